@@ -670,6 +670,10 @@ INT WINAPI _WinMain(HINSTANCE hInst, HINSTANCE, LPSTR pCMD, INT)
 
     g_dwTotalFramesPerSession = g_dwTimeOut*60/(dwNumDxAdapters*g_AppsPerAdapter);
 
+    // The stress load is spread evenly by design and does not use the GpuScheduler of
+    // DXIFRShim: NvIFR encodes the render target of the slave's D3D9 device on the
+    // adapter given with -adapter, so the session cannot live on another GPU, and
+    // the slaves are separate processes, which a scheduler in one process cannot see.
     for(DWORD a=0; a<dwNumDxAdapters; a++)
     {
         D3DADAPTER_IDENTIFIER9 Identifier;
@@ -0,0 +1,139 @@
+/*!
+ * \brief
+ * The implementation of ActivityEstimator
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+#include "ActivityEstimator.h"
+
+/* Adds the absolute differences of the row to the previous one to *pqwDifference and
+   those of neighbouring pixels to *pqwGradient, and keeps the row in pPrevious. */
+static void RowScalar(const uint8_t *pRow, uint8_t *pPrevious, int width, uint64_t *pqwDifference, uint64_t *pqwGradient)
+{
+	uint32_t difference = 0, gradient = 0;
+	for (int x = 0; x < width; x++) {
+		difference += abs(pRow[x] - pPrevious[x]);
+		if (x + 1 < width) {
+			gradient += abs(pRow[x] - pRow[x + 1]);
+		}
+		pPrevious[x] = pRow[x];
+	}
+	*pqwDifference += difference;
+	*pqwGradient += gradient;
+}
+
+static void RowSse2(const uint8_t *pRow, uint8_t *pPrevious, int width, uint64_t *pqwDifference, uint64_t *pqwGradient)
+{
+	__m128i difference = _mm_setzero_si128(), gradient = _mm_setzero_si128();
+	int x = 0;
+	// The shifted load reads one pixel past the chunk
+	for (; x + 16 < width; x += 16) {
+		__m128i cur = _mm_loadu_si128((const __m128i *)(pRow + x));
+		__m128i next = _mm_loadu_si128((const __m128i *)(pRow + x + 1));
+		__m128i prev = _mm_loadu_si128((const __m128i *)(pPrevious + x));
+		difference = _mm_add_epi64(difference, _mm_sad_epu8(cur, prev));
+		gradient = _mm_add_epi64(gradient, _mm_sad_epu8(cur, next));
+		_mm_storeu_si128((__m128i *)(pPrevious + x), cur);
+	}
+	difference = _mm_add_epi64(difference, _mm_srli_si128(difference, 8));
+	gradient = _mm_add_epi64(gradient, _mm_srli_si128(gradient, 8));
+	*pqwDifference += (uint32_t)_mm_cvtsi128_si32(difference);
+	*pqwGradient += (uint32_t)_mm_cvtsi128_si32(gradient);
+	if (x < width) {
+		RowScalar(pRow + x, pPrevious + x, width - x, pqwDifference, pqwGradient);
+	}
+}
+
+static ActivityKernel eCurrentKernel = ACTIVITY_KERNEL_SSE2;
+static void (*pfnRow)(const uint8_t *, uint8_t *, int, uint64_t *, uint64_t *) = RowSse2;
+
+// SSE2 is part of x64 and of the /arch:SSE2 default of the x86 builds
+bool ActivitySelectKernel(ActivityKernel eKernel)
+{
+	switch (eKernel) {
+	case ACTIVITY_KERNEL_SCALAR:
+		pfnRow = RowScalar;
+		break;
+	case ACTIVITY_KERNEL_SSE2:
+		pfnRow = RowSse2;
+		break;
+	default:
+		return false;
+	}
+	eCurrentKernel = eKernel;
+	return true;
+}
+
+ActivityKernel ActivityGetKernel()
+{
+	return eCurrentKernel;
+}
+
+static inline float Saturate(float v)
+{
+	return v < 1.0f ? v : 1.0f;
+}
+
+ActivityEstimator::ActivityEstimator() : width(0), height(0), bHasPrevious(false), score(0.0f)
+{
+	memset(&lastFrame, 0, sizeof(lastFrame));
+}
+
+void ActivityEstimator::Configure(int width, int height)
+{
+	this->width = width > 0 ? width : 0;
+	this->height = height > 0 ? height : 0;
+	vPrevious.assign((size_t)this->width * ((this->height + ACTIVITY_ROW_STEP - 1) / ACTIVITY_ROW_STEP), 0);
+	bHasPrevious = false;
+	score = 0.0f;
+	memset(&lastFrame, 0, sizeof(lastFrame));
+}
+
+float ActivityEstimator::Update(const uint8_t *pLuma, int pitch)
+{
+	if (!pLuma || !width || !height) {
+		return score;
+	}
+	uint64_t qwDifference = 0, qwGradient = 0;
+	uint8_t *pPrevious = vPrevious.data();
+	int nRow = 0;
+	for (int y = 0; y < height; y += ACTIVITY_ROW_STEP, nRow++) {
+		pfnRow(pLuma + (size_t)y * pitch, pPrevious + (size_t)nRow * width, width, &qwDifference, &qwGradient);
+	}
+
+	Frame frame;
+	frame.difference = bHasPrevious ? (float)qwDifference / ((float)nRow * width) : 0.0f;
+	frame.gradient = width > 1 ? (float)qwGradient / ((float)nRow * (width - 1)) : 0.0f;
+	frame.score = ACTIVITY_MOTION_SHARE * Saturate(frame.difference / ACTIVITY_FULL_DIFFERENCE)
+		+ (1.0f - ACTIVITY_MOTION_SHARE) * Saturate(frame.gradient / ACTIVITY_FULL_GRADIENT);
+	lastFrame = frame;
+
+	if (!bHasPrevious || frame.score >= score) {
+		score = frame.score;
+	} else {
+		score += ACTIVITY_DECAY * (frame.score - score);
+	}
+	bHasPrevious = true;
+	return score;
+}
+
+float ActivityEstimator::Combine(float score, int input)
+{
+	float weight = ACTIVITY_WEIGHT_FLOOR + (1.0f - ACTIVITY_WEIGHT_FLOOR) * Saturate(score > 0.0f ? score : 0.0f);
+	if (input < 0) {
+		return weight;
+	}
+	float fInput = input < ACTIVITY_INPUT_MAX ? (float)input / ACTIVITY_INPUT_MAX : 1.0f;
+	return (1.0f - ACTIVITY_INPUT_SHARE) * weight
+		+ ACTIVITY_INPUT_SHARE * (ACTIVITY_WEIGHT_FLOOR + (1.0f - ACTIVITY_WEIGHT_FLOOR) * fInput);
+}
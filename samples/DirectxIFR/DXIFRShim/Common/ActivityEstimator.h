@@ -0,0 +1,98 @@
+/*!
+ * \brief
+ * How much is going on in a player's picture, for the bandwidth allocator
+ *
+ * \file
+ *
+ * The allocator used to split the bandwidth by the digit an external
+ * process writes to test<index>.txt, which follows key presses: a cutscene
+ * nobody touches the keys in got the least. ActivityEstimator looks at the
+ * captured frames instead. Every ACTIVITY_ROW_STEP-th luma row is compared
+ * with the same row of the previous frame (mean absolute difference, the
+ * motion) and with itself shifted by a pixel (mean absolute gradient, the
+ * detail), both with PSADBW on SSE2 like Scaler. The rows are kept for the
+ * next frame. A 1080p frame takes well under 0.3 ms, which
+ * Test/ActivityEstimatorBench.cpp holds it to.
+ *
+ * The frame's score (0..1) is mostly motion, partly detail. The player's
+ * score rises with a busy frame at once, so that the bits are there when
+ * the picture needs them, and decays over a few frames. Combine() mixes
+ * the score with the input digit when the file is there.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Rows compared per frame: one in this many
+#define ACTIVITY_ROW_STEP 4
+// Mean luma difference to the previous frame that counts as all motion
+#define ACTIVITY_FULL_DIFFERENCE 8.0f
+// Mean luma gradient that counts as all detail
+#define ACTIVITY_FULL_GRADIENT 16.0f
+// Share of motion in a frame's score; the rest is detail
+#define ACTIVITY_MOTION_SHARE 0.75f
+// Weight of a calmer frame in the player's score
+#define ACTIVITY_DECAY 0.1f
+// Share of the input digit in the allocator's weight when it is known
+#define ACTIVITY_INPUT_SHARE 0.3f
+// Weight of a still player, so that it keeps some bandwidth
+#define ACTIVITY_WEIGHT_FLOOR 0.1f
+// Highest digit the input file holds
+#define ACTIVITY_INPUT_MAX 3
+
+enum ActivityKernel {
+	ACTIVITY_KERNEL_SCALAR,
+	ACTIVITY_KERNEL_SSE2,
+};
+
+// SSE2 is the default; the scalar kernel is there for comparison
+bool ActivitySelectKernel(ActivityKernel eKernel);
+ActivityKernel ActivityGetKernel();
+
+class ActivityEstimator
+{
+public:
+	struct Frame {
+		// Mean absolute luma difference to the previous frame and mean absolute horizontal gradient
+		float difference;
+		float gradient;
+		float score;
+	};
+
+	ActivityEstimator();
+
+	// Size of the luma plane; starts over
+	void Configure(int width, int height);
+	/*! Measures the frame and returns the player's score, 0..1. The first frame after
+	    Configure() has nothing to compare with and scores its detail only. */
+	float Update(const uint8_t *pLuma, int pitch);
+	float GetScore()
+	{
+		return score;
+	}
+	const Frame &GetLastFrame()
+	{
+		return lastFrame;
+	}
+
+	/*! The allocator's weight of a player with the given score and input digit;
+	    a negative digit means the input file is not there. */
+	static float Combine(float score, int input);
+
+private:
+	int width, height;
+	// The compared rows of the previous frame, back to back
+	std::vector<uint8_t> vPrevious;
+	bool bHasPrevious;
+	float score;
+	Frame lastFrame;
+};
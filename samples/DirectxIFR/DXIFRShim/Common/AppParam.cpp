@@ -24,7 +24,7 @@
 
 extern simplelogger::Logger *logger;
 
-AppParamManager::AppParamManager(const ULONGLONG *pId) : 
+AppParamManager::AppParamManager(const ULONGLONG *pId, DWORD nUserInputCapacity) : 
 hMem(NULL), pStruct(NULL), 
 	szAppParamEnv(NULL)
 {
@@ -34,7 +34,7 @@ hMem(NULL), pStruct(NULL),
 		*szAppParamEnvValueFmt = _T("GRID_AppParam_0x%llX");
 	if (pId) {
 		_stprintf_s(szMemName, sizeof(szMemName) / sizeof(szMemName[0]), szAppParamEnvValueFmt, *pId);
-		if (!CreateSharedMem(szMemName)) {
+		if (!CreateSharedMem(szMemName, nUserInputCapacity)) {
 			LOG_ERROR(logger, "Failed to create shared memory for AppParam");
 			return;
 		}
@@ -46,6 +46,9 @@ hMem(NULL), pStruct(NULL),
 		}
 		OpenSharedMem(szMemName);
 	}
+	if (pStruct && !OpenUserInputSignal(szMemName)) {
+		LOG_WARN(logger, "Failed to open user input event; the injector will fall back to polling");
+	}
 	size_t nc = _tcslen(szAppParamEnvKey) + _tcslen(szMemName) + 2;
 	szAppParamEnv = new TCHAR[nc];
 	_stprintf_s(szAppParamEnv, nc, _T("%s=%s"), szAppParamEnvKey, szMemName);
@@ -63,7 +66,7 @@ AppParamManager::~AppParamManager()
 	}
 }
 
-BOOL AppParamManager::CreateSharedMem(TCHAR *szMemName) 
+BOOL AppParamManager::CreateSharedMem(TCHAR *szMemName, DWORD nUserInputCapacity) 
 {
 	DWORD dwMemSize = sizeof(SharedMemStruct);
 	hMem = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, dwMemSize, szMemName);
@@ -78,7 +81,11 @@ BOOL AppParamManager::CreateSharedMem(TCHAR *szMemName)
 	}
 	pStruct->dwSize = dwMemSize;
 	pStruct->eAppStatus = APP_UNINITIALIZED;
-	pStruct->appParam.nUserInput = N_USER_INPUT;
+	pStruct->appParam.userInputRing.Init(nUserInputCapacity);
+	for (int i = 0; i < N_RECOVERY_PLAYER; i++) {
+		pStruct->appParam.aRecoveryRing[i].Init(N_RECOVERY_EVENT);
+		pStruct->appParam.aCongestionRing[i].Init(N_CONGESTION_REPORT);
+	}
 	return TRUE;
 }
 
@@ -123,3 +130,64 @@ BOOL AppParamManager::OpenSharedMem(TCHAR *szMemName)
 	pStruct->eAppStatus = APP_INITIALIZED;
 	return TRUE;
 }
+
+BOOL AppParamManager::OpenUserInputSignal(TCHAR *szMemName)
+{
+	TCHAR szEventName[MAX_PATH];
+	_stprintf_s(szEventName, sizeof(szEventName) / sizeof(szEventName[0]), _T("%s_UserInput"), szMemName);
+	return userInputSignal.Open(szEventName);
+}
+
+BOOL AppParamManager::PostUserInput(const UserInput &ui)
+{
+	if (!pStruct) {
+		return FALSE;
+	}
+	InputRing<UserInput, N_USER_INPUT> &ring = pStruct->appParam.userInputRing;
+	if (!ring.Push(ui, &userInputSignal)) {
+		LOG_DEBUG(logger, "User input ring is full, input dropped (sn=" << ui.sn << ", overflow=" << ring.GetOverflowCount() << ")");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+DWORD AppParamManager::WaitUserInput(UserInput *pui, DWORD nMax, DWORD dwMilliseconds)
+{
+	if (!pStruct) {
+		return 0;
+	}
+	return pStruct->appParam.userInputRing.WaitPopBatch(pui, nMax, &userInputSignal, dwMilliseconds);
+}
+
+void AppParamManager::CloseUserInput()
+{
+	if (pStruct) {
+		pStruct->appParam.userInputRing.Close(&userInputSignal);
+	}
+}
+
+BOOL AppParamManager::PostRecoveryEvent(int iPlayer, const RecoveryEvent &re)
+{
+	if (!pStruct || iPlayer < 0 || iPlayer >= N_RECOVERY_PLAYER) {
+		return FALSE;
+	}
+	// The encoder polls its ring once per frame, so no wakeup is needed
+	if (!pStruct->appParam.aRecoveryRing[iPlayer].Push(re)) {
+		LOG_DEBUG(logger, "Recovery event ring of player " << iPlayer << " is full, event dropped");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL AppParamManager::PostCongestionReport(int iPlayer, const CongestionReport &cr)
+{
+	if (!pStruct || iPlayer < 0 || iPlayer >= N_RECOVERY_PLAYER) {
+		return FALSE;
+	}
+	// A lost report only makes the estimate less precise, so a full ring just drops it
+	if (!pStruct->appParam.aCongestionRing[iPlayer].Push(cr)) {
+		LOG_DEBUG(logger, "Congestion report ring of player " << iPlayer << " is full, report dropped");
+		return FALSE;
+	}
+	return TRUE;
+}
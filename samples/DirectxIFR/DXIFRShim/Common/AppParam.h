@@ -19,8 +19,20 @@
 
 #include <tchar.h>
 #include "ControlInfo.h"
+#include "InputRing.h"
 
-#define N_USER_INPUT 16
+// Maximum capacity of the user input ring; the launcher may choose any smaller power of two
+#define N_USER_INPUT 256
+// Capacity of each player's recovery event ring
+#define N_RECOVERY_EVENT 32
+// Number of players that can receive recovery events
+#define N_RECOVERY_PLAYER 4
+// Capacity of each player's congestion report ring, two seconds of frames at 30 fps
+#define N_CONGESTION_REPORT 64
+// Maximum number of simulcast renditions besides the captured size
+#define N_RENDITION 3
+// Port distance between the renditions of a player, so that they stay clear of the other players' ports
+#define RENDITION_PORT_STRIDE 10
 
 struct AppParam
 {
@@ -47,14 +59,43 @@ struct AppParam
 	int width;
 
 	char szStreamingDest[80];
+	// Extra NVENC options in the syntax of CNvHWEncoder::ParseArguments, e.g. intra refresh, slices, VBV
+	char szEncoderOptions[256];
 
-	// Total number of slots of the ring buffer. Must be set to N_USER_INPUT upon initialization
-	DWORD nUserInput;
-	/* Absolute index of the next empty slot. 
-	   To index into aui, use the modulo value (iUserInput % nUserInput)
-	   Setting iUserInput to (DWORD)-1 signals application termination.*/
-	DWORD iUserInput;
-	UserInput aui[N_USER_INPUT];
+	// Encoder placement, a PlacementPolicy value (see Placement.h)
+	DWORD ePlacementPolicy;
+	// CPUs for the encoders; 0 means all CPUs
+	ULONGLONG qwEncoderCpuMask;
+	// CPUs for the game's render thread under PLACEMENT_ISOLATE; 0 means all CPUs not used by the encoders
+	ULONGLONG qwGameCpuMask;
+
+	// Port of the Prometheus endpoint on 127.0.0.1 (see Metrics.h); 0 disables it
+	WORD wMetricsPort;
+
+	/* Heights of the simulcast renditions every player encodes besides the captured size,
+	   largest first; the list ends at the first 0. Rendition r is streamed on the
+	   player's port + r * RENDITION_PORT_STRIDE.*/
+	WORD awRenditionHeight[N_RENDITION];
+
+	/* Library that replaces both nvEncodeAPI(64).dll and nvcuda.dll, e.g. the stub
+	   driver of NvEncStub.h; empty for the installed driver.*/
+	char szDriverLibrary[MAX_PATH];
+
+	/* The launcher encodes the players in its own process (see EncodeService.h); the
+	   shim only hands it the captured frames through a FrameRing per player.*/
+	BOOL bEncodeService;
+
+	/* Lock-free ring of user input from the launcher (producers) to the injector (consumer).
+	   Initialized by AppParamManager upon creation; closing it signals application termination.*/
+	InputRing<UserInput, N_USER_INPUT> userInputRing;
+
+	/* Per-player rings of viewer events (joins, key frame requests, loss reports)
+	   from the streaming side to the player's encoder. Initialized like userInputRing.*/
+	InputRing<RecoveryEvent, N_RECOVERY_EVENT> aRecoveryRing[N_RECOVERY_PLAYER];
+
+	/* Per-player rings of receiver feedback from the viewer's transport to the
+	   player's congestion controller. Initialized like userInputRing.*/
+	InputRing<CongestionReport, N_CONGESTION_REPORT> aCongestionRing[N_RECOVERY_PLAYER];
 
 	BOOL bForceCdeclInEnumDevicesCallback;
 };
@@ -72,7 +113,7 @@ class AppParamManager
 	};
 
 public:
-	AppParamManager(const ULONGLONG *pId = NULL);
+	AppParamManager(const ULONGLONG *pId = NULL, DWORD nUserInputCapacity = N_USER_INPUT);
 	~AppParamManager();
 	TCHAR *GetAppParamEnv()
 	{
@@ -86,11 +127,27 @@ public:
 	{
 		return pStruct->eAppStatus == APP_UNINITIALIZED;
 	}
+	// Enqueues one user input and wakes the injector if it is asleep
+	BOOL PostUserInput(const UserInput &ui);
+	// Blocks until user input arrives or dwMilliseconds elapse; returns the number of inputs dequeued
+	DWORD WaitUserInput(UserInput *pui, DWORD nMax, DWORD dwMilliseconds = INFINITE);
+	// Signals application termination to the injector
+	void CloseUserInput();
+	BOOL IsUserInputClosed()
+	{
+		return pStruct && pStruct->appParam.userInputRing.IsClosed();
+	}
+	// Asks the encoder of iPlayer for a recovery point; never blocks
+	BOOL PostRecoveryEvent(int iPlayer, const RecoveryEvent &re);
+	// Hands receiver feedback to the congestion controller of iPlayer; never blocks
+	BOOL PostCongestionReport(int iPlayer, const CongestionReport &cr);
 
 private:
-	BOOL CreateSharedMem(TCHAR *szMemName);
+	BOOL CreateSharedMem(TCHAR *szMemName, DWORD nUserInputCapacity);
 	BOOL OpenSharedMem(TCHAR *szMemName);
+	BOOL OpenUserInputSignal(TCHAR *szMemName);
 	HANDLE hMem;
+	InputRingSignal userInputSignal;
 	SharedMemStruct *pStruct;
 	TCHAR *szAppParamEnv;
 };
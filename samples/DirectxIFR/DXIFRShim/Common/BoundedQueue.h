@@ -0,0 +1,449 @@
+/*!
+ * \brief
+ * Lock-free bounded queues for handing work between pipeline threads
+ *
+ * \file
+ *
+ * SpscQueue is a ring for one producer and one consumer. Each side owns a
+ * cache line with its own index and a cached copy of the other side's, so
+ * that it only reads the other line when the cached value says the ring is
+ * full or empty. MpmcQueue takes any number of producers and consumers;
+ * like InputRing every slot carries a sequence number, and a batch claims
+ * a run of ready slots with one compare-exchange.
+ *
+ * Both hold N items in place, N a power of two, so an index is masked
+ * rather than divided and nothing is allocated. Neither ever blocks.
+ * BlockingQueue adds waiting on either of them with InputRingSignal: a
+ * side sleeps only after announcing itself, and the other side only
+ * signals when somebody is asleep.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include "InputRing.h"
+
+#define QUEUE_CACHE_LINE INPUT_RING_CACHE_LINE
+#define QUEUE_INFINITE INPUT_RING_INFINITE
+
+template <class T, uint32_t N>
+class SpscQueue
+{
+	static_assert(N && !(N & (N - 1)), "SpscQueue capacity must be a power of two");
+
+public:
+	SpscQueue()
+	{
+		Reset();
+	}
+
+	// Empties the queue; neither side may be running
+	void Reset()
+	{
+		uTail.store(0, std::memory_order_relaxed);
+		uHeadCache = 0;
+		uHead.store(0, std::memory_order_relaxed);
+		uTailCache = 0;
+	}
+
+	uint32_t GetCapacity() const
+	{
+		return N;
+	}
+
+	// Producer only. Enqueues up to n items in order and returns how many fit.
+	uint32_t PushBatch(const T *pt, uint32_t n)
+	{
+		uint32_t tail = uTail.load(std::memory_order_relaxed);
+		if (N - (tail - uHeadCache) < n) {
+			uHeadCache = uHead.load(std::memory_order_acquire);
+		}
+		uint32_t nFree = N - (tail - uHeadCache);
+		n = n < nFree ? n : nFree;
+		for (uint32_t i = 0; i < n; i++) {
+			aItem[(tail + i) & (N - 1)] = pt[i];
+		}
+		if (n) {
+			uTail.store(tail + n, std::memory_order_release);
+		}
+		return n;
+	}
+
+	bool Push(const T &t)
+	{
+		return PushBatch(&t, 1) == 1;
+	}
+
+	// Consumer only. Dequeues up to nMax items in order and returns how many there were.
+	uint32_t PopBatch(T *pt, uint32_t nMax)
+	{
+		uint32_t head = uHead.load(std::memory_order_relaxed);
+		if (uTailCache - head < nMax) {
+			uTailCache = uTail.load(std::memory_order_acquire);
+		}
+		uint32_t n = uTailCache - head;
+		n = nMax < n ? nMax : n;
+		for (uint32_t i = 0; i < n; i++) {
+			pt[i] = aItem[(head + i) & (N - 1)];
+		}
+		if (n) {
+			uHead.store(head + n, std::memory_order_release);
+		}
+		return n;
+	}
+
+	bool Pop(T &t)
+	{
+		return PopBatch(&t, 1) == 1;
+	}
+
+	// A snapshot unless both sides are idle
+	uint32_t GetSize() const
+	{
+		uint32_t n = uTail.load(std::memory_order_acquire) - uHead.load(std::memory_order_acquire);
+		return (int32_t)n < 0 ? 0 : n;
+	}
+
+	bool IsEmpty() const
+	{
+		return GetSize() == 0;
+	}
+
+private:
+	SpscQueue(const SpscQueue &);
+	SpscQueue &operator=(const SpscQueue &);
+
+	char padFront[QUEUE_CACHE_LINE];
+
+	// Producer side
+	std::atomic<uint32_t> uTail;
+	uint32_t uHeadCache;
+	char padProducer[QUEUE_CACHE_LINE - 2 * sizeof(uint32_t)];
+
+	// Consumer side
+	std::atomic<uint32_t> uHead;
+	uint32_t uTailCache;
+	char padConsumer[QUEUE_CACHE_LINE - 2 * sizeof(uint32_t)];
+
+	T aItem[N];
+};
+
+template <class T, uint32_t N>
+class MpmcQueue
+{
+	static_assert(N && !(N & (N - 1)), "MpmcQueue capacity must be a power of two");
+
+public:
+	MpmcQueue()
+	{
+		Reset();
+	}
+
+	// Empties the queue; no producer or consumer may be running
+	void Reset()
+	{
+		for (uint32_t i = 0; i < N; i++) {
+			aSlot[i].sn.store(i, std::memory_order_relaxed);
+		}
+		uTail.store(0, std::memory_order_relaxed);
+		uHead.store(0, std::memory_order_release);
+	}
+
+	uint32_t GetCapacity() const
+	{
+		return N;
+	}
+
+	/*! Enqueues up to n items and returns how many fit. A batch lands in
+	    consecutive slots, so a consumer sees its items in order. */
+	uint32_t PushBatch(const T *pt, uint32_t n)
+	{
+		uint32_t pos = uTail.load(std::memory_order_relaxed), nFree;
+		for (;;) {
+			// Count the free slots from pos on; a slot is free for pos when its sequence number is pos
+			for (nFree = 0; nFree < n; nFree++) {
+				int32_t dif = (int32_t)(aSlot[(pos + nFree) & (N - 1)].sn.load(std::memory_order_acquire) - (pos + nFree));
+				if (dif) {
+					break;
+				}
+			}
+			if (!nFree) {
+				int32_t dif = (int32_t)(aSlot[pos & (N - 1)].sn.load(std::memory_order_acquire) - pos);
+				if (dif < 0) {
+					return 0;
+				}
+				pos = uTail.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (uTail.compare_exchange_weak(pos, pos + nFree, std::memory_order_relaxed)) {
+				break;
+			}
+		}
+		for (uint32_t i = 0; i < nFree; i++) {
+			Slot &slot = aSlot[(pos + i) & (N - 1)];
+			slot.t = pt[i];
+			slot.sn.store(pos + i + 1, std::memory_order_release);
+		}
+		return nFree;
+	}
+
+	bool Push(const T &t)
+	{
+		return PushBatch(&t, 1) == 1;
+	}
+
+	// Dequeues up to nMax items that are next in the queue and returns how many there were
+	uint32_t PopBatch(T *pt, uint32_t nMax)
+	{
+		uint32_t pos = uHead.load(std::memory_order_relaxed), nReady;
+		for (;;) {
+			for (nReady = 0; nReady < nMax; nReady++) {
+				int32_t dif = (int32_t)(aSlot[(pos + nReady) & (N - 1)].sn.load(std::memory_order_acquire) - (pos + nReady + 1));
+				if (dif) {
+					break;
+				}
+			}
+			if (!nReady) {
+				int32_t dif = (int32_t)(aSlot[pos & (N - 1)].sn.load(std::memory_order_acquire) - (pos + 1));
+				if (dif < 0) {
+					return 0;
+				}
+				pos = uHead.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (uHead.compare_exchange_weak(pos, pos + nReady, std::memory_order_relaxed)) {
+				break;
+			}
+		}
+		for (uint32_t i = 0; i < nReady; i++) {
+			Slot &slot = aSlot[(pos + i) & (N - 1)];
+			pt[i] = slot.t;
+			slot.sn.store(pos + i + N, std::memory_order_release);
+		}
+		return nReady;
+	}
+
+	bool Pop(T &t)
+	{
+		return PopBatch(&t, 1) == 1;
+	}
+
+	// A snapshot; items being written or read may or may not be counted
+	uint32_t GetSize() const
+	{
+		uint32_t n = uTail.load(std::memory_order_acquire) - uHead.load(std::memory_order_acquire);
+		return (int32_t)n < 0 ? 0 : n;
+	}
+
+	bool IsEmpty() const
+	{
+		return GetSize() == 0;
+	}
+
+private:
+	MpmcQueue(const MpmcQueue &);
+	MpmcQueue &operator=(const MpmcQueue &);
+
+	struct Slot {
+		std::atomic<uint32_t> sn;
+		T t;
+	};
+
+	char padFront[QUEUE_CACHE_LINE];
+
+	// Producer side
+	std::atomic<uint32_t> uTail;
+	char padProducer[QUEUE_CACHE_LINE - sizeof(uint32_t)];
+
+	// Consumer side
+	std::atomic<uint32_t> uHead;
+	char padConsumer[QUEUE_CACHE_LINE - sizeof(uint32_t)];
+
+	Slot aSlot[N];
+};
+
+/*! Waiting push and pop on SpscQueue or MpmcQueue. With an SpscQueue, still
+    only one thread may push and one may pop. Close() wakes every waiter and
+    makes the waits return once the queue is drained. */
+template <class Queue, class T>
+class BlockingQueue
+{
+public:
+	BlockingQueue()
+	{
+		sigNotEmpty.Open(NULL);
+		sigNotFull.Open(NULL);
+		Reset();
+	}
+
+	// Empties and reopens the queue; nobody may be using it
+	void Reset()
+	{
+		q.Reset();
+		uPushSeq.store(0, std::memory_order_relaxed);
+		uPopSeq.store(0, std::memory_order_relaxed);
+		nPopSleepers.store(0, std::memory_order_relaxed);
+		nPushSleepers.store(0, std::memory_order_relaxed);
+		bClosed.store(0, std::memory_order_release);
+	}
+
+	uint32_t PushBatch(const T *pt, uint32_t n)
+	{
+		n = q.PushBatch(pt, n);
+		if (n) {
+			Wake(uPushSeq, nPopSleepers, sigNotEmpty);
+		}
+		return n;
+	}
+
+	bool Push(const T &t)
+	{
+		return PushBatch(&t, 1) == 1;
+	}
+
+	uint32_t PopBatch(T *pt, uint32_t nMax)
+	{
+		uint32_t n = q.PopBatch(pt, nMax);
+		if (n) {
+			Wake(uPopSeq, nPushSleepers, sigNotFull);
+		}
+		return n;
+	}
+
+	bool Pop(T &t)
+	{
+		return PopBatch(&t, 1) == 1;
+	}
+
+	/*! Pushes all n items, waiting for room, unless the queue is closed or
+	    dwMilliseconds elapse. Returns how many were pushed. */
+	uint32_t WaitPushBatch(const T *pt, uint32_t n, uint32_t dwMilliseconds = QUEUE_INFINITE)
+	{
+		Deadline deadline(dwMilliseconds);
+		uint32_t nPushed = 0;
+		for (;;) {
+			uint32_t seq = uPopSeq.load(std::memory_order_acquire);
+			nPushed += PushBatch(pt + nPushed, n - nPushed);
+			if (nPushed == n || IsClosed()) {
+				break;
+			}
+			uint32_t dwWait = deadline.Remaining();
+			if (!dwWait) {
+				break;
+			}
+			Block(uPopSeq, seq, nPushSleepers, sigNotFull, dwWait);
+		}
+		PassWake(uPopSeq, nPushSleepers, sigNotFull, !IsFull());
+		return nPushed;
+	}
+
+	bool WaitPush(const T &t, uint32_t dwMilliseconds = QUEUE_INFINITE)
+	{
+		return WaitPushBatch(&t, 1, dwMilliseconds) == 1;
+	}
+
+	/*! Pops up to nMax items, waiting until there is at least one, the queue
+	    is closed or dwMilliseconds elapse. Returns how many were popped. */
+	uint32_t WaitPopBatch(T *pt, uint32_t nMax, uint32_t dwMilliseconds = QUEUE_INFINITE)
+	{
+		Deadline deadline(dwMilliseconds);
+		uint32_t n;
+		for (;;) {
+			uint32_t seq = uPushSeq.load(std::memory_order_acquire);
+			n = PopBatch(pt, nMax);
+			if (n || IsClosed()) {
+				break;
+			}
+			uint32_t dwWait = deadline.Remaining();
+			if (!dwWait) {
+				break;
+			}
+			Block(uPushSeq, seq, nPopSleepers, sigNotEmpty, dwWait);
+		}
+		PassWake(uPushSeq, nPopSleepers, sigNotEmpty, !q.IsEmpty());
+		return n;
+	}
+
+	bool WaitPop(T &t, uint32_t dwMilliseconds = QUEUE_INFINITE)
+	{
+		return WaitPopBatch(&t, 1, dwMilliseconds) == 1;
+	}
+
+	void Close()
+	{
+		bClosed.store(1, std::memory_order_release);
+		Wake(uPushSeq, nPopSleepers, sigNotEmpty);
+		Wake(uPopSeq, nPushSleepers, sigNotFull);
+	}
+	bool IsClosed() const
+	{
+		return bClosed.load(std::memory_order_acquire) != 0;
+	}
+
+	uint32_t GetSize() const
+	{
+		return q.GetSize();
+	}
+	bool IsFull() const
+	{
+		return q.GetSize() >= q.GetCapacity();
+	}
+
+private:
+	struct Deadline {
+		Deadline(uint32_t dwMilliseconds) : dwMilliseconds(dwMilliseconds), tpStart(std::chrono::steady_clock::now()) {}
+		uint32_t Remaining() const
+		{
+			if (dwMilliseconds == QUEUE_INFINITE) {
+				return QUEUE_INFINITE;
+			}
+			uint64_t dwElapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tpStart).count();
+			return dwElapsed >= dwMilliseconds ? 0 : dwMilliseconds - (uint32_t)dwElapsed;
+		}
+		uint32_t dwMilliseconds;
+		std::chrono::steady_clock::time_point tpStart;
+	};
+
+	void Wake(std::atomic<uint32_t> &uSeq, std::atomic<uint32_t> &nSleepers, InputRingSignal &sig)
+	{
+		uSeq.fetch_add(1, std::memory_order_seq_cst);
+		if (nSleepers.load(std::memory_order_seq_cst)) {
+			sig.Notify(&uSeq);
+		}
+	}
+
+	void Block(std::atomic<uint32_t> &uSeq, uint32_t seq, std::atomic<uint32_t> &nSleepers, InputRingSignal &sig, uint32_t dwMilliseconds)
+	{
+		nSleepers.fetch_add(1, std::memory_order_seq_cst);
+		if (uSeq.load(std::memory_order_seq_cst) == seq) {
+			sig.Wait(&uSeq, seq, dwMilliseconds);
+		}
+		nSleepers.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	/* The Windows event wakes one sleeper per signal. A waiter that leaves while
+	   there is still work (or the queue is closed) passes the wakeup on.*/
+	void PassWake(std::atomic<uint32_t> &uSeq, std::atomic<uint32_t> &nSleepers, InputRingSignal &sig, bool bMore)
+	{
+		if ((bMore || IsClosed()) && nSleepers.load(std::memory_order_seq_cst)) {
+			sig.Notify(&uSeq);
+		}
+	}
+
+	Queue q;
+	std::atomic<uint32_t> uPushSeq;
+	std::atomic<uint32_t> uPopSeq;
+	std::atomic<uint32_t> nPopSleepers;
+	std::atomic<uint32_t> nPushSleepers;
+	std::atomic<uint32_t> bClosed;
+	InputRingSignal sigNotEmpty;
+	InputRingSignal sigNotFull;
+};
@@ -0,0 +1,157 @@
+/*!
+ * \brief
+ * The implementation of BufferPool
+ *
+ * \file
+ *
+ * A free host frame is only handed out for a request of at least half its
+ * size, so that a small rendition never pins down a full-size frame.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <string.h>
+#include <new>
+#include "BufferPool.h"
+#include "Metrics.h"
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+static const char *aszKind[] = {"input surface", "bitstream buffer", "host frame"};
+
+BufferPool::BufferPool()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+BufferPool *BufferPool::GetShared()
+{
+	static std::once_flag once;
+	static BufferPool *pPool = NULL;
+	std::call_once(once, [] { pPool = new BufferPool(); });
+	return pPool;
+}
+
+void BufferPool::Add(const void *p, const Entry &entry)
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		mpOwned[p] = entry;
+		stats.anBuffer[entry.eKind]++;
+		stats.aqwBytes[entry.eKind] += entry.cb;
+	}
+	Metrics::GetShared()->GetPlayer(entry.iPlayer, entry.iRendition)->pBufferBytes->Add((int64_t)entry.cb);
+}
+
+bool BufferPool::Remove(const void *p, Entry *pEntry)
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		std::map<const void *, Entry>::iterator it = mpOwned.find(p);
+		if (it == mpOwned.end()) {
+			return false;
+		}
+		*pEntry = it->second;
+		mpOwned.erase(it);
+		stats.anBuffer[pEntry->eKind]--;
+		stats.aqwBytes[pEntry->eKind] -= pEntry->cb;
+	}
+	Metrics::GetShared()->GetPlayer(pEntry->iPlayer, pEntry->iRendition)->pBufferBytes->Add(-(int64_t)pEntry->cb);
+	return true;
+}
+
+uint8_t *BufferPool::AcquireHost(size_t cb, int iPlayer, int iRendition)
+{
+	Entry entry = {BUFFER_HOST_FRAME, cb, iPlayer, iRendition};
+	uint8_t *p = NULL;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		std::multimap<size_t, uint8_t *>::iterator it = mpFree.lower_bound(cb);
+		if (it != mpFree.end() && it->first / 2 <= cb) {
+			entry.cb = it->first;
+			p = it->second;
+			mpFree.erase(it);
+			stats.qwFreeBytes -= entry.cb;
+			stats.nReuse++;
+		}
+	}
+	if (!p) {
+		p = new(std::nothrow) uint8_t[cb];
+		if (!p) {
+			LOG_ERROR(logger, "Out of memory for a " << cb << " byte frame of player " << iPlayer);
+			return NULL;
+		}
+		std::lock_guard<std::mutex> lock(mtx);
+		stats.nAllocate++;
+	}
+	Add(p, entry);
+	return p;
+}
+
+void BufferPool::ReleaseHost(uint8_t *p)
+{
+	Entry entry;
+	if (!p) {
+		return;
+	}
+	if (!Remove(p, &entry) || entry.eKind != BUFFER_HOST_FRAME) {
+		LOG_ERROR(logger, "Host frame " << (void *)p << " was not acquired from the pool");
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mtx);
+	mpFree.insert(std::make_pair(entry.cb, p));
+	stats.qwFreeBytes += entry.cb;
+}
+
+void BufferPool::Track(const void *p, BufferKind eKind, size_t cb, int iPlayer, int iRendition)
+{
+	if (!p) {
+		return;
+	}
+	Entry entry = {eKind, cb, iPlayer, iRendition};
+	Add(p, entry);
+}
+
+void BufferPool::Untrack(const void *p)
+{
+	Entry entry;
+	if (p && !Remove(p, &entry)) {
+		LOG_WARN(logger, "Buffer " << p << " released without being tracked");
+	}
+}
+
+int BufferPool::CheckReleased(int iPlayer, int iRendition)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	int nOwned = 0;
+	for (std::map<const void *, Entry>::iterator it = mpOwned.begin(); it != mpOwned.end(); ++it) {
+		const Entry &entry = it->second;
+		if (entry.iPlayer == iPlayer && entry.iRendition == iRendition) {
+			LOG_ERROR(logger, "Player " << iPlayer << ", rendition " << iRendition << " still owns "
+				<< aszKind[entry.eKind] << " " << it->first << " of " << entry.cb << " bytes");
+			nOwned++;
+		}
+	}
+	return nOwned;
+}
+
+void BufferPool::Trim()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	for (std::multimap<size_t, uint8_t *>::iterator it = mpFree.begin(); it != mpFree.end(); ++it) {
+		delete[] it->second;
+	}
+	mpFree.clear();
+	stats.qwFreeBytes = 0;
+}
+
+BufferPool::Stats BufferPool::GetStats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return stats;
+}
@@ -0,0 +1,91 @@
+/*!
+ * \brief
+ * Process-wide pool of frame buffers and ledger of every encoder buffer
+ *
+ * \file
+ *
+ * Each buffer an encoder holds is recorded with its owner, the player and
+ * rendition: the NVENC input surfaces and bitstream buffers, which the
+ * driver allocates per session, and the host frame copies handed out here.
+ * The owned bytes show up as dxifr_buffer_bytes, and an encoder that shuts
+ * down checks that it released everything.
+ *
+ * Host frames released by one owner are reused by the next one that asks
+ * for a frame of about the same size, e.g. when a swap chain is resized or
+ * a player rejoins, until Trim() frees them.
+ *
+ * Like TaskPool, the shared pool is never destroyed.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+
+enum BufferKind {
+	// NVENC input surface, in system memory the driver maps
+	BUFFER_INPUT_SURFACE,
+	// NVENC bitstream or motion vector buffer
+	BUFFER_BITSTREAM,
+	// Frame copy from the pool, e.g. a rendition's scaled frame
+	BUFFER_HOST_FRAME,
+	N_BUFFER_KIND,
+};
+
+class BufferPool
+{
+public:
+	struct Stats {
+		// Buffers and bytes owned now
+		int anBuffer[N_BUFFER_KIND];
+		uint64_t aqwBytes[N_BUFFER_KIND];
+		// Host frames taken from the free list and those newly allocated
+		unsigned int nReuse;
+		unsigned int nAllocate;
+		// Bytes of host frames waiting in the free list
+		uint64_t qwFreeBytes;
+	};
+
+	static BufferPool *GetShared();
+
+	// A host frame of at least cb bytes; NULL when out of memory
+	uint8_t *AcquireHost(size_t cb, int iPlayer, int iRendition = 0);
+	void ReleaseHost(uint8_t *p);
+
+	// Accounts for a buffer allocated elsewhere, e.g. by NVENC
+	void Track(const void *p, BufferKind eKind, size_t cb, int iPlayer, int iRendition = 0);
+	void Untrack(const void *p);
+
+	// Logs the buffers the player's rendition still owns and returns how many there are
+	int CheckReleased(int iPlayer, int iRendition = 0);
+	// Frees the host frames in the free list
+	void Trim();
+
+	Stats GetStats();
+
+private:
+	struct Entry {
+		BufferKind eKind;
+		size_t cb;
+		int iPlayer;
+		int iRendition;
+	};
+
+	BufferPool();
+	void Add(const void *p, const Entry &entry);
+	bool Remove(const void *p, Entry *pEntry);
+
+	std::mutex mtx;
+	std::map<const void *, Entry> mpOwned;
+	// Idle host frames by size
+	std::multimap<size_t, uint8_t *> mpFree;
+	Stats stats;
+};
@@ -0,0 +1,322 @@
+/*!
+ * \brief
+ * The implementation of CongestionControl and BitrateSmoother
+ *
+ * \file
+ *
+ * The delay based estimator follows the trendline filter, overuse detector
+ * and AIMD rate controller of Google Congestion Control, with frames in
+ * place of packet groups.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "CongestionControl.h"
+
+// Reports the trendline is fitted over
+#define TRENDLINE_WINDOW 20
+#define TRENDLINE_GAIN 4.0
+#define SMOOTHING_COEFF 0.9
+// Adaptive threshold, in ms
+#define THRESHOLD_INITIAL 12.5
+#define THRESHOLD_MIN 6.0
+#define THRESHOLD_MAX 600.0
+#define THRESHOLD_K_UP 0.0087
+#define THRESHOLD_K_DOWN 0.039
+// How long the trend must stay above the threshold, in ms
+#define OVERUSE_TIME 10.0
+#define DECREASE_FACTOR 0.85
+// Decreases are spaced so that the previous one can take effect first
+#define MIN_DECREASE_INTERVAL 200
+#define RECEIVE_RATE_WINDOW_US 500000
+
+static inline bool IsAfter(DWORD dwFrameA, DWORD dwFrameB)
+{
+	return (LONG)(dwFrameA - dwFrameB) > 0;
+}
+
+static inline double Clamp(double v, double lo, double hi)
+{
+	return v < lo ? lo : (v > hi ? hi : v);
+}
+
+CongestionControl::CongestionControl(DWORD dwStartBitrate, DWORD dwMinBitrate, DWORD dwMaxBitrate, DWORD msFeedbackTimeout) :
+	dwMinBitrate(dwMinBitrate), dwMaxBitrate(dwMaxBitrate), msFeedbackTimeout(msFeedbackTimeout),
+	bFeedbackSeen(false), dwLastReportTime(0), bHaveLast(false), arrivalMs(0),
+	accumulatedDelay(0), smoothedDelay(0), nDelta(0), prevTrend(0), trend(0), threshold(THRESHOLD_INITIAL),
+	dwLastThresholdUpdate(0), msOveruse(-1), nOveruseReport(0), eHypothesis(SIGNAL_NORMAL),
+	eRateState(RATE_INCREASE), delayEstimate(dwStartBitrate), dwLastRateUpdate(0), dwLastDecrease(0),
+	avgMaxRate(-1), varMaxRate(0.4),
+	lossEstimate(dwStartBitrate), dwLastLossUpdate(0), nLossLost(0), nLossExpected(0), lossRatio(0),
+	qwReceivedInWindow(0), receiveRate(0)
+{
+	memset(&crLast, 0, sizeof(crLast));
+	memset(&stats, 0, sizeof(stats));
+}
+
+void CongestionControl::OnReport(const CongestionReport &cr, DWORD dwNow)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	stats.nReport++;
+	if (!bFeedbackSeen) {
+		bFeedbackSeen = true;
+		dwLastRateUpdate = dwLastLossUpdate = dwLastThresholdUpdate = dwNow;
+	}
+	dwLastReportTime = dwNow;
+	if (bHaveLast && !IsAfter(cr.dwFrame, crLast.dwFrame)) {
+		stats.nStaleReport++;
+		return;
+	}
+
+	UpdateReceiveRate(cr);
+	UpdateLossBased(cr, dwNow);
+
+	OveruseSignal eSignal = SIGNAL_NORMAL;
+	if (bHaveLast) {
+		double sendDeltaMs = (LONG)(cr.dwSendUs - crLast.dwSendUs) / 1000.0;
+		double arrivalDeltaMs = (LONG)(cr.dwArrivalUs - crLast.dwArrivalUs) / 1000.0;
+		arrivalMs += arrivalDeltaMs;
+		eSignal = DetectDelay(arrivalDeltaMs - sendDeltaMs, sendDeltaMs, arrivalMs, dwNow);
+	}
+	UpdateDelayBased(eSignal, dwNow);
+
+	crLast = cr;
+	bHaveLast = true;
+}
+
+CongestionControl::OveruseSignal CongestionControl::DetectDelay(double deltaMs, double sendDeltaMs, double arrivalMs, DWORD dwNow)
+{
+	accumulatedDelay += deltaMs;
+	smoothedDelay = SMOOTHING_COEFF * smoothedDelay + (1 - SMOOTHING_COEFF) * accumulatedDelay;
+	dqDelay.push_back(std::make_pair(arrivalMs, smoothedDelay));
+	if (dqDelay.size() > TRENDLINE_WINDOW) {
+		dqDelay.pop_front();
+	}
+	if (nDelta < 60) {
+		nDelta++;
+	}
+	if (dqDelay.size() < TRENDLINE_WINDOW) {
+		return eHypothesis;
+	}
+
+	// Least squares slope of the smoothed delay over the arrival time
+	double xMean = 0, yMean = 0;
+	for (size_t i = 0; i < dqDelay.size(); i++) {
+		xMean += dqDelay[i].first;
+		yMean += dqDelay[i].second;
+	}
+	xMean /= dqDelay.size();
+	yMean /= dqDelay.size();
+	double num = 0, den = 0;
+	for (size_t i = 0; i < dqDelay.size(); i++) {
+		num += (dqDelay[i].first - xMean) * (dqDelay[i].second - yMean);
+		den += (dqDelay[i].first - xMean) * (dqDelay[i].first - xMean);
+	}
+	double slope = den > 0 ? num / den : 0;
+	trend = slope * nDelta * TRENDLINE_GAIN;
+
+	// The threshold follows the trend, so that a competing flow does not starve this one
+	double absTrend = fabs(trend);
+	if (absTrend <= threshold + 15) {
+		double dt = (double)(dwNow - dwLastThresholdUpdate);
+		double k = absTrend < threshold ? THRESHOLD_K_DOWN : THRESHOLD_K_UP;
+		threshold = Clamp(threshold + k * (absTrend - threshold) * (dt < 100 ? dt : 100), THRESHOLD_MIN, THRESHOLD_MAX);
+	}
+	dwLastThresholdUpdate = dwNow;
+
+	if (trend > threshold) {
+		msOveruse = msOveruse < 0 ? sendDeltaMs / 2 : msOveruse + sendDeltaMs;
+		nOveruseReport++;
+		if (msOveruse > OVERUSE_TIME && nOveruseReport > 1 && trend >= prevTrend) {
+			msOveruse = 0;
+			nOveruseReport = 0;
+			eHypothesis = SIGNAL_OVERUSE;
+		}
+	} else {
+		msOveruse = -1;
+		nOveruseReport = 0;
+		eHypothesis = trend < -threshold ? SIGNAL_UNDERUSE : SIGNAL_NORMAL;
+	}
+	prevTrend = trend;
+	return eHypothesis;
+}
+
+void CongestionControl::UpdateDelayBased(OveruseSignal eSignal, DWORD dwNow)
+{
+	switch (eSignal) {
+	case SIGNAL_OVERUSE:
+		eRateState = RATE_DECREASE;
+		break;
+	case SIGNAL_UNDERUSE:
+		// The queues are draining; wait for them before probing again
+		eRateState = RATE_HOLD;
+		break;
+	case SIGNAL_NORMAL:
+		if (eRateState != RATE_INCREASE) {
+			eRateState = eRateState == RATE_HOLD ? RATE_INCREASE : RATE_HOLD;
+		}
+		break;
+	}
+
+	double dt = (double)(dwNow - dwLastRateUpdate);
+	dt = dt < 1000 ? dt : 1000;
+	dwLastRateUpdate = dwNow;
+	double receiveKbps = receiveRate / 1000;
+	double stdMaxRate = sqrt(varMaxRate * (avgMaxRate > 1 ? avgMaxRate : 1));
+
+	if (eRateState == RATE_DECREASE) {
+		if (dwNow - dwLastDecrease >= MIN_DECREASE_INTERVAL) {
+			double newEstimate = DECREASE_FACTOR * (receiveRate > 0 ? receiveRate : delayEstimate);
+			delayEstimate = newEstimate < delayEstimate ? newEstimate : delayEstimate;
+			if (avgMaxRate >= 0 && receiveKbps < avgMaxRate - 3 * stdMaxRate) {
+				avgMaxRate = -1;
+			}
+			if (receiveKbps > 0) {
+				if (avgMaxRate < 0) {
+					avgMaxRate = receiveKbps;
+				} else {
+					avgMaxRate = 0.95 * avgMaxRate + 0.05 * receiveKbps;
+				}
+				double norm = avgMaxRate > 1 ? avgMaxRate : 1;
+				varMaxRate = Clamp(0.95 * varMaxRate + 0.05 * (avgMaxRate - receiveKbps) * (avgMaxRate - receiveKbps) / norm, 0.4, 2.5);
+			}
+			dwLastDecrease = dwNow;
+			stats.nOveruse++;
+		}
+		eRateState = RATE_HOLD;
+	} else if (eRateState == RATE_INCREASE) {
+		if (avgMaxRate >= 0 && receiveKbps > avgMaxRate + 3 * stdMaxRate) {
+			// Well above the last known capacity: the path has changed
+			avgMaxRate = -1;
+		}
+		if (avgMaxRate >= 0) {
+			// Near capacity, probe with about one packet per 100 ms
+			delayEstimate += 1200 * 8 * 10 * dt / 1000;
+		} else {
+			delayEstimate *= pow(1.08, dt / 1000);
+		}
+	}
+
+	// Do not grow far beyond what is actually sent; an idle stream proves nothing
+	if (receiveRate > 0 && delayEstimate > 1.5 * receiveRate + 10000) {
+		delayEstimate = 1.5 * receiveRate + 10000;
+	}
+	delayEstimate = Clamp(delayEstimate, dwMinBitrate, dwMaxBitrate);
+}
+
+void CongestionControl::UpdateLossBased(const CongestionReport &cr, DWORD dwNow)
+{
+	nLossLost += cr.nPacketLost;
+	nLossExpected += cr.nPacketExpected;
+	if (dwNow - dwLastLossUpdate < 200 || nLossExpected < 10) {
+		return;
+	}
+	lossRatio = (double)nLossLost / nLossExpected;
+	if (lossRatio > 0.1) {
+		double base = lossEstimate < delayEstimate ? lossEstimate : delayEstimate;
+		lossEstimate = base * (1 - 0.5 * lossRatio);
+		stats.nLossDecrease++;
+	} else if (lossRatio < 0.02) {
+		lossEstimate *= 1.05;
+		if (receiveRate > 0 && lossEstimate > 1.5 * receiveRate + 10000) {
+			lossEstimate = 1.5 * receiveRate + 10000;
+		}
+	}
+	lossEstimate = Clamp(lossEstimate, dwMinBitrate, dwMaxBitrate);
+	nLossLost = nLossExpected = 0;
+	dwLastLossUpdate = dwNow;
+}
+
+void CongestionControl::UpdateReceiveRate(const CongestionReport &cr)
+{
+	dqReceived.push_back(std::make_pair(cr.dwArrivalUs, cr.cbReceived));
+	qwReceivedInWindow += cr.cbReceived;
+	while ((LONG)(cr.dwArrivalUs - dqReceived.front().first) > RECEIVE_RATE_WINDOW_US) {
+		qwReceivedInWindow -= dqReceived.front().second;
+		dqReceived.pop_front();
+	}
+	// The bytes of the oldest frame arrived before the window starts
+	DWORD usSpan = cr.dwArrivalUs - dqReceived.front().first;
+	if (usSpan >= RECEIVE_RATE_WINDOW_US / 2) {
+		receiveRate = (qwReceivedInWindow - dqReceived.front().second) * 8 * 1000000.0 / usSpan;
+	}
+}
+
+void CongestionControl::OnTick(DWORD dwNow)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!bFeedbackSeen || dwNow - dwLastReportTime < msFeedbackTimeout) {
+		return;
+	}
+	delayEstimate = Clamp(delayEstimate / 2, dwMinBitrate, dwMaxBitrate);
+	lossEstimate = lossEstimate < delayEstimate ? lossEstimate : delayEstimate;
+	stats.nFeedbackTimeout++;
+	// Halve once per timeout, and start the delay measurement over once feedback is back
+	dwLastReportTime = dwNow;
+	bHaveLast = false;
+	dqReceived.clear();
+	qwReceivedInWindow = 0;
+	receiveRate = 0;
+}
+
+DWORD CongestionControl::GetEstimate()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!bFeedbackSeen) {
+		return dwMaxBitrate;
+	}
+	return (DWORD)(delayEstimate < lossEstimate ? delayEstimate : lossEstimate);
+}
+
+double CongestionControl::GetLossRatio()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return lossRatio;
+}
+
+CongestionControl::Stats CongestionControl::TakeStats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	Stats ret = stats;
+	memset(&stats, 0, sizeof(stats));
+	ret.dwEstimate = bFeedbackSeen ? (DWORD)(delayEstimate < lossEstimate ? delayEstimate : lossEstimate) : dwMaxBitrate;
+	ret.dwReceiveRate = (DWORD)receiveRate;
+	ret.lossRatio = lossRatio;
+	ret.trend = trend;
+	ret.threshold = threshold;
+	return ret;
+}
+
+BitrateSmoother::BitrateSmoother(DWORD dwStartBitrate, DWORD msMinInterval, double minChange, double maxIncreasePerSecond) :
+	dwBitrate(dwStartBitrate), msMinInterval(msMinInterval), minChange(minChange),
+	maxIncreasePerSecond(maxIncreasePerSecond), dwLastChange(0), nReconfigure(0)
+{
+}
+
+bool BitrateSmoother::Update(DWORD dwTarget, DWORD dwNow, DWORD *pdwBitrate)
+{
+	*pdwBitrate = dwBitrate;
+	if (dwTarget < dwBitrate) {
+		if (dwTarget >= dwBitrate * (1 - minChange)) {
+			return false;
+		}
+		dwBitrate = dwTarget;
+	} else {
+		DWORD msElapsed = dwNow - dwLastChange;
+		if (dwTarget <= dwBitrate * (1 + minChange) || msElapsed < msMinInterval) {
+			return false;
+		}
+		double maxBitrate = dwBitrate * (1 + maxIncreasePerSecond * (msElapsed < 1000 ? msElapsed : 1000) / 1000);
+		dwBitrate = dwTarget < maxBitrate ? dwTarget : (DWORD)maxBitrate;
+	}
+	dwLastChange = dwNow;
+	nReconfigure++;
+	*pdwBitrate = dwBitrate;
+	return true;
+}
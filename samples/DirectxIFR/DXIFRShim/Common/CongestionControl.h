@@ -0,0 +1,170 @@
+/*!
+ * \brief
+ * Sender-side congestion control for one viewer stream, and the smoothing
+ * layer between its estimate and the encoder's bitrate
+ *
+ * \file
+ *
+ * The receiver reports, for every frame it got, when the frame was sent
+ * (the sender timestamp carried by the transport, echoed back) and when its
+ * last byte arrived, together with the packet loss it saw. The transport
+ * (RTCP feedback or an HTTP back channel) only has to fill CongestionReport
+ * and post it to the player's AppParam ring.
+ *
+ * Two estimates are kept and the lower one wins:
+ *
+ *  - delay based: the growth of the one-way delay between consecutive
+ *    frames is accumulated, smoothed and fitted with a trendline. A rising
+ *    trend above an adaptive threshold means a queue is building up on the
+ *    path (overuse), so the rate drops to 85% of what actually arrived.
+ *    Otherwise the rate grows by 8% per second, or additively once it is
+ *    close to the rate of the last overuse;
+ *  - loss based: more than 10% loss cuts the rate by half the loss ratio,
+ *    less than 2% lets it grow by 5% per update.
+ *
+ * Without feedback for msFeedbackTimeout the estimate is halved, since the
+ * feedback itself may be what the congestion is dropping.
+ *
+ * Times on the receiver's clock are only ever subtracted from each other,
+ * so the two clocks do not need to be synchronized.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include "ControlInfo.h"
+
+class CongestionControl
+{
+public:
+	struct Stats {
+		unsigned int nReport;
+		// Reports out of order or from before the last one, ignored
+		unsigned int nStaleReport;
+		// Bitrate decreases caused by a rising delay, by loss and by missing feedback
+		unsigned int nOveruse;
+		unsigned int nLossDecrease;
+		unsigned int nFeedbackTimeout;
+		// Current state, not reset by TakeStats()
+		DWORD dwEstimate;
+		DWORD dwReceiveRate;
+		double lossRatio;
+		// Modified delay trend and the threshold it is compared with, in ms
+		double trend;
+		double threshold;
+	};
+
+	CongestionControl(DWORD dwStartBitrate, DWORD dwMinBitrate = 100000, DWORD dwMaxBitrate = 20000000,
+		DWORD msFeedbackTimeout = 1000);
+
+	// Thread safe; dwNow is the sender's time in ms (timeGetTime())
+	void OnReport(const CongestionReport &cr, DWORD dwNow);
+	// Called once per frame to notice missing feedback
+	void OnTick(DWORD dwNow);
+	// The rate the path to the viewer can carry, in bits per second; dwMaxBitrate before any feedback
+	DWORD GetEstimate();
+	// Packet loss ratio of the last loss interval, as reported by the viewer
+	double GetLossRatio();
+
+	Stats TakeStats();
+
+private:
+	enum OveruseSignal {
+		SIGNAL_NORMAL,
+		SIGNAL_OVERUSE,
+		SIGNAL_UNDERUSE,
+	};
+	enum RateState {
+		RATE_HOLD,
+		RATE_INCREASE,
+		RATE_DECREASE,
+	};
+
+	OveruseSignal DetectDelay(double deltaMs, double sendDeltaMs, double arrivalMs, DWORD dwNow);
+	void UpdateDelayBased(OveruseSignal eSignal, DWORD dwNow);
+	void UpdateLossBased(const CongestionReport &cr, DWORD dwNow);
+	void UpdateReceiveRate(const CongestionReport &cr);
+
+	std::mutex mtx;
+	DWORD dwMinBitrate, dwMaxBitrate;
+	DWORD msFeedbackTimeout;
+
+	// No cap until the viewer's transport sends feedback at all
+	bool bFeedbackSeen;
+	DWORD dwLastReportTime;
+	// Previous report, the base of the next delay delta
+	bool bHaveLast;
+	CongestionReport crLast;
+	// Arrival time of the previous report, in ms since the first one
+	double arrivalMs;
+
+	// Trendline over the smoothed accumulated delay, (arrival ms, delay ms)
+	double accumulatedDelay, smoothedDelay;
+	std::deque<std::pair<double, double> > dqDelay;
+	unsigned int nDelta;
+	double prevTrend;
+	double trend, threshold;
+	DWORD dwLastThresholdUpdate;
+	// Overuse must persist before it counts
+	double msOveruse;
+	unsigned int nOveruseReport;
+	OveruseSignal eHypothesis;
+
+	RateState eRateState;
+	double delayEstimate;
+	DWORD dwLastRateUpdate;
+	DWORD dwLastDecrease;
+	// Average and variance of the rate received at overuse, which is near the path capacity
+	double avgMaxRate, varMaxRate;
+
+	double lossEstimate;
+	DWORD dwLastLossUpdate;
+	unsigned int nLossLost, nLossExpected;
+	double lossRatio;
+
+	// Bytes received in the last 500 ms, (arrival us, bytes)
+	std::deque<std::pair<DWORD, DWORD> > dqReceived;
+	ULONGLONG qwReceivedInWindow;
+	double receiveRate;
+
+	Stats stats;
+};
+
+/*!
+ * Turns the allocator's target into the bitrates actually given to
+ * NvEncReconfigureEncoder. Every reconfiguration costs a rate control
+ * restart, so small changes are ignored and increases are ramped and spaced
+ * msMinInterval apart. Decreases are applied at once: the path is already
+ * congested.
+ */
+class BitrateSmoother
+{
+public:
+	BitrateSmoother(DWORD dwStartBitrate, DWORD msMinInterval = 250, double minChange = 0.05, double maxIncreasePerSecond = 0.25);
+
+	// Returns true if the encoder must be reconfigured to *pdwBitrate
+	bool Update(DWORD dwTarget, DWORD dwNow, DWORD *pdwBitrate);
+	DWORD GetBitrate()
+	{
+		return dwBitrate;
+	}
+	unsigned int GetReconfigureCount()
+	{
+		return nReconfigure;
+	}
+
+private:
+	DWORD dwBitrate;
+	DWORD msMinInterval;
+	double minChange;
+	double maxIncreasePerSecond;
+	DWORD dwLastChange;
+	unsigned int nReconfigure;
+};
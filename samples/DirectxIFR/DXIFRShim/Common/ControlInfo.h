@@ -62,18 +62,49 @@ struct UserInput {
 		ar & joy.lRx;
 		ar & joy.lRy;
 		ar & joy.lRz;
-		for (int i = 0; i < sizeof(joy.rglSlider) / sizeof(joy.rglSlider[0]); i++) {
+		for (size_t i = 0; i < sizeof(joy.rglSlider) / sizeof(joy.rglSlider[0]); i++) {
 			ar & joy.rglSlider[i];
 		}
-		for (int i = 0; i < sizeof(joy.rgdwPOV) / sizeof(joy.rgdwPOV[0]); i++) {
+		for (size_t i = 0; i < sizeof(joy.rgdwPOV) / sizeof(joy.rgdwPOV[0]); i++) {
 			ar & joy.rgdwPOV[i];
 		}
-		for (int i = 0; i < sizeof(joy.rgbButtons) / sizeof(joy.rgbButtons[0]); i++) {
+		for (size_t i = 0; i < sizeof(joy.rgbButtons) / sizeof(joy.rgbButtons[0]); i++) {
 			ar & joy.rgbButtons[i];
 		}
 	}
 };
 
+enum RecoveryEventType {
+	RE_VIEWER_JOIN, RE_KEYFRAME_REQUEST, RE_FRAME_LOSS,
+	// The viewer moves to another simulcast rendition and waits for its next IDR
+	RE_RENDITION_SWITCH
+};
+
+// A viewer event that needs a recovery point from the player's encoder
+struct RecoveryEvent {
+	RecoveryEventType type;
+	// The stream the event is about: 0 is the captured size, r > 0 the simulcast rendition r
+	// (for RE_RENDITION_SWITCH, the rendition switched to)
+	DWORD dwRendition;
+	// RE_FRAME_LOSS only: the lost range of encoder frame numbers, inclusive
+	DWORD dwFirstFrame;
+	DWORD dwLastFrame;
+};
+
+// Receiver feedback for one frame of a viewer stream, see CongestionControl
+struct CongestionReport {
+	// Encoder frame number
+	DWORD dwFrame;
+	// Sender timestamp of the frame echoed by the receiver, in us
+	DWORD dwSendUs;
+	// Arrival of the frame's last byte on the receiver's clock, in us
+	DWORD dwArrivalUs;
+	DWORD cbReceived;
+	// Packets of the frame lost and expected
+	WORD nPacketLost;
+	WORD nPacketExpected;
+};
+
 struct ControlInfo {
 	ControlInfoType type;
 
@@ -0,0 +1,499 @@
+/*!
+ * \brief
+ * Compact, versioned binary wire format for ControlInfo and UserInput
+ *
+ * \file
+ *
+ * The Archive based serialize() methods in ControlInfo.h write every field
+ * of every event, including the 32-byte button array. This encoding keeps
+ * the structs unchanged but sends only what differs from the previous event
+ * of the same datagram:
+ *
+ *   header     'G' 'I' version kind count(uint16 LE)
+ *   event      mask(varint) sn(zigzag delta) [fields selected by mask]
+ *
+ * Rectangles and joystick axes are zigzag deltas, mouse message lParam is
+ * sent as a delta of its signed x/y halves, and buttons are a 32-bit set
+ * whenever every button is either 0 or 0x80 (raw bytes otherwise). The delta
+ * state starts from all zero in every datagram, so a lost datagram never
+ * corrupts the next one. Decoding reads the receive buffer in place and
+ * writes straight into the destination struct; nothing is allocated.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <string.h>
+#include "ControlInfo.h"
+
+#define CONTROL_INFO_WIRE_VERSION 1
+#define CONTROL_INFO_WIRE_HEADER_SIZE 6
+// Upper bound of one encoded UserInput, used to size the scratch buffer
+#define CONTROL_INFO_WIRE_MAX_EVENT_SIZE 256
+// Fits a batch into one UDP datagram without IP fragmentation
+#define CONTROL_INFO_WIRE_DATAGRAM_SIZE 1200
+
+enum ControlInfoWireKind {
+	WIRE_USER_INPUT_BATCH = 1,
+	WIRE_CONTROL_INFO = 2,
+};
+
+namespace controlinfowire {
+
+enum FieldMask {
+	F_TYPE = 1 << 0,
+	F_RC_WINDOW = 1 << 1,
+	F_RC_CLIENT = 1 << 2,
+	F_WM_MSG = 1 << 3,
+	F_WM_WPARAM = 1 << 4,
+	F_WM_LPARAM = 1 << 5,
+	F_WM_MOUSE_DELTA = 1 << 6,
+	F_JOY_AXES = 1 << 7,
+	F_JOY_BUTTON_BITS = 1 << 8,
+	F_JOY_BUTTON_RAW = 1 << 9,
+};
+
+// lX .. lRz, rglSlider[2], rgdwPOV[4], in this order
+#define CONTROL_INFO_WIRE_N_AXES 12
+
+inline DWORD *JoyAxis(UserInput &ui, int i)
+{
+	if (i < 6) {
+		return (DWORD *)(&ui.joy.lX + i);
+	}
+	if (i < 8) {
+		return (DWORD *)&ui.joy.rglSlider[i - 6];
+	}
+	return &ui.joy.rgdwPOV[i - 8];
+}
+
+inline DWORD JoyAxis(const UserInput &ui, int i)
+{
+	return *JoyAxis(const_cast<UserInput &>(ui), i);
+}
+
+// Differences are taken modulo 2^32 so that any pair of values round-trips
+inline int Delta(LONG v, LONG vPrev)
+{
+	return (int)((DWORD)v - (DWORD)vPrev);
+}
+
+inline LONG Apply(LONG vPrev, int d)
+{
+	return (LONG)((DWORD)vPrev + (DWORD)d);
+}
+
+inline BOOL IsMouseMessage(UINT msg)
+{
+	return msg >= 0x0200 && msg <= 0x020E;	// WM_MOUSEFIRST .. WM_MOUSELAST
+}
+
+inline DWORD ZigZag(int v)
+{
+	return ((DWORD)v << 1) ^ (DWORD)(v >> 31);
+}
+
+inline int UnZigZag(DWORD v)
+{
+	return (int)(v >> 1) ^ -(int)(v & 1);
+}
+
+class Writer
+{
+public:
+	Writer(BYTE *pBuf, size_t cbBuf) : p(pBuf), pEnd(pBuf + cbBuf) {}
+	BOOL IsOverflow()
+	{
+		return p > pEnd;
+	}
+	BYTE *Position()
+	{
+		return p;
+	}
+	void Byte(BYTE b)
+	{
+		if (p < pEnd) {
+			*p = b;
+		}
+		p++;
+	}
+	void VarUInt(DWORD v)
+	{
+		while (v >= 0x80) {
+			Byte((BYTE)(v | 0x80));
+			v >>= 7;
+		}
+		Byte((BYTE)v);
+	}
+	void VarInt(int v)
+	{
+		VarUInt(ZigZag(v));
+	}
+	void Bytes(const void *pData, size_t cb)
+	{
+		if (p + cb <= pEnd) {
+			memcpy(p, pData, cb);
+		}
+		p += cb;
+	}
+
+private:
+	BYTE *p;
+	BYTE *pEnd;
+};
+
+class Reader
+{
+public:
+	Reader(const BYTE *pBuf, size_t cbBuf) : p(pBuf), pEnd(pBuf + cbBuf), bError(FALSE) {}
+	BOOL IsError()
+	{
+		return bError;
+	}
+	BOOL IsEnd()
+	{
+		return p >= pEnd;
+	}
+	BYTE Byte()
+	{
+		if (p >= pEnd) {
+			bError = TRUE;
+			return 0;
+		}
+		return *p++;
+	}
+	DWORD VarUInt()
+	{
+		DWORD v = 0;
+		for (int shift = 0; shift < 35; shift += 7) {
+			BYTE b = Byte();
+			v |= (DWORD)(b & 0x7F) << shift;
+			if (!(b & 0x80)) {
+				return v;
+			}
+		}
+		bError = TRUE;
+		return 0;
+	}
+	int VarInt()
+	{
+		return UnZigZag(VarUInt());
+	}
+	// Returns a pointer into the receive buffer, or NULL if it is too short
+	const BYTE *Bytes(size_t cb)
+	{
+		if ((size_t)(pEnd - p) < cb) {
+			bError = TRUE;
+			return NULL;
+		}
+		const BYTE *pData = p;
+		p += cb;
+		return pData;
+	}
+
+private:
+	const BYTE *p;
+	const BYTE *pEnd;
+	BOOL bError;
+};
+
+inline void WriteRect(Writer &w, const RECT &rc, const RECT &rcPrev)
+{
+	w.VarInt(Delta(rc.left, rcPrev.left));
+	w.VarInt(Delta(rc.top, rcPrev.top));
+	w.VarInt(Delta(rc.right, rcPrev.right));
+	w.VarInt(Delta(rc.bottom, rcPrev.bottom));
+}
+
+inline void ReadRect(Reader &r, RECT &rc)
+{
+	rc.left = Apply(rc.left, r.VarInt());
+	rc.top = Apply(rc.top, r.VarInt());
+	rc.right = Apply(rc.right, r.VarInt());
+	rc.bottom = Apply(rc.bottom, r.VarInt());
+}
+
+inline BOOL IsSameRect(const RECT &a, const RECT &b)
+{
+	return a.left == b.left && a.top == b.top && a.right == b.right && a.bottom == b.bottom;
+}
+
+/*! Encodes ui as a delta against prev. prev is the previously encoded event
+    of the same datagram (all zero for the first one). */
+inline void WriteUserInput(Writer &w, const UserInput &ui, const UserInput &prev)
+{
+	DWORD mask = 0;
+	if (ui.type != prev.type) mask |= F_TYPE;
+	if (!IsSameRect(ui.rcWindow, prev.rcWindow)) mask |= F_RC_WINDOW;
+	if (!IsSameRect(ui.rcClient, prev.rcClient)) mask |= F_RC_CLIENT;
+	if (ui.wm.msg != prev.wm.msg) mask |= F_WM_MSG;
+	if (ui.wm.wParam != prev.wm.wParam) mask |= F_WM_WPARAM;
+	if (ui.wm.lParam != prev.wm.lParam) {
+		mask |= IsMouseMessage(ui.wm.msg) ? F_WM_MOUSE_DELTA : F_WM_LPARAM;
+	}
+	DWORD axisMask = 0;
+	for (int i = 0; i < CONTROL_INFO_WIRE_N_AXES; i++) {
+		if (JoyAxis(ui, i) != JoyAxis(prev, i)) {
+			axisMask |= 1 << i;
+		}
+	}
+	if (axisMask) mask |= F_JOY_AXES;
+	DWORD buttonBits = 0;
+	BOOL bButtonBits = TRUE;
+	for (int i = 0; i < 32; i++) {
+		if (ui.joy.rgbButtons[i] == 0x80) {
+			buttonBits |= 1u << i;
+		} else if (ui.joy.rgbButtons[i]) {
+			bButtonBits = FALSE;
+		}
+	}
+	if (memcmp(ui.joy.rgbButtons, prev.joy.rgbButtons, sizeof(ui.joy.rgbButtons))) {
+		mask |= bButtonBits ? F_JOY_BUTTON_BITS : F_JOY_BUTTON_RAW;
+	}
+
+	w.VarUInt(mask);
+	w.VarInt((int)(ui.sn - prev.sn));
+	if (mask & F_TYPE) w.VarUInt((DWORD)ui.type);
+	if (mask & F_RC_WINDOW) WriteRect(w, ui.rcWindow, prev.rcWindow);
+	if (mask & F_RC_CLIENT) WriteRect(w, ui.rcClient, prev.rcClient);
+	if (mask & F_WM_MSG) w.VarUInt(ui.wm.msg);
+	if (mask & F_WM_WPARAM) w.VarUInt(ui.wm.wParam);
+	if (mask & F_WM_LPARAM) w.VarUInt(ui.wm.lParam);
+	if (mask & F_WM_MOUSE_DELTA) {
+		w.VarInt((short)LOWORD(ui.wm.lParam) - (short)LOWORD(prev.wm.lParam));
+		w.VarInt((short)HIWORD(ui.wm.lParam) - (short)HIWORD(prev.wm.lParam));
+	}
+	if (mask & F_JOY_AXES) {
+		w.VarUInt(axisMask);
+		for (int i = 0; i < CONTROL_INFO_WIRE_N_AXES; i++) {
+			if (axisMask & (1 << i)) {
+				w.VarInt(Delta(JoyAxis(ui, i), JoyAxis(prev, i)));
+			}
+		}
+	}
+	if (mask & F_JOY_BUTTON_BITS) {
+		BYTE ab[4] = {(BYTE)buttonBits, (BYTE)(buttonBits >> 8), (BYTE)(buttonBits >> 16), (BYTE)(buttonBits >> 24)};
+		w.Bytes(ab, sizeof(ab));
+	}
+	if (mask & F_JOY_BUTTON_RAW) {
+		w.Bytes(ui.joy.rgbButtons, sizeof(ui.joy.rgbButtons));
+	}
+}
+
+/*! Decodes one event in place: ui must hold the previous event of the datagram. */
+inline BOOL ReadUserInput(Reader &r, UserInput &ui)
+{
+	DWORD mask = r.VarUInt();
+	ui.sn += (DWORD)r.VarInt();
+	if (mask & F_TYPE) ui.type = (UserInputType)r.VarUInt();
+	if (mask & F_RC_WINDOW) ReadRect(r, ui.rcWindow);
+	if (mask & F_RC_CLIENT) ReadRect(r, ui.rcClient);
+	if (mask & F_WM_MSG) ui.wm.msg = r.VarUInt();
+	if (mask & F_WM_WPARAM) ui.wm.wParam = r.VarUInt();
+	if (mask & F_WM_LPARAM) ui.wm.lParam = r.VarUInt();
+	if (mask & F_WM_MOUSE_DELTA) {
+		WORD x = (WORD)((short)LOWORD(ui.wm.lParam) + r.VarInt());
+		WORD y = (WORD)((short)HIWORD(ui.wm.lParam) + r.VarInt());
+		ui.wm.lParam = MAKELONG(x, y);
+	}
+	if (mask & F_JOY_AXES) {
+		DWORD axisMask = r.VarUInt();
+		for (int i = 0; i < CONTROL_INFO_WIRE_N_AXES; i++) {
+			if (axisMask & (1 << i)) {
+				*JoyAxis(ui, i) += (DWORD)r.VarInt();
+			}
+		}
+	}
+	if (mask & F_JOY_BUTTON_BITS) {
+		const BYTE *ab = r.Bytes(4);
+		if (ab) {
+			DWORD buttonBits = ab[0] | (ab[1] << 8) | (ab[2] << 16) | ((DWORD)ab[3] << 24);
+			for (int i = 0; i < 32; i++) {
+				ui.joy.rgbButtons[i] = (buttonBits & (1u << i)) ? 0x80 : 0;
+			}
+		}
+	}
+	if (mask & F_JOY_BUTTON_RAW) {
+		const BYTE *ab = r.Bytes(sizeof(ui.joy.rgbButtons));
+		if (ab) {
+			memcpy(ui.joy.rgbButtons, ab, sizeof(ui.joy.rgbButtons));
+		}
+	}
+	return !r.IsError();
+}
+
+inline void WriteHeader(BYTE *pBuf, ControlInfoWireKind eKind, WORD nCount)
+{
+	pBuf[0] = 'G';
+	pBuf[1] = 'I';
+	pBuf[2] = CONTROL_INFO_WIRE_VERSION;
+	pBuf[3] = (BYTE)eKind;
+	pBuf[4] = (BYTE)nCount;
+	pBuf[5] = (BYTE)(nCount >> 8);
+}
+
+inline BOOL ReadHeader(const BYTE *pBuf, size_t cbBuf, ControlInfoWireKind eKind, WORD *pnCount)
+{
+	if (cbBuf < CONTROL_INFO_WIRE_HEADER_SIZE || pBuf[0] != 'G' || pBuf[1] != 'I'
+		|| pBuf[2] != CONTROL_INFO_WIRE_VERSION || pBuf[3] != (BYTE)eKind) {
+		return FALSE;
+	}
+	*pnCount = pBuf[4] | (pBuf[5] << 8);
+	return TRUE;
+}
+
+}
+
+/*! Packs UserInput events into one datagram until it is full. */
+class UserInputBatchWriter
+{
+public:
+	UserInputBatchWriter(BYTE *pBuf, size_t cbBuf) : pBuf(pBuf), cbBuf(cbBuf)
+	{
+		Reset();
+	}
+	void Reset()
+	{
+		cbUsed = CONTROL_INFO_WIRE_HEADER_SIZE;
+		nCount = 0;
+		memset(&prev, 0, sizeof(prev));
+	}
+	// Returns FALSE (leaving the batch untouched) if ui does not fit any more
+	BOOL Add(const UserInput &ui)
+	{
+		if (nCount == 0xFFFF) {
+			return FALSE;
+		}
+		BYTE abScratch[CONTROL_INFO_WIRE_MAX_EVENT_SIZE];
+		controlinfowire::Writer w(abScratch, sizeof(abScratch));
+		controlinfowire::WriteUserInput(w, ui, prev);
+		size_t cb = w.Position() - abScratch;
+		if (w.IsOverflow() || cbUsed + cb > cbBuf) {
+			return FALSE;
+		}
+		memcpy(pBuf + cbUsed, abScratch, cb);
+		cbUsed += cb;
+		nCount++;
+		prev = ui;
+		return TRUE;
+	}
+	// Finalizes the header; returns the number of bytes to send
+	size_t Finish()
+	{
+		if (cbBuf < CONTROL_INFO_WIRE_HEADER_SIZE) {
+			return 0;
+		}
+		controlinfowire::WriteHeader(pBuf, WIRE_USER_INPUT_BATCH, nCount);
+		return cbUsed;
+	}
+	WORD GetCount()
+	{
+		return nCount;
+	}
+
+private:
+	BYTE *pBuf;
+	size_t cbBuf;
+	size_t cbUsed;
+	WORD nCount;
+	UserInput prev;
+};
+
+/*! Iterates the events of a received datagram without copying it. */
+class UserInputBatchReader
+{
+public:
+	UserInputBatchReader(const BYTE *pBuf, size_t cbBuf) :
+		r(pBuf + CONTROL_INFO_WIRE_HEADER_SIZE, cbBuf > CONTROL_INFO_WIRE_HEADER_SIZE ? cbBuf - CONTROL_INFO_WIRE_HEADER_SIZE : 0),
+		nLeft(0)
+	{
+		bValid = controlinfowire::ReadHeader(pBuf, cbBuf, WIRE_USER_INPUT_BATCH, &nLeft);
+		memset(&cur, 0, sizeof(cur));
+	}
+	BOOL IsValid()
+	{
+		return bValid;
+	}
+	// Decodes the next event; returns FALSE at the end or on a malformed datagram
+	BOOL Next(UserInput &ui)
+	{
+		if (!bValid || !nLeft) {
+			return FALSE;
+		}
+		if (!controlinfowire::ReadUserInput(r, cur)) {
+			bValid = FALSE;
+			return FALSE;
+		}
+		nLeft--;
+		ui = cur;
+		return TRUE;
+	}
+
+private:
+	controlinfowire::Reader r;
+	WORD nLeft;
+	BOOL bValid;
+	UserInput cur;
+};
+
+/*! Encodes one ControlInfo message; returns its size, or 0 if cbBuf is too small. */
+inline size_t EncodeControlInfo(const ControlInfo &ci, BYTE *pBuf, size_t cbBuf)
+{
+	if (cbBuf < CONTROL_INFO_WIRE_HEADER_SIZE) {
+		return 0;
+	}
+	controlinfowire::Writer w(pBuf + CONTROL_INFO_WIRE_HEADER_SIZE, cbBuf - CONTROL_INFO_WIRE_HEADER_SIZE);
+	const std::string *astr[] = {&ci.strCmd, &ci.strWndClassKeyword, &ci.strWndTitleKeyword};
+	w.VarUInt((DWORD)ci.type);
+	for (size_t i = 0; i < sizeof(astr) / sizeof(astr[0]); i++) {
+		w.VarUInt((DWORD)astr[i]->size());
+		w.Bytes(astr[i]->data(), astr[i]->size());
+	}
+	w.VarInt(ci.iGpu);
+	w.VarInt(ci.iAudio);
+	w.VarInt(ci.bDwm);
+	w.VarUInt(ci.cxEncoding);
+	w.VarUInt(ci.cyEncoding);
+	w.VarInt(ci.bForceCdeclInEnumDevicesCallback);
+	UserInput uiZero;
+	memset(&uiZero, 0, sizeof(uiZero));
+	controlinfowire::WriteUserInput(w, ci.ui, uiZero);
+	if (w.IsOverflow()) {
+		return 0;
+	}
+	controlinfowire::WriteHeader(pBuf, WIRE_CONTROL_INFO, 1);
+	return w.Position() - pBuf;
+}
+
+/*! Decodes one ControlInfo message. Only the strings are copied out of pBuf. */
+inline BOOL DecodeControlInfo(const BYTE *pBuf, size_t cbBuf, ControlInfo &ci)
+{
+	WORD nCount;
+	if (!controlinfowire::ReadHeader(pBuf, cbBuf, WIRE_CONTROL_INFO, &nCount) || nCount != 1) {
+		return FALSE;
+	}
+	controlinfowire::Reader r(pBuf + CONTROL_INFO_WIRE_HEADER_SIZE, cbBuf - CONTROL_INFO_WIRE_HEADER_SIZE);
+	std::string *astr[] = {&ci.strCmd, &ci.strWndClassKeyword, &ci.strWndTitleKeyword};
+	ci.type = (ControlInfoType)r.VarUInt();
+	for (size_t i = 0; i < sizeof(astr) / sizeof(astr[0]); i++) {
+		DWORD cch = r.VarUInt();
+		const BYTE *pch = r.Bytes(cch);
+		if (!pch) {
+			return FALSE;
+		}
+		astr[i]->assign((const char *)pch, cch);
+	}
+	ci.iGpu = r.VarInt();
+	ci.iAudio = r.VarInt();
+	ci.bDwm = r.VarInt();
+	ci.cxEncoding = r.VarUInt();
+	ci.cyEncoding = r.VarUInt();
+	ci.bForceCdeclInEnumDevicesCallback = r.VarInt();
+	memset(&ci.ui, 0, sizeof(ci.ui));
+	return controlinfowire::ReadUserInput(r, ci.ui);
+}
@@ -0,0 +1,189 @@
+/*!
+ * \brief
+ * The implementation of EncodeService
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <string.h>
+#include "EncodeService.h"
+#include "Logger.h"
+#ifndef _WIN32
+#define _pclose pclose
+#endif
+
+extern simplelogger::Logger *logger;
+
+// VBV of the service's encoders in frames, the low-latency setting of the shim's -vbvFrames
+#define SERVICE_VBV_FRAMES 1
+
+// x264 runs without B-frames, so every frame but an IDR is a reference
+static SinkFrameKind GetFrameKind(const std::vector<uint8_t> &vAccessUnit)
+{
+	for (size_t i = 0; i + 3 < vAccessUnit.size(); i++) {
+		if (vAccessUnit[i] == 0 && vAccessUnit[i + 1] == 0 && vAccessUnit[i + 2] == 1 && (vAccessUnit[i + 3] & 0x1F) == 5) {
+			return SINK_FRAME_KEY;
+		}
+	}
+	return SINK_FRAME_REFERENCE;
+}
+
+EncodeService::EncodeService() : bStop(false)
+{
+}
+
+EncodeService::~EncodeService()
+{
+	Stop();
+}
+
+bool EncodeService::Attach(ULONGLONG qwGamePid, int index, const PlayerOutputConfig &config)
+{
+	Stream *pStream = new Stream;
+	pStream->index = index;
+	pStream->fpOutput = NULL;
+	pStream->fecSender.SetIndex(index);
+	pStream->graph.SetIndex(index);
+	pStream->bKeyFrameRequested = false;
+	pStream->bDone = false;
+	memset(&pStream->stats, 0, sizeof(pStream->stats));
+	if (!pStream->transport.Open(FrameTransport::GetName(qwGamePid, index))) {
+		delete pStream;
+		return false;
+	}
+	FrameRing *pRing = pStream->transport.GetRing();
+	PlayerOutputConfig streamConfig = config;
+	streamConfig.fps = pRing->GetFps();
+	pStream->graph.SetKeyFrameRequest([pStream] { pStream->bKeyFrameRequested = true; });
+	if (!OpenPlayerOutput(streamConfig, index, 0, pStream->graph, pStream->fecSender, sinkPlugin, &pStream->fpOutput)) {
+		LOG_ERROR(logger, "Failed to open the output of player " << index);
+		pStream->graph.Stop();
+		delete pStream;
+		return false;
+	}
+	LOG_INFO(logger, "Encoding player " << index << " of process " << qwGamePid << ": " << pRing->GetWidth() << "x" << pRing->GetHeight()
+		<< " at " << pRing->GetFps() << " fps to " << pStream->graph.GetSinkCount() << " sinks");
+
+	std::lock_guard<std::mutex> lock(mtx);
+	vpStream.push_back(pStream);
+	pStream->thread = std::thread([this, pStream] { Run(pStream); });
+	return true;
+}
+
+bool EncodeService::IsAttached(int index)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	for (size_t i = 0; i < vpStream.size(); i++) {
+		if (vpStream[i]->index == index) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool EncodeService::IsDone()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	for (size_t i = 0; i < vpStream.size(); i++) {
+		if (!vpStream[i]->bDone) {
+			return false;
+		}
+	}
+	return !vpStream.empty();
+}
+
+void EncodeService::Stop()
+{
+	bStop = true;
+	std::lock_guard<std::mutex> lock(mtx);
+	for (size_t i = 0; i < vpStream.size(); i++) {
+		Stream *pStream = vpStream[i];
+		if (pStream->thread.joinable()) {
+			pStream->thread.join();
+		}
+		pStream->encoder.Close();
+		pStream->graph.Stop();
+		if (pStream->fpOutput) {
+			_pclose(pStream->fpOutput);
+		}
+		delete pStream;
+	}
+	vpStream.clear();
+}
+
+EncodeService::Stats EncodeService::TakeStats(int index)
+{
+	Stats stats;
+	memset(&stats, 0, sizeof(stats));
+	std::lock_guard<std::mutex> lock(mtx);
+	for (size_t i = 0; i < vpStream.size(); i++) {
+		if (vpStream[i]->index == index) {
+			std::lock_guard<std::mutex> lockStats(vpStream[i]->mtxStats);
+			stats = vpStream[i]->stats;
+			memset(&vpStream[i]->stats, 0, sizeof(vpStream[i]->stats));
+			break;
+		}
+	}
+	return stats;
+}
+
+void EncodeService::Run(Stream *pStream)
+{
+	FrameRing *pRing = pStream->transport.GetRing();
+	InputRingSignal *pSignal = pStream->transport.GetSignal();
+	std::vector<uint8_t> vAccessUnit;
+	uint32_t nDroppedSeen = 0;
+	bool bOpenFailed = false;
+	while (!bStop) {
+		FrameDesc desc;
+		const uint8_t *pFrame = pRing->WaitAcquire(desc, pSignal, FrameTransport::NowMs(), SERVICE_WAIT_MS);
+		if (!pFrame) {
+			if (pRing->IsClosed()) {
+				LOG_INFO(logger, "Player " << pStream->index << " closed its frame ring");
+				break;
+			}
+			continue;
+		}
+		uint64_t qwHandoffUs = FrameTransport::NowUs() - desc.qwPublishUs;
+
+		// A sink that lost a reference frame waits for the next IDR
+		bool bIdr = (desc.dwFlags & FRAME_FLAG_IDR) != 0 || pStream->bKeyFrameRequested.exchange(false);
+		bool bEncoded = false;
+		if (!pStream->encoder.IsOpen() && !bOpenFailed) {
+			// The first frame of a session is an IDR anyway
+			if (!pStream->encoder.Open(pRing->GetWidth(), pRing->GetHeight(), pRing->GetFps(), desc.dwBitrate, SERVICE_VBV_FRAMES)) {
+				LOG_ERROR(logger, "Failed to start the encoder of player " << pStream->index << ", its frames are dropped");
+				bOpenFailed = true;
+			}
+		}
+		if (pStream->encoder.IsOpen()) {
+			if (desc.dwBitrate) {
+				pStream->encoder.SetBitrate(desc.dwBitrate);
+			}
+			// The frame is encoded where it lies and the slot handed back only then
+			bEncoded = pStream->encoder.Encode(pFrame, bIdr, vAccessUnit);
+		}
+		pRing->Release();
+		// One copy into a packet that every sink shares; the writes happen on the sinks' threads
+		bool bSinkDropped = bEncoded && !pStream->graph.Push(vAccessUnit.data(), vAccessUnit.size(), GetFrameKind(vAccessUnit));
+
+		uint32_t nDropped = pRing->GetStats().nDropped;
+		std::lock_guard<std::mutex> lock(pStream->mtxStats);
+		Stats &stats = pStream->stats;
+		stats.nFrame++;
+		stats.nIdr += bIdr;
+		stats.nEncodeError += !bEncoded;
+		stats.qwHandoffUs += qwHandoffUs;
+		stats.qwMaxHandoffUs = qwHandoffUs > stats.qwMaxHandoffUs ? qwHandoffUs : stats.qwMaxHandoffUs;
+		stats.nDropped += nDropped - nDroppedSeen;
+		stats.nSinkDropped += bSinkDropped;
+		nDroppedSeen = nDropped;
+	}
+	pStream->bDone = true;
+}
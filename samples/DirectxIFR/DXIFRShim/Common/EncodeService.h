@@ -0,0 +1,101 @@
+/*!
+ * \brief
+ * Encoding of the players of a game outside of the game's process
+ *
+ * \file
+ *
+ * Without it the shim captures, encodes and streams inside the game, so a
+ * stalled or crashing encoder stalls or crashes the game. With -service the
+ * launcher (StartApp) becomes the encode service instead: the shim copies
+ * every captured frame into the player's FrameRing and goes back to the
+ * game, and the service encodes it from there. A dead service costs the
+ * game nothing but the frames the shim drops.
+ *
+ * Every attached player gets a thread that waits on its ring, encodes the
+ * frames where they lie, with the bitrate and IDRs the shim's allocator and
+ * recovery requests asked for, and pushes the access units into a
+ * SinkGraph that OpenPlayerOutput() builds from the player's encoder
+ * options, the same sinks the shim would stream it to: the ffmpeg listener
+ * or UDP with FEC, and -record and -sinkPlugin. A sink that drops a
+ * reference frame gets an IDR. The encoder is SoftwareEncoder; NVENC
+ * sessions live in the DXGI shim for now. The time from Publish() to the
+ * frame reaching the service is kept per player.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FrameTransport.h"
+#include "PlayerOutput.h"
+#include "SoftwareEncoder.h"
+
+// How long a stream thread sleeps on an idle ring before it looks at the stop flag
+#define SERVICE_WAIT_MS 100
+
+class EncodeService
+{
+public:
+	struct Stats {
+		unsigned int nFrame;
+		unsigned int nIdr;
+		unsigned int nEncodeError;
+		// Publish() to Acquire(), summed and the largest
+		uint64_t qwHandoffUs;
+		uint64_t qwMaxHandoffUs;
+		// Frames the shim dropped because the service held every slot
+		unsigned int nDropped;
+		// Frames the primary sink dropped
+		unsigned int nSinkDropped;
+	};
+
+	EncodeService();
+	~EncodeService();
+
+	/*! Opens the ring of player index of the game and starts encoding it to the sinks of config.
+	    False if the shim has not created the ring yet, or the output cannot be opened. */
+	bool Attach(ULONGLONG qwGamePid, int index, const PlayerOutputConfig &config);
+	bool IsAttached(int index);
+	// Whether every attached player's shim has closed its ring
+	bool IsDone();
+	// Stops the stream threads and closes the outputs
+	void Stop();
+	// Counts since the last call; all zero for a player that is not attached
+	Stats TakeStats(int index);
+
+private:
+	struct Stream {
+		int index;
+		FrameTransport transport;
+		SoftwareEncoder encoder;
+		// The ffmpeg listener, unless the stream goes over UDP
+		FILE *fpOutput;
+		// Declared before the graph so that it outlives the graph's writer threads
+		FecSender fecSender;
+		SinkGraph graph;
+		std::atomic<bool> bKeyFrameRequested;
+		std::thread thread;
+		std::atomic<bool> bDone;
+		std::mutex mtxStats;
+		Stats stats;
+	};
+
+	void Run(Stream *pStream);
+
+	std::mutex mtx;
+	// Shared by the streams; outlives their graphs
+	SinkPluginHost sinkPlugin;
+	std::vector<Stream *> vpStream;
+	std::atomic<bool> bStop;
+};
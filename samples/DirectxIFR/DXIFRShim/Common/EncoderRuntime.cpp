@@ -0,0 +1,409 @@
+/*!
+ * \brief
+ * The implementation of EncoderRuntime
+ *
+ * \file
+ *
+ * The warm-up runs as one task on the shared TaskPool. Encoders that start
+ * while it is still opening sessions wait for the next one instead of
+ * opening their own, so that the process never holds more sessions than
+ * the pool was sized for; consumer GPUs only allow a few.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "EncoderRuntime.h"
+#include "GpuScheduler.h"
+#include "inc/nvCPUOPSys.h"
+#include "TaskPool.h"
+#include "Metrics.h"
+#include "Logger.h"
+#if !defined(NV_WINDOWS)
+#include <dlfcn.h>
+#endif
+
+extern simplelogger::Logger *logger;
+
+// The runtime loads the driver itself and needs nothing of CNvHWEncoder, so it also builds without the D3D headers
+typedef NVENCSTATUS (NVENCAPI *PNVENCODEAPICREATEINSTANCE)(NV_ENCODE_API_FUNCTION_LIST *);
+
+EncoderRuntime::EncoderRuntime() : bApiLoaded(false), apiStatus(NV_ENC_SUCCESS),
+	bCudaInitialized(false), cuInitResult(CUDA_SUCCESS),
+	bPrewarmed(false), iWarmDevice(0), nWarming(0)
+{
+#if defined(NV_WINDOWS)
+#if defined (_WIN64)
+	strNvEncLibrary = "nvEncodeAPI64.dll";
+#else
+	strNvEncLibrary = "nvEncodeAPI.dll";
+#endif
+#else
+	strNvEncLibrary = "libnvidia-encode.so.1";
+#endif
+	memset(&api, 0, sizeof(api));
+	memset(&stats, 0, sizeof(stats));
+}
+
+EncoderRuntime *EncoderRuntime::GetShared()
+{
+	static std::once_flag once;
+	static EncoderRuntime *pRuntime = NULL;
+	std::call_once(once, [] { pRuntime = new EncoderRuntime(); });
+	return pRuntime;
+}
+
+bool EncoderRuntime::SetLibrary(const char *szNvEncLibrary)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (bApiLoaded) {
+		return false;
+	}
+	strNvEncLibrary = szNvEncLibrary;
+	return true;
+}
+
+bool EncoderRuntime::SetCudaLibrary(const char *szCudaLibrary)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (bCudaInitialized) {
+		return false;
+	}
+	strCudaLibrary = szCudaLibrary;
+	cuSetDriverLibrary(strCudaLibrary.c_str());
+	return true;
+}
+
+NV_ENCODE_API_FUNCTION_LIST *EncoderRuntime::GetApi()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (bApiLoaded) {
+		return apiStatus == NV_ENC_SUCCESS ? &api : NULL;
+	}
+	bApiLoaded = true;
+
+	// The library stays loaded for the life of the process
+#if defined(NV_WINDOWS)
+	HINSTANCE hinstLib = LoadLibraryA(strNvEncLibrary.c_str());
+#else
+	void *hinstLib = dlopen(strNvEncLibrary.c_str(), RTLD_LAZY);
+#endif
+	if (!hinstLib) {
+		LOG_ERROR(logger, "Failed to load " << strNvEncLibrary);
+		apiStatus = NV_ENC_ERR_OUT_OF_MEMORY;
+		return NULL;
+	}
+#if defined(NV_WINDOWS)
+	PNVENCODEAPICREATEINSTANCE nvEncodeAPICreateInstance = (PNVENCODEAPICREATEINSTANCE)GetProcAddress(hinstLib, "NvEncodeAPICreateInstance");
+#else
+	PNVENCODEAPICREATEINSTANCE nvEncodeAPICreateInstance = (PNVENCODEAPICREATEINSTANCE)dlsym(hinstLib, "NvEncodeAPICreateInstance");
+#endif
+	if (!nvEncodeAPICreateInstance) {
+		LOG_ERROR(logger, strNvEncLibrary << " has no NvEncodeAPICreateInstance");
+		apiStatus = NV_ENC_ERR_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+	api.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+	apiStatus = nvEncodeAPICreateInstance(&api);
+	if (apiStatus != NV_ENC_SUCCESS) {
+		LOG_ERROR(logger, "NvEncodeAPICreateInstance failed, status=" << apiStatus);
+		return NULL;
+	}
+	return &api;
+}
+
+bool EncoderRuntime::InitCuda()
+{
+	if (!bCudaInitialized) {
+		bCudaInitialized = true;
+		cuInitResult = cuInit(0, __CUDA_API_VERSION, NULL);
+		if (cuInitResult != CUDA_SUCCESS) {
+			LOG_ERROR(logger, "cuInit failed, result=" << cuInitResult);
+		}
+	}
+	return cuInitResult == CUDA_SUCCESS;
+}
+
+NVENCSTATUS EncoderRuntime::GetCudaDevice(int iDevice, CUdevice *pDevice)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!InitCuda()) {
+		return NV_ENC_ERR_NO_ENCODE_DEVICE;
+	}
+
+	std::map<int, CUdevice>::iterator it = mpDevice.find(iDevice);
+	if (it != mpDevice.end()) {
+		*pDevice = it->second;
+		return NV_ENC_SUCCESS;
+	}
+
+	int nDevice = 0;
+	CUresult cuResult = cuDeviceGetCount(&nDevice);
+	if (cuResult != CUDA_SUCCESS) {
+		LOG_ERROR(logger, "cuDeviceGetCount failed, result=" << cuResult);
+		return NV_ENC_ERR_NO_ENCODE_DEVICE;
+	}
+	if (iDevice < 0 || iDevice >= nDevice) {
+		LOG_ERROR(logger, "Invalid CUDA device " << iDevice << " of " << nDevice);
+		return NV_ENC_ERR_INVALID_ENCODERDEVICE;
+	}
+	CUdevice device;
+	cuResult = cuDeviceGet(&device, iDevice);
+	if (cuResult != CUDA_SUCCESS) {
+		LOG_ERROR(logger, "cuDeviceGet failed, result=" << cuResult);
+		return NV_ENC_ERR_NO_ENCODE_DEVICE;
+	}
+	int major = 0, minor = 0;
+	cuResult = cuDeviceComputeCapability(&major, &minor, device);
+	if (cuResult != CUDA_SUCCESS) {
+		LOG_ERROR(logger, "cuDeviceComputeCapability failed, result=" << cuResult);
+		return NV_ENC_ERR_NO_ENCODE_DEVICE;
+	}
+	if (((major << 4) + minor) < 0x30) {
+		LOG_ERROR(logger, "GPU " << iDevice << " does not have NVENC capabilities");
+		return NV_ENC_ERR_NO_ENCODE_DEVICE;
+	}
+	mpDevice[iDevice] = device;
+	*pDevice = device;
+	return NV_ENC_SUCCESS;
+}
+
+int EncoderRuntime::GetDeviceCount()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!InitCuda()) {
+		return 0;
+	}
+	int nDevice = 0;
+	CUresult cuResult = cuDeviceGetCount(&nDevice);
+	if (cuResult != CUDA_SUCCESS) {
+		LOG_ERROR(logger, "cuDeviceGetCount failed, result=" << cuResult);
+		return 0;
+	}
+	return nDevice;
+}
+
+uint64_t EncoderRuntime::GetDeviceMemory(int iDevice)
+{
+	CUdevice device;
+	if (GetCudaDevice(iDevice, &device) != NV_ENC_SUCCESS) {
+		return 0;
+	}
+	size_t cb = 0;
+	CUresult cuResult = cuDeviceTotalMem(&cb, device);
+	if (cuResult != CUDA_SUCCESS) {
+		LOG_ERROR(logger, "cuDeviceTotalMem failed, result=" << cuResult);
+		return 0;
+	}
+	return cb;
+}
+
+NVENCSTATUS EncoderRuntime::AcquireContext(int iDevice, CUcontext *pContext)
+{
+	CUdevice device;
+	NVENCSTATUS nvStatus = GetCudaDevice(iDevice, &device);
+	if (nvStatus != NV_ENC_SUCCESS) {
+		return nvStatus;
+	}
+
+	std::lock_guard<std::mutex> lock(mtx);
+	std::map<int, SharedContext>::iterator it = mpContext.find(iDevice);
+	if (it != mpContext.end()) {
+		it->second.nRef++;
+		stats.nContextRef++;
+		*pContext = it->second.cuContext;
+		return NV_ENC_SUCCESS;
+	}
+	CUcontext cuContext;
+	CUresult cuResult = cuCtxCreate(&cuContext, 0, device);
+	if (cuResult != CUDA_SUCCESS) {
+		LOG_ERROR(logger, "cuCtxCreate failed, result=" << cuResult);
+		return NV_ENC_ERR_NO_ENCODE_DEVICE;
+	}
+	CUcontext cuContextCurr;
+	cuResult = cuCtxPopCurrent(&cuContextCurr);
+	if (cuResult != CUDA_SUCCESS) {
+		LOG_ERROR(logger, "cuCtxPopCurrent failed, result=" << cuResult);
+		cuCtxDestroy(cuContext);
+		return NV_ENC_ERR_NO_ENCODE_DEVICE;
+	}
+	SharedContext sharedContext = {cuContext, 1};
+	mpContext[iDevice] = sharedContext;
+	stats.nContext++;
+	stats.nContextRef++;
+	*pContext = cuContext;
+	return NV_ENC_SUCCESS;
+}
+
+void EncoderRuntime::ReleaseContext(CUcontext cuContext)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	for (std::map<int, SharedContext>::iterator it = mpContext.begin(); it != mpContext.end(); ++it) {
+		if (it->second.cuContext != cuContext) {
+			continue;
+		}
+		stats.nContextRef--;
+		if (--it->second.nRef == 0) {
+			CUresult cuResult = cuCtxDestroy(cuContext);
+			if (cuResult != CUDA_SUCCESS) {
+				LOG_ERROR(logger, "cuCtxDestroy failed, result=" << cuResult);
+			}
+			mpContext.erase(it);
+			stats.nContext--;
+		}
+		return;
+	}
+	LOG_ERROR(logger, "Context " << cuContext << " is not shared by the runtime");
+}
+
+NVENCSTATUS EncoderRuntime::OpenSession(int iDevice, EncoderSession *pSession)
+{
+	NV_ENCODE_API_FUNCTION_LIST *pApi = GetApi();
+	if (!pApi) {
+		return NV_ENC_ERR_OUT_OF_MEMORY;
+	}
+	pSession->iDevice = iDevice;
+	pSession->hEncoder = NULL;
+	NVENCSTATUS nvStatus = AcquireContext(iDevice, &pSession->cuContext);
+	if (nvStatus != NV_ENC_SUCCESS) {
+		return nvStatus;
+	}
+
+	NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS openSessionExParams;
+	memset(&openSessionExParams, 0, sizeof(openSessionExParams));
+	openSessionExParams.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
+	openSessionExParams.device = pSession->cuContext;
+	openSessionExParams.deviceType = NV_ENC_DEVICE_TYPE_CUDA;
+	openSessionExParams.apiVersion = NVENCAPI_VERSION;
+	nvStatus = pApi->nvEncOpenEncodeSessionEx(&openSessionExParams, &pSession->hEncoder);
+	if (nvStatus != NV_ENC_SUCCESS) {
+		LOG_ERROR(logger, "nvEncOpenEncodeSessionEx failed, status=" << nvStatus);
+		ReleaseContext(pSession->cuContext);
+		return nvStatus;
+	}
+	return NV_ENC_SUCCESS;
+}
+
+void EncoderRuntime::DestroySession(EncoderSession &session)
+{
+	api.nvEncDestroyEncoder(session.hEncoder);
+	ReleaseContext(session.cuContext);
+}
+
+void EncoderRuntime::Prewarm(int iDevice, int nSession)
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (bPrewarmed || nSession <= 0) {
+			return;
+		}
+		bPrewarmed = true;
+		iWarmDevice = iDevice;
+		nWarming = nSession;
+	}
+	TaskPool::GetShared()->Submit([this, iDevice, nSession] { WarmTask(iDevice, nSession); });
+}
+
+void EncoderRuntime::WarmTask(int iDevice, int nSession)
+{
+	uint64_t qwStartUs = Metrics::NowUs();
+	// Spread like the encoders will be, so that their sessions are waiting on the right GPU
+	std::vector<int> vDevice = iDevice < 0 ? GpuScheduler::GetShared()->PlanSessions(nSession) : std::vector<int>(nSession, iDevice);
+	for (int i = 0; i < (int)vDevice.size(); i++) {
+		EncoderSession session;
+		NVENCSTATUS nvStatus = OpenSession(vDevice[i], &session);
+		std::lock_guard<std::mutex> lock(mtx);
+		if (nvStatus != NV_ENC_SUCCESS) {
+			// Whoever is waiting opens its own session, which will most likely fail the same way
+			LOG_WARN(logger, "Warm-up stopped after " << i << " of " << nSession << " sessions, status=" << nvStatus);
+			nWarming = 0;
+			cvSession.notify_all();
+			return;
+		}
+		vSession.push_back(session);
+		nWarming--;
+		stats.nWarmed++;
+		stats.qwWarmUs = Metrics::NowUs() - qwStartUs;
+		cvSession.notify_all();
+	}
+	std::lock_guard<std::mutex> lock(mtx);
+	// The placement plan may have fewer sessions than asked for, when the devices are full
+	nWarming = 0;
+	cvSession.notify_all();
+	LOG_INFO(logger, "Warmed " << vDevice.size() << " encoder sessions in " << stats.qwWarmUs << "us");
+}
+
+bool EncoderRuntime::AcquireSession(int iDevice, EncoderSession *pSession)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	if (bPrewarmed && (iWarmDevice < 0 || iDevice == iWarmDevice)) {
+		std::vector<EncoderSession>::iterator it;
+		cvSession.wait_for(lock, std::chrono::milliseconds(SESSION_WAIT_MS), [this, iDevice, &it]
+		{
+			for (it = vSession.begin(); it != vSession.end() && it->iDevice != iDevice; ++it) {
+			}
+			return it != vSession.end() || nWarming == 0;
+		});
+		if (it != vSession.end()) {
+			*pSession = *it;
+			vSession.erase(it);
+			stats.nHit++;
+			return true;
+		}
+	}
+	stats.nMiss++;
+	return false;
+}
+
+int EncoderRuntime::DrainPool()
+{
+	std::vector<EncoderSession> vIdle;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		vIdle.swap(vSession);
+	}
+	// Destroying a session releases its context, which takes the lock
+	for (size_t i = 0; i < vIdle.size(); i++) {
+		DestroySession(vIdle[i]);
+	}
+	return (int)vIdle.size();
+}
+
+EncoderRuntime::Stats EncoderRuntime::GetStats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return stats;
+}
+
+void PrewarmEncoders(AppParam *pAppParam)
+{
+	if (!pAppParam || pAppParam->numPlayers <= 0) {
+		return;
+	}
+	if (*pAppParam->szDriverLibrary) {
+		EncoderRuntime::GetShared()->SetLibrary(pAppParam->szDriverLibrary);
+		EncoderRuntime::GetShared()->SetCudaLibrary(pAppParam->szDriverLibrary);
+	}
+	int nRendition = 0;
+	while (nRendition < N_RENDITION && pAppParam->awRenditionHeight[nRendition]) {
+		nRendition++;
+	}
+	// The encoders are pinned to a GPU with -deviceID, otherwise GpuScheduler places them
+	int iDevice = -1;
+	const char *szDevice = strstr(pAppParam->szEncoderOptions, "-deviceID ");
+	if (szDevice) {
+		sscanf(szDevice + strlen("-deviceID "), "%d", &iDevice);
+	}
+	int nMaxSession = 0;
+	const char *szSessions = strstr(pAppParam->szEncoderOptions, "-gpuSessions ");
+	if (szSessions && sscanf(szSessions + strlen("-gpuSessions "), "%d", &nMaxSession) == 1 && nMaxSession > 0) {
+		GpuScheduler::GetShared()->SetSessionLimit(nMaxSession);
+	}
+	EncoderRuntime::GetShared()->Prewarm(iDevice, pAppParam->numPlayers * (1 + nRendition));
+}
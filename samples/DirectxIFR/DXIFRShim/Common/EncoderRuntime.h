@@ -0,0 +1,132 @@
+/*!
+ * \brief
+ * Process-wide NVENC runtime: the API table, one CUDA context per device
+ * and a pool of pre-opened encoder sessions
+ *
+ * \file
+ *
+ * Every CNvEncoder used to load nvEncodeAPI, initialize CUDA, create a
+ * context and open an encode session on the first Present of its swap
+ * chain, which stalled the game and delayed the first frame of the stream.
+ * The runtime loads the library and initializes CUDA once per process, and
+ * all encoders on a device share one context, so that the driver keeps
+ * one set of context memory instead of one per player. Prewarm() opens the sessions the players
+ * will need on a pool worker as soon as the shim's first D3D entry point
+ * runs, and AcquireSession() hands them to the encoders. An encoder that
+ * finds the pool empty opens its session itself, as before.
+ *
+ * A session is an NVENC session with a reference to its device's context.
+ * The encoder that acquires it destroys the session and releases the
+ * reference on shutdown; the last reference destroys the context.
+ *
+ * The NVENC and CUDA libraries can be replaced before first use, e.g. by a
+ * stub driver. Like TaskPool, the shared runtime is never destroyed.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "inc/dynlink_cuda.h"
+#include "inc/nvEncodeAPI.h"
+#include "AppParam.h"
+
+// How long an encoder waits for the session the warm-up is opening before it opens its own
+#define SESSION_WAIT_MS 5000
+
+struct EncoderSession {
+	int iDevice;
+	CUcontext cuContext;
+	void *hEncoder;
+};
+
+class EncoderRuntime
+{
+public:
+	struct Stats {
+		// Contexts alive and references to them
+		int nContext;
+		int nContextRef;
+		// Sessions opened by the warm-up, and how long it took
+		int nWarmed;
+		uint64_t qwWarmUs;
+		// Encoders that got a pre-opened session, and those that did not
+		int nHit;
+		int nMiss;
+	};
+
+	static EncoderRuntime *GetShared();
+
+	// Replaces nvEncodeAPI(64).dll; returns false once the API is loaded
+	bool SetLibrary(const char *szNvEncLibrary);
+	// Replaces nvcuda.dll; returns false once CUDA is initialized
+	bool SetCudaLibrary(const char *szCudaLibrary);
+	// The NVENC function table, loaded on first use; NULL if the library cannot be loaded
+	NV_ENCODE_API_FUNCTION_LIST *GetApi();
+	// Initializes CUDA on first use and checks once that device iDevice can encode
+	NVENCSTATUS GetCudaDevice(int iDevice, CUdevice *pDevice);
+	// CUDA devices, 0 if CUDA cannot be initialized
+	int GetDeviceCount();
+	uint64_t GetDeviceMemory(int iDevice);
+	// A reference to the context of device iDevice, created on first use and current on no thread
+	NVENCSTATUS AcquireContext(int iDevice, CUcontext *pContext);
+	void ReleaseContext(CUcontext cuContext);
+
+	/* Opens nSession sessions on device iDevice on a pool worker, or with iDevice -1 on the
+	   devices GpuScheduler will place them on; only the first call has an effect */
+	void Prewarm(int iDevice, int nSession);
+	/* Takes a pre-opened session of device iDevice, waiting for one the warm-up is
+	   still opening. Returns false when there is none; the caller then opens its own.*/
+	bool AcquireSession(int iDevice, EncoderSession *pSession);
+	// Destroys the sessions nobody acquired and returns how many there were
+	int DrainPool();
+	// Opens a session with a context reference of its own, without the pool
+	NVENCSTATUS OpenSession(int iDevice, EncoderSession *pSession);
+	void DestroySession(EncoderSession &session);
+
+	Stats GetStats();
+
+private:
+	EncoderRuntime();
+	bool InitCuda();
+	void WarmTask(int iDevice, int nSession);
+
+	std::mutex mtx;
+	std::condition_variable cvSession;
+
+	std::string strNvEncLibrary;
+	bool bApiLoaded;
+	NVENCSTATUS apiStatus;
+	NV_ENCODE_API_FUNCTION_LIST api;
+
+	std::string strCudaLibrary;
+	bool bCudaInitialized;
+	CUresult cuInitResult;
+	std::map<int, CUdevice> mpDevice;
+	struct SharedContext {
+		CUcontext cuContext;
+		int nRef;
+	};
+	std::map<int, SharedContext> mpContext;
+
+	bool bPrewarmed;
+	// -1 when the sessions are spread over the devices
+	int iWarmDevice;
+	// Sessions the warm-up has yet to open
+	int nWarming;
+	std::vector<EncoderSession> vSession;
+	Stats stats;
+};
+
+// Sizes the pool for the players and simulcast renditions of pAppParam and starts the warm-up
+void PrewarmEncoders(AppParam *pAppParam);
@@ -0,0 +1,632 @@
+/*!
+ * \brief
+ * The implementation of the FEC kernels, FecEncoder and FecDecoder
+ *
+ * \file
+ *
+ * GF(2^8) uses the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11D). The parity
+ * row j of a block has the coefficients 1 / (x_j + y_i) with x_j = FEC_MAX_K + j
+ * and y_i = i, a Cauchy matrix, so every square submatrix of it is invertible
+ * and the decoder never meets a singular system.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "Fec.h"
+
+#ifdef _WIN32
+#include <intrin.h>
+#define FEC_TARGET(x)
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define FEC_TARGET(x) __attribute__((target(x)))
+#endif
+
+struct GfTables {
+	uint8_t aExp[512];
+	uint8_t aLog[256];
+	// c * n and c * (n << 4) for every nibble n, the pshufb lookup tables
+	uint8_t aLow[256][16];
+	uint8_t aHigh[256][16];
+
+	GfTables()
+	{
+		unsigned int x = 1;
+		for (int i = 0; i < 255; i++) {
+			aExp[i] = (uint8_t)x;
+			aLog[x] = (uint8_t)i;
+			x <<= 1;
+			if (x & 0x100) {
+				x ^= 0x11D;
+			}
+		}
+		for (int i = 255; i < 512; i++) {
+			aExp[i] = aExp[i - 255];
+		}
+		aLog[0] = 0;
+		for (int c = 0; c < 256; c++) {
+			for (int n = 0; n < 16; n++) {
+				aLow[c][n] = Mul((uint8_t)c, (uint8_t)n);
+				aHigh[c][n] = Mul((uint8_t)c, (uint8_t)(n << 4));
+			}
+		}
+	}
+	uint8_t Mul(uint8_t a, uint8_t b) const
+	{
+		return a && b ? aExp[aLog[a] + aLog[b]] : 0;
+	}
+	uint8_t Inv(uint8_t a) const
+	{
+		return aExp[255 - aLog[a]];
+	}
+};
+
+static GfTables gf;
+
+static inline uint8_t Cauchy(unsigned int j, unsigned int i)
+{
+	return gf.Inv((uint8_t)((FEC_MAX_K + j) ^ i));
+}
+
+static void XorSse2(uint8_t *pDst, const uint8_t *pSrc, size_t cb)
+{
+	size_t i = 0;
+	for (; i + 16 <= cb; i += 16) {
+		__m128i d = _mm_loadu_si128((const __m128i *)(pDst + i));
+		__m128i s = _mm_loadu_si128((const __m128i *)(pSrc + i));
+		_mm_storeu_si128((__m128i *)(pDst + i), _mm_xor_si128(d, s));
+	}
+	for (; i < cb; i++) {
+		pDst[i] ^= pSrc[i];
+	}
+}
+
+FEC_TARGET("avx2") static void XorAvx2(uint8_t *pDst, const uint8_t *pSrc, size_t cb)
+{
+	size_t i = 0;
+	for (; i + 32 <= cb; i += 32) {
+		__m256i d = _mm256_loadu_si256((const __m256i *)(pDst + i));
+		__m256i s = _mm256_loadu_si256((const __m256i *)(pSrc + i));
+		_mm256_storeu_si256((__m256i *)(pDst + i), _mm256_xor_si256(d, s));
+	}
+	XorSse2(pDst + i, pSrc + i, cb - i);
+}
+
+static void MulAddScalar(uint8_t *pDst, const uint8_t *pSrc, uint8_t c, size_t cb)
+{
+	const uint8_t *pLow = gf.aLow[c], *pHigh = gf.aHigh[c];
+	for (size_t i = 0; i < cb; i++) {
+		pDst[i] ^= pLow[pSrc[i] & 0xF] ^ pHigh[pSrc[i] >> 4];
+	}
+}
+
+FEC_TARGET("ssse3") static void MulAddSsse3(uint8_t *pDst, const uint8_t *pSrc, uint8_t c, size_t cb)
+{
+	__m128i low = _mm_loadu_si128((const __m128i *)gf.aLow[c]);
+	__m128i high = _mm_loadu_si128((const __m128i *)gf.aHigh[c]);
+	__m128i mask = _mm_set1_epi8(0xF);
+	size_t i = 0;
+	for (; i + 16 <= cb; i += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(pSrc + i));
+		__m128i p = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(s, mask)),
+			_mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+		__m128i d = _mm_loadu_si128((const __m128i *)(pDst + i));
+		_mm_storeu_si128((__m128i *)(pDst + i), _mm_xor_si128(d, p));
+	}
+	MulAddScalar(pDst + i, pSrc + i, c, cb - i);
+}
+
+FEC_TARGET("avx2") static void MulAddAvx2(uint8_t *pDst, const uint8_t *pSrc, uint8_t c, size_t cb)
+{
+	// pshufb looks up within each 128-bit lane, so both lanes get the same table
+	__m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf.aLow[c]));
+	__m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf.aHigh[c]));
+	__m256i mask = _mm256_set1_epi8(0xF);
+	size_t i = 0;
+	for (; i + 32 <= cb; i += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(pSrc + i));
+		__m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(s, mask)),
+			_mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(pDst + i));
+		_mm256_storeu_si256((__m256i *)(pDst + i), _mm256_xor_si256(d, p));
+	}
+	MulAddScalar(pDst + i, pSrc + i, c, cb - i);
+}
+
+static void CpuId(int aReg[4], int iLeaf)
+{
+#ifdef _WIN32
+	__cpuidex(aReg, iLeaf, 0);
+#else
+	__cpuid_count(iLeaf, 0, aReg[0], aReg[1], aReg[2], aReg[3]);
+#endif
+}
+
+static bool CpuHas(FecKernel eKernel)
+{
+	if (eKernel == FEC_KERNEL_SCALAR) {
+		return true;
+	}
+	int aReg[4];
+	CpuId(aReg, 0);
+	int nMaxLeaf = aReg[0];
+	CpuId(aReg, 1);
+	bool bSsse3 = (aReg[2] >> 9) & 1;
+	if (eKernel == FEC_KERNEL_SSSE3) {
+		return bSsse3;
+	}
+	// AVX2 also needs the OS to save the YMM registers
+	bool bOsXsave = (aReg[2] >> 27) & 1, bAvx = (aReg[2] >> 28) & 1;
+	if (!bSsse3 || !bOsXsave || !bAvx || nMaxLeaf < 7) {
+		return false;
+	}
+#ifdef _WIN32
+	unsigned long long qwXcr0 = _xgetbv(0);
+#else
+	unsigned int uLow, uHigh;
+	__asm__ __volatile__("xgetbv" : "=a"(uLow), "=d"(uHigh) : "c"(0));
+	unsigned long long qwXcr0 = ((unsigned long long)uHigh << 32) | uLow;
+#endif
+	if ((qwXcr0 & 6) != 6) {
+		return false;
+	}
+	CpuId(aReg, 7);
+	return (aReg[1] >> 5) & 1;
+}
+
+static FecKernel eCurrentKernel = FEC_KERNEL_SCALAR;
+static void (*pfnMulAdd)(uint8_t *, const uint8_t *, uint8_t, size_t) = MulAddScalar;
+static void (*pfnXor)(uint8_t *, const uint8_t *, size_t) = XorSse2;
+
+bool FecSelectKernel(FecKernel eKernel)
+{
+	if (!CpuHas(eKernel)) {
+		return false;
+	}
+	switch (eKernel) {
+	case FEC_KERNEL_SCALAR:
+		pfnMulAdd = MulAddScalar;
+		pfnXor = XorSse2;
+		break;
+	case FEC_KERNEL_SSSE3:
+		pfnMulAdd = MulAddSsse3;
+		pfnXor = XorSse2;
+		break;
+	case FEC_KERNEL_AVX2:
+		pfnMulAdd = MulAddAvx2;
+		pfnXor = XorAvx2;
+		break;
+	}
+	eCurrentKernel = eKernel;
+	return true;
+}
+
+FecKernel FecGetKernel()
+{
+	return eCurrentKernel;
+}
+
+// Picks the best kernel when the module is loaded, after gf is built
+static struct FecKernelInit {
+	FecKernelInit()
+	{
+		if (!FecSelectKernel(FEC_KERNEL_AVX2)) {
+			FecSelectKernel(FEC_KERNEL_SSSE3);
+		}
+	}
+} fecKernelInit;
+
+void FecMulAdd(uint8_t *pDst, const uint8_t *pSrc, uint8_t c, size_t cb)
+{
+	if (c == 0) {
+		return;
+	}
+	if (c == 1) {
+		pfnXor(pDst, pSrc, cb);
+		return;
+	}
+	pfnMulAdd(pDst, pSrc, c, cb);
+}
+
+void FecXor(uint8_t *pDst, const uint8_t *pSrc, size_t cb)
+{
+	pfnXor(pDst, pSrc, cb);
+}
+
+static inline void Put16(uint8_t *p, unsigned int v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void Put32(uint8_t *p, uint32_t v)
+{
+	Put16(p, v & 0xFFFF);
+	Put16(p + 2, v >> 16);
+}
+
+static inline unsigned int Get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t Get32(const uint8_t *p)
+{
+	return Get16(p) | ((uint32_t)Get16(p + 2) << 16);
+}
+
+static inline unsigned int ParityCount(FecMode eMode, unsigned int m, unsigned int k, unsigned int kBlock)
+{
+	if (eMode == FEC_NONE || !m) {
+		return 0;
+	}
+	// A short last block gets proportionally fewer parity packets, but at least one
+	unsigned int mBlock = (m * kBlock + k - 1) / k;
+	return eMode == FEC_XOR && mBlock > kBlock ? kBlock : mBlock;
+}
+
+FecEncoder::FecEncoder(FecMode eMode, unsigned int k, unsigned int m, bool bAdaptive)
+{
+	Configure(eMode, k, m, bAdaptive);
+}
+
+void FecEncoder::Configure(FecMode eMode, unsigned int k, unsigned int m, bool bAdaptive)
+{
+	this->eMode = eMode;
+	this->k = k < 1 ? 1 : (k > FEC_MAX_K ? FEC_MAX_K : k);
+	mMax = m > FEC_MAX_M ? FEC_MAX_M : m;
+	mCurrent = mMax;
+	this->bAdaptive = bAdaptive;
+}
+
+void FecEncoder::SetLossRatio(double lossRatio)
+{
+	if (!bAdaptive || !mMax) {
+		return;
+	}
+	// Twice the losses a block is expected to see, so that a bad run is still covered
+	unsigned int m = (unsigned int)ceil(2 * lossRatio * k);
+	mCurrent = m < 1 ? 1 : (m > mMax ? mMax : m);
+}
+
+unsigned int FecEncoder::Encode(const uint8_t *pFrame, size_t cbFrame, uint32_t dwFrame, std::vector<std::vector<uint8_t> > &vPacket)
+{
+	unsigned int nData = cbFrame ? (unsigned int)((cbFrame + FEC_MAX_PAYLOAD - 1) / FEC_MAX_PAYLOAD) : 1;
+	// Equal sizes keep the padding of the parity symbols small
+	unsigned int cbSymbol = (unsigned int)((cbFrame + nData - 1) / nData);
+	nData = cbSymbol ? (unsigned int)((cbFrame + cbSymbol - 1) / cbSymbol) : 1;
+	unsigned int nBlock = (nData + k - 1) / k;
+
+	unsigned int nPacket = 0, nParity = 0;
+	for (unsigned int b = 0; b < nBlock; b++) {
+		unsigned int kBlock = nData - b * k < k ? nData - b * k : k;
+		unsigned int mBlock = cbSymbol ? ParityCount(eMode, mCurrent, k, kBlock) : 0;
+		nPacket += kBlock + mBlock;
+		nParity += mBlock;
+	}
+	vPacket.resize(nPacket);
+	vPadded.resize(cbSymbol);
+
+	unsigned int iPacket = 0;
+	for (unsigned int b = 0; b < nBlock; b++) {
+		unsigned int kBlock = nData - b * k < k ? nData - b * k : k;
+		unsigned int mBlock = cbSymbol ? ParityCount(eMode, mCurrent, k, kBlock) : 0;
+		unsigned int iFirst = iPacket;
+		for (unsigned int i = 0; i < kBlock + mBlock; i++) {
+			size_t offset = (size_t)(b * k + i) * cbSymbol;
+			size_t cb = i < kBlock ? (cbFrame - offset < cbSymbol ? cbFrame - offset : cbSymbol) : cbSymbol;
+			std::vector<uint8_t> &vData = vPacket[iPacket++];
+			vData.resize(FEC_HEADER_SIZE + cb);
+			uint8_t *p = &vData[0];
+			p[0] = 'F';
+			p[1] = (uint8_t)eMode;
+			p[2] = (uint8_t)k;
+			p[3] = (uint8_t)kBlock;
+			p[4] = (uint8_t)mBlock;
+			p[5] = (uint8_t)i;
+			Put16(p + 6, cbSymbol);
+			Put16(p + 8, b);
+			Put16(p + 10, nBlock);
+			Put32(p + 12, dwFrame);
+			Put32(p + 16, (uint32_t)cbFrame);
+			if (i < kBlock) {
+				if (cb) {
+					memcpy(p + FEC_HEADER_SIZE, pFrame + offset, cb);
+				}
+			} else {
+				memset(p + FEC_HEADER_SIZE, 0, cb);
+			}
+		}
+
+		for (unsigned int i = 0; i < kBlock && mBlock; i++) {
+			// The data packet holds the symbol already; only the frame's last one needs padding
+			const uint8_t *pSymbol = &vPacket[iFirst + i][FEC_HEADER_SIZE];
+			size_t cb = vPacket[iFirst + i].size() - FEC_HEADER_SIZE;
+			if (cb < cbSymbol) {
+				memcpy(&vPadded[0], pSymbol, cb);
+				memset(&vPadded[cb], 0, cbSymbol - cb);
+				pSymbol = &vPadded[0];
+			}
+			if (eMode == FEC_XOR) {
+				FecXor(&vPacket[iFirst + kBlock + i % mBlock][FEC_HEADER_SIZE], pSymbol, cbSymbol);
+			} else {
+				for (unsigned int j = 0; j < mBlock; j++) {
+					FecMulAdd(&vPacket[iFirst + kBlock + j][FEC_HEADER_SIZE], pSymbol, Cauchy(j, i), cbSymbol);
+				}
+			}
+		}
+	}
+	return nParity;
+}
+
+FecDecoder::FecDecoder(unsigned int nMaxPendingFrame) : nMaxPendingFrame(nMaxPendingFrame ? nMaxPendingFrame : 1)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+bool FecDecoder::IsFinished(uint32_t dwFrame)
+{
+	for (size_t i = 0; i < dqFinished.size(); i++) {
+		if (dqFinished[i] == dwFrame) {
+			return true;
+		}
+	}
+	return false;
+}
+
+FecDecoder::Frame *FecDecoder::FindFrame(uint32_t dwFrame, bool bCreate)
+{
+	for (size_t i = 0; i < dqFrame.size(); i++) {
+		if (dqFrame[i].dwFrame == dwFrame) {
+			return &dqFrame[i];
+		}
+	}
+	if (!bCreate) {
+		return NULL;
+	}
+	if (dqFrame.size() >= nMaxPendingFrame) {
+		// Too late to be useful; the viewer asks for recovery through its loss reports
+		stats.nLostFrame++;
+		dqFinished.push_back(dqFrame.front().dwFrame);
+		dqFrame.pop_front();
+	}
+	dqFrame.push_back(Frame());
+	dqFrame.back().dwFrame = dwFrame;
+	return &dqFrame.back();
+}
+
+void FecDecoder::Receive(const uint8_t *pPacket, size_t cbPacket,
+	const std::function<void(const uint8_t *pFrame, size_t cbFrame, uint32_t dwFrame)> &onFrame)
+{
+	stats.nPacket++;
+	if (cbPacket < FEC_HEADER_SIZE || pPacket[0] != 'F' || pPacket[1] > FEC_RS) {
+		stats.nBadPacket++;
+		return;
+	}
+	FecMode eMode = (FecMode)pPacket[1];
+	unsigned int k = pPacket[2], kBlock = pPacket[3], mBlock = pPacket[4], index = pPacket[5];
+	unsigned int cbSymbol = Get16(pPacket + 6), iBlock = Get16(pPacket + 8), nBlock = Get16(pPacket + 10);
+	uint32_t dwFrame = Get32(pPacket + 12), cbFrame = Get32(pPacket + 16);
+	size_t cbPayload = cbPacket - FEC_HEADER_SIZE;
+	unsigned int nData = cbSymbol ? (cbFrame + cbSymbol - 1) / cbSymbol : 1;
+	if (!k || k > FEC_MAX_K || !kBlock || kBlock > k || mBlock > FEC_MAX_M || index >= kBlock + mBlock
+		|| iBlock >= nBlock || cbSymbol > FEC_MAX_PAYLOAD || cbPayload > cbSymbol
+		|| nBlock != (nData + k - 1) / k || iBlock * k + kBlock > nData || (iBlock + 1 < nBlock && kBlock != k)
+		|| (index >= kBlock && cbPayload != cbSymbol)) {
+		stats.nBadPacket++;
+		return;
+	}
+	if (IsFinished(dwFrame)) {
+		return;
+	}
+
+	Frame *pFrame = FindFrame(dwFrame, true);
+	if (pFrame->vBlock.empty()) {
+		pFrame->cbFrame = cbFrame;
+		pFrame->eMode = eMode;
+		pFrame->k = k;
+		pFrame->cbSymbol = cbSymbol;
+		pFrame->nBlockDone = 0;
+		pFrame->vData.assign((size_t)nData * cbSymbol, 0);
+		pFrame->vBlock.resize(nBlock);
+		for (unsigned int b = 0; b < nBlock; b++) {
+			Block &block = pFrame->vBlock[b];
+			block.kBlock = block.mBlock = 0;
+			block.qwDataMask = 0;
+			block.nData = block.nParity = 0;
+			block.bDone = false;
+		}
+	} else if (pFrame->cbFrame != cbFrame || pFrame->k != k || pFrame->cbSymbol != cbSymbol || pFrame->eMode != eMode) {
+		stats.nBadPacket++;
+		return;
+	}
+
+	Block &block = pFrame->vBlock[iBlock];
+	if (block.bDone) {
+		return;
+	}
+	if (!block.kBlock) {
+		block.kBlock = kBlock;
+		block.mBlock = mBlock;
+		block.vParity.resize(mBlock);
+	} else if (block.kBlock != kBlock || block.mBlock != mBlock) {
+		stats.nBadPacket++;
+		return;
+	}
+
+	if (index < kBlock) {
+		uint64_t qwBit = 1ULL << index;
+		if (!(block.qwDataMask & qwBit)) {
+			if (cbPayload) {
+				memcpy(&pFrame->vData[(size_t)(iBlock * k + index) * cbSymbol], pPacket + FEC_HEADER_SIZE, cbPayload);
+			}
+			block.qwDataMask |= qwBit;
+			block.nData++;
+		}
+	} else if (block.vParity[index - kBlock].empty()) {
+		block.vParity[index - kBlock].assign(pPacket + FEC_HEADER_SIZE, pPacket + cbPacket);
+		block.nParity++;
+	}
+
+	if (block.nData == kBlock) {
+		block.bDone = true;
+	} else if (block.nParity) {
+		Recover(*pFrame, iBlock);
+	}
+	if (!block.bDone) {
+		return;
+	}
+	block.vParity.clear();
+	if (++pFrame->nBlockDone < nBlock) {
+		return;
+	}
+
+	stats.nFrame++;
+	onFrame(pFrame->vData.empty() ? NULL : &pFrame->vData[0], pFrame->cbFrame, dwFrame);
+	dqFinished.push_back(dwFrame);
+	if (dqFinished.size() > 64) {
+		dqFinished.pop_front();
+	}
+	for (std::deque<Frame>::iterator it = dqFrame.begin(); it != dqFrame.end(); ++it) {
+		if (it->dwFrame == dwFrame) {
+			dqFrame.erase(it);
+			break;
+		}
+	}
+}
+
+void FecDecoder::Recover(Frame &frame, unsigned int iBlock)
+{
+	Block &block = frame.vBlock[iBlock];
+	unsigned int iFirst = iBlock * frame.k;
+	if (frame.eMode == FEC_XOR) {
+		RecoverXor(frame, block, iFirst);
+	} else if (frame.eMode == FEC_RS && block.nData + block.nParity >= block.kBlock) {
+		RecoverRs(frame, block, iFirst);
+	}
+	if (block.nData == block.kBlock) {
+		block.bDone = true;
+	}
+}
+
+void FecDecoder::RecoverXor(Frame &frame, Block &block, unsigned int iFirst)
+{
+	size_t cbSymbol = frame.cbSymbol;
+	for (unsigned int j = 0; j < block.mBlock; j++) {
+		if (block.vParity[j].empty()) {
+			continue;
+		}
+		unsigned int nMissing = 0, iMissing = 0;
+		for (unsigned int i = j; i < block.kBlock; i += block.mBlock) {
+			if (!(block.qwDataMask & (1ULL << i))) {
+				nMissing++;
+				iMissing = i;
+			}
+		}
+		if (nMissing != 1) {
+			continue;
+		}
+		uint8_t *pDst = &frame.vData[(iFirst + iMissing) * cbSymbol];
+		memcpy(pDst, &block.vParity[j][0], cbSymbol);
+		for (unsigned int i = j; i < block.kBlock; i += block.mBlock) {
+			if (i != iMissing) {
+				FecXor(pDst, &frame.vData[(iFirst + i) * cbSymbol], cbSymbol);
+			}
+		}
+		block.qwDataMask |= 1ULL << iMissing;
+		block.nData++;
+		stats.nRecoveredPacket++;
+	}
+}
+
+void FecDecoder::RecoverRs(Frame &frame, Block &block, unsigned int iFirst)
+{
+	size_t cbSymbol = frame.cbSymbol;
+	unsigned int aMissing[FEC_MAX_K], aParity[FEC_MAX_M];
+	unsigned int nMissing = 0, nParity = 0;
+	for (unsigned int i = 0; i < block.kBlock; i++) {
+		if (!(block.qwDataMask & (1ULL << i))) {
+			aMissing[nMissing++] = i;
+		}
+	}
+	for (unsigned int j = 0; j < block.mBlock && nParity < nMissing; j++) {
+		if (!block.vParity[j].empty()) {
+			aParity[nParity++] = j;
+		}
+	}
+
+	// Take the known data out of the parity, leaving nMissing equations in the missing symbols
+	vScratch.resize(nMissing * cbSymbol);
+	for (unsigned int r = 0; r < nMissing; r++) {
+		uint8_t *pSyndrome = &vScratch[r * cbSymbol];
+		memcpy(pSyndrome, &block.vParity[aParity[r]][0], cbSymbol);
+		for (unsigned int i = 0; i < block.kBlock; i++) {
+			if (block.qwDataMask & (1ULL << i)) {
+				FecMulAdd(pSyndrome, &frame.vData[(iFirst + i) * cbSymbol], Cauchy(aParity[r], i), cbSymbol);
+			}
+		}
+	}
+
+	// Gauss-Jordan inversion of the Cauchy submatrix [parity rows x missing columns]
+	uint8_t a[FEC_MAX_M][FEC_MAX_M * 2];
+	for (unsigned int r = 0; r < nMissing; r++) {
+		for (unsigned int c = 0; c < nMissing; c++) {
+			a[r][c] = Cauchy(aParity[r], aMissing[c]);
+			a[r][nMissing + c] = r == c;
+		}
+	}
+	for (unsigned int c = 0; c < nMissing; c++) {
+		unsigned int p = c;
+		while (p < nMissing && !a[p][c]) {
+			p++;
+		}
+		if (p == nMissing) {
+			return;
+		}
+		if (p != c) {
+			for (unsigned int x = 0; x < nMissing * 2; x++) {
+				uint8_t t = a[p][x];
+				a[p][x] = a[c][x];
+				a[c][x] = t;
+			}
+		}
+		uint8_t inv = gf.Inv(a[c][c]);
+		for (unsigned int x = 0; x < nMissing * 2; x++) {
+			a[c][x] = gf.Mul(a[c][x], inv);
+		}
+		for (unsigned int r = 0; r < nMissing; r++) {
+			uint8_t f = a[r][c];
+			if (r == c || !f) {
+				continue;
+			}
+			for (unsigned int x = 0; x < nMissing * 2; x++) {
+				a[r][x] ^= gf.Mul(f, a[c][x]);
+			}
+		}
+	}
+
+	for (unsigned int c = 0; c < nMissing; c++) {
+		uint8_t *pDst = &frame.vData[(iFirst + aMissing[c]) * cbSymbol];
+		memset(pDst, 0, cbSymbol);
+		for (unsigned int r = 0; r < nMissing; r++) {
+			FecMulAdd(pDst, &vScratch[r * cbSymbol], a[c][nMissing + r], cbSymbol);
+		}
+		block.qwDataMask |= 1ULL << aMissing[c];
+		block.nData++;
+		stats.nRecoveredPacket++;
+	}
+}
+
+FecDecoder::Stats FecDecoder::TakeStats()
+{
+	Stats ret = stats;
+	memset(&stats, 0, sizeof(stats));
+	return ret;
+}
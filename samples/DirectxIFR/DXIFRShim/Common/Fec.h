@@ -0,0 +1,153 @@
+/*!
+ * \brief
+ * Forward error correction for the UDP output: packetizer, block encoder
+ * and receiver-side decoder
+ *
+ * \file
+ *
+ * Every frame is split into data packets of equal size (the last one may be
+ * shorter), and the data packets are grouped into blocks of k. Each block
+ * gets m parity packets:
+ *
+ *  - FEC_RS: a systematic Reed-Solomon code over GF(2^8) built from a
+ *    Cauchy matrix, so any k of the k + m packets restore the block;
+ *  - FEC_XOR: parity j is the XOR of the data packets i with i % m == j,
+ *    which repairs one loss per parity group (a burst of up to m losses)
+ *    at almost no CPU cost.
+ *
+ * With adaptation on, m follows the observed loss ratio: twice the
+ * expected losses per block, at least one and at most the configured m.
+ *
+ * Packet layout (little endian): FEC_HEADER_SIZE bytes of header, then the
+ * symbol. Data packets may be truncated at the end of the frame; symbols
+ * are zero padded for coding.
+ *
+ *   0 'F'  1 mode  2 k  3 k of this block  4 m of this block  5 index in block
+ *   6 symbol size (uint16)  8 block (uint16)  10 block count (uint16)
+ *  12 frame number (uint32)  16 frame size (uint32)
+ *
+ * The GF(2^8) multiply-add runs on AVX2 or SSSE3 (split nibble tables with
+ * pshufb) when the CPU has it, with a table based fallback.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <vector>
+
+#define FEC_HEADER_SIZE 20
+// Fits a packet into one UDP datagram without IP fragmentation
+#define FEC_DATAGRAM_SIZE 1200
+#define FEC_MAX_PAYLOAD (FEC_DATAGRAM_SIZE - FEC_HEADER_SIZE)
+#define FEC_MAX_K 64
+#define FEC_MAX_M 32
+
+enum FecMode {
+	FEC_NONE = 0,
+	FEC_XOR = 1,
+	FEC_RS = 2,
+};
+
+enum FecKernel {
+	FEC_KERNEL_SCALAR,
+	FEC_KERNEL_SSSE3,
+	FEC_KERNEL_AVX2,
+};
+
+// The best kernel is picked at load time; returns false if the CPU lacks eKernel
+bool FecSelectKernel(FecKernel eKernel);
+FecKernel FecGetKernel();
+// pDst ^= c * pSrc over GF(2^8)
+void FecMulAdd(uint8_t *pDst, const uint8_t *pSrc, uint8_t c, size_t cb);
+void FecXor(uint8_t *pDst, const uint8_t *pSrc, size_t cb);
+
+class FecEncoder
+{
+public:
+	FecEncoder(FecMode eMode = FEC_RS, unsigned int k = 10, unsigned int m = 4, bool bAdaptive = true);
+
+	void Configure(FecMode eMode, unsigned int k, unsigned int m, bool bAdaptive);
+	// Sets the parity count from the loss ratio seen by the receiver, when adapting
+	void SetLossRatio(double lossRatio);
+	unsigned int GetParityCount()
+	{
+		return mCurrent;
+	}
+
+	/*! Splits the frame into data and parity packets. vPacket is resized to the
+	    packet count; its buffers are reused from call to call. Returns the number
+	    of parity packets. */
+	unsigned int Encode(const uint8_t *pFrame, size_t cbFrame, uint32_t dwFrame, std::vector<std::vector<uint8_t> > &vPacket);
+
+private:
+	FecMode eMode;
+	unsigned int k, mMax, mCurrent;
+	bool bAdaptive;
+	// Zero padded copy of a block's last data symbol
+	std::vector<uint8_t> vPadded;
+};
+
+class FecDecoder
+{
+public:
+	struct Stats {
+		unsigned int nFrame;
+		// Frames given up because a block could not be restored in time
+		unsigned int nLostFrame;
+		unsigned int nPacket;
+		// Data packets restored from parity
+		unsigned int nRecoveredPacket;
+		unsigned int nBadPacket;
+	};
+
+	// nMaxPendingFrame frames may be incomplete at once before the oldest is given up
+	FecDecoder(unsigned int nMaxPendingFrame = 8);
+
+	/*! Takes one datagram. Each frame that becomes complete, directly or through
+	    recovery, is handed to onFrame, in the order of completion. */
+	void Receive(const uint8_t *pPacket, size_t cbPacket,
+		const std::function<void(const uint8_t *pFrame, size_t cbFrame, uint32_t dwFrame)> &onFrame);
+
+	Stats TakeStats();
+
+private:
+	struct Block {
+		unsigned int kBlock, mBlock;
+		uint64_t qwDataMask;
+		unsigned int nData, nParity;
+		std::vector<std::vector<uint8_t> > vParity;
+		bool bDone;
+	};
+	struct Frame {
+		uint32_t dwFrame;
+		uint32_t cbFrame;
+		FecMode eMode;
+		unsigned int k;
+		unsigned int cbSymbol;
+		unsigned int nBlockDone;
+		std::vector<uint8_t> vData;
+		std::vector<Block> vBlock;
+	};
+
+	Frame *FindFrame(uint32_t dwFrame, bool bCreate);
+	bool IsFinished(uint32_t dwFrame);
+	void Recover(Frame &frame, unsigned int iBlock);
+	void RecoverXor(Frame &frame, Block &block, unsigned int iFirst);
+	void RecoverRs(Frame &frame, Block &block, unsigned int iFirst);
+
+	unsigned int nMaxPendingFrame;
+	std::deque<Frame> dqFrame;
+	// Recently finished or given up frames, whose late packets are ignored
+	std::deque<uint32_t> dqFinished;
+	std::vector<uint8_t> vScratch;
+	Stats stats;
+};
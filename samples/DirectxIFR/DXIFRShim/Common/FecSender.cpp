@@ -0,0 +1,151 @@
+/*!
+ * \brief
+ * The implementation of FecSender
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define INVALID_SOCKET -1
+#define closesocket close
+#endif
+#include "FecSender.h"
+#include "Logger.h"
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#endif
+
+extern simplelogger::Logger *logger;
+
+FecSender::FecSender(int index) : index(index), sock(INVALID_SOCKET), dwChunk(0)
+{
+	memset(&addrDest, 0, sizeof(addrDest));
+	memset(&stats, 0, sizeof(stats));
+}
+
+FecSender::~FecSender()
+{
+	Close();
+}
+
+bool FecSender::Open(const char *szDest, FecMode eMode, unsigned int k, unsigned int m, bool bAdaptive, int iPortOffset)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (sock != INVALID_SOCKET) {
+		return false;
+	}
+	std::string strDest(szDest);
+	size_t iColon = strDest.rfind(':');
+	if (iColon == std::string::npos) {
+		LOG_ERROR(logger, "UDP destination of player " << index << " has no port: " << szDest);
+		return false;
+	}
+	std::string strHost = strDest.substr(0, iColon);
+	int iPort = atoi(strDest.c_str() + iColon + 1) + index + iPortOffset;
+
+#ifdef _WIN32
+	WSADATA w;
+	if (WSAStartup(0x0101, &w) != 0) {
+		LOG_ERROR(logger, "WSAStartup() failed");
+		return false;
+	}
+#endif
+	struct hostent *pHost = gethostbyname(strHost.c_str());
+	if (!pHost || pHost->h_addrtype != AF_INET) {
+		LOG_ERROR(logger, "Cannot resolve UDP destination of player " << index << ": " << strHost);
+#ifdef _WIN32
+		WSACleanup();
+#endif
+		return false;
+	}
+	addrDest.sin_family = AF_INET;
+	addrDest.sin_port = htons((unsigned short)iPort);
+	memcpy(&addrDest.sin_addr, pHost->h_addr_list[0], sizeof(addrDest.sin_addr));
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock == INVALID_SOCKET) {
+		LOG_ERROR(logger, "socket() failed for player " << index);
+#ifdef _WIN32
+		WSACleanup();
+#endif
+		return false;
+	}
+	// A burst of one key frame's packets must not overflow the socket buffer
+	int cbSendBuffer = 4 << 20;
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char *)&cbSendBuffer, sizeof(cbSendBuffer));
+
+	encoder.Configure(eMode, k, m, bAdaptive);
+	LOG_INFO(logger, "UDP output of player " << index << " to " << strHost << ":" << iPort << ", FEC mode " << eMode << ", k=" << k << ", m=" << m
+		<< (bAdaptive ? " (adaptive)" : ""));
+	return true;
+}
+
+void FecSender::Close()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (sock == INVALID_SOCKET) {
+		return;
+	}
+	closesocket(sock);
+	sock = INVALID_SOCKET;
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+bool FecSender::IsOpen()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return sock != INVALID_SOCKET;
+}
+
+bool FecSender::Send(const uint8_t *pData, size_t cb)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (sock == INVALID_SOCKET) {
+		return false;
+	}
+	unsigned int nParity = encoder.Encode(pData, cb, dwChunk++, vPacket);
+	bool bSent = true;
+	for (size_t i = 0; i < vPacket.size(); i++) {
+		if (sendto(sock, (const char *)&vPacket[i][0], (int)vPacket[i].size(), 0,
+				(const struct sockaddr *)&addrDest, sizeof(addrDest)) < 0) {
+			stats.nSendError++;
+			bSent = false;
+		}
+		stats.qwBytes += vPacket[i].size();
+	}
+	stats.nChunk++;
+	stats.nPacket += (unsigned int)vPacket.size();
+	stats.nParityPacket += nParity;
+	return bSent;
+}
+
+void FecSender::SetLossRatio(double lossRatio)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	encoder.SetLossRatio(lossRatio);
+}
+
+FecSender::Stats FecSender::TakeStats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	Stats ret = stats;
+	memset(&stats, 0, sizeof(stats));
+	ret.nParityPerBlock = encoder.GetParityCount();
+	return ret;
+}
@@ -0,0 +1,77 @@
+/*!
+ * \brief
+ * UDP output of one player's stream, protected by forward error correction
+ *
+ * \file
+ *
+ * Replaces the ffmpeg pipe when the encoder is given a UDP destination.
+ * Every chunk handed over by the player's SinkQueue (a frame, or a slice in
+ * sub-frame mode) is split into datagrams by FecEncoder and sent right
+ * away, parity included, so the viewer can repair losses without waiting
+ * a round trip for a retransmission. The viewer side reassembles the chunks
+ * with FecDecoder.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#ifdef _WIN32
+#include <winsock.h>
+#else
+#include <netinet/in.h>
+#endif
+#include <mutex>
+#include "Fec.h"
+
+class FecSender
+{
+public:
+	struct Stats {
+		unsigned int nChunk;
+		unsigned int nPacket;
+		unsigned int nParityPacket;
+		unsigned long long qwBytes;
+		unsigned int nSendError;
+		// Current parity packets per block of k
+		unsigned int nParityPerBlock;
+	};
+
+	FecSender(int index = 0);
+	~FecSender();
+
+	void SetIndex(int index)
+	{
+		this->index = index;
+	}
+	// szDest is "host:port"; like the ffmpeg outputs, player i sends to port + i + iPortOffset.
+	// k data packets per block get up to m parity packets
+	bool Open(const char *szDest, FecMode eMode, unsigned int k, unsigned int m, bool bAdaptive = true, int iPortOffset = 0);
+	void Close();
+	bool IsOpen();
+
+	// Packetizes, protects and sends one chunk; the SinkQueue writer thread calls this
+	bool Send(const uint8_t *pData, size_t cb);
+	// The loss ratio reported by the viewer, which sets the parity count when adapting
+	void SetLossRatio(double lossRatio);
+
+	Stats TakeStats();
+
+private:
+	int index;
+	std::mutex mtx;
+#ifdef _WIN32
+	SOCKET sock;
+#else
+	int sock;
+#endif
+	struct sockaddr_in addrDest;
+	FecEncoder encoder;
+	std::vector<std::vector<uint8_t> > vPacket;
+	uint32_t dwChunk;
+	Stats stats;
+};
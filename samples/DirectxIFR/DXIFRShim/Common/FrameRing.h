@@ -0,0 +1,258 @@
+/*!
+ * \brief
+ * Ring of frame slots for passing captured frames through shared memory
+ *
+ * \file
+ *
+ * FrameRing carries the I420 frames of one player from the shim in the game
+ * process (the producer) to the encode service (the consumer, see
+ * EncodeService.h). It is a single-producer/single-consumer ring of
+ * nSlot frame slots that lives in a shared memory block (FrameTransport):
+ * the header below, then the slots, each on a FRAME_RING_ALIGN boundary.
+ *
+ * The producer fills the slot at uTail and publishes it with a release
+ * store of uTail; the consumer sees the frame and its FrameDesc with an
+ * acquire load, encodes it in place and hands the slot back with a release
+ * store of uHead. These two indices are the only fences; no lock is taken.
+ * The producer never waits: the game must not stall on a slow or dead
+ * service, so a frame that finds every slot taken is dropped and counted.
+ *
+ * The consumer sleeps like the one of InputRing, on InputRingSignal: a
+ * named event on Windows, a shared futex on uWakeSeq elsewhere, signalled
+ * only when the consumer announced itself in nSleepers. The consumer also
+ * stamps dwConsumerBeatMs whenever it looks at the ring, so that the
+ * producer can tell that the service is gone.
+ *
+ * Like InputRing, the structure is position independent and Init() must be
+ * called once by the creator before the other side touches it.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include "InputRing.h"
+
+// "FRNG" in the first bytes of the block
+#define FRAME_RING_MAGIC 0x474E5246
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_MAX_SLOT 8
+// Slots start on page boundaries, which also keeps them apart from the header's cache lines
+#define FRAME_RING_ALIGN 4096
+
+// The encoder is to make the frame an IDR
+#define FRAME_FLAG_IDR 0x1
+
+struct FrameDesc {
+	uint32_t dwFrame;
+	// Target of the shim's bandwidth allocator
+	uint32_t dwBitrate;
+	uint32_t dwFlags;
+	uint32_t dwReserved;
+	// Time of Publish(), on the clock of FrameTransport::NowUs()
+	uint64_t qwPublishUs;
+};
+
+struct FrameRing
+{
+	struct Stats {
+		uint32_t nPublished;
+		// Frames the producer had no free slot for
+		uint32_t nDropped;
+	};
+
+	static uint32_t GetSlotSize(uint32_t cbFrame)
+	{
+		return (cbFrame + FRAME_RING_ALIGN - 1) & ~(uint32_t)(FRAME_RING_ALIGN - 1);
+	}
+	static uint32_t GetDataOffset()
+	{
+		return (sizeof(FrameRing) + FRAME_RING_ALIGN - 1) & ~(uint32_t)(FRAME_RING_ALIGN - 1);
+	}
+	// Bytes of shared memory a ring of nSlot frames of cbFrame bytes needs
+	static uint64_t GetSize(uint32_t cbFrame, uint32_t nSlot)
+	{
+		return GetDataOffset() + (uint64_t)GetSlotSize(cbFrame) * nSlot;
+	}
+
+	/*! Sets the ring up, empty, for I420 frames of width x height. nSlot is clamped
+	    to [2, FRAME_RING_MAX_SLOT]; the block must be GetSize() bytes for it. */
+	void Init(uint32_t width, uint32_t height, uint32_t fps, uint32_t nSlot)
+	{
+		nSlot = nSlot < 2 ? 2 : nSlot > FRAME_RING_MAX_SLOT ? FRAME_RING_MAX_SLOT : nSlot;
+		this->width = width;
+		this->height = height;
+		this->fps = fps;
+		this->cbFrame = width * height * 3 / 2;
+		this->cbSlot = GetSlotSize(this->cbFrame);
+		this->nSlot = nSlot;
+		this->dwDataOffset = GetDataOffset();
+		this->qwSize = GetSize(this->cbFrame, nSlot);
+		uTail.store(0, std::memory_order_relaxed);
+		nPublished.store(0, std::memory_order_relaxed);
+		nDropped.store(0, std::memory_order_relaxed);
+		uHead.store(0, std::memory_order_relaxed);
+		nSleepers.store(0, std::memory_order_relaxed);
+		uWakeSeq.store(0, std::memory_order_relaxed);
+		bClosed.store(0, std::memory_order_relaxed);
+		dwConsumerBeatMs.store(0, std::memory_order_relaxed);
+		dwVersion = FRAME_RING_VERSION;
+		std::atomic_thread_fence(std::memory_order_release);
+		dwMagic = FRAME_RING_MAGIC;
+	}
+
+	// Whether a block of cbMapped bytes holds a ring this code understands
+	bool IsValid(uint64_t cbMapped) const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return cbMapped >= sizeof(FrameRing) && dwMagic == FRAME_RING_MAGIC && dwVersion == FRAME_RING_VERSION
+			&& nSlot >= 2 && nSlot <= FRAME_RING_MAX_SLOT && cbSlot >= cbFrame && qwSize <= cbMapped
+			&& dwDataOffset >= sizeof(FrameRing);
+	}
+
+	uint32_t GetWidth() const
+	{
+		return width;
+	}
+	uint32_t GetHeight() const
+	{
+		return height;
+	}
+	uint32_t GetFps() const
+	{
+		return fps;
+	}
+	uint32_t GetFrameSize() const
+	{
+		return cbFrame;
+	}
+
+	/*! The slot to fill with the next frame, or NULL, counted as a drop, if the
+	    consumer holds all of them. Producer only. */
+	uint8_t *BeginWrite()
+	{
+		uint32_t pos = uTail.load(std::memory_order_relaxed);
+		if (pos - uHead.load(std::memory_order_acquire) >= nSlot) {
+			nDropped.fetch_add(1, std::memory_order_relaxed);
+			return NULL;
+		}
+		return GetSlot(pos);
+	}
+	// Hands the slot of BeginWrite() to the consumer
+	void Publish(const FrameDesc &desc, InputRingSignal *pSignal = NULL)
+	{
+		uint32_t pos = uTail.load(std::memory_order_relaxed);
+		aDesc[pos % nSlot] = desc;
+		uTail.store(pos + 1, std::memory_order_release);
+		nPublished.fetch_add(1, std::memory_order_relaxed);
+		Wake(pSignal);
+	}
+
+	/*! The oldest published frame and its description, or NULL if there is none.
+	    The frame stays valid until Release(). Consumer only. */
+	const uint8_t *Acquire(FrameDesc &desc, uint32_t dwNowMs)
+	{
+		dwConsumerBeatMs.store(dwNowMs, std::memory_order_relaxed);
+		uint32_t pos = uHead.load(std::memory_order_relaxed);
+		if (uTail.load(std::memory_order_acquire) == pos) {
+			return NULL;
+		}
+		desc = aDesc[pos % nSlot];
+		return GetSlot(pos);
+	}
+	/*! Acquire() that sleeps until a frame is published, the ring is closed or
+	    dwMilliseconds elapse; one bounded sleep per call, like InputRing::WaitPopBatch(). */
+	const uint8_t *WaitAcquire(FrameDesc &desc, InputRingSignal *pSignal, uint32_t dwNowMs, uint32_t dwMilliseconds)
+	{
+		uint32_t seq = uWakeSeq.load(std::memory_order_acquire);
+		const uint8_t *pFrame = Acquire(desc, dwNowMs);
+		if (pFrame || IsClosed() || !dwMilliseconds) {
+			return pFrame;
+		}
+		nSleepers.fetch_add(1, std::memory_order_seq_cst);
+		if (uWakeSeq.load(std::memory_order_seq_cst) == seq) {
+			pSignal->Wait(&uWakeSeq, seq, dwMilliseconds);
+		}
+		nSleepers.fetch_sub(1, std::memory_order_relaxed);
+		return Acquire(desc, dwNowMs);
+	}
+	// Gives the frame of Acquire() back to the producer
+	void Release()
+	{
+		uHead.store(uHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// The producer is done with the ring; wakes the consumer
+	void Close(InputRingSignal *pSignal = NULL)
+	{
+		bClosed.store(1, std::memory_order_release);
+		Wake(pSignal);
+	}
+	bool IsClosed() const
+	{
+		return bClosed.load(std::memory_order_acquire) != 0;
+	}
+	// Whether the consumer has looked at the ring within dwTimeoutMs, on the clock of dwNowMs
+	bool IsConsumerAlive(uint32_t dwNowMs, uint32_t dwTimeoutMs) const
+	{
+		uint32_t dwBeatMs = dwConsumerBeatMs.load(std::memory_order_relaxed);
+		return dwBeatMs && (int32_t)(dwNowMs - dwBeatMs) < (int32_t)dwTimeoutMs;
+	}
+
+	Stats GetStats() const
+	{
+		Stats stats;
+		stats.nPublished = nPublished.load(std::memory_order_relaxed);
+		stats.nDropped = nDropped.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+private:
+	uint8_t *GetSlot(uint32_t pos)
+	{
+		return (uint8_t *)this + dwDataOffset + (size_t)cbSlot * (pos % nSlot);
+	}
+	void Wake(InputRingSignal *pSignal)
+	{
+		uWakeSeq.fetch_add(1, std::memory_order_seq_cst);
+		if (pSignal && nSleepers.load(std::memory_order_seq_cst)) {
+			pSignal->Notify(&uWakeSeq);
+		}
+	}
+
+	// Set by Init(), read-only afterwards
+	uint32_t dwMagic;
+	uint32_t dwVersion;
+	uint32_t width, height, fps;
+	uint32_t cbFrame;
+	uint32_t cbSlot;
+	uint32_t nSlot;
+	uint32_t dwDataOffset;
+	uint32_t dwReserved;
+	uint64_t qwSize;
+	char padHeader[INPUT_RING_CACHE_LINE - 10 * sizeof(uint32_t) - sizeof(uint64_t)];
+
+	// Producer side
+	std::atomic<uint32_t> uTail;
+	std::atomic<uint32_t> nPublished;
+	std::atomic<uint32_t> nDropped;
+	char padProducer[INPUT_RING_CACHE_LINE - 3 * sizeof(uint32_t)];
+
+	// Consumer side
+	std::atomic<uint32_t> uHead;
+	std::atomic<uint32_t> nSleepers;
+	std::atomic<uint32_t> uWakeSeq;
+	std::atomic<uint32_t> bClosed;
+	std::atomic<uint32_t> dwConsumerBeatMs;
+	char padConsumer[INPUT_RING_CACHE_LINE - 5 * sizeof(uint32_t)];
+
+	// Written by the producer before the slot is published
+	FrameDesc aDesc[FRAME_RING_MAX_SLOT];
+};
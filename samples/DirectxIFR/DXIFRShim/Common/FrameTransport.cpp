@@ -0,0 +1,212 @@
+/*!
+ * \brief
+ * The implementation of FrameTransport
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#ifndef _WIN32
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "FrameTransport.h"
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+FrameTransport::FrameTransport() : bCreator(false), pRing(NULL), cbMapped(0),
+#ifdef _WIN32
+	hMem(NULL)
+#else
+	fd(-1)
+#endif
+{
+}
+
+FrameTransport::~FrameTransport()
+{
+	Close();
+}
+
+std::string FrameTransport::GetName(ULONGLONG qwProcessId, int index)
+{
+	char szName[64];
+#ifdef _WIN32
+	sprintf_s(szName, sizeof(szName), "GRID_Frames_0x%llX_%d", qwProcessId, index);
+#else
+	// POSIX shared memory names start with a slash
+	snprintf(szName, sizeof(szName), "/GRID_Frames_0x%llX_%d", qwProcessId, index);
+#endif
+	return szName;
+}
+
+uint64_t FrameTransport::NowUs()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER liFrequency;
+	if (!liFrequency.QuadPart) {
+		QueryPerformanceFrequency(&liFrequency);
+	}
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+	return (uint64_t)(liNow.QuadPart / liFrequency.QuadPart * 1000000
+		+ liNow.QuadPart % liFrequency.QuadPart * 1000000 / liFrequency.QuadPart);
+#else
+	// CLOCK_MONOTONIC, which all processes share
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+uint32_t FrameTransport::NowMs()
+{
+	return (uint32_t)(NowUs() / 1000) | 1;
+}
+
+bool FrameTransport::Create(const std::string &strName, int width, int height, int fps, int nSlot)
+{
+	Close();
+	if (width <= 0 || height <= 0 || (width | height) & 1) {
+		LOG_ERROR(logger, "Frame ring " << strName << " cannot carry " << width << "x" << height << " frames");
+		return false;
+	}
+	this->strName = strName;
+	bCreator = true;
+	uint32_t nClamped = nSlot < 2 ? 2 : nSlot > FRAME_RING_MAX_SLOT ? FRAME_RING_MAX_SLOT : (uint32_t)nSlot;
+	if (!Map(FrameRing::GetSize(width * height * 3 / 2, nClamped), true)) {
+		Close();
+		return false;
+	}
+	pRing->Init(width, height, fps, nClamped);
+	if (!signal.Open((strName + "_Ready").c_str())) {
+		LOG_WARN(logger, "Failed to create the event of frame ring " << strName << "; the service will poll");
+	}
+	return true;
+}
+
+bool FrameTransport::Open(const std::string &strName)
+{
+	Close();
+	this->strName = strName;
+	bCreator = false;
+	if (!Map(0, false)) {
+		Close();
+		return false;
+	}
+	if (!pRing->IsValid(cbMapped)) {
+		LOG_ERROR(logger, "Shared memory " << strName << " does not hold a frame ring of version " << FRAME_RING_VERSION);
+		Close();
+		return false;
+	}
+	if (!signal.Open((strName + "_Ready").c_str())) {
+		LOG_WARN(logger, "Failed to open the event of frame ring " << strName << "; frames will be polled for");
+	}
+	return true;
+}
+
+#ifdef _WIN32
+bool FrameTransport::Map(uint64_t cbSize, bool bCreate)
+{
+	if (bCreate) {
+		hMem = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(cbSize >> 32), (DWORD)cbSize, strName.c_str());
+		if (!hMem) {
+			LOG_ERROR(logger, "CreateFileMapping() failed for " << strName << ", error=" << GetLastError());
+			return false;
+		}
+	} else {
+		hMem = OpenFileMappingA(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, strName.c_str());
+		if (!hMem) {
+			// The shim has not started the player yet
+			return false;
+		}
+	}
+	// A size of 0 maps the whole section when opening
+	pRing = (FrameRing *)MapViewOfFile(hMem, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)cbSize);
+	if (!pRing) {
+		LOG_ERROR(logger, "MapViewOfFile() failed for " << strName);
+		return false;
+	}
+	if (!cbSize) {
+		// The view's size is that of its region, the section rounded up to pages
+		MEMORY_BASIC_INFORMATION mbi;
+		cbSize = VirtualQuery(pRing, &mbi, sizeof(mbi)) ? mbi.RegionSize : 0;
+	}
+	cbMapped = cbSize;
+	return true;
+}
+#else
+bool FrameTransport::Map(uint64_t cbSize, bool bCreate)
+{
+	if (bCreate) {
+		// A ring left behind by a game that crashed with the same process ID is replaced
+		fd = shm_open(strName.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+		if (fd < 0) {
+			LOG_ERROR(logger, "shm_open() failed for " << strName);
+			return false;
+		}
+		if (ftruncate(fd, (off_t)cbSize)) {
+			LOG_ERROR(logger, "ftruncate() failed for " << strName);
+			return false;
+		}
+	} else {
+		fd = shm_open(strName.c_str(), O_RDWR, 0);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) || st.st_size < (off_t)sizeof(FrameRing)) {
+			return false;
+		}
+		cbSize = (uint64_t)st.st_size;
+	}
+	void *p = mmap(NULL, (size_t)cbSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		LOG_ERROR(logger, "mmap() failed for " << strName);
+		return false;
+	}
+	pRing = (FrameRing *)p;
+	cbMapped = cbSize;
+	return true;
+}
+#endif
+
+void FrameTransport::Close()
+{
+	if (pRing && bCreator) {
+		pRing->Close(&signal);
+	}
+	signal.Close();
+#ifdef _WIN32
+	if (pRing) {
+		UnmapViewOfFile(pRing);
+	}
+	if (hMem) {
+		CloseHandle(hMem);
+		hMem = NULL;
+	}
+#else
+	if (pRing) {
+		munmap(pRing, (size_t)cbMapped);
+	}
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+	if (bCreator && !strName.empty()) {
+		shm_unlink(strName.c_str());
+	}
+#endif
+	pRing = NULL;
+	cbMapped = 0;
+	bCreator = false;
+}
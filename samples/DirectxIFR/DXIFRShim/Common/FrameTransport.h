@@ -0,0 +1,78 @@
+/*!
+ * \brief
+ * Named shared memory holding the FrameRing of one player
+ *
+ * \file
+ *
+ * The shim creates the block when its player starts and the encode service
+ * opens it by name, the way the launcher and the shim meet on the AppParam
+ * block (see AppParamManager). The name is made of the game's process ID
+ * and the player index, both of which the launcher knows. On Windows the
+ * block is a file mapping in the paging file and the wakeup a named event;
+ * elsewhere it is a POSIX shared memory object, whose futex needs no name.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+typedef unsigned long long ULONGLONG;
+#endif
+#include <stdint.h>
+#include <string>
+#include "FrameRing.h"
+
+// Slots of a player's ring: one being filled, one being encoded, and slack for a slow frame
+#define FRAME_TRANSPORT_SLOTS 4
+// How long the service may stay silent before the shim takes it for gone
+#define FRAME_TRANSPORT_TIMEOUT_MS 2000
+
+class FrameTransport
+{
+public:
+	FrameTransport();
+	~FrameTransport();
+
+	static std::string GetName(ULONGLONG qwProcessId, int index);
+	// Time in microseconds, the same in every process on the host
+	static uint64_t NowUs();
+	// NowUs() in milliseconds, never 0, for the heartbeat of FrameRing
+	static uint32_t NowMs();
+
+	// Creates the block, with an empty ring for I420 frames of width x height; producer side
+	bool Create(const std::string &strName, int width, int height, int fps, int nSlot = FRAME_TRANSPORT_SLOTS);
+	// Opens the block another process created; false if it is not there (yet) or not a ring
+	bool Open(const std::string &strName);
+	// Unmaps the block; the producer closes the ring first, so that the consumer stops
+	void Close();
+
+	FrameRing *GetRing()
+	{
+		return pRing;
+	}
+	InputRingSignal *GetSignal()
+	{
+		return &signal;
+	}
+
+private:
+	bool Map(uint64_t cbSize, bool bCreate);
+
+	std::string strName;
+	bool bCreator;
+	FrameRing *pRing;
+	uint64_t cbMapped;
+	InputRingSignal signal;
+#ifdef _WIN32
+	HANDLE hMem;
+#else
+	int fd;
+#endif
+};
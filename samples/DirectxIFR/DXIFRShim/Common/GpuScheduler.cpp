@@ -0,0 +1,441 @@
+/*!
+ * \brief
+ * The implementation of GpuScheduler
+ *
+ * \file
+ *
+ * All state is behind one lock. The encoders report every frame, which
+ * is a map lookup and a few additions; the comparison of the devices runs
+ * on whichever report comes first after GPU_REBALANCE_MS.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "GpuScheduler.h"
+#include "EncoderRuntime.h"
+#include "Metrics.h"
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+GpuScheduler::GpuScheduler() : bDiscovered(false), nMaxSessionAll(0), qwLastRebalanceUs(0), bMoving(false)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+GpuScheduler *GpuScheduler::GetShared()
+{
+	static std::once_flag once;
+	static GpuScheduler *pScheduler = NULL;
+	std::call_once(once, [] { pScheduler = new GpuScheduler(); });
+	return pScheduler;
+}
+
+void GpuScheduler::Discover()
+{
+	if (bDiscovered) {
+		return;
+	}
+	bDiscovered = true;
+	// Without CUDA there is device 0, where opening the session reports the error as before
+	int nDevice = EncoderRuntime::GetShared()->GetDeviceCount();
+	nDevice = nDevice > 0 ? nDevice : 1;
+	for (int i = 0; i < nDevice; i++) {
+		Device device = {0, nMaxSessionAll, false, EncoderRuntime::GetShared()->GetDeviceMemory(i)};
+		vDevice.push_back(device);
+	}
+	LOG_INFO(logger, "Placing encoder sessions on " << nDevice << " GPUs");
+}
+
+void GpuScheduler::SetSessionLimit(int nMaxSession)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	nMaxSessionAll = nMaxSession;
+	for (size_t i = 0; i < vDevice.size(); i++) {
+		vDevice[i].nMaxSession = nMaxSession;
+	}
+}
+
+double GpuScheduler::GetSessionLoad(const Session &session, double averageLoad)
+{
+	return session.bReported ? session.encodeUs * session.fps / 1000000.0 : averageLoad;
+}
+
+void GpuScheduler::ComputeLoad(std::vector<double> &vLoad, double *pAverageLoad)
+{
+	double sumLoad = 0.0;
+	int nReported = 0;
+	for (std::map<SessionKey, Session>::iterator it = mpSession.begin(); it != mpSession.end(); ++it) {
+		if (it->second.bReported) {
+			sumLoad += GetSessionLoad(it->second, 0.0);
+			nReported++;
+		}
+	}
+	double averageLoad = nReported ? sumLoad / nReported : 0.0;
+
+	vLoad.assign(vDevice.size(), 0.0);
+	std::vector<uint64_t> vMemory(vDevice.size(), 0);
+	for (std::map<SessionKey, Session>::iterator it = mpSession.begin(); it != mpSession.end(); ++it) {
+		const Session &session = it->second;
+		double load = GetSessionLoad(session, averageLoad);
+		if (session.iDevice >= 0) {
+			vLoad[session.iDevice] += load;
+			vMemory[session.iDevice] += session.qwMemoryBytes;
+		}
+		// The reserved session on the target of a move is as busy as the one that moves
+		if (session.iMoveTo >= 0) {
+			vLoad[session.iMoveTo] += load;
+		}
+	}
+	for (size_t i = 0; i < vDevice.size(); i++) {
+		if (vDevice[i].qwTotalMemory) {
+			vLoad[i] += (double)vMemory[i] / vDevice[i].qwTotalMemory;
+		}
+	}
+	if (pAverageLoad) {
+		*pAverageLoad = averageLoad;
+	}
+}
+
+bool GpuScheduler::HasRoom(int iDevice)
+{
+	const Device &device = vDevice[iDevice];
+	return !device.bDisabled && (device.nMaxSession <= 0 || device.nSession < device.nMaxSession);
+}
+
+int GpuScheduler::PickDevice(const std::vector<double> &vLoad)
+{
+	int iBest = -1;
+	for (int i = 0; i < (int)vDevice.size(); i++) {
+		if (!HasRoom(i)) {
+			continue;
+		}
+		// Loads within a rounding error of each other are a tie
+		if (iBest < 0 || vLoad[i] < vLoad[iBest] - 1e-9
+			|| (fabs(vLoad[i] - vLoad[iBest]) <= 1e-9 && vDevice[i].nSession < vDevice[iBest].nSession)) {
+			iBest = i;
+		}
+	}
+	return iBest;
+}
+
+int GpuScheduler::Place(int iPlayer, int iRendition, int iDevice)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	Discover();
+	SessionKey key(iPlayer, iRendition);
+	if (mpSession.find(key) != mpSession.end()) {
+		LOG_ERROR(logger, "Rendition " << iRendition << " of player " << iPlayer << " is placed already");
+		return mpSession[key].iDevice;
+	}
+
+	bool bPinned = iDevice >= 0;
+	if (bPinned) {
+		if (iDevice >= (int)vDevice.size()) {
+			// Opening the session reports the invalid device
+			return iDevice;
+		}
+	} else {
+		std::vector<double> vLoad;
+		ComputeLoad(vLoad, NULL);
+		iDevice = PickDevice(vLoad);
+		if (iDevice < 0) {
+			stats.nRejected++;
+			LOG_ERROR(logger, "No GPU has a free encoder session for rendition " << iRendition << " of player " << iPlayer);
+			return -1;
+		}
+	}
+
+	Session session = {iDevice, bPinned, false, 0.0, 0, 0, -1, 0, Metrics::NowUs(), bPinned ? iDevice : -1};
+	mpSession[key] = session;
+	vDevice[iDevice].nSession++;
+	stats.nPlaced++;
+	LOG_INFO(logger, "Rendition " << iRendition << " of player " << iPlayer << " placed on GPU " << iDevice
+		<< (bPinned ? " (-deviceID)" : "") << ", " << vDevice[iDevice].nSession << " sessions there");
+	return iDevice;
+}
+
+void GpuScheduler::Release(int iPlayer, int iRendition)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	std::map<SessionKey, Session>::iterator it = mpSession.find(SessionKey(iPlayer, iRendition));
+	if (it == mpSession.end()) {
+		return;
+	}
+	Session &session = it->second;
+	bool bSpilled = session.iDevice < 0;
+	if (!bSpilled) {
+		vDevice[session.iDevice].nSession--;
+	}
+	if (session.iMoveTo >= 0) {
+		vDevice[session.iMoveTo].nSession--;
+		bMoving = bMoving && bSpilled;
+	}
+	mpSession.erase(it);
+	// The freed session goes to whoever waits in software
+	ReturnSpilled(Metrics::NowUs());
+}
+
+void GpuScheduler::Spill(int iPlayer, int iRendition, int iDevice)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	Discover();
+	SessionKey key(iPlayer, iRendition);
+	if (mpSession.find(key) != mpSession.end()) {
+		LOG_ERROR(logger, "Rendition " << iRendition << " of player " << iPlayer << " is placed already");
+		return;
+	}
+	Session session = {-1, iDevice >= 0, false, 0.0, 0, 0, -1, 0, Metrics::NowUs(), iDevice >= 0 ? iDevice : -1};
+	mpSession[key] = session;
+	stats.nSpilled++;
+	LOG_INFO(logger, "Rendition " << iRendition << " of player " << iPlayer << " is encoded in software until a GPU has room");
+}
+
+void GpuScheduler::ReturnSpilled(uint64_t qwNowUs)
+{
+	for (;;) {
+		// Oldest first
+		Session *pReturn = NULL;
+		SessionKey keyReturn;
+		for (std::map<SessionKey, Session>::iterator it = mpSession.begin(); it != mpSession.end(); ++it) {
+			Session &session = it->second;
+			if (session.iDevice < 0 && session.iMoveTo < 0 && (!pReturn || session.qwPlacedUs < pReturn->qwPlacedUs)) {
+				pReturn = &session;
+				keyReturn = it->first;
+			}
+		}
+		if (!pReturn) {
+			return;
+		}
+		int iDevice;
+		if (pReturn->iPinnedDevice >= 0) {
+			iDevice = pReturn->iPinnedDevice < (int)vDevice.size() && HasRoom(pReturn->iPinnedDevice) ? pReturn->iPinnedDevice : -1;
+		} else {
+			std::vector<double> vLoad;
+			ComputeLoad(vLoad, NULL);
+			iDevice = PickDevice(vLoad);
+		}
+		if (iDevice < 0) {
+			return;
+		}
+		pReturn->iMoveTo = iDevice;
+		pReturn->qwMoveSinceUs = qwNowUs;
+		vDevice[iDevice].nSession++;
+		LOG_INFO(logger, "GPU " << iDevice << " has room: rendition " << keyReturn.second << " of player " << keyReturn.first
+			<< " returns from software at its next IDR");
+	}
+}
+bool GpuScheduler::ReportSessionLimit(int iDevice)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	Discover();
+	if (iDevice < 0 || iDevice >= (int)vDevice.size()) {
+		return false;
+	}
+	Device &device = vDevice[iDevice];
+	if (device.nSession == 0) {
+		if (device.bDisabled) {
+			return false;
+		}
+		device.bDisabled = true;
+		LOG_WARN(logger, "GPU " << iDevice << " refuses encoder sessions, no more are placed there");
+		return true;
+	}
+	if (device.nMaxSession > 0 && device.nMaxSession <= device.nSession) {
+		return false;
+	}
+	device.nMaxSession = device.nSession;
+	LOG_WARN(logger, "GPU " << iDevice << " allows " << device.nMaxSession << " encoder sessions");
+	return true;
+}
+
+std::vector<int> GpuScheduler::PlanSessions(int nSession)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	Discover();
+	// What Place() does for sessions that have not encoded yet: fewest sessions first, within the limits
+	std::vector<int> vCount(vDevice.size(), 0);
+	for (size_t i = 0; i < vDevice.size(); i++) {
+		vCount[i] = vDevice[i].nSession;
+	}
+	std::vector<int> vPlan;
+	for (int n = 0; n < nSession; n++) {
+		int iBest = -1;
+		for (int i = 0; i < (int)vDevice.size(); i++) {
+			const Device &device = vDevice[i];
+			if (device.bDisabled || (device.nMaxSession > 0 && vCount[i] >= device.nMaxSession)) {
+				continue;
+			}
+			if (iBest < 0 || vCount[i] < vCount[iBest]) {
+				iBest = i;
+			}
+		}
+		if (iBest < 0) {
+			break;
+		}
+		vCount[iBest]++;
+		vPlan.push_back(iBest);
+	}
+	return vPlan;
+}
+
+void GpuScheduler::ReportFrame(int iPlayer, int iRendition, uint64_t qwEncodeUs, int fps, uint64_t qwMemoryBytes)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	std::map<SessionKey, Session>::iterator it = mpSession.find(SessionKey(iPlayer, iRendition));
+	if (it == mpSession.end()) {
+		return;
+	}
+	Session &session = it->second;
+	session.encodeUs = session.bReported ? session.encodeUs + GPU_LOAD_SMOOTHING * (qwEncodeUs - session.encodeUs) : (double)qwEncodeUs;
+	session.bReported = true;
+	session.fps = fps;
+	session.qwMemoryBytes = qwMemoryBytes;
+
+	uint64_t qwNowUs = Metrics::NowUs();
+	if (qwNowUs - qwLastRebalanceUs >= GPU_REBALANCE_MS * 1000ull) {
+		qwLastRebalanceUs = qwNowUs;
+		Rebalance(qwNowUs);
+	}
+}
+
+void GpuScheduler::Rebalance(uint64_t qwNowUs)
+{
+	// E.g. a limit from -gpuSessions that was raised, or a device that was not full after all
+	ReturnSpilled(qwNowUs);
+	if (bMoving || vDevice.size() < 2) {
+		return;
+	}
+	double averageLoad;
+	std::vector<double> vLoad;
+	ComputeLoad(vLoad, &averageLoad);
+	int iBusy = 0;
+	for (int i = 1; i < (int)vDevice.size(); i++) {
+		if (vLoad[i] > vLoad[iBusy]) {
+			iBusy = i;
+		}
+	}
+	int iIdle = PickDevice(vLoad);
+	if (iIdle < 0 || iIdle == iBusy) {
+		return;
+	}
+	double gap = vLoad[iBusy] - vLoad[iIdle];
+	if (gap < GPU_MIGRATE_GAP) {
+		return;
+	}
+	/* Sessions that share an engine wait for each other, and the players of one game tick
+	   together, so each of them measures slower than it would alone and the device's load
+	   adds up to more than it is. A move that leaves the idle device with more sessions
+	   than the busy one keeps would only swap them.*/
+	if (vDevice[iIdle].nSession + 1 > vDevice[iBusy].nSession - 1) {
+		return;
+	}
+
+	// Moving a session of load l leaves the two devices |gap - 2l| apart; the best is l = gap / 2
+	Session *pMove = NULL;
+	SessionKey keyMove;
+	double bestRemaining = gap;
+	for (std::map<SessionKey, Session>::iterator it = mpSession.begin(); it != mpSession.end(); ++it) {
+		Session &session = it->second;
+		if (session.iDevice != iBusy || session.bPinned || !session.bReported
+			|| qwNowUs - session.qwPlacedUs < GPU_MIGRATE_HOLD_MS * 1000ull) {
+			continue;
+		}
+		double load = GetSessionLoad(session, averageLoad);
+		// The idle device has to stay GPU_MIGRATE_GAP below what the busy one had, or the session would just swap them
+		if (load > gap - GPU_MIGRATE_GAP) {
+			continue;
+		}
+		double remaining = fabs(gap - 2 * load);
+		if (remaining < bestRemaining) {
+			bestRemaining = remaining;
+			pMove = &session;
+			keyMove = it->first;
+		}
+	}
+	if (!pMove) {
+		return;
+	}
+	pMove->iMoveTo = iIdle;
+	pMove->qwMoveSinceUs = qwNowUs;
+	vDevice[iIdle].nSession++;
+	bMoving = true;
+	LOG_INFO(logger, "GPU " << iBusy << " has load " << vLoad[iBusy] << ", GPU " << iIdle << " " << vLoad[iIdle]
+		<< ": rendition " << keyMove.second << " of player " << keyMove.first << " moves at its next IDR");
+}
+
+int GpuScheduler::GetMove(int iPlayer, int iRendition, bool *pbOverdue)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	std::map<SessionKey, Session>::iterator it = mpSession.find(SessionKey(iPlayer, iRendition));
+	if (it == mpSession.end() || it->second.iMoveTo < 0) {
+		return -1;
+	}
+	*pbOverdue = Metrics::NowUs() - it->second.qwMoveSinceUs >= GPU_MIGRATE_WAIT_MS * 1000ull;
+	return it->second.iMoveTo;
+}
+
+void GpuScheduler::FinishMove(int iPlayer, int iRendition, bool bMoved)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	std::map<SessionKey, Session>::iterator it = mpSession.find(SessionKey(iPlayer, iRendition));
+	if (it == mpSession.end() || it->second.iMoveTo < 0) {
+		return;
+	}
+	Session &session = it->second;
+	bool bSpilled = session.iDevice < 0;
+	if (bMoved) {
+		if (bSpilled) {
+			stats.nReturned++;
+		} else {
+			vDevice[session.iDevice].nSession--;
+			stats.nMigration++;
+		}
+		session.iDevice = session.iMoveTo;
+	} else {
+		vDevice[session.iMoveTo].nSession--;
+		stats.nMigrationFailed++;
+	}
+	session.iMoveTo = -1;
+	// A failed move is not retried right away either; a spilled session keeps its place in line
+	if (!bSpilled || bMoved) {
+		session.qwPlacedUs = Metrics::NowUs();
+	}
+	bMoving = bMoving && bSpilled;
+}
+
+std::vector<GpuScheduler::DeviceLoad> GpuScheduler::GetLoad()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	std::vector<double> vLoad;
+	ComputeLoad(vLoad, NULL);
+	std::vector<uint64_t> vMemory(vDevice.size(), 0);
+	for (std::map<SessionKey, Session>::iterator it = mpSession.begin(); it != mpSession.end(); ++it) {
+		if (it->second.iDevice >= 0) {
+			vMemory[it->second.iDevice] += it->second.qwMemoryBytes;
+		}
+	}
+	std::vector<DeviceLoad> vDeviceLoad;
+	for (size_t i = 0; i < vDevice.size(); i++) {
+		DeviceLoad load;
+		load.nSession = vDevice[i].nSession;
+		load.nMaxSession = vDevice[i].bDisabled ? -1 : vDevice[i].nMaxSession;
+		load.qwMemoryBytes = vMemory[i];
+		load.qwTotalMemory = vDevice[i].qwTotalMemory;
+		load.encodeLoad = vLoad[i] - (vDevice[i].qwTotalMemory ? (double)vMemory[i] / vDevice[i].qwTotalMemory : 0.0);
+		vDeviceLoad.push_back(load);
+	}
+	return vDeviceLoad;
+}
+
+GpuScheduler::Stats GpuScheduler::GetStats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return stats;
+}
@@ -0,0 +1,171 @@
+/*!
+ * \brief
+ * Placement of encoder sessions on the GPUs of a multi-GPU host
+ *
+ * \file
+ *
+ * GridAdapter picks the adapter the game renders on; the frames leave it
+ * through system memory, so the NVENC session that encodes them can run on
+ * any CUDA device. Without -deviceID every session used to go to device 0
+ * (or wherever -deviceID pointed all of them), which leaves the other
+ * encoders of a multi-GPU host idle while one of them is overbooked.
+ *
+ * The scheduler places each new session, a player or one of its
+ * renditions, on the least loaded device that still has a free session.
+ * A device's load is the sum of its sessions' encode load, the encoder
+ * time they use per second of stream (smoothed encode time per frame times
+ * the frame rate), plus the share of the device's memory their NVENC
+ * buffers take. A session that has not encoded yet counts with the average
+ * load of the others. Ties go to the device with fewer sessions, so an idle
+ * host is filled round-robin.
+ *
+ * Session limits come from -gpuSessions, or are learned: a device that
+ * refuses a session is taken as full at the number it has.
+ *
+ * Once a second the scheduler compares the busiest and the idlest device.
+ * If they are more than GPU_MIGRATE_GAP apart, it picks the session on the
+ * busy one whose move narrows the gap most, as long as the idle one stays
+ * GPU_MIGRATE_GAP below what the busy one had and ends up with no more
+ * sessions than the busy one keeps, and reserves a session for it on the
+ * idle one. The encoder moves at its next IDR, since the new
+ * session starts with one anyway; one that does not get an IDR within
+ * GPU_MIGRATE_WAIT_MS asks for it. One move is in flight at a time, and a
+ * moved session stays put for GPU_MIGRATE_HOLD_MS. Sessions pinned with
+ * -deviceID are counted but never moved.
+ *
+ * A session that finds every device full can be spilled to a software
+ * encoder (SoftwareEncoder). It is kept with device -1, and as soon as a
+ * device has room, the oldest spilled session gets a session reserved
+ * there; it returns like a move, at its next IDR. Returns are not held
+ * back by a move in flight. A pinned session returns to its own device only.
+ *
+ * Like TaskPool, the shared scheduler is never destroyed.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Weight of the latest frame in a session's encode time average
+#define GPU_LOAD_SMOOTHING 0.05
+// Difference in load between two devices that makes a session move
+#define GPU_MIGRATE_GAP 0.25
+// The timings can be set on the command line; Test/ shortens them
+// How often the loads are compared
+#ifndef GPU_REBALANCE_MS
+#define GPU_REBALANCE_MS 1000
+#endif
+// How long a move waits for an IDR before the encoder asks for one
+#ifndef GPU_MIGRATE_WAIT_MS
+#define GPU_MIGRATE_WAIT_MS 2000
+#endif
+// How long a moved session stays on its new device
+#ifndef GPU_MIGRATE_HOLD_MS
+#define GPU_MIGRATE_HOLD_MS 10000
+#endif
+
+class GpuScheduler
+{
+public:
+	struct DeviceLoad {
+		/* Sessions placed, including one reserved for a move; the limit, 0 if none is
+		   known and -1 for a device that refuses sessions */
+		int nSession;
+		int nMaxSession;
+		// Encoder seconds per second of the sessions
+		double encodeLoad;
+		uint64_t qwMemoryBytes;
+		uint64_t qwTotalMemory;
+	};
+	struct Stats {
+		int nPlaced;
+		// Sessions that found every device full
+		int nRejected;
+		int nMigration;
+		int nMigrationFailed;
+		// Sessions spilled to software, and those that got back to a GPU
+		int nSpilled;
+		int nReturned;
+	};
+
+	static GpuScheduler *GetShared();
+
+	// Sessions every device allows, 0 to learn it from the devices
+	void SetSessionLimit(int nMaxSession);
+	/*! Places the player's rendition and returns its device, iDevice if that is not
+	    negative, otherwise the least loaded one with a free session; -1 if all are full. */
+	int Place(int iPlayer, int iRendition, int iDevice = -1);
+	void Release(int iPlayer, int iRendition);
+	/*! Records a session that is encoded in software since no device took it; iDevice
+	    pins it as in Place(). GetMove() tells when a device has room for it. */
+	void Spill(int iPlayer, int iRendition, int iDevice = -1);
+	/*! The session's device refused to open it (after Release); the device is full at
+	    the sessions it has. Returns false if it was known to be full already. */
+	bool ReportSessionLimit(int iDevice);
+	// Devices for the first nSession placements on an idle host, for the warm-up
+	std::vector<int> PlanSessions(int nSession);
+
+	// Called after every frame with its encode time and the session's buffer bytes
+	void ReportFrame(int iPlayer, int iRendition, uint64_t qwEncodeUs, int fps, uint64_t qwMemoryBytes);
+	/*! The device the session is to move, or return from software, to; or -1. *pbOverdue
+	    tells that the move has waited GPU_MIGRATE_WAIT_MS for an IDR. */
+	int GetMove(int iPlayer, int iRendition, bool *pbOverdue);
+	// Called once the session has moved, or could not
+	void FinishMove(int iPlayer, int iRendition, bool bMoved);
+
+	std::vector<DeviceLoad> GetLoad();
+	Stats GetStats();
+
+private:
+	typedef std::pair<int, int> SessionKey;
+	struct Session {
+		// -1 while spilled to software
+		int iDevice;
+		bool bPinned;
+		bool bReported;
+		double encodeUs;
+		int fps;
+		uint64_t qwMemoryBytes;
+		// Device of a pending move, or -1
+		int iMoveTo;
+		uint64_t qwMoveSinceUs;
+		uint64_t qwPlacedUs;
+		// The device a pinned session belongs on, -1 if not pinned
+		int iPinnedDevice;
+	};
+	struct Device {
+		int nSession;
+		int nMaxSession;
+		bool bDisabled;
+		uint64_t qwTotalMemory;
+	};
+
+	GpuScheduler();
+	void Discover();
+	double GetSessionLoad(const Session &session, double averageLoad);
+	void ComputeLoad(std::vector<double> &vLoad, double *pAverageLoad);
+	bool HasRoom(int iDevice);
+	int PickDevice(const std::vector<double> &vLoad);
+	void Rebalance(uint64_t qwNowUs);
+	// Reserves sessions for spilled ones on devices with room
+	void ReturnSpilled(uint64_t qwNowUs);
+
+	std::mutex mtx;
+	bool bDiscovered;
+	int nMaxSessionAll;
+	std::vector<Device> vDevice;
+	std::map<SessionKey, Session> mpSession;
+	uint64_t qwLastRebalanceUs;
+	bool bMoving;
+	Stats stats;
+};
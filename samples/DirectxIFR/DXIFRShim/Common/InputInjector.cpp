@@ -0,0 +1,100 @@
+/*!
+ * \brief
+ * The implementation of InputInjector
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <mutex>
+#include <thread>
+#include "InputInjector.h"
+#include "ControlInfoWire.h"
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+void InputInjector::Start(AppParamManager *pManager)
+{
+	static std::once_flag once;
+	if (!pManager->GetAppParam()) {
+		return;
+	}
+	std::call_once(once, [pManager] { std::thread(&InputInjector::Run, pManager).detach(); });
+}
+
+static BOOL CALLBACK FindMainWindow(HWND hwnd, LPARAM lParam)
+{
+	DWORD dwPid;
+	GetWindowThreadProcessId(hwnd, &dwPid);
+	if (dwPid != GetCurrentProcessId() || !IsWindowVisible(hwnd) || GetWindow(hwnd, GW_OWNER)) {
+		return TRUE;
+	}
+	*(HWND *)lParam = hwnd;
+	return FALSE;
+}
+
+HWND InputInjector::FindTarget(AppParam *pAppParam)
+{
+	if (pAppParam->bForceHwnd && pAppParam->hwnd) {
+		return (HWND)(ULONG_PTR)pAppParam->hwnd;
+	}
+	HWND hwnd = NULL;
+	EnumWindows(FindMainWindow, (LPARAM)&hwnd);
+	return hwnd;
+}
+
+void InputInjector::Inject(HWND hwnd, const UserInput &ui)
+{
+	LPARAM lParam = ui.wm.lParam;
+	int cxViewer = ui.rcClient.right - ui.rcClient.left, cyViewer = ui.rcClient.bottom - ui.rcClient.top;
+	RECT rcGame;
+	// The viewer's window rarely has the size of the game's
+	// The wheel messages carry screen coordinates, which are left alone
+	if (controlinfowire::IsMouseMessage(ui.wm.msg) && ui.wm.msg != WM_MOUSEWHEEL && ui.wm.msg != WM_MOUSEHWHEEL && cxViewer > 0 && cyViewer > 0 && GetClientRect(hwnd, &rcGame)) {
+		int x = (short)LOWORD(ui.wm.lParam) * (rcGame.right - rcGame.left) / cxViewer;
+		int y = (short)HIWORD(ui.wm.lParam) * (rcGame.bottom - rcGame.top) / cyViewer;
+		lParam = MAKELPARAM(x, y);
+	}
+	PostMessage(hwnd, ui.wm.msg, ui.wm.wParam, lParam);
+}
+
+void InputInjector::Run(AppParamManager *pManager)
+{
+	AppParam *pAppParam = pManager->GetAppParam();
+	UserInput aui[INJECTOR_BATCH];
+	HWND hwnd = NULL;
+	unsigned int nJoystick = 0;
+	LOG_INFO(logger, "Input injector started");
+	for (;;) {
+		DWORD n = pManager->WaitUserInput(aui, INJECTOR_BATCH);
+		if (!n) {
+			if (pManager->IsUserInputClosed()) {
+				break;
+			}
+			continue;
+		}
+		if (!hwnd || !IsWindow(hwnd)) {
+			hwnd = FindTarget(pAppParam);
+		}
+		for (DWORD i = 0; i < n; i++) {
+			if (aui[i].type != UI_WM) {
+				if (!nJoystick++) {
+					LOG_WARN(logger, "Joystick input cannot be injected and is dropped");
+				}
+			} else if (hwnd) {
+				Inject(hwnd, aui[i]);
+			}
+		}
+	}
+	hwnd = FindTarget(pAppParam);
+	LOG_INFO(logger, "User input closed by the launcher, closing window " << hwnd << "; " << nJoystick << " joystick inputs dropped");
+	if (hwnd) {
+		PostMessage(hwnd, WM_CLOSE, 0, 0);
+	}
+}
@@ -0,0 +1,44 @@
+/*!
+ * \brief
+ * Injects the user input the launcher posts into the game's window
+ *
+ * \file
+ *
+ * The launcher receives the viewers' input and posts it to the user input
+ * ring of AppParam (see AppParamManager::PostUserInput). In the game
+ * process, the injector thread sleeps in WaitUserInput() until input
+ * arrives and hands every window message on to the game's window, with the
+ * mouse position scaled from the viewer's client area to the game's.
+ * Joystick input has no way into the game without a virtual device driver
+ * and is dropped.
+ *
+ * Closing the ring is the launcher's request to end the game: the injector
+ * posts WM_CLOSE to the window and stops.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include "AppParam.h"
+
+// Inputs taken from the ring per wakeup
+#define INJECTOR_BATCH 16
+
+class InputInjector
+{
+public:
+	// Starts the injector of the process once; does nothing without a launcher
+	static void Start(AppParamManager *pManager);
+
+private:
+	static void Run(AppParamManager *pManager);
+	// The window the input is for: the forced one, or the game's main window
+	static HWND FindTarget(AppParam *pAppParam);
+	static void Inject(HWND hwnd, const UserInput &ui);
+};
@@ -0,0 +1,310 @@
+/*!
+ * \brief
+ * Lock-free ring buffer for passing user input through shared memory
+ *
+ * \file
+ *
+ * InputRing is a bounded multi-producer/single-consumer queue that lives
+ * inside the AppParam shared memory block. Every slot carries its own
+ * sequence number, so producers publish with a release store and the
+ * consumer observes the payload with an acquire load; no lock is taken on
+ * either side. With a single producer it degenerates to a plain SPSC ring.
+ *
+ * The structure is position independent and valid when zero-filled, which
+ * is what CreateFileMapping() hands back. Init() must be called once by the
+ * creator before any producer or consumer touches it.
+ *
+ * InputRingSignal is the per-process wakeup primitive. On Windows it is a
+ * named auto-reset event (WaitOnAddress does not work across processes);
+ * elsewhere it is a shared futex on the ring's wake sequence. The consumer
+ * only sleeps after announcing itself in nSleepers, and producers only
+ * signal when somebody is asleep, so the uncontended path makes no system
+ * call at all.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#define INPUT_RING_CACHE_LINE 64
+#define INPUT_RING_INFINITE 0xFFFFFFFF
+
+class InputRingSignal
+{
+public:
+	InputRingSignal()
+#ifdef _WIN32
+		: hEvent(NULL)
+#endif
+	{}
+	~InputRingSignal()
+	{
+		Close();
+	}
+
+	/*! Creates the named event, or opens it if the other side got there first.
+	    The name is ignored on platforms where the futex word itself is shared. */
+#ifdef _WIN32
+	bool Open(const TCHAR *szName)
+#else
+	bool Open(const char *szName)
+#endif
+	{
+#ifdef _WIN32
+		Close();
+		hEvent = CreateEvent(NULL, FALSE, FALSE, szName);
+		return hEvent != NULL;
+#else
+		(void)szName;
+		return true;
+#endif
+	}
+	void Close()
+	{
+#ifdef _WIN32
+		if (hEvent) {
+			CloseHandle(hEvent);
+			hEvent = NULL;
+		}
+#endif
+	}
+
+	void Notify(std::atomic<uint32_t> *pWord)
+	{
+#ifdef _WIN32
+		(void)pWord;
+		if (hEvent) {
+			SetEvent(hEvent);
+		}
+#else
+		syscall(SYS_futex, (uint32_t *)pWord, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+	}
+
+	/*! Sleeps until notified, the timeout expires, or *pWord no longer equals uExpected.
+	    Spurious returns are allowed; callers re-check their condition. */
+	void Wait(std::atomic<uint32_t> *pWord, uint32_t uExpected, uint32_t dwMilliseconds)
+	{
+#ifdef _WIN32
+		(void)pWord;
+		(void)uExpected;
+		if (hEvent) {
+			WaitForSingleObject(hEvent, dwMilliseconds);
+		} else {
+			Sleep(1);
+		}
+#else
+		struct timespec ts, *pts = NULL;
+		if (dwMilliseconds != INPUT_RING_INFINITE) {
+			ts.tv_sec = dwMilliseconds / 1000;
+			ts.tv_nsec = (long)(dwMilliseconds % 1000) * 1000000;
+			pts = &ts;
+		}
+		syscall(SYS_futex, (uint32_t *)pWord, FUTEX_WAIT, uExpected, pts, NULL, 0);
+#endif
+	}
+
+private:
+	InputRingSignal(const InputRingSignal &);
+	InputRingSignal &operator=(const InputRingSignal &);
+#ifdef _WIN32
+	HANDLE hEvent;
+#endif
+};
+
+template <class T, uint32_t N>
+struct InputRing
+{
+	static_assert(N && !(N & (N - 1)), "InputRing capacity must be a power of two");
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "InputRing requires address-free 32-bit atomics");
+
+	/*! Resets the ring to empty with the given capacity.
+	    nCapacity is rounded up to a power of two and clamped to [2, N]. */
+	void Init(uint32_t nCapacity)
+	{
+		uint32_t n = 2;
+		while (n < nCapacity && n < N) {
+			n <<= 1;
+		}
+		uMask = n - 1;
+		for (uint32_t i = 0; i < N; i++) {
+			aSlot[i].sn.store(i, std::memory_order_relaxed);
+		}
+		uHead.store(0, std::memory_order_relaxed);
+		uTail.store(0, std::memory_order_relaxed);
+		nPushed.store(0, std::memory_order_relaxed);
+		nOverflow.store(0, std::memory_order_relaxed);
+		nHighWater.store(0, std::memory_order_relaxed);
+		nSleepers.store(0, std::memory_order_relaxed);
+		bClosed.store(0, std::memory_order_relaxed);
+		uWakeSeq.store(0, std::memory_order_release);
+	}
+
+	uint32_t GetCapacity() const
+	{
+		return uMask + 1;
+	}
+
+	/*! Enqueues one item. Safe to call from any number of producers.
+	    Returns false and bumps the overflow counter if the ring is full. */
+	bool Push(const T &t, InputRingSignal *pSignal = NULL)
+	{
+		uint32_t pos = uTail.load(std::memory_order_relaxed);
+		Slot *pSlot;
+		for (;;) {
+			pSlot = &aSlot[pos & uMask];
+			uint32_t sn = pSlot->sn.load(std::memory_order_acquire);
+			int32_t dif = (int32_t)(sn - pos);
+			if (dif == 0) {
+				if (uTail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (dif < 0) {
+				nOverflow.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			} else {
+				pos = uTail.load(std::memory_order_relaxed);
+			}
+		}
+		pSlot->t = t;
+		pSlot->sn.store(pos + 1, std::memory_order_release);
+		nPushed.fetch_add(1, std::memory_order_relaxed);
+
+		uint32_t nDepth = pos + 1 - uHead.load(std::memory_order_relaxed);
+		// The consumer frees slots before it moves uHead, so a stale uHead overstates the depth
+		if (nDepth > uMask + 1) {
+			nDepth = uMask + 1;
+		}
+		uint32_t nHigh = nHighWater.load(std::memory_order_relaxed);
+		while (nDepth > nHigh && !nHighWater.compare_exchange_weak(nHigh, nDepth, std::memory_order_relaxed)) {
+		}
+
+		Wake(pSignal);
+		return true;
+	}
+
+	/*! Dequeues up to nMax items in order. Single consumer only.
+	    Returns the number of items copied to pt. */
+	uint32_t PopBatch(T *pt, uint32_t nMax)
+	{
+		uint32_t pos = uHead.load(std::memory_order_relaxed), n = 0;
+		for (; n < nMax; n++, pos++) {
+			Slot *pSlot = &aSlot[pos & uMask];
+			if (pSlot->sn.load(std::memory_order_acquire) != pos + 1) {
+				break;
+			}
+			pt[n] = pSlot->t;
+			pSlot->sn.store(pos + uMask + 1, std::memory_order_release);
+		}
+		if (n) {
+			uHead.store(pos, std::memory_order_relaxed);
+		}
+		return n;
+	}
+
+	bool Pop(T &t)
+	{
+		return PopBatch(&t, 1) == 1;
+	}
+
+	bool IsEmpty() const
+	{
+		uint32_t pos = uHead.load(std::memory_order_relaxed);
+		return aSlot[pos & uMask].sn.load(std::memory_order_acquire) != pos + 1;
+	}
+
+	/*! Blocks the consumer until at least one item is available, the ring is
+	    closed, or dwMilliseconds elapse. Returns the number of items dequeued. */
+	uint32_t WaitPopBatch(T *pt, uint32_t nMax, InputRingSignal *pSignal, uint32_t dwMilliseconds = INPUT_RING_INFINITE)
+	{
+		for (;;) {
+			uint32_t seq = uWakeSeq.load(std::memory_order_acquire);
+			uint32_t n = PopBatch(pt, nMax);
+			if (n || IsClosed() || !dwMilliseconds) {
+				return n;
+			}
+			nSleepers.fetch_add(1, std::memory_order_seq_cst);
+			if (uWakeSeq.load(std::memory_order_seq_cst) == seq) {
+				pSignal->Wait(&uWakeSeq, seq, dwMilliseconds);
+			}
+			nSleepers.fetch_sub(1, std::memory_order_relaxed);
+			if (dwMilliseconds != INPUT_RING_INFINITE) {
+				// One bounded sleep per call; report whatever arrived meanwhile
+				return PopBatch(pt, nMax);
+			}
+		}
+	}
+
+	/*! Marks the ring as closed (application termination) and wakes the consumer. */
+	void Close(InputRingSignal *pSignal = NULL)
+	{
+		bClosed.store(1, std::memory_order_release);
+		Wake(pSignal);
+	}
+	bool IsClosed() const
+	{
+		return bClosed.load(std::memory_order_acquire) != 0;
+	}
+
+	uint32_t GetPushedCount() const
+	{
+		return nPushed.load(std::memory_order_relaxed);
+	}
+	uint32_t GetOverflowCount() const
+	{
+		return nOverflow.load(std::memory_order_relaxed);
+	}
+	uint32_t GetHighWater() const
+	{
+		return nHighWater.load(std::memory_order_relaxed);
+	}
+
+private:
+	void Wake(InputRingSignal *pSignal)
+	{
+		uWakeSeq.fetch_add(1, std::memory_order_seq_cst);
+		if (pSignal && nSleepers.load(std::memory_order_seq_cst)) {
+			pSignal->Notify(&uWakeSeq);
+		}
+	}
+
+	struct Slot {
+		std::atomic<uint32_t> sn;
+		T t;
+	};
+
+	// Producer side
+	std::atomic<uint32_t> uTail;
+	std::atomic<uint32_t> nPushed;
+	std::atomic<uint32_t> nOverflow;
+	std::atomic<uint32_t> nHighWater;
+	char padProducer[INPUT_RING_CACHE_LINE - 4 * sizeof(uint32_t)];
+
+	// Consumer side
+	std::atomic<uint32_t> uHead;
+	std::atomic<uint32_t> nSleepers;
+	std::atomic<uint32_t> uWakeSeq;
+	std::atomic<uint32_t> bClosed;
+	uint32_t uMask;
+	char padConsumer[INPUT_RING_CACHE_LINE - 5 * sizeof(uint32_t)];
+
+	Slot aSlot[N];
+};
@@ -5,6 +5,7 @@
  * \file
  *
  * This logger can log either into a file, or the standard output.
+ * Off Windows (the tests under Test/) there is no UDP logger.
  *
  * \copyright
  * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
@@ -20,10 +21,15 @@
 #include <string>
 #include <sstream>
 #include <time.h>
+#ifdef _WIN32
 #include <winsock.h>
 #include <windows.h>
 
 #pragma comment(lib, "ws2_32.lib")
+#else
+#include <stdio.h>
+#include <mutex>
+#endif
 
 namespace simplelogger{
 
@@ -38,43 +44,69 @@ enum LogLevel {
 class Logger {
 public:
 	Logger(LogLevel level, bool bPrintTimeStamp) : level(level), bPrintTimeStamp(bPrintTimeStamp) {
+#ifdef _WIN32
 		InitializeCriticalSection(&cs);
+#endif
 	}
 	virtual ~Logger() {
+#ifdef _WIN32
 		DeleteCriticalSection(&cs);
+#endif
 	}
 	virtual std::ostream& GetStream() = 0;
 	virtual void FlushStream() {}
 	bool ShouldLogFor(LogLevel l) {
 		return l >= level;
 	}
-	char* GetLead(LogLevel l, char *szFile, int nLine, char *szFunc) {
+	const char* GetLead(LogLevel l, const char *szFile, int nLine, const char *szFunc) {
 		if (l < TRACE || l > ERR) {
 			return "[?????] ";
 		}
-		char *szLevels[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+		const char *szLevels[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
 		if (bPrintTimeStamp) {
 			time_t t = time(NULL);
 			struct tm tm;
+#ifdef _WIN32
 			localtime_s(&tm, &t);
 			sprintf_s(szLead, sizeof(szLead), "[%-5s][%02d:%02d:%02d] ", 
 				szLevels[l], tm.tm_hour, tm.tm_min, tm.tm_sec);
+#else
+			localtime_r(&t, &tm);
+			snprintf(szLead, sizeof(szLead), "[%-5s][%02d:%02d:%02d] ", 
+				szLevels[l], tm.tm_hour, tm.tm_min, tm.tm_sec);
+#endif
 		} else {
+#ifdef _WIN32
 			sprintf_s(szLead, sizeof(szLead), "[%-5s] ", szLevels[l]);
+#else
+			snprintf(szLead, sizeof(szLead), "[%-5s] ", szLevels[l]);
+#endif
 		}
 		return szLead;
 	}
 	void EnterCriticalSection() {
+#ifdef _WIN32
 		::EnterCriticalSection(&cs);
+#else
+		mtx.lock();
+#endif
 	}
 	void LeaveCriticalSection() {
+#ifdef _WIN32
 		::LeaveCriticalSection(&cs);
+#else
+		mtx.unlock();
+#endif
 	}
 private:
 	LogLevel level;
 	char szLead[80];
 	bool bPrintTimeStamp;
+#ifdef _WIN32
 	CRITICAL_SECTION cs;
+#else
+	std::mutex mtx;
+#endif
 };
 
 class LoggerFactory {
@@ -87,10 +119,12 @@ public:
 			bool bPrintTimeStamp = true) {
 		return new ConsoleLogger(level, bPrintTimeStamp);
 	}
+#ifdef _WIN32
 	static Logger* CreateUdpLogger(char *szHost, unsigned uPort, LogLevel level = DEBUG, 
 			bool bPrintTimeStamp = true) {
 		return new UdpLogger(szHost, uPort, level, bPrintTimeStamp);
 	}
+#endif
 private:
 	LoggerFactory() {}
 
@@ -120,6 +154,7 @@ private:
 		}
 	};
 
+#ifdef _WIN32
 	class UdpLogger : public Logger {
 	private:
 		class UdpOstream : public std::ostream {
@@ -173,6 +208,7 @@ private:
 	private:
 		UdpOstream udpOut;
 	};
+#endif
 };
 
 }
@@ -0,0 +1,422 @@
+/*!
+ * \brief
+ * The implementation of Metrics
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <string.h>
+#include <sstream>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <chrono>
+#define INVALID_SOCKET -1
+#define closesocket close
+#endif
+#include "Metrics.h"
+#include "Logger.h"
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#define METRICS_TLS __declspec(thread)
+#else
+#define METRICS_TLS __thread
+#endif
+
+extern simplelogger::Logger *logger;
+
+static METRICS_TLS int tlsShard = -1;
+static std::atomic<int> iNextShard(0);
+
+// The shard of the calling thread, assigned round robin on first use
+static inline int GetShard()
+{
+	if (tlsShard < 0) {
+		tlsShard = iNextShard.fetch_add(1, std::memory_order_relaxed) % N_METRIC_SHARD;
+	}
+	return tlsShard;
+}
+
+MetricCounter::MetricCounter()
+{
+	for (int i = 0; i < N_METRIC_SHARD; i++) {
+		aShard[i].qwValue.store(0, std::memory_order_relaxed);
+	}
+}
+
+void MetricCounter::Add(uint64_t n)
+{
+	aShard[GetShard()].qwValue.fetch_add(n, std::memory_order_relaxed);
+}
+
+uint64_t MetricCounter::Get()
+{
+	uint64_t qwValue = 0;
+	for (int i = 0; i < N_METRIC_SHARD; i++) {
+		qwValue += aShard[i].qwValue.load(std::memory_order_relaxed);
+	}
+	return qwValue;
+}
+
+MetricHistogram::MetricHistogram()
+{
+	for (int i = 0; i < N_METRIC_SHARD; i++) {
+		for (int j = 0; j < N_METRIC_BUCKET; j++) {
+			aShard[i].aqwBucket[j].store(0, std::memory_order_relaxed);
+		}
+		aShard[i].qwSum.store(0, std::memory_order_relaxed);
+	}
+}
+
+int MetricHistogram::GetBucket(uint64_t qwValue)
+{
+	if (qwValue <= 8) {
+		return (int)qwValue;
+	}
+	// Bucket upper bounds are inclusive, as Prometheus' le, so the buckets are laid over value - 1
+	uint64_t x = qwValue - 1;
+	int e = 3;
+	while (e < 63 && (x >> (e + 1))) {
+		e++;
+	}
+	if (e >= METRIC_MAX_EXPONENT) {
+		return N_METRIC_BUCKET - 1;
+	}
+	return 9 + (e - 3) * 8 + (int)((x >> (e - 3)) & 7);
+}
+
+uint64_t MetricHistogram::GetBucketLimit(int i)
+{
+	if (i <= 8) {
+		return (uint64_t)i;
+	}
+	int e = 3 + (i - 9) / 8;
+	int iSub = (i - 9) % 8;
+	return (1ull << e) + ((uint64_t)(iSub + 1) << (e - 3));
+}
+
+void MetricHistogram::Record(uint64_t qwValue)
+{
+	Shard &shard = aShard[GetShard()];
+	shard.aqwBucket[GetBucket(qwValue)].fetch_add(1, std::memory_order_relaxed);
+	shard.qwSum.fetch_add(qwValue, std::memory_order_relaxed);
+}
+
+void MetricHistogram::Read(Snapshot &snapshot)
+{
+	memset(&snapshot, 0, sizeof(snapshot));
+	for (int i = 0; i < N_METRIC_SHARD; i++) {
+		for (int j = 0; j < N_METRIC_BUCKET; j++) {
+			uint64_t n = aShard[i].aqwBucket[j].load(std::memory_order_relaxed);
+			snapshot.aqwBucket[j] += n;
+			snapshot.qwCount += n;
+		}
+		snapshot.qwSum += aShard[i].qwSum.load(std::memory_order_relaxed);
+	}
+}
+
+Metrics::Metrics() : sockListen(INVALID_SOCKET)
+{
+}
+
+Metrics *Metrics::GetShared()
+{
+	static std::once_flag once;
+	static Metrics *pMetrics = NULL;
+	std::call_once(once, [] { pMetrics = new Metrics(); });
+	return pMetrics;
+}
+
+uint64_t Metrics::NowUs()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER liFrequency;
+	if (!liFrequency.QuadPart) {
+		QueryPerformanceFrequency(&liFrequency);
+	}
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+	return (uint64_t)(liNow.QuadPart / liFrequency.QuadPart * 1000000
+		+ liNow.QuadPart % liFrequency.QuadPart * 1000000 / liFrequency.QuadPart);
+#else
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void *Metrics::GetMetric(const char *szName, const char *szHelp, StreamKey key, MetricType eType)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	std::map<std::string, Family>::iterator it = mpFamily.find(szName);
+	if (it == mpFamily.end()) {
+		Family family;
+		family.eType = eType;
+		family.strHelp = szHelp;
+		it = mpFamily.insert(std::make_pair(std::string(szName), family)).first;
+	} else if (it->second.eType != eType) {
+		LOG_ERROR(logger, "Metric " << szName << " is already registered with another type");
+		return NULL;
+	}
+	void *&pMetric = it->second.mpMetric[key];
+	if (!pMetric) {
+		switch (eType) {
+		case METRIC_COUNTER:
+			pMetric = new MetricCounter();
+			break;
+		case METRIC_GAUGE:
+			pMetric = new MetricGauge();
+			break;
+		case METRIC_HISTOGRAM:
+			pMetric = new MetricHistogram();
+			break;
+		}
+	}
+	return pMetric;
+}
+
+MetricCounter *Metrics::GetCounter(const char *szName, const char *szHelp, int iPlayer, int iRendition)
+{
+	return (MetricCounter *)GetMetric(szName, szHelp, StreamKey(iPlayer, iRendition), METRIC_COUNTER);
+}
+
+MetricGauge *Metrics::GetGauge(const char *szName, const char *szHelp, int iPlayer, int iRendition)
+{
+	return (MetricGauge *)GetMetric(szName, szHelp, StreamKey(iPlayer, iRendition), METRIC_GAUGE);
+}
+
+MetricHistogram *Metrics::GetHistogram(const char *szName, const char *szHelp, int iPlayer, int iRendition)
+{
+	return (MetricHistogram *)GetMetric(szName, szHelp, StreamKey(iPlayer, iRendition), METRIC_HISTOGRAM);
+}
+
+PlayerMetrics *Metrics::GetPlayer(int iPlayer, int iRendition)
+{
+	StreamKey key(iPlayer, iRendition);
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		std::map<StreamKey, PlayerMetrics>::iterator it = mpPlayer.find(key);
+		if (it != mpPlayer.end()) {
+			return &it->second;
+		}
+	}
+	PlayerMetrics pm;
+	pm.pStartupUs = GetHistogram("dxifr_startup_microseconds", "Time from the first Present of the swap chain to its first encoded frame", iPlayer, iRendition);
+	pm.pFrameCaptured = GetCounter("dxifr_frames_captured_total", "Frames transferred from the render target", iPlayer, iRendition);
+	pm.pCaptureFailure = GetCounter("dxifr_capture_failures_total", "Frames lost because the render target transfer failed", iPlayer, iRendition);
+	pm.pTransferTimeout = GetCounter("dxifr_transfer_timeouts_total", "Render target transfers that took more than four frame periods", iPlayer, iRendition);
+	pm.pTransferUs = GetHistogram("dxifr_transfer_microseconds", "Time from the transfer request to its completion", iPlayer, iRendition);
+	pm.pPacingMiss = GetCounter("dxifr_pacing_misses_total", "Frames that finished after the next frame was due", iPlayer, iRendition);
+	pm.pFrameTaskUs = GetHistogram("dxifr_frame_microseconds", "Time from the frame tick to the end of its encode", iPlayer, iRendition);
+	pm.pTargetBitrate = GetGauge("dxifr_target_bitrate", "Bitrate the encoder runs at, in bits per second", iPlayer, iRendition);
+	pm.pCongestionEstimate = GetGauge("dxifr_congestion_estimate", "Bitrate the path to the viewer can carry, in bits per second", iPlayer, iRendition);
+	pm.pScaleUs = GetHistogram("dxifr_scale_microseconds", "Time spent downscaling the captured frame for a rendition", iPlayer, iRendition);
+	pm.pFrameEncoded = GetCounter("dxifr_frames_encoded_total", "Frames output by NVENC", iPlayer, iRendition);
+	pm.pKeyFrame = GetCounter("dxifr_key_frames_total", "IDR frames output by NVENC", iPlayer, iRendition);
+	pm.pEncodeUs = GetHistogram("dxifr_encode_microseconds", "Time spent in CNvEncoder per frame, submission and readout", iPlayer, iRendition);
+	pm.pBitstreamBytes = GetCounter("dxifr_bitstream_bytes_total", "Bytes output by NVENC", iPlayer, iRendition);
+	pm.pFrameBytes = GetHistogram("dxifr_frame_bytes", "Size of the encoded frames", iPlayer, iRendition);
+	pm.pReconfigure = GetCounter("dxifr_reconfigure_total", "Bitrate reconfigurations of the encoder", iPlayer, iRendition);
+	pm.pReconfigureFailure = GetCounter("dxifr_reconfigure_failures_total", "Bitrate reconfigurations NVENC rejected", iPlayer, iRendition);
+	pm.pGpu = GetGauge("dxifr_gpu", "CUDA device the encoder session runs on", iPlayer, iRendition);
+	pm.pGpuMove = GetCounter("dxifr_gpu_moves_total", "Moves of the encoder session to a less loaded GPU", iPlayer, iRendition);
+	pm.pMotionActivity = GetGauge("dxifr_motion_activity_permille", "Motion of the last frame in ME-only mode, 0 still to 1000 moving all over", iPlayer, iRendition);
+	pm.pMotionUs = GetHistogram("dxifr_motion_summary_microseconds", "Time spent packing and summarizing the motion vectors of a frame", iPlayer, iRendition);
+	pm.pActivity = GetGauge("dxifr_activity_permille", "Content activity the bandwidth is shared by, 0 still to 1000 busy", iPlayer, iRendition);
+	pm.pActivityUs = GetHistogram("dxifr_activity_microseconds", "Time spent measuring the activity of a frame", iPlayer, iRendition);
+	pm.pPublishUs = GetHistogram("dxifr_service_publish_microseconds", "Time spent copying a frame into the ring of the encode service", iPlayer, iRendition);
+	pm.pServiceDrop = GetCounter("dxifr_service_drops_total", "Frames dropped because the encode service held every slot of the ring", iPlayer, iRendition);
+	pm.pSoftware = GetGauge("dxifr_software_encoder", "1 while the stream is encoded on the CPU for want of an encoder session", iPlayer, iRendition);
+	pm.pSoftwareSpill = GetCounter("dxifr_software_spills_total", "Starts of the stream on the CPU because every GPU was full", iPlayer, iRendition);
+	pm.pBufferBytes = GetGauge("dxifr_buffer_bytes", "Bytes of NVENC surfaces, bitstream buffers and frame copies the stream owns", iPlayer, iRendition);
+	pm.pSinkDropped = GetCounter("dxifr_sink_dropped_total", "Encoded chunks dropped because the output fell behind", iPlayer, iRendition);
+	pm.pSinkWriteError = GetCounter("dxifr_sink_write_errors_total", "Failed writes to the output", iPlayer, iRendition);
+	pm.pSinkStall = GetCounter("dxifr_sink_stalls_total", "Writes to the output that blocked longer than a frame period", iPlayer, iRendition);
+	pm.pSinkWriteUs = GetHistogram("dxifr_sink_write_microseconds", "Time one write to the output blocked", iPlayer, iRendition);
+	pm.pStreamFrame = GetCounter("dxifr_stream_frames_total", "Raw frames handed to the streamer", iPlayer, iRendition);
+	pm.pStreamDropped = GetCounter("dxifr_stream_dropped_total", "Raw frames the streamer dropped", iPlayer, iRendition);
+	pm.pStreamBytes = GetCounter("dxifr_stream_bytes_total", "Raw bytes handed to the streamer", iPlayer, iRendition);
+
+	std::lock_guard<std::mutex> lock(mtx);
+	return &mpPlayer.insert(std::make_pair(key, pm)).first->second;
+}
+
+static void WriteLabels(std::ostringstream &oss, int iPlayer, int iRendition, const char *szLe = NULL)
+{
+	const char *szSeparator = "{";
+	if (iPlayer != Metrics::NO_PLAYER) {
+		oss << szSeparator << "player=\"" << iPlayer << "\"";
+		szSeparator = ",";
+	}
+	if (iRendition) {
+		oss << szSeparator << "rendition=\"" << iRendition << "\"";
+		szSeparator = ",";
+	}
+	if (szLe) {
+		oss << szSeparator << "le=\"" << szLe << "\"";
+		szSeparator = ",";
+	}
+	if (*szSeparator == ',') {
+		oss << "}";
+	}
+}
+
+std::string Metrics::Export()
+{
+	static const char *aszType[] = {"counter", "gauge", "histogram"};
+	std::ostringstream oss;
+	MetricHistogram::Snapshot *pSnapshot = new MetricHistogram::Snapshot;
+
+	std::lock_guard<std::mutex> lock(mtx);
+	for (std::map<std::string, Family>::iterator it = mpFamily.begin(); it != mpFamily.end(); ++it) {
+		const std::string &strName = it->first;
+		Family &family = it->second;
+		oss << "# HELP " << strName << " " << family.strHelp << "\n";
+		oss << "# TYPE " << strName << " " << aszType[family.eType] << "\n";
+		for (std::map<StreamKey, void *>::iterator itMetric = family.mpMetric.begin(); itMetric != family.mpMetric.end(); ++itMetric) {
+			int iPlayer = itMetric->first.first, iRendition = itMetric->first.second;
+			switch (family.eType) {
+			case METRIC_COUNTER:
+				oss << strName;
+				WriteLabels(oss, iPlayer, iRendition);
+				oss << " " << ((MetricCounter *)itMetric->second)->Get() << "\n";
+				break;
+			case METRIC_GAUGE:
+				oss << strName;
+				WriteLabels(oss, iPlayer, iRendition);
+				oss << " " << ((MetricGauge *)itMetric->second)->Get() << "\n";
+				break;
+			case METRIC_HISTOGRAM: {
+				((MetricHistogram *)itMetric->second)->Read(*pSnapshot);
+				// One exported bucket per power of two; the last group also holds the overflow
+				uint64_t qwCumulative = 0;
+				for (int i = 0; i < N_METRIC_BUCKET - 8; i++) {
+					qwCumulative += pSnapshot->aqwBucket[i];
+					uint64_t qwLimit = MetricHistogram::GetBucketLimit(i);
+					if (qwLimit & (qwLimit - 1)) {
+						continue;
+					}
+					std::ostringstream ossLe;
+					ossLe << qwLimit;
+					oss << strName << "_bucket";
+					WriteLabels(oss, iPlayer, iRendition, ossLe.str().c_str());
+					oss << " " << qwCumulative << "\n";
+				}
+				oss << strName << "_bucket";
+				WriteLabels(oss, iPlayer, iRendition, "+Inf");
+				oss << " " << pSnapshot->qwCount << "\n";
+				oss << strName << "_sum";
+				WriteLabels(oss, iPlayer, iRendition);
+				oss << " " << pSnapshot->qwSum << "\n";
+				oss << strName << "_count";
+				WriteLabels(oss, iPlayer, iRendition);
+				oss << " " << pSnapshot->qwCount << "\n";
+				break;
+			}
+			}
+		}
+	}
+	delete pSnapshot;
+	return oss.str();
+}
+
+bool Metrics::StartServer(unsigned short wPort)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (thServer.joinable()) {
+		return true;
+	}
+#ifdef _WIN32
+	WSADATA w;
+	if (WSAStartup(0x0101, &w) != 0) {
+		LOG_ERROR(logger, "WSAStartup() failed");
+		return false;
+	}
+#endif
+	sockListen = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockListen == INVALID_SOCKET) {
+		LOG_ERROR(logger, "socket() failed for the metrics endpoint");
+		return false;
+	}
+	int bReuse = 1;
+	setsockopt(sockListen, SOL_SOCKET, SO_REUSEADDR, (const char *)&bReuse, sizeof(bReuse));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(wPort);
+	// Local scrapers only
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sockListen, (const struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sockListen, 4) != 0) {
+		LOG_ERROR(logger, "Cannot listen on 127.0.0.1:" << wPort << " for metrics");
+		closesocket(sockListen);
+		sockListen = INVALID_SOCKET;
+		return false;
+	}
+	thServer = std::thread(&Metrics::ServerProc, this);
+	LOG_INFO(logger, "Metrics at http://127.0.0.1:" << wPort << "/metrics");
+	return true;
+}
+
+void Metrics::ServerProc()
+{
+	for (;;) {
+		struct sockaddr_in addr;
+#ifdef _WIN32
+		int cbAddr = sizeof(addr);
+		SOCKET sock = accept(sockListen, (struct sockaddr *)&addr, &cbAddr);
+		DWORD dwTimeout = 1000;
+#else
+		socklen_t cbAddr = sizeof(addr);
+		int sock = accept(sockListen, (struct sockaddr *)&addr, &cbAddr);
+		struct timeval dwTimeout = {1, 0};
+#endif
+		if (sock == INVALID_SOCKET) {
+			LOG_ERROR(logger, "accept() failed on the metrics endpoint");
+			return;
+		}
+		// A client that never completes its request must not hold up the others
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&dwTimeout, sizeof(dwTimeout));
+
+		std::string strRequest;
+		char buf[1024];
+		while (strRequest.size() < 8192 && strRequest.find("\r\n\r\n") == std::string::npos) {
+			int n = recv(sock, buf, sizeof(buf), 0);
+			if (n <= 0) {
+				break;
+			}
+			strRequest.append(buf, n);
+		}
+
+		std::string strBody, strStatus = "200 OK";
+		if (strRequest.compare(0, 4, "GET ") == 0) {
+			strBody = Export();
+		} else {
+			strStatus = "405 Method Not Allowed";
+		}
+		std::ostringstream oss;
+		oss << "HTTP/1.0 " << strStatus << "\r\n"
+			<< "Content-Type: text/plain; version=0.0.4\r\n"
+			<< "Content-Length: " << strBody.size() << "\r\n"
+			<< "Connection: close\r\n\r\n" << strBody;
+		std::string strResponse = oss.str();
+		for (size_t cbSent = 0; cbSent < strResponse.size();) {
+			int n = send(sock, strResponse.c_str() + cbSent, (int)(strResponse.size() - cbSent), 0);
+			if (n <= 0) {
+				break;
+			}
+			cbSent += n;
+		}
+		closesocket(sock);
+	}
+}
@@ -0,0 +1,218 @@
+/*!
+ * \brief
+ * Per-player metrics registry with a Prometheus text endpoint
+ *
+ * \file
+ *
+ * Counters, gauges and histograms are registered once per player (the
+ * "player" label, and "rendition" for the simulcast renditions) and then
+ * updated from the hot path without locks: counters and histograms are
+ * split into cache-line sized shards, and every
+ * thread adds to the shard it was assigned on first use, with relaxed
+ * atomics. A scrape sums the shards under the registry lock, which only
+ * registration takes as well, so scraping never waits for nor delays an
+ * encoder.
+ *
+ * Histograms are log-linear in the manner of HDR histograms: exact up to 8,
+ * then 8 sub-buckets per power of two (12.5% resolution) up to 2^41. They
+ * are exported with one bucket per power of two.
+ *
+ * The endpoint is a minimal HTTP server bound to 127.0.0.1 that answers
+ * every GET with the text exposition format, e.g.
+ * curl http://127.0.0.1:9100/metrics
+ *
+ * Like TaskPool, the shared registry is never destroyed.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#ifdef _WIN32
+#include <winsock.h>
+#endif
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Counter and histogram updates from up to this many threads never share a cache line
+#define N_METRIC_SHARD 8
+// Largest power of two a histogram tells apart; larger values land in the last bucket
+#define METRIC_MAX_EXPONENT 41
+#define N_METRIC_BUCKET (9 + (METRIC_MAX_EXPONENT - 3) * 8)
+
+class MetricCounter
+{
+public:
+	MetricCounter();
+	void Add(uint64_t n = 1);
+	uint64_t Get();
+
+private:
+	struct Shard {
+		std::atomic<uint64_t> qwValue;
+		char pad[64 - sizeof(std::atomic<uint64_t>)];
+	};
+	Shard aShard[N_METRIC_SHARD];
+};
+
+class MetricGauge
+{
+public:
+	MetricGauge() : llValue(0) {}
+	void Set(int64_t llValue)
+	{
+		this->llValue.store(llValue, std::memory_order_relaxed);
+	}
+	void Add(int64_t llDelta)
+	{
+		llValue.fetch_add(llDelta, std::memory_order_relaxed);
+	}
+	int64_t Get()
+	{
+		return llValue.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<int64_t> llValue;
+};
+
+class MetricHistogram
+{
+public:
+	struct Snapshot {
+		uint64_t aqwBucket[N_METRIC_BUCKET];
+		uint64_t qwCount;
+		uint64_t qwSum;
+	};
+
+	MetricHistogram();
+	void Record(uint64_t qwValue);
+	void Read(Snapshot &snapshot);
+
+	static int GetBucket(uint64_t qwValue);
+	// Largest value counted in bucket i
+	static uint64_t GetBucketLimit(int i);
+
+private:
+	struct Shard {
+		std::atomic<uint64_t> aqwBucket[N_METRIC_BUCKET];
+		std::atomic<uint64_t> qwSum;
+		char pad[64 - sizeof(std::atomic<uint64_t>)];
+	};
+	Shard aShard[N_METRIC_SHARD];
+};
+
+/* The metrics of one player's pipeline, registered together so that each stage
+   can look them up once and keep the pointers.*/
+struct PlayerMetrics {
+	// Capture (the encoder's frame tasks)
+	MetricHistogram *pStartupUs;
+	MetricCounter *pFrameCaptured;
+	MetricCounter *pCaptureFailure;
+	MetricCounter *pTransferTimeout;
+	MetricHistogram *pTransferUs;
+	MetricCounter *pPacingMiss;
+	MetricHistogram *pFrameTaskUs;
+	// Rate control
+	MetricGauge *pTargetBitrate;
+	MetricGauge *pCongestionEstimate;
+	// Simulcast renditions
+	MetricHistogram *pScaleUs;
+	// CNvEncoder
+	MetricCounter *pFrameEncoded;
+	MetricCounter *pKeyFrame;
+	MetricHistogram *pEncodeUs;
+	MetricCounter *pBitstreamBytes;
+	MetricHistogram *pFrameBytes;
+	MetricCounter *pReconfigure;
+	MetricCounter *pReconfigureFailure;
+	MetricGauge *pGpu;
+	MetricCounter *pGpuMove;
+	// ME-only mode (MotionExport): activity of the last frame in thousandths, and the time to pack and summarize
+	MetricGauge *pMotionActivity;
+	MetricHistogram *pMotionUs;
+	// ActivityEstimator: the player's score in thousandths, and the time to measure a frame
+	MetricGauge *pActivity;
+	MetricHistogram *pActivityUs;
+	// Encode service (AppParam::bEncodeService): time to copy a frame into the ring, and frames it had no slot for
+	MetricHistogram *pPublishUs;
+	MetricCounter *pServiceDrop;
+	// Spills to SoftwareEncoder when no GPU had a session
+	MetricGauge *pSoftware;
+	MetricCounter *pSoftwareSpill;
+	// Buffers the stream owns, see BufferPool
+	MetricGauge *pBufferBytes;
+	// Encoder output (SinkQueue)
+	MetricCounter *pSinkDropped;
+	MetricCounter *pSinkWriteError;
+	MetricCounter *pSinkStall;
+	MetricHistogram *pSinkWriteUs;
+	// Raw frame streamers
+	MetricCounter *pStreamFrame;
+	MetricCounter *pStreamDropped;
+	MetricCounter *pStreamBytes;
+};
+
+class Metrics
+{
+public:
+	enum {
+		NO_PLAYER = -1,
+	};
+
+	static Metrics *GetShared();
+	// Microseconds from an arbitrary origin, for durations
+	static uint64_t NowUs();
+
+	/* Registration returns the same object for the same name, player and rendition
+	   (0 is the captured size). Names follow the Prometheus conventions; help is only
+	   taken from the first call.*/
+	MetricCounter *GetCounter(const char *szName, const char *szHelp, int iPlayer = NO_PLAYER, int iRendition = 0);
+	MetricGauge *GetGauge(const char *szName, const char *szHelp, int iPlayer = NO_PLAYER, int iRendition = 0);
+	MetricHistogram *GetHistogram(const char *szName, const char *szHelp, int iPlayer = NO_PLAYER, int iRendition = 0);
+	PlayerMetrics *GetPlayer(int iPlayer, int iRendition = 0);
+
+	// All metrics in the Prometheus text exposition format
+	std::string Export();
+
+	// Serves Export() on 127.0.0.1:wPort; only the first call has an effect
+	bool StartServer(unsigned short wPort);
+
+private:
+	// Player and rendition
+	typedef std::pair<int, int> StreamKey;
+	enum MetricType {
+		METRIC_COUNTER,
+		METRIC_GAUGE,
+		METRIC_HISTOGRAM,
+	};
+	struct Family {
+		MetricType eType;
+		std::string strHelp;
+		std::map<StreamKey, void *> mpMetric;
+	};
+
+	Metrics();
+	void *GetMetric(const char *szName, const char *szHelp, StreamKey key, MetricType eType);
+	void ServerProc();
+
+	std::mutex mtx;
+	std::map<std::string, Family> mpFamily;
+	std::map<StreamKey, PlayerMetrics> mpPlayer;
+
+	std::thread thServer;
+#ifdef _WIN32
+	SOCKET sockListen;
+#else
+	int sockListen;
+#endif
+};
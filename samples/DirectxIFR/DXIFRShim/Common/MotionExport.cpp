@@ -0,0 +1,273 @@
+/*!
+ * \brief
+ * The implementation of MotionExport
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <emmintrin.h>
+#include "MotionExport.h"
+
+// Weights of the four partition vectors in a block's vector, times 4: 16x16, 8x8, 16x8 and 8x16
+static const int16_t aaPartitionWeight[4][4] = {
+	{ 4, 0, 0, 0 },
+	{ 1, 1, 1, 1 },
+	{ 2, 2, 0, 0 },
+	{ 2, 2, 0, 0 },
+};
+
+static inline int GetPartition(const NV_ENC_H264_MV_DATA &mv)
+{
+	return mv.partitionType < 4 ? mv.partitionType : 0;
+}
+
+static inline uint16_t SaturateCost(uint32_t dwCost)
+{
+	return dwCost < 0xFFFF ? (uint16_t)dwCost : 0xFFFF;
+}
+
+static void PackScalar(const NV_ENC_H264_MV_DATA *pMV, uint32_t nBlock, MotionBlock *pBlock)
+{
+	for (uint32_t i = 0; i < nBlock; i++) {
+		const NV_ENC_H264_MV_DATA &mv = pMV[i];
+		const int16_t *pWeight = aaPartitionWeight[GetPartition(mv)];
+		int x = 0, y = 0;
+		for (int j = 0; j < 4; j++) {
+			x += pWeight[j] * mv.MV[j].mvx;
+			y += pWeight[j] * mv.MV[j].mvy;
+		}
+		pBlock[i].mvx = (int16_t)((x + 2) >> 2);
+		pBlock[i].mvy = (int16_t)((y + 2) >> 2);
+		pBlock[i].wCost = SaturateCost(mv.MBCost);
+		pBlock[i].bMbType = mv.mb_type;
+		pBlock[i].bPartitionType = mv.partitionType;
+	}
+}
+
+static void PackSse2(const NV_ENC_H264_MV_DATA *pMV, uint32_t nBlock, MotionBlock *pBlock)
+{
+	__m128i aWeight[4];
+	for (int i = 0; i < 4; i++) {
+		const int16_t *w = aaPartitionWeight[i];
+		aWeight[i] = _mm_setr_epi16(w[0], w[1], w[2], w[3], w[0], w[1], w[2], w[3]);
+	}
+	const __m128i two = _mm_set1_epi32(2);
+	for (uint32_t i = 0; i < nBlock; i++) {
+		const NV_ENC_H264_MV_DATA &mv = pMV[i];
+		// x0 y0 x1 y1 x2 y2 x3 y3 to x0 x1 x2 x3 y0 y1 y2 y3
+		__m128i v = _mm_loadu_si128((const __m128i *)mv.MV);
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 1, 2, 0));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(3, 1, 2, 0));
+		v = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 1, 2, 0));
+		// Weighted pairs, then the sums of x and of y in lanes 0 and 2
+		__m128i s = _mm_madd_epi16(v, aWeight[GetPartition(mv)]);
+		s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+		s = _mm_srai_epi32(_mm_add_epi32(s, two), 2);
+		pBlock[i].mvx = (int16_t)_mm_cvtsi128_si32(s);
+		pBlock[i].mvy = (int16_t)_mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+		pBlock[i].wCost = SaturateCost(mv.MBCost);
+		pBlock[i].bMbType = mv.mb_type;
+		pBlock[i].bPartitionType = mv.partitionType;
+	}
+}
+
+// Sums of the vector lengths (quarter pixels) and costs, and the count of moving blocks
+struct MotionSums {
+	double length;
+	uint64_t qwCost;
+	uint32_t nMoving;
+};
+
+static void SumScalar(const MotionBlock *pBlock, uint32_t nBlock, MotionSums &sums)
+{
+	for (uint32_t i = 0; i < nBlock; i++) {
+		int sq = pBlock[i].mvx * pBlock[i].mvx + pBlock[i].mvy * pBlock[i].mvy;
+		sums.length += sqrtf((float)sq);
+		sums.qwCost += pBlock[i].wCost;
+		sums.nMoving += sq >= MOTION_MOVING_QPEL * MOTION_MOVING_QPEL;
+	}
+}
+
+static void SumSse2(const MotionBlock *pBlock, uint32_t nBlock, MotionSums &sums)
+{
+	// Two blocks per register: x y cost type/partition
+	const __m128i vectorMask = _mm_setr_epi16(-1, -1, 0, 0, -1, -1, 0, 0);
+	const __m128i costMask = _mm_set_epi32(0, 0xFFFF, 0, 0xFFFF);
+	const __m128i threshold = _mm_set1_epi32(MOTION_MOVING_QPEL * MOTION_MOVING_QPEL - 1);
+	__m128 length = _mm_setzero_ps();
+	__m128i cost = _mm_setzero_si128(), moving = _mm_setzero_si128();
+	uint32_t i = 0;
+	for (; i + 4 <= nBlock; i += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(pBlock + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(pBlock + i + 2));
+		// x * x + y * y in lanes 0 and 2
+		__m128i sqA = _mm_madd_epi16(_mm_and_si128(a, vectorMask), a);
+		__m128i sqB = _mm_madd_epi16(_mm_and_si128(b, vectorMask), b);
+		__m128i sq = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(sqA), _mm_castsi128_ps(sqB), _MM_SHUFFLE(2, 0, 2, 0)));
+		length = _mm_add_ps(length, _mm_sqrt_ps(_mm_cvtepi32_ps(sq)));
+		moving = _mm_sub_epi32(moving, _mm_cmpgt_epi32(sq, threshold));
+		cost = _mm_add_epi64(cost, _mm_and_si128(_mm_srli_epi64(a, 32), costMask));
+		cost = _mm_add_epi64(cost, _mm_and_si128(_mm_srli_epi64(b, 32), costMask));
+	}
+	float afLength[4];
+	uint32_t adwMoving[4];
+	uint64_t aqwCost[2];
+	_mm_storeu_ps(afLength, length);
+	_mm_storeu_si128((__m128i *)adwMoving, moving);
+	_mm_storeu_si128((__m128i *)aqwCost, cost);
+	sums.length += (double)afLength[0] + afLength[1] + afLength[2] + afLength[3];
+	sums.nMoving += adwMoving[0] + adwMoving[1] + adwMoving[2] + adwMoving[3];
+	sums.qwCost += aqwCost[0] + aqwCost[1];
+	SumScalar(pBlock + i, nBlock - i, sums);
+}
+
+static MotionKernel eCurrentKernel = MOTION_KERNEL_SSE2;
+static void (*pfnPack)(const NV_ENC_H264_MV_DATA *, uint32_t, MotionBlock *) = PackSse2;
+static void (*pfnSum)(const MotionBlock *, uint32_t, MotionSums &) = SumSse2;
+
+// SSE2 is part of x64 and of the /arch:SSE2 default of the x86 builds
+bool MotionSelectKernel(MotionKernel eKernel)
+{
+	switch (eKernel) {
+	case MOTION_KERNEL_SCALAR:
+		pfnPack = PackScalar;
+		pfnSum = SumScalar;
+		break;
+	case MOTION_KERNEL_SSE2:
+		pfnPack = PackSse2;
+		pfnSum = SumSse2;
+		break;
+	default:
+		return false;
+	}
+	eCurrentKernel = eKernel;
+	return true;
+}
+
+MotionKernel MotionGetKernel()
+{
+	return eCurrentKernel;
+}
+
+float MotionGetActivity(const MotionSummary &summary)
+{
+	float speed = summary.meanLength / MOTION_FAST_PIXELS;
+	return 0.5f * summary.movingRatio + 0.5f * (speed < 1.0f ? speed : 1.0f);
+}
+
+void MotionPackBlocks(const NV_ENC_H264_MV_DATA *pMV, uint32_t nBlock, MotionBlock *pBlock)
+{
+	pfnPack(pMV, nBlock, pBlock);
+}
+
+static inline int ClampToHistogram(int v)
+{
+	return v < -MOTION_HISTOGRAM_QPEL ? 0 : v > MOTION_HISTOGRAM_QPEL ? 2 * MOTION_HISTOGRAM_QPEL : v + MOTION_HISTOGRAM_QPEL;
+}
+
+// The median of the histogram, in pixels
+static float GetMedian(const std::vector<uint32_t> &vHistogram, uint32_t nBlock)
+{
+	uint32_t nBelow = 0;
+	for (size_t i = 0; i < vHistogram.size(); i++) {
+		nBelow += vHistogram[i];
+		if (nBelow * 2 >= nBlock) {
+			return ((int)i - MOTION_HISTOGRAM_QPEL) / 4.0f;
+		}
+	}
+	return 0.0f;
+}
+
+void MotionSummarize(const MotionBlock *pBlock, uint32_t nBlock, MotionSummary &summary, MotionScratch &scratch)
+{
+	memset(&summary, 0, sizeof(summary));
+	if (!nBlock) {
+		return;
+	}
+	MotionSums sums = { 0.0, 0, 0 };
+	pfnSum(pBlock, nBlock, sums);
+	summary.meanLength = (float)(sums.length / nBlock / 4.0);
+	summary.movingRatio = (float)sums.nMoving / nBlock;
+	summary.meanCost = (float)((double)sums.qwCost / nBlock);
+
+	scratch.vHistogramX.assign(2 * MOTION_HISTOGRAM_QPEL + 1, 0);
+	scratch.vHistogramY.assign(2 * MOTION_HISTOGRAM_QPEL + 1, 0);
+	for (uint32_t i = 0; i < nBlock; i++) {
+		scratch.vHistogramX[ClampToHistogram(pBlock[i].mvx)]++;
+		scratch.vHistogramY[ClampToHistogram(pBlock[i].mvy)]++;
+	}
+	summary.globalX = GetMedian(scratch.vHistogramX, nBlock);
+	summary.globalY = GetMedian(scratch.vHistogramY, nBlock);
+}
+
+size_t MotionParseStreamHeader(const uint8_t *pData, size_t cb, MotionStreamHeader &header)
+{
+	if (cb < sizeof(header)) {
+		return 0;
+	}
+	memcpy(&header, pData, sizeof(header));
+	// Later versions may only append to the frame header
+	if (header.dwMagic != MOTION_STREAM_MAGIC || header.wVersion < MOTION_STREAM_VERSION
+		|| header.cbFrameHeader < sizeof(MotionFrameHeader) || header.cbBlock != sizeof(MotionBlock)) {
+		return 0;
+	}
+	return sizeof(header);
+}
+
+size_t MotionParseFrame(const MotionStreamHeader &header, const uint8_t *pData, size_t cb,
+	MotionFrameHeader &frame, const MotionBlock **ppBlock)
+{
+	if (cb < header.cbFrameHeader) {
+		return 0;
+	}
+	memcpy(&frame, pData, sizeof(frame));
+	size_t cbFrame = header.cbFrameHeader + (size_t)frame.wMbWidth * frame.wMbHeight * sizeof(MotionBlock);
+	if (cb < cbFrame) {
+		return 0;
+	}
+	*ppBlock = (const MotionBlock *)(pData + header.cbFrameHeader);
+	return cbFrame;
+}
+
+MotionExport::MotionExport() : nFrame(0)
+{
+	memset(&summary, 0, sizeof(summary));
+}
+
+void MotionExport::AddFrame(const NV_ENC_H264_MV_DATA *pMV, uint32_t mbWidth, uint32_t mbHeight,
+	uint32_t dwInputFrame, uint32_t dwReferenceFrame, std::vector<uint8_t> &vData)
+{
+	uint32_t nBlock = mbWidth * mbHeight;
+	size_t cbStreamHeader = nFrame ? 0 : sizeof(MotionStreamHeader);
+	vData.resize(cbStreamHeader + sizeof(MotionFrameHeader) + nBlock * sizeof(MotionBlock));
+	if (cbStreamHeader) {
+		MotionStreamHeader header;
+		header.dwMagic = MOTION_STREAM_MAGIC;
+		header.wVersion = MOTION_STREAM_VERSION;
+		header.cbFrameHeader = sizeof(MotionFrameHeader);
+		header.cbBlock = sizeof(MotionBlock);
+		header.wReserved = 0;
+		memcpy(vData.data(), &header, sizeof(header));
+	}
+
+	MotionBlock *pBlock = (MotionBlock *)(vData.data() + cbStreamHeader + sizeof(MotionFrameHeader));
+	MotionPackBlocks(pMV, nBlock, pBlock);
+	MotionSummarize(pBlock, nBlock, summary, scratch);
+
+	MotionFrameHeader frame;
+	frame.dwInputFrame = dwInputFrame;
+	frame.dwReferenceFrame = dwReferenceFrame;
+	frame.wMbWidth = (uint16_t)mbWidth;
+	frame.wMbHeight = (uint16_t)mbHeight;
+	frame.summary = summary;
+	memcpy(vData.data() + cbStreamHeader, &frame, sizeof(frame));
+	nFrame++;
+}
@@ -0,0 +1,137 @@
+/*!
+ * \brief
+ * Binary export and per-frame summary of the motion vectors of ME-only mode
+ *
+ * \file
+ *
+ * With -meonly the encoder session only runs motion estimation: every frame
+ * gives one NV_ENC_H264_MV_DATA per macroblock against the previous frame.
+ * MotionExport turns them into a stream that is cheap to write and to read
+ * back, and into a summary of the frame's motion.
+ *
+ * The stream starts with a MotionStreamHeader. Every frame is a
+ * MotionFrameHeader followed by mbWidth * mbHeight MotionBlocks in raster
+ * order, little-endian like the x86 hosts that write it. A block keeps one
+ * vector, the mean of its partitions' vectors, and its cost saturated to
+ * 16 bits: 8 bytes where the driver's record has 24, and at 1080p 64 KB per
+ * frame where the text dump used to print 8160 lines.
+ *
+ * The summary is the mean vector length, the fraction of moving blocks (a
+ * vector of MOTION_MOVING_QPEL or longer), the global motion (the median
+ * vector, which a pan moves and a sprite on a still background does not)
+ * and the mean block cost. Activity folds the first two into 0..1 for rate
+ * control. Packing and summing run on SSE2, like Scaler; the median comes
+ * from a histogram of the vectors.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "inc/nvEncodeAPI.h"
+
+// "NVMV" in the first bytes of the stream
+#define MOTION_STREAM_MAGIC 0x564D564E
+#define MOTION_STREAM_VERSION 1
+// A block moves with a vector at least this long, in quarter pixels
+#define MOTION_MOVING_QPEL 4
+// Mean vector length, in pixels per frame, at which the length alone makes the activity 1
+#define MOTION_FAST_PIXELS 16.0f
+// The median is taken of vectors clamped to this many quarter pixels
+#define MOTION_HISTOGRAM_QPEL 512
+
+enum MotionKernel {
+	MOTION_KERNEL_SCALAR,
+	MOTION_KERNEL_SSE2,
+};
+
+// SSE2 is the default; the scalar kernel is there for comparison
+bool MotionSelectKernel(MotionKernel eKernel);
+MotionKernel MotionGetKernel();
+
+#pragma pack(push, 1)
+struct MotionStreamHeader {
+	uint32_t dwMagic;
+	uint16_t wVersion;
+	// Sizes of the records that follow, so that a reader skips fields it does not know
+	uint16_t cbFrameHeader;
+	uint16_t cbBlock;
+	uint16_t wReserved;
+};
+
+struct MotionSummary {
+	// Vector lengths and global motion in pixels
+	float meanLength;
+	float movingRatio;
+	float globalX, globalY;
+	float meanCost;
+};
+
+struct MotionFrameHeader {
+	uint32_t dwInputFrame;
+	uint32_t dwReferenceFrame;
+	uint16_t wMbWidth, wMbHeight;
+	MotionSummary summary;
+};
+
+struct MotionBlock {
+	// Quarter pixels
+	int16_t mvx, mvy;
+	uint16_t wCost;
+	uint8_t bMbType;
+	uint8_t bPartitionType;
+};
+#pragma pack(pop)
+
+// 0 for a still frame, 1 for one that moves all over or fast
+float MotionGetActivity(const MotionSummary &summary);
+
+// One MotionBlock per driver record
+void MotionPackBlocks(const NV_ENC_H264_MV_DATA *pMV, uint32_t nBlock, MotionBlock *pBlock);
+
+// Histograms of the median, kept by the caller between frames
+struct MotionScratch {
+	std::vector<uint32_t> vHistogramX, vHistogramY;
+};
+
+void MotionSummarize(const MotionBlock *pBlock, uint32_t nBlock, MotionSummary &summary, MotionScratch &scratch);
+
+/*! Reads the stream header at pData. Returns its size, or 0 if cb is too short or it
+    is not a motion stream. */
+size_t MotionParseStreamHeader(const uint8_t *pData, size_t cb, MotionStreamHeader &header);
+/*! Reads the frame at pData; pBlock points into pData. Returns the frame's size, or 0 if
+    cb does not hold all of it. */
+size_t MotionParseFrame(const MotionStreamHeader &header, const uint8_t *pData, size_t cb,
+	MotionFrameHeader &frame, const MotionBlock **ppBlock);
+
+class MotionExport
+{
+public:
+	MotionExport();
+
+	/*! Packs and summarizes the vectors of one frame and sets vData to its record, which
+	    starts with the stream header if it is the first frame. */
+	void AddFrame(const NV_ENC_H264_MV_DATA *pMV, uint32_t mbWidth, uint32_t mbHeight,
+		uint32_t dwInputFrame, uint32_t dwReferenceFrame, std::vector<uint8_t> &vData);
+	// The summary of the last frame; all zero before the first
+	const MotionSummary &GetSummary()
+	{
+		return summary;
+	}
+	unsigned int GetFrameCount()
+	{
+		return nFrame;
+	}
+
+private:
+	unsigned int nFrame;
+	MotionSummary summary;
+	MotionScratch scratch;
+};
@@ -24,14 +24,17 @@
 
 /* We must include d3d9.h here. NvIFRLibrary needs d3d9.h to be included before itself.*/
 #include <d3d9.h>
-#include <process.h>
 #include <NvIFRLibrary.h>
 #include "NvIFREncoder.h"
 #include <thread>
 #include <atomic>
+#include <mutex>
 #include <ctime>
+#include <cmath>
 
 #include "../DXGI/NvEncoder.h"
+#include "EncoderRuntime.h"
+#include "BufferPool.h"
 
 #pragma comment(lib, "winmm.lib")
 
@@ -45,6 +48,10 @@ uint8_t *bufferArray[MAX_PLAYERS];
 
 // Streaming constants
 #define STREAM_FRAME_RATE 30 // Number of images per second
+// Key frame interval the on-demand recovery points are compared with (the ffmpeg paths use keyint=30)
+#define REFERENCE_KEY_INT 30
+// Period of the player's statistics in the log, whatever the frame rate
+#define REPORT_INTERVAL_US 10000000
 
 // Input and Output video size
 int bufferWidth;
@@ -52,9 +59,14 @@ int bufferHeight;
 
 // Bit rate switching variables
 const int bandwidthPerPlayer = 1000000;
+#define MIN_BITRATE 100000
+#define MAX_BITRATE 3000000
 int totalBandwidthAvailable = 0;
-int sumWeight = 0;
+float sumWeight = 0;
+// Digit of the player input file, -1 if there is none
 int playerInputArray[MAX_PLAYERS] = { 0 };
+// Share of the bandwidth from the input and the activity of the picture, see ActivityEstimator::Combine()
+float playerWeightArray[MAX_PLAYERS] = { 0 };
 
 // Function to use to measure time elapsed
 LONGLONG g_llBegin1 = 0;
@@ -80,12 +92,15 @@ double GetFloatingDate1()
 
 BOOL NvIFREncoder::StartEncoder(int index, int windowWidth, int windowHeight)
 {
+    // Called on the first Present of the swap chain
+    qwStartUs = Metrics::NowUs();
+    qwLastReportUs = qwStartUs;
     bufferWidth = windowWidth;
     bufferHeight = windowHeight;
 
-    hevtStopEncoder = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if (!hevtStopEncoder) {
-        LOG_ERROR(logger, "Failed to create hevtStopEncoder");
+    hevtEncoderStopped = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!hevtEncoderStopped) {
+        LOG_ERROR(logger, "Failed to create hevtEncoderStopped");
         return FALSE;
     }
     bStopEncoder = FALSE;
@@ -99,33 +114,51 @@ BOOL NvIFREncoder::StartEncoder(int index, int windowWidth, int windowHeight)
 
     indexToUse = index;
     totalBandwidthAvailable += bandwidthPerPlayer;
-    hthEncoder = (HANDLE)_beginthread(EncoderThreadStartProc, 0, this);
 
-    if (!hthEncoder) {
-        return FALSE;
-    }
+    // The first encoder applies the session's placement policy to the shared pool and starts the metrics endpoint
+    static std::once_flag onceConfigurePlacement;
+    std::call_once(onceConfigurePlacement, [this] {
+        if (pAppParam) {
+            pPlacement->Configure((PlacementPolicy)pAppParam->ePlacementPolicy,
+                pAppParam->qwEncoderCpuMask, pAppParam->qwGameCpuMask, pTaskPool);
+            if (pAppParam->wMetricsPort) {
+                Metrics::GetShared()->StartServer(pAppParam->wMetricsPort);
+            }
+        }
+    });
+    // StartEncoder() runs on the game's render thread
+    pPlacement->IsolateGameThread();
+    iWorker = pPlacement->GetPlayerWorker(index);
+    pTaskPool->Submit([this, index] { SetupTask(index); }, iWorker, true);
 
     WaitForSingleObject(hevtInitEncoderDone, INFINITE);
     CloseHandle(hevtInitEncoderDone);
     hevtInitEncoderDone = NULL;
 
-    return bInitEncoderSuccessful;
+    if (!bInitEncoderSuccessful) {
+        CloseHandle(hevtEncoderStopped);
+        hevtEncoderStopped = NULL;
+        bStopEncoder = TRUE;
+        return FALSE;
+    }
+    pTaskPool->Submit([this, index] { FrameTask(index); }, iWorker);
+    return TRUE;
 }
 
 void NvIFREncoder::StopEncoder()
 {
-    if (bStopEncoder || !hevtStopEncoder || !hthEncoder) {
+    if (bStopEncoder || !hevtEncoderStopped) {
         return;
     }
 
+    // The task chain notices the flag within one frame period and runs CleanupTask
     bStopEncoder = TRUE;
-    SetEvent(hevtStopEncoder);
-    WaitForSingleObject(hthEncoder, INFINITE);
-    CloseHandle(hevtStopEncoder);
-    hevtStopEncoder = NULL;
+    WaitForSingleObject(hevtEncoderStopped, INFINITE);
+    CloseHandle(hevtEncoderStopped);
+    hevtEncoderStopped = NULL;
 }
 
-void NvIFREncoder::EncoderThreadProc(int index)
+void NvIFREncoder::SetupTask(int index)
 {
     /*Note:
     1. The D3D device for encoding must be create on a seperate thread other than the game rendering thread.
@@ -135,8 +168,8 @@ void NvIFREncoder::EncoderThreadProc(int index)
     the same thread, or you get D3DERR_INVALIDCALL.*/
     if (!SetupNvIFR()) {
         LOG_ERROR(logger, "Failed to setup NvIFR.");
-        SetEvent(hevtInitEncoderDone);
         CleanupNvIFR();
+        SetEvent(hevtInitEncoderDone);
         return;
     }
 
@@ -152,170 +185,485 @@ void NvIFREncoder::EncoderThreadProc(int index)
 
     if (nr != NVIFR_SUCCESS) {
         LOG_ERROR(logger, "NvIFRSetUpTargetBufferToSys failed, nr=" << nr);
-        SetEvent(hevtInitEncoderDone);
         CleanupNvIFR();
+        SetEvent(hevtInitEncoderDone);
         return;
     }
     LOG_DEBUG(logger, "NvIFRSetUpTargetBufferToSys succeeded");
 
-    bInitEncoderSuccessful = TRUE;
-    SetEvent(hevtInitEncoderDone);
-
     // Initialization of Nvidia Codec SDK parameters
-    int currentBitrate = 2500000;
-    int targetBitrate = currentBitrate;
+    currentBitrate = 2500000;
+    pCongestion = new CongestionControl(currentBitrate, MIN_BITRATE);
+    pBitrateSmoother = new BitrateSmoother(currentBitrate);
+    pMetrics = Metrics::GetShared()->GetPlayer(index);
 
     // To sleep if encoding is going faster than framerate of the game
-    UINT uFrameCount = 0;
-    DWORD dwTimeZero = timeGetTime();
-
-    char c = '0';
-    int timeBeforeIdle = 3;
-    bool isIdling = false;
-    time_t shootingStartTime = std::time(0);
-    time_t idleStartTime = 0;
+    uFrameCount = 0;
+    dwTimeZero = timeGetTime();
 
     // To read the player input data for adaptive bitrate
     TCHAR szPath[MAX_PATH];
     GetCurrentDirectory(MAX_PATH, szPath);
     ostringstream oss;
-    oss << szPath << "\\test" << index << ".txt";    
-    ifstream fin;
+    oss << szPath << "\\test" << index << ".txt";
+    strInputWeightPath = oss.str();
+    activity.Configure(bufferWidth, bufferHeight);
+
+    // With -service the launcher encodes, and the frames only go to the player's ring
+    if (pAppParam && pAppParam->bEncodeService)
+    {
+        pFrameTransport = new FrameTransport;
+        if (pFrameTransport->Create(FrameTransport::GetName(GetCurrentProcessId(), index), bufferWidth, bufferHeight, STREAM_FRAME_RATE))
+        {
+            LOG_INFO(logger, "Player " << index << " is encoded by the encode service");
+            bInitEncoderSuccessful = TRUE;
+            SetEvent(hevtInitEncoderDone);
+            return;
+        }
+        LOG_ERROR(logger, "Failed to create the frame ring of player " << index << ", encoding in the game process");
+        delete pFrameTransport;
+        pFrameTransport = NULL;
+    }
 
     // Setup Nvidia Video Codec SDK
-    CNvEncoder nvEncoder(index);
-    nvEncoder.EncodeMain(index, bufferWidth, bufferHeight, STREAM_FRAME_RATE, currentBitrate);
+    pNvEncoder = new CNvEncoder(index);
+    if (pNvEncoder->EncodeMain(index, bufferWidth, bufferHeight, STREAM_FRAME_RATE, currentBitrate,
+        pAppParam ? pAppParam->szEncoderOptions : NULL))
+    {
+        // Neither a GPU nor the software encoder took the player
+        LOG_ERROR(logger, "Failed to start the encoder of player " << index);
+        pNvEncoder->ShutdownNvEncoder();
+        delete pNvEncoder;
+        pNvEncoder = NULL;
+        delete pCongestion;
+        pCongestion = NULL;
+        delete pBitrateSmoother;
+        pBitrateSmoother = NULL;
+        CleanupNvIFR();
+        SetEvent(hevtInitEncoderDone);
+        return;
+    }
 
-    while (!bStopEncoder)
+    // Simulcast renditions of the same capture, each with an encoder session and an output of its own
+    for (int r = 0; pAppParam && r < N_RENDITION && pAppParam->awRenditionHeight[r]; r++)
     {
-        fin.open(oss.str());
-        if (fin.is_open())
+        int iRendition = r + 1;
+        int height = pAppParam->awRenditionHeight[r] & ~1;
+        int width = (int)((long long)bufferWidth * height / bufferHeight) & ~1;
+        Rendition *pRendition = new Rendition;
+        if (height >= bufferHeight || !pRendition->scaler.Configure(bufferWidth, bufferHeight, width, height))
         {
-            // Always read the value at the end of the file
-            fin.seekg(-3, ios::end); // -1 and -2 gets \n on the last line
-            fin.get(c);
-            fin.close();
-        
-			/* SP Edit: commented out chunk
-            // If we shoot, we should refresh the shooting start time
-            if (c == '3')
-            {
-                shootingStartTime = std::time(0);
-            }
-        
-            // We cannot let any other movement e.g. "c = 2" through if we have recently shot
-            if ((std::time(0) - shootingStartTime) < timeBeforeIdle)
+            LOG_ERROR(logger, "Rendition " << iRendition << " of player " << index << " cannot be " << width << "x" << height
+                << ", the ladder stops here");
+            delete pRendition;
+            break;
+        }
+        pRendition->pFrame = BufferPool::GetShared()->AcquireHost(pRendition->scaler.GetDstSize(), index, iRendition);
+        if (!pRendition->pFrame)
+        {
+            delete pRendition;
+            break;
+        }
+        // Fewer pixels need fewer bits per pixel less than proportionally
+        pRendition->bitrateRatio = pow((double)width * height / ((double)bufferWidth * bufferHeight), 0.75);
+        pRendition->pMetrics = Metrics::GetShared()->GetPlayer(index, iRendition);
+        pRendition->pEncoder = new CNvEncoder(index, iRendition);
+        if (pRendition->pEncoder->EncodeMain(index, width, height, STREAM_FRAME_RATE, (int)(currentBitrate * pRendition->bitrateRatio),
+            pAppParam->szEncoderOptions, iRendition * RENDITION_PORT_STRIDE))
+        {
+            LOG_ERROR(logger, "Failed to start the encoder of rendition " << iRendition << " of player " << index << ", the ladder stops here");
+            pRendition->pEncoder->ShutdownNvEncoder();
+            delete pRendition->pEncoder;
+            BufferPool::GetShared()->ReleaseHost(pRendition->pFrame);
+            delete pRendition;
+            break;
+        }
+        vpRendition.push_back(pRendition);
+        LOG_INFO(logger, "Rendition " << iRendition << " of player " << index << ": " << width << "x" << height);
+    }
+
+    bInitEncoderSuccessful = TRUE;
+    SetEvent(hevtInitEncoderDone);
+}
+
+void NvIFREncoder::FrameTask(int index)
+{
+    if (bStopEncoder)
+    {
+        LOG_DEBUG(logger, "Quit encoding loop");
+        pTaskPool->Submit([this, index] { CleanupTask(index); }, iWorker, true);
+        return;
+    }
+    qwFrameStartUs = Metrics::NowUs();
+
+    char c = '0';
+    ifstream fin(strInputWeightPath);
+    if (fin.is_open())
+    {
+        // Always read the value at the end of the file
+        fin.seekg(-3, ios::end); // -1 and -2 gets \n on the last line
+        fin.get(c);
+        fin.close();
+        playerInputArray[index] = (c - '0');
+    }
+    else
+    {
+        // The activity of the picture alone shares the bandwidth then
+        if (playerInputArray[index] >= 0)
+        {
+            LOG_WARN(logger, "Failed to open file " << index << ", sharing the bandwidth by the activity only");
+        }
+        playerInputArray[index] = -1;
+    }
+
+    // Index 0 will do the summing of the array.
+    // This will pose problems in the future if player 0 can 
+    // just leave while the other players are playing.
+    if (index == 0)
+    {
+        sumWeight = 0;
+        for (int i = 0; i < MAX_PLAYERS; i++)
+        {
+            sumWeight += playerWeightArray[i];
+        }
+    }
+
+    if (!UpdateBackBuffer())
+    {
+        LOG_DEBUG(logger, "UpdateBackBuffer() failed");
+    }
+
+    qwTransferStartUs = Metrics::NowUs();
+    NVIFRRESULT res = pIFR->NvIFRTransferRenderTargetToSys(0);
+
+    if (res == NVIFR_SUCCESS)
+    {
+        // The GPU transfer is waited for by the pool, not by a worker
+        pTaskPool->SubmitOnEvent(gpuEvent[index], [this, index](BOOL bTimedOut) { EncodeTask(index, bTimedOut); },
+            1000 / STREAM_FRAME_RATE * 4, iWorker);
+        return;
+    }
+
+    LOG_ERROR(logger, "NvIFRTransferRenderTargetToSys failed, res=" << res);
+    pMetrics->pCaptureFailure->Add();
+    ScheduleNextFrame(index);
+}
+
+void NvIFREncoder::EncodeTask(int index, BOOL bTimedOut)
+{
+    if (bTimedOut)
+    {
+        if (bStopEncoder)
+        {
+            ScheduleNextFrame(index);
+            return;
+        }
+        // Keep waiting: the timeout only exists so that StopEncoder() is never held up
+        LOG_WARN(logger, "Slow NvIFR transfer, index=" << index);
+        pMetrics->pTransferTimeout->Add();
+        pTaskPool->SubmitOnEvent(gpuEvent[index], [this, index](BOOL bTimedOut) { EncodeTask(index, bTimedOut); },
+            1000 / STREAM_FRAME_RATE * 4, iWorker);
+        return;
+    }
+    ResetEvent(gpuEvent[index]);
+    pMetrics->pFrameCaptured->Add();
+    pMetrics->pTransferUs->Record(Metrics::NowUs() - qwTransferStartUs);
+
+    // Hand the viewers' recovery requests to the encoder; they are coalesced there
+    RecoveryControl *pRecovery = pNvEncoder ? pNvEncoder->GetRecoveryControl() : NULL;
+    if (pAppParam && index < N_RECOVERY_PLAYER)
+    {
+        RecoveryEvent aEvent[N_RECOVERY_EVENT];
+        uint32_t nEvent = pAppParam->aRecoveryRing[index].PopBatch(aEvent, N_RECOVERY_EVENT);
+        for (uint32_t i = 0; i < nEvent; i++)
+        {
+            // Each rendition makes its own recovery points, e.g. the IDR a switching viewer waits for
+            DWORD dwRendition = aEvent[i].dwRendition;
+            if (dwRendition && dwRendition <= vpRendition.size())
             {
-                c = '3';
+                vpRendition[dwRendition - 1]->pEncoder->GetRecoveryControl()->Post(aEvent[i]);
             }
-            // No input from player - is idling
-            else if (c == '1')
+            else if (pRecovery)
             {
-                if (isIdling == false)
-                {
-                    // Start the countdown
-                    idleStartTime = std::time(0);
-                    isIdling = true;
-                }
-                // We have idled for more than 3 seconds
-                else if ((std::time(0) - idleStartTime) >= timeBeforeIdle)
-                {
-                    c = '1';
-                }
+                pRecovery->Post(aEvent[i]);
             }
-            // If there is input, allow countdown to restart
-            else if (c == '3' || c == '2')
+            else
             {
-                isIdling = false; // There is input. 
+                // The service's encoder answers every request with an IDR
+                bServiceIdr = true;
             }
-        
-			*/
-            playerInputArray[index] = (c - '0');
         }
-        else
+    }
+
+    // Receiver feedback from the viewer's transport
+    DWORD dwNow = timeGetTime();
+    if (pAppParam && index < N_RECOVERY_PLAYER)
+    {
+        CongestionReport aReport[N_CONGESTION_REPORT];
+        uint32_t nReport = pAppParam->aCongestionRing[index].PopBatch(aReport, N_CONGESTION_REPORT);
+        for (uint32_t i = 0; i < nReport; i++)
         {
-            LOG_ERROR(logger, "Failed to open file " << index);
+            pCongestion->OnReport(aReport[i], dwNow);
         }
-        
-        // Index 0 will do the summing of the array.
-        // This will pose problems in the future if player 0 can 
-        // just leave while the other players are playing.
-        if (index == 0)
+    }
+    pCongestion->OnTick(dwNow);
+    // The parity count follows the loss the viewer sees
+    FecSender *pFecSender = pNvEncoder ? pNvEncoder->GetFecSender(index) : NULL;
+    if (pFecSender)
+    {
+        pFecSender->SetLossRatio(pCongestion->GetLossRatio());
+    }
+
+    // Adaptive bitrate - depends on other players, by what they press and what their picture shows
+    uint64_t qwActivityStartUs = Metrics::NowUs();
+    float score = activity.Update(bufferArray[index], bufferWidth);
+    pMetrics->pActivityUs->Record(Metrics::NowUs() - qwActivityStartUs);
+    pMetrics->pActivity->Set((int64_t)(score * 1000));
+    playerWeightArray[index] = ActivityEstimator::Combine(score, playerInputArray[index]);
+    // The sum lags by a frame; before player 0 has summed any weight the player has it all
+    float weight = sumWeight > 0 ? playerWeightArray[index] / sumWeight : 1.0f;
+    // SP Edit: limit the min and max bit rate
+    int targetBitrate = (int)(weight * totalBandwidthAvailable);
+
+    targetBitrate = targetBitrate < MAX_BITRATE ? targetBitrate : MAX_BITRATE;
+    targetBitrate = targetBitrate > MIN_BITRATE ? targetBitrate : MIN_BITRATE;
+    // The player's share may not exceed what its viewer's path can carry
+    DWORD dwEstimate = pCongestion->GetEstimate();
+    targetBitrate = (DWORD)targetBitrate < dwEstimate ? targetBitrate : (int)dwEstimate;
+
+    // Small changes are absorbed and increases ramped, see BitrateSmoother
+    DWORD dwBitrate;
+    bool bReconfigure = pBitrateSmoother->Update(targetBitrate, dwNow, &dwBitrate);
+    if (pFrameTransport)
+    {
+        // The service encodes the frame at the bitrate it comes with, and makes no renditions
+        PublishFrame(index, dwBitrate);
+        currentBitrate = dwBitrate;
+        pMetrics->pFrameTaskUs->Record(Metrics::NowUs() - qwFrameStartUs);
+        pMetrics->pTargetBitrate->Set(dwBitrate);
+        pMetrics->pCongestionEstimate->Set(dwEstimate);
+        nPendingTask = 1;
+        FinishFrame(index);
+        return;
+    }
+    // The renditions scale and encode the same frame on other workers meanwhile; the frame buffer
+    // is not refilled before all of them are done
+    nPendingTask = (int)vpRendition.size() + 1;
+    for (size_t r = 0; r < vpRendition.size(); r++)
+    {
+        int iRendition = (int)r + 1;
+        pTaskPool->Submit([this, index, iRendition, bReconfigure, dwBitrate] { RenditionTask(index, iRendition, bReconfigure, dwBitrate); });
+    }
+    pNvEncoder->EncodeFrameLoop(bufferArray[index], bReconfigure, index, dwBitrate);
+    currentBitrate = dwBitrate;
+    pMetrics->pFrameTaskUs->Record(Metrics::NowUs() - qwFrameStartUs);
+    pMetrics->pTargetBitrate->Set(dwBitrate);
+    pMetrics->pCongestionEstimate->Set(dwEstimate);
+    if (qwStartUs)
+    {
+        uint64_t qwStartupUs = Metrics::NowUs() - qwStartUs;
+        pMetrics->pStartupUs->Record(qwStartupUs);
+        EncoderRuntime::Stats runtimeStats = EncoderRuntime::GetShared()->GetStats();
+        LOG_INFO(logger, "First frame of player " << index << " encoded " << qwStartupUs << "us after the first Present"
+            << ", " << runtimeStats.nHit << " pre-opened and " << runtimeStats.nMiss << " late encoder sessions so far");
+        qwStartUs = 0;
+    }
+
+    if (pPlacement->RecordAccess(index, bufferArray[index], bufferWidth * bufferHeight * 3 / 2))
+    {
+        LOG_INFO(logger, "Placement of player " << index << ": node " << pPlacement->GetPlayerNode(index)
+            << ", cross-node frames " << pPlacement->GetCrossNodeFrameCount(index) << "/" << pPlacement->GetFrameCount(index)
+            << ", cross-node bytes " << pPlacement->GetCrossNodeBytes(index));
+    }
+
+    if (IsReportDue())
+    {
+        RecoveryControl::Stats stats = pRecovery->GetStats();
+        LOG_INFO(logger, "Recovery of player " << index << ": " << stats.nIdr << " IDRs for " << stats.nIdrRequest << " requests"
+            << ", " << stats.nInvalidation << " invalidations for " << stats.nLossReport << " loss reports"
+            << " (" << stats.nEscalation << " escalated)"
+            << ", saved " << pRecovery->GetSavedBytes(REFERENCE_KEY_INT) << " bytes vs. keyint=" << REFERENCE_KEY_INT);
+
+        // Bursts above the channel rate show up as a high peak-to-average frame size
+        uint32_t uPeakBytes, uAverageBytes;
+        double peakToAverage = pNvEncoder->TakePeakToAverage(&uPeakBytes, &uAverageBytes);
+        LOG_INFO(logger, "Frame size of player " << index << ": peak " << uPeakBytes << ", average " << uAverageBytes
+            << ", peak-to-average " << peakToAverage);
+
+        CongestionControl::Stats ccStats = pCongestion->TakeStats();
+        LOG_INFO(logger, "Congestion of player " << index << ": estimate " << ccStats.dwEstimate << ", received " << ccStats.dwReceiveRate
+            << ", loss " << ccStats.lossRatio * 100 << "%, delay trend " << ccStats.trend << "/" << ccStats.threshold << "ms"
+            << ", " << ccStats.nOveruse << " overuse, " << ccStats.nLossDecrease << " loss and " << ccStats.nFeedbackTimeout << " feedback timeout decreases"
+            << " in " << ccStats.nReport << " reports, bitrate " << currentBitrate << " after " << pBitrateSmoother->GetReconfigureCount() << " reconfigurations");
+
+        // Every sink drops on its own; the first one is the stream to the viewer
+        SinkGraph *pSinkGraph = pNvEncoder->GetSinkGraph(index);
+        for (int iSink = 0; pSinkGraph && pSinkGraph->GetSink(iSink); iSink++)
         {
-            sumWeight = 0;
-            for (int i = 0; i < MAX_PLAYERS; i++)
-            {
-                sumWeight += playerInputArray[i];
-            }
+            SinkQueue::Stats sinkStats = pSinkGraph->GetSink(iSink)->TakeStats();
+            LOG_INFO(logger, "Output of player " << index << " to " << pSinkGraph->GetSinkName(iSink) << ": " << sinkStats.nFrame << " frames, "
+                << sinkStats.nDroppedFrame << " dropped (" << sinkStats.qwDroppedBytes << " bytes), " << sinkStats.nKeyFrameRequest << " key frame requests"
+                << ", " << sinkStats.nWriteError << " write errors, queue high water " << sinkStats.cbHighWater << " bytes");
         }
 
-        if (!UpdateBackBuffer())
+        if (pFecSender)
         {
-            LOG_DEBUG(logger, "UpdateBackBuffer() failed");
+            FecSender::Stats fecStats = pFecSender->TakeStats();
+            LOG_INFO(logger, "FEC of player " << index << ": " << fecStats.nChunk << " chunks in " << fecStats.nPacket << " packets"
+                << " (" << fecStats.nParityPacket << " parity), " << fecStats.qwBytes << " bytes, " << fecStats.nSendError << " send errors"
+                << ", " << fecStats.nParityPerBlock << " parity per block");
         }
 
-        NVIFRRESULT res = pIFR->NvIFRTransferRenderTargetToSys(0);
+        const ActivityEstimator::Frame &activityFrame = activity.GetLastFrame();
+        LOG_INFO(logger, "Activity of player " << index << ": score " << activity.GetScore() << ", last frame difference "
+            << activityFrame.difference << ", gradient " << activityFrame.gradient << ", input " << playerInputArray[index]
+            << ", weight " << playerWeightArray[index] << " of " << sumWeight);
 
-        if (res == NVIFR_SUCCESS)
+        MotionSummary motion;
+        if (pNvEncoder->GetMotionSummary(index, &motion))
         {
-            HANDLE ahevt[] = { gpuEvent[index], hevtStopEncoder };
-            //DWORD dwRet = WaitForSingleObject(gpuEvent[index], INFINITE);
-            DWORD dwRet = WaitForMultipleObjects(sizeof(ahevt) / sizeof(ahevt[0]), ahevt, FALSE, INFINITE);
-            if (dwRet != WAIT_OBJECT_0)// If not signalled
-            {
-                if (dwRet != WAIT_OBJECT_0 + 1)
-                {
-                    LOG_WARN(logger, "Abnormally break from encoding loop, dwRet=" << dwRet);
-                }
-                return;
-            }
-            ResetEvent(gpuEvent[index]);
-
-            // Adaptive bitrate - independent of other players
-            //if (playerInputArray[index] == 3) { // shooting
-            //    targetBitrate = 5000000;
-            //}
-            //else if (playerInputArray[index] == 2) { // mouse movement or any other keyboard key
-            //    targetBitrate = 2500000;
-            //}
-            //else if (playerInputArray[index] == 1) { // no input
-            //    targetBitrate = 500000;
-            //}
-
-            // Adaptive bitrate - depends on other players
-            float weight = (float)playerInputArray[index] / (float)sumWeight;
-			// SP Edit: limit the min and max bit rate
-            targetBitrate = (int)(weight * totalBandwidthAvailable);
-            
-			targetBitrate = targetBitrate < 3000000 ? targetBitrate : 3000000;
-			targetBitrate = targetBitrate > 100000 ? targetBitrate : 100000;
-
-            if (targetBitrate != currentBitrate)
-            {
-                nvEncoder.EncodeFrameLoop(bufferArray[index], true, index, targetBitrate);
-                currentBitrate = targetBitrate;
-            }
-            else
+            LOG_INFO(logger, "Motion of player " << index << ": mean vector " << motion.meanLength << "px, " << motion.movingRatio * 100
+                << "% of blocks moving, global (" << motion.globalX << ", " << motion.globalY << ")px, mean cost " << motion.meanCost
+                << ", activity " << MotionGetActivity(motion));
+        }
+
+        SoftwareEncoder *pSoftwareEncoder = pNvEncoder->GetSoftwareEncoder();
+        if (pSoftwareEncoder)
+        {
+            SoftwareEncoder::Stats swStats = pSoftwareEncoder->TakeStats();
+            LOG_INFO(logger, "Software encoder of player " << index << ": " << swStats.nFrame << " frames on "
+                << pSoftwareEncoder->GetThreadCount() << " threads, " << swStats.nSwitch << " process switches, " << swStats.nError << " errors");
+        }
+
+        SliceReadout *pSliceReadout = pNvEncoder->GetSliceReadout(index);
+        if (pSliceReadout)
+        {
+            SliceReadout::Stats sliceStats = pSliceReadout->TakeStats();
+            if (sliceStats.nFrame)
             {
-                nvEncoder.EncodeFrameLoop(bufferArray[index], false, index, targetBitrate);
+                LOG_INFO(logger, "Sub-frame readout of player " << index << ": " << sliceStats.nSlice * 1.0 / sliceStats.nFrame << " slices per frame"
+                    << ", first slice after " << sliceStats.qwFirstSliceUs / sliceStats.nFrame << "us"
+                    << ", whole frame after " << sliceStats.qwFrameUs / sliceStats.nFrame << "us"
+                    << ", " << sliceStats.nTimeout << " timeouts");
             }
-            //write_video_frame(ocArray[index], /*&ostArray[index], */bufferArray[index], index);
         }
-        else
+    }
+
+    FinishFrame(index);
+}
+
+void NvIFREncoder::RenditionTask(int index, int iRendition, bool bReconfigure, DWORD dwBitrate)
+{
+    Rendition *pRendition = vpRendition[iRendition - 1];
+    uint64_t qwStartUs = Metrics::NowUs();
+    pRendition->scaler.Scale(bufferArray[index], pRendition->pFrame);
+    pRendition->pMetrics->pScaleUs->Record(Metrics::NowUs() - qwStartUs);
+
+    // Follows the player's bitrate, reconfiguring along with it
+    DWORD dwRenditionBitrate = (DWORD)(dwBitrate * pRendition->bitrateRatio);
+    dwRenditionBitrate = dwRenditionBitrate > MIN_BITRATE ? dwRenditionBitrate : MIN_BITRATE;
+    pRendition->pEncoder->EncodeFrameLoop(pRendition->pFrame, bReconfigure, index, dwRenditionBitrate);
+    pRendition->pMetrics->pTargetBitrate->Set(dwRenditionBitrate);
+
+    FinishFrame(index);
+}
+
+void NvIFREncoder::PublishFrame(int index, DWORD dwBitrate)
+{
+    uint64_t qwPublishStartUs = Metrics::NowUs();
+    FrameRing *pRing = pFrameTransport->GetRing();
+    uint8_t *pSlot = pRing->BeginWrite();
+    if (pSlot)
+    {
+        // NvIFR writes to its own page-locked buffers, so this is the one copy of the frame
+        memcpy(pSlot, bufferArray[index], pRing->GetFrameSize());
+        FrameDesc desc = { 0 };
+        desc.dwFrame = uFrameCount;
+        desc.dwBitrate = dwBitrate;
+        desc.dwFlags = bServiceIdr ? FRAME_FLAG_IDR : 0;
+        desc.qwPublishUs = FrameTransport::NowUs();
+        pRing->Publish(desc, pFrameTransport->GetSignal());
+        pMetrics->pPublishUs->Record(Metrics::NowUs() - qwPublishStartUs);
+        bServiceIdr = false;
+        bServiceLost = false;
+    }
+    else
+    {
+        // The game goes on; a dropped frame is all a slow or dead service costs it
+        pMetrics->pServiceDrop->Add();
+        if (!bServiceLost && !pRing->IsConsumerAlive(FrameTransport::NowMs(), FRAME_TRANSPORT_TIMEOUT_MS))
         {
-            LOG_ERROR(logger, "NvIFRTransferRenderTargetToSys failed, res=" << res);
+            LOG_WARN(logger, "The encode service does not take the frames of player " << index << ", dropping them");
+            bServiceLost = true;
         }
+    }
 
-        // This sleeps the thread if we are producing frames faster than the desired framerate
-        int delta = (int)((dwTimeZero + ++uFrameCount * 1000 / STREAM_FRAME_RATE) - timeGetTime());
-        if (delta > 0) {
-            WaitForSingleObject(hevtStopEncoder, delta);
+    pPlacement->RecordAccess(index, bufferArray[index], bufferWidth * bufferHeight * 3 / 2);
+    if (IsReportDue())
+    {
+        FrameRing::Stats ringStats = pRing->GetStats();
+        LOG_INFO(logger, "Frame ring of player " << index << ": " << ringStats.nPublished << " frames published, "
+            << ringStats.nDropped << " dropped, service " << (pRing->IsConsumerAlive(FrameTransport::NowMs(), FRAME_TRANSPORT_TIMEOUT_MS) ? "alive" : "silent"));
+    }
+}
+
+bool NvIFREncoder::IsReportDue()
+{
+    uint64_t qwNowUs = Metrics::NowUs();
+    if (qwNowUs - qwLastReportUs < REPORT_INTERVAL_US)
+    {
+        return false;
+    }
+    qwLastReportUs = qwNowUs;
+    return true;
+}
+
+void NvIFREncoder::FinishFrame(int index)
+{
+    if (--nPendingTask == 0) {
+        ScheduleNextFrame(index);
+    }
+}
+
+void NvIFREncoder::ScheduleNextFrame(int index)
+{
+    // Replaces the per-thread sleep: the next tick is due at a fixed offset from dwTimeZero
+    int delta = (int)((dwTimeZero + ++uFrameCount * 1000 / STREAM_FRAME_RATE) - timeGetTime());
+    if (delta > 0 && !bStopEncoder) {
+        pTaskPool->SubmitAfter([this, index] { FrameTask(index); }, delta, iWorker);
+    } else {
+        if (!bStopEncoder) {
+            pMetrics->pPacingMiss->Add();
         }
+        pTaskPool->Submit([this, index] { FrameTask(index); }, iWorker);
     }
-    LOG_DEBUG(logger, "Quit encoding loop");
+}
 
-    nvEncoder.ShutdownNvEncoder();
+void NvIFREncoder::CleanupTask(int index)
+{
+    if (pNvEncoder)
+    {
+        pNvEncoder->ShutdownNvEncoder();
+        delete pNvEncoder;
+        pNvEncoder = NULL;
+    }
+    // Closing the ring tells the service that the player is gone
+    delete pFrameTransport;
+    pFrameTransport = NULL;
+    for (size_t r = 0; r < vpRendition.size(); r++)
+    {
+        vpRendition[r]->pEncoder->ShutdownNvEncoder();
+        delete vpRendition[r]->pEncoder;
+        BufferPool::GetShared()->ReleaseHost(vpRendition[r]->pFrame);
+        delete vpRendition[r];
+    }
+    vpRendition.clear();
+    delete pCongestion;
+    pCongestion = NULL;
+    delete pBitrateSmoother;
+    pBitrateSmoother = NULL;
     CleanupNvIFR();
+    SetEvent(hevtEncoderStopped);
 }
 
 Streamer * NvIFREncoder::pSharedStreamer = NULL;
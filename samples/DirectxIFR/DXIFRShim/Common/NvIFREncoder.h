@@ -35,6 +35,15 @@
 #include "AppParam.h"
 #include "GridAdapter.h"
 #include "Streamer.h"
+#include "TaskPool.h"
+#include "Placement.h"
+#include "CongestionControl.h"
+#include "Metrics.h"
+#include "Scaler.h"
+#include "ActivityEstimator.h"
+#include "FrameTransport.h"
+
+class CNvEncoder;
 
 class NvIFREncoder {
 public:
@@ -48,13 +57,16 @@ public:
 		bStopEncoder(TRUE), pIFR(NULL), hSharedTexture(NULL),
 		szClassName("NvIFREncoder"),
 		pBitStreamBuffer(NULL),
-		bInitEncoderSuccessful(FALSE), hevtInitEncoderDone(NULL), hthEncoder(NULL), hevtStopEncoder(NULL)
+		bInitEncoderSuccessful(FALSE), hevtInitEncoderDone(NULL), hevtEncoderStopped(NULL),
+		pTaskPool(TaskPool::GetShared()), pPlacement(Placement::GetShared()), iWorker(TaskPool::ANY_WORKER), pNvEncoder(NULL),
+		pCongestion(NULL), pBitrateSmoother(NULL), pMetrics(NULL), nPendingTask(0),
+		pFrameTransport(NULL), bServiceIdr(false), bServiceLost(false)
 	{}
 	virtual ~NvIFREncoder() 
 	{
 	/* Although every subclass calls StopEncoder() in its destructor, the common
 	   code can't be placed here, because StopEncoder() will cause virtual function 
-	   CleanupNvIFR() to get called in EncoderThreadProc(). That's an error.
+	   CleanupNvIFR() to get called in CleanupTask(). That's an error.
 	   See Effective C++, 3rd Edition, Item 9: Never Call Virtual Functions during 
 	   Construction or Destruction*/
 	}
@@ -92,13 +104,27 @@ protected:
 	virtual BOOL UpdateBackBuffer() = 0;
 
 private:
-	void EncoderThreadProc(int index);
-
-	static void EncoderThreadStartProc(void *args) 
-	{
-		NvIFREncoder* obj = static_cast<NvIFREncoder*>(args); 
-		((NvIFREncoder *)args)->EncoderThreadProc(obj->indexToUse);
-	}
+	/* The encoder runs as a chain of tasks on the shared TaskPool instead of a
+	   thread of its own: SetupTask -> (FrameTask -> EncodeTask)* -> CleanupTask.
+	   Only one task of an encoder is in flight at a time, except that EncodeTask
+	   fans out a RenditionTask per simulcast rendition and the last of them to
+	   finish schedules the next frame. Setup and cleanup are
+	   pinned to the encoder's worker because the window must be created and
+	   destroyed on the same thread; frame tasks only prefer that worker.
+	   Running setup on that worker also places the NvIFR and NVENC buffers
+	   on the worker's NUMA node.*/
+	void SetupTask(int index);
+	void FrameTask(int index);
+	void EncodeTask(int index, BOOL bTimedOut);
+	void RenditionTask(int index, int iRendition, bool bReconfigure, DWORD dwBitrate);
+	// Hands the frame to the encode service instead of encoding it, see AppParam::bEncodeService
+	void PublishFrame(int index, DWORD dwBitrate);
+	// True once per REPORT_INTERVAL_US, when the frame task logs the player's statistics
+	bool IsReportDue();
+	// Called by each task of a frame; the last one schedules the next frame
+	void FinishFrame(int index);
+	void ScheduleNextFrame(int index);
+	void CleanupTask(int index);
 
 protected:
 	int nWidth, nHeight;
@@ -193,8 +219,49 @@ private:
 
 	BOOL bInitEncoderSuccessful;
 	HANDLE hevtInitEncoderDone;
-	HANDLE hthEncoder;
-	HANDLE hevtStopEncoder;
+	HANDLE hevtEncoderStopped;
+
+	TaskPool *pTaskPool;
+	Placement *pPlacement;
+	// Preferred pool worker of this encoder, chosen by the placement policy
+	int iWorker;
+	CNvEncoder *pNvEncoder;
+	int currentBitrate;
+	// Caps the allocator's share with what the path to the viewer can carry
+	CongestionControl *pCongestion;
+	BitrateSmoother *pBitrateSmoother;
+	PlayerMetrics *pMetrics;
+	// A downscaled copy of the stream for viewers with less bandwidth, see AppParam::awRenditionHeight
+	struct Rendition {
+		Scaler scaler;
+		// Scaled frame from the BufferPool
+		uint8_t *pFrame;
+		CNvEncoder *pEncoder;
+		// Bitrate relative to the captured size
+		double bitrateRatio;
+		PlayerMetrics *pMetrics;
+	};
+	// Rendition r is at r - 1
+	std::vector<Rendition *> vpRendition;
+	std::atomic<int> nPendingTask;
+	// Start of the current frame task and of its render target transfer, see Metrics::NowUs()
+	uint64_t qwFrameStartUs;
+	// The first Present, until the first frame is encoded
+	uint64_t qwStartUs;
+	uint64_t qwTransferStartUs;
+	// Last statistics report, see IsReportDue()
+	uint64_t qwLastReportUs;
+	UINT uFrameCount;
+	DWORD dwTimeZero;
+	std::string strInputWeightPath;
+	// Measures the captured frames for the bandwidth allocator, together with the input file above
+	ActivityEstimator activity;
+	// The player's ring to the encode service; NULL when the shim encodes
+	FrameTransport *pFrameTransport;
+	// A viewer asked for a recovery point that no published frame has carried yet
+	bool bServiceIdr;
+	// The service was found silent; warned once until it takes frames again
+	bool bServiceLost;
 
 	Streamer *pStreamer;
 	static Streamer *pSharedStreamer;
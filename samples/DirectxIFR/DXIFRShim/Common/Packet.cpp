@@ -0,0 +1,100 @@
+/*!
+ * \brief
+ * The implementation of Packet and PacketPool
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <string.h>
+#include <new>
+#include "Packet.h"
+#include "Metrics.h"
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+// A recycled buffer much larger than the packet is given up, so that a key frame does not pin its size forever
+#define PACKET_MAX_SLACK (1 << 20)
+
+void Packet::Release()
+{
+	if (nRef.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		pPool->Recycle(this);
+	}
+}
+
+PacketPool::PacketPool(unsigned int nMaxFree) : nMaxFree(nMaxFree)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+PacketPool *PacketPool::GetShared()
+{
+	static std::once_flag once;
+	static PacketPool *pPool = NULL;
+	std::call_once(once, [] { pPool = new PacketPool(); });
+	return pPool;
+}
+
+Packet *PacketPool::Create(const uint8_t *pData, size_t cb, SinkFrameKind eKind, bool bFrameStart, int iPlayer)
+{
+	Packet *pPacket = NULL;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!vpFree.empty()) {
+			pPacket = vpFree.back();
+			vpFree.pop_back();
+		}
+		stats.nCreate++;
+		stats.qwCopyBytes += cb;
+		stats.nAllocate += !pPacket || pPacket->vData.capacity() < cb;
+		stats.nLive++;
+	}
+	if (!pPacket) {
+		pPacket = new(std::nothrow) Packet;
+	}
+	if (!pPacket) {
+		LOG_ERROR(logger, "Out of memory for a packet of player " << iPlayer);
+		std::lock_guard<std::mutex> lock(mtx);
+		stats.nLive--;
+		return NULL;
+	}
+	// The one copy the packet's data ever sees
+	pPacket->vData.assign(pData, pData + cb);
+	pPacket->nRef.store(1, std::memory_order_relaxed);
+	pPacket->eKind = eKind;
+	pPacket->bFrameStart = bFrameStart;
+	pPacket->iPlayer = iPlayer;
+	pPacket->qwTimestampUs = Metrics::NowUs();
+	pPacket->pPool = this;
+	return pPacket;
+}
+
+void PacketPool::Recycle(Packet *pPacket)
+{
+	if (pPacket->vData.capacity() > pPacket->vData.size() + PACKET_MAX_SLACK) {
+		std::vector<uint8_t>().swap(pPacket->vData);
+	}
+	std::lock_guard<std::mutex> lock(mtx);
+	stats.nLive--;
+	if (vpFree.size() < nMaxFree) {
+		vpFree.push_back(pPacket);
+	} else {
+		delete pPacket;
+	}
+}
+
+PacketPool::Stats PacketPool::TakeStats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	Stats ret = stats;
+	memset(&stats, 0, sizeof(stats));
+	stats.nLive = ret.nLive;
+	return ret;
+}
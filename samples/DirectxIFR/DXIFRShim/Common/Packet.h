@@ -0,0 +1,123 @@
+/*!
+ * \brief
+ * Refcounted, immutable encoder output shared by the sinks of a player
+ *
+ * \file
+ *
+ * An access unit (or a slice of one, or a motion vector record) is copied
+ * once out of the locked bitstream buffer into a Packet, and from then on
+ * only references to it move: every SinkQueue of the player's SinkGraph
+ * holds one until its writer is done with the packet, and a sink plugin
+ * may take more through SinkHost (see SinkPlugin.h). The data never
+ * changes after Create(), so no sink needs a lock to read it.
+ *
+ * The last Release() hands the packet back to the pool, which keeps its
+ * buffer for the next one. Like TaskPool, the shared pool is never
+ * destroyed, so a plugin thread that drops its reference late is safe.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+enum SinkFrameKind {
+	SINK_FRAME_KEY,
+	SINK_FRAME_REFERENCE,
+	SINK_FRAME_NON_REFERENCE,
+};
+
+class PacketPool;
+
+class Packet
+{
+public:
+	const uint8_t *GetData() const
+	{
+		return vData.data();
+	}
+	size_t GetSize() const
+	{
+		return vData.size();
+	}
+	SinkFrameKind GetKind() const
+	{
+		return eKind;
+	}
+	// Whether the packet starts a frame, rather than continuing one slice by slice
+	bool IsFrameStart() const
+	{
+		return bFrameStart;
+	}
+	int GetPlayer() const
+	{
+		return iPlayer;
+	}
+	// Time of Create(), on the clock of Metrics::NowUs()
+	uint64_t GetTimestampUs() const
+	{
+		return qwTimestampUs;
+	}
+
+	void AddRef()
+	{
+		nRef.fetch_add(1, std::memory_order_relaxed);
+	}
+	void Release();
+
+private:
+	friend class PacketPool;
+
+	Packet() : nRef(0), eKind(SINK_FRAME_KEY), bFrameStart(true), iPlayer(0), qwTimestampUs(0), pPool(NULL) {}
+
+	std::atomic<int> nRef;
+	std::vector<uint8_t> vData;
+	SinkFrameKind eKind;
+	bool bFrameStart;
+	int iPlayer;
+	uint64_t qwTimestampUs;
+	PacketPool *pPool;
+};
+
+class PacketPool
+{
+public:
+	struct Stats {
+		// Packets created, each of which is one copy of its data
+		unsigned int nCreate;
+		unsigned long long qwCopyBytes;
+		// Packets that needed a new buffer instead of a recycled one
+		unsigned int nAllocate;
+		// Packets still referenced by someone
+		int nLive;
+	};
+
+	static PacketPool *GetShared();
+
+	/*! Copies cb bytes of pData into a packet with one reference, which the caller
+	    owns. NULL when out of memory. */
+	Packet *Create(const uint8_t *pData, size_t cb, SinkFrameKind eKind, bool bFrameStart, int iPlayer);
+
+	// Counts since the last call, except nLive
+	Stats TakeStats();
+
+private:
+	friend class Packet;
+
+	PacketPool(unsigned int nMaxFree = 256);
+	void Recycle(Packet *pPacket);
+
+	unsigned int nMaxFree;
+	std::mutex mtx;
+	std::vector<Packet *> vpFree;
+	Stats stats;
+};
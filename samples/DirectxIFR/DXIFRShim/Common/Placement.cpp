@@ -0,0 +1,330 @@
+/*!
+ * \brief
+ * The implementation of Placement
+ *
+ * \file
+ *
+ * Windows uses the NUMA and working set APIs of kernel32/psapi. Elsewhere
+ * the topology is read from sysfs and the getcpu, move_pages, mbind and
+ * sched_setaffinity system calls are used directly, so no libnuma is needed.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include "Placement.h"
+#include "TaskPool.h"
+
+#ifdef _WIN32
+#include <Psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define PLACEMENT_MAX_CPUS 64
+
+#ifndef PLACEMENT_NODE_ROOT
+// The tests build with a fake tree of nodeN/cpulist files instead
+#define PLACEMENT_NODE_ROOT "/sys/devices/system/node"
+#endif
+
+Placement::Placement() : ePolicy(PLACEMENT_OS), qwEncoderMask(0), qwGameMask(0)
+{
+	for (int i = 0; i < PLACEMENT_MAX_PLAYERS; i++) {
+		aStats[i].pBuffer = NULL;
+		aStats[i].iBufferNode = -1;
+		aStats[i].nFrames = 0;
+		aStats[i].nCrossFrames = 0;
+		aStats[i].qwCrossBytes = 0;
+	}
+}
+
+Placement *Placement::GetShared()
+{
+	static std::once_flag once;
+	static Placement *pPlacement = NULL;
+	std::call_once(once, [] { pPlacement = new Placement(); });
+	return pPlacement;
+}
+
+void Placement::Configure(PlacementPolicy ePolicy, ULONGLONG qwEncoderCpuMask, ULONGLONG qwGameCpuMask, TaskPool *pTaskPool)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	this->ePolicy = ePolicy;
+	vvWorkerOfNode.clear();
+	vActiveNode.clear();
+	if (ePolicy == PLACEMENT_OS) {
+		return;
+	}
+
+	int nNode = GetNodeCount();
+	ULONGLONG qwAll = 0;
+	for (int i = 0; i < nNode; i++) {
+		qwAll |= GetNodeCpuMask(i);
+	}
+	if (!qwAll) {
+		this->ePolicy = PLACEMENT_OS;
+		return;
+	}
+	qwEncoderMask = qwEncoderCpuMask ? (qwEncoderCpuMask & qwAll) : qwAll;
+	if (!qwEncoderMask) {
+		qwEncoderMask = qwAll;
+	}
+	qwGameMask = qwGameCpuMask ? (qwGameCpuMask & qwAll) : (qwAll & ~qwEncoderMask);
+	if (!qwGameMask) {
+		qwGameMask = qwAll;
+	}
+
+	// Only nodes that own encoder CPUs take players
+	std::vector<int> vNode;
+	std::vector<ULONGLONG> vNodeMask;
+	for (int i = 0; i < nNode; i++) {
+		ULONGLONG qwMask = GetNodeCpuMask(i) & qwEncoderMask;
+		if (qwMask) {
+			vNode.push_back(i);
+			vNodeMask.push_back(qwMask);
+		}
+	}
+	vvWorkerOfNode.resize(vNode.size());
+	for (int w = 0; w < pTaskPool->GetWorkerCount(); w++) {
+		size_t k = w % vNode.size();
+		vvWorkerOfNode[k].push_back(w);
+		ULONGLONG qwMask = vNodeMask[k];
+		pTaskPool->Submit([qwMask] { SetCurrentThreadAffinity(qwMask); }, w, true);
+	}
+	vActiveNode = vNode;
+}
+
+int Placement::GetPlayerNode(int index)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (ePolicy == PLACEMENT_OS || vActiveNode.empty()) {
+		return -1;
+	}
+	return vActiveNode[index % vActiveNode.size()];
+}
+
+int Placement::GetPlayerWorker(int index)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (ePolicy == PLACEMENT_OS || vvWorkerOfNode.empty()) {
+		return index;
+	}
+	size_t k = index % vvWorkerOfNode.size();
+	const std::vector<int> &vWorker = vvWorkerOfNode[k];
+	if (vWorker.empty()) {
+		return index;
+	}
+	return vWorker[(index / vvWorkerOfNode.size()) % vWorker.size()];
+}
+
+ULONGLONG Placement::GetEncoderCpuMask()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return ePolicy == PLACEMENT_OS ? 0 : qwEncoderMask;
+}
+
+void Placement::IsolateGameThread()
+{
+	if (ePolicy == PLACEMENT_ISOLATE && qwGameMask) {
+		SetCurrentThreadAffinity(qwGameMask);
+	}
+}
+
+bool Placement::RecordAccess(int index, const void *pBuffer, size_t cb)
+{
+	PlayerStats &stats = aStats[index % PLACEMENT_MAX_PLAYERS];
+	// The buffers are page-locked, so their node only needs looking up once
+	if (stats.pBuffer != pBuffer) {
+		stats.pBuffer = pBuffer;
+		stats.iBufferNode = GetMemoryNode(pBuffer);
+	}
+	int iNode = GetCurrentNode();
+	if (stats.iBufferNode >= 0 && iNode >= 0 && iNode != stats.iBufferNode) {
+		stats.nCrossFrames++;
+		stats.qwCrossBytes += cb;
+	}
+	return ++stats.nFrames % nReportInterval == 0;
+}
+
+unsigned int Placement::GetFrameCount(int index)
+{
+	return aStats[index % PLACEMENT_MAX_PLAYERS].nFrames;
+}
+
+unsigned int Placement::GetCrossNodeFrameCount(int index)
+{
+	return aStats[index % PLACEMENT_MAX_PLAYERS].nCrossFrames;
+}
+
+ULONGLONG Placement::GetCrossNodeBytes(int index)
+{
+	return aStats[index % PLACEMENT_MAX_PLAYERS].qwCrossBytes;
+}
+
+#ifdef _WIN32
+
+int Placement::GetNodeCount()
+{
+	ULONG ulHighest = 0;
+	if (!GetNumaHighestNodeNumber(&ulHighest)) {
+		return 1;
+	}
+	return (int)ulHighest + 1;
+}
+
+ULONGLONG Placement::GetNodeCpuMask(int iNode)
+{
+	ULONGLONG qwMask = 0;
+	if (!GetNumaNodeProcessorMask((UCHAR)iNode, &qwMask)) {
+		return 0;
+	}
+	return qwMask;
+}
+
+int Placement::GetCurrentNode()
+{
+	UCHAR node = 0;
+	if (!GetNumaProcessorNode((UCHAR)GetCurrentProcessorNumber(), &node)) {
+		return -1;
+	}
+	return node;
+}
+
+int Placement::GetMemoryNode(const void *p)
+{
+	PSAPI_WORKING_SET_EX_INFORMATION info = { 0 };
+	info.VirtualAddress = (PVOID)p;
+	if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) || !info.VirtualAttributes.Valid) {
+		return -1;
+	}
+	return (int)info.VirtualAttributes.Node;
+}
+
+bool Placement::SetCurrentThreadAffinity(ULONGLONG qwMask)
+{
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)qwMask) != 0;
+}
+
+void *Placement::AllocOnNode(size_t cb, int iNode)
+{
+	if (iNode < 0) {
+		return VirtualAlloc(NULL, cb, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+	return VirtualAllocExNuma(GetCurrentProcess(), NULL, cb, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, (DWORD)iNode);
+}
+
+void Placement::FreeOnNode(void *p, size_t cb)
+{
+	VirtualFree(p, 0, MEM_RELEASE);
+}
+
+#else
+
+int Placement::GetNodeCount()
+{
+	int n = 0;
+	char szPath[256];
+	for (;; n++) {
+		snprintf(szPath, sizeof(szPath), PLACEMENT_NODE_ROOT "/node%d", n);
+		if (access(szPath, F_OK)) {
+			break;
+		}
+	}
+	return n ? n : 1;
+}
+
+ULONGLONG Placement::GetNodeCpuMask(int iNode)
+{
+	char szPath[256];
+	snprintf(szPath, sizeof(szPath), PLACEMENT_NODE_ROOT "/node%d/cpulist", iNode);
+	FILE *fp = fopen(szPath, "r");
+	if (!fp) {
+		// No NUMA information: everything is node 0
+		if (iNode) {
+			return 0;
+		}
+		long nCpu = sysconf(_SC_NPROCESSORS_ONLN);
+		return nCpu >= PLACEMENT_MAX_CPUS ? ~0ULL : ((1ULL << nCpu) - 1);
+	}
+	// cpulist looks like "0-7,16-23"
+	ULONGLONG qwMask = 0;
+	int first, last;
+	char sep;
+	while (fscanf(fp, "%d", &first) == 1) {
+		last = first;
+		if (fscanf(fp, "%c", &sep) == 1 && sep == '-') {
+			if (fscanf(fp, "%d", &last) != 1) {
+				break;
+			}
+			fscanf(fp, "%c", &sep);
+		}
+		for (int i = first; i <= last && i < PLACEMENT_MAX_CPUS; i++) {
+			qwMask |= 1ULL << i;
+		}
+	}
+	fclose(fp);
+	return qwMask;
+}
+
+int Placement::GetCurrentNode()
+{
+	unsigned int cpu = 0, node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL)) {
+		return -1;
+	}
+	return (int)node;
+}
+
+int Placement::GetMemoryNode(const void *p)
+{
+	long nPage = sysconf(_SC_PAGESIZE);
+	void *pPage = (void *)((size_t)p & ~(size_t)(nPage - 1));
+	int status = -1;
+	if (syscall(SYS_move_pages, 0, 1UL, &pPage, NULL, &status, 0) || status < 0) {
+		return -1;
+	}
+	return status;
+}
+
+bool Placement::SetCurrentThreadAffinity(ULONGLONG qwMask)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int i = 0; i < PLACEMENT_MAX_CPUS; i++) {
+		if (qwMask & (1ULL << i)) {
+			CPU_SET(i, &set);
+		}
+	}
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+void *Placement::AllocOnNode(size_t cb, int iNode)
+{
+	void *p = mmap(NULL, cb, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+	if (iNode >= 0 && iNode < PLACEMENT_MAX_CPUS) {
+		const int MPOL_PREFERRED_ = 1;
+		unsigned long nodemask = 1UL << iNode;
+		syscall(SYS_mbind, p, cb, MPOL_PREFERRED_, &nodemask, sizeof(nodemask) * 8, 0);
+	}
+	return p;
+}
+
+void Placement::FreeOnNode(void *p, size_t cb)
+{
+	munmap(p, cb);
+}
+
+#endif
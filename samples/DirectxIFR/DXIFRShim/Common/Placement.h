@@ -0,0 +1,119 @@
+/*!
+ * \brief
+ * CPU and NUMA placement of encoders and their buffers
+ *
+ * \file
+ *
+ * Placement maps every player to a NUMA node, binds TaskPool workers to the
+ * CPUs of their node, and tells each encoder which worker to prefer. Since
+ * NvIFR and NVENC allocate their page-locked buffers from the calling thread
+ * and Windows (like Linux first-touch) backs them from that thread's node,
+ * running an encoder's setup on a node-local worker is what makes its
+ * capture, conversion and bitstream buffers node-local as well.
+ *
+ * In PLACEMENT_ISOLATE mode the game's render thread is additionally kept
+ * off the encoder CPUs.
+ *
+ * Every frame the encoder reports which buffer it touched. Frames that ran
+ * on a different node from the buffer are counted as cross-node traffic,
+ * which the encoder logs periodically.
+ *
+ * Only the first 64 logical processors (one Windows processor group) are
+ * managed; the policy degrades to PLACEMENT_OS beyond that.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stddef.h>
+typedef unsigned long long ULONGLONG;
+#endif
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+class TaskPool;
+
+enum PlacementPolicy {
+	// Leave threads and memory wherever the OS puts them
+	PLACEMENT_OS = 0,
+	// Spread players over NUMA nodes and keep each encoder on its node
+	PLACEMENT_NUMA = 1,
+	// PLACEMENT_NUMA plus keeping the game's render thread off the encoder CPUs
+	PLACEMENT_ISOLATE = 2,
+};
+
+#define PLACEMENT_MAX_PLAYERS 16
+
+class Placement
+{
+public:
+	Placement();
+
+	// The process-wide placement, configured once by the first encoder
+	static Placement *GetShared();
+
+	/*! Applies the policy: qwEncoderCpuMask == 0 means all CPUs, qwGameCpuMask == 0
+	    means every CPU not used by the encoders. Binds the workers of pTaskPool. */
+	void Configure(PlacementPolicy ePolicy, ULONGLONG qwEncoderCpuMask, ULONGLONG qwGameCpuMask, TaskPool *pTaskPool);
+
+	PlacementPolicy GetPolicy()
+	{
+		return ePolicy;
+	}
+	// Node the player's encoder and buffers belong to
+	int GetPlayerNode(int index);
+	// TaskPool affinity hint for the player's tasks
+	int GetPlayerWorker(int index);
+	// CPUs of the encoders, 0 under PLACEMENT_OS
+	ULONGLONG GetEncoderCpuMask();
+	// Restricts the calling (game) thread to the game CPUs under PLACEMENT_ISOLATE
+	void IsolateGameThread();
+
+	/*! Records that the calling thread processed cb bytes of pBuffer for the player.
+	    Returns true every nReportInterval frames, when the caller should report. */
+	bool RecordAccess(int index, const void *pBuffer, size_t cb);
+	unsigned int GetFrameCount(int index);
+	unsigned int GetCrossNodeFrameCount(int index);
+	ULONGLONG GetCrossNodeBytes(int index);
+
+	// Platform helpers, also usable without a configured policy
+	static int GetNodeCount();
+	static ULONGLONG GetNodeCpuMask(int iNode);
+	static int GetCurrentNode();
+	// Node backing the page at p, or -1 if unknown (e.g. not yet touched)
+	static int GetMemoryNode(const void *p);
+	static bool SetCurrentThreadAffinity(ULONGLONG qwMask);
+	// Allocates page-aligned memory preferring iNode; release with FreeOnNode
+	static void *AllocOnNode(size_t cb, int iNode);
+	static void FreeOnNode(void *p, size_t cb);
+
+	static const unsigned int nReportInterval = 300;
+
+private:
+	struct PlayerStats {
+		const void *pBuffer;
+		int iBufferNode;
+		std::atomic<unsigned int> nFrames;
+		std::atomic<unsigned int> nCrossFrames;
+		std::atomic<ULONGLONG> qwCrossBytes;
+	};
+
+	std::mutex mtx;
+	PlacementPolicy ePolicy;
+	ULONGLONG qwEncoderMask;
+	ULONGLONG qwGameMask;
+	// Nodes that own encoder CPUs; players are assigned to them round-robin
+	std::vector<int> vActiveNode;
+	// Workers of the task pool grouped like vActiveNode
+	std::vector<std::vector<int> > vvWorkerOfNode;
+	PlayerStats aStats[PLACEMENT_MAX_PLAYERS];
+};
@@ -0,0 +1,159 @@
+/*!
+ * \brief
+ * The implementation of PlayerOutput
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sstream>
+#include <vector>
+#ifndef _WIN32
+#include <strings.h>
+#define _stricmp strcasecmp
+#define _popen popen
+#endif
+#include "PlayerOutput.h"
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+PlayerOutputConfig::PlayerOutputConfig() : fecMode(FEC_RS), fecK(10), fecM(4), portOffset(0), bHevc(false), fps(30)
+{
+}
+
+static bool ParseInt(const char *sz, int min, int max, int *pValue)
+{
+	char *pEnd;
+	long value = sz ? strtol(sz, &pEnd, 10) : 0;
+	if (!sz || pEnd == sz || *pEnd || value < min || value > max) {
+		return false;
+	}
+	*pValue = (int)value;
+	return true;
+}
+
+bool PlayerOutputConfig::Parse(const char *szOptions)
+{
+	std::vector<std::string> vArg;
+	std::istringstream iss(szOptions ? szOptions : "");
+	std::string strArg;
+	while (iss >> strArg) {
+		vArg.push_back(strArg);
+	}
+	for (size_t i = 0; i < vArg.size(); i++) {
+		const char *szName = vArg[i].c_str();
+		const char *szValue = i + 1 < vArg.size() ? vArg[i + 1].c_str() : NULL;
+		bool bValid = true;
+		if (!_stricmp(szName, "-udp")) {
+			bValid = szValue != NULL;
+			strUdpDest = szValue ? szValue : "";
+		} else if (!_stricmp(szName, "-record")) {
+			bValid = szValue != NULL;
+			strRecordFile = szValue ? szValue : "";
+		} else if (!_stricmp(szName, "-sinkPlugin")) {
+			bValid = szValue != NULL;
+			strSinkPlugin = szValue ? szValue : "";
+		} else if (!_stricmp(szName, "-fec")) {
+			bValid = ParseInt(szValue, FEC_NONE, FEC_RS, &fecMode);
+		} else if (!_stricmp(szName, "-fecK")) {
+			bValid = ParseInt(szValue, 1, FEC_MAX_K, &fecK);
+		} else if (!_stricmp(szName, "-fecM")) {
+			bValid = ParseInt(szValue, 1, FEC_MAX_M, &fecM);
+		} else {
+			continue;
+		}
+		if (!bValid) {
+			LOG_ERROR(logger, "Invalid value for " << szName << " in the encoder options");
+			return false;
+		}
+		i++;
+	}
+	return true;
+}
+
+// Times one write of a sink queue; writes blocking longer than a frame period count as stalls
+template<class Write>
+static bool TimedWrite(PlayerMetrics *pMetrics, uint64_t qwStallUs, Write write)
+{
+	if (!pMetrics) {
+		return write();
+	}
+	uint64_t qwStartUs = Metrics::NowUs();
+	bool bWritten = write();
+	uint64_t qwWriteUs = Metrics::NowUs() - qwStartUs;
+	pMetrics->pSinkWriteUs->Record(qwWriteUs);
+	if (qwWriteUs > qwStallUs) {
+		pMetrics->pSinkStall->Add();
+	}
+	if (!bWritten) {
+		pMetrics->pSinkWriteError->Add();
+	}
+	return bWritten;
+}
+
+bool OpenPlayerOutput(const PlayerOutputConfig &config, int index, int iRendition, SinkGraph &graph, FecSender &fecSender,
+	SinkPluginHost &sinkPlugin, FILE **pfOutput, PlayerMetrics *pMetrics)
+{
+	if (!config.strUdpDest.empty()) {
+		// Straight to the viewer over UDP with FEC, in place of the ffmpeg pipe
+		fecSender.Open(config.strUdpDest.c_str(), (FecMode)config.fecMode, config.fecK, config.fecM, true, config.portOffset);
+	} else if (!*pfOutput) {
+		std::ostringstream oss;
+		oss << "ffmpeg -i - -listen 1 -threads 1 -vcodec copy -preset ultrafast -an -tune zerolatency -f h264 "
+			<< PLAYER_OUTPUT_HOST << PLAYER_OUTPUT_FIRST_PORT + index + config.portOffset;
+		*pfOutput = _popen(oss.str().c_str(), "wb");
+	}
+	if (!fecSender.IsOpen() && !*pfOutput) {
+		LOG_ERROR(logger, "The output of player " << index << " could not be opened");
+		return false;
+	}
+
+	// The output is written on its sink's own thread, so a slow reader never blocks the encoder
+	uint64_t qwStallUs = 1000000 / (config.fps > 0 ? config.fps : 30);
+	if (fecSender.IsOpen()) {
+		FecSender *pSender = &fecSender;
+		graph.AddSink(config.strUdpDest, [pSender, pMetrics, qwStallUs](Packet *pPacket) {
+			return TimedWrite(pMetrics, qwStallUs, [&]() { return pSender->Send(pPacket->GetData(), pPacket->GetSize()); });
+		});
+	} else {
+		FILE *fOutput = *pfOutput;
+		graph.AddSink("output", [fOutput, pMetrics, qwStallUs](Packet *pPacket) {
+			return TimedWrite(pMetrics, qwStallUs, [&]() {
+				bool bWritten = fwrite(pPacket->GetData(), 1, pPacket->GetSize(), fOutput) == pPacket->GetSize();
+				return fflush(fOutput) == 0 && bWritten;
+			});
+		});
+	}
+
+	if (!config.strRecordFile.empty()) {
+		// The same packets to <-record><player>[_<port offset>].h264 or .hevc; a slow disk only drops frames of the recording
+		std::ostringstream oss;
+		oss << config.strRecordFile << index;
+		if (config.portOffset) {
+			oss << "_" << config.portOffset;
+		}
+		oss << (config.bHevc ? ".hevc" : ".h264");
+		FILE *fRecord = fopen(oss.str().c_str(), "wb");
+		if (!fRecord) {
+			LOG_ERROR(logger, "The recording " << oss.str() << " could not be opened");
+		} else {
+			graph.AddSink(oss.str(), [fRecord](Packet *pPacket) {
+				return fwrite(pPacket->GetData(), 1, pPacket->GetSize(), fRecord) == pPacket->GetSize();
+			}, [fRecord]() { fclose(fRecord); }, 16 << 20);
+		}
+	}
+
+	if (!config.strSinkPlugin.empty() && (sinkPlugin.IsLoaded() || sinkPlugin.Load(config.strSinkPlugin.c_str()))
+		&& !sinkPlugin.Attach(graph, index, iRendition)) {
+		LOG_ERROR(logger, "The sink plugin " << config.strSinkPlugin << " could not be attached");
+	}
+	return true;
+}
@@ -0,0 +1,59 @@
+/*!
+ * \brief
+ * The sinks of a player's stream, as the encoder options ask for them
+ *
+ * \file
+ *
+ * The primary sink goes to the viewer: with -udp straight over UDP with
+ * FEC, otherwise through an ffmpeg that listens on
+ * PLAYER_OUTPUT_FIRST_PORT + player + port offset. -record adds a
+ * recording of the same packets and -sinkPlugin a sink of a plugin. The
+ * shim's encoders and the encode service both open their output here, so
+ * a player is streamed the same way wherever it is encoded.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include "FecSender.h"
+#include "Metrics.h"
+#include "SinkGraph.h"
+#include "SinkPluginHost.h"
+
+// Host the viewers' ffmpeg connects to
+#define PLAYER_OUTPUT_HOST "http://magam001.d1.comp.nus.edu.sg:"
+#define PLAYER_OUTPUT_FIRST_PORT 30000
+
+struct PlayerOutputConfig {
+	// -udp host:port, with -fec, -fecK and -fecM
+	std::string strUdpDest;
+	int fecMode;
+	int fecK;
+	int fecM;
+	// -record prefix and -sinkPlugin library
+	std::string strRecordFile;
+	std::string strSinkPlugin;
+	// Of the rendition, added to the ports and the file names
+	int portOffset;
+	bool bHevc;
+	int fps;
+
+	// The defaults of the shim's encoders: the ffmpeg listener, Reed-Solomon FEC of 10 + 4 once UDP is asked for
+	PlayerOutputConfig();
+	/*! Picks the output options out of encoder options in the syntax of CNvHWEncoder::ParseArguments
+	    and leaves the others alone. False if one of them has a missing or bad value. */
+	bool Parse(const char *szOptions);
+};
+
+/*! Adds the sinks of player index's stream to graph, the primary one first: fecSender with
+    config.strUdpDest, else *pfOutput, or the ffmpeg listener, opened into *pfOutput, when that is
+    NULL. With pMetrics, the writes of the primary sink are timed. False if it could not be opened. */
+bool OpenPlayerOutput(const PlayerOutputConfig &config, int index, int iRendition, SinkGraph &graph, FecSender &fecSender,
+	SinkPluginHost &sinkPlugin, FILE **pfOutput, PlayerMetrics *pMetrics = NULL);
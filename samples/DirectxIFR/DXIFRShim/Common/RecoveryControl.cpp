@@ -0,0 +1,156 @@
+/*!
+ * \brief
+ * The implementation of RecoveryControl
+ *
+ * \file
+ *
+ * Frame numbers are compared with wrap-around arithmetic, like TCP sequence
+ * numbers, so a long running session does not break after 2^32 frames.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <string.h>
+#include "RecoveryControl.h"
+
+static inline bool IsBefore(DWORD dwFrameA, DWORD dwFrameB)
+{
+	return (LONG)(dwFrameA - dwFrameB) < 0;
+}
+
+RecoveryControl::RecoveryControl(DWORD msMinIdrInterval, DWORD nMaxInvalidate) :
+	msMinIdrInterval(msMinIdrInterval),
+	nMaxInvalidate(nMaxInvalidate < 16 ? nMaxInvalidate : 16),
+	bIdrPending(false), bLossPending(false), dwLossFirst(0),
+	bIdrIssued(false), dwLastIdrTime(0), dwInvalidatedEnd(0)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+void RecoveryControl::Post(const RecoveryEvent &re)
+{
+	switch (re.type) {
+	case RE_VIEWER_JOIN:
+	case RE_KEYFRAME_REQUEST:
+	case RE_RENDITION_SWITCH:
+		RequestIdr();
+		break;
+	case RE_FRAME_LOSS:
+		ReportLoss(re.dwFirstFrame, re.dwLastFrame);
+		break;
+	}
+}
+
+void RecoveryControl::RequestIdr()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	bIdrPending = true;
+	stats.nIdrRequest++;
+}
+
+void RecoveryControl::ReportLoss(DWORD dwFirstFrame, DWORD dwLastFrame)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	stats.nLossReport++;
+	// A loss before the last recovery point was reported before the viewer got that point
+	if (IsBefore(dwFirstFrame, dwInvalidatedEnd)) {
+		return;
+	}
+	/* Only the first lost frame matters: every later frame references it directly
+	   or indirectly, so the viewer cannot decode anything from there on.*/
+	if (!bLossPending || IsBefore(dwFirstFrame, dwLossFirst)) {
+		dwLossFirst = dwFirstFrame;
+	}
+	bLossPending = true;
+}
+
+bool RecoveryControl::Take(DWORD dwFrame, DWORD dwNow, NvEncPictureCommand *pCmd)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!bIdrIssued && dwFrame == 0) {
+		// The first frame is an IDR anyway and serves everything asked for so far
+		bIdrIssued = true;
+		bIdrPending = false;
+		bLossPending = false;
+		dwLastIdrTime = dwNow;
+		return false;
+	}
+
+	if (bLossPending) {
+		if (!IsBefore(dwLossFirst, dwFrame)) {
+			// Not encoded yet: nothing to recover from
+			bLossPending = false;
+		} else if (dwFrame - dwLossFirst > nMaxInvalidate) {
+			// No clean reference is left in the DPB
+			bLossPending = false;
+			bIdrPending = true;
+			stats.nEscalation++;
+		}
+	}
+
+	if (bIdrPending && (!bIdrIssued || dwNow - dwLastIdrTime >= msMinIdrInterval)) {
+		pCmd->bForceIDR = true;
+		bIdrPending = false;
+		bLossPending = false;
+		bIdrIssued = true;
+		dwLastIdrTime = dwNow;
+		dwInvalidatedEnd = dwFrame;
+		stats.nIdr++;
+		return true;
+	}
+
+	if (bLossPending) {
+		DWORD n = dwFrame - dwLossFirst;
+		for (DWORD i = 0; i < n; i++) {
+			pCmd->refFrameNumbers[i] = dwLossFirst + i;
+		}
+		pCmd->bInvalidateRefFrames = true;
+		pCmd->numRefFramesToInvalidate = n;
+		bLossPending = false;
+		dwInvalidatedEnd = dwFrame;
+		stats.nInvalidation++;
+		return true;
+	}
+	return false;
+}
+
+bool RecoveryControl::IsIdrDue(DWORD dwNow)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return bIdrPending && (!bIdrIssued || dwNow - dwLastIdrTime >= msMinIdrInterval);
+}
+
+void RecoveryControl::RecordFrame(bool bKeyFrame, DWORD cb)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (bKeyFrame) {
+		stats.nKeyFrame++;
+		stats.qwKeyFrameBytes += cb;
+	} else {
+		stats.nDeltaFrame++;
+		stats.qwDeltaFrameBytes += cb;
+	}
+}
+
+RecoveryControl::Stats RecoveryControl::GetStats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return stats;
+}
+
+LONGLONG RecoveryControl::GetSavedBytes(DWORD nKeyInt)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!nKeyInt || !stats.nKeyFrame || !stats.nDeltaFrame) {
+		return 0;
+	}
+	LONGLONG llKeyFrameCost = (LONGLONG)(stats.qwKeyFrameBytes / stats.nKeyFrame)
+		- (LONGLONG)(stats.qwDeltaFrameBytes / stats.nDeltaFrame);
+	LONGLONG nFrame = (LONGLONG)stats.nKeyFrame + stats.nDeltaFrame;
+	LONGLONG nPeriodicKeyFrame = (nFrame + nKeyInt - 1) / nKeyInt;
+	return (nPeriodicKeyFrame - stats.nKeyFrame) * llKeyFrameCost;
+}
@@ -0,0 +1,90 @@
+/*!
+ * \brief
+ * On-demand recovery points (IDR and reference frame invalidation) for one encoder
+ *
+ * \file
+ *
+ * The encoders run with an infinite GOP, so the stream has no periodic key
+ * frames. Instead, viewer events ask for a recovery point when one is
+ * actually needed: a viewer that joins or explicitly asks for a key frame
+ * gets an IDR, and a viewer that reports lost frames gets those frames
+ * invalidated so that the next frame only references pictures it has.
+ *
+ * Requests are coalesced. All requests pending when a frame is submitted
+ * are served by that one frame, and IDRs are rate limited to one per
+ * msMinIdrInterval, so a burst of joins costs a single key frame. Loss
+ * reports are merged into one range; a range the DPB can no longer cover
+ * escalates to an IDR.
+ *
+ * Frame numbers are the encoder's input timestamps (CNvHWEncoder::m_EncodeIdx),
+ * which equal the position of the frame in the stream.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <mutex>
+#include "ControlInfo.h"
+#include "inc/NvEncPictureCommand.h"
+
+class RecoveryControl
+{
+public:
+	struct Stats {
+		// Viewer requests for a key frame and the IDRs actually encoded for them
+		unsigned int nIdrRequest;
+		unsigned int nIdr;
+		// Loss reports and the invalidations (each covering a range of frames) they caused
+		unsigned int nLossReport;
+		unsigned int nInvalidation;
+		// Loss reports escalated to an IDR because the DPB no longer held a clean reference
+		unsigned int nEscalation;
+		// Output seen so far, split by frame kind
+		unsigned int nKeyFrame, nDeltaFrame;
+		ULONGLONG qwKeyFrameBytes, qwDeltaFrameBytes;
+	};
+
+	/*! msMinIdrInterval rate limits IDRs; nMaxInvalidate is the number of most recent
+	    frames that can be invalidated (the DPB size the encoder was created with). */
+	RecoveryControl(DWORD msMinIdrInterval = 500, DWORD nMaxInvalidate = 16);
+
+	// Thread safe; usually fed from the player's AppParam recovery ring
+	void Post(const RecoveryEvent &re);
+	void RequestIdr();
+	void ReportLoss(DWORD dwFirstFrame, DWORD dwLastFrame);
+
+	/*! Called right before frame dwFrame is submitted. Fills the IDR or invalidation
+	    fields of pCmd and returns true if anything must be done for this frame. */
+	bool Take(DWORD dwFrame, DWORD dwNow, NvEncPictureCommand *pCmd);
+	// True if an IDR is pending that the next frame may carry under the rate limit
+	bool IsIdrDue(DWORD dwNow);
+	// Called for every frame that comes out of the encoder
+	void RecordFrame(bool bKeyFrame, DWORD cb);
+
+	Stats GetStats();
+	/*! Bytes saved compared with forcing a key frame every nKeyInt frames, estimated
+	    from the average key and delta frame sizes seen so far. Negative if on-demand
+	    recovery cost more. */
+	LONGLONG GetSavedBytes(DWORD nKeyInt);
+
+private:
+	std::mutex mtx;
+	DWORD msMinIdrInterval;
+	DWORD nMaxInvalidate;
+
+	bool bIdrPending;
+	bool bLossPending;
+	// Oldest lost frame not yet recovered from
+	DWORD dwLossFirst;
+	bool bIdrIssued;
+	DWORD dwLastIdrTime;
+	// Frame of the last recovery point; losses reported before it are stale
+	DWORD dwInvalidatedEnd;
+
+	Stats stats;
+};
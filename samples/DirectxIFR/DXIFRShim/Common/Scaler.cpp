@@ -0,0 +1,234 @@
+/*!
+ * \brief
+ * The implementation of Scaler
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <string.h>
+#include <emmintrin.h>
+#include "Scaler.h"
+
+// Bilinear weights have 8 fractional bits so that the products fit 16-bit lanes
+#define SCALE_FRACTION_BITS 8
+#define SCALE_ONE (1 << SCALE_FRACTION_BITS)
+
+static void HalfRowScalar(const uint8_t *pRow0, const uint8_t *pRow1, uint8_t *pDst, int dstWidth)
+{
+	for (int x = 0; x < dstWidth; x++) {
+		pDst[x] = (uint8_t)((pRow0[2 * x] + pRow0[2 * x + 1] + pRow1[2 * x] + pRow1[2 * x + 1] + 2) >> 2);
+	}
+}
+
+static void HalfRowSse2(const uint8_t *pRow0, const uint8_t *pRow1, uint8_t *pDst, int dstWidth)
+{
+	const __m128i mask = _mm_set1_epi16(0x00FF), two = _mm_set1_epi16(2);
+	int x = 0;
+	for (; x + 16 <= dstWidth; x += 16) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *)(pRow0 + 2 * x));
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(pRow0 + 2 * x + 16));
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(pRow1 + 2 * x));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(pRow1 + 2 * x + 16));
+		// Even and odd pixels of both rows summed in 16-bit lanes
+		__m128i s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, mask), _mm_srli_epi16(a0, 8)),
+			_mm_add_epi16(_mm_and_si128(b0, mask), _mm_srli_epi16(b0, 8)));
+		__m128i s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, mask), _mm_srli_epi16(a1, 8)),
+			_mm_add_epi16(_mm_and_si128(b1, mask), _mm_srli_epi16(b1, 8)));
+		s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+		s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+		_mm_storeu_si128((__m128i *)(pDst + x), _mm_packus_epi16(s0, s1));
+	}
+	HalfRowScalar(pRow0 + 2 * x, pRow1 + 2 * x, pDst + x, dstWidth - x);
+}
+
+static void BlendRowScalar(const uint8_t *pRow0, const uint8_t *pRow1, int f, uint8_t *pDst, int width)
+{
+	int f0 = SCALE_ONE - f;
+	for (int x = 0; x < width; x++) {
+		pDst[x] = (uint8_t)((pRow0[x] * f0 + pRow1[x] * f + SCALE_ONE / 2) >> SCALE_FRACTION_BITS);
+	}
+}
+
+static void BlendRowSse2(const uint8_t *pRow0, const uint8_t *pRow1, int f, uint8_t *pDst, int width)
+{
+	const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(SCALE_ONE / 2);
+	const __m128i w0 = _mm_set1_epi16((short)(SCALE_ONE - f)), w1 = _mm_set1_epi16((short)f);
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(pRow0 + x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(pRow1 + x));
+		// 255 * 256 overflows a signed lane but not an unsigned one, hence the logical shift
+		__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1)), round);
+		__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1)), round);
+		_mm_storeu_si128((__m128i *)(pDst + x),
+			_mm_packus_epi16(_mm_srli_epi16(lo, SCALE_FRACTION_BITS), _mm_srli_epi16(hi, SCALE_FRACTION_BITS)));
+	}
+	BlendRowScalar(pRow0 + x, pRow1 + x, f, pDst + x, width - x);
+}
+
+static void InterpolateRowScalar(const uint8_t *pRow, const int *pColumn, const int16_t *pWeight, uint8_t *pDst, int dstWidth)
+{
+	for (int x = 0; x < dstWidth; x++) {
+		const uint8_t *p = pRow + pColumn[x];
+		pDst[x] = (uint8_t)((p[0] * pWeight[2 * x] + p[1] * pWeight[2 * x + 1] + SCALE_ONE / 2) >> SCALE_FRACTION_BITS);
+	}
+}
+
+static void InterpolateRowSse2(const uint8_t *pRow, const int *pColumn, const int16_t *pWeight, uint8_t *pDst, int dstWidth)
+{
+	const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(SCALE_ONE / 2);
+	int x = 0;
+	for (; x + 8 <= dstWidth; x += 8) {
+		// Each 16-bit lane gathers a pixel and its right neighbour
+		__m128i pairs = _mm_setzero_si128();
+		pairs = _mm_insert_epi16(pairs, *(const uint16_t *)(pRow + pColumn[x]), 0);
+		pairs = _mm_insert_epi16(pairs, *(const uint16_t *)(pRow + pColumn[x + 1]), 1);
+		pairs = _mm_insert_epi16(pairs, *(const uint16_t *)(pRow + pColumn[x + 2]), 2);
+		pairs = _mm_insert_epi16(pairs, *(const uint16_t *)(pRow + pColumn[x + 3]), 3);
+		pairs = _mm_insert_epi16(pairs, *(const uint16_t *)(pRow + pColumn[x + 4]), 4);
+		pairs = _mm_insert_epi16(pairs, *(const uint16_t *)(pRow + pColumn[x + 5]), 5);
+		pairs = _mm_insert_epi16(pairs, *(const uint16_t *)(pRow + pColumn[x + 6]), 6);
+		pairs = _mm_insert_epi16(pairs, *(const uint16_t *)(pRow + pColumn[x + 7]), 7);
+		__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pairs, zero), _mm_loadu_si128((const __m128i *)(pWeight + 2 * x)));
+		__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pairs, zero), _mm_loadu_si128((const __m128i *)(pWeight + 2 * x + 8)));
+		lo = _mm_srai_epi32(_mm_add_epi32(lo, round), SCALE_FRACTION_BITS);
+		hi = _mm_srai_epi32(_mm_add_epi32(hi, round), SCALE_FRACTION_BITS);
+		__m128i packed = _mm_packs_epi32(lo, hi);
+		_mm_storel_epi64((__m128i *)(pDst + x), _mm_packus_epi16(packed, packed));
+	}
+	InterpolateRowScalar(pRow, pColumn + x, pWeight + 2 * x, pDst + x, dstWidth - x);
+}
+
+static ScaleKernel eCurrentKernel = SCALE_KERNEL_SSE2;
+static void (*pfnHalfRow)(const uint8_t *, const uint8_t *, uint8_t *, int) = HalfRowSse2;
+static void (*pfnBlendRow)(const uint8_t *, const uint8_t *, int, uint8_t *, int) = BlendRowSse2;
+static void (*pfnInterpolateRow)(const uint8_t *, const int *, const int16_t *, uint8_t *, int) = InterpolateRowSse2;
+
+// SSE2 is part of x64 and of the /arch:SSE2 default of the x86 builds
+bool ScaleSelectKernel(ScaleKernel eKernel)
+{
+	switch (eKernel) {
+	case SCALE_KERNEL_SCALAR:
+		pfnHalfRow = HalfRowScalar;
+		pfnBlendRow = BlendRowScalar;
+		pfnInterpolateRow = InterpolateRowScalar;
+		break;
+	case SCALE_KERNEL_SSE2:
+		pfnHalfRow = HalfRowSse2;
+		pfnBlendRow = BlendRowSse2;
+		pfnInterpolateRow = InterpolateRowSse2;
+		break;
+	default:
+		return false;
+	}
+	eCurrentKernel = eKernel;
+	return true;
+}
+
+ScaleKernel ScaleGetKernel()
+{
+	return eCurrentKernel;
+}
+
+void ScalePlaneHalf(const uint8_t *pSrc, int srcPitch, int srcWidth, int srcHeight, uint8_t *pDst, int dstPitch)
+{
+	for (int y = 0; y < srcHeight / 2; y++) {
+		pfnHalfRow(pSrc + 2 * y * srcPitch, pSrc + (2 * y + 1) * srcPitch, pDst + y * dstPitch, srcWidth / 2);
+	}
+}
+
+// Source position and weight of the next sample for each destination sample, pixel centers aligned
+static void MapAxis(int srcSize, int dstSize, int i, int &iSrc, int &f)
+{
+	long long pos = ((2LL * i + 1) * srcSize * SCALE_ONE) / (2LL * dstSize) - SCALE_ONE / 2;
+	if (pos < 0) {
+		pos = 0;
+	}
+	iSrc = (int)(pos >> SCALE_FRACTION_BITS);
+	f = (int)(pos & (SCALE_ONE - 1));
+	if (iSrc >= srcSize - 1) {
+		iSrc = srcSize - 1;
+		f = 0;
+	}
+}
+
+void ScalePlaneBilinear(const uint8_t *pSrc, int srcPitch, int srcWidth, int srcHeight,
+	uint8_t *pDst, int dstPitch, int dstWidth, int dstHeight, ScaleScratch &scratch)
+{
+	if (scratch.vRow.size() < (size_t)srcWidth + 1) {
+		scratch.vRow.resize(srcWidth + 1);
+	}
+	scratch.vColumn.resize(dstWidth);
+	scratch.vWeight.resize(2 * dstWidth);
+	for (int x = 0; x < dstWidth; x++) {
+		int fx;
+		MapAxis(srcWidth, dstWidth, x, scratch.vColumn[x], fx);
+		scratch.vWeight[2 * x] = (int16_t)(SCALE_ONE - fx);
+		scratch.vWeight[2 * x + 1] = (int16_t)fx;
+	}
+	uint8_t *pRow = &scratch.vRow[0];
+	// Vertical pass first: it touches whole source rows and is the one that vectorizes
+	for (int y = 0; y < dstHeight; y++) {
+		int ySrc, fy;
+		MapAxis(srcHeight, dstHeight, y, ySrc, fy);
+		const uint8_t *pRow0 = pSrc + ySrc * srcPitch;
+		const uint8_t *pRow1 = fy ? pRow0 + srcPitch : pRow0;
+		pfnBlendRow(pRow0, pRow1, fy, pRow, srcWidth);
+		// The last column's right neighbour
+		pRow[srcWidth] = pRow[srcWidth - 1];
+		pfnInterpolateRow(pRow, &scratch.vColumn[0], &scratch.vWeight[0], pDst + y * dstPitch, dstWidth);
+	}
+}
+
+Scaler::Scaler() : srcWidth(0), srcHeight(0), dstWidth(0), dstHeight(0), eFilter(SCALE_AREA)
+{
+}
+
+bool Scaler::Configure(int srcWidth, int srcHeight, int dstWidth, int dstHeight, ScaleFilter eFilter)
+{
+	if (srcWidth <= 0 || srcHeight <= 0 || dstWidth <= 0 || dstHeight <= 0
+		|| (srcWidth | srcHeight | dstWidth | dstHeight) & 1) {
+		return false;
+	}
+	this->srcWidth = srcWidth;
+	this->srcHeight = srcHeight;
+	this->dstWidth = dstWidth;
+	this->dstHeight = dstHeight;
+	this->eFilter = eFilter;
+	return true;
+}
+
+void Scaler::ScalePlane(const uint8_t *pSrc, int width, int height, uint8_t *pDst, int dstWidth, int dstHeight)
+{
+	int iHalf = 0;
+	while (eFilter == SCALE_AREA && width >= 2 * dstWidth && height >= 2 * dstHeight) {
+		std::vector<uint8_t> &vHalf = avHalf[iHalf];
+		vHalf.resize((size_t)(width / 2) * (height / 2));
+		ScalePlaneHalf(pSrc, width, width, height, &vHalf[0], width / 2);
+		pSrc = &vHalf[0];
+		width /= 2;
+		height /= 2;
+		iHalf ^= 1;
+	}
+	if (width == dstWidth && height == dstHeight) {
+		memcpy(pDst, pSrc, (size_t)width * height);
+		return;
+	}
+	ScalePlaneBilinear(pSrc, width, width, height, pDst, dstWidth, dstWidth, dstHeight, scratch);
+}
+
+void Scaler::Scale(const uint8_t *pSrc, uint8_t *pDst)
+{
+	size_t cbSrcLuma = (size_t)srcWidth * srcHeight, cbDstLuma = (size_t)dstWidth * dstHeight;
+	ScalePlane(pSrc, srcWidth, srcHeight, pDst, dstWidth, dstHeight);
+	ScalePlane(pSrc + cbSrcLuma, srcWidth / 2, srcHeight / 2, pDst + cbDstLuma, dstWidth / 2, dstHeight / 2);
+	ScalePlane(pSrc + cbSrcLuma * 5 / 4, srcWidth / 2, srcHeight / 2, pDst + cbDstLuma * 5 / 4, dstWidth / 2, dstHeight / 2);
+}
@@ -0,0 +1,90 @@
+/*!
+ * \brief
+ * Downscaler of captured I420 frames for the simulcast renditions
+ *
+ * \file
+ *
+ * Frames are tightly packed I420 (Y, then U and V at half size), the layout
+ * NvIFRTransferRenderTargetToSys() delivers and CNvEncoder::EncodeFrameLoop()
+ * takes. With SCALE_AREA the source is first halved with a 2x2 box filter
+ * as long as the target is at most half of it, and the rest is done
+ * bilinearly, so that no source pixel is skipped; SCALE_BILINEAR goes
+ * straight to the target size.
+ *
+ * The box filter and both bilinear passes run on SSE2 when the CPU
+ * has it. Widths and heights must be even.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+enum ScaleFilter {
+	SCALE_BILINEAR,
+	SCALE_AREA,
+};
+
+enum ScaleKernel {
+	SCALE_KERNEL_SCALAR,
+	SCALE_KERNEL_SSE2,
+};
+
+// SSE2 is the default; the scalar kernel is there for comparison
+bool ScaleSelectKernel(ScaleKernel eKernel);
+ScaleKernel ScaleGetKernel();
+
+// Scratch space of the bilinear pass, kept by the caller between frames
+struct ScaleScratch {
+	std::vector<uint8_t> vRow;
+	// Left source column of each destination column, and the weights of it and its right neighbour
+	std::vector<int> vColumn;
+	std::vector<int16_t> vWeight;
+};
+
+// One plane, 2x2 box filter; the destination is srcWidth / 2 by srcHeight / 2
+void ScalePlaneHalf(const uint8_t *pSrc, int srcPitch, int srcWidth, int srcHeight, uint8_t *pDst, int dstPitch);
+// One plane, bilinear
+void ScalePlaneBilinear(const uint8_t *pSrc, int srcPitch, int srcWidth, int srcHeight,
+	uint8_t *pDst, int dstPitch, int dstWidth, int dstHeight, ScaleScratch &scratch);
+
+class Scaler
+{
+public:
+	Scaler();
+
+	bool Configure(int srcWidth, int srcHeight, int dstWidth, int dstHeight, ScaleFilter eFilter = SCALE_AREA);
+	int GetDstWidth()
+	{
+		return dstWidth;
+	}
+	int GetDstHeight()
+	{
+		return dstHeight;
+	}
+	// Bytes of one destination frame
+	size_t GetDstSize()
+	{
+		return (size_t)dstWidth * dstHeight * 3 / 2;
+	}
+
+	// pDst holds GetDstSize() bytes
+	void Scale(const uint8_t *pSrc, uint8_t *pDst);
+
+private:
+	void ScalePlane(const uint8_t *pSrc, int width, int height, uint8_t *pDst, int dstWidth, int dstHeight);
+
+	int srcWidth, srcHeight;
+	int dstWidth, dstHeight;
+	ScaleFilter eFilter;
+	// Halved copies of the plane being scaled, ping-ponged
+	std::vector<uint8_t> avHalf[2];
+	ScaleScratch scratch;
+};
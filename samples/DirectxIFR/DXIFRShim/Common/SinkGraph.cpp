@@ -0,0 +1,98 @@
+/*!
+ * \brief
+ * The implementation of SinkGraph
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include "SinkGraph.h"
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+SinkGraph::SinkGraph(int index) : index(index)
+{
+}
+
+SinkGraph::~SinkGraph()
+{
+	Stop();
+}
+
+bool SinkGraph::AddSink(const std::string &strName, const std::function<bool(Packet *)> &writePacket,
+	const std::function<void()> &close, size_t cbMax, unsigned int nMaxChunk)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	Sink sink = {strName, new SinkQueue(index, cbMax, nMaxChunk), close};
+	if (!sink.pQueue->StartPackets(writePacket, requestKeyFrame)) {
+		delete sink.pQueue;
+		return false;
+	}
+	vSink.push_back(sink);
+	LOG_INFO(logger, "Sink " << vSink.size() - 1 << " of player " << index << ": " << strName);
+	return true;
+}
+
+void SinkGraph::SetKeyFrameRequest(const std::function<void()> &requestKeyFrame)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	this->requestKeyFrame = requestKeyFrame;
+	for (size_t i = 0; i < vSink.size(); i++) {
+		vSink[i].pQueue->SetKeyFrameRequest(requestKeyFrame);
+	}
+}
+
+void SinkGraph::Stop()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	for (size_t i = 0; i < vSink.size(); i++) {
+		vSink[i].pQueue->Stop();
+		delete vSink[i].pQueue;
+		if (vSink[i].close) {
+			vSink[i].close();
+		}
+	}
+	vSink.clear();
+}
+
+bool SinkGraph::Push(const uint8_t *pData, size_t cb, SinkFrameKind eKind, bool bFrameStart)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (vSink.empty()) {
+		return false;
+	}
+	Packet *pPacket = PacketPool::GetShared()->Create(pData, cb, eKind, bFrameStart, index);
+	if (!pPacket) {
+		return false;
+	}
+	bool bQueued = vSink[0].pQueue->Push(pPacket);
+	for (size_t i = 1; i < vSink.size(); i++) {
+		vSink[i].pQueue->Push(pPacket);
+	}
+	pPacket->Release();
+	return bQueued;
+}
+
+int SinkGraph::GetSinkCount()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return (int)vSink.size();
+}
+
+SinkQueue *SinkGraph::GetSink(int iSink)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return iSink >= 0 && iSink < (int)vSink.size() ? vSink[iSink].pQueue : NULL;
+}
+
+std::string SinkGraph::GetSinkName(int iSink)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return iSink >= 0 && iSink < (int)vSink.size() ? vSink[iSink].strName : std::string();
+}
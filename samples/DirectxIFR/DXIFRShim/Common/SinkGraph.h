@@ -0,0 +1,74 @@
+/*!
+ * \brief
+ * Fan-out of a player's encoder output to any number of sinks
+ *
+ * \file
+ *
+ * Each sink (the stream to the viewer, a recording, a plugin, ...) is a
+ * SinkQueue of its own, with its own writer thread and its own drop
+ * policy, so a sink that falls behind drops frames without holding up the
+ * encoder or the other sinks. Push() copies the output once into a Packet
+ * and hands that same packet to every queue.
+ *
+ * The first sink added is the primary one: Push() reports its drops, the
+ * way it did when it was the only queue. A sink that drops a reference
+ * frame asks for a key frame like any SinkQueue; the encoder is shared, so
+ * every sink gets it.
+ *
+ * Sinks are added before output starts and removed all at once by Stop().
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "SinkQueue.h"
+
+class SinkGraph
+{
+public:
+	SinkGraph(int index = 0);
+	~SinkGraph();
+
+	void SetIndex(int index)
+	{
+		this->index = index;
+	}
+	/*! Adds a sink and starts its queue. close, if any, is called once the queue
+	    has written everything out, e.g. to close the sink's file. */
+	bool AddSink(const std::string &strName, const std::function<bool(Packet *)> &writePacket,
+		const std::function<void()> &close = std::function<void()>(), size_t cbMax = 4 << 20, unsigned int nMaxChunk = 64);
+	// Applies to the sinks added so far and later
+	void SetKeyFrameRequest(const std::function<void()> &requestKeyFrame);
+	// Writes out and stops every sink, then removes them
+	void Stop();
+
+	/*! Hands one copy of pData to every sink. Returns false if the primary sink
+	    dropped it (or there is none). */
+	bool Push(const uint8_t *pData, size_t cb, SinkFrameKind eKind, bool bFrameStart = true);
+
+	int GetSinkCount();
+	// Valid until Stop(); NULL past the last sink
+	SinkQueue *GetSink(int iSink);
+	std::string GetSinkName(int iSink);
+
+private:
+	struct Sink {
+		std::string strName;
+		SinkQueue *pQueue;
+		std::function<void()> close;
+	};
+
+	int index;
+	std::mutex mtx;
+	std::vector<Sink> vSink;
+	std::function<void()> requestKeyFrame;
+};
@@ -0,0 +1,95 @@
+/*!
+ * \brief
+ * Versioned C interface of the sink plugins of a player's SinkGraph
+ *
+ * \file
+ *
+ * A sink plugin is a DLL, like Streaming.dll, that receives the encoder's
+ * output packets without a copy: the SinkPacket it is handed points at the
+ * host's Packet. It exports
+ *
+ *     int GetSinkPlugin(uint32_t dwHostVersion, SinkPluginApi *pApi);
+ *
+ * which fills pApi and returns nonzero if it can work with a host of
+ * dwHostVersion. The host then calls Open() once per player and rendition
+ * and Write() for every packet, on the writer thread of the sink's own
+ * SinkQueue, so a slow plugin only ever drops its own frames.
+ *
+ * The data of a packet is valid during Write(). A plugin that wants it
+ * longer, e.g. to send it from a thread of its own, takes a reference with
+ * SinkHost::AddRef() and gives it back with Release(), at the latest
+ * before Close() returns. The data must not be written to.
+ *
+ * Every structure starts with its size and later versions only append to
+ * it, so either side can tell which fields the other one knows. A host
+ * loads plugins of its own SINK_PLUGIN_ABI_VERSION only.
+ *
+ * This header is plain C, for plugins that are not built with the shim.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define SINK_PLUGIN_ABI_VERSION 1
+
+#ifdef _WIN32
+#define SINK_PLUGIN_CALL __cdecl
+#else
+#define SINK_PLUGIN_CALL
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SinkFrameKind of the packet
+enum {
+	SINK_PACKET_KEY,
+	SINK_PACKET_REFERENCE,
+	SINK_PACKET_NON_REFERENCE,
+};
+
+typedef struct SinkPacket {
+	uint32_t cbStruct;
+	uint32_t cb;
+	const uint8_t *pData;
+	int32_t eKind;
+	// Zero for the second and later slices of a frame read out slice by slice
+	int32_t bFrameStart;
+	int32_t iPlayer;
+	int32_t iReserved;
+	// Time the packet was made, in microseconds
+	uint64_t qwTimestampUs;
+	// The host's packet, for SinkHost::AddRef() and Release()
+	void *hPacket;
+} SinkPacket;
+
+typedef struct SinkHost {
+	uint32_t cbStruct;
+	uint32_t dwVersion;
+	void (SINK_PLUGIN_CALL *AddRef)(void *hPacket);
+	void (SINK_PLUGIN_CALL *Release)(void *hPacket);
+} SinkHost;
+
+typedef struct SinkPluginApi {
+	uint32_t cbStruct;
+	uint32_t dwVersion;
+	// A sink for the player's rendition, or NULL; pHost stays valid until Close()
+	void *(SINK_PLUGIN_CALL *Open)(const SinkHost *pHost, int iPlayer, int iRendition);
+	// Nonzero if the packet was taken, zero on a failed write
+	int (SINK_PLUGIN_CALL *Write)(void *pSink, const SinkPacket *pPacket);
+	void (SINK_PLUGIN_CALL *Close)(void *pSink);
+} SinkPluginApi;
+
+typedef int (SINK_PLUGIN_CALL *GetSinkPlugin_Type)(uint32_t dwHostVersion, SinkPluginApi *pApi);
+
+#ifdef __cplusplus
+}
+#endif
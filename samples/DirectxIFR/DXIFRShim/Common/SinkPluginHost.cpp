@@ -0,0 +1,131 @@
+/*!
+ * \brief
+ * The implementation of SinkPluginHost
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+#include "SinkPluginHost.h"
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+// The fields of version 1, which any plugin of that version fills in
+#define SINK_PLUGIN_API_V1_SIZE (offsetof(SinkPluginApi, Close) + sizeof(((SinkPluginApi *)0)->Close))
+
+static_assert((int)SINK_PACKET_KEY == SINK_FRAME_KEY && (int)SINK_PACKET_REFERENCE == SINK_FRAME_REFERENCE
+	&& (int)SINK_PACKET_NON_REFERENCE == SINK_FRAME_NON_REFERENCE, "SinkPacket::eKind is a SinkFrameKind");
+
+SinkPluginHost::SinkPluginHost() : hLib(NULL)
+{
+	memset(&api, 0, sizeof(api));
+	memset(&host, 0, sizeof(host));
+	host.cbStruct = sizeof(host);
+	host.dwVersion = SINK_PLUGIN_ABI_VERSION;
+	host.AddRef = AddRef;
+	host.Release = Release;
+}
+
+SinkPluginHost::~SinkPluginHost()
+{
+	Unload();
+}
+
+bool SinkPluginHost::Load(const char *szPath)
+{
+	Unload();
+	strPath = szPath;
+#ifdef _WIN32
+	hLib = LoadLibraryA(szPath);
+	GetSinkPlugin_Type GetSinkPlugin_Proc = hLib ? (GetSinkPlugin_Type)GetProcAddress((HMODULE)hLib, "GetSinkPlugin") : NULL;
+#else
+	hLib = dlopen(szPath, RTLD_NOW);
+	GetSinkPlugin_Type GetSinkPlugin_Proc = hLib ? (GetSinkPlugin_Type)dlsym(hLib, "GetSinkPlugin") : NULL;
+#endif
+	if (!hLib) {
+		LOG_ERROR(logger, "Failed to load sink plugin " << strPath);
+		return false;
+	}
+	if (!GetSinkPlugin_Proc) {
+		LOG_ERROR(logger, strPath << " exports no GetSinkPlugin()");
+		Unload();
+		return false;
+	}
+	if (!GetSinkPlugin_Proc(SINK_PLUGIN_ABI_VERSION, &api) || api.dwVersion != SINK_PLUGIN_ABI_VERSION
+		|| api.cbStruct < SINK_PLUGIN_API_V1_SIZE || !api.Open || !api.Write || !api.Close) {
+		LOG_ERROR(logger, "Sink plugin " << strPath << " is of version " << api.dwVersion << ", not " << SINK_PLUGIN_ABI_VERSION);
+		Unload();
+		return false;
+	}
+	LOG_INFO(logger, "Loaded sink plugin " << strPath);
+	return true;
+}
+
+void SinkPluginHost::Unload()
+{
+	if (hLib) {
+#ifdef _WIN32
+		FreeLibrary((HMODULE)hLib);
+#else
+		dlclose(hLib);
+#endif
+		hLib = NULL;
+	}
+	memset(&api, 0, sizeof(api));
+}
+
+bool SinkPluginHost::Attach(SinkGraph &graph, int iPlayer, int iRendition)
+{
+	if (!hLib) {
+		return false;
+	}
+	void *pSink = api.Open(&host, iPlayer, iRendition);
+	if (!pSink) {
+		LOG_ERROR(logger, "Sink plugin " << strPath << " has no sink for player " << iPlayer << ", rendition " << iRendition);
+		return false;
+	}
+	SinkPluginApi *pApi = &api;
+	if (!graph.AddSink(strPath, [this, pSink](Packet *pPacket) { return Write(pSink, pPacket); }, [pApi, pSink] { pApi->Close(pSink); })) {
+		api.Close(pSink);
+		return false;
+	}
+	return true;
+}
+
+bool SinkPluginHost::Write(void *pSink, Packet *pPacket)
+{
+	SinkPacket packet;
+	memset(&packet, 0, sizeof(packet));
+	packet.cbStruct = sizeof(packet);
+	packet.cb = (uint32_t)pPacket->GetSize();
+	packet.pData = pPacket->GetData();
+	packet.eKind = pPacket->GetKind();
+	packet.bFrameStart = pPacket->IsFrameStart();
+	packet.iPlayer = pPacket->GetPlayer();
+	packet.qwTimestampUs = pPacket->GetTimestampUs();
+	packet.hPacket = pPacket;
+	return api.Write(pSink, &packet) != 0;
+}
+
+void SINK_PLUGIN_CALL SinkPluginHost::AddRef(void *hPacket)
+{
+	((Packet *)hPacket)->AddRef();
+}
+
+void SINK_PLUGIN_CALL SinkPluginHost::Release(void *hPacket)
+{
+	((Packet *)hPacket)->Release();
+}
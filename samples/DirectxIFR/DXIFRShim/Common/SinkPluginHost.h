@@ -0,0 +1,53 @@
+/*!
+ * \brief
+ * Loads a sink plugin (see SinkPlugin.h) and attaches it to SinkGraphs
+ *
+ * \file
+ *
+ * The plugin writes straight from the host's packets: Write() hands it a
+ * SinkPacket that points at the Packet's data, and SinkHost::AddRef() and
+ * Release() work on the Packet's own count.
+ *
+ * The host must outlive the graphs it attached sinks to, since the code of
+ * their writers is in the plugin.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <string>
+#include "SinkPlugin.h"
+#include "SinkGraph.h"
+
+class SinkPluginHost
+{
+public:
+	SinkPluginHost();
+	~SinkPluginHost();
+
+	// Loads the library and checks its ABI version; false if it is no sink plugin of this version
+	bool Load(const char *szPath);
+	bool IsLoaded()
+	{
+		return hLib != NULL;
+	}
+	// Opens a sink of the plugin for the player's rendition and adds it to graph
+	bool Attach(SinkGraph &graph, int iPlayer, int iRendition = 0);
+	// Frees the library; the graphs must have been stopped
+	void Unload();
+
+private:
+	static void SINK_PLUGIN_CALL AddRef(void *hPacket);
+	static void SINK_PLUGIN_CALL Release(void *hPacket);
+	bool Write(void *pSink, Packet *pPacket);
+
+	std::string strPath;
+	void *hLib;
+	SinkPluginApi api;
+	SinkHost host;
+};
@@ -0,0 +1,201 @@
+/*!
+ * \brief
+ * The implementation of SinkQueue
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <string.h>
+#include "SinkQueue.h"
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+SinkQueue::SinkQueue(int index, size_t cbMax, unsigned int nMaxChunk) :
+	index(index), cbMax(cbMax), nMaxChunk(nMaxChunk), bStop(false), cbQueued(0),
+	bDropToKeyFrame(false), bDropFrame(false), eFrameKind(SINK_FRAME_KEY)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+SinkQueue::~SinkQueue()
+{
+	Stop();
+}
+
+bool SinkQueue::Start(const std::function<bool(const uint8_t *, size_t)> &write, const std::function<void()> &requestKeyFrame)
+{
+	return StartPackets([write](Packet *pPacket) { return write(pPacket->GetData(), pPacket->GetSize()); }, requestKeyFrame);
+}
+
+bool SinkQueue::StartPackets(const std::function<bool(Packet *)> &writePacket, const std::function<void()> &requestKeyFrame)
+{
+	if (thWriter.joinable()) {
+		return false;
+	}
+	this->writePacket = writePacket;
+	SetKeyFrameRequest(requestKeyFrame);
+	bStop = false;
+	thWriter = std::thread(&SinkQueue::WriterProc, this);
+	return true;
+}
+
+void SinkQueue::SetKeyFrameRequest(const std::function<void()> &requestKeyFrame)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	this->requestKeyFrame = requestKeyFrame;
+}
+
+void SinkQueue::Stop()
+{
+	if (!thWriter.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		bStop = true;
+	}
+	cv.notify_one();
+	thWriter.join();
+}
+
+bool SinkQueue::IsFull(size_t cb)
+{
+	// An empty queue takes any chunk, however large
+	return !dqChunk.empty() && (cbQueued + cb > cbMax || dqChunk.size() >= nMaxChunk);
+}
+
+void SinkQueue::Unqueue(Packet *pPacket)
+{
+	cbQueued -= pPacket->GetSize();
+	pPacket->Release();
+}
+
+bool SinkQueue::Push(const uint8_t *pData, size_t cb, SinkFrameKind eKind, bool bFrameStart)
+{
+	Packet *pPacket = PacketPool::GetShared()->Create(pData, cb, eKind, bFrameStart, index);
+	if (!pPacket) {
+		return false;
+	}
+	bool bQueued = Push(pPacket);
+	pPacket->Release();
+	return bQueued;
+}
+
+bool SinkQueue::Push(Packet *pPacket)
+{
+	size_t cb = pPacket->GetSize();
+	SinkFrameKind eKind = pPacket->GetKind();
+	bool bFrameStart = pPacket->IsFrameStart();
+	std::function<void()> request;
+	bool bLog = false;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!thWriter.joinable() || bStop) {
+			return false;
+		}
+
+		if (bFrameStart) {
+			eFrameKind = eKind;
+			bDropFrame = false;
+			if (eKind == SINK_FRAME_KEY) {
+				bDropToKeyFrame = false;
+				if (IsFull(cb)) {
+					// The key frame makes everything still queued obsolete
+					while (!dqChunk.empty()) {
+						stats.qwDroppedBytes += dqChunk.front()->GetSize();
+						Unqueue(dqChunk.front());
+						dqChunk.pop_front();
+					}
+				}
+			} else if (bDropToKeyFrame) {
+				bDropFrame = true;
+			} else if (IsFull(cb)) {
+				bDropFrame = true;
+				if (eKind == SINK_FRAME_REFERENCE) {
+					bDropToKeyFrame = true;
+				}
+				bLog = true;
+			}
+			if (bDropFrame) {
+				stats.nDroppedFrame++;
+			} else {
+				stats.nFrame++;
+			}
+		} else if (!bDropFrame && IsFull(cb)) {
+			// Part of the frame is queued already; the rest cannot be dropped cleanly
+			bDropFrame = true;
+			bDropToKeyFrame = eFrameKind != SINK_FRAME_NON_REFERENCE;
+			stats.nDroppedFrame++;
+			bLog = true;
+		}
+
+		if (bDropFrame) {
+			stats.qwDroppedBytes += cb;
+			if (bLog && bDropToKeyFrame) {
+				stats.nKeyFrameRequest++;
+				request = requestKeyFrame;
+			}
+		} else {
+			pPacket->AddRef();
+			dqChunk.push_back(pPacket);
+			cbQueued += cb;
+			stats.qwBytes += cb;
+			if (cbQueued > stats.cbHighWater) {
+				stats.cbHighWater = cbQueued;
+			}
+		}
+	}
+
+	if (bLog) {
+		LOG_WARN(logger, "Sink of player " << index << " fell behind, dropping "
+			<< (bDropToKeyFrame ? "to the next key frame" : "a non-reference frame"));
+	}
+	if (request) {
+		request();
+	}
+	if (bDropFrame) {
+		return false;
+	}
+	cv.notify_one();
+	return true;
+}
+
+void SinkQueue::WriterProc()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	for (;;) {
+		cv.wait(lock, [this] { return bStop || !dqChunk.empty(); });
+		if (dqChunk.empty()) {
+			// Stopped and drained
+			break;
+		}
+		Packet *pPacket = dqChunk.front();
+		dqChunk.pop_front();
+
+		// cbQueued still counts the chunk while it is being written
+		lock.unlock();
+		bool bWritten = writePacket(pPacket);
+		lock.lock();
+
+		if (!bWritten) {
+			stats.nWriteError++;
+		}
+		Unqueue(pPacket);
+	}
+}
+
+SinkQueue::Stats SinkQueue::TakeStats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	Stats ret = stats;
+	memset(&stats, 0, sizeof(stats));
+	ret.cbHighWater = ret.cbHighWater > cbQueued ? ret.cbHighWater : cbQueued;
+	return ret;
+}
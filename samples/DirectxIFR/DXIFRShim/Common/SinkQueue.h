@@ -0,0 +1,112 @@
+/*!
+ * \brief
+ * Bounded, non-blocking queue in front of a blocking output (pipe, file or socket)
+ *
+ * \file
+ *
+ * The encoder thread pushes its output and returns at once; a writer thread
+ * per queue does the blocking writes. When the output falls behind, the
+ * queue fills up and frames are dropped instead of stalling the encoder:
+ *
+ *  - a non-reference frame is dropped alone, nothing depends on it;
+ *  - a reference frame is dropped together with every following frame up
+ *    to the next key frame, which is requested right away;
+ *  - a key frame is always taken, and discards whatever is still queued
+ *    since it makes that data obsolete.
+ *
+ * A frame may be pushed in several chunks (e.g. slice by slice); the drop
+ * decision is made for the whole frame on its first chunk. A frame that
+ * overflows the queue halfway is cut off and handled like a dropped
+ * reference frame.
+ *
+ * The queue holds Packets. Pushing data copies it into a new packet;
+ * pushing a packet only takes a reference, which is how a SinkGraph hands
+ * one packet to all of its queues.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "Packet.h"
+
+class SinkQueue
+{
+public:
+	struct Stats {
+		unsigned int nFrame;
+		unsigned int nDroppedFrame;
+		unsigned long long qwBytes;
+		unsigned long long qwDroppedBytes;
+		// Key frames requested because a reference frame was dropped
+		unsigned int nKeyFrameRequest;
+		unsigned int nWriteError;
+		// Most bytes queued at once
+		size_t cbHighWater;
+	};
+
+	SinkQueue(int index = 0, size_t cbMax = 4 << 20, unsigned int nMaxChunk = 64);
+	~SinkQueue();
+
+	void SetIndex(int index)
+	{
+		this->index = index;
+	}
+	/*! Starts the writer thread. write must return false on a failed write; requestKeyFrame
+	    is called on the pushing thread and must not block. */
+	bool Start(const std::function<bool(const uint8_t *, size_t)> &write, const std::function<void()> &requestKeyFrame = std::function<void()>());
+	// Start() for a writer that wants the packet itself, e.g. to keep a reference past the call
+	bool StartPackets(const std::function<bool(Packet *)> &writePacket, const std::function<void()> &requestKeyFrame = std::function<void()>());
+	void SetKeyFrameRequest(const std::function<void()> &requestKeyFrame);
+	// Writes out what is queued and stops the writer thread
+	void Stop();
+	bool IsStarted()
+	{
+		return thWriter.joinable();
+	}
+
+	/*! Queues a copy of pData without blocking. Returns false if the chunk was dropped
+	    (or the queue is not started). */
+	bool Push(const uint8_t *pData, size_t cb, SinkFrameKind eKind, bool bFrameStart = true);
+	// Queues a reference to pPacket, without copying it; the caller keeps its own reference
+	bool Push(Packet *pPacket);
+
+	// Stats since the last call
+	Stats TakeStats();
+
+private:
+	void WriterProc();
+	bool IsFull(size_t cb);
+	void Unqueue(Packet *pPacket);
+
+	int index;
+	size_t cbMax;
+	unsigned int nMaxChunk;
+	std::function<bool(Packet *)> writePacket;
+	std::function<void()> requestKeyFrame;
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::thread thWriter;
+	bool bStop;
+	// One reference each; PacketPool reuses the buffers of written chunks
+	std::deque<Packet *> dqChunk;
+	size_t cbQueued;
+	// Dropping everything until the next key frame
+	bool bDropToKeyFrame;
+	// Dropping the rest of the current frame
+	bool bDropFrame;
+	SinkFrameKind eFrameKind;
+	Stats stats;
+};
@@ -0,0 +1,134 @@
+/*!
+ * \brief
+ * The implementation of SliceReadout and MockSliceSource
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <string.h>
+#include <thread>
+#include "SliceReadout.h"
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+using namespace std::chrono;
+
+static inline unsigned int MicrosecondsSince(steady_clock::time_point t)
+{
+	return (unsigned int)duration_cast<microseconds>(steady_clock::now() - t).count();
+}
+
+SliceReadout::SliceReadout(int index, unsigned int usPollInterval) : index(index), usPollInterval(usPollInterval)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+bool SliceReadout::ReadFrame(SliceSource *pSource, const std::function<void(const SliceChunk &)> &sink, unsigned int msTimeout)
+{
+	steady_clock::time_point tStart = steady_clock::now();
+	uint32_t nEmitted = 0, cbEmitted = 0;
+	unsigned int usFirstSlice = 0;
+	for (;;) {
+		SliceProgress progress;
+		if (!pSource->Poll(progress)) {
+			LOG_WARN(logger, "Slice readout of player " << index << " failed after " << nEmitted << " slices");
+			return false;
+		}
+		unsigned int usElapsed = MicrosecondsSince(tStart);
+		bool bLastSent = false;
+		// Slice i ends where slice i + 1 starts; the last complete one ends at cbAvailable
+		while (nEmitted < progress.nSlice || (progress.bDone && !bLastSent)) {
+			uint32_t end = nEmitted + 1 < progress.nSlice ? progress.pSliceOffset[nEmitted + 1] : progress.cbAvailable;
+			if (end < cbEmitted) {
+				end = cbEmitted;
+			}
+			SliceChunk chunk;
+			chunk.pData = progress.pData + cbEmitted;
+			chunk.cb = end - cbEmitted;
+			chunk.offset = cbEmitted;
+			chunk.iSlice = nEmitted;
+			chunk.dwFrame = progress.dwFrame;
+			// A frame that ends before its last slice offset gets an empty last chunk
+			chunk.bLast = progress.bDone && nEmitted + 1 >= progress.nSlice;
+			chunk.usElapsed = usElapsed;
+			LOG_TRACE(logger, "Slice of player " << index << ": frame " << chunk.dwFrame << ", slice " << chunk.iSlice
+				<< ", offset " << chunk.offset << ", " << chunk.cb << " bytes, +" << usElapsed << "us");
+			sink(chunk);
+
+			if (!nEmitted) {
+				usFirstSlice = usElapsed;
+			}
+			cbEmitted = end;
+			bLastSent = chunk.bLast;
+			if (nEmitted < progress.nSlice) {
+				nEmitted++;
+			}
+		}
+		pSource->Release();
+
+		if (progress.bDone) {
+			std::lock_guard<std::mutex> lock(mtx);
+			stats.nFrame++;
+			stats.nSlice += nEmitted;
+			stats.qwFirstSliceUs += usFirstSlice;
+			stats.qwFrameUs += usElapsed;
+			return true;
+		}
+		if (usElapsed >= msTimeout * 1000) {
+			LOG_WARN(logger, "Slice readout of player " << index << " timed out after " << nEmitted << " slices");
+			std::lock_guard<std::mutex> lock(mtx);
+			stats.nTimeout++;
+			return false;
+		}
+		std::this_thread::sleep_for(microseconds(usPollInterval));
+	}
+}
+
+SliceReadout::Stats SliceReadout::TakeStats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	Stats ret = stats;
+	memset(&stats, 0, sizeof(stats));
+	return ret;
+}
+
+MockSliceSource::MockSliceSource(const std::vector<unsigned int> &vusSliceDelay) :
+	vusSliceDelay(vusSliceDelay), pData(NULL), cb(0), dwFrame(0)
+{
+	if (this->vusSliceDelay.empty()) {
+		this->vusSliceDelay.push_back(0);
+	}
+}
+
+void MockSliceSource::Start(const uint8_t *pData, uint32_t cb, const std::vector<uint32_t> &vSliceOffset, uint32_t dwFrame)
+{
+	this->pData = pData;
+	this->cb = cb;
+	this->vSliceOffset = vSliceOffset;
+	this->dwFrame = dwFrame;
+	tStart = steady_clock::now();
+}
+
+bool MockSliceSource::Poll(SliceProgress &progress)
+{
+	unsigned int usElapsed = MicrosecondsSince(tStart);
+	uint32_t nTotal = (uint32_t)vSliceOffset.size();
+	uint32_t n = 0;
+	while (n < nTotal && vusSliceDelay[n < vusSliceDelay.size() ? n : vusSliceDelay.size() - 1] <= usElapsed) {
+		n++;
+	}
+	progress.pData = pData;
+	progress.cbAvailable = n < nTotal ? vSliceOffset[n] : cb;
+	progress.nSlice = n;
+	progress.pSliceOffset = vSliceOffset.empty() ? NULL : &vSliceOffset[0];
+	progress.bDone = n == nTotal;
+	progress.dwFrame = dwFrame;
+	return true;
+}
@@ -0,0 +1,126 @@
+/*!
+ * \brief
+ * Sub-frame (slice level) readout of the encoded bitstream
+ *
+ * \file
+ *
+ * With sub-frame write enabled, NVENC writes each slice to the bitstream
+ * buffer as soon as it is encoded and reports the slice offsets while the
+ * rest of the frame is still being encoded. SliceReadout polls a
+ * SliceSource for that progress and hands every completed slice to a sink
+ * right away, so the packetizer can start sending the first slice while
+ * the last one is still in the encoder.
+ *
+ * Every slice is traced with its frame, offset, size and the time since
+ * the readout of its frame started.
+ *
+ * MockSliceSource emits a frame slice by slice with configurable delays,
+ * so the readout path can be exercised without a GPU.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// How far the encoder got with the current frame
+struct SliceProgress {
+	// Start of the frame in the bitstream buffer
+	const uint8_t *pData;
+	// Bytes of the frame that are complete; the complete slices end here
+	uint32_t cbAvailable;
+	// Number of complete slices and their start offsets
+	uint32_t nSlice;
+	const uint32_t *pSliceOffset;
+	// The whole frame is written
+	bool bDone;
+	uint32_t dwFrame;
+};
+
+class SliceSource
+{
+public:
+	virtual ~SliceSource() {}
+	/*! Reports the progress of the current frame. Returns false on error. pData stays
+	    valid until Release(), which is called after every successful Poll(). */
+	virtual bool Poll(SliceProgress &progress) = 0;
+	virtual void Release() = 0;
+};
+
+struct SliceChunk {
+	const uint8_t *pData;
+	uint32_t cb;
+	// Offset of the chunk in its frame
+	uint32_t offset;
+	uint32_t iSlice;
+	uint32_t dwFrame;
+	// Last chunk of the frame
+	bool bLast;
+	// Time since the readout of the frame started
+	uint32_t usElapsed;
+};
+
+class SliceReadout
+{
+public:
+	struct Stats {
+		unsigned int nFrame;
+		unsigned int nSlice;
+		unsigned int nTimeout;
+		// Summed over the frames: time to the first slice and to the whole frame
+		unsigned long long qwFirstSliceUs;
+		unsigned long long qwFrameUs;
+	};
+
+	SliceReadout(int index = 0, unsigned int usPollInterval = 100);
+
+	void SetIndex(int index)
+	{
+		this->index = index;
+	}
+	/*! Reads one frame from pSource, passing each slice to sink as soon as it is complete.
+	    The first chunk also carries the headers in front of the first slice; the last one
+	    has bLast set. Returns false on a source error or after msTimeout. */
+	bool ReadFrame(SliceSource *pSource, const std::function<void(const SliceChunk &)> &sink, unsigned int msTimeout = 1000);
+
+	// Stats since the last call
+	Stats TakeStats();
+
+private:
+	int index;
+	unsigned int usPollInterval;
+	std::mutex mtx;
+	Stats stats;
+};
+
+class MockSliceSource : public SliceSource
+{
+public:
+	/*! vusSliceDelay[i] is the time after Start() at which slice i is complete; frames
+	    with more slices than delays reuse the last delay. */
+	MockSliceSource(const std::vector<unsigned int> &vusSliceDelay);
+
+	/*! Starts emitting a frame of cb bytes whose slices begin at vSliceOffset (the first
+	    one may follow the parameter sets). pData must stay valid until the frame is read. */
+	void Start(const uint8_t *pData, uint32_t cb, const std::vector<uint32_t> &vSliceOffset, uint32_t dwFrame);
+
+	virtual bool Poll(SliceProgress &progress);
+	virtual void Release() {}
+
+private:
+	std::vector<unsigned int> vusSliceDelay;
+	const uint8_t *pData;
+	uint32_t cb;
+	std::vector<uint32_t> vSliceOffset;
+	uint32_t dwFrame;
+	std::chrono::steady_clock::time_point tStart;
+};
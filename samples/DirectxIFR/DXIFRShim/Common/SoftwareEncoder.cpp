@@ -0,0 +1,488 @@
+/*!
+ * \brief
+ * The implementation of SoftwareEncoder
+ *
+ * \file
+ *
+ * The FLV muxer writes a file header, a script tag, the AVC sequence
+ * header (SPS and PPS, since x264 runs with a global header) and then one
+ * video tag per frame, with NAL units prefixed by their length. ReadFrame()
+ * skips what is not a frame, keeps SPS and PPS, and rewrites the frame to
+ * Annex-B with start codes, which is what NalIndex and the outputs expect.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+#include "SoftwareEncoder.h"
+#include "Placement.h"
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+#define FLV_TAG_VIDEO 9
+#define FLV_CODEC_AVC 7
+#define FLV_AVC_SEQUENCE_HEADER 0
+#define FLV_AVC_NALU 1
+#define FLV_FRAME_KEY 1
+// Priority of the encoder processes on Linux, where the game runs at 0
+#define SW_NICE 10
+
+static const uint8_t abStartCode[] = {0, 0, 0, 1};
+
+std::mutex SoftwareEncoder::mtxBudget;
+int SoftwareEncoder::nThreadBudget = 0;
+int SoftwareEncoder::nThreadInUse = 0;
+
+SoftwareEncoder::SoftwareEncoder() : width(0), height(0), fps(0), vbvFrames(0), nThread(0), bitrate(0), pActive(NULL), pStandby(NULL)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+SoftwareEncoder::~SoftwareEncoder()
+{
+	Close();
+}
+
+void SoftwareEncoder::SetThreadBudget(int nThread)
+{
+	std::lock_guard<std::mutex> lock(mtxBudget);
+	nThreadBudget = nThread;
+}
+
+int SoftwareEncoder::GetThreadsInUse()
+{
+	std::lock_guard<std::mutex> lock(mtxBudget);
+	return nThreadInUse;
+}
+
+bool SoftwareEncoder::Open(int width, int height, int fps, int bitrate, int vbvFrames)
+{
+	if (pActive) {
+		return true;
+	}
+	int nWanted = (width * height + SW_PIXELS_PER_THREAD - 1) / SW_PIXELS_PER_THREAD;
+	nWanted = nWanted < 1 ? 1 : nWanted > SW_MAX_THREADS ? SW_MAX_THREADS : nWanted;
+	{
+		std::lock_guard<std::mutex> lock(mtxBudget);
+		int nBudget = nThreadBudget;
+		if (nBudget <= 0) {
+			nBudget = (int)std::thread::hardware_concurrency() / 4;
+			nBudget = nBudget > 0 ? nBudget : 1;
+		}
+		int nFree = nBudget - nThreadInUse;
+		if (nFree <= 0) {
+			LOG_WARN(logger, "All " << nBudget << " software encoder threads are in use");
+			return false;
+		}
+		nThread = nWanted < nFree ? nWanted : nFree;
+		nThreadInUse += nThread;
+	}
+
+	this->width = width;
+	this->height = height;
+	this->fps = fps > 0 ? fps : 30;
+	this->bitrate = bitrate;
+	this->vbvFrames = vbvFrames;
+	pActive = Spawn(bitrate);
+	if (!pActive) {
+		Close();
+		return false;
+	}
+	pStandby = Spawn(bitrate);
+	LOG_INFO(logger, "Software encoder for " << width << "x" << height << " at " << bitrate << "bps with " << nThread << " threads");
+	return true;
+}
+
+void SoftwareEncoder::Close()
+{
+	Kill(pActive);
+	Kill(pStandby);
+	pActive = pStandby = NULL;
+	if (nThread) {
+		std::lock_guard<std::mutex> lock(mtxBudget);
+		nThreadInUse -= nThread;
+		nThread = 0;
+	}
+}
+
+SoftwareEncoder::Process *SoftwareEncoder::Spawn(int bitrate)
+{
+	// The VBV is vbvFrames frames long like in the NVENC path, one frame by default
+	int cbVbv = (int)((long long)bitrate * (vbvFrames > 0 ? vbvFrames : 1) / fps);
+	char szCommand[512];
+	sprintf(szCommand, "ffmpeg -hide_banner -loglevel error "
+		"-f rawvideo -pix_fmt yuv420p -s %dx%d -r %d -i - "
+		"-c:v libx264 -preset ultrafast -tune zerolatency -threads %d -b:v %d -maxrate %d -bufsize %d "
+		"-x264-params keyint=infinite:scenecut=0 -f flv -flush_packets 1 -",
+		width, height, fps, nThread, bitrate, bitrate, cbVbv);
+	ULONGLONG qwCpuMask = Placement::GetShared()->GetEncoderCpuMask();
+
+	Process *pProcess = new Process;
+	pProcess->bitrate = bitrate;
+	pProcess->bHeaderRead = false;
+	pProcess->bEncoded = false;
+	pProcess->nLengthSize = 4;
+#ifdef _WIN32
+	SECURITY_ATTRIBUTES sa = {sizeof(sa), NULL, TRUE};
+	HANDLE hStdinRead = NULL, hStdoutWrite = NULL;
+	pProcess->hProcess = pProcess->hStdin = pProcess->hStdout = NULL;
+	HANDLE hNul = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+	if (!CreatePipe(&hStdinRead, &pProcess->hStdin, &sa, 0) || !CreatePipe(&pProcess->hStdout, &hStdoutWrite, &sa, 0)) {
+		LOG_ERROR(logger, "Failed to create the pipes of the software encoder, error " << GetLastError());
+	} else {
+		// Only the child's ends are inherited
+		SetHandleInformation(pProcess->hStdin, HANDLE_FLAG_INHERIT, 0);
+		SetHandleInformation(pProcess->hStdout, HANDLE_FLAG_INHERIT, 0);
+		STARTUPINFOA si;
+		memset(&si, 0, sizeof(si));
+		si.cb = sizeof(si);
+		si.dwFlags = STARTF_USESTDHANDLES;
+		si.hStdInput = hStdinRead;
+		si.hStdOutput = hStdoutWrite;
+		si.hStdError = hNul;
+		PROCESS_INFORMATION pi;
+		if (CreateProcessA(NULL, szCommand, NULL, NULL, TRUE, BELOW_NORMAL_PRIORITY_CLASS | CREATE_NO_WINDOW, NULL, NULL, &si, &pi)) {
+			if (qwCpuMask) {
+				SetProcessAffinityMask(pi.hProcess, (DWORD_PTR)qwCpuMask);
+			}
+			CloseHandle(pi.hThread);
+			pProcess->hProcess = pi.hProcess;
+		} else {
+			LOG_ERROR(logger, "Failed to start \"" << szCommand << "\", error " << GetLastError());
+		}
+	}
+	if (hStdinRead) {
+		CloseHandle(hStdinRead);
+	}
+	if (hStdoutWrite) {
+		CloseHandle(hStdoutWrite);
+	}
+	if (hNul != INVALID_HANDLE_VALUE) {
+		CloseHandle(hNul);
+	}
+	if (!pProcess->hProcess) {
+		Kill(pProcess);
+		return NULL;
+	}
+#else
+	// A process that died must fail the write, not end the shim
+	static std::once_flag onceIgnoreSigpipe;
+	std::call_once(onceIgnoreSigpipe, [] { signal(SIGPIPE, SIG_IGN); });
+
+	int afdStdin[2], afdStdout[2];
+	pProcess->pid = -1;
+	pProcess->fdStdin = pProcess->fdStdout = -1;
+	if (pipe2(afdStdin, O_CLOEXEC)) {
+		LOG_ERROR(logger, "Failed to create the pipes of the software encoder, errno " << errno);
+		delete pProcess;
+		return NULL;
+	}
+	if (pipe2(afdStdout, O_CLOEXEC)) {
+		LOG_ERROR(logger, "Failed to create the pipes of the software encoder, errno " << errno);
+		close(afdStdin[0]);
+		close(afdStdin[1]);
+		delete pProcess;
+		return NULL;
+	}
+	// Everything the child needs is prepared before fork()
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	for (int i = 0; i < 64; i++) {
+		if (qwCpuMask & (1ull << i)) {
+			CPU_SET(i, &cpuSet);
+		}
+	}
+	char szShellCommand[sizeof(szCommand) + 8];
+	sprintf(szShellCommand, "exec %s", szCommand);
+	pid_t pid = fork();
+	if (pid == 0) {
+		int fdNull = open("/dev/null", O_WRONLY);
+		dup2(afdStdin[0], 0);
+		dup2(afdStdout[1], 1);
+		dup2(fdNull, 2);
+		setpriority(PRIO_PROCESS, 0, SW_NICE);
+		if (qwCpuMask) {
+			sched_setaffinity(0, sizeof(cpuSet), &cpuSet);
+		}
+		execl("/bin/sh", "sh", "-c", szShellCommand, (char *)NULL);
+		_exit(127);
+	}
+	close(afdStdin[0]);
+	close(afdStdout[1]);
+	pProcess->pid = pid;
+	pProcess->fdStdin = afdStdin[1];
+	pProcess->fdStdout = afdStdout[0];
+	if (pid < 0) {
+		LOG_ERROR(logger, "Failed to start \"" << szCommand << "\", errno " << errno);
+		Kill(pProcess);
+		return NULL;
+	}
+#endif
+	return pProcess;
+}
+
+void SoftwareEncoder::Kill(Process *pProcess)
+{
+	if (!pProcess) {
+		return;
+	}
+	// Whatever the process still holds is not wanted; it is not waited for to finish
+#ifdef _WIN32
+	if (pProcess->hStdin) {
+		CloseHandle(pProcess->hStdin);
+	}
+	if (pProcess->hStdout) {
+		CloseHandle(pProcess->hStdout);
+	}
+	if (pProcess->hProcess) {
+		TerminateProcess(pProcess->hProcess, 0);
+		CloseHandle(pProcess->hProcess);
+	}
+#else
+	if (pProcess->fdStdin >= 0) {
+		close(pProcess->fdStdin);
+	}
+	if (pProcess->fdStdout >= 0) {
+		close(pProcess->fdStdout);
+	}
+	if (pProcess->pid > 0) {
+		kill(pProcess->pid, SIGKILL);
+		waitpid(pProcess->pid, NULL, 0);
+	}
+#endif
+	delete pProcess;
+}
+
+bool SoftwareEncoder::Switch()
+{
+	Process *pNext = pStandby;
+	pStandby = NULL;
+	if (pNext && (pNext->bitrate > bitrate * (1 + SW_BITRATE_SLACK) || pNext->bitrate < bitrate * (1 - SW_BITRATE_SLACK))) {
+		Kill(pNext);
+		pNext = NULL;
+	}
+	if (!pNext) {
+		pNext = Spawn(bitrate);
+	}
+	Kill(pActive);
+	pActive = pNext;
+	if (!pActive) {
+		return false;
+	}
+	pStandby = Spawn(bitrate);
+	stats.nSwitch++;
+	return true;
+}
+
+void SoftwareEncoder::SetBitrate(int bitrate)
+{
+	this->bitrate = bitrate;
+	// The standby is kept at the bitrate the next switch needs
+	if (pActive && pStandby && (pStandby->bitrate > bitrate * (1 + SW_BITRATE_SLACK) || pStandby->bitrate < bitrate * (1 - SW_BITRATE_SLACK))) {
+		Kill(pStandby);
+		pStandby = Spawn(bitrate);
+	}
+}
+
+bool SoftwareEncoder::Encode(const uint8_t *pFrame, bool bIdr, std::vector<uint8_t> &vAccessUnit)
+{
+	if (!pActive) {
+		return false;
+	}
+	// The first frame of a process is an IDR anyway
+	if (pActive->bEncoded && (bIdr || bitrate < pActive->bitrate * SW_BITRATE_DROP) && !Switch()) {
+		stats.nError++;
+		return false;
+	}
+	if (!Write(pActive, pFrame, (size_t)width * height * 3 / 2) || !ReadFrame(pActive, vAccessUnit)) {
+		LOG_ERROR(logger, "Software encoder process failed, the stream continues with an IDR");
+		stats.nError++;
+		Switch();
+		return false;
+	}
+	pActive->bEncoded = true;
+	stats.nFrame++;
+	return true;
+}
+
+bool SoftwareEncoder::Write(Process *pProcess, const uint8_t *pData, size_t cb)
+{
+	while (cb) {
+#ifdef _WIN32
+		DWORD cbWritten = 0;
+		if (!WriteFile(pProcess->hStdin, pData, (DWORD)cb, &cbWritten, NULL) || !cbWritten) {
+			return false;
+		}
+#else
+		ssize_t cbWritten = write(pProcess->fdStdin, pData, cb);
+		if (cbWritten < 0 && errno == EINTR) {
+			continue;
+		}
+		if (cbWritten <= 0) {
+			return false;
+		}
+#endif
+		pData += cbWritten;
+		cb -= cbWritten;
+	}
+	return true;
+}
+
+bool SoftwareEncoder::Read(Process *pProcess, uint8_t *pData, size_t cb)
+{
+	while (cb) {
+#ifdef _WIN32
+		DWORD cbRead = 0;
+		if (!ReadFile(pProcess->hStdout, pData, (DWORD)cb, &cbRead, NULL) || !cbRead) {
+			return false;
+		}
+#else
+		ssize_t cbRead = read(pProcess->fdStdout, pData, cb);
+		if (cbRead < 0 && errno == EINTR) {
+			continue;
+		}
+		if (cbRead <= 0) {
+			return false;
+		}
+#endif
+		pData += cbRead;
+		cb -= cbRead;
+	}
+	return true;
+}
+
+static uint32_t ReadBE(const uint8_t *p, int cb)
+{
+	uint32_t dw = 0;
+	for (int i = 0; i < cb; i++) {
+		dw = dw << 8 | p[i];
+	}
+	return dw;
+}
+
+static void AppendNal(std::vector<uint8_t> &v, const uint8_t *pNal, size_t cb)
+{
+	v.insert(v.end(), abStartCode, abStartCode + sizeof(abStartCode));
+	v.insert(v.end(), pNal, pNal + cb);
+}
+
+bool SoftwareEncoder::ReadFrame(Process *pProcess, std::vector<uint8_t> &vAccessUnit)
+{
+	uint8_t abHeader[15];
+	if (!pProcess->bHeaderRead) {
+		// File header and the size of the (absent) tag before the first one
+		if (!Read(pProcess, abHeader, 9) || memcmp(abHeader, "FLV", 3) || ReadBE(abHeader + 5, 4) < 9) {
+			return false;
+		}
+		uint32_t cbSkip = ReadBE(abHeader + 5, 4) - 9 + 4;
+		vTag.resize(cbSkip);
+		if (cbSkip && !Read(pProcess, vTag.data(), cbSkip)) {
+			return false;
+		}
+		pProcess->bHeaderRead = true;
+	}
+
+	for (;;) {
+		// Tag header, data and the size of the tag
+		if (!Read(pProcess, abHeader, 11)) {
+			return false;
+		}
+		uint32_t cbData = ReadBE(abHeader + 1, 3);
+		vTag.resize(cbData + 4);
+		if (!Read(pProcess, vTag.data(), vTag.size())) {
+			return false;
+		}
+		const uint8_t *p = vTag.data();
+		if ((abHeader[0] & 0x1F) != FLV_TAG_VIDEO || cbData < 5 || (p[0] & 0xF) != FLV_CODEC_AVC) {
+			continue;
+		}
+		bool bKey = p[0] >> 4 == FLV_FRAME_KEY;
+		const uint8_t *pEnd = p + cbData;
+		p += 5;
+
+		if (vTag[1] == FLV_AVC_SEQUENCE_HEADER) {
+			// AVCDecoderConfigurationRecord: the first SPS and PPS are all x264 writes
+			if (pEnd - p < 7) {
+				return false;
+			}
+			pProcess->nLengthSize = (p[4] & 3) + 1;
+			int nSps = p[5] & 0x1F;
+			p += 6;
+			for (int i = 0; i < nSps && pEnd - p >= 2; i++) {
+				uint32_t cb = ReadBE(p, 2);
+				if (pEnd - p - 2 < (ptrdiff_t)cb) {
+					return false;
+				}
+				if (i == 0) {
+					pProcess->vSps.assign(p + 2, p + 2 + cb);
+				}
+				p += 2 + cb;
+			}
+			int nPps = p < pEnd ? *p++ : 0;
+			for (int i = 0; i < nPps && pEnd - p >= 2; i++) {
+				uint32_t cb = ReadBE(p, 2);
+				if (pEnd - p - 2 < (ptrdiff_t)cb) {
+					return false;
+				}
+				if (i == 0) {
+					pProcess->vPps.assign(p + 2, p + 2 + cb);
+				}
+				p += 2 + cb;
+			}
+			continue;
+		}
+		if (vTag[1] != FLV_AVC_NALU) {
+			continue;
+		}
+
+		// Like NVENC's, every IDR carries the parameter sets, so a viewer can start there
+		vAccessUnit.clear();
+		bool bParameterSets = false;
+		for (const uint8_t *q = p; pEnd - q > pProcess->nLengthSize;) {
+			uint32_t cb = ReadBE(q, pProcess->nLengthSize);
+			q += pProcess->nLengthSize;
+			if (pEnd - q < (ptrdiff_t)cb) {
+				break;
+			}
+			bParameterSets = bParameterSets || (cb && (*q & 0x1F) == 7);
+			q += cb;
+		}
+		if (bKey && !bParameterSets && pProcess->vSps.size() && pProcess->vPps.size()) {
+			AppendNal(vAccessUnit, pProcess->vSps.data(), pProcess->vSps.size());
+			AppendNal(vAccessUnit, pProcess->vPps.data(), pProcess->vPps.size());
+		}
+		while (pEnd - p > pProcess->nLengthSize) {
+			uint32_t cb = ReadBE(p, pProcess->nLengthSize);
+			p += pProcess->nLengthSize;
+			if (pEnd - p < (ptrdiff_t)cb) {
+				return false;
+			}
+			AppendNal(vAccessUnit, p, cb);
+			p += cb;
+		}
+		return true;
+	}
+}
+
+SoftwareEncoder::Stats SoftwareEncoder::TakeStats()
+{
+	Stats s = stats;
+	memset(&stats, 0, sizeof(stats));
+	return s;
+}
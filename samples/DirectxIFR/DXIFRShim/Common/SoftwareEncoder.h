@@ -0,0 +1,135 @@
+/*!
+ * \brief
+ * CPU H.264 encoder for players that find no free NVENC session
+ *
+ * \file
+ *
+ * Consumer boards and some GRID profiles limit the number of concurrent
+ * NVENC sessions. A player that starts when all of them are taken spills
+ * to a software encoder instead of getting no stream: CNvEncoder feeds it
+ * the same I420 frames and writes its access units to the same output,
+ * so the viewer sees one continuous H.264 stream, and GpuScheduler moves
+ * the player back to a GPU once a session frees.
+ *
+ * The encoder is libx264 in an ffmpeg process, the tool the shim already
+ * streams through. Frames go in on its stdin as raw video; the stream comes
+ * back on its stdout as FLV, whose tags carry the length of every frame, so
+ * a frame is complete as soon as its tag is. Encode() waits for that, like
+ * a synchronous NVENC session. zerolatency makes x264 return every frame
+ * before it takes the next one.
+ *
+ * ffmpeg cannot change the parameters of a running encoder. An IDR, and a
+ * bitrate that has to drop at once, switch to a second process that was
+ * started beforehand and has not encoded yet, whose first frame is an IDR
+ * by construction; the old process is killed and a new standby started.
+ * Smaller bitrate changes wait for the next switch.
+ *
+ * All software encoders together use at most the thread budget of
+ * SetThreadBudget() (by default a quarter of the CPUs), so that they do not
+ * starve the game. A player that does not get a thread is refused. The
+ * processes run below normal priority, on the encoder CPUs of Placement
+ * when a policy confines the encoders.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+typedef unsigned long long ULONGLONG;
+#endif
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+// Pixels one encoder thread is given; 1280x720 gets 2 threads
+#define SW_PIXELS_PER_THREAD (960 * 540)
+#define SW_MAX_THREADS 4
+// A bitrate below this fraction of the running one switches processes at once
+#define SW_BITRATE_DROP 0.75
+// The standby process is restarted when the bitrate moved further than this from its own
+#define SW_BITRATE_SLACK 0.1
+
+class SoftwareEncoder
+{
+public:
+	struct Stats {
+		unsigned int nFrame;
+		// Switches to the standby process, for IDRs and bitrate drops
+		unsigned int nSwitch;
+		unsigned int nError;
+	};
+
+	SoftwareEncoder();
+	~SoftwareEncoder();
+
+	// Threads all software encoders may use together; 0 restores the default
+	static void SetThreadBudget(int nThread);
+	static int GetThreadsInUse();
+
+	/*! Reserves threads from the budget and starts the encoder for I420 frames of
+	    width x height. False if the budget is used up or ffmpeg cannot be started. */
+	bool Open(int width, int height, int fps, int bitrate, int vbvFrames);
+	void Close();
+	bool IsOpen()
+	{
+		return pActive != NULL;
+	}
+
+	/*! Encodes one frame and returns its access unit in Annex-B, with SPS and PPS
+	    in front of an IDR. bIdr makes it an IDR. */
+	bool Encode(const uint8_t *pFrame, bool bIdr, std::vector<uint8_t> &vAccessUnit);
+	// Takes effect at the next IDR, or with the next frame if it is a large drop
+	void SetBitrate(int bitrate);
+
+	int GetThreadCount()
+	{
+		return nThread;
+	}
+	Stats TakeStats();
+
+private:
+	struct Process {
+		int bitrate;
+		bool bHeaderRead;
+		bool bEncoded;
+		// Bytes of the NAL unit lengths in the FLV frames
+		int nLengthSize;
+		std::vector<uint8_t> vSps, vPps;
+#ifdef _WIN32
+		HANDLE hProcess;
+		HANDLE hStdin, hStdout;
+#else
+		pid_t pid;
+		int fdStdin, fdStdout;
+#endif
+	};
+
+	Process *Spawn(int bitrate);
+	void Kill(Process *pProcess);
+	// Replaces the active process with the standby and starts a new standby
+	bool Switch();
+	bool Write(Process *pProcess, const uint8_t *pData, size_t cb);
+	bool Read(Process *pProcess, uint8_t *pData, size_t cb);
+	// Reads FLV tags up to the next video frame and converts it to Annex-B
+	bool ReadFrame(Process *pProcess, std::vector<uint8_t> &vAccessUnit);
+
+	static std::mutex mtxBudget;
+	static int nThreadBudget;
+	static int nThreadInUse;
+
+	int width, height, fps, vbvFrames;
+	int nThread;
+	int bitrate;
+	Process *pActive;
+	Process *pStandby;
+	std::vector<uint8_t> vTag;
+	Stats stats;
+};
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "Streamer.h"
+#include "SinkQueue.h"
+#include "Metrics.h"
 #include <vector>
 
 extern simplelogger::Logger *logger;
@@ -40,12 +42,28 @@ public:
 			{
 				LOG_ERROR(logger, "Failed to create FFMPEG Pipe");
 			}
+
+			// A slow ffmpeg must not hold up the capture; up to four raw frames wait in the queue
+			FILE *fPipe = PipeList[i];
+			SinkList.push_back(new SinkQueue(i, (size_t)width * height * 3 / 2 * 4));
+			MetricsList.push_back(Metrics::GetShared()->GetPlayer(i));
+			if (fPipe)
+			{
+				SinkList[i]->Start([fPipe](const uint8_t *pData, size_t cb)
+				{
+					return fwrite(pData, cb, 1, fPipe) == 1;
+				});
+			}
 		}
 		
 		
 	}
 	~StreamerFile()
 	{
+		for (int i = 0; i < SinkList.size(); ++i)
+		{
+			delete SinkList[i];
+		}
 		for (int i = 0; i < PipeList.size(); ++i)
 		{
 			if (PipeList[i])
@@ -60,8 +78,15 @@ public:
 		{
 			return FALSE;
 		}
-		fwrite(pData, nBytes, 1, PipeList[bufferIndex]);
-
+		PlayerMetrics *pMetrics = MetricsList[bufferIndex];
+		pMetrics->pStreamFrame->Add();
+		pMetrics->pStreamBytes->Add(nBytes);
+		// Raw frames do not depend on each other, so any of them can be dropped alone
+		if (!SinkList[bufferIndex]->Push(pData, nBytes, SINK_FRAME_NON_REFERENCE))
+		{
+			pMetrics->pStreamDropped->Add();
+			return FALSE;
+		}
 		return TRUE;
 	}
 	BOOL IsReady() 
@@ -78,4 +103,6 @@ public:
 
 private:
 	std::vector<FILE*> PipeList;
+	std::vector<SinkQueue*> SinkList;
+	std::vector<PlayerMetrics*> MetricsList;
 };
@@ -0,0 +1,271 @@
+/*!
+ * \brief
+ * The implementation of TaskPool
+ *
+ * \file
+ *
+ * Each worker sleeps on its own condition variable. A submitted task wakes
+ * the worker it was queued on and, if that one is busy, one idle worker so
+ * the task can be stolen right away. Pinned tasks only ever wake their own
+ * worker.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include "TaskPool.h"
+
+#ifdef _WIN32
+#define TASK_POOL_TLS __declspec(thread)
+#else
+#define TASK_POOL_TLS __thread
+#endif
+
+static TASK_POOL_TLS TaskPool *tlsPool = NULL;
+static TASK_POOL_TLS int tlsWorker = TaskPool::ANY_WORKER;
+
+TaskPool::TaskPool(int nWorkers) : bShutdown(false), nIdle(0), iNextWorker(0), seqTimer(0)
+{
+	if (nWorkers <= 0) {
+		nWorkers = (int)std::thread::hardware_concurrency();
+		if (nWorkers <= 0) {
+			nWorkers = 2;
+		}
+	}
+	for (int i = 0; i < nWorkers; i++) {
+		Worker *pWorker = new Worker;
+		pWorker->bIdle = false;
+		vpWorker.push_back(pWorker);
+	}
+	for (int i = 0; i < nWorkers; i++) {
+		vpWorker[i]->th = std::thread(&TaskPool::WorkerProc, this, i);
+	}
+	thTimer = std::thread(&TaskPool::TimerProc, this);
+}
+
+TaskPool::~TaskPool()
+{
+	bShutdown = true;
+	{
+		std::lock_guard<std::mutex> lock(mtxTimer);
+		cvTimer.notify_all();
+	}
+	thTimer.join();
+	for (size_t i = 0; i < vpWorker.size(); i++) {
+		{
+			std::lock_guard<std::mutex> lock(vpWorker[i]->mtx);
+			vpWorker[i]->cv.notify_all();
+		}
+		vpWorker[i]->th.join();
+		delete vpWorker[i];
+	}
+}
+
+TaskPool *TaskPool::GetShared()
+{
+	static std::once_flag once;
+	static TaskPool *pPool = NULL;
+	std::call_once(once, [] { pPool = new TaskPool(); });
+	return pPool;
+}
+
+int TaskPool::GetCurrentWorker()
+{
+	return tlsPool == this ? tlsWorker : ANY_WORKER;
+}
+
+int TaskPool::PickWorker(int iAffinity)
+{
+	int n = (int)vpWorker.size();
+	if (iAffinity >= 0) {
+		return iAffinity % n;
+	}
+	// Work spawned by a worker stays local; outside submissions are spread round-robin
+	int iCurrent = GetCurrentWorker();
+	if (iCurrent != ANY_WORKER) {
+		return iCurrent;
+	}
+	return (int)(iNextWorker.fetch_add(1, std::memory_order_relaxed) % n);
+}
+
+void TaskPool::Submit(Task task, int iAffinity, bool bPinned)
+{
+	int iWorker = PickWorker(iAffinity);
+	Worker *pWorker = vpWorker[iWorker];
+	bool bWasIdle;
+	{
+		std::lock_guard<std::mutex> lock(pWorker->mtx);
+		if (bPinned) {
+			pWorker->dqPinned.push_back(task);
+		} else {
+			pWorker->dqTask.push_back(task);
+		}
+		bWasIdle = pWorker->bIdle;
+		pWorker->cv.notify_one();
+	}
+	if (!bPinned && !bWasIdle) {
+		WakeIdle(iWorker);
+	}
+}
+
+void TaskPool::SubmitAt(Task task, Clock::time_point tDue, int iAffinity, bool bPinned)
+{
+	std::lock_guard<std::mutex> lock(mtxTimer);
+	TimedTask tt = {tDue, seqTimer++, task, iAffinity, bPinned};
+	bool bEarliest = pqTimer.empty() || tDue < pqTimer.top().tDue;
+	pqTimer.push(tt);
+	if (bEarliest) {
+		cvTimer.notify_one();
+	}
+}
+
+void TaskPool::WakeIdle(int iExcept)
+{
+	if (nIdle.load(std::memory_order_acquire) == 0) {
+		return;
+	}
+	for (size_t i = 0; i < vpWorker.size(); i++) {
+		if ((int)i == iExcept) {
+			continue;
+		}
+		std::lock_guard<std::mutex> lock(vpWorker[i]->mtx);
+		if (vpWorker[i]->bIdle) {
+			vpWorker[i]->cv.notify_one();
+			return;
+		}
+	}
+}
+
+bool TaskPool::PopLocal(int iWorker, Task &task)
+{
+	Worker *pWorker = vpWorker[iWorker];
+	std::lock_guard<std::mutex> lock(pWorker->mtx);
+	if (!pWorker->dqPinned.empty()) {
+		task = pWorker->dqPinned.front();
+		pWorker->dqPinned.pop_front();
+		return true;
+	}
+	if (!pWorker->dqTask.empty()) {
+		task = pWorker->dqTask.back();
+		pWorker->dqTask.pop_back();
+		return true;
+	}
+	return false;
+}
+
+bool TaskPool::Steal(int iThief, Task &task)
+{
+	int n = (int)vpWorker.size();
+	for (int k = 1; k < n; k++) {
+		Worker *pVictim = vpWorker[(iThief + k) % n];
+		std::unique_lock<std::mutex> lock(pVictim->mtx, std::try_to_lock);
+		if (lock.owns_lock() && !pVictim->dqTask.empty()) {
+			task = pVictim->dqTask.front();
+			pVictim->dqTask.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void TaskPool::WorkerProc(int iWorker)
+{
+	tlsPool = this;
+	tlsWorker = iWorker;
+	Worker *pWorker = vpWorker[iWorker];
+	while (!bShutdown) {
+		Task task;
+		if (PopLocal(iWorker, task) || Steal(iWorker, task)) {
+			task();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(pWorker->mtx);
+		if (!pWorker->dqPinned.empty() || !pWorker->dqTask.empty() || bShutdown) {
+			continue;
+		}
+		pWorker->bIdle = true;
+		nIdle.fetch_add(1, std::memory_order_release);
+		// The timeout bounds the delay of a steal whose wakeup went to a busy worker
+		pWorker->cv.wait_for(lock, std::chrono::milliseconds(10));
+		nIdle.fetch_sub(1, std::memory_order_release);
+		pWorker->bIdle = false;
+	}
+}
+
+void TaskPool::TimerProc()
+{
+	std::unique_lock<std::mutex> lock(mtxTimer);
+	while (!bShutdown) {
+		if (pqTimer.empty()) {
+			cvTimer.wait(lock);
+			continue;
+		}
+		Clock::time_point tDue = pqTimer.top().tDue;
+		if (Clock::now() < tDue) {
+			cvTimer.wait_until(lock, tDue);
+			continue;
+		}
+		TimedTask tt = pqTimer.top();
+		pqTimer.pop();
+		lock.unlock();
+		Submit(tt.task, tt.iAffinity, tt.bPinned);
+		lock.lock();
+	}
+}
+
+#ifdef _WIN32
+namespace {
+
+struct EventWait {
+	TaskPool *pPool;
+	std::function<void(BOOL)> task;
+	int iAffinity;
+	bool bPinned;
+	HANDLE hWait;
+	// Whoever of the registering thread and the callback comes second releases the wait
+	std::atomic<int> nRef;
+};
+
+void ReleaseEventWait(EventWait *pWait)
+{
+	if (pWait->nRef.fetch_sub(1) == 1) {
+		UnregisterWaitEx(pWait->hWait, NULL);
+		delete pWait;
+	}
+}
+
+VOID CALLBACK EventWaitCallback(PVOID pParam, BOOLEAN bTimedOut)
+{
+	EventWait *pWait = (EventWait *)pParam;
+	std::function<void(BOOL)> task = pWait->task;
+	BOOL b = bTimedOut;
+	pWait->pPool->Submit([task, b] { task(b); }, pWait->iAffinity, pWait->bPinned);
+	ReleaseEventWait(pWait);
+}
+
+}
+
+void TaskPool::SubmitOnEvent(HANDLE hEvent, std::function<void(BOOL bTimedOut)> task, DWORD msTimeout,
+	int iAffinity, bool bPinned)
+{
+	EventWait *pWait = new EventWait;
+	pWait->pPool = this;
+	pWait->task = task;
+	pWait->iAffinity = iAffinity;
+	pWait->bPinned = bPinned;
+	pWait->hWait = NULL;
+	pWait->nRef = 2;
+	if (!RegisterWaitForSingleObject(&pWait->hWait, hEvent, EventWaitCallback, pWait, msTimeout,
+		WT_EXECUTEONLYONCE | WT_EXECUTEINWAITTHREAD)) {
+		delete pWait;
+		// Fall back to running the task as if it had timed out
+		Submit([task] { task(TRUE); }, iAffinity, bPinned);
+		return;
+	}
+	ReleaseEventWait(pWait);
+}
+#endif
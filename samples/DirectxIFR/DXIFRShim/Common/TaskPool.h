@@ -0,0 +1,121 @@
+/*!
+ * \brief
+ * Work-stealing task pool shared by all encoders of the process
+ *
+ * \file
+ *
+ * Instead of one OS thread per player that sleeps most of the frame, each
+ * encoder submits its per-frame work as short tasks. Every worker owns a
+ * deque: it pops its own work LIFO and, when empty, steals FIFO from the
+ * others. Tasks may carry an affinity hint (preferred worker) and may be
+ * pinned, in which case they are never stolen; this is what keeps
+ * thread-affine work such as window creation and destruction on one thread.
+ *
+ * Timed tasks (frame ticks) are kept in a deadline heap serviced by one
+ * timer thread, and on Windows a task can be armed on a kernel event so
+ * that GPU completion waits do not occupy a worker.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class TaskPool
+{
+public:
+	typedef std::function<void()> Task;
+	typedef std::chrono::steady_clock Clock;
+
+	enum {
+		ANY_WORKER = -1,
+	};
+
+	// nWorkers == 0 uses one worker per logical processor
+	TaskPool(int nWorkers = 0);
+	~TaskPool();
+
+	// The process-wide pool. It is never destroyed: joining threads from a
+	// DLL's static destructors would deadlock on the loader lock.
+	static TaskPool *GetShared();
+
+	int GetWorkerCount()
+	{
+		return (int)vpWorker.size();
+	}
+
+	/*! Queues a task. iAffinity is a preferred worker (taken modulo the worker
+	    count); a pinned task always runs on that worker and is never stolen. */
+	void Submit(Task task, int iAffinity = ANY_WORKER, bool bPinned = false);
+	// Queues a task once the deadline has passed
+	void SubmitAt(Task task, Clock::time_point tDue, int iAffinity = ANY_WORKER, bool bPinned = false);
+	void SubmitAfter(Task task, unsigned int msDelay, int iAffinity = ANY_WORKER, bool bPinned = false)
+	{
+		SubmitAt(task, Clock::now() + std::chrono::milliseconds(msDelay), iAffinity, bPinned);
+	}
+#ifdef _WIN32
+	/*! Queues task once hEvent is signaled or msTimeout elapses; the argument
+	    tells which of the two happened. No worker blocks while waiting. */
+	void SubmitOnEvent(HANDLE hEvent, std::function<void(BOOL bTimedOut)> task, DWORD msTimeout = INFINITE,
+		int iAffinity = ANY_WORKER, bool bPinned = false);
+#endif
+
+	// Index of the calling worker, or ANY_WORKER if called from outside the pool
+	int GetCurrentWorker();
+
+private:
+	struct Worker {
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::deque<Task> dqTask;	// Stealable: owner pops back, thieves pop front
+		std::deque<Task> dqPinned;	// Runs only on this worker
+		bool bIdle;
+		std::thread th;
+	};
+	struct TimedTask {
+		Clock::time_point tDue;
+		unsigned long long seq;
+		Task task;
+		int iAffinity;
+		bool bPinned;
+		bool operator<(const TimedTask &other) const
+		{
+			// Reversed for a min-heap, FIFO among equal deadlines
+			return tDue != other.tDue ? tDue > other.tDue : seq > other.seq;
+		}
+	};
+
+	void WorkerProc(int iWorker);
+	void TimerProc();
+	bool PopLocal(int iWorker, Task &task);
+	bool Steal(int iThief, Task &task);
+	void WakeIdle(int iExcept);
+	int PickWorker(int iAffinity);
+
+	std::vector<Worker *> vpWorker;
+	std::atomic<bool> bShutdown;
+	std::atomic<int> nIdle;
+	std::atomic<unsigned int> iNextWorker;
+
+	std::mutex mtxTimer;
+	std::condition_variable cvTimer;
+	std::priority_queue<TimedTask> pqTimer;
+	unsigned long long seqTimer;
+	std::thread thTimer;
+};
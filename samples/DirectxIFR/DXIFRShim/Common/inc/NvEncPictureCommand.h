@@ -0,0 +1,35 @@
+/*
+ * Copyright 1993-2015 NVIDIA Corporation.  All rights reserved.
+ *
+ * Please refer to the NVIDIA end user license agreement (EULA) associated
+ * with this source code for terms and conditions that govern your use of
+ * this software. Any use, reproduction, disclosure, or distribution of
+ * this software and related documentation outside the terms of the EULA
+ * is strictly prohibited.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// The per-frame commands of CNvHWEncoder::EncodeFrame, apart so that their producers need not see the encoder
+typedef struct _NvEncPictureCommand
+{
+    bool bResolutionChangePending;
+    bool bBitrateChangePending;
+    bool bForceIDR;
+    bool bForceIntraRefresh;
+    bool bInvalidateRefFrames;
+
+    uint32_t newWidth;
+    uint32_t newHeight;
+
+    uint32_t newBitrate;
+    uint32_t newVBVSize;
+
+    uint32_t  intraRefreshDuration;
+
+    uint32_t  numRefFramesToInvalidate;
+    uint32_t  refFrameNumbers[16];
+}NvEncPictureCommand;
@@ -9,6 +9,8 @@
  *
  */
 
+#pragma once
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
@@ -17,6 +19,14 @@
 
 #include "nvEncodeAPI.h"
 #include "nvUtils.h"
+#include "NvEncPictureCommand.h"
+#include "NalIndex.h"
+#include "SliceReadout.h"
+#include "SinkGraph.h"
+#include "SinkPluginHost.h"
+#include "FecSender.h"
+#include "Metrics.h"
+#include "MotionExport.h"
 
 #define SET_VER(configStruct, type) {configStruct.version = type##_VER;}
 
@@ -58,6 +68,17 @@ typedef struct _EncodeConfig
     int              intraRefreshEnableFlag;
     int              intraRefreshPeriod;
     int              intraRefreshDuration;
+    int              sliceMode;
+    int              sliceModeData;
+    int              vbvFrames;
+    int              subFrameReadout;
+    char            *udpDest;
+    int              fecMode;
+    int              fecK;
+    int              fecM;
+    int              portOffset;
+    char            *recordFile;
+    char            *sinkPlugin;
     int              deviceType;
     int              startFrameIdx;
     int              endFrameIdx;
@@ -65,6 +86,8 @@ typedef struct _EncodeConfig
     int              numB;
     int              pictureStruct;
     int              deviceID;
+    int              gpuSessions;
+    int              cpuThreads;
     int              isYuv444;
     char            *qpDeltaMapFile;
     char* inputFileName;
@@ -107,26 +130,6 @@ typedef struct _EncodeBuffer
     EncodeInputBuffer       stInputBfr;
 }EncodeBuffer;
 
-typedef struct _NvEncPictureCommand
-{
-    bool bResolutionChangePending;
-    bool bBitrateChangePending;
-    bool bForceIDR;
-    bool bForceIntraRefresh;
-    bool bInvalidateRefFrames;
-
-    uint32_t newWidth;
-    uint32_t newHeight;
-
-    uint32_t newBitrate;
-    uint32_t newVBVSize;
-
-    uint32_t  intraRefreshDuration;
-
-    uint32_t  numRefFramesToInvalidate;
-    uint32_t  refFrameNumbers[16];
-}NvEncPictureCommand;
-
 enum
 {
     NV_ENC_H264 = 0,
@@ -149,6 +152,15 @@ public:
     uint32_t                                             m_EncodeIdx;
     //FILE                                                *m_fOutput;
     FILE                                                *m_fOutputArray[4];
+    NalIndex                                             m_NalIndexArray[4];
+    SliceReadout                                         m_SliceReadoutArray[4];
+    // Declared before the sink graphs so they outlive their writer threads
+    FecSender                                            m_FecSenderArray[4];
+    SinkPluginHost                                       m_SinkPlugin;
+    // The player's output and, with -record or -sinkPlugin, the other sinks of the same packets
+    SinkGraph                                            m_SinkGraphArray[4];
+    // ME-only mode: packs the vectors of each frame for the output and keeps the frame's summary
+    MotionExport                                         m_MotionExportArray[4];
     uint32_t                                             m_uMaxWidth;
     uint32_t                                             m_uMaxHeight;
     uint32_t                                             m_uCurWidth;
@@ -158,11 +170,20 @@ protected:
     bool                                                 m_bEncoderInitialized;
     GUID                                                 codecGUID;
 
+    // Owned by EncoderRuntime
     NV_ENCODE_API_FUNCTION_LIST*                         m_pEncodeAPI;
-    HINSTANCE                                            m_hinstLib;
     void                                                *m_hEncoder;
     NV_ENC_INITIALIZE_PARAMS                             m_stCreateEncodeParams;
     NV_ENC_CONFIG                                        m_stEncodeConfig;
+    bool                                                 m_bSubFrameReadout;
+    bool                                                 m_bOutputOpen;
+    uint32_t                                             m_uSliceCount;
+    std::vector<uint32_t>                                m_vSliceOffset;
+    // Classifies the first chunk of a frame in sub-frame mode, before the whole frame is indexed
+    NalIndex                                             m_FirstChunkIndex;
+    std::vector<uint8_t>                                 m_vMotionRecord;
+    PlayerMetrics                                       *m_pMetricsArray[4];
+    int                                                  m_iRendition;
 
 public:
     NVENCSTATUS NvEncOpenEncodeSession(void* device, uint32_t deviceType);
@@ -182,7 +203,8 @@ public:
     NVENCSTATUS NvEncDestroyBitstreamBuffer(NV_ENC_OUTPUT_PTR bitstreamBuffer);
     NVENCSTATUS NvEncCreateMVBuffer(uint32_t size, void** bitstreamBuffer);
     NVENCSTATUS NvEncDestroyMVBuffer(NV_ENC_OUTPUT_PTR bitstreamBuffer);
-    NVENCSTATUS NvRunMotionEstimationOnly(EncodeBuffer *pEncodeBuffer[2], MEOnlyConfig *pMEOnly);
+    // Estimates the motion of pEncodeBuffer[1] against pEncodeBuffer[0] and writes the vectors to the player's output
+    NVENCSTATUS NvRunMotionEstimationOnly(EncodeBuffer *pEncodeBuffer[2], MEOnlyConfig *pMEOnly, int index);
     NVENCSTATUS NvEncLockBitstream(NV_ENC_LOCK_BITSTREAM* lockBitstreamBufferParams);
     NVENCSTATUS NvEncUnlockBitstream(NV_ENC_OUTPUT_PTR bitstreamBuffer);
     NVENCSTATUS NvEncLockInputBuffer(void* inputBuffer, void** bufferDataPtr, uint32_t* pitch);
@@ -201,21 +223,39 @@ public:
     NVENCSTATUS NvEncReconfigureEncoder(const NvEncPictureCommand *pEncPicCommand);
     NVENCSTATUS NvEncFlushEncoderQueue(void *hEOSEvent);
 
-    CNvHWEncoder(int index);
+    CNvHWEncoder(int index, int iRendition = 0);
     virtual ~CNvHWEncoder();
-    NVENCSTATUS                                          Initialize(void* device, NV_ENC_DEVICE_TYPE deviceType);
+    // hSession is an encode session already opened on device, see EncoderRuntime::AcquireSession()
+    NVENCSTATUS                                          Initialize(void* device, NV_ENC_DEVICE_TYPE deviceType, void *hSession = NULL);
     NVENCSTATUS                                          Deinitialize();
     NVENCSTATUS                                          NvEncEncodeFrame(EncodeBuffer *pEncodeBuffer, NvEncPictureCommand *encPicCommand,
                                                                           uint32_t width, uint32_t height,
                                                                           NV_ENC_PIC_STRUCT ePicStruct = NV_ENC_PIC_STRUCT_FRAME,
                                                                           int8_t *qpDeltaMapArray = NULL, uint32_t qpDeltaMapArraySize = 0);
+    // Opens the output first unless OpenOutput() did
     NVENCSTATUS                                          CreateEncoder(const EncodeConfig *pEncCfg, int index);
+    // Starts the player's output (ffmpeg, UDP or, in ME-only mode, a file) and its sink queue, once
+    NVENCSTATUS                                          OpenOutput(const EncodeConfig *pEncCfg, int index);
+    // Writes an access unit encoded elsewhere (SoftwareEncoder) to the output, like ProcessOutput()
+    NVENCSTATUS                                          WriteOutput(const uint8_t *pData, uint32_t cb, int index);
+    // Continues on hSession, opened on another device, with the parameters the encoder has now; the output stays.
+    // The previous encoder is left initialized for the caller to destroy, or to go back to with RestoreEncoder()
+    NVENCSTATUS                                          MoveEncoder(void *hSession, void **phPrevious);
+    // Destroys the encoder MoveEncoder() moved to and continues on hPrevious
+    NVENCSTATUS                                          RestoreEncoder(void *hPrevious);
     GUID                                                 GetPresetGUID(char* encoderPreset, int codec);
     NVENCSTATUS                                          ProcessOutput(const EncodeBuffer *pEncodeBuffer, int index);
     NVENCSTATUS                                          FlushEncoder();
     NVENCSTATUS                                          ValidateEncodeGUID(GUID inputCodecGuid);
     NVENCSTATUS                                          ValidatePresetGUID(GUID presetCodecGuid, GUID inputCodecGuid);
+    NVENCSTATUS                                          ValidateLowLatencyConfig(GUID inputCodecGuid, EncodeConfig *pEncCfg);
+    int                                                  GetEncodeCap(GUID inputCodecGuid, NV_ENC_CAPS capsToQuery);
+    bool                                                 IsSubFrameReadout() { return m_bSubFrameReadout; }
+    bool                                                 IsEncoderInitialized() { return m_bEncoderInitialized; }
     static NVENCSTATUS                                   ParseArguments(EncodeConfig *encodeConfig, int argc, char *argv[]);
+
+protected:
+    NVENCSTATUS                                          ProcessSubFrameOutput(const EncodeBuffer *pEncodeBuffer, int index);
 };
 
 typedef NVENCSTATUS (NVENCAPI *MYPROC)(NV_ENCODE_API_FUNCTION_LIST*); 
@@ -1676,6 +1676,8 @@ extern tcuGraphicsResourceGetMappedPointer   *cuGraphicsResourceGetMappedPointer
 
 /************************************/
 CUresult CUDAAPI cuInit   (unsigned int, int cudaVersion, void *hHandleDriver);
+/* Loads szDriverLibrary instead of the CUDA driver on the next cuInit(), e.g. a stub driver */
+void CUDAAPI cuSetDriverLibrary(const char *szDriverLibrary);
 /************************************/
 
 #ifdef __cplusplus
@@ -10,6 +10,8 @@
  */
 
 #include "../inc/NvHWEncoder.h"
+#include "../EncoderRuntime.h"
+#include "../PlayerOutput.h"
 
 #include <iostream>
 #include <fstream>
@@ -17,10 +19,6 @@
 
 std::ofstream NvHWEncoderLogFile;
 
-// Host IP address
-const std::string streamingIP = "http://magam001.d1.comp.nus.edu.sg:";
-const int firstPort = 30000;
-
 NVENCSTATUS CNvHWEncoder::NvEncOpenEncodeSession(void* device, uint32_t deviceType)
 {
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
@@ -279,10 +277,11 @@ NVENCSTATUS CNvHWEncoder::NvEncDestroyMVBuffer(NV_ENC_OUTPUT_PTR bitstreamBuffer
     return status;
 }
 
-NVENCSTATUS CNvHWEncoder::NvRunMotionEstimationOnly(EncodeBuffer *pEncodeBuffer[2], MEOnlyConfig *pMEOnly)
+NVENCSTATUS CNvHWEncoder::NvRunMotionEstimationOnly(EncodeBuffer *pEncodeBuffer[2], MEOnlyConfig *pMEOnly, int index)
 {
     NVENCSTATUS nvStatus;
     NV_ENC_MEONLY_PARAMS stMEOnlyParams;
+    memset(&stMEOnlyParams, 0, sizeof(stMEOnlyParams));
     SET_VER(stMEOnlyParams,NV_ENC_MEONLY_PARAMS);
     stMEOnlyParams.referenceFrame = pEncodeBuffer[0]->stInputBfr.hInputSurface;
     stMEOnlyParams.inputBuffer = pEncodeBuffer[1]->stInputBfr.hInputSurface;
@@ -291,20 +290,27 @@ NVENCSTATUS CNvHWEncoder::NvRunMotionEstimationOnly(EncodeBuffer *pEncodeBuffer[
     stMEOnlyParams.inputHeight = pEncodeBuffer[1]->stInputBfr.dwHeight;
     stMEOnlyParams.outputMV = pEncodeBuffer[0]->stOutputBfr.hBitstreamBuffer;
     nvStatus = m_pEncodeAPI->nvEncRunMotionEstimationOnly(m_hEncoder, &stMEOnlyParams);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
+        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncRunMotionEstimationOnly\n";
+        NvHWEncoderLogFile.close();
+        return nvStatus;
+    }
 
-    if (m_fOutputArray[0])
+    // Packed and summarized in binary, see MotionExport; printing every macroblock took longer than the frame
+    uint64_t qwStartUs = Metrics::NowUs();
+    NV_ENC_H264_MV_DATA *outputMV = (NV_ENC_H264_MV_DATA *)stMEOnlyParams.outputMV;
+    m_MotionExportArray[index].AddFrame(outputMV, (stMEOnlyParams.inputWidth + 15) >> 4, (stMEOnlyParams.inputHeight + 15) >> 4,
+        pMEOnly->inputFrameIndex, pMEOnly->referenceFrameIndex, m_vMotionRecord);
+    PlayerMetrics *pMetrics = m_pMetricsArray[index];
+    pMetrics->pMotionUs->Record(Metrics::NowUs() - qwStartUs);
+    pMetrics->pMotionActivity->Set((int64_t)(MotionGetActivity(m_MotionExportArray[index].GetSummary()) * 1000));
+    pMetrics->pFrameEncoded->Add();
+    // Every frame stands alone, so a dropped one costs nothing else
+    if (!m_SinkGraphArray[index].Push(m_vMotionRecord.data(), m_vMotionRecord.size(), SINK_FRAME_NON_REFERENCE))
     {
-        unsigned int numMBs = ((m_uMaxWidth +15) >> 4) * ((m_uMaxHeight + 15) >> 4);
-        fprintf(m_fOutputArray[0], "Motion Vectors for input frame = %d, reference frame = %d\n", pMEOnly->inputFrameIndex, pMEOnly->referenceFrameIndex);
-        NV_ENC_H264_MV_DATA *outputMV = (NV_ENC_H264_MV_DATA *)stMEOnlyParams.outputMV;
-        for (unsigned int i = 0; i < numMBs; i++)
-        {
-            fprintf(m_fOutputArray[0], "block = %d, mb_type = %d, partitionType = %d, MV[0].x = %d, MV[0].y = %d, MV[1].x = %d, MV[1].y = %d, MV[2].x = %d, MV[2].y = %d, MV[3].x = %d, MV[3].y = %d, cost=%d ", \
-                i, outputMV[i].mb_type, outputMV[i].partitionType, outputMV[i].MV[0].mvx, outputMV[i].MV[0].mvy, outputMV[i].MV[1].mvx, outputMV[i].MV[1].mvy, \
-                outputMV[i].MV[2].mvx, outputMV[i].MV[2].mvy, outputMV[i].MV[3].mvx, outputMV[i].MV[3].mvy, outputMV[i].MBCost);
-            fprintf(m_fOutputArray[0], "\n");
-        }
-        fprintf(m_fOutputArray[0], "\n");
+        pMetrics->pSinkDropped->Add();
     }
     return nvStatus;
 }
@@ -698,18 +704,28 @@ NVENCSTATUS CNvHWEncoder::NvEncReconfigureEncoder(const NvEncPictureCommand *pEn
     return nvStatus;
 }
 
-CNvHWEncoder::CNvHWEncoder(int index)
+CNvHWEncoder::CNvHWEncoder(int index, int iRendition)
 {
     m_hEncoder = NULL;
     m_bEncoderInitialized = false;
     m_pEncodeAPI = NULL;
-    m_hinstLib = NULL;
     m_fOutputArray[index] = NULL;
+    m_pMetricsArray[index] = Metrics::GetShared()->GetPlayer(index, iRendition);
+    m_iRendition = iRendition;
     m_EncodeIdx = 0;
     m_uCurWidth = 0;
     m_uCurHeight = 0;
     m_uMaxWidth = 0;
     m_uMaxHeight = 0;
+    m_bSubFrameReadout = false;
+    m_bOutputOpen = false;
+    m_uSliceCount = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        m_SliceReadoutArray[i].SetIndex(i);
+        m_FecSenderArray[i].SetIndex(i);
+        m_SinkGraphArray[i].SetIndex(i);
+    }
 
     NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::trunc);
     NvHWEncoderLogFile.close();
@@ -723,23 +739,8 @@ CNvHWEncoder::CNvHWEncoder(int index)
 
 CNvHWEncoder::~CNvHWEncoder()
 {
-    // clean up encode API resources here
-    if (m_pEncodeAPI)
-    {
-        delete m_pEncodeAPI;
-        m_pEncodeAPI = NULL;
-    }
-
-    if (m_hinstLib)
-    {
-#if defined (NV_WINDOWS)
-        FreeLibrary(m_hinstLib);
-#else
-        dlclose(m_hinstLib);
-#endif
-
-        m_hinstLib = NULL;
-    }
+    // The encode API table and its library belong to EncoderRuntime
+    m_pEncodeAPI = NULL;
 }
 
 NVENCSTATUS CNvHWEncoder::ValidateEncodeGUID (GUID inputCodecGuid)
@@ -883,23 +884,7 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
         return NV_ENC_ERR_INVALID_PARAM;
     }
 
-    m_fOutputArray[index] = pEncCfg->fOutput;
-
-    std::stringstream *StringStream = new std::stringstream();
-    *StringStream << "ffmpeg " \
-                "-i - " \
-                "-listen 1 -threads 1 -vcodec copy -preset ultrafast " \
-                "-an -tune zerolatency " \
-                "-f h264 " << streamingIP << firstPort + index;
-    //*StringStream << "ffmpeg " \
-    //            "-y -i - " \
-    //            "-listen 1 -threads 1 -vcodec copy -preset ultrafast " \
-    //            "-an -tune zerolatency " \
-    //            "-f h264 output" << index << ".h264";
-
-    m_fOutputArray[index] = _popen(StringStream->str().c_str(), "wb");
-
-    if (!pEncCfg->width || !pEncCfg->height || !m_fOutputArray[index])
+    if (!pEncCfg->width || !pEncCfg->height)
     {
         NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
         NvHWEncoderLogFile << "(m_uCurWidth > m_uMaxWidth) || (m_uCurHeight > m_uMaxHeight). NV_ENC_ERR_INVALID_PARAM\n";
@@ -907,6 +892,13 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
         return NV_ENC_ERR_INVALID_PARAM;
     }
 
+    // Already open if the player was encoded in software so far
+    nvStatus = OpenOutput(pEncCfg, index);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        return nvStatus;
+    }
+
     if (pEncCfg->isYuv444 && (pEncCfg->codec == NV_ENC_HEVC))
     {
         PRINTERR("444 is not supported with HEVC \n");
@@ -927,7 +919,25 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
         return nvStatus;
     }
 
+    EncodeConfig stValidatedCfg = *pEncCfg;
+    nvStatus = ValidateLowLatencyConfig(inputCodecGUID, &stValidatedCfg);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        return nvStatus;
+    }
+    pEncCfg = &stValidatedCfg;
+
+    if (pEncCfg->enableMEOnly && pEncCfg->codec != NV_ENC_H264)
+    {
+        // NVENC reports motion vectors of H.264 macroblocks only
+        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
+        NvHWEncoderLogFile << "ME-only mode needs H.264. NV_ENC_ERR_INVALID_PARAM\n";
+        NvHWEncoderLogFile.close();
+        return NV_ENC_ERR_INVALID_PARAM;
+    }
+
     codecGUID = inputCodecGUID;
+    m_FirstChunkIndex.SetCodec(pEncCfg->codec == NV_ENC_H264 ? NAL_CODEC_H264 : NAL_CODEC_HEVC);
 
     m_stCreateEncodeParams.encodeGUID = inputCodecGUID;
     m_stCreateEncodeParams.presetGUID = pEncCfg->presetGUID;
@@ -946,6 +956,18 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
     m_stCreateEncodeParams.enablePTD = 1;
     m_stCreateEncodeParams.reportSliceOffsets = 0;
     m_stCreateEncodeParams.enableSubFrameWrite = 0;
+    m_stCreateEncodeParams.enableMEOnlyMode = pEncCfg->enableMEOnly ? 1 : 0;
+    m_bSubFrameReadout = pEncCfg->subFrameReadout != 0;
+    if (m_bSubFrameReadout)
+    {
+        // Slice offsets are only reported to synchronous sessions
+        m_stCreateEncodeParams.enableEncodeAsync = 0;
+        m_stCreateEncodeParams.reportSliceOffsets = 1;
+        m_stCreateEncodeParams.enableSubFrameWrite = 1;
+        m_uSliceCount = pEncCfg->sliceMode == 3 ? pEncCfg->sliceModeData : 0;
+        // NvEncLockBitstream wants room for one offset per macroblock
+        m_vSliceOffset.resize(((m_uMaxWidth + 15) / 16) * ((m_uMaxHeight + 15) / 16));
+    }
     m_stCreateEncodeParams.encodeConfig = &m_stEncodeConfig;
     m_stCreateEncodeParams.maxEncodeWidth = m_uMaxWidth;
     m_stCreateEncodeParams.maxEncodeHeight = m_uMaxHeight;
@@ -1039,6 +1061,20 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
         }
     }
 
+    if (pEncCfg->sliceMode || pEncCfg->sliceModeData)
+    {
+        if (pEncCfg->codec == NV_ENC_HEVC)
+        {
+            m_stEncodeConfig.encodeCodecConfig.hevcConfig.sliceMode = pEncCfg->sliceMode;
+            m_stEncodeConfig.encodeCodecConfig.hevcConfig.sliceModeData = pEncCfg->sliceModeData;
+        }
+        else
+        {
+            m_stEncodeConfig.encodeCodecConfig.h264Config.sliceMode = pEncCfg->sliceMode;
+            m_stEncodeConfig.encodeCodecConfig.h264Config.sliceModeData = pEncCfg->sliceModeData;
+        }
+    }
+
     if (pEncCfg->invalidateRefFramesEnableFlag)
     {
         if (pEncCfg->codec == NV_ENC_HEVC)
@@ -1078,6 +1114,135 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
     return nvStatus;
 }
 
+NVENCSTATUS CNvHWEncoder::MoveEncoder(void *hSession, void **phPrevious)
+{
+    // m_stCreateEncodeParams and m_stEncodeConfig follow every reconfiguration
+    NVENCSTATUS nvStatus = m_pEncodeAPI->nvEncInitializeEncoder(hSession, &m_stCreateEncodeParams);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
+        NvHWEncoderLogFile << "Encode Session Initialization failed on the new device (m_pEncodeAPI->nvEncInitializeEncoder)\n";
+        NvHWEncoderLogFile.close();
+        return nvStatus;
+    }
+    *phPrevious = m_hEncoder;
+    m_hEncoder = hSession;
+    m_bEncoderInitialized = true;
+
+    return nvStatus;
+}
+
+NVENCSTATUS CNvHWEncoder::RestoreEncoder(void *hPrevious)
+{
+    NVENCSTATUS nvStatus = NvEncDestroyEncoder();
+    m_hEncoder = hPrevious;
+    m_bEncoderInitialized = true;
+
+    return nvStatus;
+}
+
+int CNvHWEncoder::GetEncodeCap(GUID inputCodecGuid, NV_ENC_CAPS capsToQuery)
+{
+    NV_ENC_CAPS_PARAM stCapsParam;
+    memset(&stCapsParam, 0, sizeof(stCapsParam));
+    SET_VER(stCapsParam, NV_ENC_CAPS_PARAM);
+    stCapsParam.capsToQuery = capsToQuery;
+
+    int capsVal = 0;
+    if (m_pEncodeAPI->nvEncGetEncodeCaps(m_hEncoder, inputCodecGuid, &stCapsParam, &capsVal) != NV_ENC_SUCCESS)
+    {
+        return 0;
+    }
+    return capsVal;
+}
+
+// Checks the low-latency options against the encoder's caps. Options the GPU lacks are
+// turned off with a warning, so the session still starts; malformed ones are rejected.
+NVENCSTATUS CNvHWEncoder::ValidateLowLatencyConfig(GUID inputCodecGuid, EncodeConfig *pEncCfg)
+{
+    if (pEncCfg->intraRefreshEnableFlag)
+    {
+        if (!GetEncodeCap(inputCodecGuid, NV_ENC_CAPS_SUPPORT_INTRA_REFRESH))
+        {
+            PRINTERR("intra refresh is not supported, disabled\n");
+            NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
+            NvHWEncoderLogFile << "intra refresh is not supported, disabled\n";
+            NvHWEncoderLogFile.close();
+            pEncCfg->intraRefreshEnableFlag = 0;
+        }
+        else if (pEncCfg->intraRefreshPeriod <= 0 || pEncCfg->intraRefreshDuration <= 0 ||
+            pEncCfg->intraRefreshDuration > pEncCfg->intraRefreshPeriod)
+        {
+            PRINTERR("invalid intra refresh period %d / duration %d\n", pEncCfg->intraRefreshPeriod, pEncCfg->intraRefreshDuration);
+            NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
+            NvHWEncoderLogFile << "invalid intra refresh period " << pEncCfg->intraRefreshPeriod << " / duration " << pEncCfg->intraRefreshDuration << "\n";
+            NvHWEncoderLogFile.close();
+            return NV_ENC_ERR_INVALID_PARAM;
+        }
+    }
+
+    if (pEncCfg->subFrameReadout)
+    {
+        if (!GetEncodeCap(inputCodecGuid, NV_ENC_CAPS_SUPPORT_SUBFRAME_READBACK))
+        {
+            PRINTERR("sub-frame readback is not supported, disabled\n");
+            NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
+            NvHWEncoderLogFile << "sub-frame readback is not supported, disabled\n";
+            NvHWEncoderLogFile.close();
+            pEncCfg->subFrameReadout = 0;
+        }
+        else if (!pEncCfg->sliceMode && !pEncCfg->sliceModeData)
+        {
+            // A single slice per frame leaves nothing to send early
+            pEncCfg->sliceMode = 3;
+            pEncCfg->sliceModeData = 4;
+        }
+    }
+
+    if (pEncCfg->sliceMode < 0 || pEncCfg->sliceMode > 3 || pEncCfg->sliceModeData < 0)
+    {
+        PRINTERR("invalid slice mode %d / data %d\n", pEncCfg->sliceMode, pEncCfg->sliceModeData);
+        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
+        NvHWEncoderLogFile << "invalid slice mode " << pEncCfg->sliceMode << " / data " << pEncCfg->sliceModeData << "\n";
+        NvHWEncoderLogFile.close();
+        return NV_ENC_ERR_INVALID_PARAM;
+    }
+    if (pEncCfg->sliceMode == 3)
+    {
+        // No more slices than macroblock (or CTU) rows
+        int numRows = (pEncCfg->height + 15) / 16;
+        if (pEncCfg->sliceModeData > numRows)
+        {
+            pEncCfg->sliceModeData = numRows;
+        }
+    }
+
+    if (pEncCfg->vbvFrames > 0 && pEncCfg->vbvSize == 0 && pEncCfg->fps > 0)
+    {
+        pEncCfg->vbvSize = (int)((long long)pEncCfg->bitrate * pEncCfg->vbvFrames / pEncCfg->fps);
+    }
+    if (pEncCfg->vbvSize && !GetEncodeCap(inputCodecGuid, NV_ENC_CAPS_SUPPORT_CUSTOM_VBV_BUF_SIZE))
+    {
+        PRINTERR("custom VBV size is not supported, using the default\n");
+        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
+        NvHWEncoderLogFile << "custom VBV size is not supported, using the default\n";
+        NvHWEncoderLogFile.close();
+        pEncCfg->vbvSize = 0;
+        pEncCfg->vbvFrames = 0;
+    }
+
+    if (pEncCfg->invalidateRefFramesEnableFlag && !GetEncodeCap(inputCodecGuid, NV_ENC_CAPS_SUPPORT_REF_PIC_INVALIDATION))
+    {
+        PRINTERR("reference picture invalidation is not supported, disabled\n");
+        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
+        NvHWEncoderLogFile << "reference picture invalidation is not supported, disabled\n";
+        NvHWEncoderLogFile.close();
+        pEncCfg->invalidateRefFramesEnableFlag = 0;
+    }
+
+    return NV_ENC_SUCCESS;
+}
+
 GUID CNvHWEncoder::GetPresetGUID(char* encoderPreset, int codec)
 {
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
@@ -1129,6 +1294,26 @@ GUID CNvHWEncoder::GetPresetGUID(char* encoderPreset, int codec)
     return presetGUID;
 }
 
+static SinkFrameKind GetSinkFrameKind(const NalIndex &nalIndex)
+{
+    if (nalIndex.IsKeyFrame())
+    {
+        return SINK_FRAME_KEY;
+    }
+    return nalIndex.IsReference() ? SINK_FRAME_REFERENCE : SINK_FRAME_NON_REFERENCE;
+}
+
+static void CountFrame(PlayerMetrics *pMetrics, const NalIndex &nalIndex, uint32_t cbFrame)
+{
+    pMetrics->pFrameEncoded->Add();
+    pMetrics->pBitstreamBytes->Add(cbFrame);
+    pMetrics->pFrameBytes->Record(cbFrame);
+    if (nalIndex.IsKeyFrame())
+    {
+        pMetrics->pKeyFrame->Add();
+    }
+}
+
 NVENCSTATUS CNvHWEncoder::ProcessOutput(const EncodeBuffer *pEncodeBuffer, int index)
 {
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
@@ -1141,6 +1326,11 @@ NVENCSTATUS CNvHWEncoder::ProcessOutput(const EncodeBuffer *pEncodeBuffer, int i
         return NV_ENC_ERR_INVALID_PARAM;
     }
 
+    if (m_bSubFrameReadout && !pEncodeBuffer->stOutputBfr.bEOSFlag)
+    {
+        return ProcessSubFrameOutput(pEncodeBuffer, index);
+    }
+
     if (pEncodeBuffer->stOutputBfr.bWaitOnEvent == TRUE)
     {
         if (!pEncodeBuffer->stOutputBfr.hOutputEvent)
@@ -1168,7 +1358,13 @@ NVENCSTATUS CNvHWEncoder::ProcessOutput(const EncodeBuffer *pEncodeBuffer, int i
     nvStatus = m_pEncodeAPI->nvEncLockBitstream(m_hEncoder, &lockBitstreamData);
     if (nvStatus == NV_ENC_SUCCESS)
     {
-        fwrite(lockBitstreamData.bitstreamBufferPtr, 1, lockBitstreamData.bitstreamSizeInBytes, m_fOutputArray[index]);
+        m_NalIndexArray[index].Index((const uint8_t *)lockBitstreamData.bitstreamBufferPtr, lockBitstreamData.bitstreamSizeInBytes);
+        CountFrame(m_pMetricsArray[index], m_NalIndexArray[index], lockBitstreamData.bitstreamSizeInBytes);
+        if (!m_SinkGraphArray[index].Push((const uint8_t *)lockBitstreamData.bitstreamBufferPtr, lockBitstreamData.bitstreamSizeInBytes,
+            GetSinkFrameKind(m_NalIndexArray[index])))
+        {
+            m_pMetricsArray[index]->pSinkDropped->Add();
+        }
         nvStatus = m_pEncodeAPI->nvEncUnlockBitstream(m_hEncoder, pEncodeBuffer->stOutputBfr.hBitstreamBuffer);
     }
     else
@@ -1182,60 +1378,202 @@ NVENCSTATUS CNvHWEncoder::ProcessOutput(const EncodeBuffer *pEncodeBuffer, int i
     return nvStatus;
 }
 
-NVENCSTATUS CNvHWEncoder::Initialize(void* device, NV_ENC_DEVICE_TYPE deviceType)
+NVENCSTATUS CNvHWEncoder::OpenOutput(const EncodeConfig *pEncCfg, int index)
 {
-    NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
-    MYPROC nvEncodeAPICreateInstance; // function pointer to create instance in nvEncodeAPI
+    if (m_bOutputOpen)
+    {
+        return NV_ENC_SUCCESS;
+    }
 
-#if defined(NV_WINDOWS)
-#if defined (_WIN64)
-    m_hinstLib = LoadLibrary(TEXT("nvEncodeAPI64.dll"));
-#else
-    m_hinstLib = LoadLibrary(TEXT("nvEncodeAPI.dll"));
-#endif
-#else
-    m_hinstLib = dlopen("libnvidia-encode.so.1", RTLD_LAZY);
-#endif
-    if (m_hinstLib == NULL)
+    PlayerOutputConfig outputConfig;
+    outputConfig.strUdpDest = pEncCfg->udpDest ? pEncCfg->udpDest : "";
+    outputConfig.fecMode = pEncCfg->fecMode;
+    outputConfig.fecK = pEncCfg->fecK;
+    outputConfig.fecM = pEncCfg->fecM;
+    outputConfig.strRecordFile = pEncCfg->recordFile && !pEncCfg->enableMEOnly ? pEncCfg->recordFile : "";
+    outputConfig.strSinkPlugin = pEncCfg->sinkPlugin ? pEncCfg->sinkPlugin : "";
+    outputConfig.portOffset = pEncCfg->portOffset;
+    outputConfig.bHevc = pEncCfg->codec == NV_ENC_HEVC;
+    outputConfig.fps = pEncCfg->fps;
+
+    // Without UDP the stream goes to the ffmpeg listener OpenPlayerOutput() starts
+    m_fOutputArray[index] = pEncCfg->udpDest ? pEncCfg->fOutput : NULL;
+    if (pEncCfg->enableMEOnly && !pEncCfg->udpDest)
+    {
+        // Motion vectors are no stream for ffmpeg; they go to <-o or "motion"><player>[_<port offset>].mv
+        std::stringstream ssMotionFile;
+        ssMotionFile << (pEncCfg->outputFileName ? pEncCfg->outputFileName : "motion") << index;
+        if (pEncCfg->portOffset)
+        {
+            ssMotionFile << "_" << pEncCfg->portOffset;
+        }
+        ssMotionFile << ".mv";
+        m_fOutputArray[index] = fopen(ssMotionFile.str().c_str(), "wb");
+        if (!m_fOutputArray[index])
+        {
+            NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
+            NvHWEncoderLogFile << "The output could not be opened. NV_ENC_ERR_INVALID_PARAM\n";
+            NvHWEncoderLogFile.close();
+            return NV_ENC_ERR_INVALID_PARAM;
+        }
+    }
+
+    if (!OpenPlayerOutput(outputConfig, index, m_iRendition, m_SinkGraphArray[index], m_FecSenderArray[index], m_SinkPlugin,
+        &m_fOutputArray[index], m_pMetricsArray[index]))
     {
         NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "NV_ENC_ERR_OUT_OF_MEMORY\n";
+        NvHWEncoderLogFile << "The output could not be opened. NV_ENC_ERR_INVALID_PARAM\n";
         NvHWEncoderLogFile.close();
-        return NV_ENC_ERR_OUT_OF_MEMORY;
+        return NV_ENC_ERR_INVALID_PARAM;
     }
 
-#if defined(NV_WINDOWS)
-    nvEncodeAPICreateInstance = (MYPROC)GetProcAddress(m_hinstLib, "NvEncodeAPICreateInstance");
-#else
-    nvEncodeAPICreateInstance = (MYPROC)dlsym(m_hinstLib, "NvEncodeAPICreateInstance");
-#endif
+    for (int i = 0; i < 4; i++)
+    {
+        m_NalIndexArray[i].SetCodec(pEncCfg->codec == NV_ENC_H264 ? NAL_CODEC_H264 : NAL_CODEC_HEVC);
+    }
+    m_bOutputOpen = true;
+    return NV_ENC_SUCCESS;
+}
 
-    if (nvEncodeAPICreateInstance == NULL)
+NVENCSTATUS CNvHWEncoder::WriteOutput(const uint8_t *pData, uint32_t cb, int index)
+{
+    if (!m_bOutputOpen)
+    {
+        return NV_ENC_ERR_NOT_INITIALIZED;
+    }
+    m_NalIndexArray[index].Index(pData, cb);
+    CountFrame(m_pMetricsArray[index], m_NalIndexArray[index], cb);
+    if (!m_SinkGraphArray[index].Push(pData, cb, GetSinkFrameKind(m_NalIndexArray[index])))
+    {
+        m_pMetricsArray[index]->pSinkDropped->Add();
+    }
+    return NV_ENC_SUCCESS;
+}
+
+// Polls the bitstream buffer of one frame while the encoder writes it slice by slice
+class CNvEncSliceSource : public SliceSource
+{
+public:
+    CNvEncSliceSource(NV_ENCODE_API_FUNCTION_LIST *pEncodeAPI, void *hEncoder, NV_ENC_OUTPUT_PTR hBitstreamBuffer,
+                      uint32_t *pSliceOffset, uint32_t uSliceCount) :
+        m_pEncodeAPI(pEncodeAPI), m_hEncoder(hEncoder), m_hBitstreamBuffer(hBitstreamBuffer),
+        m_pSliceOffset(pSliceOffset), m_uSliceCount(uSliceCount), m_bLocked(false)
+    {
+    }
+
+    virtual bool Poll(SliceProgress &progress)
+    {
+        memset(&progress, 0, sizeof(progress));
+        progress.pSliceOffset = m_pSliceOffset;
+
+        NV_ENC_LOCK_BITSTREAM lockBitstreamData;
+        memset(&lockBitstreamData, 0, sizeof(lockBitstreamData));
+        SET_VER(lockBitstreamData, NV_ENC_LOCK_BITSTREAM);
+        lockBitstreamData.outputBitstream = m_hBitstreamBuffer;
+        lockBitstreamData.doNotWait = 1;
+        lockBitstreamData.sliceOffsets = m_pSliceOffset;
+
+        NVENCSTATUS nvStatus = m_pEncodeAPI->nvEncLockBitstream(m_hEncoder, &lockBitstreamData);
+        if (nvStatus == NV_ENC_ERR_LOCK_BUSY || nvStatus == NV_ENC_ERR_ENCODER_BUSY)
+        {
+            // Nothing written yet
+            return true;
+        }
+        if (nvStatus != NV_ENC_SUCCESS)
+        {
+            return false;
+        }
+        m_bLocked = true;
+
+        progress.pData = (const uint8_t *)lockBitstreamData.bitstreamBufferPtr;
+        progress.dwFrame = lockBitstreamData.frameIdx;
+        // With a fixed number of slices the count tells when the frame is complete
+        progress.bDone = m_uSliceCount ? lockBitstreamData.numSlices >= m_uSliceCount : lockBitstreamData.hwEncodeStatus == 2;
+        if (progress.bDone)
+        {
+            progress.nSlice = lockBitstreamData.numSlices;
+            progress.cbAvailable = lockBitstreamData.bitstreamSizeInBytes;
+        }
+        else if (lockBitstreamData.numSlices > 1)
+        {
+            // The newest slice may still be being written
+            progress.nSlice = lockBitstreamData.numSlices - 1;
+            progress.cbAvailable = m_pSliceOffset[progress.nSlice];
+        }
+        return true;
+    }
+
+    virtual void Release()
+    {
+        if (m_bLocked)
+        {
+            m_pEncodeAPI->nvEncUnlockBitstream(m_hEncoder, m_hBitstreamBuffer);
+            m_bLocked = false;
+        }
+    }
+
+private:
+    NV_ENCODE_API_FUNCTION_LIST *m_pEncodeAPI;
+    void *m_hEncoder;
+    NV_ENC_OUTPUT_PTR m_hBitstreamBuffer;
+    uint32_t *m_pSliceOffset;
+    uint32_t m_uSliceCount;
+    bool m_bLocked;
+};
+
+NVENCSTATUS CNvHWEncoder::ProcessSubFrameOutput(const EncodeBuffer *pEncodeBuffer, int index)
+{
+    CNvEncSliceSource sliceSource(m_pEncodeAPI, m_hEncoder, pEncodeBuffer->stOutputBfr.hBitstreamBuffer, &m_vSliceOffset[0], m_uSliceCount);
+    SinkGraph &sinkGraph = m_SinkGraphArray[index];
+    NalIndex &nalIndex = m_NalIndexArray[index];
+    NalIndex &firstChunkIndex = m_FirstChunkIndex;
+    PlayerMetrics *pMetrics = m_pMetricsArray[index];
+    bool bDone = m_SliceReadoutArray[index].ReadFrame(&sliceSource, [&sinkGraph, &nalIndex, &firstChunkIndex, pMetrics](const SliceChunk &chunk)
+    {
+        // The first chunk holds the first slice, which tells the kind of the frame
+        if (!chunk.offset)
+        {
+            firstChunkIndex.Index(chunk.pData, chunk.cb);
+        }
+        if (!sinkGraph.Push(chunk.pData, chunk.cb, GetSinkFrameKind(firstChunkIndex), !chunk.offset))
+        {
+            pMetrics->pSinkDropped->Add();
+        }
+        if (chunk.bLast)
+        {
+            nalIndex.Index(chunk.pData - chunk.offset, chunk.offset + chunk.cb);
+            CountFrame(pMetrics, nalIndex, chunk.offset + chunk.cb);
+        }
+    });
+    if (!bDone)
     {
         NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "NV_ENC_ERR_OUT_OF_MEMORY 2\n";
+        NvHWEncoderLogFile << "sub-frame readout failed\n";
         NvHWEncoderLogFile.close();
-        return NV_ENC_ERR_OUT_OF_MEMORY;
+        PRINTERR("sub-frame readout failed \n");
+        return NV_ENC_ERR_GENERIC;
     }
+    return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS CNvHWEncoder::Initialize(void* device, NV_ENC_DEVICE_TYPE deviceType, void *hSession)
+{
+    NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
 
-    m_pEncodeAPI = new NV_ENCODE_API_FUNCTION_LIST;
+    // The library is loaded once per process
+    m_pEncodeAPI = EncoderRuntime::GetShared()->GetApi();
     if (m_pEncodeAPI == NULL)
     {
         NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "NV_ENC_ERR_OUT_OF_MEMORY 3\n";
+        NvHWEncoderLogFile << "NV_ENC_ERR_OUT_OF_MEMORY\n";
         NvHWEncoderLogFile.close();
         return NV_ENC_ERR_OUT_OF_MEMORY;
     }
 
-    memset(m_pEncodeAPI, 0, sizeof(NV_ENCODE_API_FUNCTION_LIST));
-    m_pEncodeAPI->version = NV_ENCODE_API_FUNCTION_LIST_VER;
-    nvStatus = nvEncodeAPICreateInstance(m_pEncodeAPI);
-    if (nvStatus != NV_ENC_SUCCESS)
+    if (hSession)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "nvEncodeAPICreateInstance\n";
-        NvHWEncoderLogFile.close();
-        return nvStatus;
+        m_hEncoder = hSession;
+        return NV_ENC_SUCCESS;
     }
 
     nvStatus = NvEncOpenEncodeSessionEx(device, deviceType);
@@ -1547,6 +1885,92 @@ NVENCSTATUS CNvHWEncoder::ParseArguments(EncodeConfig *encodeConfig, int argc, c
                 return NV_ENC_ERR_INVALID_PARAM;
             }
         }
+        else if (stricmp(argv[i], "-sliceMode") == 0)
+        {
+            if (++i >= argc || sscanf(argv[i], "%d", &encodeConfig->sliceMode) != 1)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+        }
+        else if (stricmp(argv[i], "-sliceModeData") == 0)
+        {
+            if (++i >= argc || sscanf(argv[i], "%d", &encodeConfig->sliceModeData) != 1)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+        }
+        else if (stricmp(argv[i], "-subFrame") == 0)
+        {
+            if (++i >= argc || sscanf(argv[i], "%d", &encodeConfig->subFrameReadout) != 1)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+        }
+        else if (stricmp(argv[i], "-udp") == 0)
+        {
+            if (++i >= argc)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+            encodeConfig->udpDest = argv[i];
+        }
+        else if (stricmp(argv[i], "-record") == 0)
+        {
+            if (++i >= argc)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+            encodeConfig->recordFile = argv[i];
+        }
+        else if (stricmp(argv[i], "-sinkPlugin") == 0)
+        {
+            if (++i >= argc)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+            encodeConfig->sinkPlugin = argv[i];
+        }
+        else if (stricmp(argv[i], "-fec") == 0)
+        {
+            if (++i >= argc || sscanf(argv[i], "%d", &encodeConfig->fecMode) != 1
+                || encodeConfig->fecMode < FEC_NONE || encodeConfig->fecMode > FEC_RS)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+        }
+        else if (stricmp(argv[i], "-fecK") == 0)
+        {
+            if (++i >= argc || sscanf(argv[i], "%d", &encodeConfig->fecK) != 1
+                || encodeConfig->fecK < 1 || encodeConfig->fecK > FEC_MAX_K)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+        }
+        else if (stricmp(argv[i], "-fecM") == 0)
+        {
+            if (++i >= argc || sscanf(argv[i], "%d", &encodeConfig->fecM) != 1
+                || encodeConfig->fecM < 1 || encodeConfig->fecM > FEC_MAX_M)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+        }
+        else if (stricmp(argv[i], "-vbvFrames") == 0)
+        {
+            if (++i >= argc || sscanf(argv[i], "%d", &encodeConfig->vbvFrames) != 1)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+        }
         else if (stricmp(argv[i], "-intraRefreshDuration") == 0)
         {
             if (++i >= argc || sscanf(argv[i], "%d", &encodeConfig->intraRefreshDuration) != 1)
@@ -1571,6 +1995,22 @@ NVENCSTATUS CNvHWEncoder::ParseArguments(EncodeConfig *encodeConfig, int argc, c
                 return NV_ENC_ERR_INVALID_PARAM;
             }
         }
+        else if (stricmp(argv[i], "-gpuSessions") == 0)
+        {
+            if (++i >= argc || sscanf(argv[i], "%d", &encodeConfig->gpuSessions) != 1)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+        }
+        else if (stricmp(argv[i], "-cpuThreads") == 0)
+        {
+            if (++i >= argc || sscanf(argv[i], "%d", &encodeConfig->cpuThreads) != 1)
+            {
+                PRINTERR("invalid parameter for %s\n", argv[i - 1]);
+                return NV_ENC_ERR_INVALID_PARAM;
+            }
+        }
         else if (stricmp(argv[i], "-yuv444") == 0)
         {
             if (++i >= argc || sscanf(argv[i], "%d", &encodeConfig->isYuv444) != 1)
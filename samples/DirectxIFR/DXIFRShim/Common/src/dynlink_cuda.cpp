@@ -207,6 +207,13 @@ tcuMemHostGetFlags                    *cuMemHostGetFlags;
 
 #define STRINGIFY(X) #X
 
+static const char *__CudaLibNameOverride = NULL;
+
+void CUDAAPI cuSetDriverLibrary(const char *szDriverLibrary)
+{
+    __CudaLibNameOverride = szDriverLibrary;
+}
+
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
 #include <Windows.h>
 
@@ -220,7 +227,7 @@ typedef HMODULE CUDADRIVER;
 
 static CUresult LOAD_LIBRARY(CUDADRIVER *pInstance)
 {
-    *pInstance = LoadLibrary(__CudaLibName);
+    *pInstance = __CudaLibNameOverride ? LoadLibraryA(__CudaLibNameOverride) : LoadLibrary(__CudaLibName);
 
     if (*pInstance == NULL)
     {
@@ -259,7 +266,7 @@ typedef void *CUDADRIVER;
 
 static CUresult LOAD_LIBRARY(CUDADRIVER *pInstance)
 {
-    *pInstance = dlopen(__CudaLibName, RTLD_NOW);
+    *pInstance = dlopen(__CudaLibNameOverride ? __CudaLibNameOverride : __CudaLibName, RTLD_NOW);
 
     if (*pInstance == NULL)
     {
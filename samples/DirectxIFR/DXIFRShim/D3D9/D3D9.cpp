@@ -18,6 +18,8 @@
 #include "ReplaceVtbl.h"
 #include "Logger.h"
 #include "AppParam.h"
+#include "EncoderRuntime.h"
+#include "InputInjector.h"
 
 simplelogger::Logger *logger 
 	= simplelogger::LoggerFactory::CreateFileLogger("D3D9.shim.log");
@@ -27,6 +29,9 @@ AppParam *pAppParam = appParamManger.GetAppParam();
 IDirect3D9 * WINAPI Direct3DCreate9_Proxy(UINT SDKVersion)
 {
 	LOG_DEBUG(logger, __FUNCTION__);
+	// The first D3D call is the earliest point outside the loader lock; the sessions are ready by the first Present
+	PrewarmEncoders(pAppParam);
+	InputInjector::Start(&appParamManger);
 	IDirect3D9 * pDirect3D9 = Direct3DCreate9(SDKVersion);
 	if (!pDirect3D9) {
 		return NULL;
@@ -42,6 +47,8 @@ IDirect3D9 * WINAPI Direct3DCreate9_Proxy(UINT SDKVersion)
 HRESULT WINAPI Direct3DCreate9Ex_Proxy(UINT SDKVersion, IDirect3D9Ex **ppD3D)
 {
 	LOG_DEBUG(logger, __FUNCTION__);
+	PrewarmEncoders(pAppParam);
+	InputInjector::Start(&appParamManger);
 	HRESULT hr = Direct3DCreate9Ex(SDKVersion, ppD3D);
 	if (FAILED(hr) || !*ppD3D) {
 		return hr;
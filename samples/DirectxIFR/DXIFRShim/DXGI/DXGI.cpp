@@ -19,6 +19,8 @@
 #include "Logger.h"
 #include "AppParam.h"
 #include "Util.h"
+#include "EncoderRuntime.h"
+#include "InputInjector.h"
 
 simplelogger::Logger *logger 
 	= simplelogger::LoggerFactory::CreateFileLogger("DXGI.shim.log");
@@ -51,6 +53,9 @@ static HRESULT WINAPI CreateDXGIFactory1_Proxy_Template(REFIID riid, Factory **p
 HRESULT WINAPI CreateDXGIFactory1_Proxy(REFIID riid, void **ppFactory)
 {
 	LOG_DEBUG(logger, __FUNCTION__);
+	// The first DXGI call is the earliest point outside the loader lock; the sessions are ready by the first Present
+	PrewarmEncoders(pAppParam);
+	InputInjector::Start(&appParamManger);
 
 	if (!memcmp(&riid, &__uuidof(IDXGIFactory), sizeof(GUID))) {
 		BOOL IDXGIFactory_ReplaceVtbl(IDXGIFactory *);
@@ -16,6 +16,9 @@
 #include "../common/inc/nvEncodeAPI.h"
 #include "../common/inc/nvUtils.h"
 #include "NvEncoder.h"
+#include "../common/EncoderRuntime.h"
+#include "../common/GpuScheduler.h"
+#include "../common/BufferPool.h"
 #include "../common/inc/nvFileIO.h"
 #include <new>
 
@@ -66,9 +69,18 @@ void convertYUVpitchtoYUV444(unsigned char *yuv_luma, unsigned char *yuv_cb, uns
     }
 }
 
-CNvEncoder::CNvEncoder(int index)
+CNvEncoder::CNvEncoder(int index, int iRendition)
 {
-    m_pNvHWEncoder = new CNvHWEncoder(index);
+    m_pNvHWEncoder = new CNvHWEncoder(index, iRendition);
+    m_pMetrics = Metrics::GetShared()->GetPlayer(index, iRendition);
+    m_iPlayer = index;
+    m_iRendition = iRendition;
+    m_iDevice = -1;
+    m_bPinned = false;
+    m_bMoveIdrRequested = false;
+    m_pSoftwareEncoder = NULL;
+    m_pMEReference = NULL;
+    m_uMEReferenceIdx = 0;
     m_pDevice = NULL;
 #if defined (NV_WINDOWS)
     m_pD3D = NULL;
@@ -80,6 +92,10 @@ CNvEncoder::CNvEncoder(int index)
     memset(&m_stEOSOutputBfr, 0, sizeof(m_stEOSOutputBfr));
 
     memset(&m_stEncodeBuffer, 0, sizeof(m_stEncodeBuffer));
+    m_szOptions[0] = '\0';
+    m_uFrameBytesPeak = 0;
+    m_qwFrameBytesSum = 0;
+    m_uFrameSizeCount = 0;
 }
 
 CNvEncoder::~CNvEncoder()
@@ -91,106 +107,91 @@ CNvEncoder::~CNvEncoder()
     }
 }
 
-NVENCSTATUS CNvEncoder::InitCuda(uint32_t deviceID)
+NVENCSTATUS CNvEncoder::OpenCudaSession(int iDevice, void **phSession)
 {
-    CUresult cuResult;
-    CUdevice device;
-    CUcontext cuContextCurr;
-    int  deviceCount = 0;
-    int  SMminor = 0, SMmajor = 0;
-
-#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
-    typedef HMODULE CUDADRIVER;
-#else
-    typedef void *CUDADRIVER;
-#endif
-    CUDADRIVER hHandleDriver = 0;
-    cuResult = cuInit(0, __CUDA_API_VERSION, hHandleDriver);
-    if (cuResult != CUDA_SUCCESS)
+    // A session the runtime opened ahead of time spares the game the start-up stall. CUDA is initialized
+    // and the device checked once per process; the context is shared by the encoders on the device
+    EncoderSession session;
+    if (!EncoderRuntime::GetShared()->AcquireSession(iDevice, &session))
     {
-        PRINTERR("cuInit error:0x%x\n", cuResult);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuResult != CUDA_SUCCESS.\n";
-        NvEncoderLogFile.close();
-        assert(0);
-        return NV_ENC_ERR_NO_ENCODE_DEVICE;
-    }
-
-    cuResult = cuDeviceGetCount(&deviceCount);
-    if (cuResult != CUDA_SUCCESS)
-    {
-        PRINTERR("cuDeviceGetCount error:0x%x\n", cuResult);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuDeviceGetCount error.\n";
-        NvEncoderLogFile.close();
-        assert(0);
-        return NV_ENC_ERR_NO_ENCODE_DEVICE;
-    }
-
-    // If dev is negative value, we clamp to 0
-    if ((int)deviceID < 0)
-        deviceID = 0;
-
-    if (deviceID >(unsigned int)deviceCount - 1)
-    {
-        PRINTERR("Invalid Device Id = %d\n", deviceID);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "Invalid Device Id.\n";
-        NvEncoderLogFile.close();
-        return NV_ENC_ERR_INVALID_ENCODERDEVICE;
+        NVENCSTATUS nvStatus = EncoderRuntime::GetShared()->OpenSession(iDevice, &session);
+        if (nvStatus != NV_ENC_SUCCESS)
+        {
+            PRINTERR("OpenSession error:0x%x\n", nvStatus);
+            NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
+            NvEncoderLogFile << "OpenSession error on GPU " << iDevice << ".\n";
+            NvEncoderLogFile.close();
+            return nvStatus;
+        }
     }
+    m_pDevice = session.cuContext;
+    *phSession = session.hEncoder;
+    return NV_ENC_SUCCESS;
+}
 
-    cuResult = cuDeviceGet(&device, deviceID);
-    if (cuResult != CUDA_SUCCESS)
+NVENCSTATUS CNvEncoder::MoveSession(int iDevice, int index)
+{
+    // The new session is opened first, so that the encoder stays where it is if the GPU refuses it
+    void *pOldDevice = m_pDevice;
+    void *hSession = NULL;
+    NVENCSTATUS nvStatus = OpenCudaSession(iDevice, &hSession);
+    if (nvStatus != NV_ENC_SUCCESS)
     {
-        PRINTERR("cuDeviceGet error:0x%x\n", cuResult);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuDeviceGet error.\n";
-        NvEncoderLogFile.close();
-        return NV_ENC_ERR_NO_ENCODE_DEVICE;
+        return nvStatus;
     }
 
-    cuResult = cuDeviceComputeCapability(&SMmajor, &SMminor, deviceID);
-    if (cuResult != CUDA_SUCCESS)
+    // Everything submitted to the old session is written out before its buffers go. The old encoder and
+    // its context stay until the new encoder has its buffers as well
+    FlushEncoder(index);
+    ReleaseIOBuffers();
+    void *hOldEncoder = NULL;
+    nvStatus = m_pNvHWEncoder->MoveEncoder(hSession, &hOldEncoder);
+    if (nvStatus == NV_ENC_SUCCESS)
     {
-        PRINTERR("cuDeviceComputeCapability error:0x%x\n", cuResult);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuDeviceComputeCapability error.\n";
-        NvEncoderLogFile.close();
-        return NV_ENC_ERR_NO_ENCODE_DEVICE;
+        nvStatus = AllocateIOBuffers(encodeConfig.width, encodeConfig.height, encodeConfig.isYuv444);
+        if (nvStatus != NV_ENC_SUCCESS)
+        {
+            ReleaseIOBuffers();
+            m_pNvHWEncoder->RestoreEncoder(hOldEncoder);
+            EncoderRuntime::GetShared()->ReleaseContext((CUcontext)m_pDevice);
+        }
     }
-
-    if (((SMmajor << 4) + SMminor) < 0x30)
+    else
     {
-        PRINTERR("GPU %d does not have NVENC capabilities exiting\n", deviceID);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "GPU does not have NVENC capabilities exiting.\n";
-        NvEncoderLogFile.close();
-        return NV_ENC_ERR_NO_ENCODE_DEVICE;
+        EncoderSession session = {iDevice, (CUcontext)m_pDevice, hSession};
+        EncoderRuntime::GetShared()->DestroySession(session);
     }
 
-    cuResult = cuCtxCreate((CUcontext*)(&m_pDevice), 0, device);
-    if (cuResult != CUDA_SUCCESS)
+    if (nvStatus == NV_ENC_SUCCESS)
     {
-        PRINTERR("cuCtxCreate error:0x%x\n", cuResult);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuCtxCreate error.\n";
-        NvEncoderLogFile.close();
-        assert(0);
-        return NV_ENC_ERR_NO_ENCODE_DEVICE;
+        EncoderSession oldSession = {m_iDevice, (CUcontext)pOldDevice, hOldEncoder};
+        EncoderRuntime::GetShared()->DestroySession(oldSession);
+        m_iDevice = iDevice;
+        m_pMetrics->pGpu->Set(iDevice);
+        m_pMetrics->pGpuMove->Add();
+        return NV_ENC_SUCCESS;
     }
 
-    cuResult = cuCtxPopCurrent(&cuContextCurr);
-    if (cuResult != CUDA_SUCCESS)
+    NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
+    NvEncoderLogFile << "MoveSession to GPU " << iDevice << " failed.\n";
+    NvEncoderLogFile.close();
+    // Back to where it was: the old encoder carries on, on buffers allocated again
+    m_pDevice = pOldDevice;
+    if (AllocateIOBuffers(encodeConfig.width, encodeConfig.height, encodeConfig.isYuv444) != NV_ENC_SUCCESS)
     {
-        PRINTERR("cuCtxPopCurrent error:0x%x\n", cuResult);
         NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuCtxPopCurrent error.\n";
+        NvEncoderLogFile << "No buffers on GPU " << m_iDevice << " either after the failed move.\n";
         NvEncoderLogFile.close();
-        assert(0);
-        return NV_ENC_ERR_NO_ENCODE_DEVICE;
+        // The hardware encoder is gone; the caller hands the player to the software encoder
+        ReleaseIOBuffers();
+        BufferPool::GetShared()->CheckReleased(m_iPlayer, m_iRendition);
+        m_pNvHWEncoder->NvEncDestroyEncoder();
+        EncoderRuntime::GetShared()->ReleaseContext((CUcontext)m_pDevice);
+        m_pDevice = NULL;
+        m_iDevice = -1;
+        m_pMetrics->pGpu->Set(-1);
     }
-    return NV_ENC_SUCCESS;
+    return nvStatus;
 }
 
 #if defined(NV_WINDOWS)
@@ -310,9 +311,12 @@ NVENCSTATUS CNvEncoder::AllocateIOBuffers(uint32_t uInputWidth, uint32_t uInputH
 {
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
 
-    m_EncodeBufferQueue.Initialize(m_stEncodeBuffer, m_uEncodeBufferCount);
+    m_FreeBufferQueue.Reset();
+    m_PendingBufferQueue.Reset();
+    m_pMEReference = NULL;
     for (uint32_t i = 0; i < m_uEncodeBufferCount; i++)
     {
+        m_FreeBufferQueue.Push(&m_stEncodeBuffer[i]);
         nvStatus = m_pNvHWEncoder->NvEncCreateInputBuffer(uInputWidth, uInputHeight, &m_stEncodeBuffer[i].stInputBfr.hInputSurface, isYuv444);
         if (nvStatus != NV_ENC_SUCCESS)
         {
@@ -321,6 +325,10 @@ NVENCSTATUS CNvEncoder::AllocateIOBuffers(uint32_t uInputWidth, uint32_t uInputH
             NvEncoderLogFile.close();
             return nvStatus;
         }
+        size_t cbInput = (size_t)uInputWidth * uInputHeight;
+        cbInput = isYuv444 ? cbInput * 3 : cbInput * 3 / 2;
+        BufferPool::GetShared()->Track(m_stEncodeBuffer[i].stInputBfr.hInputSurface, BUFFER_INPUT_SURFACE,
+            cbInput, m_iPlayer, m_iRendition);
 
         m_stEncodeBuffer[i].stInputBfr.bufferFmt = isYuv444 ? NV_ENC_BUFFER_FORMAT_YUV444_PL : NV_ENC_BUFFER_FORMAT_NV12_PL;
         //m_stEncodeBuffer[i].stInputBfr.bufferFmt = NV_ENC_BUFFER_FORMAT_IYUV_PL;
@@ -328,17 +336,35 @@ NVENCSTATUS CNvEncoder::AllocateIOBuffers(uint32_t uInputWidth, uint32_t uInputH
         m_stEncodeBuffer[i].stInputBfr.dwHeight = uInputHeight;
 
         //Allocate output surface
-        nvStatus = m_pNvHWEncoder->NvEncCreateBitstreamBuffer(BITSTREAM_BUFFER_SIZE, &m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer);
+        uint32_t cbOutput = BITSTREAM_BUFFER_SIZE;
+        if (encodeConfig.enableMEOnly)
+        {
+            cbOutput = ((uInputWidth + 15) >> 4) * ((uInputHeight + 15) >> 4) * sizeof(NV_ENC_H264_MV_DATA);
+            nvStatus = m_pNvHWEncoder->NvEncCreateMVBuffer(cbOutput, &m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer);
+        }
+        else
+        {
+            nvStatus = m_pNvHWEncoder->NvEncCreateBitstreamBuffer(cbOutput, &m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer);
+        }
         if (nvStatus != NV_ENC_SUCCESS)
         {
             NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-            NvEncoderLogFile << "NvEncCreateBitstreamBuffer failed.\n";
+            NvEncoderLogFile << (encodeConfig.enableMEOnly ? "NvEncCreateMVBuffer failed.\n" : "NvEncCreateBitstreamBuffer failed.\n");
             NvEncoderLogFile.close();
             return nvStatus;
         }
-        m_stEncodeBuffer[i].stOutputBfr.dwBitstreamBufferSize = BITSTREAM_BUFFER_SIZE;
+        BufferPool::GetShared()->Track(m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer, BUFFER_BITSTREAM,
+            cbOutput, m_iPlayer, m_iRendition);
+        m_stEncodeBuffer[i].stOutputBfr.dwBitstreamBufferSize = cbOutput;
 
 #if defined (NV_WINDOWS)
+        if (m_pNvHWEncoder->IsSubFrameReadout())
+        {
+            // The encoder runs synchronously; ProcessOutput polls the bitstream instead of waiting
+            m_stEncodeBuffer[i].stOutputBfr.hOutputEvent = NULL;
+            m_stEncodeBuffer[i].stOutputBfr.bWaitOnEvent = false;
+            continue;
+        }
         nvStatus = m_pNvHWEncoder->NvEncRegisterAsyncEvent(&m_stEncodeBuffer[i].stOutputBfr.hOutputEvent);
         if (nvStatus != NV_ENC_SUCCESS)
         {
@@ -347,7 +373,7 @@ NVENCSTATUS CNvEncoder::AllocateIOBuffers(uint32_t uInputWidth, uint32_t uInputH
             NvEncoderLogFile.close();
             return nvStatus;
         }
-        if (m_stEncoderInput.enableMEOnly)
+        if (encodeConfig.enableMEOnly)
         {
             m_stEncodeBuffer[i].stOutputBfr.bWaitOnEvent = false;
         }
@@ -361,6 +387,11 @@ NVENCSTATUS CNvEncoder::AllocateIOBuffers(uint32_t uInputWidth, uint32_t uInputH
     m_stEOSOutputBfr.bEOSFlag = TRUE;
 
 #if defined (NV_WINDOWS)
+    if (m_pNvHWEncoder->IsSubFrameReadout())
+    {
+        m_stEOSOutputBfr.hOutputEvent = NULL;
+        return NV_ENC_SUCCESS;
+    }
     nvStatus = m_pNvHWEncoder->NvEncRegisterAsyncEvent(&m_stEOSOutputBfr.hOutputEvent);
     if (nvStatus != NV_ENC_SUCCESS)
     {
@@ -378,12 +409,15 @@ NVENCSTATUS CNvEncoder::AllocateIOBuffers(uint32_t uInputWidth, uint32_t uInputH
 
 NVENCSTATUS CNvEncoder::ReleaseIOBuffers()
 {
+    m_pMEReference = NULL;
     for (uint32_t i = 0; i < m_uEncodeBufferCount; i++)
     {
+        BufferPool::GetShared()->Untrack(m_stEncodeBuffer[i].stInputBfr.hInputSurface);
+        BufferPool::GetShared()->Untrack(m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer);
         m_pNvHWEncoder->NvEncDestroyInputBuffer(m_stEncodeBuffer[i].stInputBfr.hInputSurface);
         m_stEncodeBuffer[i].stInputBfr.hInputSurface = NULL;
 
-        if (m_stEncoderInput.enableMEOnly)
+        if (encodeConfig.enableMEOnly)
         {
             m_pNvHWEncoder->NvEncDestroyMVBuffer(m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer);
             m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer = NULL;
@@ -395,9 +429,12 @@ NVENCSTATUS CNvEncoder::ReleaseIOBuffers()
         }
 
 #if defined(NV_WINDOWS)
-        m_pNvHWEncoder->NvEncUnregisterAsyncEvent(m_stEncodeBuffer[i].stOutputBfr.hOutputEvent);
-        nvCloseFile(m_stEncodeBuffer[i].stOutputBfr.hOutputEvent);
-        m_stEncodeBuffer[i].stOutputBfr.hOutputEvent = NULL;
+        if (m_stEncodeBuffer[i].stOutputBfr.hOutputEvent)
+        {
+            m_pNvHWEncoder->NvEncUnregisterAsyncEvent(m_stEncodeBuffer[i].stOutputBfr.hOutputEvent);
+            nvCloseFile(m_stEncodeBuffer[i].stOutputBfr.hOutputEvent);
+            m_stEncodeBuffer[i].stOutputBfr.hOutputEvent = NULL;
+        }
 #endif
     }
 
@@ -429,15 +466,12 @@ NVENCSTATUS CNvEncoder::FlushEncoder(int index)
         return nvStatus;
     }
 
-    EncodeBuffer *pEncodeBufer = m_EncodeBufferQueue.GetPending();
-    while (pEncodeBufer)
+    while (ProcessPendingBuffer(index))
     {
-        m_pNvHWEncoder->ProcessOutput(pEncodeBufer, index);
-        pEncodeBufer = m_EncodeBufferQueue.GetPending();
     }
 
 #if defined(NV_WINDOWS)
-    if (WaitForSingleObject(m_stEOSOutputBfr.hOutputEvent, 500) != WAIT_OBJECT_0)
+    if (m_stEOSOutputBfr.hOutputEvent && WaitForSingleObject(m_stEOSOutputBfr.hOutputEvent, 500) != WAIT_OBJECT_0)
     {
         NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
         NvEncoderLogFile << "WaitForSingleObject(m_stEOSOutputBfr.hOutputEvent, 500) error.\n";
@@ -459,8 +493,21 @@ NVENCSTATUS CNvEncoder::Deinitialize(uint32_t devicetype)
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
 
     ReleaseIOBuffers();
+    BufferPool::GetShared()->CheckReleased(m_iPlayer, m_iRendition);
 
     nvStatus = m_pNvHWEncoder->NvEncDestroyEncoder();
+    if (m_pSoftwareEncoder)
+    {
+        delete m_pSoftwareEncoder;
+        m_pSoftwareEncoder = NULL;
+        m_pMetrics->pSoftware->Set(0);
+        GpuScheduler::GetShared()->Release(m_iPlayer, m_iRendition);
+    }
+    if (m_iDevice >= 0)
+    {
+        GpuScheduler::GetShared()->Release(m_iPlayer, m_iRendition);
+        m_iDevice = -1;
+    }
 
     if (m_pDevice)
     {
@@ -481,15 +528,9 @@ NVENCSTATUS CNvEncoder::Deinitialize(uint32_t devicetype)
 #endif
 
         case NV_ENC_CUDA:
-            CUresult cuResult = CUDA_SUCCESS;
-            cuResult = cuCtxDestroy((CUcontext)m_pDevice);
-            if (cuResult != CUDA_SUCCESS)
-            {
-                NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-                NvEncoderLogFile << "cuCtxDestroy() error.\n";
-                NvEncoderLogFile.close();
-                PRINTERR("cuCtxDestroy error:0x%x\n", cuResult);
-            }
+            // The last encoder on the device destroys the context
+            EncoderRuntime::GetShared()->ReleaseContext((CUcontext)m_pDevice);
+            break;
         }
 
         m_pDevice = NULL;
@@ -532,12 +573,8 @@ NVENCSTATUS loadframe(uint8_t *yuvInput[3], HANDLE hInputYUVFile, uint32_t frmId
     }
     return NV_ENC_SUCCESS;
 }
-int lumaPlaneSize, chromaPlaneSize;
-
-int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initialBitrate)
+int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initialBitrate, const char *szOptions, int portOffset)
 {
-    uint8_t *yuv[3];
-    
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
 
     NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::trunc);
@@ -549,7 +586,11 @@ int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initia
     encodeConfig.bitrate = initialBitrate;
     encodeConfig.rcMode = NV_ENC_PARAMS_RC_VBR;
     encodeConfig.gopLength = NVENC_INFINITE_GOPLENGTH;
+    // Recovery points are produced on demand, see RecoveryControl
+    encodeConfig.invalidateRefFramesEnableFlag = 1;
     encodeConfig.deviceType = NV_ENC_CUDA;
+    // Placed by GpuScheduler unless -deviceID pins it
+    encodeConfig.deviceID = -1;
     encodeConfig.codec = NV_ENC_H264;
     encodeConfig.fps = fps;
     encodeConfig.qp = 28;
@@ -558,13 +599,57 @@ int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initia
     encodeConfig.i_quant_offset = DEFAULT_I_QOFFSET;
     encodeConfig.b_quant_offset = DEFAULT_B_QOFFSET;
     encodeConfig.presetGUID = NV_ENC_PRESET_LOW_LATENCY_HP_GUID;
+    static char szDefaultPreset[] = "lowLatencyHP";
+    encodeConfig.encoderPreset = szDefaultPreset;
     encodeConfig.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
     encodeConfig.isYuv444 = 0;
     encodeConfig.width = width;
     encodeConfig.height = height;
     encodeConfig.vbvSize = 0;
     encodeConfig.numB = 0;
+    // Only used with -udp
+    encodeConfig.fecMode = FEC_RS;
+    encodeConfig.fecK = 10;
+    encodeConfig.fecM = 4;
+
+    if (szOptions && *szOptions)
+    {
+        // Split the options in place (strtok is not reentrant and encoders start concurrently);
+        // encodeConfig keeps pointers into m_szOptions
+        strncpy(m_szOptions, szOptions, sizeof(m_szOptions) - 1);
+        m_szOptions[sizeof(m_szOptions) - 1] = '\0';
+        char *argv[64];
+        int argc = 0;
+        for (char *p = m_szOptions; *p && argc < 64;)
+        {
+            while (*p == ' ' || *p == '\t')
+            {
+                *p++ = '\0';
+            }
+            if (*p)
+            {
+                argv[argc++] = p;
+            }
+            while (*p && *p != ' ' && *p != '\t')
+            {
+                p++;
+            }
+        }
+        if (CNvHWEncoder::ParseArguments(&encodeConfig, argc, argv) != NV_ENC_SUCCESS)
+        {
+            NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
+            NvEncoderLogFile << "Invalid encoder options: " << szOptions << "\n";
+            NvEncoderLogFile.close();
+            return 1;
+        }
+    }
+    encodeConfig.portOffset = portOffset;
 
+    void *hSession = NULL;
+    if (encodeConfig.deviceType != NV_ENC_CUDA && encodeConfig.deviceID < 0)
+    {
+        encodeConfig.deviceID = 0;
+    }
     switch (encodeConfig.deviceType)
     {
 #if defined(NV_WINDOWS)
@@ -581,21 +666,79 @@ int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initia
         break;
 #endif
     case NV_ENC_CUDA:
-        InitCuda(encodeConfig.deviceID);
+        m_bPinned = encodeConfig.deviceID >= 0;
+        if (encodeConfig.gpuSessions > 0)
+        {
+            GpuScheduler::GetShared()->SetSessionLimit(encodeConfig.gpuSessions);
+        }
+        if (encodeConfig.cpuThreads > 0)
+        {
+            SoftwareEncoder::SetThreadBudget(encodeConfig.cpuThreads);
+        }
+        for (;;)
+        {
+            int iDevice = GpuScheduler::GetShared()->Place(m_iPlayer, m_iRendition, encodeConfig.deviceID);
+            if (iDevice < 0)
+            {
+                nvStatus = NV_ENC_ERR_NO_ENCODE_DEVICE;
+                break;
+            }
+            nvStatus = OpenCudaSession(iDevice, &hSession);
+            if (nvStatus == NV_ENC_SUCCESS)
+            {
+                m_iDevice = iDevice;
+                m_pMetrics->pGpu->Set(iDevice);
+                break;
+            }
+            // A GPU that refuses the session is full; the next least loaded one is tried unless pinned
+            GpuScheduler::GetShared()->Release(m_iPlayer, m_iRendition);
+            if (m_bPinned || !GpuScheduler::GetShared()->ReportSessionLimit(iDevice))
+            {
+                break;
+            }
+        }
+        if (nvStatus != NV_ENC_SUCCESS)
+        {
+            NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
+            NvEncoderLogFile << "No GPU could open an encode session.\n";
+            NvEncoderLogFile.close();
+            // Rather than leaving the player without a stream, the CPU encodes it until a session frees
+            if (StartSoftwareEncoder(index) != NV_ENC_SUCCESS)
+            {
+                return 1;
+            }
+            m_pNvHWEncoder->m_SinkGraphArray[index].SetKeyFrameRequest([this] { m_Recovery.RequestIdr(); });
+            return 0;
+        }
         break;
     }
 
+    if (StartHardwareEncoder(hSession, index) != NV_ENC_SUCCESS)
+    {
+        return 1;
+    }
+    // A frame the output had to drop breaks the stream until the next key frame
+    m_pNvHWEncoder->m_SinkGraphArray[index].SetKeyFrameRequest([this] { m_Recovery.RequestIdr(); });
+
+    // Frames are encoded straight from the caller's buffer in EncodeFrameLoop
+    return 0;
+}
+
+NVENCSTATUS CNvEncoder::StartHardwareEncoder(void *hSession, int index)
+{
+    NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
+
     if (encodeConfig.deviceType != NV_ENC_CUDA)
         nvStatus = m_pNvHWEncoder->Initialize(m_pDevice, NV_ENC_DEVICE_TYPE_DIRECTX);
     else
-        nvStatus = m_pNvHWEncoder->Initialize(m_pDevice, NV_ENC_DEVICE_TYPE_CUDA);
+        nvStatus = m_pNvHWEncoder->Initialize(m_pDevice, NV_ENC_DEVICE_TYPE_CUDA, hSession);
 
     if (nvStatus != NV_ENC_SUCCESS)
     {
         NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
         NvEncoderLogFile << "m_pNvHWEncoder->Initialize failed.\n";
         NvEncoderLogFile.close();
-        return 1;
+        return nvStatus;
     }
 
     encodeConfig.presetGUID = m_pNvHWEncoder->GetPresetGUID(encodeConfig.encoderPreset, encodeConfig.codec);
@@ -606,7 +749,7 @@ int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initia
         NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
         NvEncoderLogFile << "m_pNvHWEncoder->CreateEncoder failed.\n";
         NvEncoderLogFile.close();
-        return 1;
+        return nvStatus;
     }
     encodeConfig.maxWidth = encodeConfig.maxWidth ? encodeConfig.maxWidth : encodeConfig.width;
     encodeConfig.maxHeight = encodeConfig.maxHeight ? encodeConfig.maxHeight : encodeConfig.height;
@@ -630,6 +773,11 @@ int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initia
         m_uEncodeBufferCount = 1;
         //m_uEncodeBufferCount = NumIOBuffers;
     }
+    if (encodeConfig.enableMEOnly)
+    {
+        // The frame being estimated and its reference, the frame before
+        m_uEncodeBufferCount = 2;
+    }
     m_uPicStruct = encodeConfig.pictureStruct;
     nvStatus = AllocateIOBuffers(encodeConfig.width, encodeConfig.height, encodeConfig.isYuv444);
     if (nvStatus != NV_ENC_SUCCESS)
@@ -637,27 +785,79 @@ int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initia
         NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
         NvEncoderLogFile << "AllocateIOBuffers failed.\n";
         NvEncoderLogFile.close();
-        return 1;
+        return nvStatus;
     }
 
-    uint32_t  chromaFormatIDC = (encodeConfig.isYuv444 ? 3 : 1);
-    lumaPlaneSize = encodeConfig.maxWidth * encodeConfig.maxHeight;
-    chromaPlaneSize = (chromaFormatIDC == 3) ? lumaPlaneSize : (lumaPlaneSize >> 2);
-
-    yuv[0] = new(std::nothrow) uint8_t[lumaPlaneSize];
-    yuv[1] = new(std::nothrow) uint8_t[chromaPlaneSize];
-    yuv[2] = new(std::nothrow) uint8_t[chromaPlaneSize];
+    return NV_ENC_SUCCESS;
+}
 
-    if (yuv[0] == NULL || yuv[1] == NULL || yuv[2] == NULL)
+NVENCSTATUS CNvEncoder::StartSoftwareEncoder(int index)
+{
+    // x264 is the encoder at hand; HEVC and 4:4:4 players stay without a stream as before, and so do
+    // ME-only ones
+    if (encodeConfig.codec != NV_ENC_H264 || encodeConfig.isYuv444 || encodeConfig.enableMEOnly)
+    {
+        return NV_ENC_ERR_UNSUPPORTED_PARAM;
+    }
+    NVENCSTATUS nvStatus = m_pNvHWEncoder->OpenOutput(&encodeConfig, index);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        return nvStatus;
+    }
+    m_pSoftwareEncoder = new SoftwareEncoder();
+    if (!m_pSoftwareEncoder->Open(encodeConfig.width, encodeConfig.height, encodeConfig.fps, encodeConfig.bitrate, encodeConfig.vbvFrames))
     {
-        PRINTERR("\nvEncoder.exe Error: Failed to allocate memory for yuv array!\n");
         NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "Error: Failed to allocate memory for yuv array.\n";
+        NvEncoderLogFile << "No software encoder either.\n";
         NvEncoderLogFile.close();
-        return 1;
+        delete m_pSoftwareEncoder;
+        m_pSoftwareEncoder = NULL;
+        return NV_ENC_ERR_OUT_OF_MEMORY;
     }
+    GpuScheduler::GetShared()->Spill(m_iPlayer, m_iRendition, m_bPinned ? encodeConfig.deviceID : -1);
+    m_pMetrics->pGpu->Set(-1);
+    m_pMetrics->pSoftware->Set(1);
+    m_pMetrics->pSoftwareSpill->Add();
+    return NV_ENC_SUCCESS;
+}
 
-    return 0;
+NVENCSTATUS CNvEncoder::ReturnToHardware(int iDevice, int index)
+{
+    void *hSession = NULL;
+    NVENCSTATUS nvStatus = OpenCudaSession(iDevice, &hSession);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        return nvStatus;
+    }
+    // The stream goes on where the software encoder leaves it: same output, frame numbers and bitrate
+    nvStatus = StartHardwareEncoder(hSession, index);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
+        NvEncoderLogFile << "Return to GPU " << iDevice << " failed.\n";
+        NvEncoderLogFile.close();
+        // Back to where it was: the software encoder carries on, the session and its context go
+        ReleaseIOBuffers();
+        BufferPool::GetShared()->CheckReleased(m_iPlayer, m_iRendition);
+        if (m_pNvHWEncoder->IsEncoderInitialized())
+        {
+            m_pNvHWEncoder->NvEncDestroyEncoder();
+            EncoderRuntime::GetShared()->ReleaseContext((CUcontext)m_pDevice);
+        }
+        else
+        {
+            EncoderSession session = {iDevice, (CUcontext)m_pDevice, hSession};
+            EncoderRuntime::GetShared()->DestroySession(session);
+        }
+        m_pDevice = NULL;
+        return nvStatus;
+    }
+    delete m_pSoftwareEncoder;
+    m_pSoftwareEncoder = NULL;
+    m_iDevice = iDevice;
+    m_pMetrics->pGpu->Set(iDevice);
+    m_pMetrics->pSoftware->Set(0);
+    return NV_ENC_SUCCESS;
 }
 
 void CNvEncoder::ShutdownNvEncoder()
@@ -690,14 +890,91 @@ void CNvEncoder::EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, i
     stEncodeFrame.yuv[1] = buffer + (stEncodeFrame.stride[0] * encodeConfig.height);//yuv[1];
     stEncodeFrame.yuv[2] = buffer + (stEncodeFrame.stride[0] * encodeConfig.height * 5 / 4);//yuv[2];
 
-    EncodeFrame(&stEncodeFrame, index, false, encodeConfig.width, encodeConfig.height);
+    // A move to another GPU, or back from software, waits for an IDR, which the session there starts with anyway
+    bool bOverdue = false;
+    int iMoveTo = (m_iDevice >= 0 && !m_bPinned) || m_pSoftwareEncoder ? GpuScheduler::GetShared()->GetMove(m_iPlayer, m_iRendition, &bOverdue) : -1;
+    if (iMoveTo >= 0)
+    {
+        if (bOverdue && !m_bMoveIdrRequested)
+        {
+            m_Recovery.RequestIdr();
+            m_bMoveIdrRequested = true;
+        }
+        // Motion estimation has no IDRs; any frame can move
+        if (encodeConfig.enableMEOnly || m_Recovery.IsIdrDue(GetTickCount()))
+        {
+            if (m_pSoftwareEncoder)
+            {
+                bool bReturned = ReturnToHardware(iMoveTo, index) == NV_ENC_SUCCESS;
+                GpuScheduler::GetShared()->FinishMove(m_iPlayer, m_iRendition, bReturned);
+                if (!bReturned)
+                {
+                    // The GPU is full after all; the player waits in software for the next free session
+                    GpuScheduler::GetShared()->ReportSessionLimit(iMoveTo);
+                }
+            }
+            else
+            {
+                bool bMoved = MoveSession(iMoveTo, index) == NV_ENC_SUCCESS;
+                GpuScheduler::GetShared()->FinishMove(m_iPlayer, m_iRendition, bMoved);
+                if (!bMoved && !m_pNvHWEncoder->IsEncoderInitialized())
+                {
+                    // Neither GPU kept the encoder; the CPU encodes the player until a session frees
+                    GpuScheduler::GetShared()->Release(m_iPlayer, m_iRendition);
+                    StartSoftwareEncoder(index);
+                }
+            }
+            m_bMoveIdrRequested = false;
+        }
+    }
+
+    if (!m_pSoftwareEncoder && !m_pNvHWEncoder->IsEncoderInitialized())
+    {
+        // A failed move left the player without an encoder, and software could not take it
+        return;
+    }
 
-    if (isReconfiguringBitrate == true)
+    uint64_t qwStartUs = Metrics::NowUs();
+    if (m_pSoftwareEncoder)
+    {
+        EncodeSoftwareFrame(buffer, index);
+    }
+    else if (encodeConfig.enableMEOnly)
+    {
+        MEOnlyConfig stMEOnly;
+        memset(&stMEOnly, 0, sizeof(stMEOnly));
+        memcpy(stMEOnly.yuv[1], stEncodeFrame.yuv, sizeof(stEncodeFrame.yuv));
+        memcpy(stMEOnly.stride, stEncodeFrame.stride, sizeof(stEncodeFrame.stride));
+        stMEOnly.width = encodeConfig.width;
+        stMEOnly.height = encodeConfig.height;
+        RunMotionEstimationOnly(&stMEOnly, index);
+    }
+    else
+    {
+        EncodeFrame(&stEncodeFrame, index, false, encodeConfig.width, encodeConfig.height);
+    }
+    uint64_t qwEncodeUs = Metrics::NowUs() - qwStartUs;
+    m_pMetrics->pEncodeUs->Record(qwEncodeUs);
+    if (m_iDevice >= 0)
+    {
+        GpuScheduler::GetShared()->ReportFrame(m_iPlayer, m_iRendition, qwEncodeUs, encodeConfig.fps, (uint64_t)m_pMetrics->pBufferBytes->Get());
+    }
+
+    if (isReconfiguringBitrate == true && m_pSoftwareEncoder)
+    {
+        // A return to a GPU starts at this bitrate as well
+        m_pMetrics->pReconfigure->Add();
+        m_pSoftwareEncoder->SetBitrate(targetBitrate);
+        encodeConfig.bitrate = targetBitrate;
+    }
+    else if (isReconfiguringBitrate == true && !encodeConfig.enableMEOnly)
     {
+        m_pMetrics->pReconfigure->Add();
         NvEncPictureCommand encPicCommand;
     
         encPicCommand.bBitrateChangePending = true;
-        encPicCommand.newVBVSize = 0;
+        // Keep the VBV the same number of frames long at the new rate; 0 selects one frame
+        encPicCommand.newVBVSize = encodeConfig.vbvFrames > 0 ? (uint32_t)((long long)targetBitrate * encodeConfig.vbvFrames / encodeConfig.fps) : 0;
         encPicCommand.newBitrate = targetBitrate;
     
         encPicCommand.bResolutionChangePending = false;
@@ -707,6 +984,7 @@ void CNvEncoder::EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, i
         NVENCSTATUS status = m_pNvHWEncoder->NvEncReconfigureEncoder(&encPicCommand);
         if (status != NV_ENC_SUCCESS)
         {
+            m_pMetrics->pReconfigureFailure->Add();
             // Common error: NV_ENC_ERR_INVALID_PARAM (== 8)
             printf("Bitrate changing failed! Error is %d\n", status);
             NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
@@ -719,7 +997,6 @@ void CNvEncoder::EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, i
 NVENCSTATUS CNvEncoder::EncodeFrame(EncodeFrameConfig *pEncodeFrame, int index, bool bFlush, uint32_t width, uint32_t height)
 {
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
-    uint32_t lockedPitch = 0;
     EncodeBuffer *pEncodeBuffer = NULL;
 
     if (bFlush)
@@ -741,14 +1018,53 @@ NVENCSTATUS CNvEncoder::EncodeFrame(EncodeFrameConfig *pEncodeFrame, int index,
         return NV_ENC_ERR_INVALID_PARAM;
     }
 
-    pEncodeBuffer = m_EncodeBufferQueue.GetAvailable();
+    pEncodeBuffer = GetAvailableBuffer(index);
     if (!pEncodeBuffer)
     {
-        // This does run
-        m_pNvHWEncoder->ProcessOutput(m_EncodeBufferQueue.GetPending(), index);
-        pEncodeBuffer = m_EncodeBufferQueue.GetAvailable();
+        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
+        NvEncoderLogFile << "No encode buffer. NV_ENC_ERR_OUT_OF_MEMORY.\n";
+        NvEncoderLogFile.close();
+        return NV_ENC_ERR_OUT_OF_MEMORY;
     }
 
+    nvStatus = CopyToInputBuffer(pEncodeBuffer, pEncodeFrame->yuv, width, height);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        return nvStatus;
+    }
+
+    // Serve the viewers' pending IDR and invalidation requests with this frame
+    NvEncPictureCommand encPicCommand;
+    memset(&encPicCommand, 0, sizeof(encPicCommand));
+    bool bRecovery = m_Recovery.Take(m_pNvHWEncoder->m_EncodeIdx, GetTickCount(), &encPicCommand);
+    if (encPicCommand.bInvalidateRefFrames)
+    {
+        if (m_pNvHWEncoder->NvEncInvalidateRefFrames(&encPicCommand) != NV_ENC_SUCCESS)
+        {
+            // The encoder could not find a clean reference; fall back to a key frame
+            encPicCommand.bForceIDR = true;
+        }
+    }
+
+    nvStatus = m_pNvHWEncoder->NvEncEncodeFrame(pEncodeBuffer, bRecovery ? &encPicCommand : NULL, width, height, (NV_ENC_PIC_STRUCT)m_uPicStruct);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
+        NvEncoderLogFile << "m_pNvHWEncoder->NvEncEncodeFrame\n";
+        NvEncoderLogFile.close();
+    }
+    else if (m_pNvHWEncoder->IsSubFrameReadout())
+    {
+        // Stream the slices of this frame while it is encoded rather than when its buffer is reused
+        ProcessPendingBuffer(index);
+    }
+    return nvStatus;
+}
+
+NVENCSTATUS CNvEncoder::CopyToInputBuffer(EncodeBuffer *pEncodeBuffer, uint8_t *yuv[3], uint32_t width, uint32_t height)
+{
+    NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
+    uint32_t lockedPitch = 0;
     unsigned char *pInputSurface;
 
     nvStatus = m_pNvHWEncoder->NvEncLockInputBuffer(pEncodeBuffer->stInputBfr.hInputSurface, (void**)&pInputSurface, &lockedPitch);
@@ -764,14 +1080,14 @@ NVENCSTATUS CNvEncoder::EncodeFrame(EncodeFrameConfig *pEncodeFrame, int index,
     if (pEncodeBuffer->stInputBfr.bufferFmt == NV_ENC_BUFFER_FORMAT_NV12_PL)
     {
         unsigned char *pInputSurfaceCh = pInputSurface + (pEncodeBuffer->stInputBfr.dwHeight*lockedPitch);
-        convertYUVpitchtoNV12(pEncodeFrame->yuv[0], pEncodeFrame->yuv[1], pEncodeFrame->yuv[2], pInputSurface, pInputSurfaceCh, width, height, width, lockedPitch);
+        convertYUVpitchtoNV12(yuv[0], yuv[1], yuv[2], pInputSurface, pInputSurfaceCh, width, height, width, lockedPitch);
     }
     else
     {
         // Does not run
         unsigned char *pInputSurfaceCb = pInputSurface + (pEncodeBuffer->stInputBfr.dwHeight * lockedPitch);
         unsigned char *pInputSurfaceCr = pInputSurfaceCb + (pEncodeBuffer->stInputBfr.dwHeight * lockedPitch);
-        convertYUVpitchtoYUV444(pEncodeFrame->yuv[0], pEncodeFrame->yuv[1], pEncodeFrame->yuv[2], pInputSurface, pInputSurfaceCb, pInputSurfaceCr, width, height, width, lockedPitch);
+        convertYUVpitchtoYUV444(yuv[0], yuv[1], yuv[2], pInputSurface, pInputSurfaceCb, pInputSurfaceCr, width, height, width, lockedPitch);
     }
     nvStatus = m_pNvHWEncoder->NvEncUnlockInputBuffer(pEncodeBuffer->stInputBfr.hInputSurface);
     if (nvStatus != NV_ENC_SUCCESS)
@@ -782,12 +1098,126 @@ NVENCSTATUS CNvEncoder::EncodeFrame(EncodeFrameConfig *pEncodeFrame, int index,
         NvEncoderLogFile.close();
         return nvStatus;
     }
-    nvStatus = m_pNvHWEncoder->NvEncEncodeFrame(pEncodeBuffer, NULL, width, height, (NV_ENC_PIC_STRUCT)m_uPicStruct);
+    return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS CNvEncoder::RunMotionEstimationOnly(MEOnlyConfig *pMEOnly, int index, bool bFlush)
+{
+    if (bFlush)
+    {
+        // The next frame has nothing to be compared with
+        m_pMEReference = NULL;
+        return NV_ENC_SUCCESS;
+    }
+
+    // The two buffers take turns as the frame and its reference
+    EncodeBuffer *pEncodeBuffer[2];
+    pEncodeBuffer[0] = m_pMEReference;
+    pEncodeBuffer[1] = m_pMEReference == &m_stEncodeBuffer[0] ? &m_stEncodeBuffer[1] : &m_stEncodeBuffer[0];
+    NVENCSTATUS nvStatus = CopyToInputBuffer(pEncodeBuffer[1], pMEOnly->yuv[1], pMEOnly->width, pMEOnly->height);
     if (nvStatus != NV_ENC_SUCCESS)
+    {
+        m_pMEReference = NULL;
+        return nvStatus;
+    }
+
+    uint32_t uInputIdx = m_pNvHWEncoder->m_EncodeIdx++;
+    if (m_pMEReference)
+    {
+        pMEOnly->inputFrameIndex = uInputIdx;
+        pMEOnly->referenceFrameIndex = m_uMEReferenceIdx;
+        nvStatus = m_pNvHWEncoder->NvRunMotionEstimationOnly(pEncodeBuffer, pMEOnly, index);
+        if (nvStatus != NV_ENC_SUCCESS)
+        {
+            NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
+            NvEncoderLogFile << "m_pNvHWEncoder->NvRunMotionEstimationOnly\n";
+            NvEncoderLogFile.close();
+        }
+    }
+    m_pMEReference = pEncodeBuffer[1];
+    m_uMEReferenceIdx = uInputIdx;
+    return nvStatus;
+}
+
+void CNvEncoder::EncodeSoftwareFrame(uint8_t *buffer, int index)
+{
+    // Frames are numbered on as in NVENC. x264 behind ffmpeg cannot invalidate references, so a loss is
+    // recovered with an IDR
+    NvEncPictureCommand encPicCommand;
+    memset(&encPicCommand, 0, sizeof(encPicCommand));
+    bool bRecovery = m_Recovery.Take(m_pNvHWEncoder->m_EncodeIdx++, GetTickCount(), &encPicCommand);
+    bool bIdr = bRecovery && (encPicCommand.bForceIDR || encPicCommand.bInvalidateRefFrames);
+    if (!m_pSoftwareEncoder->Encode(buffer, bIdr, m_vAccessUnit))
     {
         NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "m_pNvHWEncoder->NvEncEncodeFrame\n";
+        NvEncoderLogFile << "m_pSoftwareEncoder->Encode failed.\n";
         NvEncoderLogFile.close();
+        return;
     }
-    return nvStatus;
+    m_pNvHWEncoder->WriteOutput(m_vAccessUnit.data(), (uint32_t)m_vAccessUnit.size(), index);
+    RecordOutput(index);
+}
+
+EncodeBuffer *CNvEncoder::GetAvailableBuffer(int index)
+{
+    EncodeBuffer *pEncodeBuffer = NULL;
+    if (!m_FreeBufferQueue.Pop(pEncodeBuffer))
+    {
+        // All buffers are in flight; reuse the oldest once its frame is written
+        if (!m_PendingBufferQueue.Pop(pEncodeBuffer))
+        {
+            return NULL;
+        }
+        ProcessOutput(pEncodeBuffer, index);
+    }
+    m_PendingBufferQueue.Push(pEncodeBuffer);
+    return pEncodeBuffer;
+}
+
+bool CNvEncoder::ProcessPendingBuffer(int index)
+{
+    EncodeBuffer *pEncodeBuffer = NULL;
+    if (!m_PendingBufferQueue.Pop(pEncodeBuffer))
+    {
+        return false;
+    }
+    ProcessOutput(pEncodeBuffer, index);
+    m_FreeBufferQueue.Push(pEncodeBuffer);
+    return true;
+}
+
+void CNvEncoder::ProcessOutput(EncodeBuffer *pEncodeBuffer, int index)
+{
+    if (m_pNvHWEncoder->ProcessOutput(pEncodeBuffer, index) == NV_ENC_SUCCESS && !pEncodeBuffer->stOutputBfr.bEOSFlag)
+    {
+        RecordOutput(index);
+    }
+}
+
+void CNvEncoder::RecordOutput(int index)
+{
+    const NalIndex &nalIndex = m_pNvHWEncoder->m_NalIndexArray[index];
+    uint32_t cb = (uint32_t)nalIndex.GetAccessUnitSize();
+    m_Recovery.RecordFrame(nalIndex.IsKeyFrame(), cb);
+    m_uFrameBytesPeak = cb > m_uFrameBytesPeak ? cb : m_uFrameBytesPeak;
+    m_qwFrameBytesSum += cb;
+    m_uFrameSizeCount++;
+}
+
+double CNvEncoder::TakePeakToAverage(uint32_t *pPeakBytes, uint32_t *pAverageBytes)
+{
+    uint32_t uAverage = m_uFrameSizeCount ? (uint32_t)(m_qwFrameBytesSum / m_uFrameSizeCount) : 0;
+    double ratio = uAverage ? (double)m_uFrameBytesPeak / uAverage : 0.0;
+    if (pPeakBytes)
+    {
+        *pPeakBytes = m_uFrameBytesPeak;
+    }
+    if (pAverageBytes)
+    {
+        *pAverageBytes = uAverage;
+    }
+    m_uFrameBytesPeak = 0;
+    m_qwFrameBytesSum = 0;
+    m_uFrameSizeCount = 0;
+    return ratio;
 }
\ No newline at end of file
@@ -20,72 +20,15 @@
 #endif
 
 #include "../common/inc/NvHWEncoder.h"
+#include "../common/RecoveryControl.h"
+#include "../common/BoundedQueue.h"
+#include "../common/SoftwareEncoder.h"
 
 #define MAX_ENCODE_QUEUE 32
 #define FRAME_QUEUE 240
 
 #define SET_VER(configStruct, type) {configStruct.version = type##_VER;}
 
-template<class T>
-class CNvQueue {
-    T** m_pBuffer;
-    unsigned int m_uSize;
-    unsigned int m_uPendingCount;
-    unsigned int m_uAvailableIdx;
-    unsigned int m_uPendingndex;
-public:
-    CNvQueue() : m_pBuffer(NULL), m_uSize(0), m_uPendingCount(0), m_uAvailableIdx(0),
-        m_uPendingndex(0)
-    {
-    }
-
-    ~CNvQueue()
-    {
-        delete[] m_pBuffer;
-    }
-
-    bool Initialize(T *pItems, unsigned int uSize)
-    {
-        m_uSize = uSize;
-        m_uPendingCount = 0;
-        m_uAvailableIdx = 0;
-        m_uPendingndex = 0;
-        m_pBuffer = new T *[m_uSize];
-        for (unsigned int i = 0; i < m_uSize; i++)
-        {
-            m_pBuffer[i] = &pItems[i];
-        }
-        return true;
-    }
-
-
-    T * GetAvailable()
-    {
-        T *pItem = NULL;
-        if (m_uPendingCount == m_uSize)
-        {
-            return NULL;
-        }
-        pItem = m_pBuffer[m_uAvailableIdx];
-        m_uAvailableIdx = (m_uAvailableIdx + 1) % m_uSize;
-        m_uPendingCount += 1;
-        return pItem;
-    }
-
-    T* GetPending()
-    {
-        if (m_uPendingCount == 0)
-        {
-            return NULL;
-        }
-
-        T *pItem = m_pBuffer[m_uPendingndex];
-        m_uPendingndex = (m_uPendingndex + 1) % m_uSize;
-        m_uPendingCount -= 1;
-        return pItem;
-    }
-};
-
 typedef struct _EncodeFrameConfig
 {
     uint8_t  *yuv[3];
@@ -105,12 +48,43 @@ typedef enum
 class CNvEncoder
 {
 public:
-    CNvEncoder(int index);
+    // iRendition > 0 marks a simulcast rendition of the player, which gets its own metrics
+    CNvEncoder(int index, int iRendition = 0);
     virtual ~CNvEncoder();
 
-    int                                                  EncodeMain(int index, int width, int height, int fps, int initialBitrate);
+    /* szOptions takes the command line options of CNvHWEncoder::ParseArguments
+       (e.g. "-intraRefresh 1 -intraRefreshPeriod 60 -intraRefreshDuration 10 -sliceMode 3 -sliceModeData 4 -vbvFrames 1")
+       and overrides the defaults of the shim. "-subFrame 1" streams every slice as soon as it is encoded.
+       "-udp host:port -fec 2 -fecK 10 -fecM 4" sends the stream over UDP with Reed-Solomon FEC (-fec 1 for XOR)
+       instead of through ffmpeg. portOffset moves the output port of a simulcast rendition away from the player's.
+       An H.264 player that finds every GPU full is encoded by SoftwareEncoder, on at most "-cpuThreads <n>" threads
+       shared by all such players, until a session frees. "-meonly 1" only estimates motion and writes the vectors
+       in the binary format of MotionExport to motion<index>[_<portOffset>].mv (the prefix is "-o" if given).
+       "-record <prefix>" also writes the stream to <prefix><index>[_<portOffset>].h264 (.hevc), and "-sinkPlugin <dll>"
+       hands it to a plugin of SinkPlugin.h; every such sink gets the same packets and drops on its own.*/
+    int                                                  EncodeMain(int index, int width, int height, int fps, int initialBitrate, const char *szOptions = NULL, int portOffset = 0);
     void                                                 EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, int index, int targetBitrate);
     void                                                 ShutdownNvEncoder();
+    RecoveryControl                                     *GetRecoveryControl() { return &m_Recovery; }
+    // Peak-to-average frame size since the last call; the peak and average sizes are optional outputs
+    double                                               TakePeakToAverage(uint32_t *pPeakBytes = NULL, uint32_t *pAverageBytes = NULL);
+    // The player's slice readout, or NULL unless the encoder runs in sub-frame mode
+    SliceReadout                                        *GetSliceReadout(int index) { return m_pNvHWEncoder && m_pNvHWEncoder->IsSubFrameReadout() ? &m_pNvHWEncoder->m_SliceReadoutArray[index] : NULL; }
+    // The motion of the last frame; false unless the encoder runs in ME-only mode ("-meonly 1")
+    bool                                                 GetMotionSummary(int index, MotionSummary *pSummary)
+    {
+        if (!encodeConfig.enableMEOnly || !m_pNvHWEncoder || !m_pNvHWEncoder->m_MotionExportArray[index].GetFrameCount())
+        {
+            return false;
+        }
+        *pSummary = m_pNvHWEncoder->m_MotionExportArray[index].GetSummary();
+        return true;
+    }
+    // The CPU encoder of a spilled player, or NULL while the player is on a GPU
+    SoftwareEncoder                                     *GetSoftwareEncoder() { return m_pSoftwareEncoder; }
+    SinkGraph                                           *GetSinkGraph(int index) { return m_pNvHWEncoder ? &m_pNvHWEncoder->m_SinkGraphArray[index] : NULL; }
+    // The player's UDP output, or NULL unless the encoder sends over UDP
+    FecSender                                           *GetFecSender(int index) { return m_pNvHWEncoder && m_pNvHWEncoder->m_FecSenderArray[index].IsOpen() ? &m_pNvHWEncoder->m_FecSenderArray[index] : NULL; }
     EncodeConfig                                         encodeConfig;
 
 protected:
@@ -125,8 +99,31 @@ protected:
     CUcontext                                            m_cuContext;
     EncodeConfig                                         m_stEncoderInput;
     EncodeBuffer                                         m_stEncodeBuffer[MAX_ENCODE_QUEUE];
-    CNvQueue<EncodeBuffer>                               m_EncodeBufferQueue;
+    // Buffers free for a new frame, and the buffers of submitted frames in encode order. Both ends of
+    // both queues run on the encode thread for now; the SPSC ordering is there for when the drain
+    // side gets its own thread, and only Test/BoundedQueueTest.cpp exercises it across threads.
+    SpscQueue<EncodeBuffer *, MAX_ENCODE_QUEUE>          m_FreeBufferQueue;
+    SpscQueue<EncodeBuffer *, MAX_ENCODE_QUEUE>          m_PendingBufferQueue;
     EncodeOutputBuffer                                   m_stEOSOutputBfr;
+    RecoveryControl                                      m_Recovery;
+    char                                                 m_szOptions[256];
+    uint32_t                                             m_uFrameBytesPeak;
+    uint64_t                                             m_qwFrameBytesSum;
+    uint32_t                                             m_uFrameSizeCount;
+    PlayerMetrics                                       *m_pMetrics;
+    // Owner of the buffers in the BufferPool ledger
+    int                                                  m_iPlayer;
+    int                                                  m_iRendition;
+    // CUDA device of the session, -1 for DirectX; placed by GpuScheduler unless pinned with -deviceID
+    int                                                  m_iDevice;
+    bool                                                 m_bPinned;
+    bool                                                 m_bMoveIdrRequested;
+    // Encodes the stream while no GPU has a free session, NULL otherwise
+    SoftwareEncoder                                     *m_pSoftwareEncoder;
+    std::vector<uint8_t>                                 m_vAccessUnit;
+    // ME-only mode: the buffer holding the previous frame, NULL before the first, and its number
+    EncodeBuffer                                        *m_pMEReference;
+    uint32_t                                             m_uMEReferenceIdx;
 
 protected:
     NVENCSTATUS                                          Deinitialize(uint32_t devicetype);
@@ -134,12 +131,31 @@ protected:
     NVENCSTATUS                                          InitD3D9(uint32_t deviceID = 0);
     NVENCSTATUS                                          InitD3D11(uint32_t deviceID = 0);
     NVENCSTATUS                                          InitD3D10(uint32_t deviceID = 0);
-    NVENCSTATUS                                          InitCuda(uint32_t deviceID = 0);
+    // Takes a pre-opened session of the device or opens one; m_pDevice is then its context
+    NVENCSTATUS                                          OpenCudaSession(int iDevice, void **phSession);
+    // Continues the stream on another GPU from the next frame, which must be an IDR
+    NVENCSTATUS                                          MoveSession(int iDevice, int index);
+    // Initializes the NVENC encoder on the session and allocates its buffers; the output is opened unless it is
+    NVENCSTATUS                                          StartHardwareEncoder(void *hSession, int index);
+    // Spills the player to the CPU when every GPU is full
+    NVENCSTATUS                                          StartSoftwareEncoder(int index);
+    // Continues a spilled stream on a GPU from the next frame, which must be an IDR
+    NVENCSTATUS                                          ReturnToHardware(int iDevice, int index);
+    void                                                 EncodeSoftwareFrame(uint8_t *buffer, int index);
+    // Accounts for the access unit just written to the output
+    void                                                 RecordOutput(int index);
     NVENCSTATUS                                          AllocateIOBuffers(uint32_t uInputWidth, uint32_t uInputHeight, uint32_t isYuv444);
     NVENCSTATUS                                          ReleaseIOBuffers();
     unsigned char*                                       LockInputBuffer(void * hInputSurface, uint32_t *pLockedPitch);
     NVENCSTATUS                                          FlushEncoder(int index);
-    NVENCSTATUS                                          RunMotionEstimationOnly(MEOnlyConfig *pMEOnly, bool bFlush);
+    void                                                 ProcessOutput(EncodeBuffer *pEncodeBuffer, int index);
+    // A free buffer, or the oldest pending one once its output is written; the buffer is then pending
+    EncodeBuffer                                        *GetAvailableBuffer(int index);
+    // Writes the output of the oldest pending frame and frees its buffer; false if nothing is pending
+    bool                                                 ProcessPendingBuffer(int index);
+    // Uploads the frame in pMEOnly->yuv[1] and estimates its motion against the previous one
+    NVENCSTATUS                                          RunMotionEstimationOnly(MEOnlyConfig *pMEOnly, int index, bool bFlush = false);
+    NVENCSTATUS                                          CopyToInputBuffer(EncodeBuffer *pEncodeBuffer, uint8_t *yuv[3], uint32_t width, uint32_t height);
 };
 
 // NVEncodeAPI entry point
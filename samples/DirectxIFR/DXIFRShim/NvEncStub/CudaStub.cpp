@@ -0,0 +1,246 @@
+/*!
+ * \brief
+ * CUDA driver entry points of the stub driver
+ *
+ * \file
+ *
+ * Only what dynlink_cuda loads and the shim calls: devices, their
+ * properties and contexts. A context is an NvEncStubContext that
+ * nvEncOpenEncodeSessionEx reads the device from. The _v2 names are the
+ * ones dynlink_cuda looks up with the default __CUDA_API_VERSION.
+ *
+ * The dynlink headers are not included, since they declare these names as
+ * function pointers.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "NvEncStub.h"
+
+#if defined(_WIN32)
+#define CUDAAPI __stdcall
+#else
+#define CUDAAPI
+#endif
+
+typedef int CUresult;
+typedef int CUdevice;
+typedef NvEncStubContext *CUcontext;
+
+#define CUDA_SUCCESS 0
+#define CUDA_ERROR_INVALID_VALUE 1
+#define CUDA_ERROR_NOT_INITIALIZED 3
+#define CUDA_ERROR_INVALID_DEVICE 101
+#define CUDA_ERROR_INVALID_CONTEXT 201
+#define CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT 16
+#define CU_DEVICE_ATTRIBUTE_COMPUTE_MODE 20
+
+static bool bInitialized = false;
+#if defined(_WIN32)
+static __declspec(thread) std::vector<CUcontext> *pvContextStack = NULL;
+#else
+static __thread std::vector<CUcontext> *pvContextStack = NULL;
+#endif
+
+static int DeviceCount()
+{
+	NvEncStubModel model;
+	NvEncStubGetModel(&model);
+	return (int)model.nGpu;
+}
+
+static std::vector<CUcontext> &ContextStack()
+{
+	if (!pvContextStack) {
+		pvContextStack = new std::vector<CUcontext>;
+	}
+	return *pvContextStack;
+}
+
+static bool IsContext(CUcontext ctx)
+{
+	return ctx && ctx->dwMagic == NVENC_STUB_CONTEXT_MAGIC;
+}
+
+extern "C" {
+
+CUresult CUDAAPI cuInit(unsigned int Flags)
+{
+	bInitialized = true;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuDriverGetVersion(int *driverVersion)
+{
+	*driverVersion = 7050;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuDeviceGetCount(int *count)
+{
+	if (!bInitialized) {
+		return CUDA_ERROR_NOT_INITIALIZED;
+	}
+	*count = DeviceCount();
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuDeviceGet(CUdevice *device, int ordinal)
+{
+	if (!bInitialized) {
+		return CUDA_ERROR_NOT_INITIALIZED;
+	}
+	if (ordinal < 0 || ordinal >= DeviceCount()) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+	*device = ordinal;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuDeviceGetName(char *name, int len, CUdevice dev)
+{
+	if (dev < 0 || dev >= DeviceCount()) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+	if (len <= 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+	char szName[32];
+	sprintf(szName, "NvEncStub GPU %d", dev);
+	strncpy(name, szName, len - 1);
+	name[len - 1] = '\0';
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuDeviceComputeCapability(int *major, int *minor, CUdevice dev)
+{
+	if (dev < 0 || dev >= DeviceCount()) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+	*major = 5;
+	*minor = 2;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuDeviceGetAttribute(int *pi, int attrib, CUdevice dev)
+{
+	if (dev < 0 || dev >= DeviceCount()) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+	*pi = attrib == CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT ? 16 : attrib == CU_DEVICE_ATTRIBUTE_COMPUTE_MODE ? 0 : 1;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuDeviceTotalMem_v2(size_t *bytes, CUdevice dev)
+{
+	if (dev < 0 || dev >= DeviceCount()) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+	*bytes = (size_t)4 << 30;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuDeviceTotalMem(unsigned int *bytes, CUdevice dev)
+{
+	size_t cb;
+	CUresult result = cuDeviceTotalMem_v2(&cb, dev);
+	*bytes = (unsigned int)(cb > 0xFFFFFFFFu ? 0xFFFFFFFFu : cb);
+	return result;
+}
+
+CUresult CUDAAPI cuCtxCreate_v2(CUcontext *pctx, unsigned int flags, CUdevice dev)
+{
+	if (!bInitialized) {
+		return CUDA_ERROR_NOT_INITIALIZED;
+	}
+	if (dev < 0 || dev >= DeviceCount()) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+	// Like the driver, the new context is current on the calling thread
+	CUcontext ctx = new NvEncStubContext;
+	ctx->dwMagic = NVENC_STUB_CONTEXT_MAGIC;
+	ctx->iDevice = dev;
+	ContextStack().push_back(ctx);
+	*pctx = ctx;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuCtxCreate(CUcontext *pctx, unsigned int flags, CUdevice dev)
+{
+	return cuCtxCreate_v2(pctx, flags, dev);
+}
+
+CUresult CUDAAPI cuCtxDestroy_v2(CUcontext ctx)
+{
+	if (!IsContext(ctx)) {
+		return CUDA_ERROR_INVALID_CONTEXT;
+	}
+	std::vector<CUcontext> &vStack = ContextStack();
+	if (!vStack.empty() && vStack.back() == ctx) {
+		vStack.pop_back();
+	}
+	ctx->dwMagic = 0;
+	delete ctx;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuCtxDestroy(CUcontext ctx)
+{
+	return cuCtxDestroy_v2(ctx);
+}
+
+CUresult CUDAAPI cuCtxPushCurrent_v2(CUcontext ctx)
+{
+	if (!IsContext(ctx)) {
+		return CUDA_ERROR_INVALID_CONTEXT;
+	}
+	ContextStack().push_back(ctx);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuCtxPushCurrent(CUcontext ctx)
+{
+	return cuCtxPushCurrent_v2(ctx);
+}
+
+CUresult CUDAAPI cuCtxPopCurrent_v2(CUcontext *pctx)
+{
+	std::vector<CUcontext> &vStack = ContextStack();
+	if (vStack.empty()) {
+		return CUDA_ERROR_INVALID_CONTEXT;
+	}
+	if (pctx) {
+		*pctx = vStack.back();
+	}
+	vStack.pop_back();
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuCtxPopCurrent(CUcontext *pctx)
+{
+	return cuCtxPopCurrent_v2(pctx);
+}
+
+CUresult CUDAAPI cuCtxGetDevice(CUdevice *device)
+{
+	std::vector<CUcontext> &vStack = ContextStack();
+	if (vStack.empty()) {
+		return CUDA_ERROR_INVALID_CONTEXT;
+	}
+	*device = vStack.back()->iDevice;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI cuCtxSynchronize()
+{
+	return ContextStack().empty() ? CUDA_ERROR_INVALID_CONTEXT : CUDA_SUCCESS;
+}
+
+}
@@ -0,0 +1,1078 @@
+/*!
+ * \brief
+ * NVENC entry points of the stub driver
+ *
+ * \file
+ *
+ * One mutex guards the stub. Nothing waits while holding it: a blocking
+ * nvEncLockBitstream copies the frame's completion time and sleeps outside,
+ * and the completion events are signaled by a thread of their own.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <thread>
+#include <vector>
+#include "inc/nvEncodeAPI.h"
+#include "NvEncStub.h"
+
+#define STUB_MAX_SLICE 32
+// Bit rate and frame rate assumed when the session sets none
+#define STUB_DEFAULT_BITRATE 5000000
+#define STUB_DEFAULT_FPS 30
+
+struct StubFrame {
+	bool bValid;
+	uint32_t dwFrame;
+	uint64_t qwTimeStamp;
+	NV_ENC_PIC_TYPE picType;
+	uint32_t cb;
+	// Start of every slice; the first one includes the parameter sets
+	std::vector<uint32_t> vSliceOffset;
+	// Modeled times on the stub's clock
+	uint64_t qwSubmitUs;
+	uint64_t qwStartUs;
+	uint64_t qwDoneUs;
+};
+
+struct StubBitstream {
+	std::vector<uint8_t> vData;
+	StubFrame frame;
+};
+
+struct StubInput {
+	uint32_t dwWidth;
+	uint32_t dwHeight;
+	uint32_t dwPitch;
+	std::vector<uint8_t> vData;
+};
+
+struct StubSession {
+	int iDevice;
+	// Opening order, which seeds the frames of the session
+	uint32_t dwOrdinal;
+	bool bInitialized;
+	NV_ENC_INITIALIZE_PARAMS initParams;
+	NV_ENC_CONFIG config;
+	uint32_t dwFrame;
+	uint32_t dwSinceIdr;
+	bool bForceIdr;
+	// The next frame references an older one after an invalidation and costs more
+	bool bRecovery;
+	std::map<void *, StubInput *> mpInput;
+	std::map<void *, StubBitstream *> mpBitstream;
+	// The handle of an MV buffer is its NV_ENC_H264_MV_DATA array
+	std::map<void *, std::vector<NV_ENC_H264_MV_DATA> *> mpMV;
+	std::map<void *, NV_ENC_BUFFER_FORMAT> mpResource;
+	std::set<void *> setEvent;
+};
+
+static std::mutex mtxStub;
+static bool bModelLoaded = false;
+static NvEncStubModel model;
+static NvEncStubStats stats;
+static FILE *fpTrace = NULL;
+static uint32_t dwNextOrdinal = 0;
+static std::map<int, int> mpDeviceSession;
+// When each encode engine of a device is free again
+static std::map<int, std::vector<uint64_t> > mpEngineFreeUs;
+static std::set<StubSession *> setSession;
+
+static std::condition_variable cvCompletion;
+static bool bCompletionThread = false;
+typedef std::pair<uint64_t, void *> Completion;
+static std::priority_queue<Completion, std::vector<Completion>, std::greater<Completion> > pqCompletion;
+// Registered events; an event unregistered before its frame completes is not signaled
+static std::multiset<void *> msetLiveEvent;
+
+static uint64_t NowUs()
+{
+	static const std::chrono::steady_clock::time_point tpStart = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tpStart).count();
+}
+
+static void DefaultModel(NvEncStubModel *pModel)
+{
+	memset(pModel, 0, sizeof(*pModel));
+	pModel->dwLatencyUs = 2000;
+	pModel->dwLatencyPerMpixUs = 1500;
+	pModel->dwIdrLatencyUs = 1000;
+	pModel->dwJitterUs = 300;
+	pModel->nEngine = 1;
+	pModel->nMaxSession = 0;
+	pModel->nGpu = 1;
+	pModel->idrSizeRatio = 4.0;
+	pModel->dwSizeJitterPercent = 10;
+	pModel->dwEventDelayUs = 100;
+	pModel->timeScale = 1.0;
+	pModel->dwSeed = 1;
+}
+
+static void ParseModel(const char *szModel, NvEncStubModel *pModel)
+{
+	while (szModel && *szModel) {
+		const char *szEnd = strchr(szModel, ',');
+		size_t cch = szEnd ? (size_t)(szEnd - szModel) : strlen(szModel);
+		char szPair[300] = {0};
+		strncpy(szPair, szModel, std::min(cch, sizeof(szPair) - 1));
+		szModel = szEnd ? szEnd + 1 : NULL;
+
+		char *szValue = strchr(szPair, '=');
+		if (!szValue) {
+			continue;
+		}
+		*szValue++ = '\0';
+		unsigned long ul = strtoul(szValue, NULL, 10);
+		if (!strcmp(szPair, "latency")) pModel->dwLatencyUs = ul;
+		else if (!strcmp(szPair, "perMpix")) pModel->dwLatencyPerMpixUs = ul;
+		else if (!strcmp(szPair, "idrLatency")) pModel->dwIdrLatencyUs = ul;
+		else if (!strcmp(szPair, "jitter")) pModel->dwJitterUs = ul;
+		else if (!strcmp(szPair, "engines")) pModel->nEngine = std::max(1ul, ul);
+		else if (!strcmp(szPair, "sessions")) pModel->nMaxSession = ul;
+		else if (!strcmp(szPair, "gpus")) pModel->nGpu = ul;
+		else if (!strcmp(szPair, "idrSize")) pModel->idrSizeRatio = strtod(szValue, NULL);
+		else if (!strcmp(szPair, "sizeJitter")) pModel->dwSizeJitterPercent = std::min(100ul, ul);
+		else if (!strcmp(szPair, "eventDelay")) pModel->dwEventDelayUs = ul;
+		else if (!strcmp(szPair, "timeScale")) pModel->timeScale = std::max(0.0, strtod(szValue, NULL));
+		else if (!strcmp(szPair, "seed")) pModel->dwSeed = ul;
+		else if (!strcmp(szPair, "trace")) strncpy(pModel->szTrace, szValue, sizeof(pModel->szTrace) - 1);
+		else fprintf(stderr, "NvEncStub: unknown model key %s\n", szPair);
+	}
+}
+
+// Called with mtxStub held
+static void ApplyModel(const NvEncStubModel &newModel)
+{
+	bool bNewTrace = !bModelLoaded || strcmp(newModel.szTrace, model.szTrace);
+	model = newModel;
+	bModelLoaded = true;
+	if (!bNewTrace) {
+		return;
+	}
+	if (fpTrace) {
+		fclose(fpTrace);
+		fpTrace = NULL;
+	}
+	if (model.szTrace[0]) {
+		fpTrace = fopen(model.szTrace, "w");
+		if (fpTrace) {
+			fprintf(fpTrace, "session,frame,type,bytes,submit_us,start_us,done_us\n");
+		} else {
+			fprintf(stderr, "NvEncStub: cannot write %s\n", model.szTrace);
+		}
+	}
+}
+
+// Called with mtxStub held
+static void LoadModel()
+{
+	if (bModelLoaded) {
+		return;
+	}
+	NvEncStubModel newModel;
+	DefaultModel(&newModel);
+	ParseModel(getenv(NVENC_STUB_ENV), &newModel);
+	ApplyModel(newModel);
+}
+
+// A number from the seed, the session and the frame alone (splitmix64)
+static uint64_t Hash(uint32_t dwSeed, uint32_t dwOrdinal, uint32_t dwFrame, uint32_t dwSalt)
+{
+	uint64_t x = ((uint64_t)dwSeed << 32 | dwOrdinal) ^ ((uint64_t)dwFrame << 8 | dwSalt) * 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+// A value in [-range, range]
+static int64_t Jitter(uint64_t h, uint32_t range)
+{
+	return range ? (int64_t)(h % (2ull * range + 1)) - range : 0;
+}
+
+static uint64_t Scale(int64_t us)
+{
+	return us > 0 ? (uint64_t)(us * model.timeScale) : 0;
+}
+
+static void CompletionThread()
+{
+	std::unique_lock<std::mutex> lock(mtxStub);
+	for (;;) {
+		if (pqCompletion.empty()) {
+			cvCompletion.wait(lock);
+			continue;
+		}
+		uint64_t qwNowUs = NowUs();
+		Completion completion = pqCompletion.top();
+		if (completion.first > qwNowUs) {
+			cvCompletion.wait_for(lock, std::chrono::microseconds(completion.first - qwNowUs));
+			continue;
+		}
+		pqCompletion.pop();
+#if defined(_WIN32)
+		if (msetLiveEvent.count(completion.second)) {
+			SetEvent((HANDLE)completion.second);
+		}
+#endif
+	}
+}
+
+// Called with mtxStub held
+static void ScheduleCompletion(void *hEvent, uint64_t qwDueUs)
+{
+	if (!bCompletionThread) {
+		bCompletionThread = true;
+		std::thread(CompletionThread).detach();
+	}
+	pqCompletion.push(Completion(qwDueUs, hEvent));
+	cvCompletion.notify_one();
+}
+
+static bool IsHevc(const StubSession *pSession)
+{
+	return !memcmp(&pSession->initParams.encodeGUID, &NV_ENC_CODEC_HEVC_GUID, sizeof(GUID));
+}
+
+static uint32_t SliceCount(const StubSession *pSession)
+{
+	uint32_t dwSliceMode, dwSliceModeData;
+	if (IsHevc(pSession)) {
+		dwSliceMode = pSession->config.encodeCodecConfig.hevcConfig.sliceMode;
+		dwSliceModeData = pSession->config.encodeCodecConfig.hevcConfig.sliceModeData;
+	} else {
+		dwSliceMode = pSession->config.encodeCodecConfig.h264Config.sliceMode;
+		dwSliceModeData = pSession->config.encodeCodecConfig.h264Config.sliceModeData;
+	}
+	return dwSliceMode == 3 ? std::max(1u, std::min(dwSliceModeData, (uint32_t)STUB_MAX_SLICE)) : 1;
+}
+
+static uint32_t IdrPeriod(const StubSession *pSession)
+{
+	uint32_t dwPeriod = IsHevc(pSession) ? pSession->config.encodeCodecConfig.hevcConfig.idrPeriod
+		: pSession->config.encodeCodecConfig.h264Config.idrPeriod;
+	return dwPeriod ? dwPeriod : pSession->config.gopLength;
+}
+
+// Canned parameter sets; the consumers only look at the NAL types
+static size_t WriteParameterSets(bool bHevc, uint8_t *p, size_t cbMax)
+{
+	static const uint8_t abH264[] = {
+		0, 0, 0, 1, 0x67, 0x64, 0x00, 0x28, 0xAC, 0x2B, 0x40, 0x3C, 0x01, 0x13, 0xF2, 0xC0, 0x3C, 0x48, 0x9A, 0x80,
+		0, 0, 0, 1, 0x68, 0xEE, 0x3C, 0xB0,
+	};
+	static const uint8_t abHevc[] = {
+		0, 0, 0, 1, 0x40, 0x01, 0x0C, 0x01, 0xFF, 0xFF, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5D, 0x95, 0x98, 0x09,
+		0, 0, 0, 1, 0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5D, 0xA0, 0x02, 0x80, 0x80, 0x2D, 0x16, 0x59, 0x59, 0xA4, 0x93, 0x2B, 0xC0, 0x40,
+		0, 0, 0, 1, 0x44, 0x01, 0xC1, 0x72, 0xB4, 0x62, 0x40,
+	};
+	const uint8_t *pSrc = bHevc ? abHevc : abH264;
+	size_t cb = bHevc ? sizeof(abHevc) : sizeof(abH264);
+	if (cb > cbMax) {
+		return 0;
+	}
+	memcpy(p, pSrc, cb);
+	return cb;
+}
+
+// Writes the access unit of a frame of about cbTarget bytes
+static void WriteAccessUnit(StubSession *pSession, StubBitstream *pBitstream, uint32_t cbTarget)
+{
+	StubFrame &frame = pBitstream->frame;
+	uint8_t *p = pBitstream->vData.data();
+	size_t cbMax = pBitstream->vData.size();
+	bool bHevc = IsHevc(pSession);
+	bool bIdr = frame.picType == NV_ENC_PIC_TYPE_IDR;
+	uint32_t nSlice = SliceCount(pSession);
+	size_t cbSliceHeader = bHevc ? 7 : 6;
+
+	size_t cb = bIdr ? WriteParameterSets(bHevc, p, cbMax) : 0;
+	size_t cbPayload = cbTarget > cb + nSlice * cbSliceHeader ? cbTarget - cb - nSlice * cbSliceHeader : 0;
+	frame.vSliceOffset.clear();
+	for (uint32_t i = 0; i < nSlice && cb + cbSliceHeader <= cbMax; i++) {
+		frame.vSliceOffset.push_back(i ? (uint32_t)cb : 0);
+		p[cb++] = 0; p[cb++] = 0; p[cb++] = 0; p[cb++] = 1;
+		if (bHevc) {
+			// IDR_W_RADL or TRAIL_R, then first_slice_segment_in_pic_flag
+			p[cb++] = (uint8_t)((bIdr ? 19 : 1) << 1);
+			p[cb++] = 1;
+			p[cb++] = i ? 0x00 : 0x80;
+		} else {
+			// nal_ref_idc 3 with IDR or non-IDR slice, then first_mb_in_slice as ue(v)
+			p[cb++] = bIdr ? 0x65 : 0x41;
+			p[cb++] = i ? 0x40 : 0x80;
+		}
+		size_t cbSlice = std::min(cbPayload / nSlice + (i + 1 == nSlice ? cbPayload % nSlice : 0), cbMax - cb);
+		// No zero bytes, so no start code can appear in the payload
+		memset(p + cb, 0xA5, cbSlice);
+		cb += cbSlice;
+	}
+	frame.cb = (uint32_t)cb;
+}
+
+static uint32_t FrameSize(const StubSession *pSession, bool bIdr, bool bRecovery, uint64_t h)
+{
+	const NV_ENC_INITIALIZE_PARAMS &init = pSession->initParams;
+	double fps = init.frameRateNum && init.frameRateDen ? (double)init.frameRateNum / init.frameRateDen : STUB_DEFAULT_FPS;
+	uint32_t dwBitrate = pSession->config.rcParams.averageBitRate ? pSession->config.rcParams.averageBitRate : STUB_DEFAULT_BITRATE;
+	double cbAverage = dwBitrate / 8.0 / fps;
+	double cbIdr = cbAverage * model.idrSizeRatio;
+	double cb;
+	if (bIdr) {
+		cb = cbIdr;
+	} else {
+		// The P frames of a GOP make up for its IDR frame
+		uint32_t dwPeriod = IdrPeriod(pSession);
+		cb = dwPeriod > 1 && dwPeriod != NVENC_INFINITE_GOPLENGTH ? (dwPeriod * cbAverage - cbIdr) / (dwPeriod - 1) : cbAverage;
+		cb = std::max(cb, cbAverage / 4);
+		if (bRecovery) {
+			cb *= 2;
+		}
+	}
+	cb += cb * Jitter(h, model.dwSizeJitterPercent) / 100.0;
+	return (uint32_t)std::max(cb, 64.0);
+}
+
+static StubSession *Session(void *encoder)
+{
+	return setSession.count((StubSession *)encoder) ? (StubSession *)encoder : NULL;
+}
+
+static NVENCSTATUS OpenSession(int iDevice, void **encoder)
+{
+	if (!encoder) {
+		return NV_ENC_ERR_INVALID_PTR;
+	}
+	std::lock_guard<std::mutex> lock(mtxStub);
+	LoadModel();
+	if (model.nMaxSession && mpDeviceSession[iDevice] >= (int)model.nMaxSession) {
+		stats.nSessionRejected++;
+		return NV_ENC_ERR_OUT_OF_MEMORY;
+	}
+	StubSession *pSession = new StubSession;
+	pSession->iDevice = iDevice;
+	pSession->dwOrdinal = dwNextOrdinal++;
+	pSession->bInitialized = false;
+	memset(&pSession->initParams, 0, sizeof(pSession->initParams));
+	memset(&pSession->config, 0, sizeof(pSession->config));
+	pSession->dwFrame = 0;
+	pSession->dwSinceIdr = 0;
+	pSession->bForceIdr = false;
+	pSession->bRecovery = false;
+	setSession.insert(pSession);
+	mpDeviceSession[iDevice]++;
+	stats.nSession++;
+	stats.nSessionPeak = std::max(stats.nSessionPeak, stats.nSession);
+	*encoder = pSession;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubOpenEncodeSession(void *device, uint32_t deviceType, void **encoder)
+{
+	return OpenSession(0, encoder);
+}
+
+static NVENCSTATUS NVENCAPI StubOpenEncodeSessionEx(NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS *openSessionExParams, void **encoder)
+{
+	if (!openSessionExParams) {
+		return NV_ENC_ERR_INVALID_PTR;
+	}
+	if (openSessionExParams->apiVersion != NVENCAPI_VERSION) {
+		return NV_ENC_ERR_INVALID_VERSION;
+	}
+	int iDevice = 0;
+	const NvEncStubContext *pContext = (const NvEncStubContext *)openSessionExParams->device;
+	if (openSessionExParams->deviceType == NV_ENC_DEVICE_TYPE_CUDA) {
+		if (!pContext || pContext->dwMagic != NVENC_STUB_CONTEXT_MAGIC) {
+			return NV_ENC_ERR_INVALID_DEVICE;
+		}
+		iDevice = pContext->iDevice;
+	}
+	return OpenSession(iDevice, encoder);
+}
+
+static NVENCSTATUS NVENCAPI StubGetEncodeGUIDCount(void *encoder, uint32_t *encodeGUIDCount)
+{
+	*encodeGUIDCount = 2;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubGetEncodeGUIDs(void *encoder, GUID *GUIDs, uint32_t guidArraySize, uint32_t *GUIDCount)
+{
+	const GUID aGuid[] = {NV_ENC_CODEC_H264_GUID, NV_ENC_CODEC_HEVC_GUID};
+	*GUIDCount = std::min(guidArraySize, (uint32_t)(sizeof(aGuid) / sizeof(aGuid[0])));
+	memcpy(GUIDs, aGuid, *GUIDCount * sizeof(GUID));
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubGetEncodeProfileGUIDCount(void *encoder, GUID encodeGUID, uint32_t *encodeProfileGUIDCount)
+{
+	*encodeProfileGUIDCount = 1;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubGetEncodeProfileGUIDs(void *encoder, GUID encodeGUID, GUID *profileGUIDs, uint32_t guidArraySize, uint32_t *GUIDCount)
+{
+	*GUIDCount = guidArraySize ? 1 : 0;
+	if (guidArraySize) {
+		profileGUIDs[0] = NV_ENC_CODEC_PROFILE_AUTOSELECT_GUID;
+	}
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubGetInputFormatCount(void *encoder, GUID encodeGUID, uint32_t *inputFmtCount)
+{
+	*inputFmtCount = 3;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubGetInputFormats(void *encoder, GUID encodeGUID, NV_ENC_BUFFER_FORMAT *inputFmts, uint32_t inputFmtArraySize, uint32_t *inputFmtCount)
+{
+	const NV_ENC_BUFFER_FORMAT aFmt[] = {NV_ENC_BUFFER_FORMAT_NV12_PL, NV_ENC_BUFFER_FORMAT_IYUV_PL, NV_ENC_BUFFER_FORMAT_YUV444_PL};
+	*inputFmtCount = std::min(inputFmtArraySize, (uint32_t)(sizeof(aFmt) / sizeof(aFmt[0])));
+	memcpy(inputFmts, aFmt, *inputFmtCount * sizeof(NV_ENC_BUFFER_FORMAT));
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubGetEncodeCaps(void *encoder, GUID encodeGUID, NV_ENC_CAPS_PARAM *capsParam, int *capsVal)
+{
+	switch (capsParam->capsToQuery) {
+	case NV_ENC_CAPS_NUM_MAX_BFRAMES: *capsVal = 0; break;
+	case NV_ENC_CAPS_SUPPORTED_RATECONTROL_MODES: *capsVal = NV_ENC_PARAMS_RC_VBR | NV_ENC_PARAMS_RC_CBR; break;
+	case NV_ENC_CAPS_LEVEL_MAX: *capsVal = 51; break;
+	case NV_ENC_CAPS_LEVEL_MIN: *capsVal = 10; break;
+	case NV_ENC_CAPS_WIDTH_MAX: *capsVal = 4096; break;
+	case NV_ENC_CAPS_HEIGHT_MAX: *capsVal = 4096; break;
+	case NV_ENC_CAPS_NUM_MAX_TEMPORAL_LAYERS: *capsVal = 0; break;
+	case NV_ENC_CAPS_MB_NUM_MAX: *capsVal = (4096 / 16) * (4096 / 16); break;
+	case NV_ENC_CAPS_MB_PER_SEC_MAX: *capsVal = 8160 * 60 * 4; break;
+#if defined(_WIN32)
+	case NV_ENC_CAPS_ASYNC_ENCODE_SUPPORT: *capsVal = 1; break;
+#else
+	case NV_ENC_CAPS_ASYNC_ENCODE_SUPPORT: *capsVal = 0; break;
+#endif
+	case NV_ENC_CAPS_SUPPORT_FIELD_ENCODING:
+	case NV_ENC_CAPS_SUPPORT_MONOCHROME:
+	case NV_ENC_CAPS_SUPPORT_FMO:
+	case NV_ENC_CAPS_SUPPORT_BDIRECT_MODE:
+	case NV_ENC_CAPS_SUPPORT_RESERVED:
+	case NV_ENC_CAPS_SUPPORT_HIERARCHICAL_BFRAMES:
+	case NV_ENC_CAPS_SEPARATE_COLOUR_PLANE:
+	case NV_ENC_CAPS_SUPPORT_TEMPORAL_SVC:
+	case NV_ENC_CAPS_SUPPORT_LOSSLESS_ENCODE:
+		*capsVal = 0;
+		break;
+	default:
+		// The remaining caps are features the stub accepts
+		*capsVal = 1;
+		break;
+	}
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubGetEncodePresetCount(void *encoder, GUID encodeGUID, uint32_t *encodePresetGUIDCount)
+{
+	*encodePresetGUIDCount = 9;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubGetEncodePresetGUIDs(void *encoder, GUID encodeGUID, GUID *presetGUIDs, uint32_t guidArraySize, uint32_t *encodePresetGUIDCount)
+{
+	const GUID aGuid[] = {
+		NV_ENC_PRESET_DEFAULT_GUID, NV_ENC_PRESET_HP_GUID, NV_ENC_PRESET_HQ_GUID, NV_ENC_PRESET_BD_GUID,
+		NV_ENC_PRESET_LOW_LATENCY_DEFAULT_GUID, NV_ENC_PRESET_LOW_LATENCY_HQ_GUID, NV_ENC_PRESET_LOW_LATENCY_HP_GUID,
+		NV_ENC_PRESET_LOSSLESS_DEFAULT_GUID, NV_ENC_PRESET_LOSSLESS_HP_GUID,
+	};
+	*encodePresetGUIDCount = std::min(guidArraySize, (uint32_t)(sizeof(aGuid) / sizeof(aGuid[0])));
+	memcpy(presetGUIDs, aGuid, *encodePresetGUIDCount * sizeof(GUID));
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubGetEncodePresetConfig(void *encoder, GUID encodeGUID, GUID presetGUID, NV_ENC_PRESET_CONFIG *presetConfig)
+{
+	uint32_t version = presetConfig->presetCfg.version;
+	memset(&presetConfig->presetCfg, 0, sizeof(presetConfig->presetCfg));
+	NV_ENC_CONFIG &config = presetConfig->presetCfg;
+	config.version = version;
+	config.profileGUID = NV_ENC_CODEC_PROFILE_AUTOSELECT_GUID;
+	config.gopLength = 30;
+	config.frameIntervalP = 1;
+	config.frameFieldMode = NV_ENC_PARAMS_FRAME_FIELD_MODE_FRAME;
+	config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CONSTQP;
+	config.rcParams.constQP.qpInterP = 28;
+	config.rcParams.constQP.qpIntra = 25;
+	if (!memcmp(&encodeGUID, &NV_ENC_CODEC_HEVC_GUID, sizeof(GUID))) {
+		config.encodeCodecConfig.hevcConfig.idrPeriod = config.gopLength;
+	} else {
+		config.encodeCodecConfig.h264Config.idrPeriod = config.gopLength;
+	}
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubInitializeEncoder(void *encoder, NV_ENC_INITIALIZE_PARAMS *createEncodeParams)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession) {
+		return NV_ENC_ERR_INVALID_ENCODERDEVICE;
+	}
+	if (!createEncodeParams || !createEncodeParams->encodeWidth || !createEncodeParams->encodeHeight) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	pSession->initParams = *createEncodeParams;
+	if (createEncodeParams->encodeConfig) {
+		pSession->config = *createEncodeParams->encodeConfig;
+	} else {
+		NV_ENC_PRESET_CONFIG presetConfig;
+		memset(&presetConfig, 0, sizeof(presetConfig));
+		StubGetEncodePresetConfig(encoder, createEncodeParams->encodeGUID, createEncodeParams->presetGUID, &presetConfig);
+		pSession->config = presetConfig.presetCfg;
+	}
+	pSession->initParams.encodeConfig = &pSession->config;
+	pSession->bInitialized = true;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubReconfigureEncoder(void *encoder, NV_ENC_RECONFIGURE_PARAMS *reInitEncodeParams)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->bInitialized) {
+		return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+	}
+	NV_ENC_INITIALIZE_PARAMS &init = reInitEncodeParams->reInitEncodeParams;
+	if (!init.encodeWidth || !init.encodeHeight) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	pSession->initParams = init;
+	if (init.encodeConfig) {
+		pSession->config = *init.encodeConfig;
+	}
+	pSession->initParams.encodeConfig = &pSession->config;
+	pSession->bForceIdr |= reInitEncodeParams->forceIDR;
+	if (reInitEncodeParams->resetEncoder) {
+		pSession->dwSinceIdr = 0;
+	}
+	stats.nReconfigure++;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubCreateInputBuffer(void *encoder, NV_ENC_CREATE_INPUT_BUFFER *createInputBufferParams)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession) {
+		return NV_ENC_ERR_INVALID_ENCODERDEVICE;
+	}
+	StubInput *pInput = new StubInput;
+	pInput->dwWidth = createInputBufferParams->width;
+	pInput->dwHeight = createInputBufferParams->height;
+	pInput->dwPitch = (pInput->dwWidth + 31) & ~31;
+	size_t cbPlane = (size_t)pInput->dwPitch * pInput->dwHeight;
+	pInput->vData.resize(createInputBufferParams->bufferFmt == NV_ENC_BUFFER_FORMAT_YUV444_PL ? cbPlane * 3 : cbPlane * 3 / 2);
+	pSession->mpInput[pInput] = pInput;
+	createInputBufferParams->inputBuffer = pInput;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubDestroyInputBuffer(void *encoder, NV_ENC_INPUT_PTR inputBuffer)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->mpInput.count(inputBuffer)) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	delete pSession->mpInput[inputBuffer];
+	pSession->mpInput.erase(inputBuffer);
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubLockInputBuffer(void *encoder, NV_ENC_LOCK_INPUT_BUFFER *lockInputBufferParams)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->mpInput.count(lockInputBufferParams->inputBuffer)) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	StubInput *pInput = pSession->mpInput[lockInputBufferParams->inputBuffer];
+	lockInputBufferParams->bufferDataPtr = pInput->vData.data();
+	lockInputBufferParams->pitch = pInput->dwPitch;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubUnlockInputBuffer(void *encoder, NV_ENC_INPUT_PTR inputBuffer)
+{
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubCreateBitstreamBuffer(void *encoder, NV_ENC_CREATE_BITSTREAM_BUFFER *createBitstreamBufferParams)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession) {
+		return NV_ENC_ERR_INVALID_ENCODERDEVICE;
+	}
+	if (!createBitstreamBufferParams->size) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	StubBitstream *pBitstream = new StubBitstream;
+	pBitstream->vData.resize(createBitstreamBufferParams->size);
+	pBitstream->frame.bValid = false;
+	pSession->mpBitstream[pBitstream] = pBitstream;
+	createBitstreamBufferParams->bitstreamBuffer = pBitstream;
+	createBitstreamBufferParams->bitstreamBufferPtr = NULL;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubDestroyBitstreamBuffer(void *encoder, NV_ENC_OUTPUT_PTR bitstreamBuffer)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->mpBitstream.count(bitstreamBuffer)) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	delete pSession->mpBitstream[bitstreamBuffer];
+	pSession->mpBitstream.erase(bitstreamBuffer);
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubEncodePicture(void *encoder, NV_ENC_PIC_PARAMS *encodePicParams)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->bInitialized) {
+		return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+	}
+	uint64_t qwNowUs = NowUs();
+	if (encodePicParams->encodePicFlags & NV_ENC_PIC_FLAG_EOS) {
+		// Nothing is queued behind the stub's frames, the flush is done once they are
+		if (encodePicParams->completionEvent) {
+			std::vector<uint64_t> &vEngine = mpEngineFreeUs[pSession->iDevice];
+			uint64_t qwDueUs = vEngine.empty() ? qwNowUs : std::max(qwNowUs, *std::max_element(vEngine.begin(), vEngine.end()));
+			ScheduleCompletion(encodePicParams->completionEvent, qwDueUs);
+		}
+		return NV_ENC_SUCCESS;
+	}
+	if (!pSession->mpBitstream.count(encodePicParams->outputBitstream)) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	StubBitstream *pBitstream = pSession->mpBitstream[encodePicParams->outputBitstream];
+
+	uint32_t dwFrame = pSession->dwFrame++;
+	uint32_t dwPeriod = IdrPeriod(pSession);
+	bool bIdr = dwFrame == 0 || pSession->bForceIdr
+		|| (encodePicParams->encodePicFlags & (NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_FORCEINTRA))
+		|| (dwPeriod && dwPeriod != NVENC_INFINITE_GOPLENGTH && pSession->dwSinceIdr >= dwPeriod);
+	pSession->bForceIdr = false;
+	pSession->dwSinceIdr = bIdr ? 1 : pSession->dwSinceIdr + 1;
+
+	StubFrame &frame = pBitstream->frame;
+	frame.bValid = true;
+	frame.dwFrame = encodePicParams->frameIdx ? encodePicParams->frameIdx : dwFrame;
+	frame.qwTimeStamp = encodePicParams->inputTimeStamp;
+	frame.picType = bIdr ? NV_ENC_PIC_TYPE_IDR : NV_ENC_PIC_TYPE_P;
+	WriteAccessUnit(pSession, pBitstream, FrameSize(pSession, bIdr, pSession->bRecovery && !bIdr,
+		Hash(model.dwSeed, pSession->dwOrdinal, dwFrame, 1)));
+	pSession->bRecovery = false;
+
+	// The frame waits for the engine of the device that frees up first
+	double mpix = (double)pSession->initParams.encodeWidth * pSession->initParams.encodeHeight / 1e6;
+	int64_t latencyUs = model.dwLatencyUs + (int64_t)(model.dwLatencyPerMpixUs * mpix) + (bIdr ? model.dwIdrLatencyUs : 0)
+		+ Jitter(Hash(model.dwSeed, pSession->dwOrdinal, dwFrame, 2), model.dwJitterUs);
+	std::vector<uint64_t> &vEngine = mpEngineFreeUs[pSession->iDevice];
+	vEngine.resize(model.nEngine, 0);
+	std::vector<uint64_t>::iterator itEngine = std::min_element(vEngine.begin(), vEngine.end());
+	frame.qwSubmitUs = qwNowUs;
+	frame.qwStartUs = std::max(qwNowUs, *itEngine);
+	frame.qwDoneUs = frame.qwStartUs + Scale(latencyUs);
+	*itEngine = frame.qwDoneUs;
+
+	if (encodePicParams->completionEvent) {
+		ScheduleCompletion(encodePicParams->completionEvent, frame.qwDoneUs + Scale(model.dwEventDelayUs));
+	}
+	stats.nFrame++;
+	stats.nIdr += bIdr;
+	stats.qwBytes += frame.cb;
+	stats.qwEngineWaitUs += frame.qwStartUs - frame.qwSubmitUs;
+	if (fpTrace) {
+		fprintf(fpTrace, "%u,%u,%s,%u,%llu,%llu,%llu\n", pSession->dwOrdinal, dwFrame, bIdr ? "IDR" : "P", frame.cb,
+			(unsigned long long)frame.qwSubmitUs, (unsigned long long)frame.qwStartUs, (unsigned long long)frame.qwDoneUs);
+	}
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubLockBitstream(void *encoder, NV_ENC_LOCK_BITSTREAM *lockBitstreamBufferParams)
+{
+	std::unique_lock<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->mpBitstream.count(lockBitstreamBufferParams->outputBitstream)) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	StubBitstream *pBitstream = pSession->mpBitstream[lockBitstreamBufferParams->outputBitstream];
+	if (!pBitstream->frame.bValid) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	StubFrame frame = pBitstream->frame;
+	bool bSubFrame = pSession->initParams.enableSubFrameWrite != 0;
+
+	uint32_t nSlice = (uint32_t)frame.vSliceOffset.size();
+	uint32_t nDone = nSlice;
+	uint64_t qwNowUs = NowUs();
+	if (qwNowUs < frame.qwDoneUs) {
+		if (lockBitstreamBufferParams->doNotWait && bSubFrame) {
+			// The slices finish one after the other
+			nDone = qwNowUs <= frame.qwStartUs ? 0
+				: (uint32_t)((qwNowUs - frame.qwStartUs) * nSlice / (frame.qwDoneUs - frame.qwStartUs));
+			if (!nDone) {
+				return NV_ENC_ERR_LOCK_BUSY;
+			}
+		} else {
+			/* Without sub-frame writes the shim only passes doNotWait after its completion
+			   event, so where there is no event the call waits as the driver would.*/
+			lock.unlock();
+			std::this_thread::sleep_for(std::chrono::microseconds(frame.qwDoneUs - qwNowUs));
+			lock.lock();
+		}
+	}
+
+	lockBitstreamBufferParams->bitstreamBufferPtr = pBitstream->vData.data();
+	lockBitstreamBufferParams->bitstreamSizeInBytes = nDone < nSlice ? frame.vSliceOffset[nDone] : frame.cb;
+	lockBitstreamBufferParams->frameIdx = frame.dwFrame;
+	lockBitstreamBufferParams->outputTimeStamp = frame.qwTimeStamp;
+	lockBitstreamBufferParams->pictureType = frame.picType;
+	lockBitstreamBufferParams->pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+	lockBitstreamBufferParams->frameAvgQP = frame.picType == NV_ENC_PIC_TYPE_IDR ? 25 : 28;
+	lockBitstreamBufferParams->hwEncodeStatus = nDone < nSlice ? 1 : 2;
+	lockBitstreamBufferParams->numSlices = nDone;
+	if (lockBitstreamBufferParams->sliceOffsets && pSession->initParams.reportSliceOffsets) {
+		for (uint32_t i = 0; i < nDone; i++) {
+			lockBitstreamBufferParams->sliceOffsets[i] = frame.vSliceOffset[i];
+		}
+	}
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubUnlockBitstream(void *encoder, NV_ENC_OUTPUT_PTR bitstreamBuffer)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	return pSession && pSession->mpBitstream.count(bitstreamBuffer) ? NV_ENC_SUCCESS : NV_ENC_ERR_INVALID_PARAM;
+}
+
+static NVENCSTATUS NVENCAPI StubGetEncodeStats(void *encoder, NV_ENC_STAT *encodeStats)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->mpBitstream.count(encodeStats->outputBitStream)) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	const StubFrame &frame = pSession->mpBitstream[encodeStats->outputBitStream]->frame;
+	encodeStats->bitStreamSize = frame.cb;
+	encodeStats->picType = frame.picType;
+	encodeStats->lastValidByteOffset = frame.cb;
+	encodeStats->picIdx = frame.dwFrame;
+	for (size_t i = 0; i < frame.vSliceOffset.size() && i < 16; i++) {
+		encodeStats->sliceOffsets[i] = frame.vSliceOffset[i];
+	}
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubGetSequenceParams(void *encoder, NV_ENC_SEQUENCE_PARAM_PAYLOAD *sequenceParamPayload)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->bInitialized) {
+		return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+	}
+	size_t cb = WriteParameterSets(IsHevc(pSession), (uint8_t *)sequenceParamPayload->spsppsBuffer, sequenceParamPayload->inBufferSize);
+	if (!cb) {
+		return NV_ENC_ERR_NOT_ENOUGH_BUFFER;
+	}
+	if (sequenceParamPayload->outSPSPPSPayloadSize) {
+		*sequenceParamPayload->outSPSPPSPayloadSize = (uint32_t)cb;
+	}
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubRegisterAsyncEvent(void *encoder, NV_ENC_EVENT_PARAMS *eventParams)
+{
+#if defined(_WIN32)
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !eventParams->completionEvent) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	pSession->setEvent.insert(eventParams->completionEvent);
+	msetLiveEvent.insert(eventParams->completionEvent);
+	return NV_ENC_SUCCESS;
+#else
+	// Like the driver, only Windows has asynchronous mode
+	return NV_ENC_ERR_UNIMPLEMENTED;
+#endif
+}
+
+// Called with mtxStub held
+static void UnregisterEvent(StubSession *pSession, void *hEvent)
+{
+	if (pSession->setEvent.erase(hEvent)) {
+		msetLiveEvent.erase(msetLiveEvent.find(hEvent));
+	}
+}
+
+static NVENCSTATUS NVENCAPI StubUnregisterAsyncEvent(void *encoder, NV_ENC_EVENT_PARAMS *eventParams)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->setEvent.count(eventParams->completionEvent)) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	UnregisterEvent(pSession, eventParams->completionEvent);
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubRegisterResource(void *encoder, NV_ENC_REGISTER_RESOURCE *registerResParams)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !registerResParams->resourceToRegister) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	// The resource is never read; its handle is a fresh allocation
+	void *hResource = new char;
+	pSession->mpResource[hResource] = registerResParams->bufferFormat;
+	registerResParams->registeredResource = hResource;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubUnregisterResource(void *encoder, NV_ENC_REGISTERED_PTR registeredRes)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->mpResource.erase(registeredRes)) {
+		return NV_ENC_ERR_RESOURCE_NOT_REGISTERED;
+	}
+	delete (char *)registeredRes;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubMapInputResource(void *encoder, NV_ENC_MAP_INPUT_RESOURCE *mapInputResParams)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->mpResource.count(mapInputResParams->registeredResource)) {
+		return NV_ENC_ERR_RESOURCE_NOT_REGISTERED;
+	}
+	mapInputResParams->mappedResource = mapInputResParams->registeredResource;
+	mapInputResParams->mappedBufferFmt = pSession->mpResource[mapInputResParams->registeredResource];
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubUnmapInputResource(void *encoder, NV_ENC_INPUT_PTR mappedInputBuffer)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	return pSession && pSession->mpResource.count(mappedInputBuffer) ? NV_ENC_SUCCESS : NV_ENC_ERR_RESOURCE_NOT_MAPPED;
+}
+
+static NVENCSTATUS NVENCAPI StubInvalidateRefFrames(void *encoder, uint64_t invalidRefFrameTimeStamp)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->bInitialized) {
+		return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+	}
+	pSession->bRecovery = true;
+	stats.nInvalidate++;
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubCreateMVBuffer(void *encoder, NV_ENC_CREATE_MV_BUFFER *createMVBufferParams)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->bInitialized) {
+		return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+	}
+	const NV_ENC_INITIALIZE_PARAMS &init = pSession->initParams;
+	uint32_t dwWidth = std::max(init.maxEncodeWidth, init.encodeWidth), dwHeight = std::max(init.maxEncodeHeight, init.encodeHeight);
+	std::vector<NV_ENC_H264_MV_DATA> *pvMV = new std::vector<NV_ENC_H264_MV_DATA>(((dwWidth + 15) >> 4) * ((dwHeight + 15) >> 4));
+	memset(pvMV->data(), 0, pvMV->size() * sizeof(NV_ENC_H264_MV_DATA));
+	pSession->mpMV[pvMV->data()] = pvMV;
+	createMVBufferParams->MVBuffer = pvMV->data();
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubDestroyMVBuffer(void *encoder, NV_ENC_OUTPUT_PTR MVBuffer)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->mpMV.count(MVBuffer)) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	delete pSession->mpMV[MVBuffer];
+	pSession->mpMV.erase(MVBuffer);
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubRunMotionEstimationOnly(void *encoder, NV_ENC_MEONLY_PARAMS *MEOnlyParams)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession || !pSession->bInitialized) {
+		return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+	}
+	if (!pSession->mpMV.count(MEOnlyParams->outputMV)) {
+		return NV_ENC_ERR_INVALID_PARAM;
+	}
+	std::vector<NV_ENC_H264_MV_DATA> &vMV = *pSession->mpMV[MEOnlyParams->outputMV];
+	StubInput *pInput = pSession->mpInput.count(MEOnlyParams->inputBuffer) ? pSession->mpInput[MEOnlyParams->inputBuffer] : NULL;
+	StubInput *pRef = pSession->mpInput.count(MEOnlyParams->referenceFrame) ? pSession->mpInput[MEOnlyParams->referenceFrame] : NULL;
+	uint32_t nMbX = (MEOnlyParams->inputWidth + 15) >> 4, nMbY = (MEOnlyParams->inputHeight + 15) >> 4;
+	for (uint32_t y = 0; y < nMbY; y++) {
+		for (uint32_t x = 0; x < nMbX && y * nMbX + x < vMV.size(); x++) {
+			NV_ENC_H264_MV_DATA &mv = vMV[y * nMbX + x];
+			memset(&mv, 0, sizeof(mv));
+			mv.mb_type = 1;
+			if (!pInput || !pRef || pInput->dwPitch != pRef->dwPitch) {
+				continue;
+			}
+			// Zero motion; the cost is the luma SAD against the co-located block
+			uint32_t dwSad = 0;
+			for (uint32_t j = y * 16; j < std::min(y * 16 + 16, pInput->dwHeight); j++) {
+				const uint8_t *p = pInput->vData.data() + (size_t)j * pInput->dwPitch;
+				const uint8_t *q = pRef->vData.data() + (size_t)j * pRef->dwPitch;
+				for (uint32_t i = x * 16; i < std::min(x * 16 + 16, pInput->dwWidth); i++) {
+					dwSad += abs(p[i] - q[i]);
+				}
+			}
+			mv.MBCost = dwSad;
+		}
+	}
+	return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI StubDestroyEncoder(void *encoder)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	StubSession *pSession = Session(encoder);
+	if (!pSession) {
+		return NV_ENC_ERR_INVALID_ENCODERDEVICE;
+	}
+	for (std::map<void *, StubInput *>::iterator it = pSession->mpInput.begin(); it != pSession->mpInput.end(); ++it) {
+		delete it->second;
+	}
+	for (std::map<void *, StubBitstream *>::iterator it = pSession->mpBitstream.begin(); it != pSession->mpBitstream.end(); ++it) {
+		delete it->second;
+	}
+	for (std::map<void *, std::vector<NV_ENC_H264_MV_DATA> *>::iterator it = pSession->mpMV.begin(); it != pSession->mpMV.end(); ++it) {
+		delete it->second;
+	}
+	for (std::map<void *, NV_ENC_BUFFER_FORMAT>::iterator it = pSession->mpResource.begin(); it != pSession->mpResource.end(); ++it) {
+		delete (char *)it->first;
+	}
+	while (!pSession->setEvent.empty()) {
+		UnregisterEvent(pSession, *pSession->setEvent.begin());
+	}
+	mpDeviceSession[pSession->iDevice]--;
+	stats.nSession--;
+	setSession.erase(pSession);
+	delete pSession;
+	if (fpTrace) {
+		fflush(fpTrace);
+	}
+	return NV_ENC_SUCCESS;
+}
+
+extern "C" NVENCSTATUS NVENCAPI NvEncodeAPICreateInstance(NV_ENCODE_API_FUNCTION_LIST *functionList)
+{
+	if (!functionList) {
+		return NV_ENC_ERR_INVALID_PTR;
+	}
+	if (functionList->version != NV_ENCODE_API_FUNCTION_LIST_VER) {
+		return NV_ENC_ERR_INVALID_VERSION;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mtxStub);
+		LoadModel();
+	}
+	uint32_t version = functionList->version;
+	memset(functionList, 0, sizeof(*functionList));
+	functionList->version = version;
+	functionList->nvEncOpenEncodeSession = StubOpenEncodeSession;
+	functionList->nvEncGetEncodeGUIDCount = StubGetEncodeGUIDCount;
+	functionList->nvEncGetEncodeProfileGUIDCount = StubGetEncodeProfileGUIDCount;
+	functionList->nvEncGetEncodeProfileGUIDs = StubGetEncodeProfileGUIDs;
+	functionList->nvEncGetEncodeGUIDs = StubGetEncodeGUIDs;
+	functionList->nvEncGetInputFormatCount = StubGetInputFormatCount;
+	functionList->nvEncGetInputFormats = StubGetInputFormats;
+	functionList->nvEncGetEncodeCaps = StubGetEncodeCaps;
+	functionList->nvEncGetEncodePresetCount = StubGetEncodePresetCount;
+	functionList->nvEncGetEncodePresetGUIDs = StubGetEncodePresetGUIDs;
+	functionList->nvEncGetEncodePresetConfig = StubGetEncodePresetConfig;
+	functionList->nvEncInitializeEncoder = StubInitializeEncoder;
+	functionList->nvEncCreateInputBuffer = StubCreateInputBuffer;
+	functionList->nvEncDestroyInputBuffer = StubDestroyInputBuffer;
+	functionList->nvEncCreateBitstreamBuffer = StubCreateBitstreamBuffer;
+	functionList->nvEncDestroyBitstreamBuffer = StubDestroyBitstreamBuffer;
+	functionList->nvEncEncodePicture = StubEncodePicture;
+	functionList->nvEncLockBitstream = StubLockBitstream;
+	functionList->nvEncUnlockBitstream = StubUnlockBitstream;
+	functionList->nvEncLockInputBuffer = StubLockInputBuffer;
+	functionList->nvEncUnlockInputBuffer = StubUnlockInputBuffer;
+	functionList->nvEncGetEncodeStats = StubGetEncodeStats;
+	functionList->nvEncGetSequenceParams = StubGetSequenceParams;
+	functionList->nvEncRegisterAsyncEvent = StubRegisterAsyncEvent;
+	functionList->nvEncUnregisterAsyncEvent = StubUnregisterAsyncEvent;
+	functionList->nvEncMapInputResource = StubMapInputResource;
+	functionList->nvEncUnmapInputResource = StubUnmapInputResource;
+	functionList->nvEncDestroyEncoder = StubDestroyEncoder;
+	functionList->nvEncInvalidateRefFrames = StubInvalidateRefFrames;
+	functionList->nvEncOpenEncodeSessionEx = StubOpenEncodeSessionEx;
+	functionList->nvEncRegisterResource = StubRegisterResource;
+	functionList->nvEncUnregisterResource = StubUnregisterResource;
+	functionList->nvEncReconfigureEncoder = StubReconfigureEncoder;
+	functionList->nvEncCreateMVBuffer = StubCreateMVBuffer;
+	functionList->nvEncDestroyMVBuffer = StubDestroyMVBuffer;
+	functionList->nvEncRunMotionEstimationOnly = StubRunMotionEstimationOnly;
+	return NV_ENC_SUCCESS;
+}
+
+extern "C" void NVENCSTUBAPI NvEncStubGetModel(NvEncStubModel *pModel)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	LoadModel();
+	*pModel = model;
+}
+
+extern "C" void NVENCSTUBAPI NvEncStubSetModel(const NvEncStubModel *pModel)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	NvEncStubModel newModel = *pModel;
+	newModel.nEngine = std::max(1u, newModel.nEngine);
+	newModel.timeScale = std::max(0.0, newModel.timeScale);
+	ApplyModel(newModel);
+}
+
+extern "C" void NVENCSTUBAPI NvEncStubGetStats(NvEncStubStats *pStats)
+{
+	std::lock_guard<std::mutex> lock(mtxStub);
+	*pStats = stats;
+}
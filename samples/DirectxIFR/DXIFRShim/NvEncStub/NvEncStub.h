@@ -0,0 +1,114 @@
+/*!
+ * \brief
+ * Stub NVENC and CUDA driver with a latency model, for running the encoder
+ * without a GPU
+ *
+ * \file
+ *
+ * NvEncStub builds into one library that exports NvEncodeAPICreateInstance
+ * and the CUDA driver entry points the shim uses. Put it in place of
+ * nvEncodeAPI(64).dll and nvcuda.dll (libnvidia-encode.so.1 and libcuda.so),
+ * or point StartApp -driver / EncoderRuntime::SetLibrary() and
+ * SetCudaLibrary() at it. The unmodified encoder, queueing and rate control
+ * code then runs against it on machines without an NVIDIA GPU.
+ *
+ * Frames are not encoded. Each one occupies one of the GPU's encode engines
+ * for a modeled time and produces an Annex-B access unit of a modeled size:
+ * parameter sets and IDR slices for key frames, P slices otherwise, split
+ * into the configured number of slices. The completion event, if any, is
+ * signaled after the frame is done; sub-frame readout sees the slices
+ * complete one by one. ME-only mode reports zero motion with the 16x16 luma
+ * SAD against the reference frame as the cost.
+ *
+ * Encode time and frame size depend only on the seed, the order in which
+ * sessions were opened and the frame number, not on timing, so a run can
+ * be repeated with the same model to reproduce a scheduling problem. The
+ * optional trace records when each frame was submitted, started and done.
+ *
+ * The model is read on first use from the NVENC_STUB environment variable,
+ * comma-separated key=value pairs, e.g.
+ *   NVENC_STUB=latency=3000,perMpix=1500,sessions=2,engines=1,trace=stub.csv
+ * Keys: latency, perMpix, idrLatency, jitter (microseconds), engines,
+ * sessions, gpus, idrSize (times the average frame), sizeJitter (percent),
+ * eventDelay (microseconds), timeScale, seed and trace (file name).
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define NVENCSTUBAPI __stdcall
+#else
+#define NVENCSTUBAPI
+#endif
+
+#define NVENC_STUB_ENV "NVENC_STUB"
+#define NVENC_STUB_CONTEXT_MAGIC 0x4E565354
+
+// What a CUcontext of the stub points to; sessions opened on it run on its device
+struct NvEncStubContext {
+	uint32_t dwMagic;
+	int iDevice;
+};
+
+struct NvEncStubModel {
+	// Encode time of a frame: fixed, per megapixel, extra for an IDR frame and +/- jitter
+	uint32_t dwLatencyUs;
+	uint32_t dwLatencyPerMpixUs;
+	uint32_t dwIdrLatencyUs;
+	uint32_t dwJitterUs;
+	// Frames a GPU encodes at the same time; the others wait for an engine
+	uint32_t nEngine;
+	// Sessions a GPU allows, 2 on GeForce; 0 for no limit
+	uint32_t nMaxSession;
+	// CUDA devices reported, all of them able to encode
+	uint32_t nGpu;
+	// Size of an IDR frame relative to the average frame, and the +/- variation of every frame
+	double idrSizeRatio;
+	uint32_t dwSizeJitterPercent;
+	// Time from the end of a frame to its completion event
+	uint32_t dwEventDelayUs;
+	// Scales all modeled times; 0 completes every frame at once
+	double timeScale;
+	uint32_t dwSeed;
+	// CSV of every frame, none if empty
+	char szTrace[260];
+};
+
+struct NvEncStubStats {
+	int nSession;
+	int nSessionPeak;
+	// Sessions refused for the session limit
+	int nSessionRejected;
+	uint64_t nFrame;
+	uint64_t nIdr;
+	uint64_t qwBytes;
+	// Time frames waited for an engine
+	uint64_t qwEngineWaitUs;
+	int nReconfigure;
+	int nInvalidate;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The default model with NVENC_STUB applied
+void NVENCSTUBAPI NvEncStubGetModel(NvEncStubModel *pModel);
+// Replaces the model; sessions opened before keep their seed
+void NVENCSTUBAPI NvEncStubSetModel(const NvEncStubModel *pModel);
+void NVENCSTUBAPI NvEncStubGetStats(NvEncStubStats *pStats);
+
+typedef void (NVENCSTUBAPI *PNVENCSTUBSETMODEL)(const NvEncStubModel *pModel);
+typedef void (NVENCSTUBAPI *PNVENCSTUBGETSTATS)(NvEncStubStats *pStats);
+
+#ifdef __cplusplus
+}
+#endif
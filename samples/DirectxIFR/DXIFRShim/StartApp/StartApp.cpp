@@ -5,9 +5,14 @@
 #include <string>
 #include <iostream>
 #include <signal.h>
+#include <atomic>
+#include <thread>
 #include "Logger.h"
 #include "AppParam.h"
+#include "Placement.h"
 #include "Util4Streamer.h"
+#include "EncodeService.h"
+#include "ControlInfoWire.h"
 
 using namespace std;
 
@@ -19,9 +24,26 @@ void ShowUsageAndExit(char *szExeName)
 	printf(
 		"Usage: %s -r <WxH> -gpu <gpu number> -audio <audio number> -hevc <application command line> -players <number of players> " \
 		"-rows <number of split screen rows> -cols <number of split screen columns> -width <width of a single split screen> " \
-		"-height <height of a single split screen>\n"
-		"-hevc is optional\n"
-		"-width and -height seems broken. Avoid for now.\n", szExeName);
+		"-height <height of a single split screen> -placement <os|numa|isolate> -encodercpus <hex CPU mask> " \
+		"-nvenc \"<NVENC options>\" -metricsport <port> -ladder <height,...> -driver <library> -service -inputport <port> " \
+		"-inputring <capacity>\n"
+		"-hevc, -placement, -encodercpus, -nvenc, -metricsport, -ladder, -driver, -service, -inputport and -inputring are optional\n"
+		"-metricsport serves Prometheus metrics on http://127.0.0.1:<port>/metrics\n"
+		"-ladder adds up to 3 downscaled renditions of every player, e.g. 720,480, streamed on the player's port + 10, + 20, ...\n"
+		"-nvenc takes NVENC sample options, e.g. \"-intraRefresh 1 -intraRefreshPeriod 60 -intraRefreshDuration 10 " \
+		"-sliceMode 3 -sliceModeData 4 -vbvFrames 1\"; \"-subFrame 1\" streams each frame slice by slice; " \
+		"\"-udp <host:port> -fec <0|1|2> -fecK 10 -fecM 4\" sends over UDP with none/XOR/Reed-Solomon FEC; " \
+		"\"-record <prefix>\" also records every player to <prefix><player>.h264 and \"-sinkPlugin <dll>\" hands the stream to a sink plugin; " \
+		"the encoders are spread over the GPUs, at most \"-gpuSessions <n>\" on each, unless \"-deviceID <n>\" pins them to one; " \
+		"players that find every GPU full are encoded with x264 through ffmpeg on at most \"-cpuThreads <n>\" threads in all\n"
+		"-driver loads NVENC and CUDA from <library> instead of the installed driver, e.g. NvEncStub.dll, " \
+		"whose latency model is set by the NVENC_STUB environment variable\n"
+		"-service encodes the players in this process, with x264, and streams them as -nvenc's -udp, -record and -sinkPlugin say; " \
+		"the game only hands over the captured frames\n"
+		"-inputport receives the viewers' input on UDP <port>, in the format of ControlInfoWire.h, and injects it into the game; " \
+		"Ctrl+C then asks the game to close\n"
+		"-inputring sets how many user inputs wait for the game before new ones are dropped, a power of two up to %d (default)\n"
+		"-width and -height seems broken. Avoid for now.\n", szExeName, N_USER_INPUT);
 	exit(0);
 }
 
@@ -40,7 +62,10 @@ static int FindMatchedResolution(char *szResolution)
 }
 
 void ParseArgs(int argc, char *argv[], int &iArg, int &iResolution, int &iGpu, int &iAudio, 
-			   int &iNumPlayers, int &iCols, int &iRows, int &iSplitWidth, int &iSplitHeight, BOOL &bHEVC)
+			   int &iNumPlayers, int &iCols, int &iRows, int &iSplitWidth, int &iSplitHeight, BOOL &bHEVC,
+			   DWORD &ePlacementPolicy, ULONGLONG &qwEncoderCpuMask, std::string &strEncoderOptions,
+			   WORD &wMetricsPort, WORD awRenditionHeight[N_RENDITION], std::string &strDriverLibrary,
+			   BOOL &bEncodeService, WORD &wInputPort, DWORD &nUserInputCapacity)
 {
 	char *str, *pEnd;
 	for (iArg = 1; iArg < argc; iArg++) {
@@ -141,6 +166,124 @@ void ParseArgs(int argc, char *argv[], int &iArg, int &iResolution, int &iGpu, i
 			continue;
 		}
 
+		if (!_stricmp(argv[iArg], "-service")) {
+			bEncodeService = TRUE;
+			continue;
+		}
+
+		if (!_stricmp(argv[iArg], "-placement")) {
+			if (iArg + 1 >= argc) {
+				ShowUsageAndExit(argv[0]);
+			}
+			str = argv[++iArg];
+			if (!_stricmp(str, "os")) {
+				ePlacementPolicy = PLACEMENT_OS;
+			} else if (!_stricmp(str, "numa")) {
+				ePlacementPolicy = PLACEMENT_NUMA;
+			} else if (!_stricmp(str, "isolate")) {
+				ePlacementPolicy = PLACEMENT_ISOLATE;
+			} else {
+				ShowUsageAndExit(argv[0]);
+			}
+			continue;
+		}
+
+		if (!_stricmp(argv[iArg], "-encodercpus")) {
+			if (iArg + 1 >= argc) {
+				ShowUsageAndExit(argv[0]);
+			}
+			str = argv[++iArg];
+			qwEncoderCpuMask = _strtoui64(str, &pEnd, 16);
+			if (pEnd == str || *pEnd != '\0') {
+				ShowUsageAndExit(argv[0]);
+			}
+			continue;
+		}
+
+		if (!_stricmp(argv[iArg], "-metricsport")) {
+			if (iArg + 1 >= argc) {
+				ShowUsageAndExit(argv[0]);
+			}
+			str = argv[++iArg];
+			unsigned long ulPort = strtoul(str, &pEnd, 10);
+			if (pEnd == str || *pEnd != '\0' || ulPort == 0 || ulPort > 65535) {
+				ShowUsageAndExit(argv[0]);
+			}
+			wMetricsPort = (WORD)ulPort;
+			continue;
+		}
+
+		if (!_stricmp(argv[iArg], "-inputport")) {
+			if (iArg + 1 >= argc) {
+				ShowUsageAndExit(argv[0]);
+			}
+			str = argv[++iArg];
+			unsigned long ulPort = strtoul(str, &pEnd, 10);
+			if (pEnd == str || *pEnd != '\0' || ulPort == 0 || ulPort > 65535) {
+				ShowUsageAndExit(argv[0]);
+			}
+			wInputPort = (WORD)ulPort;
+			continue;
+		}
+
+		if (!_stricmp(argv[iArg], "-inputring")) {
+			if (iArg + 1 >= argc) {
+				ShowUsageAndExit(argv[0]);
+			}
+			str = argv[++iArg];
+			unsigned long ulCapacity = strtoul(str, &pEnd, 10);
+			if (pEnd == str || *pEnd != '\0' || ulCapacity < 2 || ulCapacity > N_USER_INPUT || (ulCapacity & (ulCapacity - 1))) {
+				ShowUsageAndExit(argv[0]);
+			}
+			nUserInputCapacity = (DWORD)ulCapacity;
+			continue;
+		}
+
+		if (!_stricmp(argv[iArg], "-ladder")) {
+			if (iArg + 1 >= argc) {
+				ShowUsageAndExit(argv[0]);
+			}
+			str = argv[++iArg];
+			int nRendition = 0;
+			for (;;) {
+				unsigned long ulHeight = strtoul(str, &pEnd, 10);
+				if (pEnd == str || ulHeight < 2 || ulHeight > 4320 || nRendition == N_RENDITION) {
+					ShowUsageAndExit(argv[0]);
+				}
+				awRenditionHeight[nRendition++] = (WORD)ulHeight;
+				if (*pEnd == '\0') {
+					break;
+				}
+				if (*pEnd != ',') {
+					ShowUsageAndExit(argv[0]);
+				}
+				str = pEnd + 1;
+			}
+			continue;
+		}
+
+		if (!_stricmp(argv[iArg], "-nvenc")) {
+			if (iArg + 1 >= argc) {
+				ShowUsageAndExit(argv[0]);
+			}
+			strEncoderOptions = argv[++iArg];
+			if (strEncoderOptions.size() >= sizeof(((AppParam *)0)->szEncoderOptions)) {
+				ShowUsageAndExit(argv[0]);
+			}
+			continue;
+		}
+
+		if (!_stricmp(argv[iArg], "-driver")) {
+			if (iArg + 1 >= argc) {
+				ShowUsageAndExit(argv[0]);
+			}
+			strDriverLibrary = argv[++iArg];
+			if (strDriverLibrary.size() >= sizeof(((AppParam *)0)->szDriverLibrary)) {
+				ShowUsageAndExit(argv[0]);
+			}
+			continue;
+		}
+
 		/*When control flow reaches here, no valid option is parsed. 
 		  The rest are application command line.*/
 		break;
@@ -207,6 +350,93 @@ void SignalHandler_FullStop(int signal)
 	bFullStop = TRUE;
 }
 
+// After Ctrl+C, closes the user input ring, which the shim's injector takes as the request to close the game
+void PollFullStop(AppParamManager *pManager)
+{
+	if (bFullStop && !pManager->IsUserInputClosed()) {
+		LOG_INFO(logger, "Asking the game to close");
+		pManager->CloseUserInput();
+	}
+}
+
+/* Receives the viewers' input, datagrams of WIRE_USER_INPUT_BATCH, on UDP port wPort
+   and posts it to the game's injector until bStop is set.*/
+void RunInputReceiver(WORD wPort, AppParamManager *pManager, std::atomic<bool> *pbStop)
+{
+	WSADATA w;
+	if (WSAStartup(0x0101, &w) != 0) {
+		LOG_ERROR(logger, "WSAStartup() failed, no user input is received");
+		return;
+	}
+	SOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(wPort);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (s == INVALID_SOCKET || bind(s, (struct sockaddr *)&sa, sizeof(sa))) {
+		LOG_ERROR(logger, "Failed to receive user input on port " << wPort << ", error=" << WSAGetLastError());
+		if (s != INVALID_SOCKET) {
+			closesocket(s);
+		}
+		WSACleanup();
+		return;
+	}
+	// Wakes up now and then to look at the stop flag
+	DWORD dwTimeout = SERVICE_WAIT_MS;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&dwTimeout, sizeof(dwTimeout));
+	LOG_INFO(logger, "Receiving user input on port " << wPort);
+
+	BYTE abDatagram[CONTROL_INFO_WIRE_DATAGRAM_SIZE];
+	unsigned int nInput = 0, nDropped = 0, nMalformed = 0;
+	while (!*pbStop) {
+		int cb = recv(s, (char *)abDatagram, sizeof(abDatagram), 0);
+		if (cb <= 0) {
+			continue;
+		}
+		UserInputBatchReader reader(abDatagram, (size_t)cb);
+		UserInput ui;
+		while (reader.Next(ui)) {
+			nInput++;
+			nDropped += !pManager->PostUserInput(ui);
+		}
+		nMalformed += !reader.IsValid();
+	}
+	LOG_INFO(logger, "User input: " << nInput << " inputs, " << nDropped << " dropped on a full ring, " << nMalformed << " malformed datagrams");
+	closesocket(s);
+	WSACleanup();
+}
+
+/* Encodes the players of the game until it exits; a player is attached as soon as
+   the shim has created its frame ring.*/
+void RunEncodeService(DWORD dwGamePid, HANDLE hGame, int nPlayer, const PlayerOutputConfig &outputConfig, AppParamManager *pManager)
+{
+	EncodeService service;
+	DWORD dwLastLog = GetTickCount();
+	while (WaitForSingleObject(hGame, SERVICE_WAIT_MS) == WAIT_TIMEOUT) {
+		PollFullStop(pManager);
+		for (int i = 0; i < nPlayer; i++) {
+			if (!service.IsAttached(i)) {
+				service.Attach(dwGamePid, i, outputConfig);
+			}
+		}
+		if (GetTickCount() - dwLastLog < 5000) {
+			continue;
+		}
+		dwLastLog = GetTickCount();
+		for (int i = 0; i < nPlayer; i++) {
+			EncodeService::Stats stats = service.TakeStats(i);
+			if (stats.nFrame || stats.nDropped) {
+				LOG_INFO(logger, "Service of player " << i << ": " << stats.nFrame << " frames, " << stats.nIdr << " IDRs, "
+					<< stats.nEncodeError << " errors, " << stats.nDropped << " dropped by the shim, " << stats.nSinkDropped
+					<< " by the output, handoff "
+					<< (stats.nFrame ? stats.qwHandoffUs / stats.nFrame : 0) << "us average, " << stats.qwMaxHandoffUs << "us max");
+			}
+		}
+	}
+	service.Stop();
+}
+
 int main(int argc, char *argv[]) 
 {
 	if (argc == 1) {
@@ -225,10 +455,26 @@ int main(int argc, char *argv[])
 	int iSplitWidth = 0;
 	int iSplitHeight = 0;
 	BOOL bHEVC = FALSE;
-	ParseArgs(argc, argv, iArg, iRes, iGpu, iAudio, iNumPlayers, iCols, iRows, iSplitWidth, iSplitHeight, bHEVC);
+	DWORD ePlacementPolicy = PLACEMENT_OS;
+	ULONGLONG qwEncoderCpuMask = 0;
+	std::string strEncoderOptions;
+	WORD wMetricsPort = 0;
+	WORD awRenditionHeight[N_RENDITION] = {0};
+	std::string strDriverLibrary;
+	BOOL bEncodeService = FALSE;
+	WORD wInputPort = 0;
+	DWORD nUserInputCapacity = N_USER_INPUT;
+	ParseArgs(argc, argv, iArg, iRes, iGpu, iAudio, iNumPlayers, iCols, iRows, iSplitWidth, iSplitHeight, bHEVC,
+		ePlacementPolicy, qwEncoderCpuMask, strEncoderOptions, wMetricsPort, awRenditionHeight, strDriverLibrary,
+		bEncodeService, wInputPort, nUserInputCapacity);
+	// The service streams the players the way the shim would, so it takes the output options of -nvenc
+	PlayerOutputConfig outputConfig;
+	if (bEncodeService && !outputConfig.Parse(strEncoderOptions.c_str())) {
+		ShowUsageAndExit(argv[0]);
+	}
 
 	ULONGLONG pid = GetCurrentProcessId();
-	AppParamManager appParamManger(&pid);
+	AppParamManager appParamManger(&pid, nUserInputCapacity);
 	AppParam *pAppParam = appParamManger.GetAppParam();
 	if (!pAppParam) {
 		printf("Unable to setup shared memory. Program will exit.\n");
@@ -261,6 +507,14 @@ int main(int argc, char *argv[])
 	pAppParam->cxEncoding = aRes[iRes].x;
 	pAppParam->cyEncoding = aRes[iRes].y;
 	pAppParam->bHEVC = bHEVC;
+	pAppParam->ePlacementPolicy = ePlacementPolicy;
+	pAppParam->qwEncoderCpuMask = qwEncoderCpuMask;
+	pAppParam->qwGameCpuMask = 0;
+	strcpy_s(pAppParam->szEncoderOptions, strEncoderOptions.c_str());
+	pAppParam->wMetricsPort = wMetricsPort;
+	memcpy(pAppParam->awRenditionHeight, awRenditionHeight, sizeof(pAppParam->awRenditionHeight));
+	strcpy_s(pAppParam->szDriverLibrary, strDriverLibrary.c_str());
+	pAppParam->bEncodeService = bEncodeService;
 
 	char szAppDir[MAX_PATH];
 	strcpy_s(szAppDir, argv[iArg]);
@@ -293,10 +547,27 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 	CloseHandle(pi.hThread);
-	CloseHandle(pi.hProcess);
 
 	while (appParamManger.IsAppUninitialized()) {
 		Sleep(100);
 	}
+	std::atomic<bool> bInputStop(false);
+	std::thread thInput;
+	if (wInputPort) {
+		signal(SIGINT, SignalHandler_FullStop);
+		thInput = std::thread(RunInputReceiver, wInputPort, &appParamManger, &bInputStop);
+	}
+	if (bEncodeService) {
+		RunEncodeService(pi.dwProcessId, pi.hProcess, pAppParam->numPlayers, outputConfig, &appParamManger);
+	} else if (wInputPort) {
+		while (WaitForSingleObject(pi.hProcess, SERVICE_WAIT_MS) == WAIT_TIMEOUT) {
+			PollFullStop(&appParamManger);
+		}
+	}
+	if (thInput.joinable()) {
+		bInputStop = true;
+		thInput.join();
+	}
+	CloseHandle(pi.hProcess);
 	return 0;
 }
@@ -0,0 +1,113 @@
+/*!
+ * \brief
+ * Benchmark of ActivityEstimator on 1080p frames against its 0.3 ms budget
+ *
+ * \file
+ *
+ * The input is a run of 1920x1080 luma planes of a panning gradient with
+ * noise, more of them than the caches hold, as captured frames arrive.
+ * Every kernel runs ActivityEstimator::Update() on them in turn; the time
+ * of a kernel is its best of a few rounds, so that another process on the
+ * machine does not count against it.
+ *
+ * The benchmark reports ms per frame of each kernel and fails if the SSE2
+ * one, which the shim runs, takes more than ACTIVITY_BUDGET_MS, or if the
+ * kernels measure the frames differently.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "ActivityEstimator.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+// Distinct frames, 16 MB of luma
+#define SOURCE_FRAME_COUNT 8
+#define FRAMES_PER_ROUND 240
+#define ROUND_COUNT 5
+#define ACTIVITY_BUDGET_MS 0.3
+
+static std::vector<uint8_t> MakeFrame(int iFrame)
+{
+	std::vector<uint8_t> v((size_t)WIDTH * HEIGHT);
+	uint32_t u = 12345 + iFrame;
+	for (int y = 0; y < HEIGHT; y++) {
+		for (int x = 0; x < WIDTH; x++) {
+			u ^= u << 13;
+			u ^= u >> 17;
+			u ^= u << 5;
+			// Pans by 6 pixels a frame
+			v[(size_t)y * WIDTH + x] = (uint8_t)((x + 6 * iFrame + y) / 8 + u % 16);
+		}
+	}
+	return v;
+}
+
+struct Result {
+	double msFrame;
+	std::vector<ActivityEstimator::Frame> vFrame;
+};
+
+static void Run(const std::vector<std::vector<uint8_t> > &vvFrame, ActivityKernel eKernel, Result &r)
+{
+	ActivitySelectKernel(eKernel);
+	ActivityEstimator estimator;
+	estimator.Configure(WIDTH, HEIGHT);
+	r.msFrame = 1e9;
+	r.vFrame.clear();
+	for (int k = 0; k < ROUND_COUNT; k++) {
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		for (int i = 0; i < FRAMES_PER_ROUND; i++) {
+			estimator.Update(vvFrame[i % SOURCE_FRAME_COUNT].data(), WIDTH);
+			if (!k) {
+				r.vFrame.push_back(estimator.GetLastFrame());
+			}
+		}
+		double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		r.msFrame = std::min(r.msFrame, sec * 1000 / FRAMES_PER_ROUND);
+	}
+}
+
+static bool SameFrames(const std::vector<ActivityEstimator::Frame> &a, const std::vector<ActivityEstimator::Frame> &b)
+{
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < a.size(); i++) {
+		if (a[i].difference != b[i].difference || a[i].gradient != b[i].gradient || a[i].score != b[i].score) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::vector<uint8_t> > vvFrame;
+	for (int i = 0; i < SOURCE_FRAME_COUNT; i++) {
+		vvFrame.push_back(MakeFrame(i));
+	}
+
+	Result scalar, sse2;
+	Run(vvFrame, ACTIVITY_KERNEL_SCALAR, scalar);
+	Run(vvFrame, ACTIVITY_KERNEL_SSE2, sse2);
+	printf("%-10s %14s %14s %14s\n", "", "scalar", "sse2", "budget");
+	printf("%-10s %8.3f ms/fr %8.3f ms/fr %8.3f ms/fr\n", "1920x1080", scalar.msFrame, sse2.msFrame, ACTIVITY_BUDGET_MS);
+	if (!SameFrames(scalar.vFrame, sse2.vFrame)) {
+		printf("FAIL: the SSE2 and scalar kernels measure the frames differently\n");
+		return 1;
+	}
+	if (sse2.msFrame > ACTIVITY_BUDGET_MS) {
+		printf("FAIL: a 1080p frame takes %.3f ms, over the budget of %.1f ms\n", sse2.msFrame, ACTIVITY_BUDGET_MS);
+		return 1;
+	}
+	return 0;
+}
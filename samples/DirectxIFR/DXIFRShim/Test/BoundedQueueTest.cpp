@@ -0,0 +1,301 @@
+/*!
+ * \brief
+ * Multi-threaded stress tests of SpscQueue, MpmcQueue and BlockingQueue
+ *
+ * \file
+ *
+ * Producers push items that carry their producer and sequence number, in
+ * batches of varying size, into small queues so that they are full most of
+ * the time. Consumers check that every item arrives exactly once and that
+ * each of them sees a producer's items in the order they were pushed.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "BoundedQueue.h"
+#include "TestUtil.h"
+
+typedef unsigned long long Item;
+
+#define ITEM(iProducer, seq) (((Item)(iProducer) << 40) | (seq))
+#define ITEM_PRODUCER(item) ((unsigned int)((item) >> 40))
+#define ITEM_SEQ(item) ((item) & ((1ull << 40) - 1))
+
+// Bookkeeping of a stress run, shared by its consumers
+class Tally
+{
+public:
+	Tally(unsigned int nProducer, Item nPerProducer) : nProducer(nProducer), nPerProducer(nPerProducer),
+		abSeen(new std::atomic<unsigned char>[nProducer * nPerProducer]), nDuplicate(0), nDisorder(0), nReceived(0)
+	{
+		for (Item i = 0; i < nProducer * nPerProducer; i++) {
+			abSeen[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	// Called by one consumer for the items it got, in order; vLast is that consumer's own
+	void Take(const Item *pItem, uint32_t n, std::vector<Item> &vLast)
+	{
+		for (uint32_t i = 0; i < n; i++) {
+			unsigned int iProducer = ITEM_PRODUCER(pItem[i]);
+			Item seq = ITEM_SEQ(pItem[i]);
+			if (iProducer >= nProducer || seq >= nPerProducer) {
+				nDisorder++;
+				continue;
+			}
+			if (abSeen[iProducer * nPerProducer + seq].exchange(1)) {
+				nDuplicate++;
+			}
+			if (vLast[iProducer] != ~0ull && seq <= vLast[iProducer]) {
+				nDisorder++;
+			}
+			vLast[iProducer] = seq;
+		}
+		nReceived += n;
+	}
+
+	void Check()
+	{
+		CHECK(nReceived == nProducer * nPerProducer);
+		CHECK(nDuplicate == 0);
+		CHECK(nDisorder == 0);
+	}
+
+	unsigned int nProducer;
+	Item nPerProducer;
+
+private:
+	std::unique_ptr<std::atomic<unsigned char>[]> abSeen;
+	std::atomic<unsigned int> nDuplicate, nDisorder;
+	std::atomic<Item> nReceived;
+};
+
+// Pushes items in batches of 1 to nMaxBatch, yielding whenever the queue is full
+template <class Queue>
+static void Produce(Queue &q, unsigned int iProducer, Item nPerProducer, uint32_t nMaxBatch)
+{
+	Item aItem[16];
+	for (Item seq = 0; seq < nPerProducer; ) {
+		uint32_t n = (uint32_t)(seq % nMaxBatch) + 1;
+		n = n < nPerProducer - seq ? n : (uint32_t)(nPerProducer - seq);
+		for (uint32_t i = 0; i < n; i++) {
+			aItem[i] = ITEM(iProducer, seq + i);
+		}
+		uint32_t nPushed = q.PushBatch(aItem, n);
+		if (!nPushed) {
+			std::this_thread::yield();
+		}
+		seq += nPushed;
+	}
+}
+
+// Runs nProducer producers and nConsumer consumers over q until every item went through
+template <class Queue>
+static void Stress(Queue &q, unsigned int nProducer, unsigned int nConsumer, Item nPerProducer, uint32_t nMaxBatch)
+{
+	Tally tally(nProducer, nPerProducer);
+	std::atomic<unsigned int> nProducerDone(0);
+	std::vector<std::thread> vThread;
+	for (unsigned int p = 0; p < nProducer; p++) {
+		vThread.push_back(std::thread([&q, &nProducerDone, p, nPerProducer, nMaxBatch] {
+			Produce(q, p, nPerProducer, nMaxBatch);
+			nProducerDone++;
+		}));
+	}
+	for (unsigned int c = 0; c < nConsumer; c++) {
+		vThread.push_back(std::thread([&q, &tally, &nProducerDone, nProducer, nMaxBatch] {
+			std::vector<Item> vLast(nProducer, ~0ull);
+			Item aItem[16];
+			for (;;) {
+				// Done is read before the pop, so an empty pop after it means nothing is left
+				bool bDone = nProducerDone == nProducer;
+				uint32_t n = q.PopBatch(aItem, nMaxBatch);
+				if (n) {
+					tally.Take(aItem, n, vLast);
+				} else if (bDone) {
+					break;
+				} else {
+					std::this_thread::yield();
+				}
+			}
+		}));
+	}
+	for (size_t i = 0; i < vThread.size(); i++) {
+		vThread[i].join();
+	}
+	tally.Check();
+	CHECK(q.IsEmpty());
+}
+
+static void TestSpscSingleItems()
+{
+	SpscQueue<Item, 64> q;
+	Stress(q, 1, 1, 200000, 1);
+}
+
+static void TestSpscBatches()
+{
+	SpscQueue<Item, 64> q;
+	// Batches up to 13 do not divide the capacity, so they wrap around the end of the ring
+	Stress(q, 1, 1, 200000, 13);
+}
+
+static void TestSpscBatchLargerThanFree()
+{
+	SpscQueue<Item, 8> q;
+	Item aItem[12];
+	for (int i = 0; i < 12; i++) {
+		aItem[i] = i;
+	}
+	CHECK(q.PushBatch(aItem, 5) == 5);
+	CHECK(q.PushBatch(aItem + 5, 7) == 3);
+	CHECK(q.GetSize() == 8);
+	Item aOut[12];
+	CHECK(q.PopBatch(aOut, 12) == 8);
+	for (int i = 0; i < 8; i++) {
+		CHECK(aOut[i] == (Item)i);
+	}
+	CHECK(q.PopBatch(aOut, 12) == 0);
+	CHECK(q.IsEmpty());
+}
+
+static void TestMpmcManyProducersOneConsumer()
+{
+	MpmcQueue<Item, 64> q;
+	Stress(q, 4, 1, 50000, 7);
+}
+
+static void TestMpmcManyProducersManyConsumers()
+{
+	MpmcQueue<Item, 64> q;
+	Stress(q, 8, 8, 25000, 5);
+}
+
+static void TestMpmcTinyQueue()
+{
+	// Two slots for eight threads: nearly every push and pop contends
+	MpmcQueue<Item, 2> q;
+	Stress(q, 4, 4, 20000, 1);
+}
+
+static void TestBlockingMpmcCloseWakesConsumers()
+{
+	BlockingQueue<MpmcQueue<Item, 8>, Item> q;
+	const unsigned int nProducer = 4, nConsumer = 4;
+	const Item nPerProducer = 20000;
+	Tally tally(nProducer, nPerProducer);
+	std::atomic<unsigned int> nPushFailure(0), nConsumerDone(0);
+	std::vector<std::thread> vProducer, vConsumer;
+	for (unsigned int p = 0; p < nProducer; p++) {
+		vProducer.push_back(std::thread([&q, &nPushFailure, p, nPerProducer] {
+			for (Item seq = 0; seq < nPerProducer; seq++) {
+				if (!q.WaitPush(ITEM(p, seq))) {
+					nPushFailure++;
+				}
+			}
+		}));
+	}
+	for (unsigned int c = 0; c < nConsumer; c++) {
+		vConsumer.push_back(std::thread([&q, &tally, &nConsumerDone, nProducer] {
+			std::vector<Item> vLast(nProducer, ~0ull);
+			Item aItem[3];
+			uint32_t n;
+			// Only Close() ends the wait of an idle consumer
+			while ((n = q.WaitPopBatch(aItem, 3)) != 0) {
+				tally.Take(aItem, n, vLast);
+			}
+			CHECK(q.IsClosed());
+			nConsumerDone++;
+		}));
+	}
+	for (size_t i = 0; i < vProducer.size(); i++) {
+		vProducer[i].join();
+	}
+	CHECK(WaitUntil([&q] { return q.GetSize() == 0; }));
+	CHECK(nConsumerDone == 0);
+	q.Close();
+	for (size_t i = 0; i < vConsumer.size(); i++) {
+		vConsumer[i].join();
+	}
+	CHECK(nPushFailure == 0);
+	tally.Check();
+}
+
+static void TestBlockingSpscInOrder()
+{
+	BlockingQueue<SpscQueue<Item, 4>, Item> q;
+	const Item nItem = 100000;
+	Item nExpected = 0;
+	bool bInOrder = true;
+	std::thread consumer([&q, &nExpected, &bInOrder] {
+		Item item;
+		while (q.WaitPop(item)) {
+			bInOrder = bInOrder && item == nExpected;
+			nExpected++;
+		}
+	});
+	Item aItem[3];
+	for (Item i = 0; i < nItem; ) {
+		uint32_t n = nItem - i < 3 ? (uint32_t)(nItem - i) : 3;
+		for (uint32_t j = 0; j < n; j++) {
+			aItem[j] = i + j;
+		}
+		// Waits for room until the whole batch is in
+		CHECK(q.WaitPushBatch(aItem, n) == n);
+		i += n;
+	}
+	q.Close();
+	consumer.join();
+	CHECK(bInOrder);
+	CHECK(nExpected == nItem);
+}
+
+static void TestBlockingTimeouts()
+{
+	BlockingQueue<SpscQueue<Item, 4>, Item> q;
+	Item item;
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	CHECK(!q.WaitPop(item, 50));
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	CHECK(ms >= 45 && ms < 1000);
+
+	for (Item i = 0; i < 4; i++) {
+		CHECK(q.Push(i));
+	}
+	CHECK(q.IsFull());
+	t0 = std::chrono::steady_clock::now();
+	CHECK(!q.WaitPush(9, 30));
+	ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	CHECK(ms >= 25 && ms < 1000);
+
+	// A consumer making room ends the wait of a producer
+	std::thread consumer([&q] {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		Item itemPopped;
+		q.Pop(itemPopped);
+	});
+	CHECK(q.WaitPush(9, 5000));
+	consumer.join();
+}
+
+int main(int argc, char *argv[])
+{
+	RUN_TEST(TestSpscSingleItems);
+	RUN_TEST(TestSpscBatches);
+	RUN_TEST(TestSpscBatchLargerThanFree);
+	RUN_TEST(TestMpmcManyProducersOneConsumer);
+	RUN_TEST(TestMpmcManyProducersManyConsumers);
+	RUN_TEST(TestMpmcTinyQueue);
+	RUN_TEST(TestBlockingMpmcCloseWakesConsumers);
+	RUN_TEST(TestBlockingSpscInOrder);
+	RUN_TEST(TestBlockingTimeouts);
+	return TestResult();
+}
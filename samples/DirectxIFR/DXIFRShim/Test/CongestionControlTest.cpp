@@ -0,0 +1,369 @@
+/*!
+ * \brief
+ * Tests of CongestionControl against a simulated bottleneck link
+ *
+ * \file
+ *
+ * A 60 fps sender encodes every frame at the bitrate NvIFREncoder would
+ * pick, the estimate through a BitrateSmoother, and sends it as a burst of
+ * 1200-byte packets into a drop-tail bottleneck of a given
+ * capacity, propagation delay and random loss. The receiver's report of
+ * every frame comes back over a fixed feedback delay and is handed to
+ * OnReport() at the next frame, as NvIFREncoder does with the AppParam
+ * ring. The receiver's clock is offset to wrap during the run.
+ *
+ * The tests change the link under the controller (a capacity step down and
+ * up, a longer path, loss) and check where the estimate settles relative
+ * to the capacity and how long frames wait in the bottleneck queue.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include "CongestionControl.h"
+#include "TestUtil.h"
+
+#define FPS 60
+#define PACKET_BYTES 1200
+#define FEEDBACK_DELAY_US 20000
+// The bottleneck drops packets that would wait longer than this
+#define MAX_QUEUE_US 1000000
+#define START_BITRATE 1000000
+#define MIN_BITRATE 100000
+#define MAX_BITRATE 20000000
+// Wraps the receiver's 32-bit microsecond clock 10 s into the run
+#define RECEIVER_CLOCK_OFFSET_US (0xFFFFFFFFu - 10000000u)
+// Bounds of a settled stream: the estimate relative to the capacity, and the wait in the queue
+#define MIN_SETTLED_RATIO 0.8
+#define MAX_SETTLED_RATIO 1.05
+#define MAX_SETTLED_PEAK_RATIO 1.2
+#define MAX_SETTLED_QUEUE_P95_MS 50
+#define MAX_SETTLED_QUEUE_MS 100
+
+class Random
+{
+public:
+	Random(uint32_t seed) : u(seed) {}
+	// Uniform in [0, 1)
+	double Next()
+	{
+		u ^= u << 13;
+		u ^= u >> 17;
+		u ^= u << 5;
+		return u / 4294967296.0;
+	}
+
+private:
+	uint32_t u;
+};
+
+struct Sample {
+	double sec;
+	double estimate;
+	// What the encoder was set to
+	double bitrate;
+	double capacity;
+	// Wait of the frame's first packet behind what was already queued
+	double msQueue;
+};
+
+class LinkSimulation
+{
+public:
+	LinkSimulation(double capacity, double msPropagation = 20, double loss = 0) :
+		cc(START_BITRATE, MIN_BITRATE, MAX_BITRATE), smoother(START_BITRATE), capacity(capacity), msPropagation(msPropagation), loss(loss),
+		random(1), iFrame(0), usLinkFree(0), nLost(0), nExpected(0) {}
+
+	// Runs the sender for sec seconds of simulated time
+	void Run(double sec)
+	{
+		for (int n = (int)(sec * FPS); n > 0; n--) {
+			double usNow = iFrame * 1e6 / FPS;
+			DWORD dwNow = (DWORD)(usNow / 1000);
+			while (!dqFeedback.empty() && dqFeedback.front().first <= usNow) {
+				cc.OnReport(dqFeedback.front().second, dwNow);
+				dqFeedback.pop_front();
+			}
+			cc.OnTick(dwNow);
+
+			Sample s;
+			s.sec = usNow / 1e6;
+			s.estimate = cc.GetEstimate();
+			DWORD dwBitrate;
+			smoother.Update((DWORD)s.estimate, dwNow, &dwBitrate);
+			s.bitrate = dwBitrate;
+			s.capacity = capacity;
+			s.msQueue = std::max(usLinkFree - usNow, 0.0) / 1000;
+			vSample.push_back(s);
+
+			// The encoder hits its target on average, not on every frame
+			double cbFrame = s.bitrate / 8 / FPS * (0.8 + 0.4 * random.Next());
+			Send(usNow, (DWORD)cbFrame);
+			iFrame++;
+		}
+	}
+
+	// The estimate and the queueing delay over the last sec seconds
+	double GetMeanEstimate(double sec)
+	{
+		double sum = 0;
+		int n = 0;
+		for (size_t i = Since(sec); i < vSample.size(); i++, n++) {
+			sum += vSample[i].estimate;
+		}
+		return n ? sum / n : 0;
+	}
+	double GetMaxEstimate(double sec)
+	{
+		double maxEstimate = 0;
+		for (size_t i = Since(sec); i < vSample.size(); i++) {
+			maxEstimate = std::max(maxEstimate, vSample[i].estimate);
+		}
+		return maxEstimate;
+	}
+	double GetMinEstimate(double sec)
+	{
+		double minEstimate = 1e12;
+		for (size_t i = Since(sec); i < vSample.size(); i++) {
+			minEstimate = std::min(minEstimate, vSample[i].estimate);
+		}
+		return minEstimate;
+	}
+	double GetQueuePercentileMs(double sec, double p)
+	{
+		std::vector<double> v;
+		for (size_t i = Since(sec); i < vSample.size(); i++) {
+			v.push_back(vSample[i].msQueue);
+		}
+		std::sort(v.begin(), v.end());
+		return v.empty() ? 0 : v[(size_t)(p * (v.size() - 1))];
+	}
+	double GetMaxQueueMs(double sec)
+	{
+		double msMax = 0;
+		for (size_t i = Since(sec); i < vSample.size(); i++) {
+			msMax = std::max(msMax, vSample[i].msQueue);
+		}
+		return msMax;
+	}
+	// Seconds from secFrom until the estimate first fell below bitrate
+	double GetTimeBelow(double secFrom, double bitrate)
+	{
+		for (size_t i = 0; i < vSample.size(); i++) {
+			if (vSample[i].sec >= secFrom && vSample[i].estimate < bitrate) {
+				return vSample[i].sec - secFrom;
+			}
+		}
+		return 1e9;
+	}
+	double GetTimeAbove(double secFrom, double bitrate)
+	{
+		for (size_t i = 0; i < vSample.size(); i++) {
+			if (vSample[i].sec >= secFrom && vSample[i].estimate > bitrate) {
+				return vSample[i].sec - secFrom;
+			}
+		}
+		return 1e9;
+	}
+	double Now()
+	{
+		return iFrame / (double)FPS;
+	}
+
+	CongestionControl cc;
+	BitrateSmoother smoother;
+	double capacity;
+	double msPropagation;
+	double loss;
+
+private:
+	size_t Since(double sec)
+	{
+		double secFrom = Now() - sec;
+		size_t i = vSample.size();
+		while (i > 0 && vSample[i - 1].sec >= secFrom) {
+			i--;
+		}
+		return i;
+	}
+
+	void Send(double usNow, DWORD cbFrame)
+	{
+		CongestionReport cr;
+		memset(&cr, 0, sizeof(cr));
+		cr.dwFrame = iFrame;
+		cr.dwSendUs = (DWORD)usNow;
+		double usArrival = -1;
+		for (DWORD cbSent = 0; cbSent < cbFrame; cbSent += PACKET_BYTES) {
+			DWORD cbPacket = std::min<DWORD>(PACKET_BYTES, cbFrame - cbSent);
+			nExpected++;
+			if (usLinkFree - usNow > MAX_QUEUE_US || random.Next() < loss) {
+				nLost++;
+				continue;
+			}
+			usLinkFree = std::max(usLinkFree, usNow) + cbPacket * 8 * 1e6 / capacity;
+			usArrival = usLinkFree + msPropagation * 1000;
+			cr.cbReceived += cbPacket;
+		}
+		// A frame the receiver got nothing of is not reported; the next report counts its packets by sequence number
+		if (usArrival < 0) {
+			return;
+		}
+		cr.nPacketLost = (WORD)nLost;
+		cr.nPacketExpected = (WORD)nExpected;
+		nLost = nExpected = 0;
+		cr.dwArrivalUs = (DWORD)((uint64_t)usArrival + RECEIVER_CLOCK_OFFSET_US);
+		dqFeedback.push_back(std::make_pair(usArrival + FEEDBACK_DELAY_US, cr));
+	}
+
+	Random random;
+	DWORD iFrame;
+	// When the bottleneck is done with what it holds
+	double usLinkFree;
+	// Packets since the last report
+	unsigned int nLost, nExpected;
+	// Reports on their way back, by the time they reach the sender
+	std::deque<std::pair<double, CongestionReport> > dqFeedback;
+	std::vector<Sample> vSample;
+};
+
+// Where the estimate settled over the last sec seconds, and how long frames queued meanwhile
+static void CheckConverged(LinkSimulation &sim, double sec)
+{
+	double mean = sim.GetMeanEstimate(sec);
+	double msQueueP95 = sim.GetQueuePercentileMs(sec, 0.95);
+	bool bSettled = mean > MIN_SETTLED_RATIO * sim.capacity && mean < MAX_SETTLED_RATIO * sim.capacity
+		&& sim.GetMaxEstimate(sec) < MAX_SETTLED_PEAK_RATIO * sim.capacity
+		&& msQueueP95 < MAX_SETTLED_QUEUE_P95_MS && sim.GetMaxQueueMs(sec) < MAX_SETTLED_QUEUE_MS;
+	CHECK(bSettled);
+	if (!bSettled) {
+		printf("  at %.0f s: estimate %.2f Mbps on average, %.2f Mbps at most on %.2f Mbps, queue %.1f ms p95, %.1f ms at most\n",
+			sim.Now(), mean / 1e6, sim.GetMaxEstimate(sec) / 1e6, sim.capacity / 1e6, msQueueP95, sim.GetMaxQueueMs(sec));
+	}
+}
+
+static void TestConvergesToCapacity()
+{
+	LinkSimulation sim(4e6);
+	// Up from the start bitrate at 8% a second
+	sim.Run(30);
+	CHECK(sim.GetTimeAbove(0, 0.9 * sim.capacity) < 25);
+	sim.Run(30);
+	CheckConverged(sim, 30);
+	CongestionControl::Stats stats = sim.cc.TakeStats();
+	CHECK(stats.nOveruse > 0);
+	CHECK(stats.nLossDecrease == 0 && stats.nFeedbackTimeout == 0 && stats.nStaleReport == 0);
+	// The receiver's clock wrapped 10 s in; the measured rate is still the one sent
+	CHECK(stats.dwReceiveRate > 0.7 * sim.capacity && stats.dwReceiveRate < 1.05 * sim.capacity);
+}
+
+static void TestBandwidthStep()
+{
+	LinkSimulation sim(8e6);
+	sim.Run(40);
+	CheckConverged(sim, 20);
+
+	/* A quarter of the capacity. The cuts leave 15% of the link to drain the queue the overshoot
+	   built, and the estimate is back at the capacity before it is gone, so some of it may stand
+	   until the next overuse.*/
+	double secStep = sim.Now();
+	sim.capacity = 2e6;
+	sim.Run(5);
+	CHECK(sim.GetTimeBelow(secStep, sim.capacity) < 1.5);
+	sim.Run(5);
+	CHECK(sim.GetMaxQueueMs(5) < 500);
+	sim.Run(10);
+	CHECK(sim.GetMaxQueueMs(10) < 250);
+	sim.Run(20);
+	CheckConverged(sim, 20);
+
+	// And up again, back at the multiplicative rate since the new rates are far above the old maximum
+	secStep = sim.Now();
+	sim.capacity = 6e6;
+	sim.Run(40);
+	CHECK(sim.GetTimeAbove(secStep, 0.9 * sim.capacity) < 20);
+	CheckConverged(sim, 20);
+}
+
+static void TestAddedDelay()
+{
+	// A long path converges the same, only later
+	LinkSimulation simFar(4e6, 150);
+	simFar.Run(60);
+	CheckConverged(simFar, 30);
+
+	/* A route change adds 130 ms at once. Until the step leaves the trendline window it looks like
+	   a queue, so the estimate takes the spaced cuts of an overuse, but it does not collapse.*/
+	LinkSimulation sim(4e6);
+	sim.Run(40);
+	double secStep = sim.Now();
+	sim.msPropagation = 150;
+	sim.Run(2);
+	CHECK(sim.GetMinEstimate(2) > 0.4 * sim.capacity);
+	sim.Run(38);
+	CHECK(sim.GetTimeAbove(secStep + 2, 0.9 * sim.capacity) < 20);
+	CheckConverged(sim, 20);
+}
+
+static void TestLoss()
+{
+	// Loss under 2% is noise; the delay decides
+	LinkSimulation sim(4e6, 20, 0.01);
+	sim.Run(60);
+	CheckConverged(sim, 30);
+	CHECK(sim.cc.GetLossRatio() < 0.05);
+	sim.cc.TakeStats();
+
+	// Between 2% and 10% the loss holds the estimate rather than cutting it
+	sim.loss = 0.05;
+	sim.Run(30);
+	CHECK(sim.GetMeanEstimate(30) > 0.6 * sim.capacity && sim.GetMaxEstimate(30) < MAX_SETTLED_PEAK_RATIO * sim.capacity);
+	CHECK(sim.GetMaxQueueMs(30) < MAX_SETTLED_QUEUE_MS);
+
+	// 20% loss halves the estimate within seconds, whatever the delay says
+	double secStep = sim.Now();
+	sim.loss = 0.2;
+	sim.Run(5);
+	CHECK(sim.GetTimeBelow(secStep, 0.5 * sim.capacity) < 3);
+	CHECK(sim.cc.TakeStats().nLossDecrease > 0);
+
+	// Once the loss is gone it climbs back to the capacity
+	sim.loss = 0;
+	sim.Run(60);
+	CheckConverged(sim, 20);
+}
+
+static void TestFeedbackOutage()
+{
+	LinkSimulation sim(4e6);
+	sim.Run(40);
+	sim.cc.TakeStats();
+	DWORD dwBefore = sim.cc.GetEstimate();
+	// Nothing gets through for 2.5 s, feedback included: the estimate halves once per second
+	sim.loss = 1;
+	sim.Run(2.5);
+	CongestionControl::Stats stats = sim.cc.TakeStats();
+	CHECK(stats.nFeedbackTimeout == 2);
+	CHECK(sim.cc.GetEstimate() < 0.3 * dwBefore);
+	sim.loss = 0;
+	sim.Run(40);
+	CheckConverged(sim, 20);
+}
+
+int main(int argc, char *argv[])
+{
+	RUN_TEST(TestConvergesToCapacity);
+	RUN_TEST(TestBandwidthStep);
+	RUN_TEST(TestAddedDelay);
+	RUN_TEST(TestLoss);
+	RUN_TEST(TestFeedbackOutage);
+	return TestResult();
+}
@@ -0,0 +1,299 @@
+/*!
+ * \brief
+ * Benchmark of the ControlInfoWire encoding against the Archive & serialize() path
+ *
+ * \file
+ *
+ * BinaryArchive writes what a binary archive makes of serialize(): every
+ * field at its full size, strings as a length and the bytes. Both paths
+ * encode and decode the same input streams, batched into datagrams of
+ * CONTROL_INFO_WIRE_DATAGRAM_SIZE, and the benchmark reports the bytes and
+ * the time per event of each. It fails if the wire format decodes anything
+ * other than what went in.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "ControlInfoWire.h"
+
+class BinaryArchive
+{
+public:
+	BinaryArchive(std::vector<BYTE> &v, bool bSave) : bSave(bSave), v(v), iRead(0) {}
+
+	template <typename T>
+	typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value, BinaryArchive &>::type operator&(T &t)
+	{
+		if (bSave) {
+			const BYTE *p = (const BYTE *)&t;
+			v.insert(v.end(), p, p + sizeof(t));
+		} else {
+			memcpy(&t, v.data() + iRead, sizeof(t));
+			iRead += sizeof(t);
+		}
+		return *this;
+	}
+	BinaryArchive &operator&(std::string &str)
+	{
+		unsigned long long cch = str.size();
+		*this & cch;
+		if (bSave) {
+			v.insert(v.end(), str.begin(), str.end());
+		} else {
+			str.assign((const char *)v.data() + iRead, (size_t)cch);
+			iRead += (size_t)cch;
+		}
+		return *this;
+	}
+	template <typename T>
+	typename std::enable_if<std::is_class<T>::value, BinaryArchive &>::type operator&(T &t)
+	{
+		t.serialize(*this, 0);
+		return *this;
+	}
+
+private:
+	bool bSave;
+	std::vector<BYTE> &v;
+	size_t iRead;
+};
+
+static UserInput MakeMouseMove(DWORD sn, int x, int y)
+{
+	UserInput ui;
+	memset(&ui, 0, sizeof(ui));
+	ui.sn = sn;
+	ui.type = UI_WM;
+	ui.rcWindow.left = 100;
+	ui.rcWindow.top = 80;
+	ui.rcWindow.right = 100 + 1296;
+	ui.rcWindow.bottom = 80 + 759;
+	ui.rcClient.right = 1280;
+	ui.rcClient.bottom = 720;
+	ui.wm.msg = 0x0200;	// WM_MOUSEMOVE
+	ui.wm.lParam = MAKELONG(x, y);
+	return ui;
+}
+
+static UserInput MakeJoystick(DWORD sn, int i)
+{
+	UserInput ui;
+	memset(&ui, 0, sizeof(ui));
+	ui.sn = sn;
+	ui.type = UI_JOY;
+	ui.joy.lX = 32767 + (i * 37) % 2000 - 1000;
+	ui.joy.lY = 32767 - (i * 53) % 2000 + 1000;
+	ui.joy.rgdwPOV[0] = ui.joy.rgdwPOV[1] = ui.joy.rgdwPOV[2] = ui.joy.rgdwPOV[3] = 0xFFFFFFFF;
+	ui.joy.rgbButtons[i / 16 % 4] = 0x80;
+	return ui;
+}
+
+// Pointer and keyboard input of a desktop session, then a gamepad
+static std::vector<UserInput> MakeStream(bool bJoystick, int n)
+{
+	std::vector<UserInput> vui;
+	for (int i = 0; i < n; i++) {
+		if (bJoystick) {
+			vui.push_back(MakeJoystick(i + 1, i));
+		} else if (i % 10 == 9) {
+			UserInput ui = MakeMouseMove(i + 1, 0, 0);
+			ui.wm.msg = i % 20 == 9 ? 0x0100 : 0x0101;	// WM_KEYDOWN / WM_KEYUP
+			ui.wm.wParam = 'W';
+			ui.wm.lParam = 0x00110001;
+			vui.push_back(ui);
+		} else {
+			vui.push_back(MakeMouseMove(i + 1, 640 + i % 50 * 3, 360 - i % 30 * 2));
+		}
+	}
+	return vui;
+}
+
+struct Result {
+	double cbPerEvent;
+	double nsEncode;
+	double nsDecode;
+};
+
+static double NsSince(std::chrono::steady_clock::time_point t0, size_t n)
+{
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / n;
+}
+
+static bool RunWire(const std::vector<UserInput> &vui, int nRound, Result &r)
+{
+	std::vector<std::vector<BYTE> > vv;
+	BYTE abDatagram[CONTROL_INFO_WIRE_DATAGRAM_SIZE];
+	size_t cbTotal = 0;
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < nRound; k++) {
+		vv.clear();
+		UserInputBatchWriter writer(abDatagram, sizeof(abDatagram));
+		for (size_t i = 0; i < vui.size(); i++) {
+			if (!writer.Add(vui[i])) {
+				size_t cb = writer.Finish();
+				vv.push_back(std::vector<BYTE>(abDatagram, abDatagram + cb));
+				writer.Reset();
+				writer.Add(vui[i]);
+			}
+		}
+		size_t cb = writer.Finish();
+		vv.push_back(std::vector<BYTE>(abDatagram, abDatagram + cb));
+	}
+	r.nsEncode = NsSince(t0, vui.size() * nRound);
+	for (size_t i = 0; i < vv.size(); i++) {
+		cbTotal += vv[i].size();
+	}
+	r.cbPerEvent = (double)cbTotal / vui.size();
+
+	size_t n = 0;
+	UserInput ui;
+	t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < nRound; k++) {
+		n = 0;
+		for (size_t i = 0; i < vv.size(); i++) {
+			UserInputBatchReader reader(vv[i].data(), vv[i].size());
+			if (!reader.IsValid()) {
+				return false;
+			}
+			while (reader.Next(ui)) {
+				if (memcmp(&ui, &vui[n], sizeof(ui))) {
+					return false;
+				}
+				n++;
+			}
+		}
+	}
+	r.nsDecode = NsSince(t0, vui.size() * nRound);
+	return n == vui.size();
+}
+
+static void RunArchive(const std::vector<UserInput> &vui, int nRound, Result &r)
+{
+	// Every event archives to the same size; send as many as fit a datagram
+	std::vector<BYTE> vOne;
+	BinaryArchive arOne(vOne, true);
+	arOne & const_cast<UserInput &>(vui[0]);
+	const size_t nPerDatagram = CONTROL_INFO_WIRE_DATAGRAM_SIZE / vOne.size();
+	std::vector<std::vector<BYTE> > vv;
+	size_t cbTotal = 0;
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < nRound; k++) {
+		vv.clear();
+		for (size_t i = 0; i < vui.size(); i += nPerDatagram) {
+			vv.push_back(std::vector<BYTE>());
+			BinaryArchive ar(vv.back(), true);
+			for (size_t j = i; j < i + nPerDatagram && j < vui.size(); j++) {
+				ar & const_cast<UserInput &>(vui[j]);
+			}
+		}
+	}
+	r.nsEncode = NsSince(t0, vui.size() * nRound);
+	for (size_t i = 0; i < vv.size(); i++) {
+		cbTotal += vv[i].size();
+	}
+	r.cbPerEvent = (double)cbTotal / vui.size();
+
+	UserInput ui;
+	volatile DWORD dwSink = 0;
+	t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < nRound; k++) {
+		size_t n = 0;
+		for (size_t i = 0; i < vv.size(); i++) {
+			BinaryArchive ar(vv[i], false);
+			for (size_t j = 0; j < nPerDatagram && n < vui.size(); j++, n++) {
+				ar & ui;
+				dwSink = dwSink + ui.sn;
+			}
+		}
+	}
+	r.nsDecode = NsSince(t0, vui.size() * nRound);
+}
+
+static bool RunControlInfo(int nRound)
+{
+	ControlInfo ci;
+	ci.type = APP_START;
+	ci.strCmd = "C:\\Games\\Game\\Game.exe -windowed -width 1280 -height 720";
+	ci.strWndClassKeyword = "UnrealWindow";
+	ci.strWndTitleKeyword = "Game";
+	ci.iGpu = 1;
+	ci.iAudio = 0;
+	ci.bDwm = FALSE;
+	ci.cxEncoding = 1280;
+	ci.cyEncoding = 720;
+	ci.bForceCdeclInEnumDevicesCallback = FALSE;
+	ci.ui = MakeMouseMove(0, 0, 0);
+
+	BYTE abWire[CONTROL_INFO_WIRE_DATAGRAM_SIZE];
+	size_t cbWire = 0;
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < nRound; k++) {
+		cbWire = EncodeControlInfo(ci, abWire, sizeof(abWire));
+	}
+	double nsWireEncode = NsSince(t0, nRound);
+	ControlInfo ciOut;
+	t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < nRound; k++) {
+		if (!DecodeControlInfo(abWire, cbWire, ciOut)) {
+			return false;
+		}
+	}
+	double nsWireDecode = NsSince(t0, nRound);
+	if (ciOut.strCmd != ci.strCmd || ciOut.strWndTitleKeyword != ci.strWndTitleKeyword || ciOut.cyEncoding != ci.cyEncoding
+		|| memcmp(&ciOut.ui, &ci.ui, sizeof(ci.ui))) {
+		return false;
+	}
+
+	std::vector<BYTE> v;
+	t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < nRound; k++) {
+		v.clear();
+		BinaryArchive ar(v, true);
+		ar & ci;
+	}
+	double nsArchiveEncode = NsSince(t0, nRound);
+	t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < nRound; k++) {
+		BinaryArchive ar(v, false);
+		ar & ciOut;
+	}
+	double nsArchiveDecode = NsSince(t0, nRound);
+
+	printf("%-22s %8s %10s %10s\n", "ControlInfo", "bytes", "enc ns", "dec ns");
+	printf("  %-20s %8u %10.1f %10.1f\n", "wire", (unsigned)cbWire, nsWireEncode, nsWireDecode);
+	printf("  %-20s %8u %10.1f %10.1f\n", "archive", (unsigned)v.size(), nsArchiveEncode, nsArchiveDecode);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	const int nEvent = 100000, nRound = 20;
+	const char *aszStream[] = {"mouse and keyboard", "joystick"};
+	for (int s = 0; s < 2; s++) {
+		std::vector<UserInput> vui = MakeStream(s == 1, nEvent);
+		Result wire, archive;
+		if (!RunWire(vui, nRound, wire)) {
+			printf("FAIL: %s input does not round-trip through the wire format\n", aszStream[s]);
+			return 1;
+		}
+		RunArchive(vui, nRound, archive);
+		printf("%-22s %8s %10s %10s\n", aszStream[s], "B/event", "enc ns", "dec ns");
+		printf("  %-20s %8.1f %10.1f %10.1f\n", "wire", wire.cbPerEvent, wire.nsEncode, wire.nsDecode);
+		printf("  %-20s %8.1f %10.1f %10.1f\n", "archive", archive.cbPerEvent, archive.nsEncode, archive.nsDecode);
+	}
+	if (!RunControlInfo(200000)) {
+		printf("FAIL: ControlInfo does not round-trip through the wire format\n");
+		return 1;
+	}
+	return 0;
+}
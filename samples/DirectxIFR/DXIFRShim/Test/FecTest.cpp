@@ -0,0 +1,299 @@
+/*!
+ * \brief
+ * Encode, lose and recover round trips of the RS and XOR FEC
+ *
+ * \file
+ *
+ * Every test encodes frames with FecEncoder, drops a chosen set of packets
+ * and feeds the rest to a FecDecoder in a shuffled order, then checks which
+ * frames come out and that they come out byte for byte. The GF(2^8) kernels
+ * are checked against a bitwise multiply first, each one the CPU has.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include "Fec.h"
+#include "TestUtil.h"
+
+// 20 Mbps at 60 fps: 36 data packets, in blocks of 10, 10, 10 and 6
+#define FRAME_SIZE 41666
+
+static const char *aszKernel[] = {"scalar", "ssse3", "avx2"};
+
+// Which packet of the frame to lose: block, index in block, and the block's data and parity counts
+typedef std::function<bool(unsigned int iBlock, unsigned int i, unsigned int kBlock, unsigned int mBlock)> LossPattern;
+
+static uint8_t GfMul(uint8_t a, uint8_t b)
+{
+	uint8_t p = 0;
+	for (; b; b >>= 1) {
+		if (b & 1) {
+			p ^= a;
+		}
+		a = (uint8_t)((a << 1) ^ (a & 0x80 ? 0x1D : 0));
+	}
+	return p;
+}
+
+static std::vector<uint8_t> MakeFrame(size_t cb, unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	std::vector<uint8_t> v(cb);
+	for (size_t i = 0; i < cb; i++) {
+		v[i] = (uint8_t)rng();
+	}
+	return v;
+}
+
+// Frames that came out of the decoder, by frame number
+typedef std::map<uint32_t, std::vector<uint8_t> > Delivered;
+
+static void Deliver(FecDecoder &dec, std::vector<std::vector<uint8_t> > &vPacket, const LossPattern &lose, unsigned int seed,
+	Delivered &delivered)
+{
+	std::vector<std::vector<uint8_t> *> vpKept;
+	for (size_t i = 0; i < vPacket.size(); i++) {
+		const uint8_t *p = vPacket[i].data();
+		if (!lose(p[8] | (p[9] << 8), p[5], p[3], p[4])) {
+			vpKept.push_back(&vPacket[i]);
+		}
+	}
+	std::mt19937 rng(seed);
+	std::shuffle(vpKept.begin(), vpKept.end(), rng);
+	for (size_t i = 0; i < vpKept.size(); i++) {
+		dec.Receive(vpKept[i]->data(), vpKept[i]->size(), [&delivered](const uint8_t *pFrame, size_t cbFrame, uint32_t dwFrame) {
+			CHECK(delivered.find(dwFrame) == delivered.end());
+			delivered[dwFrame] = std::vector<uint8_t>(pFrame, pFrame + cbFrame);
+		});
+	}
+}
+
+// Encodes, loses and decodes one frame; true if it came back intact
+static bool RoundTrip(FecMode eMode, unsigned int k, unsigned int m, size_t cbFrame, const LossPattern &lose, unsigned int seed = 1)
+{
+	FecEncoder enc(eMode, k, m, false);
+	FecDecoder dec;
+	std::vector<std::vector<uint8_t> > vPacket;
+	std::vector<uint8_t> vFrame = MakeFrame(cbFrame, seed);
+	enc.Encode(vFrame.data(), vFrame.size(), seed, vPacket);
+	Delivered delivered;
+	Deliver(dec, vPacket, lose, seed, delivered);
+	return delivered.size() == 1 && delivered.begin()->first == seed && delivered.begin()->second == vFrame;
+}
+
+static void TestKernelsMatchGfMultiply()
+{
+	std::vector<uint8_t> vSrc = MakeFrame(1000, 7), vDst(1000), vExpected(1000);
+	for (int iKernel = FEC_KERNEL_SCALAR; iKernel <= FEC_KERNEL_AVX2; iKernel++) {
+		if (!FecSelectKernel((FecKernel)iKernel)) {
+			printf("  %s kernel not supported by this CPU\n", aszKernel[iKernel]);
+			continue;
+		}
+		for (int c = 0; c < 256; c++) {
+			for (int i = 0; i < 1000; i++) {
+				vDst[i] = vExpected[i] = (uint8_t)i;
+				if (i >= 3) {
+					vExpected[i] ^= GfMul(vSrc[i], (uint8_t)c);
+				}
+			}
+			// Unaligned, with a tail that is not a multiple of the vector width
+			FecMulAdd(&vDst[3], &vSrc[3], (uint8_t)c, 997);
+			CHECK(vDst == vExpected);
+		}
+	}
+	FecSelectKernel(FEC_KERNEL_SCALAR);
+}
+
+static void TestRsRestoresAnyMLosses()
+{
+	for (int iKernel = FEC_KERNEL_SCALAR; iKernel <= FEC_KERNEL_AVX2; iKernel++) {
+		if (!FecSelectKernel((FecKernel)iKernel)) {
+			continue;
+		}
+		// No loss, the first m data packets, the last m, and a mix of data and parity
+		CHECK(RoundTrip(FEC_RS, 10, 4, FRAME_SIZE, [](unsigned int, unsigned int, unsigned int, unsigned int) { return false; }));
+		CHECK(RoundTrip(FEC_RS, 10, 4, FRAME_SIZE, [](unsigned int, unsigned int i, unsigned int, unsigned int mBlock) {
+			return i < mBlock;
+		}));
+		CHECK(RoundTrip(FEC_RS, 10, 4, FRAME_SIZE, [](unsigned int, unsigned int i, unsigned int kBlock, unsigned int mBlock) {
+			return i >= kBlock - mBlock && i < kBlock;
+		}));
+		CHECK(RoundTrip(FEC_RS, 10, 4, FRAME_SIZE, [](unsigned int iBlock, unsigned int i, unsigned int kBlock, unsigned int) {
+			return i == iBlock || i == kBlock - 1 || i == kBlock + 1;
+		}));
+		// All but one of the 32 data packets of a block, restored from 31 parity packets
+		CHECK(RoundTrip(FEC_RS, 32, 31, 32 * FEC_MAX_PAYLOAD, [](unsigned int, unsigned int i, unsigned int, unsigned int) { return i < 31; }));
+	}
+	FecSelectKernel(FEC_KERNEL_SCALAR);
+}
+
+static void TestRsGivesUpBeyondM()
+{
+	FecEncoder enc(FEC_RS, 10, 4, false);
+	FecDecoder dec(2);
+	std::vector<std::vector<uint8_t> > vPacket;
+	Delivered delivered;
+	std::vector<uint8_t> vFrame = MakeFrame(FRAME_SIZE, 1);
+	// Frame 1 loses five packets of block 1, one more than its parity
+	enc.Encode(vFrame.data(), vFrame.size(), 1, vPacket);
+	Deliver(dec, vPacket, [](unsigned int iBlock, unsigned int i, unsigned int, unsigned int) { return iBlock == 1 && i < 5; }, 1, delivered);
+	CHECK(delivered.empty());
+	// Frame 2 is still incomplete when frame 3 starts, which pushes frame 1 out of the window of two
+	std::vector<std::vector<uint8_t> > vPacket2, vPacket3;
+	enc.Encode(vFrame.data(), vFrame.size(), 2, vPacket2);
+	Deliver(dec, vPacket2, [](unsigned int iBlock, unsigned int, unsigned int, unsigned int) { return iBlock == 3; }, 2, delivered);
+	enc.Encode(vFrame.data(), vFrame.size(), 3, vPacket3);
+	Deliver(dec, vPacket3, [](unsigned int, unsigned int, unsigned int, unsigned int) { return false; }, 3, delivered);
+	Deliver(dec, vPacket2, [](unsigned int iBlock, unsigned int, unsigned int, unsigned int) { return iBlock != 3; }, 2, delivered);
+	// Late packets of the given up frame change nothing
+	Deliver(dec, vPacket, [](unsigned int, unsigned int, unsigned int, unsigned int) { return false; }, 1, delivered);
+	CHECK(delivered.size() == 2 && delivered.count(1) == 0);
+	FecDecoder::Stats stats = dec.TakeStats();
+	CHECK(stats.nFrame == 2);
+	CHECK(stats.nLostFrame == 1);
+}
+
+static void TestXorRestoresBursts()
+{
+	// A burst of m consecutive losses hits each parity group once
+	for (unsigned int iStart = 0; iStart < 10; iStart += 3) {
+		CHECK(RoundTrip(FEC_XOR, 10, 4, FRAME_SIZE, [iStart](unsigned int, unsigned int i, unsigned int kBlock, unsigned int mBlock) {
+			return i >= iStart && i < iStart + mBlock && i < kBlock;
+		}));
+	}
+	// One loss per group, the parity of another group lost as well
+	CHECK(RoundTrip(FEC_XOR, 10, 4, FRAME_SIZE, [](unsigned int, unsigned int i, unsigned int kBlock, unsigned int mBlock) {
+		return i == 0 || i == 1 || i == kBlock + mBlock - 1;
+	}));
+}
+
+static void TestXorCannotRestoreTwoLossesOfAGroup()
+{
+	// Data packets 1 and 5 are both in parity group 1 of 4
+	CHECK(!RoundTrip(FEC_XOR, 10, 4, FRAME_SIZE, [](unsigned int iBlock, unsigned int i, unsigned int, unsigned int) {
+		return iBlock == 0 && (i == 1 || i == 5);
+	}));
+	// The same two losses under RS are fine
+	CHECK(RoundTrip(FEC_RS, 10, 4, FRAME_SIZE, [](unsigned int iBlock, unsigned int i, unsigned int, unsigned int) {
+		return iBlock == 0 && (i == 1 || i == 5);
+	}));
+}
+
+static void TestSmallFrames()
+{
+	size_t acb[] = {0, 1, 5, FEC_MAX_PAYLOAD, FEC_MAX_PAYLOAD + 1};
+	for (size_t iSize = 0; iSize < sizeof(acb) / sizeof(acb[0]); iSize++) {
+		for (int iMode = FEC_XOR; iMode <= FEC_RS; iMode++) {
+			CHECK(RoundTrip((FecMode)iMode, 10, 4, acb[iSize], [](unsigned int, unsigned int, unsigned int, unsigned int) { return false; }));
+			if (acb[iSize]) {
+				// The first data packet, restored from parity
+				CHECK(RoundTrip((FecMode)iMode, 10, 4, acb[iSize], [](unsigned int, unsigned int i, unsigned int, unsigned int) { return i == 0; }));
+			}
+		}
+	}
+}
+
+static void TestStreamUnderRandomLoss()
+{
+	const int nFrame = 200;
+	FecEncoder enc(FEC_RS, 10, 4, false);
+	FecDecoder dec;
+	std::vector<std::vector<uint8_t> > vPacket;
+	std::vector<uint8_t> vFrame = MakeFrame(FRAME_SIZE, 3);
+	std::mt19937 rng(11);
+	std::bernoulli_distribution loss(0.05);
+	Delivered delivered;
+	unsigned int nExpected = 0;
+	for (int f = 0; f < nFrame; f++) {
+		enc.Encode(vFrame.data(), vFrame.size(), f, vPacket);
+		// Pick the losses first, to know whether each block still has k packets
+		std::vector<bool> vLost(vPacket.size());
+		std::map<unsigned int, unsigned int> mapLostOfBlock, mapParityOfBlock;
+		for (size_t i = 0; i < vPacket.size(); i++) {
+			vLost[i] = loss(rng);
+			mapLostOfBlock[vPacket[i][8]] += vLost[i] ? 1 : 0;
+			mapParityOfBlock[vPacket[i][8]] = vPacket[i][4];
+		}
+		bool bRecoverable = true;
+		for (std::map<unsigned int, unsigned int>::iterator it = mapLostOfBlock.begin(); it != mapLostOfBlock.end(); ++it) {
+			bRecoverable = bRecoverable && it->second <= mapParityOfBlock[it->first];
+		}
+		nExpected += bRecoverable ? 1 : 0;
+		size_t iPacket = 0;
+		Deliver(dec, vPacket, [&vLost, &iPacket](unsigned int, unsigned int, unsigned int, unsigned int) { return vLost[iPacket++]; }, f, delivered);
+	}
+	CHECK(delivered.size() == nExpected);
+	CHECK(nExpected > nFrame * 9 / 10);
+	for (Delivered::iterator it = delivered.begin(); it != delivered.end(); ++it) {
+		CHECK(it->second == vFrame);
+	}
+	FecDecoder::Stats stats = dec.TakeStats();
+	CHECK(stats.nRecoveredPacket > 0);
+	CHECK(stats.nBadPacket == 0);
+}
+
+static void TestLatePacketsIgnored()
+{
+	FecEncoder enc(FEC_RS, 10, 4, false);
+	FecDecoder dec;
+	std::vector<std::vector<uint8_t> > vPacket;
+	std::vector<uint8_t> vFrame = MakeFrame(FRAME_SIZE, 5);
+	enc.Encode(vFrame.data(), vFrame.size(), 5, vPacket);
+	Delivered delivered;
+	// Done after its first k packets of each block; the parity arrives late, then everything again
+	Deliver(dec, vPacket, [](unsigned int, unsigned int i, unsigned int kBlock, unsigned int) { return i >= kBlock; }, 5, delivered);
+	Deliver(dec, vPacket, [](unsigned int, unsigned int i, unsigned int kBlock, unsigned int) { return i < kBlock; }, 6, delivered);
+	Deliver(dec, vPacket, [](unsigned int, unsigned int, unsigned int, unsigned int) { return false; }, 7, delivered);
+	CHECK(delivered.size() == 1);
+	CHECK(dec.TakeStats().nFrame == 1);
+
+	uint8_t abGarbage[FEC_HEADER_SIZE] = {'X'};
+	dec.Receive(abGarbage, sizeof(abGarbage), [](const uint8_t *, size_t, uint32_t) { CHECK(false); });
+	CHECK(dec.TakeStats().nBadPacket == 1);
+}
+
+static void TestAdaptiveParity()
+{
+	FecEncoder enc(FEC_RS, 10, 8, true);
+	double aLoss[] = {0.0, 0.01, 0.05, 0.1, 0.3};
+	unsigned int am[] = {1, 1, 1, 2, 6};
+	for (size_t i = 0; i < sizeof(aLoss) / sizeof(aLoss[0]); i++) {
+		enc.SetLossRatio(aLoss[i]);
+		CHECK(enc.GetParityCount() == am[i]);
+	}
+	enc.SetLossRatio(0.9);
+	CHECK(enc.GetParityCount() == 8);
+
+	// The decoder follows the parity count of each block
+	std::vector<std::vector<uint8_t> > vPacket;
+	std::vector<uint8_t> vFrame = MakeFrame(FRAME_SIZE, 9);
+	enc.SetLossRatio(0.1);
+	unsigned int nParity = enc.Encode(vFrame.data(), vFrame.size(), 9, vPacket);
+	CHECK(nParity == 2 + 2 + 2 + 2);
+	FecDecoder dec;
+	Delivered delivered;
+	Deliver(dec, vPacket, [](unsigned int, unsigned int i, unsigned int, unsigned int mBlock) { return i < mBlock; }, 9, delivered);
+	CHECK(delivered.size() == 1 && delivered[9] == vFrame);
+}
+
+int main(int argc, char *argv[])
+{
+	RUN_TEST(TestKernelsMatchGfMultiply);
+	RUN_TEST(TestRsRestoresAnyMLosses);
+	RUN_TEST(TestRsGivesUpBeyondM);
+	RUN_TEST(TestXorRestoresBursts);
+	RUN_TEST(TestXorCannotRestoreTwoLossesOfAGroup);
+	RUN_TEST(TestSmallFrames);
+	RUN_TEST(TestStreamUnderRandomLoss);
+	RUN_TEST(TestLatePacketsIgnored);
+	RUN_TEST(TestAdaptiveParity);
+	return TestResult();
+}
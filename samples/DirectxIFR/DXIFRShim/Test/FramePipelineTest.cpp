@@ -0,0 +1,281 @@
+/*!
+ * \brief
+ * Tests of NvFBCToSys's FramePipeline with a fake grabber and gated writers
+ *
+ * \file
+ *
+ * FakeGrabber fills every frame with the player and the number of the
+ * grab, so a writer can tell which grab it got and whether the frame was
+ * overwritten while it wrote. GatedWriter holds its writer thread in
+ * Write() until the test opens it, the way a pipe that is not drained
+ * would. The Win32 calls of the pipeline come from compat/windows.h.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "FramePipeline.h"
+#include "TestUtil.h"
+
+#define FRAME_BYTES 4096
+// Fast enough for the tests not to wait on the pace
+#define PIPELINE_FPS 1000
+
+struct FrameStamp {
+	int iPlayer;
+	int iGrab;
+};
+
+class FakeGrabber : public FrameGrabber
+{
+public:
+	FakeGrabber(int nPlayer) : vGrab(nPlayer), iFailingPlayer(-1) {}
+
+	virtual bool Grab(int iPlayer, unsigned char *pDst, DWORD cbFrame)
+	{
+		if (iPlayer == iFailingPlayer) {
+			return false;
+		}
+		FrameStamp stamp = {iPlayer, vGrab[iPlayer]++};
+		memset(pDst, (unsigned char)stamp.iGrab, cbFrame);
+		memcpy(pDst, &stamp, sizeof(stamp));
+		return true;
+	}
+
+	// Grabs per player
+	std::vector<int> vGrab;
+	int iFailingPlayer;
+};
+
+class GatedWriter : public FrameWriter
+{
+public:
+	GatedWriter(int iPlayer, bool bOpen = true) : FrameWriter(iPlayer, FRAME_BYTES, NULL), iPlayer(iPlayer), bTorn(false), bFail(false), bOpen(bOpen), nEntered(0) {}
+	virtual ~GatedWriter()
+	{
+		// The writer thread calls Write(), which is gone once this destructor is done
+		Stop();
+	}
+
+	void Open()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		bOpen = true;
+		cv.notify_all();
+	}
+	// Waits until the writer thread is in its n-th Write()
+	bool WaitEntered(int n)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		return cv.wait_for(lock, std::chrono::seconds(5), [this, n] { return nEntered >= n; });
+	}
+	bool WaitIdle()
+	{
+		return WaitUntil([this] { return !IsBusy(); });
+	}
+	std::vector<int> GetWritten()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		return vWritten;
+	}
+
+	const int iPlayer;
+	std::atomic<bool> bTorn;
+	std::atomic<bool> bFail;
+
+protected:
+	virtual bool Write(const unsigned char *pFrame, DWORD cbFrame)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		nEntered++;
+		cv.notify_all();
+		cv.wait(lock, [this] { return bOpen; });
+		FrameStamp stamp;
+		memcpy(&stamp, pFrame, sizeof(stamp));
+		for (DWORD i = sizeof(stamp); i < cbFrame; i++) {
+			if (pFrame[i] != (unsigned char)stamp.iGrab) {
+				bTorn = true;
+			}
+		}
+		if (stamp.iPlayer != iPlayer || cbFrame != FRAME_BYTES) {
+			bTorn = true;
+		}
+		vWritten.push_back(stamp.iGrab);
+		return !bFail;
+	}
+
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool bOpen;
+	int nEntered;
+	std::vector<int> vWritten;
+};
+
+static std::vector<int> Sequence(int n)
+{
+	std::vector<int> v(n);
+	for (int i = 0; i < n; i++) {
+		v[i] = i;
+	}
+	return v;
+}
+
+static void TestBusyWriterIsSkipped()
+{
+	FakeGrabber grabber(3);
+	GatedWriter writer0(0), writer1(1, false), writer2(2);
+	GatedWriter *apWriter[] = {&writer0, &writer1, &writer2};
+	std::vector<FrameWriter *> vWriter(apWriter, apWriter + 3);
+	for (int i = 0; i < 3; i++) {
+		CHECK(apWriter[i]->Start());
+	}
+	FramePipeline pipeline(&grabber, vWriter, FRAME_BYTES, PIPELINE_FPS);
+
+	CHECK(pipeline.RunRound());
+	CHECK(writer1.WaitEntered(1));
+	// Player 1's pipe is stuck; the others go on at full rate without waiting for it
+	for (int k = 1; k < 5; k++) {
+		CHECK(writer0.WaitIdle() && writer2.WaitIdle());
+		CHECK(pipeline.RunRound());
+	}
+	CHECK(writer1.IsBusy());
+	CHECK(grabber.vGrab[0] == 5 && grabber.vGrab[1] == 1 && grabber.vGrab[2] == 5);
+	CHECK(writer0.GetSkippedCount() == 0 && writer2.GetSkippedCount() == 0);
+	CHECK(writer1.GetSkippedCount() == 4);
+
+	// Once the pipe drains, player 1 is grabbed again from the next round
+	writer1.Open();
+	CHECK(writer1.WaitIdle());
+	CHECK(writer0.WaitIdle() && writer2.WaitIdle());
+	CHECK(pipeline.RunRound());
+	CHECK(writer0.WaitIdle() && writer1.WaitIdle() && writer2.WaitIdle());
+	CHECK(grabber.vGrab[1] == 2);
+	CHECK(writer1.GetSkippedCount() == 4);
+
+	// Every grab was written once, in order, as it was grabbed
+	CHECK(writer0.GetWritten() == Sequence(6));
+	CHECK(writer1.GetWritten() == Sequence(2));
+	CHECK(writer2.GetWritten() == Sequence(6));
+	for (int i = 0; i < 3; i++) {
+		CHECK(!apWriter[i]->bTorn);
+		CHECK(apWriter[i]->GetWrittenCount() == grabber.vGrab[i]);
+		CHECK(apWriter[i]->GetWriteErrorCount() == 0);
+	}
+}
+
+static void TestEveryWriterBusy()
+{
+	FakeGrabber grabber(2);
+	GatedWriter writer0(0, false), writer1(1, false);
+	std::vector<FrameWriter *> vWriter = {&writer0, &writer1};
+	CHECK(writer0.Start() && writer1.Start());
+	FramePipeline pipeline(&grabber, vWriter, FRAME_BYTES, PIPELINE_FPS);
+
+	CHECK(pipeline.RunRound());
+	CHECK(writer0.WaitEntered(1) && writer1.WaitEntered(1));
+	// Rounds with nothing to grab still keep the pace and count the skips
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < 10; k++) {
+		CHECK(pipeline.RunRound());
+	}
+	CHECK(std::chrono::steady_clock::now() - t0 >= std::chrono::milliseconds(10 * 1000 / PIPELINE_FPS - 1));
+	CHECK(grabber.vGrab[0] == 1 && grabber.vGrab[1] == 1);
+	CHECK(writer0.GetSkippedCount() == 10 && writer1.GetSkippedCount() == 10);
+	writer0.Open();
+	writer1.Open();
+}
+
+static void TestGrabFailureEndsRound()
+{
+	FakeGrabber grabber(3);
+	GatedWriter writer0(0), writer1(1), writer2(2);
+	std::vector<FrameWriter *> vWriter = {&writer0, &writer1, &writer2};
+	CHECK(writer0.Start() && writer1.Start() && writer2.Start());
+	FramePipeline pipeline(&grabber, vWriter, FRAME_BYTES, PIPELINE_FPS);
+
+	grabber.iFailingPlayer = 1;
+	CHECK(!pipeline.RunRound());
+	// Player 0 was handed over before the failure, player 2 was not reached
+	CHECK(writer0.WaitIdle());
+	CHECK(writer0.GetWrittenCount() == 1);
+	CHECK(writer1.GetWrittenCount() == 0 && writer2.GetWrittenCount() == 0);
+	CHECK(grabber.vGrab[2] == 0);
+
+	grabber.iFailingPlayer = -1;
+	CHECK(pipeline.RunRound());
+	CHECK(writer0.WaitIdle() && writer1.WaitIdle() && writer2.WaitIdle());
+	CHECK(writer0.GetWritten() == Sequence(2));
+	CHECK(writer1.GetWritten() == Sequence(1));
+	CHECK(writer2.GetWritten() == Sequence(1));
+}
+
+static void TestStopFinishesFrameInFlight()
+{
+	GatedWriter writer(0, false);
+	CHECK(writer.Start());
+	FakeGrabber grabber(1);
+	grabber.Grab(0, writer.GetBackBuffer(), FRAME_BYTES);
+	writer.Submit();
+	CHECK(writer.WaitEntered(1));
+
+	// Stop() waits for the write in progress rather than cutting it off
+	std::atomic<bool> bStopped(false);
+	std::thread stopper([&writer, &bStopped] {
+		writer.Stop();
+		bStopped = true;
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	CHECK(!bStopped);
+	writer.Open();
+	stopper.join();
+	CHECK(writer.GetWrittenCount() == 1);
+	CHECK(!writer.IsBusy());
+	CHECK(writer.GetWritten() == Sequence(1));
+	CHECK(!writer.bTorn);
+	// A second Stop(), as the destructor does, returns at once
+	writer.Stop();
+}
+
+static void TestStopRightAfterSubmit()
+{
+	// A frame submitted just before Stop() is still written, even if a write fails
+	for (int k = 0; k < 100; k++) {
+		GatedWriter writer(0);
+		writer.bFail = k % 2 != 0;
+		CHECK(writer.Start());
+		FakeGrabber grabber(1);
+		grabber.Grab(0, writer.GetBackBuffer(), FRAME_BYTES);
+		writer.Submit();
+		writer.Stop();
+		CHECK(writer.GetWrittenCount() == 1);
+		CHECK(writer.GetWriteErrorCount() == (k % 2 ? 1 : 0));
+		CHECK(!writer.IsBusy());
+	}
+
+	// An idle writer, and one that never started, stop at once
+	GatedWriter idle(0), unstarted(1);
+	CHECK(idle.Start());
+	idle.Stop();
+	unstarted.Stop();
+	CHECK(idle.GetWrittenCount() == 0 && unstarted.GetWrittenCount() == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	RUN_TEST(TestBusyWriterIsSkipped);
+	RUN_TEST(TestEveryWriterBusy);
+	RUN_TEST(TestGrabFailureEndsRound);
+	RUN_TEST(TestStopFinishesFrameInFlight);
+	RUN_TEST(TestStopRightAfterSubmit);
+	return TestResult();
+}
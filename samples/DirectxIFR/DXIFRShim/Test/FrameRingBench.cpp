@@ -0,0 +1,166 @@
+/*!
+ * \brief
+ * Benchmark of the FrameRing handoff from the shim to the encode service
+ *
+ * \file
+ *
+ * A synthetic producer plays the shim: at the game's frame rate it copies
+ * an I420 frame into the slot of BeginWrite() and publishes it, stamping
+ * the frame number into the frame. The consumer plays EncodeService::Run():
+ * it sleeps in WaitAcquire(), holds the frame for a simulated encode and
+ * releases it. Both go through their own mapping of the same FrameTransport
+ * block, as the two processes do.
+ *
+ * The benchmark reports the Publish() to Acquire() latency, the producer's
+ * time per frame and the frames dropped on a full ring, for an idle and for
+ * a busy consumer. It fails if a frame arrives out of order or torn.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "FrameTransport.h"
+#include "Logger.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger(simplelogger::ERR);
+
+struct Config {
+	const char *szName;
+	int width, height, fps;
+	int nSlot;
+	// Time the consumer holds every frame, as if it encoded it
+	int usEncode;
+};
+
+struct Result {
+	std::vector<uint64_t> vHandoffUs;
+	double usProduce;
+	uint32_t nDropped;
+	bool bIntact;
+};
+
+static uint64_t Percentile(std::vector<uint64_t> &v, double p)
+{
+	if (v.empty()) {
+		return 0;
+	}
+	size_t i = (size_t)(p * (v.size() - 1));
+	std::nth_element(v.begin(), v.begin() + i, v.end());
+	return v[i];
+}
+
+static void SpinUs(int us)
+{
+	uint64_t qwEndUs = FrameTransport::NowUs() + us;
+	while (FrameTransport::NowUs() < qwEndUs) {
+	}
+}
+
+static bool Run(const Config &config, int nFrame, Result &r)
+{
+	char szName[64];
+	sprintf(szName, "FrameRingBench_%d_%s", (int)getpid(), config.szName);
+	FrameTransport producer, consumer;
+	if (!producer.Create(szName, config.width, config.height, config.fps, config.nSlot) || !consumer.Open(szName)) {
+		return false;
+	}
+	FrameRing *pProducerRing = producer.GetRing();
+	FrameRing *pConsumerRing = consumer.GetRing();
+	const uint32_t cbFrame = pProducerRing->GetFrameSize();
+	std::vector<uint8_t> vFrame(cbFrame, 0x80);
+
+	r.vHandoffUs.clear();
+	r.vHandoffUs.reserve(nFrame);
+	r.bIntact = true;
+	std::thread th([&] {
+		uint32_t dwExpected = 0;
+		for (;;) {
+			FrameDesc desc;
+			const uint8_t *pFrame = pConsumerRing->WaitAcquire(desc, consumer.GetSignal(), FrameTransport::NowMs(), 100);
+			if (!pFrame) {
+				if (pConsumerRing->IsClosed()) {
+					break;
+				}
+				continue;
+			}
+			r.vHandoffUs.push_back(FrameTransport::NowUs() - desc.qwPublishUs);
+			uint32_t dwHead, dwTail;
+			memcpy(&dwHead, pFrame, sizeof(dwHead));
+			memcpy(&dwTail, pFrame + cbFrame - sizeof(dwTail), sizeof(dwTail));
+			// Dropped frames leave gaps, but the numbers only go up and both ends are of the same frame
+			r.bIntact = r.bIntact && dwHead == desc.dwFrame && dwTail == desc.dwFrame && desc.dwFrame >= dwExpected;
+			dwExpected = desc.dwFrame + 1;
+			SpinUs(config.usEncode);
+			pConsumerRing->Release();
+		}
+	});
+
+	uint64_t qwProduceUs = 0;
+	uint64_t qwNextUs = FrameTransport::NowUs();
+	for (int i = 0; i < nFrame; i++) {
+		uint64_t qwStartUs = FrameTransport::NowUs();
+		uint8_t *pSlot = pProducerRing->BeginWrite();
+		if (pSlot) {
+			uint32_t dwFrame = (uint32_t)i;
+			memcpy(&vFrame[0], &dwFrame, sizeof(dwFrame));
+			memcpy(&vFrame[cbFrame - sizeof(dwFrame)], &dwFrame, sizeof(dwFrame));
+			memcpy(pSlot, vFrame.data(), cbFrame);
+			FrameDesc desc = {dwFrame, 5000000, i ? 0u : (uint32_t)FRAME_FLAG_IDR, 0, FrameTransport::NowUs()};
+			pProducerRing->Publish(desc, producer.GetSignal());
+		}
+		qwProduceUs += FrameTransport::NowUs() - qwStartUs;
+		qwNextUs += 1000000 / config.fps;
+		uint64_t qwNowUs = FrameTransport::NowUs();
+		if (qwNextUs > qwNowUs) {
+			std::this_thread::sleep_for(std::chrono::microseconds(qwNextUs - qwNowUs));
+		}
+	}
+	pProducerRing->Close(producer.GetSignal());
+	th.join();
+
+	r.usProduce = (double)qwProduceUs / nFrame;
+	r.nDropped = pProducerRing->GetStats().nDropped;
+	return r.vHandoffUs.size() + r.nDropped == (size_t)nFrame;
+}
+
+int main(int argc, char *argv[])
+{
+	const int nFrame = 600;
+	const Config aConfig[] = {
+		{"720p60", 1280, 720, 60, 4, 2000},
+		{"1080p60", 1920, 1080, 60, 4, 4000},
+		{"1080p60_2slots", 1920, 1080, 60, 2, 4000},
+		// The service encodes slower than the game renders; the ring fills up and the shim drops
+		{"1080p60_busy", 1920, 1080, 60, 4, 20000},
+		{"1080p144", 1920, 1080, 144, 4, 4000},
+	};
+	printf("%-16s %8s %8s %8s %8s %10s %8s\n", "", "p50 us", "p99 us", "max us", "frames", "produce us", "dropped");
+	for (size_t c = 0; c < sizeof(aConfig) / sizeof(aConfig[0]); c++) {
+		Result r;
+		if (!Run(aConfig[c], nFrame, r)) {
+			printf("FAIL: %s lost frames or has no ring\n", aConfig[c].szName);
+			return 1;
+		}
+		if (!r.bIntact) {
+			printf("FAIL: %s handed over a frame out of order or torn\n", aConfig[c].szName);
+			return 1;
+		}
+		size_t nFrameOut = r.vHandoffUs.size();
+		uint64_t qwP50 = Percentile(r.vHandoffUs, 0.5), qwP99 = Percentile(r.vHandoffUs, 0.99);
+		uint64_t qwMax = r.vHandoffUs.empty() ? 0 : *std::max_element(r.vHandoffUs.begin(), r.vHandoffUs.end());
+		printf("%-16s %8llu %8llu %8llu %8u %10.1f %8u\n", aConfig[c].szName, (unsigned long long)qwP50, (unsigned long long)qwP99,
+			(unsigned long long)qwMax, (unsigned)nFrameOut, r.usProduce, r.nDropped);
+	}
+	return 0;
+}
@@ -0,0 +1,428 @@
+/*!
+ * \brief
+ * Tests of GpuScheduler on a simulated multi-GPU host
+ *
+ * \file
+ *
+ * The NVENC and CUDA driver is NvEncStub, built next to the test, with
+ * three GPUs of one encode engine and two sessions each. Every Player
+ * goes through the session lifecycle of CNvEncoder: EncodeMain places
+ * it and opens its session through EncoderRuntime, trying the next GPU
+ * when one refuses; EncodeFrameLoop encodes on the stub at 30 fps,
+ * reports each frame, and moves the session when the scheduler asks,
+ * opening the new session before it lets go of the old one. The wait for
+ * an IDR before a move is left out; the stub starts every session with one.
+ *
+ * The scheduler and the runtime are process-wide, so the tests run on one
+ * host one after the other, and each ends with every player stopped.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "EncoderRuntime.h"
+#include "GpuScheduler.h"
+#include "Metrics.h"
+#include "NvEncStub.h"
+#include "Logger.h"
+#include "TestUtil.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger(simplelogger::ERR);
+
+#define STUB_LIBRARY "./libnvencstub.so"
+#define N_GPU 3
+#define N_SESSION_PER_GPU 2
+// About 11 ms a 1080p frame, a third of a GPU at 30 fps
+#define STUB_MODEL "gpus=3,sessions=2,engines=1,latency=3000,perMpix=4000,jitter=500"
+// Encode time of a frame in software
+#define SOFTWARE_FRAME_MS 15
+
+static NV_ENCODE_API_FUNCTION_LIST *pApi;
+static PNVENCSTUBGETSTATS pfnGetStubStats;
+
+class Player
+{
+public:
+	Player(int iPlayer) : iPlayer(iPlayer), iDevice(-1), bSoftware(false), nMove(0), nReturn(0), nFrame(0), bStop(false),
+		session(), hBitstream(NULL)
+	{
+	}
+	~Player()
+	{
+		Stop();
+	}
+
+	// EncodeMain: the least loaded GPU with room, the next one if it refuses; software if asked and none has room
+	bool Start(bool bSpill = false)
+	{
+		for (;;) {
+			int iPlaced = GpuScheduler::GetShared()->Place(iPlayer, 0);
+			if (iPlaced < 0) {
+				break;
+			}
+			if (Open(iPlaced)) {
+				iDevice = iPlaced;
+				return true;
+			}
+			GpuScheduler::GetShared()->Release(iPlayer, 0);
+			if (!GpuScheduler::GetShared()->ReportSessionLimit(iPlaced)) {
+				break;
+			}
+		}
+		if (!bSpill) {
+			return false;
+		}
+		GpuScheduler::GetShared()->Spill(iPlayer, 0);
+		bSoftware = true;
+		return true;
+	}
+	void Run()
+	{
+		bStop = false;
+		th = std::thread([this] {
+			uint64_t qwNextUs = Metrics::NowUs();
+			while (!bStop) {
+				EncodeFrame();
+				qwNextUs += 1000000 / 30;
+				uint64_t qwNowUs = Metrics::NowUs();
+				if (qwNextUs > qwNowUs) {
+					std::this_thread::sleep_for(std::chrono::microseconds(qwNextUs - qwNowUs));
+				} else {
+					qwNextUs = qwNowUs;
+				}
+			}
+		});
+	}
+	void Stop()
+	{
+		bStop = true;
+		if (th.joinable()) {
+			th.join();
+		}
+		if (iDevice >= 0) {
+			Close();
+		}
+		if (iDevice >= 0 || bSoftware) {
+			GpuScheduler::GetShared()->Release(iPlayer, 0);
+		}
+		iDevice = -1;
+		bSoftware = false;
+	}
+
+	const int iPlayer;
+	// -1 while not started or in software
+	std::atomic<int> iDevice;
+	std::atomic<bool> bSoftware;
+	std::atomic<int> nMove, nReturn, nFrame;
+
+private:
+	// OpenCudaSession and the encoder and buffer set-up of StartHardwareEncoder
+	bool Open(int iOpen)
+	{
+		EncoderSession newSession;
+		if (!EncoderRuntime::GetShared()->AcquireSession(iOpen, &newSession)
+			&& EncoderRuntime::GetShared()->OpenSession(iOpen, &newSession) != NV_ENC_SUCCESS) {
+			return false;
+		}
+		NV_ENC_INITIALIZE_PARAMS initParams;
+		memset(&initParams, 0, sizeof(initParams));
+		initParams.version = NV_ENC_INITIALIZE_PARAMS_VER;
+		initParams.encodeGUID = NV_ENC_CODEC_H264_GUID;
+		initParams.presetGUID = NV_ENC_PRESET_LOW_LATENCY_HP_GUID;
+		initParams.encodeWidth = 1920;
+		initParams.encodeHeight = 1080;
+		initParams.frameRateNum = 30;
+		initParams.frameRateDen = 1;
+		NV_ENC_CREATE_BITSTREAM_BUFFER createBitstream;
+		memset(&createBitstream, 0, sizeof(createBitstream));
+		createBitstream.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+		createBitstream.size = 2 << 20;
+		if (pApi->nvEncInitializeEncoder(newSession.hEncoder, &initParams) != NV_ENC_SUCCESS
+			|| pApi->nvEncCreateBitstreamBuffer(newSession.hEncoder, &createBitstream) != NV_ENC_SUCCESS) {
+			EncoderRuntime::GetShared()->DestroySession(newSession);
+			return false;
+		}
+		// Only now the old session goes, if there is one
+		if (session.hEncoder) {
+			Close();
+		}
+		session = newSession;
+		hBitstream = createBitstream.bitstreamBuffer;
+		return true;
+	}
+	void Close()
+	{
+		pApi->nvEncDestroyBitstreamBuffer(session.hEncoder, hBitstream);
+		EncoderRuntime::GetShared()->DestroySession(session);
+		memset(&session, 0, sizeof(session));
+		hBitstream = NULL;
+	}
+	// EncodeFrameLoop with MoveSession and ReturnToHardware
+	void EncodeFrame()
+	{
+		bool bOverdue = false;
+		int iMoveTo = GpuScheduler::GetShared()->GetMove(iPlayer, 0, &bOverdue);
+		if (iMoveTo >= 0) {
+			bool bMoved = Open(iMoveTo);
+			GpuScheduler::GetShared()->FinishMove(iPlayer, 0, bMoved);
+			if (bMoved) {
+				(bSoftware ? nReturn : nMove)++;
+				bSoftware = false;
+				iDevice = iMoveTo;
+			} else if (bSoftware) {
+				GpuScheduler::GetShared()->ReportSessionLimit(iMoveTo);
+			}
+		}
+		if (bSoftware) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(SOFTWARE_FRAME_MS));
+			nFrame++;
+			return;
+		}
+
+		uint64_t qwStartUs = Metrics::NowUs();
+		NV_ENC_PIC_PARAMS picParams;
+		memset(&picParams, 0, sizeof(picParams));
+		picParams.version = NV_ENC_PIC_PARAMS_VER;
+		picParams.inputWidth = 1920;
+		picParams.inputHeight = 1080;
+		picParams.outputBitstream = hBitstream;
+		picParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+		CHECK(pApi->nvEncEncodePicture(session.hEncoder, &picParams) == NV_ENC_SUCCESS);
+		NV_ENC_LOCK_BITSTREAM lockBitstream;
+		memset(&lockBitstream, 0, sizeof(lockBitstream));
+		lockBitstream.version = NV_ENC_LOCK_BITSTREAM_VER;
+		lockBitstream.outputBitstream = hBitstream;
+		CHECK(pApi->nvEncLockBitstream(session.hEncoder, &lockBitstream) == NV_ENC_SUCCESS);
+		pApi->nvEncUnlockBitstream(session.hEncoder, hBitstream);
+		GpuScheduler::GetShared()->ReportFrame(iPlayer, 0, Metrics::NowUs() - qwStartUs, 30, 3 << 20);
+		nFrame++;
+	}
+
+	std::thread th;
+	std::atomic<bool> bStop;
+	EncoderSession session;
+	void *hBitstream;
+};
+
+static std::vector<int> SessionsPerGpu()
+{
+	std::vector<GpuScheduler::DeviceLoad> vLoad = GpuScheduler::GetShared()->GetLoad();
+	std::vector<int> vSession;
+	for (size_t i = 0; i < vLoad.size(); i++) {
+		vSession.push_back(vLoad[i].nSession);
+	}
+	return vSession;
+}
+
+static NvEncStubStats StubStats()
+{
+	NvEncStubStats stubStats;
+	pfnGetStubStats(&stubStats);
+	return stubStats;
+}
+
+// What the scheduler counts matches what is open on the driver, and nothing is left of the stopped players
+static void CheckIdle()
+{
+	CHECK(SessionsPerGpu() == std::vector<int>(N_GPU, 0));
+	CHECK(StubStats().nSession == 0);
+	CHECK(EncoderRuntime::GetShared()->GetStats().nContextRef == 0);
+}
+
+static void TestPlacementSpreadsAndLearnsLimits()
+{
+	NvEncStubStats stubBefore = StubStats();
+	GpuScheduler::Stats before = GpuScheduler::GetShared()->GetStats();
+	std::vector<std::unique_ptr<Player> > vPlayer;
+	for (int i = 0; i < N_GPU * N_SESSION_PER_GPU; i++) {
+		vPlayer.push_back(std::unique_ptr<Player>(new Player(i)));
+		CHECK(vPlayer.back()->Start());
+		// An idle host is filled round-robin
+		CHECK(vPlayer.back()->iDevice == i % N_GPU);
+	}
+	CHECK(SessionsPerGpu() == std::vector<int>(N_GPU, N_SESSION_PER_GPU));
+
+	// The limit is learned from one refusal per GPU; then the session is rejected
+	Player extra(N_GPU * N_SESSION_PER_GPU);
+	CHECK(!extra.Start());
+	CHECK(StubStats().nSessionRejected - stubBefore.nSessionRejected == N_GPU);
+	GpuScheduler::Stats after = GpuScheduler::GetShared()->GetStats();
+	CHECK(after.nPlaced - before.nPlaced == N_GPU * N_SESSION_PER_GPU + N_GPU);
+	CHECK(after.nRejected - before.nRejected == 1);
+	std::vector<GpuScheduler::DeviceLoad> vLoad = GpuScheduler::GetShared()->GetLoad();
+	for (size_t i = 0; i < vLoad.size(); i++) {
+		CHECK(vLoad[i].nMaxSession == N_SESSION_PER_GPU);
+	}
+	CHECK(StubStats().nSession == N_GPU * N_SESSION_PER_GPU);
+
+	vPlayer.clear();
+	CheckIdle();
+}
+
+static void TestIdleGpuTakesOverBusyOne()
+{
+	GpuScheduler::Stats before = GpuScheduler::GetShared()->GetStats();
+	std::vector<std::unique_ptr<Player> > vPlayer;
+	for (int i = 0; i < N_GPU * N_SESSION_PER_GPU; i++) {
+		vPlayer.push_back(std::unique_ptr<Player>(new Player(i)));
+		CHECK(vPlayer.back()->Start());
+		vPlayer.back()->Run();
+	}
+	// Both players of GPU 2 quit; GPUs 0 and 1 stay doubled up
+	vPlayer[2]->Stop();
+	vPlayer[5]->Stop();
+	CHECK(SessionsPerGpu() == std::vector<int>({2, 2, 0}));
+
+	// After the hold, one session moves to GPU 2; moving another would only swap the imbalance
+	CHECK(WaitUntil([] { return GpuScheduler::GetShared()->GetStats().nMigration > 0; }, 10 * GPU_MIGRATE_HOLD_MS));
+	std::this_thread::sleep_for(std::chrono::milliseconds(3 * GPU_MIGRATE_HOLD_MS));
+	GpuScheduler::Stats after = GpuScheduler::GetShared()->GetStats();
+	CHECK(after.nMigration - before.nMigration == 1);
+	CHECK(after.nMigrationFailed == before.nMigrationFailed);
+	std::vector<int> vSession = SessionsPerGpu();
+	CHECK(vSession[2] == 1 && vSession[0] + vSession[1] == 3);
+
+	int nMoved = 0;
+	for (size_t i = 0; i < vPlayer.size(); i++) {
+		if (vPlayer[i]->nMove) {
+			nMoved++;
+			CHECK(vPlayer[i]->iDevice == 2);
+			CHECK(vPlayer[i]->nMove == 1);
+		}
+	}
+	CHECK(nMoved == 1);
+	// The old session was closed once the new one was up
+	CHECK(StubStats().nSession == 4);
+
+	vPlayer.clear();
+	CheckIdle();
+}
+
+static void TestRefusedMoveStaysPut()
+{
+	GpuScheduler::Stats before = GpuScheduler::GetShared()->GetStats();
+	std::vector<std::unique_ptr<Player> > vPlayer;
+	for (int i = 0; i < 4; i++) {
+		vPlayer.push_back(std::unique_ptr<Player>(new Player(i)));
+		CHECK(vPlayer.back()->Start());
+	}
+	// GPU 0 has two players; GPU 1 looks idle to the scheduler, but another process holds its sessions
+	vPlayer[1]->Stop();
+	EncoderSession aOutside[N_SESSION_PER_GPU];
+	for (int i = 0; i < N_SESSION_PER_GPU; i++) {
+		CHECK(EncoderRuntime::GetShared()->OpenSession(1, &aOutside[i]) == NV_ENC_SUCCESS);
+	}
+	vPlayer[0]->Run();
+	vPlayer[2]->Run();
+	vPlayer[3]->Run();
+
+	CHECK(WaitUntil([] { return GpuScheduler::GetShared()->GetStats().nMigrationFailed > 0; }, 10 * GPU_MIGRATE_HOLD_MS));
+	CHECK(GpuScheduler::GetShared()->GetStats().nMigration == before.nMigration);
+	// The session stays where it was and keeps encoding; the reservation on GPU 1 is given back
+	CHECK(vPlayer[0]->iDevice == 0 && vPlayer[3]->iDevice == 0);
+	CHECK(vPlayer[0]->nMove == 0 && vPlayer[3]->nMove == 0);
+	int nFrame0 = vPlayer[0]->nFrame, nFrame3 = vPlayer[3]->nFrame;
+	CHECK(WaitUntil([&] { return vPlayer[0]->nFrame > nFrame0 + 5 && vPlayer[3]->nFrame > nFrame3 + 5; }));
+	CHECK(StubStats().nSession == 3 + N_SESSION_PER_GPU);
+
+	// Once the other process is gone, the next try succeeds
+	for (int i = 0; i < N_SESSION_PER_GPU; i++) {
+		EncoderRuntime::GetShared()->DestroySession(aOutside[i]);
+	}
+	CHECK(WaitUntil([&] { return GpuScheduler::GetShared()->GetStats().nMigration == before.nMigration + 1; }, 10 * GPU_MIGRATE_HOLD_MS));
+	CHECK(vPlayer[0]->iDevice + vPlayer[3]->iDevice == 1);
+	CHECK(StubStats().nSession == 3);
+
+	vPlayer.clear();
+	CheckIdle();
+}
+
+static void TestSpillAndReturnUnderLoad()
+{
+	const int nHardware = N_GPU * N_SESSION_PER_GPU, nSpill = 2;
+	GpuScheduler::Stats before = GpuScheduler::GetShared()->GetStats();
+	std::vector<std::unique_ptr<Player> > vPlayer;
+	for (int i = 0; i < nHardware + nSpill; i++) {
+		vPlayer.push_back(std::unique_ptr<Player>(new Player(i)));
+		CHECK(vPlayer.back()->Start(true));
+		vPlayer.back()->Run();
+		// The spilled players return oldest first, so they must not share a timestamp
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+	for (int i = nHardware; i < nHardware + nSpill; i++) {
+		CHECK(vPlayer[i]->bSoftware && vPlayer[i]->iDevice == -1);
+	}
+	CHECK(GpuScheduler::GetShared()->GetStats().nSpilled - before.nSpilled == nSpill);
+	CHECK(SessionsPerGpu() == std::vector<int>(N_GPU, N_SESSION_PER_GPU));
+	CHECK(StubStats().nSession == nHardware);
+	// The host is full and stays full, so nothing comes back while every GPU player runs
+	int nFrame = vPlayer[nHardware]->nFrame;
+	CHECK(WaitUntil([&] { return vPlayer[nHardware]->nFrame > nFrame + 10; }));
+	std::this_thread::sleep_for(std::chrono::milliseconds(2 * GPU_REBALANCE_MS));
+	CHECK(GpuScheduler::GetShared()->GetStats().nReturned == before.nReturned);
+
+	// A player of GPU 0 quits: the older spilled player takes its session, the other keeps waiting
+	vPlayer[0]->Stop();
+	CHECK(WaitUntil([&] { return vPlayer[nHardware]->nReturn == 1; }, 10 * GPU_REBALANCE_MS));
+	CHECK(vPlayer[nHardware]->iDevice == 0 && !vPlayer[nHardware]->bSoftware);
+	CHECK(vPlayer[nHardware + 1]->bSoftware);
+	CHECK(StubStats().nSession == nHardware);
+
+	// Then one of GPU 1, and the last spilled player is back too
+	vPlayer[1]->Stop();
+	CHECK(WaitUntil([&] { return vPlayer[nHardware + 1]->nReturn == 1; }, 10 * GPU_REBALANCE_MS));
+	CHECK(vPlayer[nHardware + 1]->iDevice == 1 && !vPlayer[nHardware + 1]->bSoftware);
+	GpuScheduler::Stats after = GpuScheduler::GetShared()->GetStats();
+	CHECK(after.nReturned - before.nReturned == nSpill);
+	CHECK(after.nMigrationFailed == before.nMigrationFailed);
+	CHECK(SessionsPerGpu() == std::vector<int>(N_GPU, N_SESSION_PER_GPU));
+	CHECK(StubStats().nSession == nHardware);
+	// Both keep encoding on their GPU
+	int nFrame0 = vPlayer[nHardware]->nFrame, nFrame1 = vPlayer[nHardware + 1]->nFrame;
+	CHECK(WaitUntil([&] { return vPlayer[nHardware]->nFrame > nFrame0 + 5 && vPlayer[nHardware + 1]->nFrame > nFrame1 + 5; }));
+
+	vPlayer.clear();
+	CheckIdle();
+}
+
+int main(int argc, char *argv[])
+{
+	setenv(NVENC_STUB_ENV, STUB_MODEL, 1);
+	EncoderRuntime::GetShared()->SetLibrary(STUB_LIBRARY);
+	EncoderRuntime::GetShared()->SetCudaLibrary(STUB_LIBRARY);
+	pApi = EncoderRuntime::GetShared()->GetApi();
+	void *hStub = dlopen(STUB_LIBRARY, RTLD_LAZY);
+	pfnGetStubStats = hStub ? (PNVENCSTUBGETSTATS)dlsym(hStub, "NvEncStubGetStats") : NULL;
+	if (!pApi || !pfnGetStubStats) {
+		printf("FAIL: " STUB_LIBRARY " cannot be loaded\n");
+		return 1;
+	}
+	// dynlink_cuda prints every CUDA function the stub does not have; the runtime needs none of them
+	fflush(stdout);
+	int fdStdout = dup(1), fdNull = open("/dev/null", O_WRONLY);
+	dup2(fdNull, 1);
+	int nDevice = EncoderRuntime::GetShared()->GetDeviceCount();
+	fflush(stdout);
+	dup2(fdStdout, 1);
+	close(fdNull);
+	close(fdStdout);
+	CHECK(nDevice == N_GPU);
+
+	RUN_TEST(TestPlacementSpreadsAndLearnsLimits);
+	RUN_TEST(TestIdleGpuTakesOverBusyOne);
+	RUN_TEST(TestRefusedMoveStaysPut);
+	RUN_TEST(TestSpillAndReturnUnderLoad);
+	return TestResult();
+}
@@ -0,0 +1,244 @@
+/*!
+ * \brief
+ * Multi-threaded tests of InputRing, the user input ring of AppParam
+ *
+ * \file
+ *
+ * Several producers push into a small ring while the consumer drains it
+ * with WaitPopBatch(), as the launcher's input receivers and the game's
+ * injector do. The consumer checks that every item arrives exactly once,
+ * in each producer's order, and that a sleeping consumer is woken by every
+ * push and by Close(). The ring is a local object; the futex it sleeps on
+ * works the same within a process as across a shared mapping.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "InputRing.h"
+#include "TestUtil.h"
+
+typedef unsigned long long Item;
+typedef InputRing<Item, 256> Ring;
+
+#define ITEM(iProducer, seq) (((Item)(iProducer) << 40) | (seq))
+#define ITEM_PRODUCER(item) ((unsigned int)((item) >> 40))
+#define ITEM_SEQ(item) ((item) & ((1ull << 40) - 1))
+
+static uint64_t NowMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The ring is too large for the stack of a test, as it is for the launcher's
+static std::unique_ptr<Ring> NewRing(uint32_t nCapacity)
+{
+	std::unique_ptr<Ring> pRing(new Ring);
+	memset((void *)pRing.get(), 0, sizeof(Ring));
+	pRing->Init(nCapacity);
+	return pRing;
+}
+
+static void TestCapacityAndOverflow()
+{
+	std::unique_ptr<Ring> pRing = NewRing(5);
+	CHECK(pRing->GetCapacity() == 8);
+	for (Item i = 0; i < 8; i++) {
+		CHECK(pRing->Push(i));
+	}
+	CHECK(!pRing->Push(8));
+	CHECK(pRing->GetOverflowCount() == 1);
+	CHECK(pRing->GetHighWater() == 8);
+
+	Item a[16];
+	CHECK(pRing->PopBatch(a, 3) == 3);
+	CHECK(a[0] == 0 && a[1] == 1 && a[2] == 2);
+	// The freed slots take new items behind the old ones
+	CHECK(pRing->Push(100) && pRing->Push(101));
+	CHECK(pRing->PopBatch(a, 16) == 7);
+	CHECK(a[4] == 7 && a[5] == 100 && a[6] == 101);
+	CHECK(pRing->IsEmpty());
+	CHECK(pRing->GetPushedCount() == 10);
+
+	// Clamped to [2, N]
+	pRing->Init(1);
+	CHECK(pRing->GetCapacity() == 2);
+	pRing->Init(100000);
+	CHECK(pRing->GetCapacity() == 256);
+	CHECK(pRing->GetPushedCount() == 0 && pRing->GetOverflowCount() == 0);
+}
+
+static void TestProducersAgainstWaitingConsumer()
+{
+	const unsigned int nProducer = 4;
+	const Item nPerProducer = 200000;
+	std::unique_ptr<Ring> pRing = NewRing(16);
+	InputRingSignal signal;
+	CHECK(signal.Open("InputRingTest"));
+
+	std::vector<std::thread> vth;
+	std::atomic<unsigned int> nFull(0);
+	for (unsigned int p = 0; p < nProducer; p++) {
+		vth.push_back(std::thread([&, p] {
+			for (Item seq = 0; seq < nPerProducer; seq++) {
+				// A full ring drops input; these producers retry so that every item has to arrive
+				while (!pRing->Push(ITEM(p, seq), &signal)) {
+					nFull++;
+					std::this_thread::yield();
+				}
+			}
+		}));
+	}
+
+	std::vector<Item> vNext(nProducer, 0);
+	Item nReceived = 0, nDisorder = 0;
+	unsigned int nTimeout = 0;
+	Item a[8];
+	while (nReceived < nProducer * nPerProducer) {
+		/* An empty return before the timeout is allowed: the next slot may be claimed by a
+		   producer that has not written it yet while later pushes wake the consumer */
+		uint64_t msStart = NowMs();
+		uint32_t n = pRing->WaitPopBatch(a, sizeof(a) / sizeof(a[0]), &signal, 2000);
+		if (!n && NowMs() - msStart >= 2000 && ++nTimeout > 2) {
+			break;
+		}
+		for (uint32_t i = 0; i < n; i++) {
+			unsigned int iProducer = ITEM_PRODUCER(a[i]);
+			if (iProducer >= nProducer || ITEM_SEQ(a[i]) != vNext[iProducer]) {
+				nDisorder++;
+				continue;
+			}
+			vNext[iProducer]++;
+		}
+		nReceived += n;
+	}
+	for (size_t i = 0; i < vth.size(); i++) {
+		vth[i].join();
+	}
+
+	CHECK(nReceived == nProducer * nPerProducer);
+	CHECK(nDisorder == 0);
+	// The producers never stop long enough for a 2 s wait to run out
+	CHECK(nTimeout == 0);
+	CHECK(pRing->GetPushedCount() == nProducer * nPerProducer);
+	CHECK(pRing->GetOverflowCount() == nFull);
+	CHECK(pRing->GetHighWater() <= pRing->GetCapacity());
+	CHECK(pRing->IsEmpty());
+}
+
+static void TestEveryPushWakesSleeper()
+{
+	const int nRound = 2000;
+	std::unique_ptr<Ring> pRing = NewRing(8);
+	InputRingSignal signal;
+	std::atomic<int> nTaken(0);
+	std::atomic<unsigned int> nSpurious(0);
+
+	std::thread th([&] {
+		Item item;
+		while (nTaken < nRound) {
+			// Without a timeout, a lost wake-up hangs here and the producer's wait below fails
+			uint32_t n = pRing->WaitPopBatch(&item, 1, &signal);
+			if (!n) {
+				if (pRing->IsClosed()) {
+					break;
+				}
+				nSpurious++;
+				continue;
+			}
+			if (item != (Item)nTaken) {
+				nSpurious++;
+			}
+			nTaken++;
+		}
+	});
+
+	int nLost = 0;
+	for (int i = 0; i < nRound; i++) {
+		// Mostly after the consumer has gone to sleep, now and then right as it does
+		if (i % 4) {
+			std::this_thread::sleep_for(std::chrono::microseconds(i % 3 ? 50 : 500));
+		}
+		CHECK(pRing->Push(i, &signal));
+		if (!WaitUntil([&nTaken, i] { return nTaken > i; }, 1000)) {
+			nLost++;
+			break;
+		}
+	}
+	pRing->Close(&signal);
+	th.join();
+
+	CHECK(nLost == 0);
+	CHECK(nTaken == nRound);
+	CHECK(nSpurious == 0);
+}
+
+static void TestCloseWakesConsumer()
+{
+	std::unique_ptr<Ring> pRing = NewRing(8);
+	InputRingSignal signal;
+	CHECK(pRing->Push(1, &signal) && pRing->Push(2, &signal));
+
+	std::atomic<bool> bDone(false);
+	std::vector<Item> vItem;
+	uint64_t msWaited = 0;
+	std::thread th([&] {
+		Item a[4];
+		uint32_t n;
+		// What was pushed before Close() still comes out, then the wait returns 0 at once
+		while ((n = pRing->WaitPopBatch(a, 4, &signal)) != 0) {
+			vItem.insert(vItem.end(), a, a + n);
+		}
+		uint64_t msStart = NowMs();
+		CHECK(pRing->WaitPopBatch(a, 4, &signal) == 0);
+		msWaited = NowMs() - msStart;
+		bDone = true;
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	CHECK(!bDone);
+	uint64_t msClose = NowMs();
+	pRing->Close(&signal);
+	CHECK(WaitUntil([&bDone] { return (bool)bDone; }, 1000));
+	th.join();
+
+	CHECK(NowMs() - msClose < 1000);
+	CHECK(vItem.size() == 2 && vItem[0] == 1 && vItem[1] == 2);
+	CHECK(msWaited < 100);
+	CHECK(pRing->IsClosed());
+}
+
+static void TestBoundedWaitTimesOut()
+{
+	std::unique_ptr<Ring> pRing = NewRing(8);
+	InputRingSignal signal;
+	Item item;
+	uint64_t msStart = NowMs();
+	CHECK(pRing->WaitPopBatch(&item, 1, &signal, 50) == 0);
+	uint64_t msWaited = NowMs() - msStart;
+	CHECK(msWaited >= 40 && msWaited < 1000);
+	// A zero timeout only polls
+	msStart = NowMs();
+	CHECK(pRing->WaitPopBatch(&item, 1, &signal, 0) == 0);
+	CHECK(NowMs() - msStart < 10);
+	CHECK(pRing->Push(7, &signal));
+	CHECK(pRing->WaitPopBatch(&item, 1, &signal, 0) == 1 && item == 7);
+}
+
+int main(int argc, char *argv[])
+{
+	RUN_TEST(TestCapacityAndOverflow);
+	RUN_TEST(TestProducersAgainstWaitingConsumer);
+	RUN_TEST(TestEveryPushWakesSleeper);
+	RUN_TEST(TestCloseWakesConsumer);
+	RUN_TEST(TestBoundedWaitTimesOut);
+	return TestResult();
+}
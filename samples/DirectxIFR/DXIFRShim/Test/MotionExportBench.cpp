@@ -0,0 +1,202 @@
+/*!
+ * \brief
+ * Throughput benchmark of the motion vector export, parser and summary
+ *
+ * \file
+ *
+ * The input is ME-only output of a 1080p60 stream as the driver gives it:
+ * 120x68 NV_ENC_H264_MV_DATA a frame of a slow pan, with a still sprite,
+ * noise and a mix of partition types. Each kernel runs the steps of
+ * MotionExport on it:
+ *
+ * - pack: the driver's records to MotionBlocks;
+ * - summary: MotionSummarize() of the packed blocks;
+ * - parse: walking the written stream with MotionParseStreamHeader() and
+ *   MotionParseFrame(), as a reader of the export does;
+ * - parse+summary: the same, summarizing every frame it reads.
+ *
+ * The benchmark reports microseconds per 1080p frame of each step, and
+ * what that makes in frames per second for a reader. Parsing alone only
+ * walks the frame headers, so it costs next to nothing. It fails if the
+ * kernels pack different blocks or summarize them differently, or if the
+ * stream reads back other frames or summaries than were written.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "MotionExport.h"
+
+#define MB_WIDTH 120
+#define MB_HEIGHT 68
+#define MB_COUNT (MB_WIDTH * MB_HEIGHT)
+// Distinct frames of driver output, replayed FRAME_COUNT times in turn
+#define SOURCE_FRAME_COUNT 30
+#define FRAME_COUNT 600
+
+class Random
+{
+public:
+	Random(uint32_t seed) : u(seed) {}
+	uint32_t Next()
+	{
+		u ^= u << 13;
+		u ^= u >> 17;
+		u ^= u << 5;
+		return u;
+	}
+
+private:
+	uint32_t u;
+};
+
+static std::vector<NV_ENC_H264_MV_DATA> MakeFrame(int iFrame, Random &random)
+{
+	std::vector<NV_ENC_H264_MV_DATA> v(MB_COUNT);
+	// A pan of a few pixels a frame that turns slowly, in quarter pixels
+	int panX = (int)(12 * cos(iFrame * 0.2)), panY = (int)(6 * sin(iFrame * 0.2));
+	for (int y = 0; y < MB_HEIGHT; y++) {
+		for (int x = 0; x < MB_WIDTH; x++) {
+			NV_ENC_H264_MV_DATA &mv = v[y * MB_WIDTH + x];
+			memset(&mv, 0, sizeof(mv));
+			// The sprite is still on screen while the background pans
+			bool bSprite = x >= 50 && x < 70 && y >= 25 && y < 45;
+			mv.partitionType = (uint8_t)(random.Next() % 4);
+			mv.mb_type = random.Next() % 20 ? 1 : 0;
+			for (int j = 0; j < 4; j++) {
+				mv.MV[j].mvx = (int16_t)(bSprite ? 0 : panX + (int)(random.Next() % 9) - 4);
+				mv.MV[j].mvy = (int16_t)(bSprite ? 0 : panY + (int)(random.Next() % 9) - 4);
+			}
+			mv.MBCost = random.Next() % 2000 + (random.Next() % 100 ? 0 : 100000);
+		}
+	}
+	return v;
+}
+
+static double GetSeconds(std::chrono::steady_clock::time_point t0)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static bool SameSummary(const MotionSummary &a, const MotionSummary &b)
+{
+	// The SSE2 kernel sums the lengths in another order
+	return fabsf(a.meanLength - b.meanLength) <= 1e-4f * (1.0f + a.meanLength) && a.movingRatio == b.movingRatio
+		&& a.globalX == b.globalX && a.globalY == b.globalY && a.meanCost == b.meanCost;
+}
+
+// Microseconds per frame of each step
+struct Result {
+	double usPack, usSummary, usParse, usParseSummary;
+	std::vector<MotionBlock> vBlock;
+	std::vector<MotionSummary> vSummary;
+	bool bReadBack;
+};
+
+static void Run(const std::vector<std::vector<NV_ENC_H264_MV_DATA> > &vvSource, MotionKernel eKernel, Result &r)
+{
+	MotionSelectKernel(eKernel);
+	std::vector<MotionBlock> vBlock((size_t)FRAME_COUNT * MB_COUNT);
+
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < FRAME_COUNT; i++) {
+		MotionPackBlocks(vvSource[i % SOURCE_FRAME_COUNT].data(), MB_COUNT, &vBlock[(size_t)i * MB_COUNT]);
+	}
+	r.usPack = GetSeconds(t0) * 1e6 / FRAME_COUNT;
+
+	MotionScratch scratch;
+	r.vSummary.resize(FRAME_COUNT);
+	t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < FRAME_COUNT; i++) {
+		MotionSummarize(&vBlock[(size_t)i * MB_COUNT], MB_COUNT, r.vSummary[i], scratch);
+	}
+	r.usSummary = GetSeconds(t0) * 1e6 / FRAME_COUNT;
+
+	// The stream as the encoder writes it
+	MotionExport exporter;
+	std::vector<uint8_t> vStream, vData;
+	for (int i = 0; i < FRAME_COUNT; i++) {
+		exporter.AddFrame(vvSource[i % SOURCE_FRAME_COUNT].data(), MB_WIDTH, MB_HEIGHT, i, i ? i - 1 : 0, vData);
+		vStream.insert(vStream.end(), vData.begin(), vData.end());
+	}
+
+	r.bReadBack = true;
+	for (int bSummarize = 0; bSummarize < 2; bSummarize++) {
+		const uint8_t *p = vStream.data(), *pEnd = p + vStream.size();
+		MotionStreamHeader header;
+		uint32_t nFrame = 0;
+		t0 = std::chrono::steady_clock::now();
+		size_t cb = MotionParseStreamHeader(p, pEnd - p, header);
+		for (p += cb; cb && p < pEnd; p += cb) {
+			MotionFrameHeader frame;
+			const MotionBlock *pBlock;
+			cb = MotionParseFrame(header, p, pEnd - p, frame, &pBlock);
+			if (!cb || frame.dwInputFrame != nFrame) {
+				r.bReadBack = false;
+				break;
+			}
+			if (bSummarize) {
+				MotionSummary summary;
+				MotionSummarize(pBlock, (uint32_t)frame.wMbWidth * frame.wMbHeight, summary, scratch);
+				r.bReadBack &= memcmp(&summary, &frame.summary, sizeof(summary)) == 0;
+			} else {
+				r.bReadBack &= memcmp(&frame.summary, &r.vSummary[nFrame], sizeof(frame.summary)) == 0;
+			}
+			nFrame++;
+		}
+		double sec = GetSeconds(t0);
+		r.bReadBack &= nFrame == FRAME_COUNT && p == pEnd;
+		(bSummarize ? r.usParseSummary : r.usParse) = sec * 1e6 / FRAME_COUNT;
+	}
+	r.vBlock.swap(vBlock);
+}
+
+int main(int argc, char *argv[])
+{
+	Random random(12345);
+	std::vector<std::vector<NV_ENC_H264_MV_DATA> > vvSource;
+	for (int i = 0; i < SOURCE_FRAME_COUNT; i++) {
+		vvSource.push_back(MakeFrame(i, random));
+	}
+
+	Result scalar, sse2;
+	Run(vvSource, MOTION_KERNEL_SCALAR, scalar);
+	Run(vvSource, MOTION_KERNEL_SSE2, sse2);
+	if (!scalar.bReadBack || !sse2.bReadBack) {
+		printf("FAIL: the stream did not read back the frames and summaries that were written\n");
+		return 1;
+	}
+	if (memcmp(scalar.vBlock.data(), sse2.vBlock.data(), scalar.vBlock.size() * sizeof(MotionBlock))) {
+		printf("FAIL: the SSE2 and scalar kernels pack different blocks\n");
+		return 1;
+	}
+	for (int i = 0; i < FRAME_COUNT; i++) {
+		if (!SameSummary(scalar.vSummary[i], sse2.vSummary[i])) {
+			printf("FAIL: frame %d: the SSE2 and scalar kernels summarize differently\n", i);
+			return 1;
+		}
+	}
+
+	printf("%-8s %14s %14s %14s %14s %12s\n", "", "pack", "summary", "parse", "parse+summary", "reader");
+	const struct {
+		const char *szName;
+		const Result *pResult;
+	} aRow[] = {
+		{"scalar", &scalar},
+		{"sse2", &sse2},
+	};
+	for (size_t i = 0; i < sizeof(aRow) / sizeof(aRow[0]); i++) {
+		const Result &r = *aRow[i].pResult;
+		printf("%-8s %8.1f us/fr %8.1f us/fr %8.2f us/fr %8.1f us/fr %8.0f fps\n", aRow[i].szName,
+			r.usPack, r.usSummary, r.usParse, r.usParseSummary, 1e6 / r.usParseSummary);
+	}
+	return 0;
+}
@@ -0,0 +1,180 @@
+/*!
+ * \brief
+ * Benchmark of the Annex-B start code scanners of NalIndex.h
+ *
+ * \file
+ *
+ * The input is a synthetic H.264 stream of the shim's kind: 1080p60 at
+ * about 8 Mbps, an IDR with SPS and PPS every 60 frames, four slices a
+ * picture. The slice payloads are random bytes run through emulation
+ * prevention, once as CABAC-like output and once with a third of the bytes
+ * zero, where the SSE2 kernel has to check many pairs of zero bytes.
+ *
+ * Every kernel scans the whole stream for start codes: the scalar loop, the
+ * SSE2 one where the compiler targets it, and NalIndex::Index() an access
+ * unit at a time, which also classifies the NAL units. The benchmark reports
+ * GB/s of each and fails if their start codes differ from each other or
+ * from where the generator put them.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "NalIndex.h"
+
+#define FRAME_COUNT 600
+#define GOP_LENGTH 60
+#define SLICES_PER_FRAME 4
+// 8 Mbps at 60 fps, with an IDR ten times the size of the other frames
+#define P_FRAME_BYTES 14000
+#define IDR_FRAME_BYTES 140000
+
+struct Stream {
+	std::vector<uint8_t> vData;
+	// Access units as offsets into vData, and the offset of every 00 00 01
+	std::vector<size_t> vAccessUnit;
+	std::vector<size_t> vStartCode;
+};
+
+class Random
+{
+public:
+	Random(uint32_t seed) : u(seed) {}
+	uint32_t Next()
+	{
+		u ^= u << 13;
+		u ^= u >> 17;
+		u ^= u << 5;
+		return u;
+	}
+
+private:
+	uint32_t u;
+};
+
+static void AddNal(Stream &stream, bool bLongStartCode, uint8_t header, size_t cbPayload, int zeroPercent, Random &random)
+{
+	std::vector<uint8_t> &v = stream.vData;
+	if (bLongStartCode) {
+		v.push_back(0);
+	}
+	stream.vStartCode.push_back(v.size());
+	v.push_back(0);
+	v.push_back(0);
+	v.push_back(1);
+	v.push_back(header);
+	int nZero = 0;
+	for (size_t i = 0; i < cbPayload; i++) {
+		uint8_t b = (int)(random.Next() % 100) < zeroPercent ? 0 : (uint8_t)random.Next();
+		// Emulation prevention: no 00 00 0x with x <= 3 inside a NAL unit
+		if (nZero >= 2 && b <= 3) {
+			v.push_back(3);
+			nZero = 0;
+		}
+		v.push_back(b);
+		nZero = b ? 0 : nZero + 1;
+	}
+	// rbsp_trailing_bits, so the NAL unit never ends in a zero byte
+	v.push_back(0x80);
+}
+
+static Stream MakeStream(int zeroPercent)
+{
+	Stream stream;
+	Random random(12345);
+	for (int iFrame = 0; iFrame < FRAME_COUNT; iFrame++) {
+		stream.vAccessUnit.push_back(stream.vData.size());
+		bool bIdr = iFrame % GOP_LENGTH == 0;
+		if (bIdr) {
+			AddNal(stream, true, 0x67, 20, 0, random);
+			AddNal(stream, true, 0x68, 4, 0, random);
+		}
+		size_t cbSlice = (bIdr ? IDR_FRAME_BYTES : P_FRAME_BYTES) / SLICES_PER_FRAME;
+		for (int i = 0; i < SLICES_PER_FRAME; i++) {
+			// The first NAL unit of an access unit and the parameter sets take 4-byte start codes
+			AddNal(stream, i == 0 && !bIdr, bIdr ? 0x65 : 0x41, cbSlice + random.Next() % 256, zeroPercent, random);
+		}
+	}
+	stream.vAccessUnit.push_back(stream.vData.size());
+	return stream;
+}
+
+typedef const uint8_t *(*FindStartCode)(const uint8_t *, const uint8_t *);
+
+static double Scan(const Stream &stream, FindStartCode find, int nRound, std::vector<size_t> &vFound)
+{
+	const uint8_t *pData = stream.vData.data(), *pEnd = pData + stream.vData.size();
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < nRound; k++) {
+		vFound.clear();
+		for (const uint8_t *p = find(pData, pEnd); p < pEnd; p = find(p + 3, pEnd)) {
+			vFound.push_back(p - pData);
+		}
+	}
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	return (double)stream.vData.size() * nRound / sec / 1e9;
+}
+
+static double Index(const Stream &stream, int nRound, std::vector<size_t> &vFound)
+{
+	const uint8_t *pData = stream.vData.data();
+	NalIndex nalIndex(NAL_CODEC_H264);
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < nRound; k++) {
+		vFound.clear();
+		for (size_t i = 0; i + 1 < stream.vAccessUnit.size(); i++) {
+			size_t offset = stream.vAccessUnit[i];
+			nalIndex.Index(pData + offset, stream.vAccessUnit[i + 1] - offset);
+			for (size_t j = 0; j < nalIndex.GetCount(); j++) {
+				const NalUnit &nal = nalIndex.GetNal(j);
+				// Where its 00 00 01 is
+				vFound.push_back(offset + nal.offset + nal.startCodeSize - 3);
+			}
+		}
+	}
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	return (double)stream.vData.size() * nRound / sec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	const int nRound = 20;
+	const struct {
+		const char *szName;
+		int zeroPercent;
+	} aContent[] = {
+		{"cabac", 0},
+		{"zero-rich", 33},
+	};
+	printf("%-10s %8s %13s %13s %13s\n", "", "MB", "scalar", "sse2", "index");
+	for (size_t c = 0; c < sizeof(aContent) / sizeof(aContent[0]); c++) {
+		Stream stream = MakeStream(aContent[c].zeroPercent);
+		std::vector<size_t> vScalar, vIndex;
+		double gbpsScalar = Scan(stream, NalFindStartCodeScalar, nRound, vScalar);
+		double gbpsIndex = Index(stream, nRound, vIndex);
+		if (vScalar != stream.vStartCode || vIndex != stream.vStartCode) {
+			printf("FAIL: %s: the scalar kernel or NalIndex found other start codes than were written\n", aContent[c].szName);
+			return 1;
+		}
+#ifdef NAL_INDEX_SSE2
+		std::vector<size_t> vSse2;
+		double gbpsSse2 = Scan(stream, NalFindStartCode, nRound, vSse2);
+		if (vSse2 != vScalar) {
+			printf("FAIL: %s: the SSE2 and scalar kernels disagree\n", aContent[c].szName);
+			return 1;
+		}
+		printf("%-10s %8.1f %8.2f GB/s %8.2f GB/s %8.2f GB/s\n", aContent[c].szName, stream.vData.size() / 1e6,
+			gbpsScalar, gbpsSse2, gbpsIndex);
+#else
+		printf("%-10s %8.1f %8.2f GB/s %13s %8.2f GB/s\n", aContent[c].szName, stream.vData.size() / 1e6,
+			gbpsScalar, "-", gbpsIndex);
+#endif
+	}
+	return 0;
+}
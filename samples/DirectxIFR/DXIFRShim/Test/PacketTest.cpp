@@ -0,0 +1,193 @@
+/*!
+ * \brief
+ * Tests that the output of an encoder is copied once, however many sinks take it
+ *
+ * \file
+ *
+ * The copies are counted by PacketPool::TakeStats(): every Packet is one
+ * copy of its data. Each sink records the address of the data it wrote, so
+ * the tests also see that the sinks of a SinkGraph share the one packet.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <mutex>
+#include <vector>
+#include "Packet.h"
+#include "SinkGraph.h"
+#include "Logger.h"
+#include "TestUtil.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger(simplelogger::ERR);
+
+// Frames of a few hundred bytes to a few hundred kilobytes, the first byte being the frame number
+static size_t FrameSize(int iFrame)
+{
+	return 300 + (iFrame * 7919) % (256 << 10);
+}
+
+class RecordingSink
+{
+public:
+	bool Write(Packet *pPacket)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		vData.push_back(pPacket->GetData());
+		vFrame.push_back(pPacket->GetData()[0]);
+		return true;
+	}
+	std::function<bool(Packet *)> Writer()
+	{
+		return [this](Packet *pPacket) { return Write(pPacket); };
+	}
+	size_t GetCount()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		return vData.size();
+	}
+
+	std::mutex mtx;
+	std::vector<const uint8_t *> vData;
+	std::vector<int> vFrame;
+};
+
+static void TestOneCopyPerPushAcrossSinks()
+{
+	const int nSink = 4, nFrame = 200;
+	SinkGraph graph(0);
+	RecordingSink aSink[nSink];
+	for (int i = 0; i < nSink; i++) {
+		CHECK(graph.AddSink("sink" + std::to_string(i), aSink[i].Writer(), std::function<void()>(), 64 << 20, 256));
+	}
+	PacketPool::GetShared()->TakeStats();
+
+	std::vector<uint8_t> vFrame;
+	unsigned long long qwBytes = 0;
+	for (int i = 0; i < nFrame; i++) {
+		vFrame.assign(FrameSize(i), (uint8_t)i);
+		qwBytes += vFrame.size();
+		CHECK(graph.Push(vFrame.data(), vFrame.size(), i % 30 ? SINK_FRAME_REFERENCE : SINK_FRAME_KEY));
+	}
+	CHECK(WaitUntil([&aSink] {
+		for (int i = 0; i < nSink; i++) {
+			if (aSink[i].GetCount() != nFrame) {
+				return false;
+			}
+		}
+		return true;
+	}));
+	graph.Stop();
+
+	PacketPool::Stats stats = PacketPool::GetShared()->TakeStats();
+	CHECK(stats.nCreate == nFrame);
+	CHECK(stats.qwCopyBytes == qwBytes);
+	CHECK(stats.nLive == 0);
+	// Every sink wrote every frame, in order, from the same packet
+	for (int i = 0; i < nSink; i++) {
+		for (int j = 0; j < nFrame; j++) {
+			CHECK(aSink[i].vFrame[j] == (uint8_t)j);
+			CHECK(aSink[i].vData[j] == aSink[0].vData[j]);
+		}
+	}
+}
+
+static void TestDroppedFramesAreNotCopied()
+{
+	const int nFrame = 100;
+	SinkGraph graph(0);
+	RecordingSink primary;
+	std::mutex mtxGate;
+	mtxGate.lock();
+	CHECK(graph.AddSink("primary", primary.Writer(), std::function<void()>(), 64 << 20, 256));
+	// Holds its writer until the frames are pushed, with room for two of them
+	CHECK(graph.AddSink("blocked", [&mtxGate](Packet *pPacket) {
+		std::lock_guard<std::mutex> lock(mtxGate);
+		return true;
+	}, std::function<void()>(), 64 << 20, 2));
+	PacketPool::GetShared()->TakeStats();
+
+	std::vector<uint8_t> vFrame;
+	unsigned long long qwBytes = 0;
+	for (int i = 0; i < nFrame; i++) {
+		vFrame.assign(FrameSize(i), (uint8_t)i);
+		qwBytes += vFrame.size();
+		graph.Push(vFrame.data(), vFrame.size(), i ? SINK_FRAME_REFERENCE : SINK_FRAME_KEY);
+	}
+	CHECK(WaitUntil([&primary] { return primary.GetCount() == nFrame; }));
+	SinkQueue::Stats blockedStats = graph.GetSink(1)->TakeStats();
+	CHECK(blockedStats.nDroppedFrame > 0);
+	mtxGate.unlock();
+	graph.Stop();
+
+	// A sink that drops a frame drops its reference; the frame was copied once for all of them
+	PacketPool::Stats stats = PacketPool::GetShared()->TakeStats();
+	CHECK(stats.nCreate == nFrame);
+	CHECK(stats.qwCopyBytes == qwBytes);
+	CHECK(stats.nLive == 0);
+}
+
+static void TestSinkQueuePushCopiesOnce()
+{
+	const int nFrame = 50;
+	SinkQueue q(0, 64 << 20, 256);
+	RecordingSink sink;
+	q.Start([&sink](const uint8_t *pData, size_t cb) {
+		std::lock_guard<std::mutex> lock(sink.mtx);
+		sink.vFrame.push_back(pData[0]);
+		return true;
+	});
+	PacketPool::GetShared()->TakeStats();
+
+	unsigned long long qwBytes = 0;
+	std::vector<uint8_t> vFrame;
+	for (int i = 0; i < nFrame; i++) {
+		vFrame.assign(FrameSize(i), (uint8_t)i);
+		qwBytes += vFrame.size();
+		CHECK(q.Push(vFrame.data(), vFrame.size(), SINK_FRAME_REFERENCE));
+	}
+	q.Stop();
+	CHECK(sink.vFrame.size() == (size_t)nFrame);
+
+	PacketPool::Stats stats = PacketPool::GetShared()->TakeStats();
+	CHECK(stats.nCreate == nFrame);
+	CHECK(stats.qwCopyBytes == qwBytes);
+	CHECK(stats.nLive == 0);
+}
+
+static void TestBuffersAreRecycled()
+{
+	const int nFrame = 500;
+	SinkGraph graph(0);
+	RecordingSink aSink[2];
+	for (int i = 0; i < 2; i++) {
+		CHECK(graph.AddSink("sink" + std::to_string(i), aSink[i].Writer()));
+	}
+	std::vector<uint8_t> vFrame(4096, 0);
+	PacketPool::GetShared()->TakeStats();
+	for (int i = 0; i < nFrame; i++) {
+		vFrame[0] = (uint8_t)i;
+		graph.Push(vFrame.data(), vFrame.size(), SINK_FRAME_REFERENCE);
+		// One frame in flight at a time, as at a frame rate the sinks keep up with
+		CHECK(WaitUntil([&aSink, i] { return aSink[0].GetCount() == (size_t)i + 1 && aSink[1].GetCount() == (size_t)i + 1; }));
+	}
+	graph.Stop();
+
+	PacketPool::Stats stats = PacketPool::GetShared()->TakeStats();
+	CHECK(stats.nCreate == nFrame);
+	// The buffers of the earlier tests, or a few new ones, carry every frame
+	CHECK(stats.nAllocate <= 2);
+	CHECK(stats.nLive == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	RUN_TEST(TestOneCopyPerPushAcrossSinks);
+	RUN_TEST(TestDroppedFramesAreNotCopied);
+	RUN_TEST(TestSinkQueuePushCopiesOnce);
+	RUN_TEST(TestBuffersAreRecycled);
+	return TestResult();
+}
@@ -0,0 +1,181 @@
+/*!
+ * \brief
+ * Tests of Placement's NUMA topology and player assignment on fake sysfs trees
+ *
+ * \file
+ *
+ * Placement.cpp is built with PLACEMENT_NODE_ROOT pointing at
+ * PLACEMENT_TEST_ROOT, a directory in the working directory that every
+ * test fills with the nodeN/cpulist files of the machine it plays: two or
+ * four nodes, a single node, or no NUMA information at all. Binding the
+ * task pool's workers to CPUs the host does not have fails harmlessly.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "Placement.h"
+#include "TaskPool.h"
+#include "TestUtil.h"
+
+#define PLACEMENT_TEST_MAX_NODES 8
+
+// Replaces the fake tree with one node directory per cpulist
+static void MakeNodes(const std::vector<std::string> &vCpulist)
+{
+	char szPath[256];
+	for (int i = 0; i < PLACEMENT_TEST_MAX_NODES; i++) {
+		snprintf(szPath, sizeof(szPath), PLACEMENT_TEST_ROOT "/node%d/cpulist", i);
+		unlink(szPath);
+		snprintf(szPath, sizeof(szPath), PLACEMENT_TEST_ROOT "/node%d", i);
+		rmdir(szPath);
+	}
+	mkdir(PLACEMENT_TEST_ROOT, 0755);
+	for (size_t i = 0; i < vCpulist.size(); i++) {
+		snprintf(szPath, sizeof(szPath), PLACEMENT_TEST_ROOT "/node%d", (int)i);
+		mkdir(szPath, 0755);
+		snprintf(szPath, sizeof(szPath), PLACEMENT_TEST_ROOT "/node%d/cpulist", (int)i);
+		FILE *fp = fopen(szPath, "w");
+		CHECK(fp != NULL);
+		if (fp) {
+			fprintf(fp, "%s\n", vCpulist[i].c_str());
+			fclose(fp);
+		}
+	}
+}
+
+static void RemoveNodes()
+{
+	MakeNodes(std::vector<std::string>());
+	rmdir(PLACEMENT_TEST_ROOT);
+}
+
+static ULONGLONG CpuRange(int first, int last)
+{
+	ULONGLONG qwMask = 0;
+	for (int i = first; i <= last; i++) {
+		qwMask |= 1ULL << i;
+	}
+	return qwMask;
+}
+
+static void TestCpulistParsing()
+{
+	MakeNodes({"0-3,8-11", "4-7,12-15", "16,18,20-21", "62-70"});
+	CHECK(Placement::GetNodeCount() == 4);
+	CHECK(Placement::GetNodeCpuMask(0) == (CpuRange(0, 3) | CpuRange(8, 11)));
+	CHECK(Placement::GetNodeCpuMask(1) == (CpuRange(4, 7) | CpuRange(12, 15)));
+	CHECK(Placement::GetNodeCpuMask(2) == ((1ULL << 16) | (1ULL << 18) | CpuRange(20, 21)));
+	// Only the first 64 processors are managed
+	CHECK(Placement::GetNodeCpuMask(3) == CpuRange(62, 63));
+	CHECK(Placement::GetNodeCpuMask(4) == 0);
+
+	// A node without CPUs, e.g. memory only, has an empty cpulist
+	MakeNodes({"0-1", ""});
+	CHECK(Placement::GetNodeCount() == 2);
+	CHECK(Placement::GetNodeCpuMask(1) == 0);
+}
+
+static void TestPlayersSpreadOverNodes()
+{
+	MakeNodes({"0-3", "4-7"});
+	TaskPool pool(4);
+	Placement placement;
+	placement.Configure(PLACEMENT_NUMA, 0, 0, &pool);
+	CHECK(placement.GetPolicy() == PLACEMENT_NUMA);
+	CHECK(placement.GetEncoderCpuMask() == CpuRange(0, 7));
+	// Players alternate between the nodes; workers 0, 2 are on node 0 and 1, 3 on node 1
+	const int aNode[] = {0, 1, 0, 1, 0, 1};
+	const int aWorker[] = {0, 1, 2, 3, 0, 1};
+	for (int i = 0; i < 6; i++) {
+		CHECK(placement.GetPlayerNode(i) == aNode[i]);
+		CHECK(placement.GetPlayerWorker(i) == aWorker[i]);
+	}
+}
+
+static void TestEncoderCpusPickTheNodes()
+{
+	MakeNodes({"0-3", "4-7", "8-11"});
+	TaskPool pool(3);
+	Placement placement;
+	// Encoders on two CPUs of node 1 and all of node 2; the game gets the rest
+	ULONGLONG qwEncoder = CpuRange(6, 11) | (1ULL << 40);
+	placement.Configure(PLACEMENT_ISOLATE, qwEncoder, 0, &pool);
+	CHECK(placement.GetEncoderCpuMask() == CpuRange(6, 11));
+	const int aNode[] = {1, 2, 1, 2};
+	const int aWorker[] = {0, 1, 2, 1};
+	for (int i = 0; i < 4; i++) {
+		CHECK(placement.GetPlayerNode(i) == aNode[i]);
+		CHECK(placement.GetPlayerWorker(i) == aWorker[i]);
+	}
+
+	// Encoder CPUs the machine does not have fall back to all of them
+	placement.Configure(PLACEMENT_NUMA, 1ULL << 40, 0, &pool);
+	CHECK(placement.GetEncoderCpuMask() == CpuRange(0, 11));
+	CHECK(placement.GetPlayerNode(2) == 2);
+}
+
+static void TestSingleNode()
+{
+	MakeNodes({"0-7"});
+	CHECK(Placement::GetNodeCount() == 1);
+	TaskPool pool(3);
+	Placement placement;
+	placement.Configure(PLACEMENT_NUMA, 0, 0, &pool);
+	CHECK(placement.GetPolicy() == PLACEMENT_NUMA);
+	// Every player on node 0, spread over the workers
+	for (int i = 0; i < 7; i++) {
+		CHECK(placement.GetPlayerNode(i) == 0);
+		CHECK(placement.GetPlayerWorker(i) == i % 3);
+	}
+}
+
+static void TestNoNumaInformation()
+{
+	MakeNodes(std::vector<std::string>());
+	// Everything is node 0, which has every online CPU
+	CHECK(Placement::GetNodeCount() == 1);
+	long nCpu = sysconf(_SC_NPROCESSORS_ONLN);
+	CHECK(Placement::GetNodeCpuMask(0) == (nCpu >= 64 ? ~0ULL : CpuRange(0, (int)nCpu - 1)));
+	CHECK(Placement::GetNodeCpuMask(1) == 0);
+
+	TaskPool pool(2);
+	Placement placement;
+	placement.Configure(PLACEMENT_NUMA, 0, 0, &pool);
+	CHECK(placement.GetPlayerNode(5) == 0);
+	CHECK(placement.GetPlayerWorker(5) == 1);
+}
+
+static void TestOsPolicyLeavesPlayersAlone()
+{
+	MakeNodes({"0-3", "4-7"});
+	TaskPool pool(2);
+	Placement placement;
+	placement.Configure(PLACEMENT_OS, CpuRange(0, 3), 0, &pool);
+	CHECK(placement.GetPolicy() == PLACEMENT_OS);
+	CHECK(placement.GetEncoderCpuMask() == 0);
+	for (int i = 0; i < 4; i++) {
+		CHECK(placement.GetPlayerNode(i) == -1);
+		CHECK(placement.GetPlayerWorker(i) == i);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	RUN_TEST(TestCpulistParsing);
+	RUN_TEST(TestPlayersSpreadOverNodes);
+	RUN_TEST(TestEncoderCpusPickTheNodes);
+	RUN_TEST(TestSingleNode);
+	RUN_TEST(TestNoNumaInformation);
+	RUN_TEST(TestOsPolicyLeavesPlayersAlone);
+	RemoveNodes();
+	return TestResult();
+}
@@ -0,0 +1,220 @@
+/*!
+ * \brief
+ * Tests of RecoveryControl's coalescing of viewer recovery events
+ *
+ * \file
+ *
+ * The tests replay bursts of RE_KEYFRAME_REQUEST, RE_VIEWER_JOIN and
+ * RE_FRAME_LOSS events against a 30 fps encoder loop that calls Take()
+ * before every frame, and compare the IDRs and invalidations that come out
+ * with the naive policy of one IDR per event.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <string.h>
+#include <vector>
+#include "RecoveryControl.h"
+#include "TestUtil.h"
+
+#define FRAME_MS 33
+#define MIN_IDR_INTERVAL_MS 500
+#define DPB_SIZE 16
+// Sizes of the frames the simulated encoder puts out
+#define KEY_FRAME_BYTES 60000
+#define DELTA_FRAME_BYTES 6000
+
+static RecoveryEvent MakeEvent(RecoveryEventType type, DWORD dwFirstFrame = 0, DWORD dwLastFrame = 0)
+{
+	RecoveryEvent re;
+	memset(&re, 0, sizeof(re));
+	re.type = type;
+	re.dwFirstFrame = dwFirstFrame;
+	re.dwLastFrame = dwLastFrame;
+	return re;
+}
+
+// The encode loop of one player: what Take() asked for at every frame
+class Encoder
+{
+public:
+	Encoder() : rc(MIN_IDR_INTERVAL_MS, DPB_SIZE), dwFrame(0) {}
+
+	// Encodes frame dwFrame at its time in the stream and moves on to the next
+	NvEncPictureCommand Encode()
+	{
+		NvEncPictureCommand cmd;
+		memset(&cmd, 0, sizeof(cmd));
+		rc.Take(dwFrame, dwFrame * FRAME_MS, &cmd);
+		bool bKeyFrame = dwFrame == 0 || cmd.bForceIDR;
+		if (bKeyFrame) {
+			vIdrFrame.push_back(dwFrame);
+		}
+		rc.RecordFrame(bKeyFrame, bKeyFrame ? KEY_FRAME_BYTES : DELTA_FRAME_BYTES);
+		dwFrame++;
+		return cmd;
+	}
+	void EncodeUntil(DWORD dwEnd)
+	{
+		while (dwFrame < dwEnd) {
+			Encode();
+		}
+	}
+
+	RecoveryControl rc;
+	DWORD dwFrame;
+	std::vector<DWORD> vIdrFrame;
+};
+
+static void TestKeyFrameBurstCoalesces()
+{
+	Encoder enc;
+	enc.EncodeUntil(100);
+	// Ten viewers join or ask for a key frame during one frame: one IDR serves all of them
+	for (int i = 0; i < 10; i++) {
+		enc.rc.Post(MakeEvent(i % 2 ? RE_KEYFRAME_REQUEST : RE_VIEWER_JOIN));
+	}
+	CHECK(enc.Encode().bForceIDR);
+	// Then one more request every frame for a second: the rate limit lets through one IDR per 500 ms
+	for (int i = 0; i < 30; i++) {
+		enc.rc.Post(MakeEvent(RE_KEYFRAME_REQUEST));
+		enc.Encode();
+	}
+	enc.EncodeUntil(200);
+
+	RecoveryControl::Stats stats = enc.rc.GetStats();
+	CHECK(stats.nIdrRequest == 40);
+	// Frame 0, frame 100, and the second of requests after it: frames 116 and 132 (33 ms frames)
+	std::vector<DWORD> vExpected = {0, 100, 116, 132};
+	CHECK(enc.vIdrFrame == vExpected);
+	CHECK(stats.nIdr == 3);
+	for (size_t i = 2; i < enc.vIdrFrame.size(); i++) {
+		CHECK((enc.vIdrFrame[i] - enc.vIdrFrame[i - 1]) * FRAME_MS >= MIN_IDR_INTERVAL_MS);
+	}
+	// A request the last IDR has not served yet is still pending, not dropped
+	CHECK(!enc.rc.IsIdrDue(enc.dwFrame * FRAME_MS));
+}
+
+static void TestLossReportsMergeIntoOneInvalidation()
+{
+	Encoder enc;
+	enc.EncodeUntil(200);
+	// Several viewers lose overlapping ranges of the same burst
+	enc.rc.Post(MakeEvent(RE_FRAME_LOSS, 195, 196));
+	enc.rc.Post(MakeEvent(RE_FRAME_LOSS, 193, 195));
+	enc.rc.Post(MakeEvent(RE_FRAME_LOSS, 197, 199));
+	enc.rc.Post(MakeEvent(RE_FRAME_LOSS, 194, 194));
+	NvEncPictureCommand cmd = enc.Encode();
+	CHECK(!cmd.bForceIDR);
+	CHECK(cmd.bInvalidateRefFrames);
+	// From the first lost frame up to the frame before this one
+	CHECK(cmd.numRefFramesToInvalidate == 7);
+	for (DWORD i = 0; i < cmd.numRefFramesToInvalidate; i++) {
+		CHECK(cmd.refFrameNumbers[i] == 193 + i);
+	}
+
+	// A late report of frames before that recovery point is stale and costs nothing
+	enc.rc.Post(MakeEvent(RE_FRAME_LOSS, 196, 198));
+	cmd = enc.Encode();
+	CHECK(!cmd.bForceIDR && !cmd.bInvalidateRefFrames);
+	// A loss of a frame not encoded yet needs nothing either
+	enc.rc.Post(MakeEvent(RE_FRAME_LOSS, 205, 206));
+	cmd = enc.Encode();
+	CHECK(!cmd.bForceIDR && !cmd.bInvalidateRefFrames);
+
+	RecoveryControl::Stats stats = enc.rc.GetStats();
+	CHECK(stats.nLossReport == 6);
+	CHECK(stats.nInvalidation == 1);
+	CHECK(stats.nIdr == 0);
+	CHECK(stats.nEscalation == 0);
+}
+
+static void TestOldLossEscalatesToIdr()
+{
+	Encoder enc;
+	enc.EncodeUntil(300);
+	// The DPB no longer holds a picture from before frame 280; a key frame request at the same time rides along
+	enc.rc.Post(MakeEvent(RE_FRAME_LOSS, 280, 281));
+	enc.rc.Post(MakeEvent(RE_KEYFRAME_REQUEST));
+	enc.rc.Post(MakeEvent(RE_FRAME_LOSS, 290, 295));
+	NvEncPictureCommand cmd = enc.Encode();
+	CHECK(cmd.bForceIDR);
+	CHECK(!cmd.bInvalidateRefFrames);
+	RecoveryControl::Stats stats = enc.rc.GetStats();
+	CHECK(stats.nEscalation == 1);
+	CHECK(stats.nIdr == 1);
+	CHECK(stats.nInvalidation == 0);
+}
+
+/* A minute of a busy session, against the naive policy of one IDR per event. Alongside, the
+   policy of RecoveryControl written out for this replay gives the exact count of each.*/
+static void TestReplayAgainstOneIdrPerEvent()
+{
+	Encoder enc;
+	const DWORD nFrame = 60 * 30;
+	unsigned int nEvent = 0;
+	unsigned int nExpectedIdr = 0, nExpectedInvalidation = 0;
+	bool bIdrWanted = false, bLossWanted = false;
+	DWORD dwLastIdr = 0, dwLastRecovery = 0;
+	unsigned int uRandom = 1;
+	while (enc.dwFrame < nFrame) {
+		DWORD dwFrame = enc.dwFrame;
+		uRandom = uRandom * 1103515245 + 12345;
+		unsigned int r = (uRandom >> 16) % 100;
+		// About every fifth frame, a burst of up to four events from the viewers
+		if (r < 20 && dwFrame > 0) {
+			unsigned int nBurst = 1 + r % 4;
+			for (unsigned int i = 0; i < nBurst; i++) {
+				if ((r + i) % 3) {
+					DWORD dwLost = dwFrame - 1 - (r + i) % 4;
+					enc.rc.Post(MakeEvent(RE_FRAME_LOSS, dwLost, dwFrame - 1));
+					// Frames before the last recovery point were already repaired
+					bLossWanted |= dwLost >= dwLastRecovery;
+				} else {
+					enc.rc.Post(MakeEvent(RE_KEYFRAME_REQUEST));
+					bIdrWanted = true;
+				}
+			}
+			nEvent += nBurst;
+		}
+		if (bIdrWanted && (dwFrame - dwLastIdr) * FRAME_MS >= MIN_IDR_INTERVAL_MS) {
+			nExpectedIdr++;
+			bIdrWanted = bLossWanted = false;
+			dwLastIdr = dwLastRecovery = dwFrame;
+		} else if (bLossWanted) {
+			nExpectedInvalidation++;
+			bLossWanted = false;
+			dwLastRecovery = dwFrame;
+		}
+		NvEncPictureCommand cmd = enc.Encode();
+		CHECK(cmd.bForceIDR == (dwLastIdr == dwFrame && dwFrame));
+		CHECK(cmd.bInvalidateRefFrames == (dwLastRecovery == dwFrame && dwLastIdr != dwFrame));
+	}
+
+	RecoveryControl::Stats stats = enc.rc.GetStats();
+	CHECK(stats.nIdrRequest + stats.nLossReport == nEvent);
+	CHECK(stats.nIdr == nExpectedIdr);
+	CHECK(stats.nInvalidation == nExpectedInvalidation);
+	CHECK(stats.nEscalation == 0);
+	// Against one IDR per event: at most two IDRs a second however many viewers ask, losses repaired without one
+	CHECK(stats.nIdr <= 60 * 1000 / MIN_IDR_INTERVAL_MS);
+	CHECK(stats.nIdr < stats.nIdrRequest);
+	CHECK(stats.nIdr * 4 < nEvent);
+	CHECK(stats.nKeyFrame == stats.nIdr + 1);
+	CHECK(stats.nKeyFrame + stats.nDeltaFrame == nFrame);
+	// The saving the encoder logs, here against a key frame every second
+	CHECK(enc.rc.GetSavedBytes(30) == ((LONGLONG)nFrame / 30 - stats.nKeyFrame) * (KEY_FRAME_BYTES - DELTA_FRAME_BYTES));
+}
+
+int main(int argc, char *argv[])
+{
+	RUN_TEST(TestKeyFrameBurstCoalesces);
+	RUN_TEST(TestLossReportsMergeIntoOneInvalidation);
+	RUN_TEST(TestOldLossEscalatesToIdr);
+	RUN_TEST(TestReplayAgainstOneIdrPerEvent);
+	return TestResult();
+}
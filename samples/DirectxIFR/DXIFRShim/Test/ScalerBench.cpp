@@ -0,0 +1,92 @@
+/*!
+ * \brief
+ * Benchmark of Scaler on a 1080p capture for each rendition height
+ *
+ * \file
+ *
+ * The input is one 1920x1080 I420 frame of gradients and noise, scaled to
+ * the heights a -ladder of StartApp would ask for, at the widths
+ * CNvIFREncoder gives them. Every height runs the area filter on the SSE2
+ * and the scalar kernels and the bilinear filter on SSE2, and the benchmark
+ * reports ms per frame of each, which is what one more rendition costs the
+ * encode thread of a player. It fails if the two kernels do not produce the
+ * same bytes.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "Scaler.h"
+
+#define SRC_WIDTH 1920
+#define SRC_HEIGHT 1080
+#define FRAME_COUNT 100
+
+static std::vector<uint8_t> MakeFrame()
+{
+	std::vector<uint8_t> v((size_t)SRC_WIDTH * SRC_HEIGHT * 3 / 2);
+	uint32_t u = 12345;
+	for (int y = 0; y < SRC_HEIGHT; y++) {
+		for (int x = 0; x < SRC_WIDTH; x++) {
+			u ^= u << 13;
+			u ^= u >> 17;
+			u ^= u << 5;
+			v[(size_t)y * SRC_WIDTH + x] = (uint8_t)((x + y) / 12 + u % 32);
+		}
+	}
+	// Chroma: a slow gradient each way
+	size_t cbLuma = (size_t)SRC_WIDTH * SRC_HEIGHT;
+	for (size_t i = 0; i < cbLuma / 4; i++) {
+		v[cbLuma + i] = (uint8_t)(i % (SRC_WIDTH / 2) / 4);
+		v[cbLuma * 5 / 4 + i] = (uint8_t)(i / (SRC_WIDTH / 2) / 3);
+	}
+	return v;
+}
+
+// ms per frame; vDst holds the last frame scaled
+static double Run(const std::vector<uint8_t> &vSrc, int width, int height, ScaleFilter eFilter, ScaleKernel eKernel,
+	std::vector<uint8_t> &vDst)
+{
+	ScaleSelectKernel(eKernel);
+	Scaler scaler;
+	scaler.Configure(SRC_WIDTH, SRC_HEIGHT, width, height, eFilter);
+	vDst.resize(scaler.GetDstSize());
+	// The first frame sizes the scratch buffers, as it does in the encoder
+	scaler.Scale(vSrc.data(), vDst.data());
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for (int k = 0; k < FRAME_COUNT; k++) {
+		scaler.Scale(vSrc.data(), vDst.data());
+	}
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	return sec * 1000 / FRAME_COUNT;
+}
+
+int main(int argc, char *argv[])
+{
+	const int aHeight[] = {720, 540, 480, 360, 270};
+	std::vector<uint8_t> vSrc = MakeFrame();
+	printf("%-10s %16s %16s %16s\n", "", "area sse2", "area scalar", "bilinear sse2");
+	for (size_t i = 0; i < sizeof(aHeight) / sizeof(aHeight[0]); i++) {
+		int height = aHeight[i];
+		// As CNvIFREncoder sizes a rendition
+		int width = (int)((long long)SRC_WIDTH * height / SRC_HEIGHT) & ~1;
+		std::vector<uint8_t> vSse2, vScalar, vBilinear;
+		double msSse2 = Run(vSrc, width, height, SCALE_AREA, SCALE_KERNEL_SSE2, vSse2);
+		double msScalar = Run(vSrc, width, height, SCALE_AREA, SCALE_KERNEL_SCALAR, vScalar);
+		double msBilinear = Run(vSrc, width, height, SCALE_BILINEAR, SCALE_KERNEL_SSE2, vBilinear);
+		if (vSse2 != vScalar) {
+			printf("FAIL: %dx%d: the SSE2 and scalar kernels disagree\n", width, height);
+			return 1;
+		}
+		char szSize[16];
+		snprintf(szSize, sizeof(szSize), "%dx%d", width, height);
+		printf("%-10s %10.3f ms/fr %10.3f ms/fr %10.3f ms/fr\n", szSize, msSse2, msScalar, msBilinear);
+	}
+	return 0;
+}
@@ -0,0 +1,280 @@
+/*!
+ * \brief
+ * Tests of the drop policy of SinkQueue and SinkGraph behind a slow sink
+ *
+ * \file
+ *
+ * Every chunk carries its frame number in its first byte. GatedSink holds
+ * the writer thread on its first chunk until the test opens it, so the test
+ * knows exactly what is queued when it pushes the next chunk.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include "SinkQueue.h"
+#include "SinkGraph.h"
+#include "Logger.h"
+#include "TestUtil.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger(simplelogger::ERR);
+
+#define CHUNK_SIZE 1000
+
+class GatedSink
+{
+public:
+	GatedSink(bool bOpen = false) : bOpen(bOpen), nEntered(0) {}
+
+	bool Write(const uint8_t *pData, size_t cb)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		nEntered++;
+		cv.notify_all();
+		cv.wait(lock, [this] { return bOpen; });
+		vWritten.push_back(pData[0]);
+		return true;
+	}
+	std::function<bool(const uint8_t *, size_t)> Writer()
+	{
+		return [this](const uint8_t *pData, size_t cb) { return Write(pData, cb); };
+	}
+	void Open()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		bOpen = true;
+		cv.notify_all();
+	}
+	// Waits until the writer thread is busy with its n-th chunk
+	bool WaitEntered(int n)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		return cv.wait_for(lock, std::chrono::seconds(5), [this, n] { return nEntered >= n; });
+	}
+	std::vector<int> GetWritten()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		return vWritten;
+	}
+
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool bOpen;
+	int nEntered;
+	std::vector<int> vWritten;
+};
+
+static bool Push(SinkQueue &q, int iFrame, SinkFrameKind eKind, bool bFrameStart = true)
+{
+	uint8_t ab[CHUNK_SIZE] = {(uint8_t)iFrame};
+	return q.Push(ab, sizeof(ab), eKind, bFrameStart);
+}
+
+static std::vector<int> Frames(std::initializer_list<int> l)
+{
+	return std::vector<int>(l);
+}
+
+// Starts q and leaves its writer blocked in the sink on frame 1, with nQueued more frames queued behind it
+static void FillBehindGate(SinkQueue &q, GatedSink &sink, std::atomic<int> &nRequest, int nQueued)
+{
+	q.Start(sink.Writer(), [&nRequest] { nRequest++; });
+	CHECK(Push(q, 1, SINK_FRAME_KEY));
+	CHECK(sink.WaitEntered(1));
+	for (int i = 0; i < nQueued; i++) {
+		CHECK(Push(q, 2 + i, SINK_FRAME_REFERENCE));
+	}
+}
+
+static void TestNonReferenceFrameDroppedAlone()
+{
+	SinkQueue q(0, 1 << 20, 3);
+	GatedSink sink;
+	std::atomic<int> nRequest(0);
+	FillBehindGate(q, sink, nRequest, 3);
+
+	CHECK(!Push(q, 5, SINK_FRAME_NON_REFERENCE));
+	CHECK(nRequest == 0);
+
+	sink.Open();
+	CHECK(WaitUntil([&sink] { return sink.GetWritten().size() == 4; }));
+	// Nothing depended on frame 5, so the next reference frame goes out
+	CHECK(Push(q, 6, SINK_FRAME_REFERENCE));
+	q.Stop();
+	CHECK(sink.GetWritten() == Frames({1, 2, 3, 4, 6}));
+
+	SinkQueue::Stats stats = q.TakeStats();
+	CHECK(stats.nFrame == 5);
+	CHECK(stats.nDroppedFrame == 1);
+	CHECK(stats.qwDroppedBytes == CHUNK_SIZE);
+	CHECK(stats.nKeyFrameRequest == 0);
+}
+
+static void TestReferenceFrameDropsToKeyFrame()
+{
+	SinkQueue q(0, 1 << 20, 3);
+	GatedSink sink;
+	std::atomic<int> nRequest(0);
+	FillBehindGate(q, sink, nRequest, 3);
+
+	CHECK(!Push(q, 5, SINK_FRAME_REFERENCE));
+	CHECK(nRequest == 1);
+
+	sink.Open();
+	CHECK(WaitUntil([&sink] { return sink.GetWritten().size() == 4; }));
+	// The queue has room again, but frames 6 and 7 refer to the lost frame 5
+	CHECK(!Push(q, 6, SINK_FRAME_REFERENCE));
+	CHECK(!Push(q, 7, SINK_FRAME_NON_REFERENCE));
+	CHECK(nRequest == 1);
+	CHECK(Push(q, 8, SINK_FRAME_KEY));
+	CHECK(Push(q, 9, SINK_FRAME_REFERENCE));
+	q.Stop();
+	CHECK(sink.GetWritten() == Frames({1, 2, 3, 4, 8, 9}));
+
+	SinkQueue::Stats stats = q.TakeStats();
+	CHECK(stats.nFrame == 6);
+	CHECK(stats.nDroppedFrame == 3);
+	CHECK(stats.nKeyFrameRequest == 1);
+}
+
+static void TestKeyFrameDiscardsQueue()
+{
+	SinkQueue q(0, 1 << 20, 3);
+	GatedSink sink;
+	std::atomic<int> nRequest(0);
+	FillBehindGate(q, sink, nRequest, 3);
+
+	// A full queue still takes a key frame, in place of the frames it makes obsolete
+	CHECK(Push(q, 5, SINK_FRAME_KEY));
+	SinkQueue::Stats stats = q.TakeStats();
+	CHECK(stats.qwDroppedBytes == 3 * CHUNK_SIZE);
+	CHECK(stats.nDroppedFrame == 0);
+	CHECK(nRequest == 0);
+
+	sink.Open();
+	q.Stop();
+	CHECK(sink.GetWritten() == Frames({1, 5}));
+}
+
+static void TestFrameCutHalfway()
+{
+	// Room for four chunks, counting the one being written
+	SinkQueue q(0, 4 * CHUNK_SIZE, 64);
+	GatedSink sink;
+	std::atomic<int> nRequest(0);
+	FillBehindGate(q, sink, nRequest, 0);
+
+	// Frame 2 arrives slice by slice and overflows on its fourth slice
+	CHECK(Push(q, 2, SINK_FRAME_REFERENCE, true));
+	CHECK(Push(q, 2, SINK_FRAME_REFERENCE, false));
+	CHECK(Push(q, 2, SINK_FRAME_REFERENCE, false));
+	CHECK(!Push(q, 2, SINK_FRAME_REFERENCE, false));
+	CHECK(nRequest == 1);
+	// The rest of the frame goes too, without asking again
+	CHECK(!Push(q, 2, SINK_FRAME_REFERENCE, false));
+	CHECK(nRequest == 1);
+	CHECK(!Push(q, 3, SINK_FRAME_NON_REFERENCE));
+
+	// The key frame also discards the first slices of frame 2
+	CHECK(Push(q, 4, SINK_FRAME_KEY));
+	sink.Open();
+	q.Stop();
+	CHECK(sink.GetWritten() == Frames({1, 4}));
+
+	SinkQueue::Stats stats = q.TakeStats();
+	CHECK(stats.nDroppedFrame == 2);
+	CHECK(stats.nKeyFrameRequest == 1);
+}
+
+static void TestSlowSinkNeverBlocksEncoder()
+{
+	const int nFrame = 300, nKeyInt = 30;
+	SinkQueue q(0, 8 * CHUNK_SIZE, 64);
+	std::mutex mtx;
+	std::vector<int> vWritten;
+	q.Start([&mtx, &vWritten](const uint8_t *pData, size_t cb) {
+		// Half the speed of the encoder below
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		std::lock_guard<std::mutex> lock(mtx);
+		vWritten.push_back(pData[0] | (pData[1] << 8));
+		return true;
+	});
+
+	double maxPushMs = 0;
+	for (int i = 0; i < nFrame; i++) {
+		uint8_t ab[CHUNK_SIZE] = {(uint8_t)i, (uint8_t)(i >> 8)};
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		q.Push(ab, sizeof(ab), i % nKeyInt ? SINK_FRAME_REFERENCE : SINK_FRAME_KEY);
+		double pushMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		maxPushMs = pushMs > maxPushMs ? pushMs : maxPushMs;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	q.Stop();
+
+	SinkQueue::Stats stats = q.TakeStats();
+	CHECK(stats.nFrame + stats.nDroppedFrame == (unsigned int)nFrame);
+	CHECK(stats.nFrame == vWritten.size());
+	CHECK(stats.nDroppedFrame > 0);
+	CHECK(stats.cbHighWater <= 8 * CHUNK_SIZE);
+	// A push takes a lock and maybe a copy, never a write
+	CHECK(maxPushMs < 50);
+	// Every frame that went out can be decoded: its predecessor went out too, or it is a key frame
+	for (size_t i = 0; i < vWritten.size(); i++) {
+		int iFrame = vWritten[i];
+		CHECK(iFrame % nKeyInt == 0 || (i > 0 && vWritten[i - 1] == iFrame - 1));
+	}
+}
+
+static void TestSinkGraphSlowSinkDropsAlone()
+{
+	SinkGraph graph(0);
+	GatedSink fast(true), slow;
+	std::atomic<int> nRequest(0);
+	graph.SetKeyFrameRequest([&nRequest] { nRequest++; });
+	CHECK(graph.AddSink("fast", [&fast](Packet *pPacket) { return fast.Write(pPacket->GetData(), pPacket->GetSize()); }));
+	CHECK(graph.AddSink("slow", [&slow](Packet *pPacket) { return slow.Write(pPacket->GetData(), pPacket->GetSize()); },
+		std::function<void()>(), 1 << 20, 2));
+	CHECK(graph.GetSinkCount() == 2);
+
+	uint8_t ab[CHUNK_SIZE] = {1};
+	CHECK(graph.Push(ab, sizeof(ab), SINK_FRAME_KEY));
+	CHECK(slow.WaitEntered(1));
+	for (int i = 2; i <= 6; i++) {
+		ab[0] = (uint8_t)i;
+		// The primary sink keeps up, so the encoder sees no drop
+		CHECK(graph.Push(ab, sizeof(ab), SINK_FRAME_REFERENCE));
+	}
+	CHECK(WaitUntil([&fast] { return fast.GetWritten().size() == 6; }));
+
+	SinkQueue::Stats slowStats = graph.GetSink(1)->TakeStats();
+	CHECK(slowStats.nFrame == 3);
+	CHECK(slowStats.nDroppedFrame == 3);
+	CHECK(nRequest == 1);
+	CHECK(graph.GetSinkName(1) == "slow");
+	CHECK(graph.GetSink(2) == NULL);
+
+	slow.Open();
+	graph.Stop();
+	CHECK(fast.GetWritten() == Frames({1, 2, 3, 4, 5, 6}));
+	CHECK(slow.GetWritten() == Frames({1, 2, 3}));
+	CHECK(graph.GetSinkCount() == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	RUN_TEST(TestNonReferenceFrameDroppedAlone);
+	RUN_TEST(TestReferenceFrameDropsToKeyFrame);
+	RUN_TEST(TestKeyFrameDiscardsQueue);
+	RUN_TEST(TestFrameCutHalfway);
+	RUN_TEST(TestSlowSinkNeverBlocksEncoder);
+	RUN_TEST(TestSinkGraphSlowSinkDropsAlone);
+	return TestResult();
+}
@@ -0,0 +1,244 @@
+/*!
+ * \brief
+ * Tests of SliceReadout against MockSliceSource
+ *
+ * \file
+ *
+ * Every frame is a buffer of parameter sets followed by slices, each byte
+ * holding its offset, so a chunk's content shows where it came from. The
+ * sink records the chunks the way CNvHWEncoder::ProcessSubFrameOutput()
+ * pushes them: a chunk at offset 0 starts the frame. FailingSliceSource
+ * lets the mock fail on a given poll.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <vector>
+#include "SliceReadout.h"
+#include "Logger.h"
+#include "TestUtil.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger(simplelogger::ERR);
+
+#define POLL_INTERVAL_US 100
+
+struct Chunk {
+	uint32_t cb;
+	uint32_t offset;
+	uint32_t iSlice;
+	uint32_t dwFrame;
+	bool bFrameStart;
+	bool bLast;
+	uint32_t usElapsed;
+	// The chunk's bytes held the offsets they were written at
+	bool bIntact;
+};
+
+class ChunkSink
+{
+public:
+	ChunkSink(const uint8_t *pFrame) : pFrame(pFrame) {}
+
+	void operator()(const SliceChunk &chunk)
+	{
+		Chunk c;
+		c.cb = chunk.cb;
+		c.offset = chunk.offset;
+		c.iSlice = chunk.iSlice;
+		c.dwFrame = chunk.dwFrame;
+		c.bFrameStart = !chunk.offset;
+		c.bLast = chunk.bLast;
+		c.usElapsed = chunk.usElapsed;
+		c.bIntact = chunk.pData == pFrame + chunk.offset;
+		for (uint32_t i = 0; i < chunk.cb; i++) {
+			c.bIntact &= chunk.pData[i] == (uint8_t)(chunk.offset + i);
+		}
+		vChunk.push_back(c);
+	}
+
+	const uint8_t *pFrame;
+	std::vector<Chunk> vChunk;
+};
+
+class FailingSliceSource : public SliceSource
+{
+public:
+	FailingSliceSource(SliceSource *pSource, int iFailingPoll) : pSource(pSource), iFailingPoll(iFailingPoll), nPoll(0), nRelease(0) {}
+
+	virtual bool Poll(SliceProgress &progress)
+	{
+		if (nPoll++ == iFailingPoll) {
+			return false;
+		}
+		return pSource->Poll(progress);
+	}
+	virtual void Release()
+	{
+		nRelease++;
+		pSource->Release();
+	}
+
+	SliceSource *pSource;
+	int iFailingPoll;
+	int nPoll;
+	int nRelease;
+};
+
+static std::vector<uint8_t> MakeFrame(uint32_t cb)
+{
+	std::vector<uint8_t> v(cb);
+	for (uint32_t i = 0; i < cb; i++) {
+		v[i] = (uint8_t)i;
+	}
+	return v;
+}
+
+static bool ReadFrame(SliceReadout &readout, SliceSource *pSource, ChunkSink &sink, unsigned int msTimeout = 1000)
+{
+	return readout.ReadFrame(pSource, [&sink](const SliceChunk &chunk) { sink(chunk); }, msTimeout);
+}
+
+// The chunks cover [0, cbEnd) back to back, one per slice in order, and only the first starts the frame
+static void CheckInOrder(const std::vector<Chunk> &vChunk, uint32_t cbEnd, uint32_t dwFrame)
+{
+	uint32_t cb = 0;
+	for (size_t i = 0; i < vChunk.size(); i++) {
+		const Chunk &c = vChunk[i];
+		CHECK(c.iSlice == i);
+		CHECK(c.offset == cb);
+		CHECK(c.dwFrame == dwFrame);
+		CHECK(c.bFrameStart == (i == 0));
+		CHECK(c.bIntact);
+		CHECK(!i || c.usElapsed >= vChunk[i - 1].usElapsed);
+		cb += c.cb;
+	}
+	CHECK(cb == cbEnd);
+}
+
+static void TestSlicesInOrder()
+{
+	// 30 bytes of SPS and PPS, then four slices completing 5 ms apart
+	std::vector<uint8_t> vFrame = MakeFrame(4000);
+	std::vector<uint32_t> vOffset = {30, 1030, 2030, 3030};
+	MockSliceSource source({5000, 10000, 15000, 20000});
+	SliceReadout readout(0, POLL_INTERVAL_US);
+	for (uint32_t dwFrame = 7; dwFrame < 9; dwFrame++) {
+		ChunkSink sink(vFrame.data());
+		source.Start(vFrame.data(), (uint32_t)vFrame.size(), vOffset, dwFrame);
+		CHECK(ReadFrame(readout, &source, sink));
+		CHECK(sink.vChunk.size() == 4);
+		CheckInOrder(sink.vChunk, 4000, dwFrame);
+		// The first chunk carries the parameter sets along with the first slice
+		CHECK(sink.vChunk[0].cb == 1030);
+		for (size_t i = 0; i < sink.vChunk.size(); i++) {
+			CHECK(sink.vChunk[i].bLast == (i == 3));
+		}
+		// Each slice came out once it was complete, not at the end of the frame
+		CHECK(sink.vChunk[0].usElapsed >= 5000);
+		CHECK(sink.vChunk[3].usElapsed >= 20000);
+	}
+
+	// A frame that is complete on the first poll comes out the same
+	MockSliceSource sourceDone({0});
+	ChunkSink sink(vFrame.data());
+	sourceDone.Start(vFrame.data(), (uint32_t)vFrame.size(), vOffset, 9);
+	CHECK(ReadFrame(readout, &sourceDone, sink));
+	CHECK(sink.vChunk.size() == 4);
+	CheckInOrder(sink.vChunk, 4000, 9);
+	CHECK(sink.vChunk.back().bLast);
+
+	SliceReadout::Stats stats = readout.TakeStats();
+	CHECK(stats.nFrame == 3);
+	CHECK(stats.nSlice == 12);
+	CHECK(stats.nTimeout == 0);
+	CHECK(stats.qwFirstSliceUs <= stats.qwFrameUs);
+	CHECK(readout.TakeStats().nFrame == 0);
+}
+
+static void TestShortSlices()
+{
+	std::vector<uint8_t> vFrame = MakeFrame(900);
+	SliceReadout readout(0, POLL_INTERVAL_US);
+
+	// An empty slice in the middle and one at the end
+	MockSliceSource source({1000, 2000, 3000, 4000});
+	ChunkSink sink(vFrame.data());
+	source.Start(vFrame.data(), 900, {0, 500, 500, 900}, 1);
+	CHECK(ReadFrame(readout, &source, sink));
+	CHECK(sink.vChunk.size() == 4);
+	CheckInOrder(sink.vChunk, 900, 1);
+	if (sink.vChunk.size() == 4) {
+		CHECK(sink.vChunk[1].cb == 0);
+		CHECK(sink.vChunk[2].cb == 400);
+		CHECK(sink.vChunk[3].cb == 0);
+		CHECK(sink.vChunk[3].bLast);
+	}
+
+	// A frame that ends short of its last slice: the last chunk is empty, but the frame still ends
+	MockSliceSource sourceShort({0});
+	ChunkSink sinkShort(vFrame.data());
+	sourceShort.Start(vFrame.data(), 600, {0, 400, 800}, 2);
+	CHECK(ReadFrame(readout, &sourceShort, sinkShort));
+	CHECK(sinkShort.vChunk.size() == 3);
+	CheckInOrder(sinkShort.vChunk, 800, 2);
+	if (sinkShort.vChunk.size() == 3) {
+		CHECK(sinkShort.vChunk[2].cb == 0);
+		CHECK(sinkShort.vChunk[2].bLast);
+	}
+	CHECK(readout.TakeStats().nFrame == 2);
+}
+
+static void TestFailedPoll()
+{
+	std::vector<uint8_t> vFrame = MakeFrame(3000);
+	// The first two slices are there at once, the third never
+	MockSliceSource mock({0, 0, 1000000000});
+	mock.Start(vFrame.data(), 3000, {0, 1000, 2000}, 3);
+	FailingSliceSource source(&mock, 2);
+	SliceReadout readout(0, POLL_INTERVAL_US);
+	ChunkSink sink(vFrame.data());
+	CHECK(!ReadFrame(readout, &source, sink));
+	// What came out before the error is in order, and the frame never ended
+	CHECK(sink.vChunk.size() == 2);
+	CheckInOrder(sink.vChunk, 2000, 3);
+	for (size_t i = 0; i < sink.vChunk.size(); i++) {
+		CHECK(!sink.vChunk[i].bLast);
+	}
+	// Every successful poll was released; the failed one had nothing to release
+	CHECK(source.nPoll == 3);
+	CHECK(source.nRelease == 2);
+	SliceReadout::Stats stats = readout.TakeStats();
+	CHECK(stats.nFrame == 0);
+	CHECK(stats.nTimeout == 0);
+}
+
+static void TestTimeout()
+{
+	std::vector<uint8_t> vFrame = MakeFrame(2000);
+	MockSliceSource source({0, 1000000000});
+	source.Start(vFrame.data(), 2000, {0, 1000}, 4);
+	SliceReadout readout(0, POLL_INTERVAL_US);
+	ChunkSink sink(vFrame.data());
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	CHECK(!ReadFrame(readout, &source, sink, 20));
+	CHECK(std::chrono::steady_clock::now() - t0 >= std::chrono::milliseconds(20));
+	CHECK(sink.vChunk.size() == 1);
+	CheckInOrder(sink.vChunk, 1000, 4);
+	CHECK(!sink.vChunk.empty() && !sink.vChunk[0].bLast);
+	SliceReadout::Stats stats = readout.TakeStats();
+	CHECK(stats.nFrame == 0);
+	CHECK(stats.nTimeout == 1);
+}
+
+int main(int argc, char *argv[])
+{
+	RUN_TEST(TestSlicesInOrder);
+	RUN_TEST(TestShortSlices);
+	RUN_TEST(TestFailedPoll);
+	RUN_TEST(TestTimeout);
+	return TestResult();
+}
@@ -0,0 +1,223 @@
+/*!
+ * \brief
+ * Scaling benchmark of TaskPool from one worker to one per logical processor
+ *
+ * \file
+ *
+ * Every task does a fixed amount of arithmetic, about what an encoder's
+ * per-frame bookkeeping costs. Three loads run on pools of 1, 2, 4, ...
+ * workers:
+ *
+ * - submit: an outside thread queues the tasks round-robin, as the encoders'
+ *   frame ticks do;
+ * - steal: one task spawns all the others on its own worker, so every other
+ *   worker only gets work by stealing;
+ * - timer: the tasks go through the deadline heap, all due within a few
+ *   milliseconds, in shuffled order.
+ *
+ * The benchmark reports tasks per second and the speedup over one worker,
+ * and for the timer load how late the tasks ran; the load is more than the
+ * workers keep up with, so that includes the wait behind busy workers. It
+ * fails if a task is lost, runs twice or runs before its deadline. An
+ * argument sets the largest pool, e.g. to run more workers than processors.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "TaskPool.h"
+
+enum Load {
+	LOAD_SUBMIT,
+	LOAD_STEAL,
+	LOAD_TIMER,
+	N_LOAD
+};
+static const char *aszLoad[N_LOAD] = {"submit", "steal", "timer"};
+
+// Keeps the compiler from dropping the work
+static std::atomic<unsigned int> uSink(0);
+
+static void Work(unsigned int nIteration)
+{
+	unsigned int u = nIteration;
+	for (unsigned int i = 0; i < nIteration; i++) {
+		u = u * 1664525 + 1013904223;
+	}
+	uSink.fetch_add(u & 1, std::memory_order_relaxed);
+}
+
+// Counts the tasks of a run and wakes the main thread after the last one
+class Run
+{
+public:
+	Run(int nTask) : nTask(nTask), nDone(0), nEarly(0), abRan(new std::atomic<unsigned char>[nTask]), nTwice(0)
+	{
+		for (int i = 0; i < nTask; i++) {
+			abRan[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void Done(int iTask)
+	{
+		if (abRan[iTask].exchange(1)) {
+			nTwice++;
+		}
+		if (nDone.fetch_add(1) + 1 == nTask) {
+			std::lock_guard<std::mutex> lock(mtx);
+			cv.notify_one();
+		}
+	}
+	bool Wait(int msTimeout)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		return cv.wait_for(lock, std::chrono::milliseconds(msTimeout), [this] { return nDone == nTask; });
+	}
+
+	const int nTask;
+	std::atomic<int> nDone;
+	std::atomic<int> nEarly;
+	std::unique_ptr<std::atomic<unsigned char>[]> abRan;
+	std::atomic<int> nTwice;
+	std::vector<double> vLateUs;
+
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+};
+
+struct Result {
+	double tasksPerSec;
+	double usLateP50, usLateP99;
+	bool bIntact;
+};
+
+static double Percentile(std::vector<double> &v, double p)
+{
+	if (v.empty()) {
+		return 0;
+	}
+	size_t i = (size_t)(p * (v.size() - 1));
+	std::nth_element(v.begin(), v.begin() + i, v.end());
+	return v[i];
+}
+
+static Result RunLoad(TaskPool &pool, Load eLoad, int nTask, unsigned int nIteration)
+{
+	Run run(nTask);
+	std::mutex mtxLate;
+	run.vLateUs.reserve(nTask);
+	TaskPool::Clock::time_point t0 = TaskPool::Clock::now();
+	if (eLoad == LOAD_SUBMIT) {
+		for (int i = 0; i < nTask; i++) {
+			pool.Submit([&run, i, nIteration] {
+				Work(nIteration);
+				run.Done(i);
+			});
+		}
+	} else if (eLoad == LOAD_STEAL) {
+		// Spawned from a worker, the tasks stay on that worker's deque
+		pool.Submit([&run, &pool, nTask, nIteration] {
+			for (int i = 1; i < nTask; i++) {
+				pool.Submit([&run, i, nIteration] {
+					Work(nIteration);
+					run.Done(i);
+				});
+			}
+			Work(nIteration);
+			run.Done(0);
+		}, 0);
+	} else {
+		std::vector<int> vOrder(nTask);
+		for (int i = 0; i < nTask; i++) {
+			vOrder[i] = i;
+		}
+		for (int i = nTask - 1; i > 0; i--) {
+			std::swap(vOrder[i], vOrder[(unsigned int)(i * 2654435761u) % (i + 1)]);
+		}
+		// Due over 5 ms from 1 ms ahead, so the heap is filled before the first one fires
+		TaskPool::Clock::time_point tFirst = t0 + std::chrono::milliseconds(1);
+		for (int k = 0; k < nTask; k++) {
+			int i = vOrder[k];
+			TaskPool::Clock::time_point tDue = tFirst + std::chrono::microseconds(5000LL * i / nTask);
+			pool.SubmitAt([&run, &mtxLate, i, tDue, nIteration] {
+				double usLate = std::chrono::duration<double, std::micro>(TaskPool::Clock::now() - tDue).count();
+				if (usLate < 0) {
+					run.nEarly++;
+				}
+				{
+					std::lock_guard<std::mutex> lock(mtxLate);
+					run.vLateUs.push_back(usLate);
+				}
+				Work(nIteration);
+				run.Done(i);
+			}, tDue);
+		}
+	}
+	bool bDone = run.Wait(30000);
+	double sec = std::chrono::duration<double>(TaskPool::Clock::now() - t0).count();
+
+	Result r;
+	r.tasksPerSec = nTask / sec;
+	r.bIntact = bDone && run.nTwice == 0 && run.nEarly == 0;
+	{
+		std::lock_guard<std::mutex> lock(mtxLate);
+		r.usLateP50 = Percentile(run.vLateUs, 0.5);
+		r.usLateP99 = Percentile(run.vLateUs, 0.99);
+	}
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	const int nTask = 20000;
+	const unsigned int nIteration = 20000;
+	int nMaxWorker = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+	if (nMaxWorker < 1) {
+		nMaxWorker = 1;
+	}
+	std::vector<int> vWorker;
+	for (int n = 1; n < nMaxWorker; n *= 2) {
+		vWorker.push_back(n);
+	}
+	vWorker.push_back(nMaxWorker);
+
+	printf("%-8s %8s %12s %8s %10s %10s\n", "", "workers", "tasks/s", "speedup", "late p50", "late p99");
+	for (int l = 0; l < N_LOAD; l++) {
+		double tasksPerSecOne = 0;
+		for (size_t w = 0; w < vWorker.size(); w++) {
+			TaskPool pool(vWorker[w]);
+			// A short run first, so the workers are up and the deques have grown
+			Result r = RunLoad(pool, (Load)l, nTask / 10, nIteration);
+			if (r.bIntact) {
+				r = RunLoad(pool, (Load)l, nTask, nIteration);
+			}
+			if (!r.bIntact) {
+				printf("FAIL: %s on %d workers lost a task, ran one twice or ran one early\n", aszLoad[l], vWorker[w]);
+				return 1;
+			}
+			if (!w) {
+				tasksPerSecOne = r.tasksPerSec;
+			}
+			if (l == LOAD_TIMER) {
+				printf("%-8s %8d %12.0f %7.2fx %8.0fus %8.0fus\n", aszLoad[l], vWorker[w], r.tasksPerSec,
+					r.tasksPerSec / tasksPerSecOne, r.usLateP50, r.usLateP99);
+			} else {
+				printf("%-8s %8d %12.0f %7.2fx\n", aszLoad[l], vWorker[w], r.tasksPerSec, r.tasksPerSec / tasksPerSecOne);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,57 @@
+/*!
+ * \brief
+ * Minimal checks for the tests under Test/
+ *
+ * \file
+ *
+ * A test is a plain program: CHECK() reports a failed condition and
+ * carries on, RUN_TEST() runs one test function, and TestResult() is what
+ * main() returns, nonzero if any check failed.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+static int nTestFailure = 0;
+
+#define CHECK(cond) \
+	do {																	\
+		if (!(cond)) {														\
+			fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond);	\
+			nTestFailure++;													\
+		}																	\
+	} while (0)
+
+#define RUN_TEST(test) \
+	do {																	\
+		int nFailureBefore = nTestFailure;									\
+		test();																\
+		printf("%-40s %s\n", #test, nTestFailure == nFailureBefore ? "ok" : "FAILED");	\
+	} while (0)
+
+inline int TestResult()
+{
+	return nTestFailure ? 1 : 0;
+}
+
+// Polls cond for up to msTimeout; true as soon as it holds
+inline bool WaitUntil(const std::function<bool()> &cond, int msTimeout = 5000)
+{
+	for (int i = 0; i < msTimeout; i++) {
+		if (cond()) {
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return cond();
+}
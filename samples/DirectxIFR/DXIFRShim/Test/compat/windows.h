@@ -0,0 +1,186 @@
+/*!
+ * \brief
+ * The few Win32 types and macros the portable Common headers use
+ *
+ * \file
+ *
+ * Only for building the tests and benchmarks of Test/ with g++ on Linux;
+ * the shim itself always gets the real windows.h.
+ *
+ * Below the types, the events, threads, interlocked operations and
+ * performance counter of NvFBCToSys's FramePipeline and Util/Timer, on the
+ * standard library. Only what those use is there: unnamed events, and
+ * WaitForSingleObject() on an event or a thread.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#ifdef _WIN32
+#error "Test/compat is for builds without the Windows SDK"
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef unsigned int UINT;
+typedef int BOOL;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+typedef char TCHAR;
+typedef void *HANDLE;
+typedef void *LPVOID;
+typedef DWORD *LPDWORD;
+
+typedef union _LARGE_INTEGER {
+	struct {
+		DWORD LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct tagRECT {
+	LONG left;
+	LONG top;
+	LONG right;
+	LONG bottom;
+} RECT;
+
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH 260
+#define INFINITE 0xFFFFFFFF
+#define WINAPI
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+
+#define LOWORD(l) ((WORD)((DWORD)(l) & 0xffff))
+#define HIWORD(l) ((WORD)((DWORD)(l) >> 16))
+#define MAKELONG(a, b) ((LONG)(((WORD)(a)) | ((DWORD)((WORD)(b))) << 16))
+
+// Nanoseconds of the steady clock
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER *pli)
+{
+	pli->QuadPart = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	return TRUE;
+}
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *pli)
+{
+	pli->QuadPart = 1000000000;
+	return TRUE;
+}
+
+inline void Sleep(DWORD dwMilliseconds)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(dwMilliseconds));
+}
+
+inline LONG InterlockedIncrement(volatile LONG *p)
+{
+	return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+inline LONG InterlockedDecrement(volatile LONG *p)
+{
+	return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+inline LONG InterlockedExchange(volatile LONG *p, LONG l)
+{
+	return __atomic_exchange_n(p, l, __ATOMIC_SEQ_CST);
+}
+
+// What an event or a thread is: something to wait for until it is signaled
+class CompatWaitable
+{
+public:
+	CompatWaitable(bool bManualReset, bool bSignaled) : bManualReset(bManualReset), bSignaled(bSignaled) {}
+
+	void Set()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		bSignaled = true;
+		cv.notify_all();
+	}
+	void Reset()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		bSignaled = false;
+	}
+	DWORD Wait(DWORD dwMilliseconds)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		if (dwMilliseconds == INFINITE) {
+			cv.wait(lock, [this] { return bSignaled; });
+		} else if (!cv.wait_for(lock, std::chrono::milliseconds(dwMilliseconds), [this] { return bSignaled; })) {
+			return WAIT_TIMEOUT;
+		}
+		if (!bManualReset) {
+			bSignaled = false;
+		}
+		return WAIT_OBJECT_0;
+	}
+
+private:
+	bool bManualReset;
+	bool bSignaled;
+	std::mutex mtx;
+	std::condition_variable cv;
+};
+
+// A thread shares its waitable with its handle, so either may go first
+struct CompatHandle {
+	std::shared_ptr<CompatWaitable> pWaitable;
+};
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID lpParameter);
+
+inline HANDLE CreateEvent(void *pAttributes, BOOL bManualReset, BOOL bInitialState, const TCHAR *szName)
+{
+	return new CompatHandle{std::make_shared<CompatWaitable>(bManualReset != FALSE, bInitialState != FALSE)};
+}
+inline BOOL SetEvent(HANDLE h)
+{
+	((CompatHandle *)h)->pWaitable->Set();
+	return TRUE;
+}
+inline BOOL ResetEvent(HANDLE h)
+{
+	((CompatHandle *)h)->pWaitable->Reset();
+	return TRUE;
+}
+
+// The thread handle is signaled once the thread has returned
+inline HANDLE CreateThread(void *pAttributes, size_t cbStack, LPTHREAD_START_ROUTINE pStart, LPVOID lpParameter, DWORD dwFlags, LPDWORD pdwThreadId)
+{
+	std::shared_ptr<CompatWaitable> pDone = std::make_shared<CompatWaitable>(true, false);
+	std::thread([pDone, pStart, lpParameter] {
+		pStart(lpParameter);
+		pDone->Set();
+	}).detach();
+	return new CompatHandle{pDone};
+}
+
+inline DWORD WaitForSingleObject(HANDLE h, DWORD dwMilliseconds)
+{
+	return ((CompatHandle *)h)->pWaitable->Wait(dwMilliseconds);
+}
+
+inline BOOL CloseHandle(HANDLE h)
+{
+	delete (CompatHandle *)h;
+	return TRUE;
+}
@@ -0,0 +1,188 @@
+/*!
+ * \brief
+ * The implementation of FrameWriter and FramePipeline
+ *
+ * \file
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#include "FramePipeline.h"
+
+FrameWriter::FrameWriter(int iPlayer, DWORD cbFrame, FILE *fOutput)
+    : m_iPlayer(iPlayer)
+    , m_cbFrame(cbFrame)
+    , m_fOutput(fOutput)
+    , m_iBack(0)
+    , m_hThread(NULL)
+    , m_hWork(NULL)
+    , m_lBusy(0)
+    , m_bStop(false)
+    , m_nWritten(0)
+    , m_nSkipped(0)
+    , m_nWriteError(0)
+{
+    m_apBuffer[0] = new unsigned char[cbFrame];
+    m_apBuffer[1] = new unsigned char[cbFrame];
+}
+
+FrameWriter::~FrameWriter()
+{
+    Stop();
+    delete[] m_apBuffer[0];
+    delete[] m_apBuffer[1];
+}
+
+bool FrameWriter::Start()
+{
+    m_hWork = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!m_hWork)
+    {
+        return false;
+    }
+    m_hThread = CreateThread(NULL, 0, ThreadProc, this, 0, NULL);
+    return m_hThread != NULL;
+}
+
+void FrameWriter::Stop()
+{
+    if (m_hThread)
+    {
+        m_bStop = true;
+        SetEvent(m_hWork);
+        WaitForSingleObject(m_hThread, INFINITE);
+        CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+    if (m_hWork)
+    {
+        CloseHandle(m_hWork);
+        m_hWork = NULL;
+    }
+}
+
+void FrameWriter::Submit()
+{
+    // The writer is idle, so the front buffer is free to become the next back buffer
+    m_iBack = 1 - m_iBack;
+    InterlockedExchange(&m_lBusy, 1);
+    SetEvent(m_hWork);
+}
+
+bool FrameWriter::Write(const unsigned char *pFrame, DWORD cbFrame)
+{
+    return fwrite(pFrame, cbFrame, 1, m_fOutput) == 1;
+}
+
+DWORD WINAPI FrameWriter::ThreadProc(LPVOID lpParameter)
+{
+    ((FrameWriter *)lpParameter)->Run();
+    return 0;
+}
+
+void FrameWriter::Run()
+{
+    for (;;)
+    {
+        WaitForSingleObject(m_hWork, INFINITE);
+        if (m_lBusy)
+        {
+            // Submit() flipped m_iBack, so the submitted frame is the other buffer
+            if (!Write(m_apBuffer[1 - m_iBack], m_cbFrame))
+            {
+                InterlockedIncrement(&m_nWriteError);
+            }
+            InterlockedIncrement(&m_nWritten);
+            InterlockedExchange(&m_lBusy, 0);
+        }
+        if (m_bStop)
+        {
+            break;
+        }
+    }
+}
+
+FramePipeline::FramePipeline(FrameGrabber *pGrabber, const std::vector<FrameWriter *> &vWriter, DWORD cbFrame, int iFps)
+    : m_pGrabber(pGrabber)
+    , m_vWriter(vWriter)
+    , m_cbFrame(cbFrame)
+    , m_iFps(iFps > 0 ? iFps : 30)
+    , m_llTick(0)
+    , m_llRound(0)
+    , m_msGrab(0)
+    , m_nWrittenAtReport(0)
+    , m_nSkippedAtReport(0)
+    , m_llRoundAtReport(0)
+    , m_msGrabAtReport(0)
+{
+}
+
+bool FramePipeline::RunRound()
+{
+    Timer timerGrab;
+    for (size_t i = 0; i < m_vWriter.size(); ++i)
+    {
+        FrameWriter *pWriter = m_vWriter[i];
+        if (pWriter->IsBusy())
+        {
+            pWriter->Skip();
+            continue;
+        }
+        if (!m_pGrabber->Grab((int)i, pWriter->GetBackBuffer(), m_cbFrame))
+        {
+            return false;
+        }
+        pWriter->Submit();
+    }
+    m_msGrab += timerGrab.now();
+    m_llRound++;
+
+    // The next round is due at a fixed offset from the start, so the rate does not drift
+    double msPeriod = 1000.0 / m_iFps;
+    double msWait = ++m_llTick * msPeriod - m_timerPace.now();
+    if (msWait > 0)
+    {
+        Sleep((DWORD)msWait);
+    }
+    else if (msWait < -msPeriod)
+    {
+        // Too far behind to catch up; start over instead of grabbing in a burst
+        m_timerPace.reset();
+        m_llTick = 0;
+    }
+    return true;
+}
+
+void FramePipeline::Report(DWORD dwIntervalMs)
+{
+    double msElapsed = m_timerReport.now();
+    if (msElapsed < dwIntervalMs)
+    {
+        return;
+    }
+
+    LONG nWritten = 0, nSkipped = 0;
+    for (size_t i = 0; i < m_vWriter.size(); ++i)
+    {
+        nWritten += m_vWriter[i]->GetWrittenCount();
+        nSkipped += m_vWriter[i]->GetSkippedCount();
+    }
+    LONGLONG llRounds = m_llRound - m_llRoundAtReport;
+    int nPlayers = (int)m_vWriter.size();
+    printf("%d players: %.1f fps per player (target %d), grab %.2f ms per round, %d frames skipped by busy writers\n",
+        nPlayers,
+        nPlayers ? (nWritten - m_nWrittenAtReport) * 1000.0 / msElapsed / nPlayers : 0.0,
+        m_iFps,
+        llRounds ? (m_msGrab - m_msGrabAtReport) / llRounds : 0.0,
+        (int)(nSkipped - m_nSkippedAtReport));
+
+    m_nWrittenAtReport = nWritten;
+    m_nSkippedAtReport = nSkipped;
+    m_llRoundAtReport = m_llRound;
+    m_msGrabAtReport = m_msGrab;
+    m_timerReport.reset();
+}
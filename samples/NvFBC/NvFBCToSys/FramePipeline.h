@@ -0,0 +1,119 @@
+/*!
+ * \brief
+ * Pipelined grab and write stages for NvFBCToSys
+ *
+ * \file
+ *
+ * The grab stage captures every player's region in turn on the main
+ * thread. Each player has a FrameWriter with two frame buffers and its own
+ * thread: while the writer thread pushes the front buffer into the player's
+ * pipe, the grab stage already fills the back buffer. A round therefore
+ * costs the sum of the grabs only, not of the grabs and the writes.
+ *
+ * A writer that is still busy with its previous frame when the next round
+ * starts is skipped for that round instead of stalling the other players.
+ *
+ * FrameGrabber hides NvFBC, so the pipeline can also be driven by a fake
+ * grabber, and FrameWriter::Write can be overridden to fake a slow pipe.
+ *
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+#include <vector>
+
+#include <Timer.h>
+
+// Source of the players' frames
+class FrameGrabber
+{
+public:
+    virtual ~FrameGrabber() {}
+
+    // Copies the current frame of iPlayer into pDst, which holds cbFrame bytes
+    virtual bool Grab(int iPlayer, unsigned char *pDst, DWORD cbFrame) = 0;
+};
+
+// Double-buffered writer of one player's frames
+class FrameWriter
+{
+public:
+    FrameWriter(int iPlayer, DWORD cbFrame, FILE *fOutput);
+    virtual ~FrameWriter();
+
+    bool Start();
+    // Finishes the frame in flight and ends the writer thread
+    void Stop();
+
+    // Whether the previous frame is still being written
+    bool IsBusy() { return m_lBusy != 0; }
+    // Buffer for the grab stage to fill; only valid while !IsBusy()
+    unsigned char *GetBackBuffer() { return m_apBuffer[m_iBack]; }
+    // Hands the back buffer to the writer thread, never waits for the write
+    void Submit();
+    // Counts a frame that was not grabbed because the writer was busy
+    void Skip() { m_nSkipped++; }
+
+    LONG GetWrittenCount() { return m_nWritten; }
+    LONG GetSkippedCount() { return m_nSkipped; }
+    LONG GetWriteErrorCount() { return m_nWriteError; }
+
+protected:
+    // Writes one frame; overridable to fake a slow pipe
+    virtual bool Write(const unsigned char *pFrame, DWORD cbFrame);
+
+private:
+    static DWORD WINAPI ThreadProc(LPVOID lpParameter);
+    void Run();
+
+    int m_iPlayer;
+    DWORD m_cbFrame;
+    FILE *m_fOutput;
+    unsigned char *m_apBuffer[2];
+    int m_iBack;
+    HANDLE m_hThread;
+    HANDLE m_hWork;
+    volatile LONG m_lBusy;
+    volatile bool m_bStop;
+    volatile LONG m_nWritten;
+    LONG m_nSkipped;
+    volatile LONG m_nWriteError;
+};
+
+// Runs the grab stage over all players at a fixed frame rate
+class FramePipeline
+{
+public:
+    FramePipeline(FrameGrabber *pGrabber, const std::vector<FrameWriter *> &vWriter, DWORD cbFrame, int iFps);
+
+    /*! Grabs a frame for every player whose writer is free, hands it over and waits
+        for the next tick. Returns false as soon as a grab fails. */
+    bool RunRound();
+
+    // Prints the achieved frame rate every dwIntervalMs
+    void Report(DWORD dwIntervalMs = 5000);
+
+private:
+    FrameGrabber *m_pGrabber;
+    std::vector<FrameWriter *> m_vWriter;
+    DWORD m_cbFrame;
+    int m_iFps;
+    Timer m_timerPace;
+    // Ticks since m_timerPace was last reset
+    LONGLONG m_llTick;
+    LONGLONG m_llRound;
+    double m_msGrab;
+
+    Timer m_timerReport;
+    LONG m_nWrittenAtReport;
+    LONG m_nSkippedAtReport;
+    LONGLONG m_llRoundAtReport;
+    double m_msGrabAtReport;
+};
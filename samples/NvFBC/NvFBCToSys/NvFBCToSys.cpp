@@ -31,6 +31,8 @@
 #include <ctime>
 #include <vector>
 
+#include "FramePipeline.h"
+
 // Structure to store the command line arguments
 struct AppArguments
 {
@@ -49,6 +51,7 @@ struct AppArguments
 	int   numPlayers; // Number of players to stream to. // Defaults to 1
 	int   numRows; // Number of columns in the split screen
 	int   numCols; // Number of rows in the split screen
+	int   iFps; // Frames per second grabbed for every player
 };
 
 // Prints the help message
@@ -74,6 +77,7 @@ void printHelp()
 	printf("                       Should be between 30000 and 30005.");
 	printf("  -players             The number of players to stream to. Defaults to 30000.\n");
 	printf("                       Should be between 1 and 6. Defaults to 1.");
+	printf("  -fps                 Frames per second grabbed for every player. Defaults to 30.\n");
     printf("  -nowait              Grab with the no wait flag\n");
 }
 
@@ -95,6 +99,7 @@ bool parseCmdLine(int argc, char **argv, AppArguments &args)
 	args.numPlayers = 1;
 	args.numRows = 1;
 	args.numCols = 1;
+	args.iFps = 30;
 
     for(int cnt = 1; cnt < argc; ++cnt)
     {
@@ -247,6 +252,20 @@ bool parseCmdLine(int argc, char **argv, AppArguments &args)
 			}
 			args.numPlayers = atoi(argv[cnt]);
 		}
+		else if (0 == _stricmp(argv[cnt], "-fps"))
+		{
+			++cnt;
+
+			if (cnt >= argc)
+			{
+				printf("Missing -fps option\n");
+				printHelp();
+				return false;
+			}
+			args.iFps = atoi(argv[cnt]);
+			if (args.iFps < 1)
+				args.iFps = 1;
+		}
 		else if (0 == _stricmp(argv[cnt], "-layout"))
 		{
 			if ((cnt + 2) >= argc)
@@ -276,6 +295,51 @@ bool parseCmdLine(int argc, char **argv, AppArguments &args)
 
     return true;
 }
+
+// Grabs the players' regions of the desktop through NvFBCToSys
+class NvFBCGrabber : public FrameGrabber
+{
+public:
+    NvFBCGrabber(const AppArguments &args)
+        : nvfbcToSys(NULL)
+        , frameBuffer(NULL)
+        , status(NVFBC_SUCCESS)
+        , m_args(args)
+    {
+    }
+
+    virtual bool Grab(int iPlayer, unsigned char *pDst, DWORD cbFrame)
+    {
+        NvFBCFrameGrabInfo grabInfo;
+        NVFBC_TOSYS_GRAB_FRAME_PARAMS fbcSysGrabParams = {0};
+        fbcSysGrabParams.dwVersion = NVFBC_TOSYS_GRAB_FRAME_PARAMS_VER;
+        fbcSysGrabParams.dwFlags = m_args.iSetUpFlags;
+        fbcSysGrabParams.dwTargetWidth = m_args.iWidth;
+        fbcSysGrabParams.dwTargetHeight = m_args.iHeight;
+        fbcSysGrabParams.dwStartX = m_args.iStartX + m_args.iWidth * (iPlayer % m_args.numCols);
+        fbcSysGrabParams.dwStartY = m_args.iStartY + m_args.iHeight * (iPlayer / m_args.numCols);
+        fbcSysGrabParams.eGMode = m_args.gmMode;
+        fbcSysGrabParams.pNvFBCFrameGrabInfo = &grabInfo;
+
+        status = nvfbcToSys->NvFBCToSysGrabFrame(&fbcSysGrabParams);
+        if (status != NVFBC_SUCCESS)
+        {
+            return false;
+        }
+        // NvFBC grabs every player into the same buffer, so the frame moves to the player's own
+        DWORD cbGrabbed = grabInfo.dwWidth * grabInfo.dwHeight * 3 / 2;
+        memcpy(pDst, frameBuffer, cbGrabbed < cbFrame ? cbGrabbed : cbFrame);
+        return true;
+    }
+
+    NvFBCToSys *nvfbcToSys;
+    unsigned char *frameBuffer;
+    NVFBCRESULT status;
+
+private:
+    const AppArguments &m_args;
+};
+
 /*!
  * Main program
  */
@@ -289,17 +353,13 @@ int main(int argc, char* argv[])
     DWORD maxDisplayWidth = -1, maxDisplayHeight = -1;
     BOOL bRecoveryDone = FALSE;
 
-    NvFBCFrameGrabInfo grabInfo;
-    unsigned char *frameBuffer = NULL;
-    unsigned char *diffMap = NULL;
-    char frameNo[10];
-    std::string outName;
-
 	std::vector<FILE*> PipeList;
     
     if(!parseCmdLine(argc, argv, args))
         return -1;
 
+    NvFBCGrabber grabber(args);
+
     //! Load NvFBC
     if(!nvfbcLibrary.load())
     {
@@ -309,6 +369,7 @@ int main(int argc, char* argv[])
 
     //! Create an instance of NvFBCToSys
     nvfbcToSys = (NvFBCToSys *)nvfbcLibrary.create(NVFBC_TO_SYS, &maxDisplayWidth, &maxDisplayHeight);
+    grabber.nvfbcToSys = nvfbcToSys;
 
     NVFBCRESULT status = NVFBC_SUCCESS;
     if(!nvfbcToSys)
@@ -323,7 +384,7 @@ int main(int argc, char* argv[])
     fbcSysSetupParams.eMode = args.bfFormat;
     fbcSysSetupParams.bWithHWCursor = args.bHWCursor;
     fbcSysSetupParams.bDiffMap = FALSE;
-    fbcSysSetupParams.ppBuffer = (void **)&frameBuffer;
+    fbcSysSetupParams.ppBuffer = (void **)&grabber.frameBuffer;
     fbcSysSetupParams.ppDiffMap = NULL;
 
 	for (int i = 0; i < args.numPlayers; ++i)
@@ -339,99 +400,75 @@ int main(int argc, char* argv[])
 		PipeList.push_back(_popen(StringStream->str().c_str(), "wb"));
 	}
 
+    //! One writer thread per player, so the pipe writes overlap the grabs
+    DWORD cbFrame = (args.iWidth ? args.iWidth : maxDisplayWidth) * (args.iHeight ? args.iHeight : maxDisplayHeight) * 3 / 2;
+    std::vector<FrameWriter *> vWriter;
+    for (int i = 0; i < args.numPlayers; ++i)
+    {
+        vWriter.push_back(new FrameWriter(i, cbFrame, PipeList[i]));
+        if (!PipeList[i] || !vWriter[i]->Start())
+        {
+            fprintf(stderr, "Unable to start the writer of player %d\n", i);
+            return -1;
+        }
+    }
+    FramePipeline pipeline(&grabber, vWriter, cbFrame, args.iFps);
+
     status = nvfbcToSys->NvFBCToSysSetUp(&fbcSysSetupParams);
     if (status == NVFBC_SUCCESS)
     {
         //! Sleep so that ToSysSetUp forces a framebuffer update
         Sleep(100);
         
-        NVFBC_TOSYS_GRAB_FRAME_PARAMS fbcSysGrabParams = {0};
-        //! For each frame to grab..
-        //for(int cnt = 0; cnt < args.iFrameCnt; ++cnt)
-		int cnt = 0;
-		while (true)
+        //! Grab every player once per tick until the session cannot be recovered
+        while (true)
         {
-			++cnt;
-            outName = args.sBaseName + "_" + _itoa(cnt, frameNo, 10) + ".bmp";
-
-			int row = 0;
-			int col = 0;
-
-			for (int i = 0; i < args.numPlayers; ++i)
-			{			
-				fbcSysGrabParams.dwVersion = NVFBC_TOSYS_GRAB_FRAME_PARAMS_VER;
-				fbcSysGrabParams.dwFlags = args.iSetUpFlags;
-				fbcSysGrabParams.dwTargetWidth = args.iWidth;
-				fbcSysGrabParams.dwTargetHeight = args.iHeight;
-				fbcSysGrabParams.dwStartX = args.iStartX + args.iWidth*col;
-				fbcSysGrabParams.dwStartY = args.iStartY + args.iHeight*row;
-				fbcSysGrabParams.eGMode = args.gmMode;
-				fbcSysGrabParams.pNvFBCFrameGrabInfo = &grabInfo;
-
-				status = nvfbcToSys->NvFBCToSysGrabFrame(&fbcSysGrabParams);
-				// Then, fwrite the frame buffer to player 1 (pipe1) (need 1 pipe per player. 1 pipe = 1 ffmpeg streamer)
-				if (status == NVFBC_SUCCESS)
-				{
-					bRecoveryDone = FALSE;
-					fwrite(frameBuffer, grabInfo.dwWidth*grabInfo.dwHeight * 3/2, 1, PipeList[i]);
-					//fflush(PipeList[i]);
-				}
-
-				++col;
-
-				if (col >= args.numCols)
-				{
-					col = 0;
-					++row;
-				}
-			}
-			
-            if (status == NVFBC_SUCCESS)
+            if (pipeline.RunRound())
             {
                 bRecoveryDone = FALSE;
+                pipeline.Report();
+                continue;
             }
-            else
+            status = grabber.status;
+            if (bRecoveryDone == TRUE)
+            {
+                fprintf(stderr, "Unable to recover from NvFBC Frame grab failure.\n");
+                //! Relase the NvFBCToSys object
+                nvfbcToSys->NvFBCToSysRelease();
+                return -1;
+            }
+            if (status == NVFBC_ERROR_INVALIDATED_SESSION)
             {
-                if (bRecoveryDone == TRUE)
+                fprintf(stderr, "Session Invalidated. Attempting recovery\n");
+                nvfbcToSys->NvFBCToSysRelease();
+                nvfbcToSys = NULL;
+                //! Recover from error. Create an instance of NvFBCToSys
+                nvfbcToSys = (NvFBCToSys *)nvfbcLibrary.create(NVFBC_TO_SYS, &maxDisplayWidth, &maxDisplayHeight);
+                grabber.nvfbcToSys = nvfbcToSys;
+                if(!nvfbcToSys)
                 {
-                    fprintf(stderr, "Unable to recover from NvFBC Frame grab failure.\n");
-                    //! Relase the NvFBCToSys object
-                    nvfbcToSys->NvFBCToSysRelease();
+                    fprintf(stderr, "Unable to create an instance of NvFBC\n");
                     return -1;
                 }
-                if (status == NVFBC_ERROR_INVALIDATED_SESSION)
+                //! Setup the frame grab
+                NVFBC_TOSYS_SETUP_PARAMS fbcSysSetupParams = {0};
+                fbcSysSetupParams.dwVersion = NVFBC_TOSYS_SETUP_PARAMS_VER;
+                fbcSysSetupParams.eMode = args.bfFormat;
+                fbcSysSetupParams.bWithHWCursor = args.bHWCursor;
+                fbcSysSetupParams.bDiffMap = FALSE;
+                fbcSysSetupParams.ppBuffer = (void **)&grabber.frameBuffer;
+                fbcSysSetupParams.ppDiffMap = NULL;
+                status = nvfbcToSys->NvFBCToSysSetUp(&fbcSysSetupParams);
+                if (status == NVFBC_SUCCESS)
+                {
+                    bRecoveryDone = TRUE;
+                }
+                else
                 {
-                    fprintf(stderr, "Session Invalidated. Attempting recovery\n");
+                    fprintf(stderr, "Unable to recover from NvFBC Frame grab failure.\n");
+                    //! Relase the NvFBCToSys object
                     nvfbcToSys->NvFBCToSysRelease();
-                    nvfbcToSys = NULL;
-                    //! Recover from error. Create an instance of NvFBCToSys
-                    nvfbcToSys = (NvFBCToSys *)nvfbcLibrary.create(NVFBC_TO_SYS, &maxDisplayWidth, &maxDisplayHeight);
-                    if(!nvfbcToSys)
-                    {
-                        fprintf(stderr, "Unable to create an instance of NvFBC\n");
-                        return -1;
-                    }
-                    //! Setup the frame grab
-                    NVFBC_TOSYS_SETUP_PARAMS fbcSysSetupParams = {0};
-                    fbcSysSetupParams.dwVersion = NVFBC_TOSYS_SETUP_PARAMS_VER;
-                    fbcSysSetupParams.eMode = args.bfFormat;
-                    fbcSysSetupParams.bWithHWCursor = args.bHWCursor;
-                    fbcSysSetupParams.bDiffMap = FALSE;
-                    fbcSysSetupParams.ppBuffer = (void **)&frameBuffer;
-                    fbcSysSetupParams.ppDiffMap = NULL;
-                    status = nvfbcToSys->NvFBCToSysSetUp(&fbcSysSetupParams);
-                    cnt--;
-                    if (status == NVFBC_SUCCESS)
-                    {
-                        bRecoveryDone = TRUE;
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Unable to recover from NvFBC Frame grab failure.\n");
-                        //! Relase the NvFBCToSys object
-                        nvfbcToSys->NvFBCToSysRelease();
-                        return -1;
-                    }
+                    return -1;
                 }
             }
         }
@@ -443,6 +480,11 @@ int main(int argc, char* argv[])
     //! Relase the NvFBCToSys object
     nvfbcToSys->NvFBCToSysRelease();
 
+    for (size_t i = 0; i < vWriter.size(); ++i)
+    {
+        delete vWriter[i];
+    }
+
 	if (args.yuvFile) {
 		//fclose(args.yuvFile);
 		for (int i = 0; i < PipeList.size(); ++i)
@@ -209,6 +209,10 @@ bool createThreads()
     gpuDevice.cb = sizeof(gpuDevice);
     GPUIdx = 0;
 
+    // Every GPU gets the same number of threads on purpose, and none of them go
+    // through the GpuScheduler of DXIFRShim: NvIFR encodes the FBO of the thread's
+    // affinity context, on the GPU that renders it, so there is no session that
+    // could be placed on, or moved to, another GPU.
     // Iterate through all GPUs
     while (wglEnumGpusNV(GPUIdx, &hGPU))
     {
@@ -43,6 +43,7 @@
 #include "CommandLine.h"
 #include "Timer.h"
 #include "Util.h"
+#include "../../Util/NalIndex.h"
 
 /*****************************************************************************/
 
@@ -54,6 +55,8 @@ static NvIFRAPI nvIFR;
 static unsigned int framesPerSecond = 30;
 //! output file.
 FILE *outFile;
+//! NAL units of the last encoded frame, shared by everything consuming it.
+static NalIndex nalIndex(NAL_CODEC_H264);
 //! frame counter
 static unsigned int frameCounter = 0;
 //! the frame at which the last screen update had been done
@@ -408,7 +411,8 @@ void glXSwapBuffers(Display * dpy, GLXDrawable drawable)
         exit(-1);
     }
 
-    // write encoded frame to the h264 file.
+    // index the NAL units once, then write encoded frame to the h264 file.
+    nalIndex.Index((const uint8_t *)data, dataSize);
     fwrite(data, 1, dataSize, outFile);
 
     // release the data buffer
@@ -440,7 +444,8 @@ void glXSwapBuffers(Display * dpy, GLXDrawable drawable)
         lastUpdateFrame = frameCounter;
         lastUpdateTime = elapsedTime;
 
-        SHIM_LOG("Encoding %dx%d at %4.0f fps\n", fbo->width, fbo->height, frameRate);
+        SHIM_LOG("Encoding %dx%d at %4.0f fps, %u key frames bookmarked\n", fbo->width, fbo->height, frameRate,
+            (unsigned int)nalIndex.GetBookmarks().size());
     }
 }
 
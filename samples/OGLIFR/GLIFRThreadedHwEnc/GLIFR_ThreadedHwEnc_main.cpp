@@ -56,6 +56,8 @@ static NV_IFROGL_TRANSFEROBJECT_HANDLE transferObjectHandle;
 static Event transferStartedEvent;
 //! this event is triggered when the client read back the bitstream data
 static Event dataReleasedEvent;
+//! manual reset event, set by deinit to stop the worker thread
+static Event stopEvent;
 
 //! width and height of the window
 static unsigned int winWidth = 256, winHeight = 256;
@@ -98,8 +100,8 @@ typedef struct
 {
     //! Will indicate whether thread is created yet or not so as not to wait for the thread exit in deinit.
     bool m_created;
-    //! will be set by the main thread when the worker thread needs to be terminated
-    volatile bool m_terminateThread;
+    //! will be signalled by the main thread when the worker thread needs to be terminated
+    Event *m_stopEvent;
     //! output file
     FILE *m_outFile;
     //! this event is triggered when the server started the transfer
@@ -212,13 +214,15 @@ unsigned int ThreadProc(void *userData)
     ThreadData *threadData = (ThreadData*)userData;
     uintptr_t dataSize;
     const void *data;
+    // the stop event comes first, so it wins when both are signalled
+    Event *waitEvents[] = { threadData->m_stopEvent, threadData->m_transferStartedEvent };
 
-    while (!threadData->m_terminateThread)
+    while (!threadData->m_stopEvent->tryWait())
     {
         while (transferCounter == receivedTransfers)
         {
-            threadData->m_transferStartedEvent->wait();
-            if (threadData->m_terminateThread)
+            // sleep until the next transfer starts or the thread is stopped
+            if (Event::waitAny(waitEvents, 2, Event::INFINITE_TIMEOUT) != 1)
                 return 0;
         }
 
@@ -360,10 +364,8 @@ static void deinit()
 {
     // clean up
 
-    // terminate the thread
-    threadData.m_terminateThread = true;
-    // if the thread is waiting for the transfer signal then set it
-    transferStartedEvent.signal();
+    // terminate the thread, also if it is waiting for the transfer signal
+    stopEvent.signal();
 
     if (!threadData.m_created)
         exit(-1);
@@ -379,6 +381,7 @@ static void deinit()
 
     transferStartedEvent.cleanup();
     dataReleasedEvent.cleanup();
+    stopEvent.cleanup();
 
     if (nvIFR.nvIFROGLDestroyTransferObject(transferObjectHandle) != NV_IFROGL_SUCCESS)
     {
@@ -550,12 +553,17 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Failed to initialize event.\n");
         exit(-1);
     }
+    if (!stopEvent.init(true))
+    {
+        fprintf(stderr, "Failed to initialize event.\n");
+        exit(-1);
+    }
     // on startup there is no pending transfer therefore signal that the data had
     // been release.
     dataReleasedEvent.signal();
 
 	threadData.m_created = false;
-    threadData.m_terminateThread = false;
+    threadData.m_stopEvent = &stopEvent;
     threadData.m_outFile = outFile;
     threadData.m_dataReleasedEvent = &dataReleasedEvent;
     threadData.m_transferStartedEvent = &transferStartedEvent;
@@ -0,0 +1,191 @@
+/*!
+ * \file
+ * Wake-up latency of Event
+ *
+ * Two threads hand a token back and forth through a pair of auto reset
+ * events, and the benchmark reports the time per hand-off for
+ *
+ *  - wait() on a single event (the futex path),
+ *  - wait() with the eventfd attached, as once getPollFd() was called,
+ *  - waitAny() on the stop event and the work event, the way the worker of
+ *    GLIFRThreadedHwEnc waits for the next transfer,
+ *  - a mutex and condition variable, the old implementation, for reference,
+ *
+ * and the time from signalling a stop event to a thread blocked in
+ * waitAny() returning. It fails if waitAny() reports the wrong event.
+ *
+ * \copyright
+ * Copyright 2013-2014 NVIDIA Corporation.  All rights reserved.
+ *
+ * NOTICE TO LICENSEE:
+ *
+ * This source code and/or documentation ("Licensed Deliverables") are
+ * subject to the applicable NVIDIA license agreement that governs the
+ * use of the Licensed Deliverables.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "Event.h"
+
+typedef std::chrono::steady_clock Clock;
+
+//! The condition variable event Event replaced
+class CondEvent
+{
+private:
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+    bool m_signalled;
+
+public:
+    CondEvent() : m_signalled(false)
+    {
+        pthread_mutex_init(&m_mutex, NULL);
+        pthread_cond_init(&m_cond, NULL);
+    }
+    ~CondEvent()
+    {
+        pthread_cond_destroy(&m_cond);
+        pthread_mutex_destroy(&m_mutex);
+    }
+    void wait()
+    {
+        pthread_mutex_lock(&m_mutex);
+        while (!m_signalled)
+            pthread_cond_wait(&m_cond, &m_mutex);
+        m_signalled = false;
+        pthread_mutex_unlock(&m_mutex);
+    }
+    void signal()
+    {
+        pthread_mutex_lock(&m_mutex);
+        m_signalled = true;
+        pthread_cond_signal(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+    }
+};
+
+static double nsPerHandoff(Clock::time_point start, int count)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (2.0 * count);
+}
+
+template <typename E>
+static double pingPong(E &ping, E &pong, int count)
+{
+    Clock::time_point start = Clock::now();
+    std::thread peer([&]() {
+        for (int i = 0; i < count; i++)
+        {
+            ping.wait();
+            pong.signal();
+        }
+    });
+    for (int i = 0; i < count; i++)
+    {
+        ping.signal();
+        pong.wait();
+    }
+    peer.join();
+    return nsPerHandoff(start, count);
+}
+
+//! Like pingPong(), but the peer waits with waitAny() on stop and ping
+static bool pingPongAny(Event &ping, Event &pong, Event &stop, int count, double &ns)
+{
+    bool ok = true;
+    Clock::time_point start = Clock::now();
+    std::thread peer([&]() {
+        Event *events[] = { &stop, &ping };
+        for (int i = 0; i < count; i++)
+        {
+            if (Event::waitAny(events, 2, Event::INFINITE_TIMEOUT) != 1)
+                ok = false;
+            pong.signal();
+        }
+    });
+    for (int i = 0; i < count; i++)
+    {
+        ping.signal();
+        pong.wait();
+    }
+    peer.join();
+    ns = nsPerHandoff(start, count);
+    return ok;
+}
+
+//! Median time from stop.signal() to waitAny() returning 0 in a blocked thread
+static bool stopLatency(int count, double &ns)
+{
+    std::vector<double> samples;
+    for (int i = 0; i < count; i++)
+    {
+        Event work, stop;
+        work.init();
+        stop.init(true);
+        Event *events[] = { &stop, &work };
+        int index = -1;
+        Clock::time_point woken;
+        std::thread worker([&]() {
+            index = Event::waitAny(events, 2, Event::INFINITE_TIMEOUT);
+            woken = Clock::now();
+        });
+        // give the worker time to block in poll()
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        Clock::time_point signalled = Clock::now();
+        stop.signal();
+        worker.join();
+        if (index != 0)
+            return false;
+        samples.push_back(std::chrono::duration<double, std::nano>(woken - signalled).count());
+    }
+    std::sort(samples.begin(), samples.end());
+    ns = samples[samples.size() / 2];
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const int count = 100000;
+
+    Event ping, pong;
+    ping.init();
+    pong.init();
+    printf("%-28s %8.0f ns\n", "wait()", pingPong(ping, pong, count));
+
+    Event pingFd, pongFd;
+    pingFd.init();
+    pongFd.init();
+    pingFd.getPollFd();
+    pongFd.getPollFd();
+    printf("%-28s %8.0f ns\n", "wait() with eventfd", pingPong(pingFd, pongFd, count));
+
+    Event pingAny, pongAny, stop;
+    pingAny.init();
+    pongAny.init();
+    stop.init(true);
+    double ns;
+    if (!pingPongAny(pingAny, pongAny, stop, count, ns))
+    {
+        printf("FAIL: waitAny() returned the wrong event\n");
+        return 1;
+    }
+    printf("%-28s %8.0f ns\n", "waitAny(stop, work)", ns);
+
+    CondEvent pingCond, pongCond;
+    printf("%-28s %8.0f ns\n", "condition variable", pingPong(pingCond, pongCond, count));
+
+    if (!stopLatency(200, ns))
+    {
+        printf("FAIL: waitAny() did not return the stop event\n");
+        return 1;
+    }
+    printf("%-28s %8.0f ns (median)\n", "stop to waitAny() return", ns);
+    return 0;
+}
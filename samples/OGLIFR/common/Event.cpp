@@ -14,6 +14,41 @@
 
 #include "Event.h"
 
+#ifndef _WIN32
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+/*!
+ * Milliseconds elapsed on the monotonic clock.
+ */
+static unsigned long long monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*!
+ * Time left until deadline, or INFINITE_TIMEOUT if there is no deadline.
+ */
+static unsigned int remainingMs(unsigned long long deadline)
+{
+    if (deadline == 0)
+    {
+        return Event::INFINITE_TIMEOUT;
+    }
+    unsigned long long now = monotonicMs();
+    return now >= deadline ? 0 : (unsigned int)(deadline - now);
+}
+#endif
+
 /*!
  * Constructor.
  */
@@ -22,9 +57,9 @@ Event::Event()
 #ifdef _WIN32
     m_eventHandle = 0;
 #else
-    pthread_cond_init(&m_cond, NULL);
-    pthread_mutex_init(&m_mutex, NULL);
-    m_value = false;
+    m_state = 0;
+    m_fd = -1;
+    m_manualReset = false;
 #endif
 }
 
@@ -38,25 +73,26 @@ Event::~Event()
 /*!
  * Init.
  *
+ * \param [in] manualReset
+ *   If true the event stays signalled until reset(), otherwise a successful
+ *   wait resets it.
+ * \param [in] initialState
+ *   Initial signalled state.
+ *
  * \return false if failed
  */
-bool Event::init()
+bool Event::init(bool manualReset, bool initialState)
 {
 #ifdef _WIN32
-    m_eventHandle = CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_eventHandle = CreateEvent(NULL, manualReset ? TRUE : FALSE, initialState ? TRUE : FALSE, NULL);
     if(!m_eventHandle)
     {
         return false;
     }
 #else
-    if (pthread_cond_init(&m_cond, NULL) != 0)
-    {
-        return false;
-    }
-    if (pthread_mutex_init(&m_mutex, NULL) != 0)
-    {
-        return false;
-    }
+    m_manualReset = manualReset;
+    m_state = initialState ? 1 : 0;
+    m_fd = -1;
 #endif
 
     return true;
@@ -74,8 +110,11 @@ void Event::cleanup()
         m_eventHandle = 0;
     }
 #else
-    pthread_cond_destroy(&m_cond);
-    pthread_mutex_destroy(&m_mutex);
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
 #endif
 }
 
@@ -83,17 +122,55 @@ void Event::cleanup()
  * Wait for an event to be signalled.
  */
 void Event::wait()
+{
+    wait(INFINITE_TIMEOUT);
+}
+
+/*!
+ * Wait for an event to be signalled, at most timeoutMs milliseconds.
+ *
+ * \return false on timeout
+ */
+bool Event::wait(unsigned int timeoutMs)
 {
 #ifdef _WIN32
-    WaitForSingleObject(m_eventHandle, INFINITE);
+    return WaitForSingleObject(m_eventHandle, timeoutMs) == WAIT_OBJECT_0;
 #else
-    pthread_mutex_lock(&m_mutex);
-    while (m_value == false)
+    unsigned long long deadline = timeoutMs == INFINITE_TIMEOUT ? 0 : monotonicMs() + timeoutMs;
+    for (;;)
     {
-        pthread_cond_wait(&m_cond, &m_mutex);
+        if (tryConsume())
+        {
+            return true;
+        }
+        unsigned int left = remainingMs(deadline);
+        if (left == 0)
+        {
+            return false;
+        }
+        struct timespec ts, *pts = NULL;
+        if (left != INFINITE_TIMEOUT)
+        {
+            ts.tv_sec = left / 1000;
+            ts.tv_nsec = (long)(left % 1000) * 1000000;
+            pts = &ts;
+        }
+        syscall(SYS_futex, &m_state, FUTEX_WAIT_PRIVATE, 0, pts, NULL, 0);
     }
-    m_value = false;
-    pthread_mutex_unlock(&m_mutex);
+#endif
+}
+
+/*!
+ * Poll the event without blocking; consumes the signal of an auto reset event.
+ *
+ * \return true if the event was signalled
+ */
+bool Event::tryWait()
+{
+#ifdef _WIN32
+    return WaitForSingleObject(m_eventHandle, 0) == WAIT_OBJECT_0;
+#else
+    return tryConsume();
 #endif
 }
 
@@ -105,9 +182,164 @@ void Event::signal()
 #ifdef _WIN32
     SetEvent(m_eventHandle);
 #else
-    pthread_mutex_lock(&m_mutex);
-    m_value = true;
-    pthread_cond_broadcast(&m_cond);
-    pthread_mutex_unlock(&m_mutex);
+    __atomic_store_n(&m_state, 1, __ATOMIC_SEQ_CST);
+    // Auto reset events release one waiter, like SetEvent()
+    syscall(SYS_futex, &m_state, FUTEX_WAKE_PRIVATE, m_manualReset ? INT_MAX : 1, NULL, NULL, 0);
+    int fd = __atomic_load_n(&m_fd, __ATOMIC_SEQ_CST);
+    if (fd >= 0)
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(fd, &one, sizeof(one));
+        (void)ret;
+    }
+#endif
+}
+
+/*!
+ * Reset an event to the non-signalled state.
+ */
+void Event::reset()
+{
+#ifdef _WIN32
+    ResetEvent(m_eventHandle);
+#else
+    drainFd();
+    __atomic_store_n(&m_state, 0, __ATOMIC_SEQ_CST);
 #endif
 }
+
+/*!
+ * Wait until any of the events is signalled.
+ *
+ * \param [in] events
+ *   Array of events to wait on, at most MAX_WAIT_EVENTS.
+ * \param [in] count
+ *   Number of events.
+ * \param [in] timeoutMs
+ *   Timeout in milliseconds, or INFINITE_TIMEOUT.
+ *
+ * \return index of the lowest signalled event, or -1 on timeout or error.
+ */
+int Event::waitAny(Event **events, unsigned int count, unsigned int timeoutMs)
+{
+    if (count == 0 || count > MAX_WAIT_EVENTS)
+    {
+        return -1;
+    }
+
+#ifdef _WIN32
+    HANDLE handles[MAX_WAIT_EVENTS];
+    for (unsigned int i = 0; i < count; i++)
+    {
+        handles[i] = events[i]->m_eventHandle;
+    }
+    DWORD ret = WaitForMultipleObjects(count, handles, FALSE, timeoutMs);
+    if (ret >= WAIT_OBJECT_0 && ret < WAIT_OBJECT_0 + count)
+    {
+        return (int)(ret - WAIT_OBJECT_0);
+    }
+    return -1;
+#else
+    struct pollfd fds[MAX_WAIT_EVENTS];
+    for (unsigned int i = 0; i < count; i++)
+    {
+        fds[i].fd = events[i]->getPollFd();
+        fds[i].events = POLLIN;
+        if (fds[i].fd < 0)
+        {
+            return -1;
+        }
+    }
+
+    unsigned long long deadline = timeoutMs == INFINITE_TIMEOUT ? 0 : monotonicMs() + timeoutMs;
+    for (;;)
+    {
+        // The fds were attached before this check, so a later signal makes them readable
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if (events[i]->tryConsume())
+            {
+                return (int)i;
+            }
+        }
+        unsigned int left = remainingMs(deadline);
+        if (left == 0)
+        {
+            return -1;
+        }
+        for (unsigned int i = 0; i < count; i++)
+        {
+            fds[i].revents = 0;
+        }
+        if (poll(fds, count, left == INFINITE_TIMEOUT ? -1 : (int)left) < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+#endif
+}
+
+#ifndef _WIN32
+/*!
+ * File descriptor that polls readable while the event is signalled.
+ * Readiness may be spurious; confirm it with tryWait().
+ *
+ * \return the eventfd, or -1 if it could not be created
+ */
+int Event::getPollFd()
+{
+    int fd = __atomic_load_n(&m_fd, __ATOMIC_ACQUIRE);
+    if (fd >= 0)
+    {
+        return fd;
+    }
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int expected = -1;
+    if (!__atomic_compare_exchange_n(&m_fd, &expected, fd, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+        close(fd);
+        return expected;
+    }
+    // Mirror a signal that happened before the fd existed
+    if (__atomic_load_n(&m_state, __ATOMIC_SEQ_CST))
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(fd, &one, sizeof(one));
+        (void)ret;
+    }
+    return fd;
+}
+
+/*!
+ * Consume the signalled state if set.
+ */
+bool Event::tryConsume()
+{
+    if (m_manualReset)
+    {
+        return __atomic_load_n(&m_state, __ATOMIC_ACQUIRE) != 0;
+    }
+    // Drain first: a signal racing with us then leaves the fd readable, never the reverse
+    drainFd();
+    int expected = 1;
+    return __atomic_compare_exchange_n(&m_state, &expected, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/*!
+ * Clear the readability of the eventfd.
+ */
+void Event::drainFd()
+{
+    int fd = __atomic_load_n(&m_fd, __ATOMIC_ACQUIRE);
+    if (fd >= 0)
+    {
+        uint64_t value;
+        ssize_t ret = read(fd, &value, sizeof(value));
+        (void)ret;
+    }
+}
+#endif
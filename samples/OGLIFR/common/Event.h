@@ -20,33 +20,59 @@
 #define WIN32_LEAN_AND_MEAN
 #endif
 #include <windows.h>
-#else
-#include <pthread.h>
 #endif
 
 /*!
- * 
+ * Auto or manual reset event with the semantics of a Win32 event object.
+ *
+ * On Linux the signalled state is a futex word, so waiting on and signalling
+ * a single event never takes a lock. An eventfd is attached on demand (by
+ * getPollFd() or waitAny()) so that events can be waited on together with
+ * each other and with sockets through poll/epoll.
  */
 class Event
 {
+public:
+    //! Timeout value meaning wait forever
+    static const unsigned int INFINITE_TIMEOUT = 0xFFFFFFFF;
+    //! Maximum number of events accepted by waitAny()
+    static const unsigned int MAX_WAIT_EVENTS = 64;
+
 private:
 #ifdef _WIN32
     HANDLE m_eventHandle;
 #else
-    pthread_cond_t m_cond;
-    pthread_mutex_t m_mutex;
-    bool m_value;
+    volatile int m_state;   //!< 1 if signalled; the futex word
+    volatile int m_fd;      //!< eventfd mirroring m_state, -1 until needed
+    bool m_manualReset;
+
+    bool tryConsume();
+    void drainFd();
 #endif
 
 public:
     Event();
     ~Event();
 
-    bool init();
+    bool init(bool manualReset = false, bool initialState = false);
     void cleanup();
 
     void wait();
+    bool wait(unsigned int timeoutMs);
+    bool tryWait();
     void signal();
+    void reset();
+
+    static int waitAny(Event **events, unsigned int count, unsigned int timeoutMs);
+
+#ifdef _WIN32
+    HANDLE getHandle() const
+    {
+        return m_eventHandle;
+    }
+#else
+    int getPollFd();
+#endif
 };
 
 #endif // _EVENT_H_
@@ -0,0 +1,311 @@
+/*
+ * \copyright
+ * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
+ * NOTICE TO LICENSEE: This source code and/or documentation ("Licensed Deliverables")
+ * are subject to the applicable NVIDIA license agreement
+ * that governs the use of the Licensed Deliverables.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#define NAL_INDEX_SSE2 1
+#endif
+
+// Annex-B NAL unit indexer for H.264 and HEVC access units.
+//
+// The encoder output is parsed once per access unit. Every consumer (file
+// writers, pipes, packetizers, late-joining viewers) can then reuse the NAL
+// boundaries, the cached parameter sets and the key frame bookmarks instead
+// of parsing the bitstream again.
+
+enum NalCodec
+{
+    NAL_CODEC_H264,
+    NAL_CODEC_HEVC,
+};
+
+struct NalUnit
+{
+    uint32_t offset;        // Offset of the start code within the access unit
+    uint32_t size;          // Size including the start code
+    uint8_t  startCodeSize; // 3 or 4
+    uint8_t  type;          // nal_unit_type
+    bool     bSlice;        // Coded slice (VCL NAL)
+    bool     bFirstSlice;   // First slice of its picture
+};
+
+struct NalBookmark
+{
+    uint64_t accessUnit;    // Index of the access unit
+    uint64_t streamOffset;  // Byte offset of the access unit in the whole stream
+    bool     bIdr;          // IDR/IRAP (as opposed to a recovery point SEI)
+};
+
+inline int NalLowestBit(unsigned int mask)
+{
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (int)i;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Returns the first 00 00 01 in [p, pEnd), or pEnd if there is none, a byte at a time.
+inline const uint8_t *NalFindStartCodeScalar(const uint8_t *p, const uint8_t *pEnd)
+{
+    for (; pEnd - p >= 3; p++)
+    {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+        {
+            return p;
+        }
+    }
+    return pEnd;
+}
+
+// Returns the first 00 00 01 in [p, pEnd), or pEnd if there is none.
+// The SSE2 path tests 16 positions at a time for a pair of zero bytes, which
+// emulation prevention makes rare inside NAL payloads.
+inline const uint8_t *NalFindStartCode(const uint8_t *p, const uint8_t *pEnd)
+{
+#ifdef NAL_INDEX_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    while (pEnd - p >= 18)
+    {
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), zero));
+        // Bit i set: p[i] == 0 && p[i + 1] == 0
+        mask &= (mask >> 1) | (p[16] == 0 ? 0x8000 : 0);
+        while (mask)
+        {
+            int i = NalLowestBit(mask);
+            if (p[i + 2] == 1)
+            {
+                return p + i;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#endif
+    return NalFindStartCodeScalar(p, pEnd);
+}
+
+class NalIndex
+{
+public:
+    enum
+    {
+        MAX_BOOKMARKS = 16,
+    };
+
+    NalIndex(NalCodec eCodec = NAL_CODEC_H264) : m_eCodec(eCodec), m_nAccessUnit(0), m_qwStreamOffset(0),
+        m_bKeyFrame(false), m_bIdr(false), m_bReference(false), m_pData(NULL), m_cbData(0)
+    {
+    }
+
+    void SetCodec(NalCodec eCodec)
+    {
+        m_eCodec = eCodec;
+    }
+
+    // Indexes one access unit. pData must stay valid while the NAL units are accessed.
+    void Index(const uint8_t *pData, size_t cbData)
+    {
+        m_vNal.clear();
+        m_bKeyFrame = false;
+        m_bReference = false;
+        m_pData = pData;
+        m_cbData = cbData;
+
+        const uint8_t *pEnd = pData + cbData;
+        const uint8_t *p = NalFindStartCode(pData, pEnd);
+        while (p < pEnd)
+        {
+            NalUnit nal;
+            // A zero byte before 00 00 01 belongs to a 4-byte start code
+            bool bLong = p > pData && p[-1] == 0;
+            const uint8_t *pStart = bLong ? p - 1 : p;
+            const uint8_t *pPayload = p + 3;
+            const uint8_t *pNext = NalFindStartCode(pPayload, pEnd);
+            // Trailing zero bytes belong to the next start code, not to this NAL unit
+            const uint8_t *pStop = pNext;
+            if (pNext < pEnd && pStop[-1] == 0)
+            {
+                pStop--;
+            }
+            nal.offset = (uint32_t)(pStart - pData);
+            nal.size = (uint32_t)(pStop - pStart);
+            nal.startCodeSize = (uint8_t)(pPayload - pStart);
+            Classify(pPayload, pStop, nal);
+            m_vNal.push_back(nal);
+            p = pNext;
+        }
+
+        if (m_bKeyFrame)
+        {
+            NalBookmark bookmark = { m_nAccessUnit, m_qwStreamOffset, m_bIdr };
+            if (m_vBookmark.size() == MAX_BOOKMARKS)
+            {
+                m_vBookmark.erase(m_vBookmark.begin());
+            }
+            m_vBookmark.push_back(bookmark);
+        }
+        m_nAccessUnit++;
+        m_qwStreamOffset += cbData;
+    }
+
+    size_t GetCount() const
+    {
+        return m_vNal.size();
+    }
+    const NalUnit &GetNal(size_t i) const
+    {
+        return m_vNal[i];
+    }
+    const uint8_t *GetNalData(size_t i) const
+    {
+        return m_pData + m_vNal[i].offset;
+    }
+    // Number of slices of the picture in the last access unit
+    size_t GetSliceCount() const
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < m_vNal.size(); i++)
+        {
+            n += m_vNal[i].bSlice;
+        }
+        return n;
+    }
+
+    // Whether the last access unit is a random access point (IDR/IRAP or recovery point SEI)
+    bool IsKeyFrame() const
+    {
+        return m_bKeyFrame;
+    }
+    // Whether other pictures may reference the last access unit; a non-reference one can be dropped alone
+    bool IsReference() const
+    {
+        return m_bReference;
+    }
+    bool HasParameterSets() const
+    {
+        return !m_vSps.empty() && !m_vPps.empty() && (m_eCodec != NAL_CODEC_HEVC || !m_vVps.empty());
+    }
+    // Latest VPS/SPS/PPS as Annex-B, what a late-joining decoder needs ahead of the next key frame
+    std::vector<uint8_t> GetParameterSets() const
+    {
+        std::vector<uint8_t> v(m_vVps);
+        v.insert(v.end(), m_vSps.begin(), m_vSps.end());
+        v.insert(v.end(), m_vPps.begin(), m_vPps.end());
+        return v;
+    }
+    // Most recent random access points, oldest first
+    const std::vector<NalBookmark> &GetBookmarks() const
+    {
+        return m_vBookmark;
+    }
+    uint64_t GetAccessUnitCount() const
+    {
+        return m_nAccessUnit;
+    }
+    // Size of the last access unit
+    size_t GetAccessUnitSize() const
+    {
+        return m_cbData;
+    }
+
+private:
+    void Classify(const uint8_t *pPayload, const uint8_t *pStop, NalUnit &nal)
+    {
+        nal.type = 0;
+        nal.bSlice = false;
+        nal.bFirstSlice = false;
+        size_t cb = pStop - pPayload;
+        if (!cb)
+        {
+            return;
+        }
+        const uint8_t *pStart = pPayload - nal.startCodeSize;
+        if (m_eCodec == NAL_CODEC_H264)
+        {
+            nal.type = pPayload[0] & 0x1F;
+            nal.bSlice = nal.type >= 1 && nal.type <= 5;
+            // first_mb_in_slice is ue(v); a leading 1 bit codes 0
+            nal.bFirstSlice = nal.bSlice && cb > 1 && (pPayload[1] & 0x80);
+            // nal_ref_idc
+            m_bReference |= nal.bSlice && (pPayload[0] & 0x60);
+            switch (nal.type)
+            {
+            case 5: MarkKeyFrame(true); break;
+            case 6: if (cb > 1 && IsRecoveryPointSei(pPayload + 1, pStop)) MarkKeyFrame(false); break;
+            case 7: m_vSps.assign(pStart, pStop); break;
+            case 8: m_vPps.assign(pStart, pStop); break;
+            }
+        }
+        else
+        {
+            nal.type = (pPayload[0] >> 1) & 0x3F;
+            nal.bSlice = nal.type < 32;
+            // first_slice_segment_in_pic_flag follows the 2-byte header
+            nal.bFirstSlice = nal.bSlice && cb > 2 && (pPayload[2] & 0x80);
+            // The even types up to RSV_VCL_N14 are sub-layer non-reference pictures
+            m_bReference |= nal.bSlice && !(nal.type <= 14 && !(nal.type & 1));
+            if (nal.type >= 16 && nal.type <= 23)
+            {
+                MarkKeyFrame(true);
+            }
+            switch (nal.type)
+            {
+            case 32: m_vVps.assign(pStart, pStop); break;
+            case 33: m_vSps.assign(pStart, pStop); break;
+            case 34: m_vPps.assign(pStart, pStop); break;
+            case 39: if (cb > 2 && IsRecoveryPointSei(pPayload + 2, pStop)) MarkKeyFrame(false); break;
+            }
+        }
+    }
+
+    void MarkKeyFrame(bool bIdr)
+    {
+        if (!m_bKeyFrame || bIdr)
+        {
+            m_bIdr = bIdr;
+        }
+        m_bKeyFrame = true;
+    }
+
+    // Checks the payloadType of the first SEI message (6 is recovery_point)
+    static bool IsRecoveryPointSei(const uint8_t *p, const uint8_t *pStop)
+    {
+        unsigned int payloadType = 0;
+        while (p < pStop && *p == 0xFF)
+        {
+            payloadType += 255;
+            p++;
+        }
+        return p < pStop && payloadType + *p == 6;
+    }
+
+    NalCodec m_eCodec;
+    uint64_t m_nAccessUnit;
+    uint64_t m_qwStreamOffset;
+    bool m_bKeyFrame;
+    bool m_bIdr;
+    bool m_bReference;
+    const uint8_t *m_pData;
+    size_t m_cbData;
+    std::vector<NalUnit> m_vNal;
+    std::vector<uint8_t> m_vVps, m_vSps, m_vPps;
+    std::vector<NalBookmark> m_vBookmark;
+};